@@ -78,8 +78,12 @@
  * These files should be considered secret, and permissions should be set
  * accordingly.
  *
+ * The tests build the service with this set to their own directory.
+ *
  */
+#ifndef CONFIG_DIR
 #define CONFIG_DIR "/etc/pam-pico/"
+#endif
 /**
  * @brief The default format to use for a Rendezvous Channel URI
  *
@@ -91,6 +95,18 @@
  */
 #define URL_PREFIX "http://rendezvous.mypico.org/channel/"
 
+/**
+ * @brief The lowest fixed port the direct TCP channel may listen on
+ *
+ * Ports below this are reserved for system services.
+ */
+#define TCPPORT_MIN (1024)
+
+/**
+ * @brief The highest port the direct TCP channel may listen on
+ */
+#define TCPPORT_MAX (65535)
+
 // Structure definitions
 
 /**
@@ -111,13 +127,22 @@ typedef struct _AuthConfig {
 	bool beacons;
 	bool anyuser;
 	float timeout;
+	float resumegrace;
+	float heartbeatmin;
+	float heartbeatmax;
+	bool instantunlock;
+	bool sharelink;
 	Buffer * rvpurl;
+	Buffer * tcphost;
+	int tcpport;
 	Buffer * configdir;
+	Buffer * tracedir;
 } AuthConfig;
 
 // Function prototypes
 
 static void authconfig_postfix_char(Buffer * buffer, char character);
+static void authconfig_postfix_list(Buffer * buffer, char character);
 
 // Function definitions
 
@@ -136,10 +161,18 @@ AuthConfig * authconfig_new() {
 	authconfig->beacons = false;
 	authconfig->anyuser = false;
 	authconfig->timeout = 0.0;
+	authconfig->resumegrace = 0.0;
+	authconfig->heartbeatmin = 0.0;
+	authconfig->heartbeatmax = 0.0;
+	authconfig->instantunlock = false;
+	authconfig->sharelink = false;
 	authconfig->rvpurl = buffer_new(0);
 	buffer_append_string(authconfig->rvpurl, URL_PREFIX);
+	authconfig->tcphost = buffer_new(0);
+	authconfig->tcpport = 0;
 	authconfig->configdir = buffer_new(0);
 	buffer_append_string(authconfig->configdir, CONFIG_DIR);
+	authconfig->tracedir = buffer_new(0);
 
 	return authconfig;
 }
@@ -156,6 +189,21 @@ void authconfig_delete(AuthConfig * authconfig) {
 			authconfig->rvpurl = NULL;
 		}
 
+		if (authconfig->tcphost != NULL) {
+			buffer_delete(authconfig->tcphost);
+			authconfig->tcphost = NULL;
+		}
+
+		if (authconfig->configdir != NULL) {
+			buffer_delete(authconfig->configdir);
+			authconfig->configdir = NULL;
+		}
+
+		if (authconfig->tracedir != NULL) {
+			buffer_delete(authconfig->tracedir);
+			authconfig->tracedir = NULL;
+		}
+
 		FREE(authconfig);
 	}
 }
@@ -194,6 +242,41 @@ static void authconfig_postfix_char(Buffer * buffer, char character) {
 	}
 }
 
+/**
+ * Apply authconfig_postfix_char() to each entry in a list separated by
+ * commas or whitespace. The entries are rejoined separated by commas.
+ *
+ * @param buffer The buffer containing the list.
+ * @param character The character to check for and, if needed, append.
+ */
+static void authconfig_postfix_list(Buffer * buffer, char character) {
+	gchar ** entries;
+	Buffer * entry;
+	int count;
+	bool first;
+
+	entries = g_strsplit_set(buffer_get_buffer(buffer), ", \t\n", -1);
+	entry = buffer_new(0);
+	buffer_clear(buffer);
+	first = TRUE;
+
+	for (count = 0; entries[count] != NULL; count++) {
+		if (entries[count][0] != 0) {
+			buffer_clear(entry);
+			buffer_append_string(entry, entries[count]);
+			authconfig_postfix_char(entry, character);
+			if (first == FALSE) {
+				buffer_append_string(buffer, ",");
+			}
+			buffer_append_buffer(buffer, entry);
+			first = FALSE;
+		}
+	}
+
+	buffer_delete(entry);
+	g_strfreev(entries);
+}
+
 /**
  * Populate an AuthConfig data structure with values taken from the JSON string
  * provided. If no value is found in the JSON dictionary for a particular
@@ -235,6 +318,12 @@ bool authconfig_read_json(AuthConfig * authconfig, char const * json) {
 				if (strcmp(string, "btc") == 0) {
 					authconfig->channeltype = AUTHCHANNEL_BTC;
 				}
+				if (strcmp(string, "race") == 0) {
+					authconfig->channeltype = AUTHCHANNEL_RACE;
+				}
+				if (strcmp(string, "tcp") == 0) {
+					authconfig->channeltype = AUTHCHANNEL_TCP;
+				}
 			}
 
 			type = json_get_type(config, "beacons");
@@ -255,12 +344,60 @@ bool authconfig_read_json(AuthConfig * authconfig, char const * json) {
 				authconfig->timeout = decimal;
 			}
 
+			type = json_get_type(config, "resumegrace");
+			if (type == JSONTYPE_DECIMAL) {
+				decimal = json_get_decimal(config, "resumegrace");
+				authconfig->resumegrace = decimal;
+			}
+
+			type = json_get_type(config, "heartbeatmin");
+			if (type == JSONTYPE_DECIMAL) {
+				decimal = json_get_decimal(config, "heartbeatmin");
+				authconfig->heartbeatmin = decimal;
+			}
+
+			type = json_get_type(config, "heartbeatmax");
+			if (type == JSONTYPE_DECIMAL) {
+				decimal = json_get_decimal(config, "heartbeatmax");
+				authconfig->heartbeatmax = decimal;
+			}
+
+			type = json_get_type(config, "instantunlock");
+			if (type == JSONTYPE_INTEGER) {
+				integer = json_get_integer(config, "instantunlock");
+				authconfig->instantunlock = (integer != 0);
+			}
+
+			type = json_get_type(config, "sharelink");
+			if (type == JSONTYPE_INTEGER) {
+				integer = json_get_integer(config, "sharelink");
+				authconfig->sharelink = (integer != 0);
+			}
+
 			type = json_get_type(config, "rvpurl");
 			if (type == JSONTYPE_STRING) {
 				string = json_get_string(config, "rvpurl");
 				buffer_clear(authconfig->rvpurl);
 				buffer_append_string(authconfig->rvpurl, string);
-				authconfig_postfix_char(authconfig->rvpurl, '/');
+				authconfig_postfix_list(authconfig->rvpurl, '/');
+			}
+
+			type = json_get_type(config, "tcphost");
+			if (type == JSONTYPE_STRING) {
+				string = json_get_string(config, "tcphost");
+				buffer_clear(authconfig->tcphost);
+				buffer_append_string(authconfig->tcphost, string);
+			}
+
+			type = json_get_type(config, "tcpport");
+			if (type == JSONTYPE_INTEGER) {
+				integer = json_get_integer(config, "tcpport");
+				if ((integer == 0) || ((integer >= TCPPORT_MIN) && (integer <= TCPPORT_MAX))) {
+					authconfig->tcpport = integer;
+				}
+				else {
+					LOG(LOG_ERR, "Ignoring tcpport %d; must be 0 or between %d and %d\n", integer, TCPPORT_MIN, TCPPORT_MAX);
+				}
 			}
 
 			type = json_get_type(config, "configdir");
@@ -270,6 +407,16 @@ bool authconfig_read_json(AuthConfig * authconfig, char const * json) {
 				buffer_append_string(authconfig->configdir, string);
 				authconfig_postfix_char(authconfig->configdir, '/');
 			}
+
+			type = json_get_type(config, "tracedir");
+			if (type == JSONTYPE_STRING) {
+				string = json_get_string(config, "tracedir");
+				buffer_clear(authconfig->tracedir);
+				if (strlen(string) > 0) {
+					buffer_append_string(authconfig->tracedir, string);
+					authconfig_postfix_char(authconfig->tracedir, '/');
+				}
+			}
 		}
 		else {
 			LOG(LOG_ERR, "JSON error: %s\n", json);
@@ -466,6 +613,162 @@ float authconfig_get_timeout(AuthConfig const * authconfig) {
 	return authconfig->timeout;
 }
 
+/**
+ * Set the resumption grace period configuration option. If a continuous
+ * session drops, the Pico has this many seconds to resume it using the key
+ * already established before the user's session is locked. This should be
+ * set to 0 to lock straight away.
+ *
+ * The default value is 0.
+ *
+ * @param authconfig The object to set the value for.
+ * @param resumegrace The grace period in seconds.
+ *
+ */
+void authconfig_set_resumegrace(AuthConfig * authconfig, float resumegrace) {
+	authconfig->resumegrace = resumegrace;
+}
+
+/**
+ * Get the resumption grace period configuration option. If a continuous
+ * session drops, the Pico has this many seconds to resume it using the key
+ * already established before the user's session is locked. This will be
+ * set to 0 if the session should be locked straight away.
+ *
+ * The default value is 0.
+ *
+ * @param authconfig The object to get the value from.
+ * @return The value.
+ */
+float authconfig_get_resumegrace(AuthConfig const * authconfig) {
+	return authconfig->resumegrace;
+}
+
+/**
+ * Set the shortest heartbeat interval configuration option. During
+ * continuous authentication the Pico is asked to wait between this many
+ * seconds and the maximum before re-authenticating, depending on how
+ * healthy the link is. The interval drops back to this value whenever a
+ * heartbeat is late, so it bounds how long it takes to lock. This should be
+ * set to 0 to use the state machine's fixed interval.
+ *
+ * The default value is 0.
+ *
+ * @param authconfig The object to set the value for.
+ * @param heartbeatmin The shortest interval in seconds.
+ *
+ */
+void authconfig_set_heartbeatmin(AuthConfig * authconfig, float heartbeatmin) {
+	authconfig->heartbeatmin = heartbeatmin;
+}
+
+/**
+ * Get the shortest heartbeat interval configuration option. During
+ * continuous authentication the Pico is asked to wait between this many
+ * seconds and the maximum before re-authenticating, depending on how
+ * healthy the link is. A value of 0 means the state machine's fixed
+ * interval is used.
+ *
+ * The default value is 0.
+ *
+ * @param authconfig The object to get the value from.
+ * @return The value.
+ */
+float authconfig_get_heartbeatmin(AuthConfig const * authconfig) {
+	return authconfig->heartbeatmin;
+}
+
+/**
+ * Set the longest heartbeat interval configuration option. While the link
+ * is healthy, the interval between continuous authentication heartbeats
+ * grows up to this many seconds. If it's less than the minimum, the minimum
+ * is used throughout.
+ *
+ * The default value is 0.
+ *
+ * @param authconfig The object to set the value for.
+ * @param heartbeatmax The longest interval in seconds.
+ *
+ */
+void authconfig_set_heartbeatmax(AuthConfig * authconfig, float heartbeatmax) {
+	authconfig->heartbeatmax = heartbeatmax;
+}
+
+/**
+ * Get the longest heartbeat interval configuration option. While the link
+ * is healthy, the interval between continuous authentication heartbeats
+ * grows up to this many seconds.
+ *
+ * The default value is 0.
+ *
+ * @param authconfig The object to get the value from.
+ * @return The value.
+ */
+float authconfig_get_heartbeatmax(AuthConfig const * authconfig) {
+	return authconfig->heartbeatmax;
+}
+
+/**
+ * Set the instant unlock configuration option. This should be set to true
+ * if an authentication for a user who already has a continuous session with
+ * the same service should first try challenging the Pico in that session,
+ * rather than stopping it and waiting for a fresh authentication.
+ *
+ * The default value is false.
+ *
+ * @param authconfig The object to set the value for.
+ * @param instantunlock The value to set.
+ */
+void authconfig_set_instantunlock(AuthConfig * authconfig, bool instantunlock) {
+	authconfig->instantunlock = instantunlock;
+}
+
+/**
+ * Get the instant unlock configuration option. This will be set to true
+ * if an authentication for a user who already has a continuous session with
+ * the same service should first try challenging the Pico in that session,
+ * rather than stopping it and waiting for a fresh authentication.
+ *
+ * The default value is false.
+ *
+ * @param authconfig The object to get the value from.
+ * @return The value.
+ */
+bool authconfig_get_instantunlock(AuthConfig const * authconfig) {
+	return authconfig->instantunlock;
+}
+
+/**
+ * Set the share link configuration option. This should be set to true if a
+ * continuous authentication for a user who already has a continuous session
+ * with the same service should subscribe to that session's link to the
+ * Pico, rather than opening a channel of its own. All sessions sharing a
+ * link are locked together when the link is lost.
+ *
+ * The default value is false.
+ *
+ * @param authconfig The object to set the value for.
+ * @param sharelink The value to set.
+ */
+void authconfig_set_sharelink(AuthConfig * authconfig, bool sharelink) {
+	authconfig->sharelink = sharelink;
+}
+
+/**
+ * Get the share link configuration option. This will be set to true if a
+ * continuous authentication for a user who already has a continuous session
+ * with the same service should subscribe to that session's link to the
+ * Pico, rather than opening a channel of its own.
+ *
+ * The default value is false.
+ *
+ * @param authconfig The object to get the value from.
+ * @return The value.
+ */
+bool authconfig_get_sharelink(AuthConfig const * authconfig) {
+	return authconfig->sharelink;
+}
+
 /**
  * Set the Rendezvous Point URL configuration option. This should be set to
  * the full URL, including path, to use for the Rendezvous Point. The
@@ -477,6 +780,9 @@ float authconfig_get_timeout(AuthConfig const * authconfig) {
  *
  * https://rendezvous.mypico.org/channel/6f4a12cb5a6f3e8974efab5c20900535
  *
+ * Several URLs can be given, separated by commas, in which case the best
+ * performing of them is used for each session. See rvpendpoints_choose().
+ *
  * The default value is:
  *
  * http://rendezvous.mypico.org/channel/
@@ -501,6 +807,8 @@ void authconfig_set_rvpurl(AuthConfig * authconfig, char const * rvpurl) {
  *
  * https://rendezvous.mypico.org/channel/6f4a12cb5a6f3e8974efab5c20900535
  *
+ * This may be a list of URLs separated by commas.
+ *
  * The default value is:
  *
  * http://rendezvous.mypico.org/channel/
@@ -516,6 +824,68 @@ Buffer const * authconfig_get_rvpurl(AuthConfig const * authconfig) {
 	return authconfig->rvpurl;
 }
 
+/**
+ * Set the host to advertise for the direct TCP channel. This is the host
+ * name or IP address that a Pico on the local network should connect to.
+ * An empty string means the local address is detected when each session
+ * starts.
+ *
+ * The default value is an empty string.
+ *
+ * @param authconfig The object to set the value for.
+ * @param tcphost The host to advertise.
+ */
+void authconfig_set_tcphost(AuthConfig * authconfig, char const * tcphost) {
+	buffer_clear(authconfig->tcphost);
+	buffer_append_string(authconfig->tcphost, tcphost);
+}
+
+/**
+ * Get the host to advertise for the direct TCP channel. See
+ * authconfig_set_tcphost() for details.
+ *
+ * The returned buffer belongs to the AuthConfig instance; it should not be
+ * freed or directly changed, except using authconfig_set_tcphost();
+ *
+ * @param authconfig The object to get the value from.
+ * @return The host to advertise, or an empty string to detect it.
+ */
+Buffer const * authconfig_get_tcphost(AuthConfig const * authconfig) {
+	return authconfig->tcphost;
+}
+
+/**
+ * Set the port to listen on for the direct TCP channel. If this is zero, a
+ * free port is chosen for each session. A fixed port makes it easier to
+ * allow the channel through a firewall, but only one session can listen on
+ * it at a time, so a second session started while the first is still
+ * waiting for its Pico will fail.
+ *
+ * Ports below TCPPORT_MIN are reserved for system services and are
+ * rejected when read from JSON.
+ *
+ * The default value is 0.
+ *
+ * @param authconfig The object to set the value for.
+ * @param tcpport The port to listen on, or zero to choose one.
+ */
+void authconfig_set_tcpport(AuthConfig * authconfig, int tcpport) {
+	authconfig->tcpport = tcpport;
+}
+
+/**
+ * Get the port to listen on for the direct TCP channel. See
+ * authconfig_set_tcpport() for details.
+ *
+ * The default value is 0.
+ *
+ * @param authconfig The object to get the value from.
+ * @return The port to listen on, or zero to choose one.
+ */
+int authconfig_get_tcpport(AuthConfig const * authconfig) {
+	return authconfig->tcpport;
+}
+
 /**
  * Set the configuration directory option. This should be set to
  * the full path of the directory where the configuration files for this
@@ -577,5 +947,41 @@ Buffer const * authconfig_get_configdir(AuthConfig const * authconfig) {
 	return authconfig->configdir;
 }
 
+/**
+ * Set the trace directory option. If set, a trace of each authentication
+ * session will be recorded to a file in this directory, which can later be
+ * replayed using pico-replay-handshake. It should include a trailing
+ * forward slash.
+ *
+ * Traces contain the protocol frames exchanged, so the directory should only
+ * be readable by the user the service runs as.
+ *
+ * The default value is the empty string, meaning no traces are recorded.
+ *
+ * @param authconfig The object to set the value for.
+ * @param tracedir The directory to record traces into, or the empty string.
+ *
+ */
+void authconfig_set_tracedir(AuthConfig * authconfig, char const * tracedir) {
+	buffer_clear(authconfig->tracedir);
+	buffer_append_string(authconfig->tracedir, tracedir);
+}
+
+/**
+ * Get the trace directory option. If set, a trace of each authentication
+ * session will be recorded to a file in this directory. If no traces should
+ * be recorded, the buffer will be empty.
+ *
+ * The returned buffer belongs to the AuthConfig instance; it should not be
+ * freed or directly changed, except using authconfig_set_tracedir();
+ *
+ * @param authconfig The object to get the value from.
+ * @return The directory to record traces into.
+ *
+ */
+Buffer const * authconfig_get_tracedir(AuthConfig const * authconfig) {
+	return authconfig->tracedir;
+}
+
 /** @} addtogroup Service */
 
@@ -64,6 +64,8 @@
  *
  *  - AUTHCHANNEL_RVP: Rendevzous Point channel (HTTP/HTTPS)
  *  - AUTHCHANNEL_BT: Bluetooth
+ *  - AUTHCHANNEL_RACE: Both of the above, using whichever connects first
+ *  - AUTHCHANNEL_TCP: Direct TCP connection on the local network
  *
  */
 typedef enum _AUTHCHANNEL {
@@ -71,6 +73,8 @@ typedef enum _AUTHCHANNEL {
 	
 	AUTHCHANNEL_RVP,
 	AUTHCHANNEL_BTC,
+	AUTHCHANNEL_RACE,
+	AUTHCHANNEL_TCP,
 	
 	AUTHCHANNEL_NUM
 } AUTHCHANNEL;
@@ -102,12 +106,33 @@ bool authconfig_get_anyuser(AuthConfig const * authconfig);
 void authconfig_set_timeout(AuthConfig * authconfig, float timeout);
 float authconfig_get_timeout(AuthConfig const * authconfig);
 
+void authconfig_set_resumegrace(AuthConfig * authconfig, float resumegrace);
+float authconfig_get_resumegrace(AuthConfig const * authconfig);
+void authconfig_set_heartbeatmin(AuthConfig * authconfig, float heartbeatmin);
+float authconfig_get_heartbeatmin(AuthConfig const * authconfig);
+void authconfig_set_heartbeatmax(AuthConfig * authconfig, float heartbeatmax);
+float authconfig_get_heartbeatmax(AuthConfig const * authconfig);
+
+void authconfig_set_instantunlock(AuthConfig * authconfig, bool instantunlock);
+bool authconfig_get_instantunlock(AuthConfig const * authconfig);
+void authconfig_set_sharelink(AuthConfig * authconfig, bool sharelink);
+bool authconfig_get_sharelink(AuthConfig const * authconfig);
+
 void authconfig_set_rvpurl(AuthConfig * authconfig, char const * rvpurl);
 Buffer const * authconfig_get_rvpurl(AuthConfig const * authconfig);
 
+void authconfig_set_tcphost(AuthConfig * authconfig, char const * tcphost);
+Buffer const * authconfig_get_tcphost(AuthConfig const * authconfig);
+
+void authconfig_set_tcpport(AuthConfig * authconfig, int tcpport);
+int authconfig_get_tcpport(AuthConfig const * authconfig);
+
 void authconfig_set_configdir(AuthConfig * authconfig, char const * configdir);
 Buffer const * authconfig_get_configdir(AuthConfig const * authconfig);
 
+void authconfig_set_tracedir(AuthConfig * authconfig, char const * tracedir);
+Buffer const * authconfig_get_tracedir(AuthConfig const * authconfig);
+
 // Function definitions
 
 #endif
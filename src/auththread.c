@@ -58,6 +58,7 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <malloc.h>
 #include <syslog.h>
 #include "pico/pico.h"
@@ -68,13 +69,23 @@
 #include "pico/cryptosupport.h"
 
 #include "log.h"
+#include "timesource.h"
+#include "sessiontrace.h"
 #include "service.h"
 #include "servicebtc.h"
 #include "servicervp.h"
+#include "servicerace.h"
+#include "servicetcp.h"
+#include "usersjournal.h"
 #include "auththread.h"
 
 // Defines
 
+/**
+ * @brief The dbus interface the Progress signal is sent on
+ */
+#define AUTHTHREAD_PROGRESS_INTERFACE "uk.ac.cam.cl.pico.interface"
+
 // Structure definitions
 
 /**
@@ -106,6 +117,24 @@ struct _AuthThread {
 	Buffer * extraData;
 	GMainLoop * loop;
 	guint timeoutid;
+	SessionTrace * trace;
+	CryptoPool * cryptopool;
+	KeyCache * keycache;
+	UsersCache * userscache;
+	Locker * locker;
+	RvpEndpoints * rvpendpoints;
+	RvpWarmer * rvpwarmer;
+	bool instant;
+	AuthThreadPresence presence_callback;
+	void * presence_user_data;
+	AuthThread * link;
+	GSList * subscribers;
+	Buffer * parameters;
+	bool speculative;
+	GDBusConnection * connection;
+	Buffer * listener;
+	Buffer * objectpath;
+	guint releaseid;
 };
 
 // Function prototypes
@@ -115,6 +144,18 @@ static void authhtread_service_update(Service * service, int state, void * user_
 static void auththread_service_stopped(Service * service, void * user_data);
 static void auththread_complete_auth_reply(AuthThread * auththread, bool success);
 static gboolean auththread_timeout(gpointer user_data);
+static void auththread_start_trace(AuthThread * auththread);
+static void auththread_presence_result(Service * service, bool present, void * user_data);
+static void auththread_subscribe(AuthThread * auththread, AuthThread * link);
+static void auththread_unsubscribe(AuthThread * auththread);
+static void auththread_release_subscribers(AuthThread * auththread);
+static void auththread_lock(AuthThread * auththread);
+static void auththread_configure_service(AuthThread * auththread);
+static void auththread_load_keys(AuthThread * auththread);
+static USERFILE auththread_load_users(AuthThread * auththread);
+static void auththread_emit_progress(AuthThread * auththread, char const * stage);
+static void auththread_release_session(AuthThread * auththread);
+static gboolean auththread_release_idle(gpointer user_data);
 
 // Function definitions
 
@@ -143,12 +184,34 @@ AuthThread * auththread_new() {
 
 	auththread->shared = shared_new();
 	auththread->users = users_new();
-	auththread->filtered = users_new();
+	// The filtered users list is only needed if authenticating a specific user
+	auththread->filtered = NULL;
 
 	// The service is now set up when auththread_start_auth() is called to allow the correct channeltype to be selected
 	auththread->service = NULL;
 	auththread->extraData = buffer_new(0);
 	auththread->timeoutid = 0;
+	// The trace is only created if a trace directory is configured
+	auththread->trace = NULL;
+	// The pools belong to pico-continuous, if there are any
+	auththread->cryptopool = NULL;
+	auththread->keycache = NULL;
+	auththread->userscache = NULL;
+	auththread->locker = NULL;
+	auththread->rvpendpoints = NULL;
+	auththread->rvpwarmer = NULL;
+	auththread->instant = FALSE;
+	auththread->presence_callback = NULL;
+	auththread->presence_user_data = NULL;
+	auththread->link = NULL;
+	auththread->subscribers = NULL;
+	auththread->parameters = buffer_new(0);
+	auththread->speculative = FALSE;
+	// Progress is only signalled once a dbus caller is known
+	auththread->connection = NULL;
+	auththread->listener = buffer_new(0);
+	auththread->objectpath = buffer_new(0);
+	auththread->releaseid = 0;
 
 	return auththread;
 }
@@ -160,6 +223,10 @@ AuthThread * auththread_new() {
  */
 void auththread_delete(AuthThread * auththread) {
 	if (auththread) {
+		// Neither end of a shared link should be left pointing at this thread
+		auththread_unsubscribe(auththread);
+		auththread_release_subscribers(auththread);
+
 		if (auththread->authconfig) {
 			authconfig_delete(auththread->authconfig);
 			auththread->authconfig = NULL;
@@ -175,35 +242,96 @@ void auththread_delete(AuthThread * auththread) {
 			auththread->password = NULL;
 		}
 
-		if (auththread->shared) {
-			shared_delete(auththread->shared);
-			auththread->shared = NULL;
+		if (auththread->releaseid != 0) {
+			g_source_remove(auththread->releaseid);
+			auththread->releaseid = 0;
 		}
 
-		if (auththread->users) {
-			users_delete(auththread->users);
-			auththread->users = NULL;
+		auththread_release_session(auththread);
+
+		// The service records into the trace, so this must come after it's deleted
+		if (auththread->trace) {
+			sessiontrace_delete(auththread->trace);
+			auththread->trace = NULL;
 		}
 
-		if (auththread->filtered) {
-			users_delete(auththread->filtered);
-			auththread->filtered = NULL;
+		if (auththread->parameters) {
+			buffer_delete(auththread->parameters);
+			auththread->parameters = NULL;
 		}
 
-		if (auththread->service) {
-			service_delete(auththread->service);
-			auththread->service = NULL;
+		if (auththread->connection) {
+			g_object_unref(auththread->connection);
+			auththread->connection = NULL;
 		}
 
-		if (auththread->extraData) {
-			buffer_delete(auththread->extraData);
-			auththread->extraData = NULL;
+		if (auththread->listener) {
+			buffer_delete(auththread->listener);
+			auththread->listener = NULL;
+		}
+
+		if (auththread->objectpath) {
+			buffer_delete(auththread->objectpath);
+			auththread->objectpath = NULL;
 		}
 
 		FREE(auththread);
 	}
 }
 
+/**
+ * Free the state needed to run the session's own service: the service
+ * itself, the keys and the users. This is everything except what's needed
+ * to reply to the dbus caller and to identify the session.
+ *
+ * @param auththread The AuthThread to free the state of.
+ */
+static void auththread_release_session(AuthThread * auththread) {
+	// The service uses the keys and users, so must be deleted first
+	if (auththread->service) {
+		service_delete(auththread->service);
+		auththread->service = NULL;
+	}
+
+	if (auththread->shared) {
+		shared_delete(auththread->shared);
+		auththread->shared = NULL;
+	}
+
+	if (auththread->users) {
+		users_delete(auththread->users);
+		auththread->users = NULL;
+	}
+
+	if (auththread->filtered) {
+		users_delete(auththread->filtered);
+		auththread->filtered = NULL;
+	}
+
+	if (auththread->extraData) {
+		buffer_delete(auththread->extraData);
+		auththread->extraData = NULL;
+	}
+}
+
+/**
+ * Internal callback to free the state of a session that's subscribed to
+ * another session's link, once its own service has finished stopping. The
+ * service can't be deleted from inside its own stop callback, hence this
+ * is called from the main loop afterwards.
+ *
+ * @param user_data The AuthThread to free the state of, cast to (void *).
+ * @return FALSE, so that the callback is only called once.
+ */
+static gboolean auththread_release_idle(gpointer user_data) {
+	AuthThread * auththread = (AuthThread *)user_data;
+
+	auththread->releaseid = 0;
+	auththread_release_session(auththread);
+
+	return FALSE;
+}
+
 /**
  * Set the handle of this process. The handle is actually an index into the
  * array of ProcessItem structures stored by ProcessStore.
@@ -331,6 +459,17 @@ void auththread_set_result(AuthThread * auththread, bool result) {
 	auththread->result = result;
 }
 
+/**
+ * Get the parameters the session was configured with, as passed in to
+ * auththread_config(). The buffer isn't null terminated.
+ *
+ * @param auththread The object to access the data from.
+ * @return The parameters, which mustn't be freed or changed.
+ */
+Buffer const * auththread_get_parameters(AuthThread const * auththread) {
+	return auththread->parameters;
+}
+
 /**
  * Get the result of the authentication process. True if the authntication was
  * successful, false o/w.
@@ -378,6 +517,74 @@ void auththread_set_invocation(AuthThread * auththread, GDBusMethodInvocation *
 	auththread->invocation = invocation;
 }
 
+/**
+ * Set the dbus client to send Progress signals to, taken from the sender of
+ * a dbus call. The signals are addressed to this client alone, rather than
+ * being broadcast, since they reveal when the user's Pico is in range.
+ *
+ * The most recent caller for the session replaces any previous one.
+ *
+ * @param auththread The AuthThread object to set the client for.
+ * @param invocation The invocation of the call, as provided by GDbus.
+ */
+void auththread_set_listener(AuthThread * auththread, GDBusMethodInvocation * invocation) {
+	GDBusConnection * connection;
+	char const * sender;
+
+	sender = g_dbus_method_invocation_get_sender(invocation);
+	connection = g_dbus_method_invocation_get_connection(invocation);
+
+	buffer_clear(auththread->listener);
+	buffer_clear(auththread->objectpath);
+	if ((sender != NULL) && (connection != NULL)) {
+		buffer_append_string(auththread->listener, sender);
+		buffer_append_string(auththread->objectpath, g_dbus_method_invocation_get_object_path(invocation));
+
+		g_object_ref(connection);
+		if (auththread->connection) {
+			g_object_unref(auththread->connection);
+		}
+		auththread->connection = connection;
+	}
+}
+
+/**
+ * Send a Progress signal to the dbus client waiting on the session, if
+ * there is one, so that it can update its interface or start any follow-on
+ * work without waiting for CompleteAuth to return. The signal carries the
+ * session's handle and the stage it's reached:
+ *
+ *  - "connected": a Pico has connected to the session.
+ *  - "verifying": the Pico has authenticated and its details are being
+ *    checked.
+ *  - "authenticated": the user authenticated successfully.
+ *  - "failed": the user failed to authenticate.
+ *  - "finished": the session, including any continuous authentication, has
+ *    ended.
+ *  - "error": the session ended due to an error.
+ *
+ * Where a stage also completes a waiting CompleteAuth call, the signal must
+ * be sent before the reply, so that the client sees the stage before the
+ * call returns and it moves on.
+ *
+ * @param auththread The AuthThread the progress is for.
+ * @param stage The stage the session has reached.
+ */
+static void auththread_emit_progress(AuthThread * auththread, char const * stage) {
+	GError * error;
+	gboolean result;
+
+	if ((auththread->connection != NULL) && (buffer_get_pos(auththread->listener) > 0)) {
+		LOG(LOG_DEBUG, "Progress %s for session %d", stage, auththread->handle);
+		error = NULL;
+		result = g_dbus_connection_emit_signal(auththread->connection, buffer_get_buffer(auththread->listener), buffer_get_buffer(auththread->objectpath), AUTHTHREAD_PROGRESS_INTERFACE, "Progress", g_variant_new("(is)", auththread->handle, stage), & error);
+		if (result == FALSE) {
+			LOG(LOG_ERR, "Failed to send progress signal: %s", error->message);
+			g_error_free(error);
+		}
+	}
+}
+
 /**
  * Get the invocation for the call from pam_pico via dbus. This can be used to 
  * the result of the authentication back to pam_pico.
@@ -414,12 +621,22 @@ void auththread_ownerlost(AuthThread * auththread) {
  *
  * The exception to this is the anyuser value, which can be changed by the
  * dbus caller, but *cannot* be set in the configuration file (as this would
- * be right dangerous).
+ * be right dangerous). Conversely the instantunlock and sharelink values can
+ * only be set in the configuration file, since they allow the password of an
+ * existing session to be handed out, as can the tracedir value, since traces
+ * are written with the service's privileges, and the tcphost and tcpport
+ * values, since they choose where the service listens and what it tells
+ * the Pico to connect to.
  *
  * @param auththread The AuthThread object to set the data for.
  */
 bool auththread_config(AuthThread * auththread, char const * parameters) {
 	bool anyuser_restore;
+	bool instantunlock_restore;
+	bool sharelink_restore;
+	Buffer * tracedir_restore;
+	Buffer * tcphost_restore;
+	int tcpport_restore;
 	bool result;
 	Buffer * filename;
 	Buffer const * configdir;
@@ -441,12 +658,31 @@ bool auththread_config(AuthThread * auththread, char const * parameters) {
 		LOG(LOG_ERR, "Config file failed to load or was badly formatted JSON\n");
 	}
 
-	// Overlay the config passed by dbus
+	// Overlay the config passed by dbus, except for the values that can only
+	// be set from file
 	if (result) {
 		LOG(LOG_INFO, "Config received from dbus and overlaid: ");
+		instantunlock_restore = authconfig_get_instantunlock(auththread->authconfig);
+		sharelink_restore = authconfig_get_sharelink(auththread->authconfig);
+		tracedir_restore = buffer_new(0);
+		buffer_append_buffer(tracedir_restore, authconfig_get_tracedir(auththread->authconfig));
+		tcphost_restore = buffer_new(0);
+		buffer_append_buffer(tcphost_restore, authconfig_get_tcphost(auththread->authconfig));
+		tcpport_restore = authconfig_get_tcpport(auththread->authconfig);
 		result = authconfig_read_json(auththread->authconfig, parameters);
+		authconfig_set_instantunlock(auththread->authconfig, instantunlock_restore);
+		authconfig_set_sharelink(auththread->authconfig, sharelink_restore);
+		authconfig_set_tracedir(auththread->authconfig, buffer_get_buffer(tracedir_restore));
+		authconfig_set_tcphost(auththread->authconfig, buffer_get_buffer(tcphost_restore));
+		authconfig_set_tcpport(auththread->authconfig, tcpport_restore);
+		buffer_delete(tracedir_restore);
+		buffer_delete(tcphost_restore);
 	}
 
+	// Kept so that later calls can check they're asking for the same session
+	buffer_clear(auththread->parameters);
+	buffer_append_string(auththread->parameters, parameters);
+
 	buffer_delete(filename);
 
 	return result;
@@ -471,39 +707,31 @@ bool auththread_config(AuthThread * auththread, char const * parameters) {
  *  6. Performs continuous authentication.
  *  7. If continuous authentication finishes, lock the user's screen.
  *
+ * If the session is speculative, there's no dbus caller to reply to. The
+ * code is kept, and the beacons held back, until a caller attaches using
+ * auththread_attach().
+ *
  * @param auththread The AuthThread object to use for the session.
+ * @return true if the session was set up successfully, false o/w.
  */
-void auththread_start_auth(AuthThread * auththread) {
+bool auththread_start_auth(AuthThread * auththread) {
 	PicoUkAcCamClPicoInterface * object;
 	GDBusMethodInvocation * invocation;
 	gboolean success;
 	int handle;
 	USERFILE usersresult;
 	char const * beacon;
-	bool beacons;
-	bool continuous;
 	float timeout;
-	Buffer const * configdir;
 	AUTHCHANNEL channeltype;
-	Buffer const * url;
-	char const * urlstring;
+	Buffer * urlprefix;
 	ServiceRvp * servicervp;
 	ServiceBtc * servicebtc;
-	Buffer * pubfilename;
-	Buffer * privfilename;
-	Buffer * usersfilename;
+	ServiceRace * servicerace;
+	ServiceTcp * servicetcp;
 
-	// Set up the configuration filenames
-	configdir = authconfig_get_configdir(auththread->authconfig);
-	pubfilename = buffer_new(0);
-	privfilename = buffer_new(0);
-	usersfilename = buffer_new(0);
-	buffer_append_buffer(pubfilename, configdir);
-	buffer_append_buffer(privfilename, configdir);
-	buffer_append_buffer(usersfilename, configdir);
-	buffer_append_string(pubfilename, PUB_FILE);
-	buffer_append_string(privfilename, PRIV_FILE);
-	buffer_append_string(usersfilename, USERS_FILE);
+	// Pick the best of the configured Rendezvous Points
+	urlprefix = buffer_new(0);
+	rvpendpoints_choose(auththread->rvpendpoints, buffer_get_buffer(authconfig_get_rvpurl(auththread->authconfig)), urlprefix);
 
 	// Set up the authentication thread
 
@@ -515,8 +743,6 @@ void auththread_start_auth(AuthThread * auththread) {
 	object = auththread->object;
 	invocation = auththread->invocation;
 
-	beacons = authconfig_get_beacons(auththread->authconfig);
-	continuous = authconfig_get_continuous(auththread->authconfig);
 	timeout = authconfig_get_timeout(auththread->authconfig);
 	channeltype = authconfig_get_channeltype(auththread->authconfig);
 
@@ -528,9 +754,26 @@ void auththread_start_auth(AuthThread * auththread) {
 	case AUTHCHANNEL_RVP:
 		servicervp = servicervp_new();
 		auththread->service = (Service *)servicervp;
-		url = authconfig_get_rvpurl(auththread->authconfig);
-		urlstring = buffer_get_buffer(url);
-		servicervp_set_urlprefix(servicervp, urlstring);
+		servicervp_set_urlprefix(servicervp, buffer_get_buffer(urlprefix));
+		servicervp_set_endpoints(servicervp, auththread->rvpendpoints);
+		if (auththread->rvpwarmer != NULL) {
+			servicervp_set_session(servicervp, rvpwarmer_get_session(auththread->rvpwarmer));
+		}
+		break;
+	case AUTHCHANNEL_RACE:
+		servicerace = servicerace_new();
+		auththread->service = (Service *)servicerace;
+		servicerace_set_urlprefix(servicerace, buffer_get_buffer(urlprefix));
+		servicerace_set_endpoints(servicerace, auththread->rvpendpoints);
+		if (auththread->rvpwarmer != NULL) {
+			servicerace_set_session(servicerace, rvpwarmer_get_session(auththread->rvpwarmer));
+		}
+		break;
+	case AUTHCHANNEL_TCP:
+		servicetcp = servicetcp_new();
+		auththread->service = (Service *)servicetcp;
+		servicetcp_set_host(servicetcp, buffer_get_buffer(authconfig_get_tcphost(auththread->authconfig)));
+		servicetcp_set_port(servicetcp, authconfig_get_tcpport(auththread->authconfig));
 		break;
 	default:
 		LOG(LOG_ERR, "No channel type selected");
@@ -539,41 +782,202 @@ void auththread_start_auth(AuthThread * auththread) {
 		break;
 	}
 
-	service_set_continuous(auththread->service, continuous);
-	service_set_beacons(auththread->service, beacons);
-	service_set_configdir(auththread->service, configdir);
+	// Keep the Rendezvous Points warm for the sessions that follow
+	if ((auththread->rvpwarmer != NULL) && ((channeltype == AUTHCHANNEL_RVP) || (channeltype == AUTHCHANNEL_RACE))) {
+		rvpwarmer_add(auththread->rvpwarmer, buffer_get_buffer(authconfig_get_rvpurl(auththread->authconfig)));
+	}
 
-	shared_load_or_generate_keys(auththread->shared, buffer_get_buffer(pubfilename), buffer_get_buffer(privfilename));
+	auththread_configure_service(auththread);
+	service_set_held_beacons(auththread->service, auththread->speculative);
+	auththread_start_trace(auththread);
+	auththread_load_keys(auththread);
 
-	// Load in the list of paired users from the confid directory
-	usersresult = users_load(auththread->users, buffer_get_buffer(usersfilename));
+	// Load in the list of paired users from the config directory
+	usersresult = auththread_load_users(auththread);
 	if (usersresult != USERFILE_SUCCESS) {
 		LOG(LOG_ERR, "Failed to load user file, error: %d", usersresult);
 	}
 
-	buffer_delete(pubfilename);
-	buffer_delete(privfilename);
-	buffer_delete(usersfilename);
-
-	service_set_loop(auththread->service, auththread->loop);
-	service_set_update_callback(auththread->service, authhtread_service_update, auththread);
-	service_set_stop_callback(auththread->service, auththread_service_stopped, auththread);
+	buffer_delete(urlprefix);
 
 	success = auththread_setup(auththread);
 
 	beacon = service_get_beacon(auththread->service);
 
 	// Return the result to the dbus caller
-	pico_uk_ac_cam_cl_pico_interface_complete_start_auth(object, invocation, handle, beacon, success);
+	if ((object != NULL) && (invocation != NULL)) {
+		auththread_set_listener(auththread, invocation);
+		pico_uk_ac_cam_cl_pico_interface_complete_start_auth(object, invocation, handle, beacon, success);
+	}
 
 	// The dbus caller is no longer being blocked, but is expected to call back
 	// soon to get the authentication result
 
-	// Set up a timer to stop the process after a period of time
-	if (timeout > 0.0) {
+	// Set up a timer to stop the process after a period of time; a
+	// speculative session waits for as long as it takes for a caller to attach
+	if ((timeout > 0.0) && (auththread->speculative == FALSE)) {
 		LOG(LOG_INFO, "Timeout set to %f seconds", timeout);
-		auththread->timeoutid = g_timeout_add((guint)(timeout * 1000), auththread_timeout, auththread);
+		auththread->timeoutid = timesource_timeout_add((guint)(timeout * 1000), auththread_timeout, auththread);
+	}
+
+	return success;
+}
+
+/**
+ * Check whether a session can be resumed by a dbus caller retrying an
+ * authentication, for example because the PAM stack called pam_pico again
+ * after the previous attempt was cut short. The session can be resumed if
+ * it's for the same user, the caller knows the code it's using, and it's
+ * still waiting for the Pico or has authenticated it successfully. If so, the
+ * caller can go on to call CompleteAuth with the same handle, and carry on
+ * showing the same code.
+ *
+ * The code acts as proof that the caller started the session, since the
+ * handle of a session that's ended may have been re-used.
+ *
+ * @param auththread The AuthThread to resume.
+ * @param username The user the caller is authenticating.
+ * @param code The code the caller was given when it started the session.
+ * @return true if the session can be resumed, false o/w.
+ */
+bool auththread_resume(AuthThread * auththread, char const * username, char const * code) {
+	bool result;
+
+	result = (auththread->service != NULL) && (auththread->speculative == FALSE);
+
+	if (result) {
+		result = (auththread->state == AUTHTHREADSTATE_STARTED) || ((auththread->state == AUTHTHREADSTATE_COMPLETED) && (auththread->result == TRUE));
+	}
+
+	if (result) {
+		result = auththread_check_code(auththread, code) && (strcmp(auththread_get_username(auththread), username) == 0);
+	}
+
+	if (result) {
+		LOG(LOG_INFO, "Resuming session %d", auththread->handle);
+		sessiontrace_record_string(auththread->trace, SESSIONTRACEEVENT_DBUS, "ResumeAuth");
+	}
+
+	return result;
+}
+
+/**
+ * Get the code the session is using, as handed to the dbus caller that
+ * started it to display to the user.
+ *
+ * @param auththread The AuthThread to get the code for.
+ * @return The code, or NULL if the session hasn't been started.
+ */
+char const * auththread_get_code(AuthThread const * auththread) {
+	char const * code;
+
+	code = NULL;
+	if (auththread->service != NULL) {
+		code = service_get_beacon(auththread->service);
+	}
+
+	return code;
+}
+
+/**
+ * Check whether a code is the one the session is using, and so was handed to
+ * the dbus caller that started it.
+ *
+ * @param auththread The AuthThread to check.
+ * @param code The code to check.
+ * @return true if the session has been started and is using the code, false
+ *         o/w.
+ */
+bool auththread_check_code(AuthThread const * auththread, char const * code) {
+	bool result;
+	char const * beacon;
+
+	result = false;
+	if (auththread->service != NULL) {
+		beacon = service_get_beacon(auththread->service);
+		result = (beacon != NULL) && (strcmp(beacon, code) == 0);
+	}
+
+	return result;
+}
+
+/**
+ * Set whether the session is speculative. A speculative session is started
+ * before anyone has asked to authenticate, for example when the user's
+ * screen locks, so that its code and channel are ready by the time the user
+ * comes back. Until a dbus caller attaches to it, it holds back its beacons,
+ * doesn't time out, and never locks the user's session when it ends. Should
+ * a Pico authenticate before then anyway, the result is thrown away rather
+ * than kept for whoever attaches.
+ *
+ * This must be set before auththread_start_auth() is called.
+ *
+ * @param auththread The AuthThread object to set the value for.
+ * @param speculative true if the session is speculative, false o/w.
+ */
+void auththread_set_speculative(AuthThread * auththread, bool speculative) {
+	auththread->speculative = speculative;
+}
+
+/**
+ * Get whether the session is speculative and still waiting for a dbus
+ * caller to attach to it.
+ *
+ * @param auththread The AuthThread object to get the value from.
+ * @return true if the session is speculative, false o/w.
+ */
+bool auththread_get_speculative(AuthThread const * auththread) {
+	return auththread->speculative;
+}
+
+/**
+ * Attach a StartAuth dbus call to a speculative session, in place of
+ * starting a new session. The caller is replied to straight away with the
+ * code the session is already using, and from then on the session behaves
+ * as if it had been started by the call, and the beacons are sent.
+ *
+ * The call can only attach if it uses the same parameters that the session
+ * was started with, and the session is still waiting for the Pico.
+ *
+ * @param auththread The speculative AuthThread to attach to.
+ * @param parameters The parameters passed in the StartAuth call.
+ * @param object The object data needed to reply to the dbus message.
+ * @param invocation The invocaion data needed to reply to the dbus message.
+ * @return true if the call was attached and replied to, false o/w.
+ */
+bool auththread_attach(AuthThread * auththread, char const * parameters, PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation) {
+	bool result;
+	float timeout;
+	size_t length;
+
+	result = (auththread->speculative == TRUE) && (auththread->service != NULL);
+
+	if (result) {
+		result = (auththread->state == AUTHTHREADSTATE_STARTED);
 	}
+
+	if (result) {
+		length = strlen(parameters);
+		result = (length == buffer_get_pos(auththread->parameters)) && (memcmp(buffer_get_buffer(auththread->parameters), parameters, length) == 0);
+	}
+
+	if (result) {
+		LOG(LOG_INFO, "Attaching to speculative session %d", auththread->handle);
+		sessiontrace_record_string(auththread->trace, SESSIONTRACEEVENT_DBUS, "StartAuth attached");
+		auththread->speculative = FALSE;
+		service_set_held_beacons(auththread->service, FALSE);
+
+		timeout = authconfig_get_timeout(auththread->authconfig);
+		if ((timeout > 0.0) && (auththread->state == AUTHTHREADSTATE_STARTED)) {
+			LOG(LOG_INFO, "Timeout set to %f seconds", timeout);
+			auththread->timeoutid = timesource_timeout_add((guint)(timeout * 1000), auththread_timeout, auththread);
+		}
+
+		auththread_set_listener(auththread, invocation);
+		pico_uk_ac_cam_cl_pico_interface_complete_start_auth(object, invocation, auththread->handle, service_get_beacon(auththread->service), TRUE);
+	}
+
+	return result;
 }
 
 /**
@@ -630,7 +1034,6 @@ static void authhtread_service_update(Service * service, int state, void * user_
 	Buffer const * extraData;
 	Buffer const * symmetricKey;
 	bool result;
-	char const * username;
 
 	switch (state) {
 		case FSMSERVICESTATE_START:
@@ -639,8 +1042,20 @@ static void authhtread_service_update(Service * service, int state, void * user_
 				g_source_remove(auththread->timeoutid);
 				auththread->timeoutid = 0;
 			}
+			auththread_emit_progress(auththread, "connected");
+			break;
+		case FSMSERVICESTATE_STATUS:
+			auththread_emit_progress(auththread, "verifying");
 			break;
 		case FSMSERVICESTATE_AUTHENTICATED:
+			if (auththread->speculative) {
+				// Nobody asked for this, so it mustn't be handed to whoever attaches
+				LOG(LOG_WARNING, "Discarding authentication reached before anyone attached");
+				auththread->result = FALSE;
+				auththread->state = AUTHTHREADSTATE_COMPLETED;
+				service_stop(service);
+				break;
+			}
 			auththread->result = TRUE;
 			auththread->state = AUTHTHREADSTATE_COMPLETED;
 			// The initial authentication is complete, so we need to get the result back
@@ -657,6 +1072,7 @@ static void authhtread_service_update(Service * service, int state, void * user_
 				LOG(LOG_ERR, "Failed to extract encrypted extra data sent by Pico");
 			}
 
+			auththread_emit_progress(auththread, "authenticated");
 			auththread_complete_auth_reply(auththread, auththread->result);
 			continuous = authconfig_get_continuous(auththread->authconfig);
 			if (continuous) {
@@ -677,17 +1093,18 @@ static void authhtread_service_update(Service * service, int state, void * user_
 			// If pam_pico has already sent us a dbus message, we should reply to it
 			// immediately; if not, we'll hold on to the result for a short while in case
 			// it does
+			auththread_emit_progress(auththread, "failed");
 			auththread_complete_auth_reply(auththread, auththread->result);
 			LOG(LOG_INFO, "Requesting service stop");
 			//service_stop(auththread->service);
 			break;
 		case FSMSERVICESTATE_FIN:
 		case FSMSERVICESTATE_ERROR:
+			auththread_emit_progress(auththread, (state == FSMSERVICESTATE_FIN) ? "finished" : "error");
 			auththread_complete_auth_reply(auththread, FALSE);
-			if (auththread->result == TRUE) {
+			if ((auththread->result == TRUE) && (auththread->instant == FALSE) && (auththread->speculative == FALSE)) {
 				// The user successfully authenticated and something went wrong, so we should lock
-				username = buffer_get_buffer(auththread->username);
-				lock(username);
+				auththread_lock(auththread);
 				LOG(LOG_INFO, "Locked");
 			}
 			break;
@@ -703,13 +1120,217 @@ static void authhtread_service_update(Service * service, int state, void * user_
  * @param auththread The AuthThread to stop.
  */
 void auththread_stop(AuthThread * auththread) {
-	if (auththread->state < AUTHTHREADSTATE_HARVESTABLE) {
+	if (auththread->state == AUTHTHREADSTATE_SUBSCRIBED) {
+		// The service has already stopped, so there's only the link to leave
+		auththread_unsubscribe(auththread);
+		auththread->state = AUTHTHREADSTATE_HARVESTABLE;
+	}
+	else if (auththread->state < AUTHTHREADSTATE_HARVESTABLE) {
 		if (auththread->service) {
 			service_stop(auththread->service);
 		}
 	}
 }
 
+/**
+ * Get whether this authentication should try to complete using an existing
+ * continuous session for the same user and service, if there is one.
+ *
+ * @param auththread The AuthThread to get the value for.
+ * @return true if an existing session should be challenged first, false o/w.
+ */
+bool auththread_get_instantunlock(AuthThread const * auththread) {
+	return authconfig_get_instantunlock(auththread->authconfig);
+}
+
+/**
+ * Get whether this authentication should subscribe to the link of an
+ * existing continuous session for the same user and service, if there is
+ * one, rather than keeping a channel of its own.
+ *
+ * @param auththread The AuthThread to get the value for.
+ * @return true if an existing link should be shared, false o/w.
+ */
+bool auththread_get_sharelink(AuthThread const * auththread) {
+	return authconfig_get_sharelink(auththread->authconfig);
+}
+
+/**
+ * Get whether this authentication will need Bluetooth, either to send
+ * beacons or to use the Bluetooth channel. Bluetooth must be initialised
+ * before the authentication is started if so.
+ *
+ * @param auththread The AuthThread to get the value for.
+ * @return true if Bluetooth is needed, false o/w.
+ */
+bool auththread_get_bluetooth(AuthThread const * auththread) {
+	AUTHCHANNEL channeltype;
+
+	channeltype = authconfig_get_channeltype(auththread->authconfig);
+
+	return (authconfig_get_beacons(auththread->authconfig) || (channeltype == AUTHCHANNEL_BTC) || (channeltype == AUTHCHANNEL_RACE));
+}
+
+/**
+ * Check that the Pico in this AuthThread's continuous session is present,
+ * by challenging it over the session's existing channel. The callback is
+ * called exactly once with the result, unless this returns false.
+ *
+ * @param auththread The continuing AuthThread whose Pico should be
+ *        challenged.
+ * @param timeout The time in milliseconds to wait for an answer.
+ * @param callback The function to call with the result.
+ * @param user_data The user data to pass to the callback.
+ * @return true if the challenge was sent, false o/w.
+ */
+bool auththread_request_presence(AuthThread * auththread, int timeout, AuthThreadPresence callback, void * user_data) {
+	bool result;
+
+	result = FALSE;
+	if ((auththread->state == AUTHTHREADSTATE_CONTINUING) && (auththread->service != NULL) && (auththread->presence_callback == NULL)) {
+		auththread->presence_callback = callback;
+		auththread->presence_user_data = user_data;
+		result = service_request_presence(auththread->service, timeout, auththread_presence_result, auththread);
+		if (result == FALSE) {
+			auththread->presence_callback = NULL;
+			auththread->presence_user_data = NULL;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Tell the continuous session whether its user is at their desktop session,
+ * so that the interval between the Pico's heartbeats can follow the user's
+ * activity. This has no effect unless the session is continuing.
+ *
+ * @param auththread The AuthThread to update.
+ * @param away true if the user's session is locked or idle, false if it's
+ *        active.
+ */
+void auththread_set_user_away(AuthThread * auththread, bool away) {
+	if ((auththread->state == AUTHTHREADSTATE_CONTINUING) && (auththread->service != NULL)) {
+		service_set_user_away(auththread->service, away);
+	}
+}
+
+/**
+ * Complete this authentication successfully without the Pico having to
+ * authenticate afresh, because the Pico in an existing continuous session
+ * for the same user and service has just proved it's present. The password
+ * is taken from the existing session, which carries on as before. This
+ * AuthThread's own service is then stopped.
+ *
+ * If this is a continuous authentication configured to share links, it
+ * subscribes to the existing session's link rather than finishing, so that
+ * it's locked along with the existing session when the link is lost.
+ *
+ * Nothing happens unless both sessions are for the same user, so that one
+ * user's password can never be handed to another user's session.
+ *
+ * @param auththread The newly started AuthThread to complete.
+ * @param existing The continuing AuthThread whose Pico answered.
+ */
+void auththread_complete_instant(AuthThread * auththread, AuthThread * existing) {
+	if (strcmp(auththread_get_username(auththread), auththread_get_username(existing)) != 0) {
+		LOG(LOG_WARNING, "Refusing to complete session %d using a session for a different user", auththread->handle);
+	}
+	else if (auththread->state == AUTHTHREADSTATE_STARTED) {
+		LOG(LOG_INFO, "Completing using existing continuous session");
+		buffer_clear(auththread->password);
+		buffer_append_buffer(auththread->password, existing->password);
+		auththread->result = TRUE;
+		auththread->instant = TRUE;
+		auththread->state = AUTHTHREADSTATE_COMPLETED;
+		if (auththread->timeoutid != 0) {
+			g_source_remove(auththread->timeoutid);
+			auththread->timeoutid = 0;
+		}
+		auththread_complete_auth_reply(auththread, TRUE);
+		if (authconfig_get_continuous(auththread->authconfig) && authconfig_get_sharelink(auththread->authconfig)) {
+			auththread_subscribe(auththread, existing);
+			// Stop the service directly, since the subscription is what's continuing
+			service_stop(auththread->service);
+		}
+		else {
+			auththread_stop(auththread);
+		}
+	}
+}
+
+/**
+ * Subscribe an AuthThread to another AuthThread's continuous link to the
+ * Pico. The subscriber has no channel of its own and finishes when the
+ * session owning the link finishes.
+ *
+ * @param auththread The AuthThread to subscribe.
+ * @param link The continuing AuthThread that owns the link.
+ */
+static void auththread_subscribe(AuthThread * auththread, AuthThread * link) {
+	LOG(LOG_INFO, "Sharing continuous link of session %d", link->handle);
+	auththread->link = link;
+	auththread->state = AUTHTHREADSTATE_SUBSCRIBED;
+	link->subscribers = g_slist_prepend(link->subscribers, auththread);
+}
+
+/**
+ * Remove an AuthThread from the link it's subscribed to, if any.
+ *
+ * @param auththread The AuthThread to unsubscribe.
+ */
+static void auththread_unsubscribe(AuthThread * auththread) {
+	if (auththread->link != NULL) {
+		auththread->link->subscribers = g_slist_remove(auththread->link->subscribers, auththread);
+		auththread->link = NULL;
+	}
+}
+
+/**
+ * Finish all of the sessions subscribed to this AuthThread's link, because
+ * the link has been lost. The user is locked by the owner of the link, and
+ * since locking applies to all of the user's sessions, the subscribers are
+ * locked together with it.
+ *
+ * @param auththread The AuthThread owning the link.
+ */
+static void auththread_release_subscribers(AuthThread * auththread) {
+	GSList * item;
+	AuthThread * subscriber;
+
+	for (item = auththread->subscribers; item != NULL; item = item->next) {
+		subscriber = (AuthThread *)item->data;
+		LOG(LOG_INFO, "Shared link lost for session %d", subscriber->handle);
+		subscriber->link = NULL;
+		subscriber->state = AUTHTHREADSTATE_HARVESTABLE;
+	}
+	g_slist_free(auththread->subscribers);
+	auththread->subscribers = NULL;
+}
+
+/**
+ * Internal callback with the result of a presence check, which is passed
+ * on to whoever requested it.
+ *
+ * @param service The Service that performed the check.
+ * @param present true if the Pico answered the challenge, false o/w.
+ * @param user_data The AuthThread the check was for, cast to (void *).
+ */
+static void auththread_presence_result(Service * service, bool present, void * user_data) {
+	AuthThread * auththread = (AuthThread *)user_data;
+	AuthThreadPresence callback;
+	void * callback_user_data;
+
+	callback = auththread->presence_callback;
+	callback_user_data = auththread->presence_user_data;
+	auththread->presence_callback = NULL;
+	auththread->presence_user_data = NULL;
+
+	if (callback != NULL) {
+		callback(auththread, present, callback_user_data);
+	}
+}
+
 /**
  * This callback is called when authentication, or continuous authentication,
  * finishes (either successfully or unsuccessfully). The state is managed by
@@ -723,13 +1344,13 @@ void auththread_stop(AuthThread * auththread) {
  */
 static void auththread_service_stopped(Service * service, void * user_data) {
 	AuthThread * auththread = (AuthThread *)user_data;
-	char const * username;
 	bool continuous;
 
 	continuous = authconfig_get_continuous(auththread->authconfig);
-	if (continuous) {
-		username = buffer_get_buffer(auththread->username);
-		lock(username);
+	// An instant unlock leaves the existing session to lock when it ends, and
+	// a speculative session was never asked for by the user
+	if (continuous && (auththread->instant == FALSE) && (auththread->speculative == FALSE)) {
+		auththread_lock(auththread);
 		LOG(LOG_INFO, "Locked (stopped)");
 	}
 	if (auththread->timeoutid != 0) {
@@ -739,7 +1360,15 @@ static void auththread_service_stopped(Service * service, void * user_data) {
 
 	auththread_complete_auth_reply(auththread, FALSE);
 
-	auththread->state = AUTHTHREADSTATE_HARVESTABLE;
+	// A subscriber's link is still up, so it carries on without the service,
+	// which along with the keys and users no longer needs to be kept
+	if (auththread->state != AUTHTHREADSTATE_SUBSCRIBED) {
+		auththread_release_subscribers(auththread);
+		auththread->state = AUTHTHREADSTATE_HARVESTABLE;
+	}
+	else if (auththread->releaseid == 0) {
+		auththread->releaseid = g_idle_add(auththread_release_idle, auththread);
+	}
 }
 
 /**
@@ -777,6 +1406,8 @@ static void auththread_complete_auth_reply(AuthThread * auththread, bool success
 		username = buffer_get_buffer(auththread->username);
 		password = buffer_get_buffer(auththread->password);
 		LOG(LOG_INFO, "Returning on wait with success %d\n", success);
+		// The password is deliberately not recorded
+		sessiontrace_record_string(auththread->trace, SESSIONTRACEEVENT_DBUS, success ? "CompleteAuth 1" : "CompleteAuth 0");
 		pico_uk_ac_cam_cl_pico_interface_complete_complete_auth(object, invocation, username, password, success);
 	}
 }
@@ -808,11 +1439,19 @@ static bool auththread_setup(AuthThread * auththread) {
 	}
 	else {
 		LOG(LOG_INFO, "Authenticating for user %s", username);
+		if (auththread->filtered == NULL) {
+			auththread->filtered = users_new();
+		}
 		filtered = auththread->filtered;
 		// Filter the list of users so we only have keys associated with this username
 		filteredNum = users_filter_by_name(auththread->users, username, filtered);
 		LOG(LOG_INFO, "Filtered to %d result(s) in users file", filteredNum);
 
+		// The full list is no longer needed, so there's no need to keep it
+		// in memory for the (potentially long) life of the session
+		users_delete(auththread->users);
+		auththread->users = users_new();
+
 		if (filteredNum == 0) {
 			// A users input of NULL would allow anyone to log in
 			// We don't want that, so ensure we bail in this case
@@ -840,6 +1479,101 @@ void auththread_set_loop(AuthThread * auththread, GMainLoop * loop) {
 	auththread->loop = loop;
 }
 
+/**
+ * Set the pool of worker threads for the service to process messages from
+ * the Pico on. If no pool is set, messages are processed on the main loop.
+ *
+ * @param auththread The object to set the value for.
+ * @param cryptopool The pool to use, which remains owned by the caller.
+ */
+void auththread_set_cryptopool(AuthThread * auththread, CryptoPool * cryptopool) {
+	auththread->cryptopool = cryptopool;
+}
+
+/**
+ * Set the cache to take the service identity key from. If no cache is set,
+ * the key is loaded from the configuration directory for each session.
+ *
+ * @param auththread The object to set the value for.
+ * @param keycache The cache to use, which remains owned by the caller.
+ */
+void auththread_set_keycache(AuthThread * auththread, KeyCache * keycache) {
+	auththread->keycache = keycache;
+}
+
+/**
+ * Set the cache to take the list of paired users from. If no cache is set,
+ * the users file and journal are read in full for each session.
+ *
+ * @param auththread The object to set the value for.
+ * @param userscache The cache to use, which remains owned by the caller.
+ */
+void auththread_set_userscache(AuthThread * auththread, UsersCache * userscache) {
+	auththread->userscache = userscache;
+}
+
+/**
+ * Set the Locker to lock the user's session with when continuous
+ * authentication ends. If no Locker is set, the lock command is run
+ * synchronously instead.
+ *
+ * @param auththread The object to set the value for.
+ * @param locker The Locker to use, which remains owned by the caller.
+ */
+void auththread_set_locker(AuthThread * auththread, Locker * locker) {
+	auththread->locker = locker;
+}
+
+/**
+ * Set the RvpEndpoints object used to choose between the Rendezvous Points
+ * listed in the configuration, and to report their performance to. If none
+ * is set, the first Rendezvous Point listed is always used.
+ *
+ * @param auththread The object to set the value for.
+ * @param rvpendpoints The object to use, which remains owned by the caller.
+ */
+void auththread_set_rvpendpoints(AuthThread * auththread, RvpEndpoints * rvpendpoints) {
+	auththread->rvpendpoints = rvpendpoints;
+}
+
+/**
+ * Set the RvpWarmer holding warm connections to the Rendezvous Points. The
+ * session's Rendezvous Point channel makes its requests using the
+ * RvpWarmer's SoupSession, and the Rendezvous Points configured for the
+ * session are kept warm for the sessions that follow. If none is set, the
+ * channel connects to the Rendezvous Point afresh.
+ *
+ * @param auththread The object to set the value for.
+ * @param rvpwarmer The object to use, which remains owned by the caller.
+ */
+void auththread_set_rvpwarmer(AuthThread * auththread, RvpWarmer * rvpwarmer) {
+	auththread->rvpwarmer = rvpwarmer;
+}
+
+/**
+ * Lock the user's session. The latency of the lock is measured from the
+ * last time the Pico was heard from, since that's the last time the user
+ * was known to be present.
+ *
+ * @param auththread The AuthThread whose user should be locked.
+ */
+static void auththread_lock(AuthThread * auththread) {
+	char const * username;
+	gint64 since;
+
+	username = buffer_get_buffer(auththread->username);
+	if (auththread->locker != NULL) {
+		since = 0;
+		if (auththread->service != NULL) {
+			since = service_get_last_heard(auththread->service);
+		}
+		locker_lock(auththread->locker, username, since);
+	}
+	else {
+		lock(username);
+	}
+}
+
 /**
  * Internal callback triggered when a timeout occurs. This indicates that
  * the process should stop.
@@ -854,6 +1588,7 @@ static gboolean auththread_timeout(gpointer user_data) {
 	auththread->timeoutid = 0;
 
 	LOG(LOG_DEBUG, "Configured time limit reached");
+	sessiontrace_record_string(auththread->trace, SESSIONTRACEEVENT_TIMER, "auth");
 	if (auththread->service) {
 		service_stop(auththread->service);
 	}
@@ -861,5 +1596,150 @@ static gboolean auththread_timeout(gpointer user_data) {
 	return FALSE;
 }
 
+/**
+ * If a trace directory has been configured, open a new trace file in it and
+ * set the service to record the session's events into it. Each session gets
+ * its own file, named using the handle and start time of the session.
+ *
+ * If no trace directory is configured, this does nothing.
+ *
+ * @param auththread The AuthThread to start recording a trace for.
+ */
+static void auththread_start_trace(AuthThread * auththread) {
+	Buffer const * tracedir;
+	Buffer * filename;
+	Buffer * leafname;
+	bool result;
+	char continuous;
+
+	tracedir = authconfig_get_tracedir(auththread->authconfig);
+	if ((buffer_get_pos(tracedir) > 0) && (auththread->trace == NULL)) {
+		leafname = buffer_new(0);
+		buffer_sprintf(leafname, "session-%d-%" G_GINT64_FORMAT ".trace", auththread->handle, g_get_real_time() / 1000);
+		filename = buffer_new(0);
+		buffer_append_buffer(filename, tracedir);
+		buffer_append_string(filename, buffer_get_buffer(leafname));
+		buffer_delete(leafname);
+
+		auththread->trace = sessiontrace_new();
+		result = sessiontrace_open_write(auththread->trace, buffer_get_buffer(filename));
+		if (result) {
+			LOG(LOG_INFO, "Recording session trace to %s", buffer_get_buffer(filename));
+			continuous = authconfig_get_continuous(auththread->authconfig) ? 1 : 0;
+			sessiontrace_record(auththread->trace, SESSIONTRACEEVENT_START, &continuous, 1);
+			sessiontrace_record_string(auththread->trace, SESSIONTRACEEVENT_DBUS, "StartAuth");
+			service_set_trace(auththread->service, auththread->trace);
+		}
+		else {
+			sessiontrace_delete(auththread->trace);
+			auththread->trace = NULL;
+		}
+
+		buffer_delete(filename);
+	}
+}
+
+/**
+ * Apply the configuration to the AuthThread's service and set up the
+ * callbacks the AuthThread needs from it.
+ *
+ * @param auththread The AuthThread whose service should be configured.
+ */
+static void auththread_configure_service(AuthThread * auththread) {
+	service_set_continuous(auththread->service, authconfig_get_continuous(auththread->authconfig));
+	service_set_beacons(auththread->service, authconfig_get_beacons(auththread->authconfig));
+	service_set_configdir(auththread->service, authconfig_get_configdir(auththread->authconfig));
+	service_set_cryptopool(auththread->service, auththread->cryptopool);
+	service_set_resume_grace(auththread->service, (int)(authconfig_get_resumegrace(auththread->authconfig) * 1000));
+	service_set_heartbeat(auththread->service, (int)(authconfig_get_heartbeatmin(auththread->authconfig) * 1000), (int)(authconfig_get_heartbeatmax(auththread->authconfig) * 1000));
+
+	service_set_loop(auththread->service, auththread->loop);
+	service_set_update_callback(auththread->service, authhtread_service_update, auththread);
+	service_set_stop_callback(auththread->service, auththread_service_stopped, auththread);
+}
+
+/**
+ * Give the Shared object the service's long-term identity key. If a
+ * KeyCache has been set the long-lived key is taken from it, otherwise the
+ * key is loaded from the configuration directory (or generated, if there
+ * isn't one yet). Either way the Shared object owns its key pair.
+ *
+ * @param auththread The AuthThread to load the keys for.
+ */
+static void auththread_load_keys(AuthThread * auththread) {
+	Buffer const * configdir;
+	KeyPair * identitykey;
+	Buffer * pubfilename;
+	Buffer * privfilename;
+
+	configdir = authconfig_get_configdir(auththread->authconfig);
+
+	identitykey = NULL;
+	if (auththread->keycache != NULL) {
+		identitykey = keycache_get(auththread->keycache, configdir);
+	}
+	if (identitykey != NULL) {
+		// Use the long-lived key rather than loading it afresh
+		shared_set_service_identity_key(auththread->shared, identitykey);
+	}
+	else {
+		pubfilename = buffer_new(0);
+		privfilename = buffer_new(0);
+		buffer_append_buffer(pubfilename, configdir);
+		buffer_append_buffer(privfilename, configdir);
+		buffer_append_string(pubfilename, PUB_FILE);
+		buffer_append_string(privfilename, PRIV_FILE);
+
+		shared_load_or_generate_keys(auththread->shared, buffer_get_buffer(pubfilename), buffer_get_buffer(privfilename));
+
+		buffer_delete(pubfilename);
+		buffer_delete(privfilename);
+	}
+}
+
+/**
+ * Load the list of users paired with the configuration directory. If a
+ * UsersCache has been set, only the entries for the user being
+ * authenticated are taken from it, otherwise the users file and journal
+ * are read in full.
+ *
+ * The Bluetooth devices in the cached journal are passed on to the service,
+ * so that devices paired since the last compaction are sent beacons.
+ *
+ * @param auththread The AuthThread to load the users for.
+ * @return The result of loading the users file.
+ */
+static USERFILE auththread_load_users(AuthThread * auththread) {
+	USERFILE result;
+	Buffer const * configdir;
+	char const * username;
+	UsersJournal * usersjournal;
+	GSList * devices;
+
+	configdir = authconfig_get_configdir(auththread->authconfig);
+
+	username = NULL;
+	if (authconfig_get_anyuser(auththread->authconfig) == FALSE) {
+		username = auththread_get_username(auththread);
+	}
+
+	if (auththread->userscache != NULL) {
+		result = userscache_get(auththread->userscache, configdir, username, auththread->users);
+
+		devices = NULL;
+		userscache_get_devices(auththread->userscache, configdir, & devices);
+		service_set_beacon_devices(auththread->service, devices);
+		g_slist_free_full(devices, g_free);
+	}
+	else {
+		usersjournal = usersjournal_new();
+		usersjournal_set_configdir(usersjournal, buffer_get_buffer(configdir));
+		result = usersjournal_load(usersjournal, auththread->users);
+		usersjournal_delete(usersjournal);
+	}
+
+	return result;
+}
+
 /** @} addtogroup Service */
 
@@ -64,6 +64,12 @@
 #include <picobt/devicelist.h>
 
 #include "authconfig.h"
+#include "cryptopool.h"
+#include "keycache.h"
+#include "userscache.h"
+#include "locker.h"
+#include "rvpendpoints.h"
+#include "rvpwarmer.h"
 #include "gdbus-generated.h"
 
 // Defines
@@ -75,6 +81,11 @@
  */
 typedef struct _AuthThread AuthThread;
 
+/**
+ * @brief Callback for the result of auththread_request_presence()
+ */
+typedef void (*AuthThreadPresence)(AuthThread * auththread, bool present, void * user_data);
+
 /**
  * @brief The states that each Auth Thread can take
  *
@@ -102,6 +113,16 @@ typedef struct _AuthThread AuthThread;
  * owner in this case, since it should already have lost interest (PAMs don't
  * handle continuous authentication).
  *
+ * A continuous session that completed using another session's link to the
+ * same Pico (see the sharelink configuration option) closes its own channel
+ * and moves into the AUTHTHREADSTATE_SUBSCRIBED state instead. It remains
+ * there until the session that owns the link finishes, at which point all of
+ * the subscribers finish with it. A subscriber frees its service, keys and
+ * users once subscribed, keeping only its configuration, username and
+ * password, so each extra session costs a small fixed amount of memory
+ * rather than a whole session's worth. The channel, heartbeats and keys
+ * are those of the single session owning the link.
+ *
  * The last thing a session does before finishing is to move itself into the
  * AUTHTHREADSTATE_HARVESTABLE state. In this state, the data associated with
  * the session will be released for re-use the next time the
@@ -115,6 +136,7 @@ typedef enum _AUTHTHREADSTATE {
 	AUTHTHREADSTATE_STARTED,
 	AUTHTHREADSTATE_COMPLETED,
 	AUTHTHREADSTATE_CONTINUING,
+	AUTHTHREADSTATE_SUBSCRIBED,
 	AUTHTHREADSTATE_HARVESTABLE,
 	
 	AUTHTHREADSTATE_NUM
@@ -135,16 +157,36 @@ void auththread_set_password(AuthThread * auththread, char const * password);
 char const * auththread_get_password(AuthThread * auththread);
 void auththread_set_result(AuthThread * auththread, bool result);
 bool auththread_get_result(AuthThread * auththread);
+Buffer const * auththread_get_parameters(AuthThread const * auththread);
 void auththread_set_object(AuthThread * auththread, PicoUkAcCamClPicoInterface * object);
 PicoUkAcCamClPicoInterface * auththread_get_object(AuthThread * auththread);
+void auththread_set_listener(AuthThread * auththread, GDBusMethodInvocation * invocation);
 void auththread_set_invocation(AuthThread * auththread, GDBusMethodInvocation * invocation);
 GDBusMethodInvocation * auththread_get_invocation(AuthThread * auththread);
-void auththread_start_auth(AuthThread * auththread);
+bool auththread_start_auth(AuthThread * auththread);
+bool auththread_resume(AuthThread * auththread, char const * username, char const * code);
+char const * auththread_get_code(AuthThread const * auththread);
+bool auththread_check_code(AuthThread const * auththread, char const * code);
+void auththread_set_speculative(AuthThread * auththread, bool speculative);
+bool auththread_get_speculative(AuthThread const * auththread);
+bool auththread_attach(AuthThread * auththread, char const * parameters, PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation);
 void auththread_ownerlost(AuthThread * auththread);
 void auththread_set_loop(AuthThread * auththread, GMainLoop * loop);
+void auththread_set_cryptopool(AuthThread * auththread, CryptoPool * cryptopool);
+void auththread_set_keycache(AuthThread * auththread, KeyCache * keycache);
+void auththread_set_userscache(AuthThread * auththread, UsersCache * userscache);
+void auththread_set_locker(AuthThread * auththread, Locker * locker);
+void auththread_set_rvpendpoints(AuthThread * auththread, RvpEndpoints * rvpendpoints);
+void auththread_set_rvpwarmer(AuthThread * auththread, RvpWarmer * rvpwarmer);
 bool auththread_config(AuthThread * auththread, char const * parameters);
 bool auththread_get_commitment(AuthThread const * auththread, Buffer * commitment);
 void auththread_stop(AuthThread * auththread);
+bool auththread_get_instantunlock(AuthThread const * auththread);
+bool auththread_get_sharelink(AuthThread const * auththread);
+bool auththread_get_bluetooth(AuthThread const * auththread);
+bool auththread_request_presence(AuthThread * auththread, int timeout, AuthThreadPresence callback, void * user_data);
+void auththread_set_user_away(AuthThread * auththread, bool away);
+void auththread_complete_instant(AuthThread * auththread, AuthThread * existing);
 
 // Function definitions
 
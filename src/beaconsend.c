@@ -73,6 +73,7 @@
 #include "pico/buffer.h"
 
 #include "log.h"
+#include "timesource.h"
 #include "beaconthread.h"
 #include "beaconsend.h"
 
@@ -140,6 +141,7 @@ struct _BeaconSend {
 	Buffer * code;
 	BeaconSendFinishCallback finish_callback;
 	void * user_data;
+	bool held;
 };
 
 // Function prototypes
@@ -168,6 +170,7 @@ BeaconSend * beaconsend_new() {
 	beaconsend->code = buffer_new(0);
 	beaconsend->finish_callback = NULL;
 	beaconsend->user_data = NULL;
+	beaconsend->held = FALSE;
 
 	return beaconsend;
 }
@@ -205,6 +208,19 @@ bool beaconsend_set_device(BeaconSend * beaconsend, char const * const device) {
 	return (result == 0);
 }
 
+/**
+ * Set whether to hold beacons back. While held, the timer keeps running but
+ * no beacons are sent. This can be changed while beacons are being sent,
+ * taking effect from the next timer event.
+ *
+ * @param beaconsend The object to hold the beacons for.
+ * @param held true to hold beacons back, false to send one on every timer
+ *        event.
+ */
+void beaconsend_set_held(BeaconSend * beaconsend, bool held) {
+	beaconsend->held = held;
+}
+
 /**
  * Deal with errors by outputting them to the log, then freeing 
  * and clearning the error structure.
@@ -248,9 +264,12 @@ static gboolean beaconsend_sdp_search(gpointer user_data) {
 	int sdp_socket;
 	uint32_t priority;
 	GIOChannel * iochannel;
+	bool due;
 
 	priority = 1;
-	if ((beaconsend->state == BEACONSENDSTATE_STARTING) || (beaconsend->state == BEACONSENDSTATE_READY)) {
+	due = (beaconsend->held == FALSE);
+
+	if (due && ((beaconsend->state == BEACONSENDSTATE_STARTING) || (beaconsend->state == BEACONSENDSTATE_READY))) {
 		beaconsend->state = BEACONSENDSTATE_SENDING;
 
 		// Connect to the SDP server
@@ -475,7 +494,7 @@ void beaconsend_start(BeaconSend * beaconsend) {
 	result = beaconsend_sdp_search(beaconsend);
 
 	if (result) {
-		g_timeout_add (BEACONSEND_GAP, beaconsend_sdp_search, beaconsend);
+		timesource_timeout_add(BEACONSEND_GAP, beaconsend_sdp_search, beaconsend);
 	}
 }
 
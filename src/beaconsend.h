@@ -81,6 +81,7 @@ void beaconsend_stop(BeaconSend * beaconsend);
 bool beaconsend_set_device(BeaconSend * beaconsend, char const * const device);
 void beaconsend_set_code(BeaconSend * beaconsend, char const * code);
 void beaconsend_set_finished_callback(BeaconSend * beaconsend, BeaconSendFinishCallback callback, void * user_data);
+void beaconsend_set_held(BeaconSend * beaconsend, bool held);
 
 // Function definitions
 
@@ -83,6 +83,9 @@
  * beacon (potentially sent to multiple devices and over a period of time).
  * The associated functions should be used to access and manipulate the data.
  *
+ * The devices list holds the addresses of devices to send to on top of
+ * those in the device file.
+ *
  * The lifecycle of this data is managed by AuthThread.
  *
  */
@@ -96,6 +99,8 @@ struct _BeaconThread {
 	BeaconThreadFinishCallback finish_callback;
 	void * user_data;
 	Buffer * configdir;
+	GSList * devices;
+	bool held;
 };
 
 typedef struct _BeaconPool BeaconPool;
@@ -103,6 +108,8 @@ typedef struct _BeaconPool BeaconPool;
 // Function prototypes
 
 static void beaconthread_finished(BeaconSend const * beaconsend, void * user_data);
+static bool beaconthread_has_device(BeaconThread * beaconthread, GSList const * extra, char const * device);
+static void beaconthread_start_device(BeaconThread * beaconthread, size_t count, char const * device);
 
 // Function definitions
 
@@ -125,6 +132,8 @@ BeaconThread * beaconthread_new() {
 	beaconthread->finish_callback = NULL;
 	beaconthread->user_data = NULL;
 	beaconthread->configdir = buffer_new(0);
+	beaconthread->devices = NULL;
+	beaconthread->held = FALSE;
 
 	return beaconthread;
 }
@@ -165,6 +174,9 @@ void beaconthread_delete(BeaconThread * beaconthread) {
 			buffer_delete(beaconthread->configdir);
 			beaconthread->configdir = NULL;
 		}
+
+		g_slist_free_full(beaconthread->devices, g_free);
+		beaconthread->devices = NULL;
 		
 		FREE(beaconthread);
 	}
@@ -223,6 +235,25 @@ void beaconthread_set_code(BeaconThread * beaconthread, char const * code) {
 	buffer_append_string(beaconthread->code, code);
 }
 
+/**
+ * Set whether to hold beacons back, for example while waiting for a user
+ * who hasn't yet asked to authenticate. This can be changed while beacons
+ * are being sent.
+ *
+ * @param beaconthread The object to hold the beacons for.
+ * @param held true to hold beacons back, false to send them.
+ */
+void beaconthread_set_held(BeaconThread * beaconthread, bool held) {
+	size_t count;
+
+	beaconthread->held = held;
+	for (count = 0; count < beaconthread->beaconsendcount; count++) {
+		if (beaconthread->beaconsend[count] != NULL) {
+			beaconsend_set_held(beaconthread->beaconsend[count], held);
+		}
+	}
+}
+
 /**
  * Set the directory to read configuration files from.
  *
@@ -234,6 +265,20 @@ void beaconthread_set_configdir(BeaconThread * beaconthread, Buffer const * conf
 	buffer_append_buffer(beaconthread->configdir, configdir);
 }
 
+/**
+ * Set extra devices to send beacons to, on top of those in the device file
+ * in the configuration directory. Addresses already in the device file are
+ * skipped when the session starts. The addresses are copied, so the list
+ * remains owned by the caller.
+ *
+ * @param beaconthread The object to set the value for.
+ * @param devices A list of Bluetooth addresses as strings, or NULL.
+ */
+void beaconthread_set_devices(BeaconThread * beaconthread, GSList const * devices) {
+	g_slist_free_full(beaconthread->devices, g_free);
+	beaconthread->devices = g_slist_copy_deep((GSList *)devices, (GCopyFunc)g_strdup, NULL);
+}
+
 /**
  * Start the beacon session. This will create multiple instances of BeaconSend
  * for each device that beacons are sent to.
@@ -248,10 +293,8 @@ void beaconthread_start(BeaconThread * beaconthread, Users const * users) {
 	Buffer * btlistfilename;
 	size_t devicenum;
 	size_t count;
-	char const * device;
-	bool result;
-	char const * code;
-	BeaconSend * beaconsend;
+	GSList * extra;
+	GSList const * address;
 
 	btlistfilename = buffer_new(0);
 	buffer_append_buffer(btlistfilename, beaconthread->configdir);
@@ -264,33 +307,89 @@ void beaconthread_start(BeaconThread * beaconthread, Users const * users) {
 
 	beaconthread_set_state(beaconthread, BEACONTHREADSTATE_STARTED);
 
+	// Devices that haven't been compacted into the device file yet
+	extra = NULL;
+	for (address = beaconthread->devices; address != NULL; address = address->next) {
+		if (beaconthread_has_device(beaconthread, extra, address->data) == FALSE) {
+			extra = g_slist_prepend(extra, address->data);
+		}
+	}
+
 	LOG(LOG_INFO, "Sending beacons\n");
 
-	beaconthread->beaconsend = CALLOC(sizeof(BeaconSend *), devicenum);
-	beaconthread->beaconsendcount = devicenum;
+	beaconthread->beaconsendcount = devicenum + g_slist_length(extra);
+	beaconthread->beaconsend = CALLOC(sizeof(BeaconSend *), beaconthread->beaconsendcount);
 
 	current = beacons_get_first(beaconthread->beacons);
 	count = 0;
 	while (current != NULL) {
-		beaconsend = beaconsend_new();
-		beaconthread->beaconsend[count] = beaconsend;
+		beaconthread_start_device(beaconthread, count, beacons_get_address(current));
+		count++;
+		current = beacons_get_next(current);
+	}
 
-		device = beacons_get_address(current);
-		result = beaconsend_set_device(beaconsend, device);
-		if (result == FALSE) {
-			LOG(LOG_ERR, "Failed to set device: %s\n", device);
-		}
+	for (address = extra; address != NULL; address = address->next) {
+		beaconthread_start_device(beaconthread, count, address->data);
+		count++;
+	}
 
-		code = buffer_get_buffer(beaconthread->code);
-		beaconsend_set_code(beaconsend, code);
+	g_slist_free(extra);
+}
 
-		beaconthread->running++;
-		beaconsend_set_finished_callback(beaconsend, beaconthread_finished, beaconthread);
-		beaconsend_start(beaconsend);
+/**
+ * Check whether beacons will already be sent to a device, either because
+ * it's in the device file or because it's already in the list of extra
+ * devices. Bluetooth addresses are compared ignoring case.
+ *
+ * @param beaconthread The object holding the devices loaded from file.
+ * @param extra The extra devices found so far.
+ * @param device The address of the device to check for.
+ * @return true if beacons will already be sent to the device, false o/w.
+ */
+static bool beaconthread_has_device(BeaconThread * beaconthread, GSList const * extra, char const * device) {
+	BeaconDevice * current;
+	bool found;
 
-		count++;
+	found = FALSE;
+	current = beacons_get_first(beaconthread->beacons);
+	while ((current != NULL) && (found == FALSE)) {
+		found = (g_ascii_strcasecmp(beacons_get_address(current), device) == 0);
 		current = beacons_get_next(current);
 	}
+
+	while ((extra != NULL) && (found == FALSE)) {
+		found = (g_ascii_strcasecmp(extra->data, device) == 0);
+		extra = extra->next;
+	}
+
+	return found;
+}
+
+/**
+ * Create and start the BeaconSend for a single device.
+ *
+ * @param beaconthread The session the device belongs to.
+ * @param count The index in the beaconsend array to store the BeaconSend at.
+ * @param device The Bluetooth address of the device to send beacons to.
+ */
+static void beaconthread_start_device(BeaconThread * beaconthread, size_t count, char const * device) {
+	BeaconSend * beaconsend;
+	bool result;
+
+	beaconsend = beaconsend_new();
+	beaconthread->beaconsend[count] = beaconsend;
+
+	result = beaconsend_set_device(beaconsend, device);
+	if (result == FALSE) {
+		LOG(LOG_ERR, "Failed to set device: %s\n", device);
+	}
+
+	beaconsend_set_code(beaconsend, buffer_get_buffer(beaconthread->code));
+	beaconsend_set_held(beaconsend, beaconthread->held);
+
+	beaconthread->running++;
+	beaconsend_set_finished_callback(beaconsend, beaconthread_finished, beaconthread);
+	beaconsend_start(beaconsend);
 }
 
 /**
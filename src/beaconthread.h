@@ -116,6 +116,8 @@ BEACONTHREADSTATE beaconthread_get_state(BeaconThread * beaconthread);
 void beaconthread_set_code(BeaconThread * beaconthread, char const * code);
 void beaconthread_set_finished_callback(BeaconThread * beaconthread, BeaconThreadFinishCallback callback, void * user_data);
 void beaconthread_set_configdir(BeaconThread * beaconthread, Buffer const * configdir);
+void beaconthread_set_devices(BeaconThread * beaconthread, GSList const * devices);
+void beaconthread_set_held(BeaconThread * beaconthread, bool held);
 
 void beaconthread_start(BeaconThread * beaconthread, Users const * users);
 void beaconthread_stop(BeaconThread * beaconthread);
@@ -0,0 +1,340 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Worker pool for offloading CPU-heavy work from the main loop
+ * @section DESCRIPTION
+ *
+ * Runs work functions on a bounded pool of worker threads and calls their
+ * completion functions back on the main context, passing the results back
+ * through a lock-free queue.
+ *
+ * See cryptopool.h for more details.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include "pico/debug.h"
+
+#include "log.h"
+#include "cryptopool.h"
+
+// Defines
+
+// Structure definitions
+
+typedef struct _CryptoPoolTask CryptoPoolTask;
+
+/**
+ * @brief A single item of work
+ *
+ * Once the work has been done the task is pushed onto the completion queue,
+ * which is an intrusive singly-linked list threaded through the next field.
+ */
+struct _CryptoPoolTask {
+	CryptoPoolTask * next;
+	CryptoPoolWork work;
+	CryptoPoolComplete complete;
+	void * user_data;
+};
+
+/**
+ * @brief The GSource used to dispatch completions on the main context
+ */
+typedef struct _CryptoPoolSource {
+	GSource source;
+	CryptoPool * cryptopool;
+} CryptoPoolSource;
+
+/**
+ * @brief Opaque structure used for managing the worker pool
+ *
+ * The completed field is the head of the completion queue. It's only ever
+ * accessed atomically: workers push tasks onto it, while the main context
+ * swaps the whole list out for NULL when dispatching.
+ *
+ * The lifecycle of this data is managed by pico-continuous.
+ *
+ */
+struct _CryptoPool {
+	GThreadPool * threads;
+	GMainContext * context;
+	GSource * source;
+	CryptoPoolTask * completed;
+	int threadnum;
+};
+
+// Function prototypes
+
+static void cryptopool_thread(gpointer data, gpointer user_data);
+static void cryptopool_post(CryptoPool * cryptopool, CryptoPoolTask * task);
+static void cryptopool_dispatch_completed(CryptoPool * cryptopool);
+static gboolean cryptopool_source_prepare(GSource * source, gint * timeout);
+static gboolean cryptopool_source_check(GSource * source);
+static gboolean cryptopool_source_dispatch(GSource * source, GSourceFunc callback, gpointer user_data);
+
+// Local variables
+
+/**
+ * @brief The functions for the completion queue's GSource
+ */
+static GSourceFuncs cryptopool_source_funcs = {
+	cryptopool_source_prepare,
+	cryptopool_source_check,
+	cryptopool_source_dispatch,
+	NULL
+};
+
+// Function definitions
+
+/**
+ * Create a new instance of the class. The worker threads are started
+ * immediately.
+ *
+ * @param context The main context to call completion functions on, or NULL
+ *        to use the global default main context.
+ * @return The newly created object.
+ */
+CryptoPool * cryptopool_new(GMainContext * context) {
+	CryptoPool * cryptopool;
+	GError * error;
+
+	cryptopool = CALLOC(sizeof(CryptoPool), 1);
+
+	cryptopool->threadnum = MIN(g_get_num_processors(), CRYPTOPOOL_MAX_THREADS);
+	cryptopool->completed = NULL;
+
+	error = NULL;
+	cryptopool->threads = g_thread_pool_new(cryptopool_thread, cryptopool, cryptopool->threadnum, FALSE, & error);
+	if (error != NULL) {
+		LOG(LOG_ERR, "Failed to create worker pool: %s", error->message);
+		g_error_free(error);
+	}
+
+	cryptopool->context = (context != NULL) ? g_main_context_ref(context) : g_main_context_ref(g_main_context_default());
+	cryptopool->source = g_source_new(& cryptopool_source_funcs, sizeof(CryptoPoolSource));
+	((CryptoPoolSource *)cryptopool->source)->cryptopool = cryptopool;
+	g_source_attach(cryptopool->source, cryptopool->context);
+
+	return cryptopool;
+}
+
+/**
+ * Delete an instance of the class, freeing up the memory allocated to it.
+ * Any work already submitted is completed first, and its completion
+ * functions called, so this should be called from the main context.
+ *
+ * @param cryptopool The object to free.
+ */
+void cryptopool_delete(CryptoPool * cryptopool) {
+	if (cryptopool) {
+		if (cryptopool->threads != NULL) {
+			// Wait for any queued and running work to finish
+			g_thread_pool_free(cryptopool->threads, FALSE, TRUE);
+			cryptopool->threads = NULL;
+		}
+
+		cryptopool_dispatch_completed(cryptopool);
+
+		g_source_destroy(cryptopool->source);
+		g_source_unref(cryptopool->source);
+		cryptopool->source = NULL;
+		g_main_context_unref(cryptopool->context);
+		cryptopool->context = NULL;
+
+		FREE(cryptopool);
+	}
+}
+
+/**
+ * Submit an item of work to the pool. The work function is called on one of
+ * the worker threads and then, once it has returned, the completion function
+ * is called on the main context. If the worker threads couldn't be created,
+ * the work is done immediately on the calling thread instead, although the
+ * completion function is still called from the main context.
+ *
+ * @param cryptopool The pool to submit the work to.
+ * @param work The function to call on the worker thread.
+ * @param complete The function to call on the main context afterwards, or
+ *        NULL if nothing needs to be done on completion.
+ * @param user_data The data to pass to both functions.
+ */
+void cryptopool_submit(CryptoPool * cryptopool, CryptoPoolWork work, CryptoPoolComplete complete, void * user_data) {
+	CryptoPoolTask * task;
+	GError * error;
+
+	task = CALLOC(sizeof(CryptoPoolTask), 1);
+	task->next = NULL;
+	task->work = work;
+	task->complete = complete;
+	task->user_data = user_data;
+
+	error = NULL;
+	if ((cryptopool->threads == NULL) || (g_thread_pool_push(cryptopool->threads, task, & error) == FALSE)) {
+		if (error != NULL) {
+			LOG(LOG_ERR, "Failed to submit work to worker pool: %s", error->message);
+			g_error_free(error);
+		}
+		cryptopool_thread(task, cryptopool);
+	}
+}
+
+/**
+ * Get the number of worker threads the pool is using.
+ *
+ * @param cryptopool The pool to get the value for.
+ * @return The maximum number of threads that will run work simultaneously.
+ */
+int cryptopool_get_threads(CryptoPool const * cryptopool) {
+	return cryptopool->threadnum;
+}
+
+/**
+ * Called on a worker thread to perform an item of work.
+ *
+ * @param data The task to perform.
+ * @param user_data The pool the task was submitted to.
+ */
+static void cryptopool_thread(gpointer data, gpointer user_data) {
+	CryptoPoolTask * task = (CryptoPoolTask *)data;
+	CryptoPool * cryptopool = (CryptoPool *)user_data;
+
+	if (task->work != NULL) {
+		task->work(task->user_data);
+	}
+
+	cryptopool_post(cryptopool, task);
+}
+
+/**
+ * Push a completed task onto the completion queue and wake up the main
+ * context. This is safe to call from any number of threads at once.
+ *
+ * @param cryptopool The pool to push the task onto.
+ * @param task The completed task.
+ */
+static void cryptopool_post(CryptoPool * cryptopool, CryptoPoolTask * task) {
+	CryptoPoolTask * head;
+
+	do {
+		head = g_atomic_pointer_get(& cryptopool->completed);
+		task->next = head;
+	} while (g_atomic_pointer_compare_and_exchange(& cryptopool->completed, head, task) == FALSE);
+
+	// If the queue already held tasks, the main context has already been woken
+	if (head == NULL) {
+		g_main_context_wakeup(cryptopool->context);
+	}
+}
+
+/**
+ * Take every task from the completion queue and call their completion
+ * functions, in the order the tasks completed. This must only be called
+ * from the main context.
+ *
+ * @param cryptopool The pool to dispatch the completions for.
+ */
+static void cryptopool_dispatch_completed(CryptoPool * cryptopool) {
+	CryptoPoolTask * list;
+	CryptoPoolTask * reversed;
+	CryptoPoolTask * task;
+
+	// Detach the whole list in one go; this is the only place tasks are
+	// removed, so there's no risk of ABA problems
+	do {
+		list = g_atomic_pointer_get(& cryptopool->completed);
+	} while ((list != NULL) && (g_atomic_pointer_compare_and_exchange(& cryptopool->completed, list, NULL) == FALSE));
+
+	// The list is last-in first-out, so reverse it
+	reversed = NULL;
+	while (list != NULL) {
+		task = list;
+		list = list->next;
+		task->next = reversed;
+		reversed = task;
+	}
+
+	while (reversed != NULL) {
+		task = reversed;
+		reversed = reversed->next;
+		if (task->complete != NULL) {
+			task->complete(task->user_data);
+		}
+		FREE(task);
+	}
+}
+
+/**
+ * GSource prepare function for the completion queue. The source doesn't
+ * need a timeout, since workers wake the main context when they post.
+ *
+ * @param source The source being prepared.
+ * @param timeout Returns the maximum time to wait, in this case -1.
+ * @return TRUE if there are completions waiting to be dispatched.
+ */
+static gboolean cryptopool_source_prepare(GSource * source, gint * timeout) {
+	CryptoPool * cryptopool = ((CryptoPoolSource *)source)->cryptopool;
+
+	*timeout = -1;
+
+	return (g_atomic_pointer_get(& cryptopool->completed) != NULL);
+}
+
+/**
+ * GSource check function for the completion queue.
+ *
+ * @param source The source being checked.
+ * @return TRUE if there are completions waiting to be dispatched.
+ */
+static gboolean cryptopool_source_check(GSource * source) {
+	CryptoPool * cryptopool = ((CryptoPoolSource *)source)->cryptopool;
+
+	return (g_atomic_pointer_get(& cryptopool->completed) != NULL);
+}
+
+/**
+ * GSource dispatch function for the completion queue.
+ *
+ * @param source The source being dispatched.
+ * @param callback Unused.
+ * @param user_data Unused.
+ * @return Always G_SOURCE_CONTINUE, so the source remains attached.
+ */
+static gboolean cryptopool_source_dispatch(GSource * source, GSourceFunc callback, gpointer user_data) {
+	CryptoPool * cryptopool = ((CryptoPoolSource *)source)->cryptopool;
+
+	cryptopool_dispatch_completed(cryptopool);
+
+	return G_SOURCE_CONTINUE;
+}
+
+/** @} addtogroup Service */
+
@@ -0,0 +1,99 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Worker pool for offloading CPU-heavy work from the main loop
+ * @section DESCRIPTION
+ *
+ * The service handles every session on a single GMainLoop. Most of the work
+ * is I/O, but each step of the sigma protocol involves elliptic curve and
+ * symmetric cryptography. With many handshakes in progress at once, running
+ * these inline serialises them all on one core and delays the dispatch of
+ * other sessions' I/O.
+ *
+ * CryptoPool runs work functions on a bounded pool of worker threads. When
+ * each completes, its completion function is called back on the main
+ * context. Completions are passed back through a lock-free multiple-producer
+ * single-consumer queue: workers push onto it with a single atomic
+ * compare-and-exchange, and a GSource attached to the main context takes the
+ * whole queue in one operation when it's dispatched. Workers therefore never
+ * block on the main loop, and vice versa.
+ *
+ * The pool places no constraints on ordering between separate work items;
+ * callers that need ordering (such as the Service, which must feed its
+ * state machine one message at a time) should wait for each completion
+ * before submitting the next item.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#ifndef __CRYPTOPOOL_H
+#define __CRYPTOPOOL_H (1)
+
+#include <stdbool.h>
+#include <glib.h>
+
+// Defines
+
+/**
+ * @brief The maximum number of worker threads
+ *
+ * By default one thread is used per processor, up to this limit.
+ */
+#define CRYPTOPOOL_MAX_THREADS (8)
+
+// Structure definitions
+
+/**
+ * The internal structure can be found in cryptopool.c
+ */
+typedef struct _CryptoPool CryptoPool;
+
+/**
+ * @brief A function to be run on a worker thread
+ */
+typedef void (*CryptoPoolWork)(void * user_data);
+
+/**
+ * @brief A function to be run on the main context once the work completes
+ */
+typedef void (*CryptoPoolComplete)(void * user_data);
+
+// Function prototypes
+
+CryptoPool * cryptopool_new(GMainContext * context);
+void cryptopool_delete(CryptoPool * cryptopool);
+void cryptopool_submit(CryptoPool * cryptopool, CryptoPoolWork work, CryptoPoolComplete complete, void * user_data);
+int cryptopool_get_threads(CryptoPool const * cryptopool);
+
+// Function definitions
+
+#endif
+
+/** @} addtogroup Service */
+
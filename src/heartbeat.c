@@ -0,0 +1,226 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Adaptive interval between continuous authentication heartbeats
+ * @section DESCRIPTION
+ *
+ * Chooses the interval a continuously authenticating Pico should wait
+ * between heartbeats, based on whether its recent heartbeats arrived on
+ * time. See heartbeat.h for the policy.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include "pico/debug.h"
+
+#include "log.h"
+#include "heartbeat.h"
+
+// Defines
+
+// Structure definitions
+
+/**
+ * @brief Opaque structure used for adapting the heartbeat interval
+ *
+ * The last value holds the time the previous heartbeat arrived, or -1 if
+ * there's no previous heartbeat to measure the gap from. The away value is
+ * true while the user's desktop session is locked or idle.
+ *
+ */
+struct _Heartbeat {
+	int minimum;
+	int maximum;
+	int interval;
+	int stable;
+	gint64 last;
+	bool away;
+};
+
+// Function prototypes
+
+// Function definitions
+
+/**
+ * Create a new instance of the class. The interval starts at the minimum.
+ *
+ * @param minimum The shortest interval to use, in milliseconds.
+ * @param maximum The longest interval to use, in milliseconds. If this is
+ *        less than the minimum, the minimum is used throughout.
+ * @return The newly created object.
+ */
+Heartbeat * heartbeat_new(int minimum, int maximum) {
+	Heartbeat * heartbeat;
+
+	heartbeat = CALLOC(sizeof(Heartbeat), 1);
+
+	heartbeat->minimum = minimum;
+	heartbeat->maximum = (maximum > minimum) ? maximum : minimum;
+	heartbeat->interval = minimum;
+	heartbeat->stable = 0;
+	heartbeat->last = -1;
+	heartbeat->away = false;
+
+	return heartbeat;
+}
+
+/**
+ * Delete an instance of the class, freeing up the memory allocated to it.
+ *
+ * @param heartbeat The object to free.
+ */
+void heartbeat_delete(Heartbeat * heartbeat) {
+	if (heartbeat) {
+		FREE(heartbeat);
+	}
+}
+
+/**
+ * Get the interval the Pico should currently wait between heartbeats.
+ *
+ * @param heartbeat The object to get the value from.
+ * @return The interval in milliseconds.
+ */
+int heartbeat_get_interval(Heartbeat const * heartbeat) {
+	return heartbeat->interval;
+}
+
+/**
+ * Get the shortest interval the Pico will ever be asked to wait.
+ *
+ * @param heartbeat The object to get the value from.
+ * @return The minimum interval in milliseconds.
+ */
+int heartbeat_get_minimum(Heartbeat const * heartbeat) {
+	return heartbeat->minimum;
+}
+
+/**
+ * Get the longest interval the Pico will ever be asked to wait.
+ *
+ * @param heartbeat The object to get the value from.
+ * @return The maximum interval in milliseconds.
+ */
+int heartbeat_get_maximum(Heartbeat const * heartbeat) {
+	return heartbeat->maximum;
+}
+
+/**
+ * Record the arrival of a heartbeat and choose the interval to give the
+ * Pico in reply. The heartbeat is compared against the interval it was
+ * sent in response to: if it was late the interval drops to the minimum,
+ * and after enough on-time heartbeats in a row it's doubled.
+ *
+ * @param heartbeat The object to update.
+ * @param now The time the heartbeat arrived, in milliseconds.
+ * @return The interval in milliseconds to give the Pico.
+ */
+int heartbeat_beat(Heartbeat * heartbeat, gint64 now) {
+	gint64 gap;
+	int tolerance;
+
+	if (heartbeat->last >= 0) {
+		gap = now - heartbeat->last;
+		tolerance = heartbeat->interval / 4;
+		if (tolerance < HEARTBEAT_TOLERANCE) {
+			tolerance = HEARTBEAT_TOLERANCE;
+		}
+
+		if (gap > heartbeat->interval + tolerance) {
+			LOG(LOG_INFO, "Heartbeat %" G_GINT64_FORMAT " ms late", gap - heartbeat->interval);
+			heartbeat->interval = heartbeat->minimum;
+			heartbeat->stable = 0;
+		}
+		else {
+			heartbeat->stable++;
+			if ((heartbeat->stable >= HEARTBEAT_STABLE_BEATS) && (heartbeat->interval < heartbeat->maximum)) {
+				heartbeat->interval *= 2;
+				if (heartbeat->interval > heartbeat->maximum) {
+					heartbeat->interval = heartbeat->maximum;
+				}
+				heartbeat->stable = 0;
+				LOG(LOG_DEBUG, "Heartbeat interval increased to %d ms", heartbeat->interval);
+			}
+		}
+	}
+	heartbeat->last = now;
+
+	return heartbeat->interval;
+}
+
+/**
+ * Record that something went wrong with the link, such as it dropping.
+ * The interval returns to the minimum, and the next heartbeat isn't
+ * measured against the last one, since the gap between them includes the
+ * outage.
+ *
+ * @param heartbeat The object to update.
+ */
+void heartbeat_anomaly(Heartbeat * heartbeat) {
+	heartbeat->interval = heartbeat->minimum;
+	heartbeat->stable = 0;
+	heartbeat->last = -1;
+}
+
+/**
+ * Record whether the user is at their desktop session. When they go away
+ * (the session locks or goes idle) the interval goes to the maximum; when
+ * they come back it returns to the minimum. In either case the next
+ * heartbeat isn't measured against the last one, since it was requested
+ * using the old interval.
+ *
+ * @param heartbeat The object to update.
+ * @param away true if the user's session is locked or idle, false if it's
+ *        active.
+ */
+void heartbeat_set_away(Heartbeat * heartbeat, bool away) {
+	if (heartbeat->away != away) {
+		heartbeat->away = away;
+		heartbeat->interval = (away ? heartbeat->maximum : heartbeat->minimum);
+		heartbeat->stable = 0;
+		heartbeat->last = -1;
+		LOG(LOG_DEBUG, "User %s, heartbeat interval set to %d ms", (away ? "away" : "back"), heartbeat->interval);
+	}
+}
+
+/**
+ * Get whether the user was last reported to be away from their desktop
+ * session.
+ *
+ * @param heartbeat The object to get the value from.
+ * @return true if the user's session is locked or idle, false o/w.
+ */
+bool heartbeat_get_away(Heartbeat const * heartbeat) {
+	return heartbeat->away;
+}
+
+/** @} addtogroup Service */
@@ -0,0 +1,103 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Adaptive interval between continuous authentication heartbeats
+ * @section DESCRIPTION
+ *
+ * Once a Pico has authenticated continuously, it sends a re-authentication
+ * message (a heartbeat) each time the interval the service last gave it has
+ * elapsed. Over the Rendezvous Point each heartbeat costs a POST and a GET,
+ * and every heartbeat wakes the service's main loop, so on a stable link
+ * there's little to be gained from a short interval.
+ *
+ * Heartbeat chooses the interval to give the Pico. It starts at a minimum
+ * and doubles after each run of heartbeats arriving on time, up to a
+ * maximum. If a heartbeat arrives late, or the link drops, the interval goes
+ * straight back to the minimum so that a Pico that's wandered off is
+ * noticed quickly. This keeps the time to lock bounded by the minimum
+ * interval whenever the link looks unhealthy.
+ *
+ * The interval also follows the user's activity. While the user's desktop
+ * session is locked or idle there's nobody at the keyboard to protect, so
+ * the interval goes straight to the maximum. When the user comes back it
+ * returns to the minimum, so that the Pico's presence is confirmed quickly
+ * while they're working, and then grows again as the link proves itself.
+ *
+ * Times are passed in by the caller in milliseconds, so the policy can be
+ * driven by either a real or virtual clock.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#ifndef __HEARTBEAT_H
+#define __HEARTBEAT_H (1)
+
+#include <stdbool.h>
+#include <glib.h>
+
+// Defines
+
+/**
+ * @brief The number of on-time heartbeats before the interval grows
+ */
+#define HEARTBEAT_STABLE_BEATS (3)
+
+/**
+ * @brief The least lateness in milliseconds that counts as an anomaly
+ *
+ * A heartbeat is late if it arrives more than this, or a quarter of the
+ * interval if that's longer, after it was due. This allows for the round
+ * trip through the Rendezvous Point.
+ */
+#define HEARTBEAT_TOLERANCE (2000)
+
+// Structure definitions
+
+/**
+ * The internal structure can be found in heartbeat.c
+ */
+typedef struct _Heartbeat Heartbeat;
+
+// Function prototypes
+
+Heartbeat * heartbeat_new(int minimum, int maximum);
+void heartbeat_delete(Heartbeat * heartbeat);
+int heartbeat_get_interval(Heartbeat const * heartbeat);
+int heartbeat_get_minimum(Heartbeat const * heartbeat);
+int heartbeat_get_maximum(Heartbeat const * heartbeat);
+int heartbeat_beat(Heartbeat * heartbeat, gint64 now);
+void heartbeat_anomaly(Heartbeat * heartbeat);
+void heartbeat_set_away(Heartbeat * heartbeat, bool away);
+bool heartbeat_get_away(Heartbeat const * heartbeat);
+
+// Function definitions
+
+#endif
+
+/** @} addtogroup Service */
@@ -0,0 +1,328 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Long-lived cache of service identity keys
+ * @section DESCRIPTION
+ *
+ * Holds one long-lived service identity key pair for each of a small number
+ * of recently used configuration directories, so that sessions don't need
+ * to load and rebuild the key each time.
+ *
+ * See keycache.h for more details.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include "pico/debug.h"
+
+#include "log.h"
+#include "processstore.h"
+#include "keycache.h"
+
+// Defines
+
+/**
+ * @brief The maximum number of configuration directories to hold keys for
+ *
+ * The configuration directory is chosen by the dbus caller, so the number
+ * of keys held has to be limited. In practice almost every session uses
+ * the system configuration directory, so only a few are needed. The least
+ * recently used key is dropped to make space.
+ */
+#define KEYCACHE_MAX_ENTRIES (4)
+
+// Structure definitions
+
+/**
+ * @brief The key pair for a single configuration directory
+ *
+ * The modification times of the key files are recorded so that the key can
+ * be reloaded if they change. The time the entry was last used, on the
+ * monotonic clock, decides which entry is dropped when the cache is full.
+ */
+typedef struct _KeyCacheEntry {
+	KeyPair * keypair;
+	struct timespec pubmodified;
+	struct timespec privmodified;
+	gint64 used;
+} KeyCacheEntry;
+
+/**
+ * @brief Opaque structure used for managing the cache
+ *
+ * The entries table maps configuration directory paths to KeyCacheEntry
+ * structures.
+ *
+ * The lifecycle of this data is managed by pico-continuous.
+ *
+ */
+struct _KeyCache {
+	GHashTable * entries;
+};
+
+// Function prototypes
+
+static void keycache_entry_delete(gpointer data);
+static void keycache_evict(KeyCache * keycache);
+static bool keycache_modified(char const * filename, struct timespec * modified);
+static KeyPair * keycache_load(char const * pubfilename, char const * privfilename);
+
+// Function definitions
+
+/**
+ * Create a new instance of the class. Keys are only loaded when they're
+ * first requested.
+ *
+ * @return The newly created object.
+ */
+KeyCache * keycache_new() {
+	KeyCache * keycache;
+
+	keycache = CALLOC(sizeof(KeyCache), 1);
+
+	keycache->entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, keycache_entry_delete);
+
+	return keycache;
+}
+
+/**
+ * Delete an instance of the class, freeing up the memory allocated to it.
+ * Key pairs returned by keycache_get() belong to the caller, so remain
+ * valid.
+ *
+ * @param keycache The object to free.
+ */
+void keycache_delete(KeyCache * keycache) {
+	if (keycache) {
+		g_hash_table_destroy(keycache->entries);
+		keycache->entries = NULL;
+
+		FREE(keycache);
+	}
+}
+
+/**
+ * Get the service identity key pair for a configuration directory. The key
+ * is loaded from the directory the first time it's requested, or generated
+ * and saved there if there are no key files. Subsequent requests return the
+ * same key, unless the key files have changed since.
+ *
+ * Each call returns a new KeyPair, which belongs to the caller and must be
+ * freed using keypair_delete(), or handed to an object that takes ownership
+ * of it, such as a Shared object. The KeyPair shares the underlying OpenSSL
+ * keys with the cache by reference count, so no key is parsed or copied.
+ *
+ * @param keycache The cache to get the key pair from.
+ * @param configdir The directory containing the key files.
+ * @return The service identity key pair, owned by the caller.
+ */
+KeyPair * keycache_get(KeyCache * keycache, Buffer const * configdir) {
+	KeyCacheEntry * entry;
+	Buffer * pubfilename;
+	Buffer * privfilename;
+	struct timespec pubmodified;
+	struct timespec privmodified;
+	bool changed;
+
+	pubfilename = buffer_new(0);
+	privfilename = buffer_new(0);
+	buffer_append_buffer(pubfilename, configdir);
+	buffer_append_buffer(privfilename, configdir);
+	buffer_append_string(pubfilename, PUB_FILE);
+	buffer_append_string(privfilename, PRIV_FILE);
+
+	keycache_modified(buffer_get_buffer(pubfilename), & pubmodified);
+	keycache_modified(buffer_get_buffer(privfilename), & privmodified);
+
+	entry = g_hash_table_lookup(keycache->entries, buffer_get_buffer(configdir));
+	if (entry == NULL) {
+		if (g_hash_table_size(keycache->entries) >= KEYCACHE_MAX_ENTRIES) {
+			keycache_evict(keycache);
+		}
+		entry = CALLOC(sizeof(KeyCacheEntry), 1);
+		entry->keypair = keycache_load(buffer_get_buffer(pubfilename), buffer_get_buffer(privfilename));
+		g_hash_table_insert(keycache->entries, g_strdup(buffer_get_buffer(configdir)), entry);
+		LOG(LOG_INFO, "Loaded service identity key for %s", buffer_get_buffer(configdir));
+	}
+	else {
+		changed = (pubmodified.tv_sec != entry->pubmodified.tv_sec) || (pubmodified.tv_nsec != entry->pubmodified.tv_nsec);
+		changed |= (privmodified.tv_sec != entry->privmodified.tv_sec) || (privmodified.tv_nsec != entry->privmodified.tv_nsec);
+		if (changed) {
+			// Sessions using the old key hold their own references to it
+			keypair_delete(entry->keypair);
+			entry->keypair = keycache_load(buffer_get_buffer(pubfilename), buffer_get_buffer(privfilename));
+			LOG(LOG_INFO, "Reloaded changed service identity key for %s", buffer_get_buffer(configdir));
+		}
+	}
+
+	// Generating a key creates the files, so check the times again
+	keycache_modified(buffer_get_buffer(pubfilename), & entry->pubmodified);
+	keycache_modified(buffer_get_buffer(privfilename), & entry->privmodified);
+	entry->used = g_get_monotonic_time();
+
+	buffer_delete(pubfilename);
+	buffer_delete(privfilename);
+
+	return keycache_copy(entry->keypair);
+}
+
+/**
+ * Create a new KeyPair holding the same keys as an existing one. The
+ * OpenSSL keys aren't copied; instead a reference to each is taken, which
+ * the new KeyPair releases when it's deleted. Each owner of a KeyPair can
+ * therefore free it independently of the others.
+ *
+ * This is used for the keys returned by keycache_get(), but can be used to
+ * copy any key pair, for example to give each of several Shared objects
+ * its own.
+ *
+ * @param keypair The key pair to copy.
+ * @return The newly created key pair.
+ */
+KeyPair * keycache_copy(KeyPair * keypair) {
+	KeyPair * copy;
+	EC_KEY * publickey;
+	EVP_PKEY * privatekey;
+
+	copy = keypair_new();
+
+	publickey = keypair_getpublickey(keypair);
+	if (publickey != NULL) {
+		EC_KEY_up_ref(publickey);
+		keypair_setpublickey(copy, publickey);
+	}
+
+	privatekey = keypair_getprivatekey(keypair);
+	if (privatekey != NULL) {
+		EVP_PKEY_up_ref(privatekey);
+		keypair_setprivatekey(copy, privatekey);
+	}
+
+	return copy;
+}
+
+/**
+ * Delete an entry from the cache.
+ *
+ * @param data The entry to delete, cast to (void *).
+ */
+static void keycache_entry_delete(gpointer data) {
+	KeyCacheEntry * entry = (KeyCacheEntry *)data;
+
+	if (entry) {
+		keypair_delete(entry->keypair);
+		FREE(entry);
+	}
+}
+
+/**
+ * Drop the least recently used entry from the cache, to make space for a
+ * new one.
+ *
+ * @param keycache The cache to drop the entry from.
+ */
+static void keycache_evict(KeyCache * keycache) {
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+	gpointer oldest;
+	gint64 used;
+
+	oldest = NULL;
+	used = G_MAXINT64;
+	g_hash_table_iter_init(& iter, keycache->entries);
+	while (g_hash_table_iter_next(& iter, & key, & value)) {
+		if (((KeyCacheEntry *)value)->used < used) {
+			used = ((KeyCacheEntry *)value)->used;
+			oldest = key;
+		}
+	}
+
+	if (oldest != NULL) {
+		LOG(LOG_INFO, "Dropping service identity key for %s", (char *)oldest);
+		g_hash_table_remove(keycache->entries, oldest);
+	}
+}
+
+/**
+ * Get the modification time of a file.
+ *
+ * @param filename The file to check.
+ * @param modified Returns the modification time, or zero if the file
+ *        doesn't exist.
+ * @return true if the file exists, false o/w.
+ */
+static bool keycache_modified(char const * filename, struct timespec * modified) {
+	struct stat status;
+	bool result;
+
+	result = (stat(filename, & status) == 0);
+	if (result) {
+		*modified = status.st_mtim;
+	}
+	else {
+		modified->tv_sec = 0;
+		modified->tv_nsec = 0;
+	}
+
+	return result;
+}
+
+/**
+ * Load a key pair from file, or generate and save a new one if it can't be
+ * loaded. This matches the behaviour of shared_load_or_generate_keys().
+ *
+ * @param pubfilename The file containing the public key.
+ * @param privfilename The file containing the private key.
+ * @return The newly created key pair.
+ */
+static KeyPair * keycache_load(char const * pubfilename, char const * privfilename) {
+	KeyPair * keypair;
+	bool result;
+
+	keypair = keypair_new();
+	result = keypair_import(keypair, pubfilename, privfilename);
+	if (result == FALSE) {
+		LOG(LOG_INFO, "Generating new service identity key");
+		keypair_generate(keypair);
+		keypair_export(keypair, pubfilename, privfilename);
+	}
+
+	return keypair;
+}
+
+/** @} addtogroup Service */
+
@@ -0,0 +1,78 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Long-lived cache of service identity keys
+ * @section DESCRIPTION
+ *
+ * The service identity key is used to sign every invitation and takes part
+ * in every handshake. Loading it from disk for each session means reading
+ * and parsing the DER files and rebuilding the key object each time.
+ *
+ * KeyCache holds one long-lived key pair for each of a few recently used
+ * configuration directories. The key is loaded (or generated, if there
+ * are no key files yet) the first time it's needed. If the key files
+ * change on disk, for example because the service has been re-keyed, the
+ * key is reloaded the next time it's requested.
+ *
+ * Each session gets its own KeyPair, sharing the cached OpenSSL keys by
+ * reference count, so that sessions own and free their keys in the usual
+ * way and a key that's replaced or dropped from the cache stays valid for
+ * as long as any session is still using it.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#ifndef __KEYCACHE_H
+#define __KEYCACHE_H (1)
+
+#include "pico/buffer.h"
+#include "pico/keypair.h"
+
+// Defines
+
+// Structure definitions
+
+/**
+ * The internal structure can be found in keycache.c
+ */
+typedef struct _KeyCache KeyCache;
+
+// Function prototypes
+
+KeyCache * keycache_new();
+void keycache_delete(KeyCache * keycache);
+KeyPair * keycache_get(KeyCache * keycache, Buffer const * configdir);
+KeyPair * keycache_copy(KeyPair * keypair);
+
+// Function definitions
+
+#endif
+
+/** @} addtogroup Service */
+
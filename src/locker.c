@@ -0,0 +1,680 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Asynchronously lock users' sessions
+ * @section DESCRIPTION
+ *
+ * Locks users' sessions using logind, falling back to the lock script,
+ * without blocking the main loop. See locker.h for details.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include "pico/debug.h"
+#include "pico/buffer.h"
+
+#include "log.h"
+#include "timesource.h"
+#include "locker.h"
+
+// Defines
+
+/**
+ * @brief The time in milliseconds to wait for logind to reply
+ */
+#define LOCKER_DBUS_TIMEOUT (2000)
+
+/**
+ * @brief The time in milliseconds to wait for a session to report it's locked
+ *
+ * Once logind has passed on the request to lock a session, the session's
+ * LockedHint property is set by the screen locker when it's actually
+ * showing. If that doesn't happen in time, the lock command is run instead.
+ */
+#define LOCKER_CONFIRM_TIMEOUT (3000)
+
+// Structure definitions
+
+/**
+ * @brief Opaque structure used for locking sessions
+ *
+ * The pending table maps the name of each user with a lock in progress to
+ * its LockRequest, so that further requests for the same user can be
+ * coalesced into it.
+ *
+ * The lifecycle of this data is managed by pico-continuous.
+ *
+ */
+struct _Locker {
+	GDBusConnection * connection;
+	bool logind;
+	Buffer * command;
+	GHashTable * pending;
+	LockerStats stats;
+};
+
+/**
+ * @brief A lock in progress for a single user
+ *
+ * The request outlives the Locker if the Locker is deleted while the lock
+ * is still in progress, in which case locker is set to NULL and the request
+ * is simply freed once the outstanding calls complete.
+ *
+ */
+typedef struct _LockRequest {
+	Locker * locker;
+	char * username;
+	gint64 since;
+	int outstanding;
+	int locked;
+} LockRequest;
+
+/**
+ * @brief The lock of one of the user's logind sessions
+ *
+ * The session is reference counted, since it's needed by each dbus call
+ * and signal subscription made for it, any of which may outlive the lock.
+ * The request is only used until the session's lock is finished.
+ *
+ */
+typedef struct _LockSession {
+	LockRequest * request;
+	GDBusConnection * connection;
+	char * id;
+	char * path;
+	guint subscriptionid;
+	guint timeoutid;
+	bool finished;
+	int refs;
+} LockSession;
+
+// Function prototypes
+
+static void locker_list_sessions(LockRequest * request);
+static void locker_sessions_listed(GObject * source, GAsyncResult * res, gpointer user_data);
+static LockSession * locker_session_new(LockRequest * request, char const * id, char const * path);
+static void locker_session_ref(LockSession * session);
+static void locker_session_unref(gpointer data);
+static void locker_session_properties(GObject * source, GAsyncResult * res, gpointer user_data);
+static void locker_session_locked(GObject * source, GAsyncResult * res, gpointer user_data);
+static void locker_session_changed(GDBusConnection * connection, gchar const * sender_name, gchar const * object_path, gchar const * interface_name, gchar const * signal_name, GVariant * parameters, gpointer user_data);
+static gboolean locker_session_timeout(gpointer user_data);
+static void locker_session_finish(LockSession * session, bool locked);
+static bool locker_graphical(char const * type);
+static void locker_run_command(LockRequest * request);
+static void locker_command_done(GObject * source, GAsyncResult * res, gpointer user_data);
+static void locker_complete(LockRequest * request, bool result);
+static void locker_orphan(gpointer key, gpointer value, gpointer user_data);
+
+// Function definitions
+
+/**
+ * Create a new instance of the class. The system bus is connected to
+ * straight away, so that locking doesn't have to wait for it later.
+ *
+ * @return The newly created object.
+ */
+Locker * locker_new() {
+	Locker * locker;
+	GError * error;
+
+	locker = CALLOC(sizeof(Locker), 1);
+
+	error = NULL;
+	locker->connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, & error);
+	if (locker->connection == NULL) {
+		LOG(LOG_ERR, "Failed to connect to system bus for locking: %s", error->message);
+		g_error_free(error);
+	}
+	locker->logind = TRUE;
+	locker->command = buffer_new(0);
+	buffer_append_string(locker->command, LOCK_COMMAND);
+	locker->pending = g_hash_table_new(g_str_hash, g_str_equal);
+	memset(& locker->stats, 0, sizeof(LockerStats));
+
+	return locker;
+}
+
+/**
+ * Delete an instance of the class, freeing up the memory allocated to it.
+ * Any locks still in progress will complete, but won't be counted.
+ *
+ * @param locker The object to free.
+ */
+void locker_delete(Locker * locker) {
+	if (locker) {
+		if (locker->pending) {
+			g_hash_table_foreach(locker->pending, locker_orphan, NULL);
+			g_hash_table_destroy(locker->pending);
+			locker->pending = NULL;
+		}
+
+		if (locker->connection) {
+			g_object_unref(locker->connection);
+			locker->connection = NULL;
+		}
+
+		if (locker->command) {
+			buffer_delete(locker->command);
+			locker->command = NULL;
+		}
+
+		FREE(locker);
+	}
+}
+
+/**
+ * Set whether to try locking using logind before falling back to the lock
+ * command. This is true by default.
+ *
+ * @param locker The object to set the value for.
+ * @param logind true to try logind first, false to only use the command.
+ */
+void locker_set_logind(Locker * locker, bool logind) {
+	locker->logind = logind;
+}
+
+/**
+ * Set the command to run if the session can't be locked using logind. The
+ * command is passed the name of the user as its only argument. The default
+ * is LOCK_COMMAND.
+ *
+ * @param locker The object to set the value for.
+ * @param command The full path of the command to run.
+ */
+void locker_set_command(Locker * locker, char const * command) {
+	buffer_clear(locker->command);
+	buffer_append_string(locker->command, command);
+}
+
+/**
+ * Lock all of a user's sessions. The call returns straight away, and the
+ * lock completes in the background on the main loop. If a lock for the
+ * same user is already in progress, this request is merged into it.
+ *
+ * @param locker The object to lock using.
+ * @param username The name of the user to lock.
+ * @param since The monotonic time in microseconds to measure the lock's
+ *        latency from, or 0 to measure from now.
+ */
+void locker_lock(Locker * locker, char const * username, gint64 since) {
+	LockRequest * request;
+
+	if (since <= 0) {
+		since = timesource_get_monotonic_time();
+	}
+
+	locker->stats.requests++;
+	request = (LockRequest *)g_hash_table_lookup(locker->pending, username);
+	if (request != NULL) {
+		LOG(LOG_INFO, "Lock for %s already in progress", username);
+		locker->stats.coalesced++;
+		if (since < request->since) {
+			request->since = since;
+		}
+	}
+	else {
+		LOG(LOG_INFO, "Locking %s", username);
+		request = CALLOC(sizeof(LockRequest), 1);
+		request->locker = locker;
+		request->username = g_strdup(username);
+		request->since = since;
+		request->outstanding = 0;
+		request->locked = 0;
+		g_hash_table_insert(locker->pending, request->username, request);
+
+		if ((locker->logind) && (locker->connection != NULL)) {
+			locker_list_sessions(request);
+		}
+		else {
+			locker_run_command(request);
+		}
+	}
+}
+
+/**
+ * Get the counters describing the locks performed so far.
+ *
+ * @param locker The object to get the values from.
+ * @param stats A structure to copy the values into.
+ */
+void locker_get_stats(Locker const * locker, LockerStats * stats) {
+	memcpy(stats, & locker->stats, sizeof(LockerStats));
+}
+
+/**
+ * Ask logind for the list of sessions, so that the user's sessions can be
+ * found.
+ *
+ * @param request The lock in progress.
+ */
+static void locker_list_sessions(LockRequest * request) {
+	g_dbus_connection_call(request->locker->connection, "org.freedesktop.login1", "/org/freedesktop/login1", "org.freedesktop.login1.Manager", "ListSessions", NULL, G_VARIANT_TYPE("(a(susso))"), G_DBUS_CALL_FLAGS_NONE, LOCKER_DBUS_TIMEOUT, NULL, locker_sessions_listed, request);
+}
+
+/**
+ * Internal callback with logind's list of sessions. The properties of each
+ * session belonging to the user are fetched, so that the graphical ones can
+ * be locked. If the user has no sessions, the lock command is run instead.
+ *
+ * @param source The GDBusConnection the call was made on.
+ * @param res The result of the call.
+ * @param user_data The lock in progress, cast to (void *).
+ */
+static void locker_sessions_listed(GObject * source, GAsyncResult * res, gpointer user_data) {
+	LockRequest * request = (LockRequest *)user_data;
+	GVariant * result;
+	GVariantIter * iter;
+	GError * error;
+	gchar const * id;
+	gchar const * user;
+	gchar const * path;
+	guint32 uid;
+	LockSession * session;
+
+	error = NULL;
+	result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, & error);
+	if (result == NULL) {
+		LOG(LOG_ERR, "Failed to list logind sessions: %s", error->message);
+		g_error_free(error);
+	}
+	else if (request->locker != NULL) {
+		g_variant_get(result, "(a(susso))", & iter);
+		while (g_variant_iter_loop(iter, "(&su&s&s&o)", & id, & uid, & user, NULL, & path)) {
+			if (strcmp(user, request->username) == 0) {
+				request->outstanding++;
+				session = locker_session_new(request, id, path);
+				locker_session_ref(session);
+				g_dbus_connection_call(session->connection, "org.freedesktop.login1", session->path, "org.freedesktop.DBus.Properties", "GetAll", g_variant_new("(s)", "org.freedesktop.login1.Session"), G_VARIANT_TYPE("(a{sv})"), G_DBUS_CALL_FLAGS_NONE, LOCKER_DBUS_TIMEOUT, NULL, locker_session_properties, session);
+			}
+		}
+		g_variant_iter_free(iter);
+	}
+
+	if (result != NULL) {
+		g_variant_unref(result);
+	}
+
+	if (request->locker == NULL) {
+		if (request->outstanding == 0) {
+			locker_complete(request, FALSE);
+		}
+	}
+	else if (request->outstanding == 0) {
+		locker_run_command(request);
+	}
+}
+
+/**
+ * Create the lock of one of the user's logind sessions. The reference
+ * returned is released once the session's lock is finished.
+ *
+ * @param request The lock in progress.
+ * @param id The logind session id.
+ * @param path The logind session's object path.
+ * @return The newly created object.
+ */
+static LockSession * locker_session_new(LockRequest * request, char const * id, char const * path) {
+	LockSession * session;
+
+	session = CALLOC(sizeof(LockSession), 1);
+	session->request = request;
+	session->connection = g_object_ref(request->locker->connection);
+	session->id = g_strdup(id);
+	session->path = g_strdup(path);
+	session->subscriptionid = 0;
+	session->timeoutid = 0;
+	session->finished = FALSE;
+	session->refs = 1;
+
+	return session;
+}
+
+/**
+ * Take a reference to the lock of a session.
+ *
+ * @param session The session to reference.
+ */
+static void locker_session_ref(LockSession * session) {
+	session->refs++;
+}
+
+/**
+ * Release a reference to the lock of a session, freeing it once there are
+ * none left.
+ *
+ * @param data The LockSession, cast to (gpointer).
+ */
+static void locker_session_unref(gpointer data) {
+	LockSession * session = (LockSession *)data;
+
+	session->refs--;
+	if (session->refs == 0) {
+		g_object_unref(session->connection);
+		g_free(session->id);
+		g_free(session->path);
+		FREE(session);
+	}
+}
+
+/**
+ * Check whether a logind session type is graphical, and so has a screen
+ * that can be locked.
+ *
+ * @param type The value of the session's Type property.
+ * @return true if the session is graphical, false o/w.
+ */
+static bool locker_graphical(char const * type) {
+	return ((strcmp(type, "x11") == 0) || (strcmp(type, "wayland") == 0) || (strcmp(type, "mir") == 0));
+}
+
+/**
+ * Internal callback with the properties of one of the user's sessions. A
+ * graphical session that isn't already locked is asked to lock, and watched
+ * until its LockedHint property shows that it has. Other sessions are left
+ * alone.
+ *
+ * @param source The GDBusConnection the call was made on.
+ * @param res The result of the call.
+ * @param user_data The session, cast to (void *).
+ */
+static void locker_session_properties(GObject * source, GAsyncResult * res, gpointer user_data) {
+	LockSession * session = (LockSession *)user_data;
+	GVariant * result;
+	GVariant * properties;
+	GError * error;
+	gchar const * type;
+	gboolean lockedhint;
+
+	error = NULL;
+	result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, & error);
+	if (result == NULL) {
+		LOG(LOG_ERR, "Failed to get logind session properties: %s", error->message);
+		g_error_free(error);
+		locker_session_finish(session, FALSE);
+	}
+	else {
+		properties = g_variant_get_child_value(result, 0);
+		type = "";
+		lockedhint = FALSE;
+		g_variant_lookup(properties, "Type", "&s", & type);
+		g_variant_lookup(properties, "LockedHint", "b", & lockedhint);
+
+		if (session->finished == TRUE) {
+			// Nothing more to do
+		}
+		else if (locker_graphical(type) == FALSE) {
+			LOG(LOG_DEBUG, "Not locking session %s of type %s", session->id, type);
+			locker_session_finish(session, FALSE);
+		}
+		else if (lockedhint == TRUE) {
+			LOG(LOG_INFO, "Session %s is already locked", session->id);
+			locker_session_finish(session, TRUE);
+		}
+		else {
+			// Watch for the lock before asking for it, so the change can't be missed
+			locker_session_ref(session);
+			session->subscriptionid = g_dbus_connection_signal_subscribe(session->connection, "org.freedesktop.login1", "org.freedesktop.DBus.Properties", "PropertiesChanged", session->path, "org.freedesktop.login1.Session", G_DBUS_SIGNAL_FLAGS_NONE, locker_session_changed, session, locker_session_unref);
+			session->timeoutid = timesource_timeout_add(LOCKER_CONFIRM_TIMEOUT, locker_session_timeout, session);
+
+			locker_session_ref(session);
+			g_dbus_connection_call(session->connection, "org.freedesktop.login1", "/org/freedesktop/login1", "org.freedesktop.login1.Manager", "LockSession", g_variant_new("(s)", session->id), NULL, G_DBUS_CALL_FLAGS_NONE, LOCKER_DBUS_TIMEOUT, NULL, locker_session_locked, session);
+		}
+
+		g_variant_unref(properties);
+		g_variant_unref(result);
+	}
+
+	locker_session_unref(session);
+}
+
+/**
+ * Internal callback with the result of asking logind to lock one of the
+ * user's sessions. If the request succeeded, the session is still waited
+ * on until its LockedHint property is set.
+ *
+ * @param source The GDBusConnection the call was made on.
+ * @param res The result of the call.
+ * @param user_data The session, cast to (void *).
+ */
+static void locker_session_locked(GObject * source, GAsyncResult * res, gpointer user_data) {
+	LockSession * session = (LockSession *)user_data;
+	GVariant * result;
+	GError * error;
+
+	error = NULL;
+	result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, & error);
+	if (result == NULL) {
+		LOG(LOG_ERR, "Failed to lock logind session: %s", error->message);
+		g_error_free(error);
+		locker_session_finish(session, FALSE);
+	}
+	else {
+		g_variant_unref(result);
+	}
+
+	locker_session_unref(session);
+}
+
+/**
+ * Internal callback for changes to the properties of a session being
+ * locked. The session's lock is finished once its LockedHint is set.
+ *
+ * @param connection The connection the signal was received on.
+ * @param sender_name The unique name of logind.
+ * @param object_path The session's object path.
+ * @param interface_name The properties interface.
+ * @param signal_name The PropertiesChanged signal.
+ * @param parameters The interface, changed properties and invalidated
+ *        properties.
+ * @param user_data The session, cast to (gpointer).
+ */
+static void locker_session_changed(GDBusConnection * connection, gchar const * sender_name, gchar const * object_path, gchar const * interface_name, gchar const * signal_name, GVariant * parameters, gpointer user_data) {
+	LockSession * session = (LockSession *)user_data;
+	GVariant * changed;
+	gboolean lockedhint;
+
+	if (g_variant_is_of_type(parameters, G_VARIANT_TYPE("(sa{sv}as)"))) {
+		changed = g_variant_get_child_value(parameters, 1);
+		lockedhint = FALSE;
+		g_variant_lookup(changed, "LockedHint", "b", & lockedhint);
+		if (lockedhint == TRUE) {
+			locker_session_finish(session, TRUE);
+		}
+		g_variant_unref(changed);
+	}
+}
+
+/**
+ * Internal callback if a session doesn't report being locked in time.
+ *
+ * @param user_data The session, cast to (gpointer).
+ * @return Always FALSE, so the source is removed.
+ */
+static gboolean locker_session_timeout(gpointer user_data) {
+	LockSession * session = (LockSession *)user_data;
+
+	session->timeoutid = 0;
+	LOG(LOG_ERR, "Session %s didn't report being locked", session->id);
+	locker_session_finish(session, FALSE);
+
+	return FALSE;
+}
+
+/**
+ * Finish the lock of one of the user's sessions. Once all of the user's
+ * sessions have finished, the lock is complete, with its latency measured
+ * up to this point. If none of them were locked, the lock command is run
+ * instead. Only the first call for each session has any effect.
+ *
+ * @param session The session to finish.
+ * @param locked true if the session's LockedHint showed it was locked,
+ *        false o/w.
+ */
+static void locker_session_finish(LockSession * session, bool locked) {
+	LockRequest * request;
+
+	if (session->finished == FALSE) {
+		session->finished = TRUE;
+
+		if (session->subscriptionid != 0) {
+			g_dbus_connection_signal_unsubscribe(session->connection, session->subscriptionid);
+			session->subscriptionid = 0;
+		}
+
+		if (session->timeoutid != 0) {
+			g_source_remove(session->timeoutid);
+			session->timeoutid = 0;
+		}
+
+		request = session->request;
+		session->request = NULL;
+		if (locked) {
+			request->locked++;
+		}
+		request->outstanding--;
+		if (request->outstanding == 0) {
+			if ((request->locked > 0) || (request->locker == NULL)) {
+				locker_complete(request, (request->locked > 0));
+			}
+			else {
+				locker_run_command(request);
+			}
+		}
+
+		locker_session_unref(session);
+	}
+}
+
+/**
+ * Run the lock command for the user as a subprocess, without waiting for
+ * it to finish.
+ *
+ * @param request The lock in progress.
+ */
+static void locker_run_command(LockRequest * request) {
+	GSubprocess * subprocess;
+	GError * error;
+	gchar const * argv[3];
+
+	request->locker->stats.commands++;
+	argv[0] = buffer_get_buffer(request->locker->command);
+	argv[1] = request->username;
+	argv[2] = NULL;
+
+	error = NULL;
+	subprocess = g_subprocess_newv(argv, G_SUBPROCESS_FLAGS_STDOUT_SILENCE | G_SUBPROCESS_FLAGS_STDERR_SILENCE, & error);
+	if (subprocess == NULL) {
+		LOG(LOG_ERR, "Failed to run lock command: %s", error->message);
+		g_error_free(error);
+		locker_complete(request, FALSE);
+	}
+	else {
+		g_subprocess_wait_check_async(subprocess, NULL, locker_command_done, request);
+	}
+}
+
+/**
+ * Internal callback once the lock command has finished.
+ *
+ * @param source The GSubprocess that ran the command.
+ * @param res The result of waiting for the command.
+ * @param user_data The lock in progress, cast to (void *).
+ */
+static void locker_command_done(GObject * source, GAsyncResult * res, gpointer user_data) {
+	LockRequest * request = (LockRequest *)user_data;
+	GError * error;
+	bool result;
+
+	error = NULL;
+	result = g_subprocess_wait_check_finish(G_SUBPROCESS(source), res, & error);
+	if (result == FALSE) {
+		LOG(LOG_ERR, "Lock command failed: %s", error->message);
+		g_error_free(error);
+	}
+	g_object_unref(source);
+
+	locker_complete(request, result);
+}
+
+/**
+ * Finish a lock, recording its latency, and free the request. Further
+ * requests for the same user will start a new lock.
+ *
+ * @param request The lock that's finished.
+ * @param result true if the user was locked, false o/w.
+ */
+static void locker_complete(LockRequest * request, bool result) {
+	Locker * locker;
+	gint64 latency;
+
+	locker = request->locker;
+	if (locker != NULL) {
+		g_hash_table_remove(locker->pending, request->username);
+		if (result) {
+			latency = timesource_get_monotonic_time() - request->since;
+			LOG(LOG_INFO, "Locked %s after %" G_GINT64_FORMAT " ms", request->username, latency / 1000);
+			locker->stats.locks++;
+			locker->stats.latencylast = latency;
+			locker->stats.latencytotal += latency;
+			if (latency > locker->stats.latencymax) {
+				locker->stats.latencymax = latency;
+			}
+		}
+		else {
+			LOG(LOG_ERR, "Failed to lock %s", request->username);
+			locker->stats.failures++;
+		}
+	}
+
+	g_free(request->username);
+	FREE(request);
+}
+
+/**
+ * Detach a lock in progress from the Locker, because the Locker is being
+ * deleted. Used with g_hash_table_foreach().
+ *
+ * @param key The name of the user being locked.
+ * @param value The lock in progress.
+ * @param user_data Unused.
+ */
+static void locker_orphan(gpointer key, gpointer value, gpointer user_data) {
+	LockRequest * request = (LockRequest *)value;
+
+	request->locker = NULL;
+}
+
+/** @} addtogroup Service */
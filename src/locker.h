@@ -0,0 +1,122 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Asynchronously lock users' sessions
+ * @section DESCRIPTION
+ *
+ * When a continuous authentication ends, the user's session must be locked.
+ * Running the lock script synchronously would stall the main loop, and so
+ * every other session, for as long as the script takes.
+ *
+ * Locker locks sessions without blocking. It asks logind for the user's
+ * sessions and calls LockSession on each graphical one (of type x11,
+ * wayland or mir), which in turn signals the session's screen saver.
+ * Sessions without a screen, such as ssh logins, are left alone. A session
+ * only counts as locked once its LockedHint property is set, which the
+ * screen locker does once it's showing. If logind isn't available, or none
+ * of the user's sessions report being locked, the lock script is run as a
+ * GSubprocess instead, which can reach the desktop's ScreenSaver interface
+ * on the user's own session bus.
+ *
+ * If a lock is requested for a user while a lock for the same user is
+ * already in progress, the requests are coalesced into one.
+ *
+ * The latency of each lock is measured from the time passed in with the
+ * request (usually the last time the Pico was heard from) to the time the
+ * user's sessions report being locked, or the lock script finishes, and
+ * summarised in the stats.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#ifndef __LOCKER_H
+#define __LOCKER_H (1)
+
+#include <stdbool.h>
+#include <glib.h>
+
+// Defines
+
+/**
+ * @brief The command to call to lock the user's session
+ *
+ * There's no canonical way to lock a user's session. A common approach is
+ * to send a dbus message to the desktop manager to trigger a lock. Given there
+ * are different ways to do this, it's easiest to keep the command in a bash
+ * script that can be called from this service.
+ *
+ * This define sets the command to use if logind can't lock the session.
+ */
+#define LOCK_COMMAND "/usr/share/pam-pico/lock.sh"
+
+// Structure definitions
+
+/**
+ * The internal structure can be found in locker.c
+ */
+typedef struct _Locker Locker;
+
+/**
+ * @brief Counters describing the locks performed
+ *
+ *  - requests: locks requested.
+ *  - coalesced: requests merged into a lock already in progress.
+ *  - locks: locks that completed successfully, either confirmed by
+ *    LockedHint or by the lock command succeeding.
+ *  - commands: locks that ran the lock command rather than using logind.
+ *  - failures: locks that couldn't be performed.
+ *  - latencylast: the latency of the most recent lock, in microseconds.
+ *  - latencymax: the largest latency of any lock, in microseconds.
+ *  - latencytotal: the sum of the latencies of all locks, in microseconds.
+ */
+typedef struct _LockerStats {
+	unsigned long requests;
+	unsigned long coalesced;
+	unsigned long locks;
+	unsigned long commands;
+	unsigned long failures;
+	gint64 latencylast;
+	gint64 latencymax;
+	gint64 latencytotal;
+} LockerStats;
+
+// Function prototypes
+
+Locker * locker_new();
+void locker_delete(Locker * locker);
+void locker_set_logind(Locker * locker, bool logind);
+void locker_set_command(Locker * locker, char const * command);
+void locker_lock(Locker * locker, char const * username, gint64 since);
+void locker_get_stats(Locker const * locker, LockerStats * stats);
+
+// Function definitions
+
+#endif
+
+/** @} addtogroup Service */
@@ -0,0 +1,435 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Watch for users' sessions locking or going idle
+ * @section DESCRIPTION
+ *
+ * Follows logind's sessions on the system bus and reports when a user's
+ * session locks or goes idle. See lockwatcher.h for details.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include "pico/debug.h"
+
+#include "log.h"
+#include "lockwatcher.h"
+
+// Defines
+
+/**
+ * @brief The time in milliseconds to wait for logind to reply
+ */
+#define LOCKWATCHER_DBUS_TIMEOUT (2000)
+
+/**
+ * @brief The well-known name logind owns on the system bus
+ */
+#define LOCKWATCHER_LOGIND "org.freedesktop.login1"
+
+/**
+ * @brief The interface logind's session objects implement
+ */
+#define LOCKWATCHER_SESSION_INTERFACE "org.freedesktop.login1.Session"
+
+// Structure definitions
+
+/**
+ * @brief Opaque structure used for watching sessions
+ *
+ * The sessions table maps the object path of each logind session seen so
+ * far to its WatchedSession.
+ *
+ * The lifecycle of this data is managed by pico-continuous.
+ *
+ */
+struct _LockWatcher {
+	GDBusConnection * connection;
+	GCancellable * cancellable;
+	GHashTable * sessions;
+	guint propertiesid;
+	guint sessionid;
+	guint removedid;
+	LockWatcherChanged changed;
+	void * user_data;
+};
+
+/**
+ * @brief The state of a single logind session
+ *
+ * The username is NULL until it's been looked up, and no changes are
+ * reported for the session until then. Away records what was last reported,
+ * so that only changes are reported.
+ *
+ */
+typedef struct _WatchedSession {
+	char * username;
+	bool locked;
+	bool idle;
+	bool away;
+} WatchedSession;
+
+/**
+ * @brief A lookup of the user owning a session
+ *
+ * The session is referenced by its path, since it may be removed before
+ * the lookup completes.
+ *
+ */
+typedef struct _SessionLookup {
+	LockWatcher * lockwatcher;
+	char * path;
+} SessionLookup;
+
+// Function prototypes
+
+static WatchedSession * lockwatcher_get_session(LockWatcher * lockwatcher, char const * path);
+static void lockwatcher_session_delete(gpointer data);
+static void lockwatcher_name_received(GObject * source, GAsyncResult * res, gpointer user_data);
+static void lockwatcher_update(LockWatcher * lockwatcher, WatchedSession * session);
+static void lockwatcher_properties_changed(GDBusConnection * connection, const gchar * sender_name, const gchar * object_path, const gchar * interface_name, const gchar * signal_name, GVariant * parameters, gpointer user_data);
+static void lockwatcher_session_signal(GDBusConnection * connection, const gchar * sender_name, const gchar * object_path, const gchar * interface_name, const gchar * signal_name, GVariant * parameters, gpointer user_data);
+static void lockwatcher_session_removed(GDBusConnection * connection, const gchar * sender_name, const gchar * object_path, const gchar * interface_name, const gchar * signal_name, GVariant * parameters, gpointer user_data);
+
+// Function definitions
+
+/**
+ * Create a new instance of the class. Nothing is watched until
+ * lockwatcher_start() is called.
+ *
+ * @return The newly created object.
+ */
+LockWatcher * lockwatcher_new() {
+	LockWatcher * lockwatcher;
+
+	lockwatcher = CALLOC(sizeof(LockWatcher), 1);
+
+	lockwatcher->connection = NULL;
+	lockwatcher->cancellable = g_cancellable_new();
+	lockwatcher->sessions = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, lockwatcher_session_delete);
+	lockwatcher->propertiesid = 0;
+	lockwatcher->sessionid = 0;
+	lockwatcher->removedid = 0;
+	lockwatcher->changed = NULL;
+	lockwatcher->user_data = NULL;
+
+	return lockwatcher;
+}
+
+/**
+ * Delete an instance of the class, freeing up the memory allocated to it.
+ * Any lookups still in progress are cancelled.
+ *
+ * @param lockwatcher The object to free.
+ */
+void lockwatcher_delete(LockWatcher * lockwatcher) {
+	if (lockwatcher) {
+		if (lockwatcher->cancellable) {
+			g_cancellable_cancel(lockwatcher->cancellable);
+			g_object_unref(lockwatcher->cancellable);
+			lockwatcher->cancellable = NULL;
+		}
+
+		if (lockwatcher->connection) {
+			if (lockwatcher->propertiesid != 0) {
+				g_dbus_connection_signal_unsubscribe(lockwatcher->connection, lockwatcher->propertiesid);
+				lockwatcher->propertiesid = 0;
+			}
+			if (lockwatcher->sessionid != 0) {
+				g_dbus_connection_signal_unsubscribe(lockwatcher->connection, lockwatcher->sessionid);
+				lockwatcher->sessionid = 0;
+			}
+			if (lockwatcher->removedid != 0) {
+				g_dbus_connection_signal_unsubscribe(lockwatcher->connection, lockwatcher->removedid);
+				lockwatcher->removedid = 0;
+			}
+			g_object_unref(lockwatcher->connection);
+			lockwatcher->connection = NULL;
+		}
+
+		if (lockwatcher->sessions) {
+			g_hash_table_destroy(lockwatcher->sessions);
+			lockwatcher->sessions = NULL;
+		}
+
+		FREE(lockwatcher);
+	}
+}
+
+/**
+ * Set the callback to call when a user's session goes away or comes back.
+ * The callback is called on the main loop.
+ *
+ * @param lockwatcher The object to set the callback for.
+ * @param changed The callback to call, or NULL to stop reporting changes.
+ * @param user_data The user data to pass to the callback.
+ */
+void lockwatcher_set_changed_callback(LockWatcher * lockwatcher, LockWatcherChanged changed, void * user_data) {
+	lockwatcher->changed = changed;
+	lockwatcher->user_data = user_data;
+}
+
+/**
+ * Connect to the system bus and start watching logind's sessions.
+ *
+ * @param lockwatcher The object to start.
+ * @return true if the watcher started, false if the system bus couldn't be
+ *         reached.
+ */
+bool lockwatcher_start(LockWatcher * lockwatcher) {
+	GError * error;
+	bool result;
+
+	result = (lockwatcher->connection != NULL);
+
+	if (result == false) {
+		error = NULL;
+		lockwatcher->connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, & error);
+		if (lockwatcher->connection == NULL) {
+			LOG(LOG_ERR, "Failed to connect to system bus to watch sessions: %s", error->message);
+			g_error_free(error);
+		}
+		else {
+			lockwatcher->propertiesid = g_dbus_connection_signal_subscribe(lockwatcher->connection, LOCKWATCHER_LOGIND, "org.freedesktop.DBus.Properties", "PropertiesChanged", NULL, LOCKWATCHER_SESSION_INTERFACE, G_DBUS_SIGNAL_FLAGS_NONE, lockwatcher_properties_changed, lockwatcher, NULL);
+			lockwatcher->sessionid = g_dbus_connection_signal_subscribe(lockwatcher->connection, LOCKWATCHER_LOGIND, LOCKWATCHER_SESSION_INTERFACE, NULL, NULL, NULL, G_DBUS_SIGNAL_FLAGS_NONE, lockwatcher_session_signal, lockwatcher, NULL);
+			lockwatcher->removedid = g_dbus_connection_signal_subscribe(lockwatcher->connection, LOCKWATCHER_LOGIND, "org.freedesktop.login1.Manager", "SessionRemoved", "/org/freedesktop/login1", NULL, G_DBUS_SIGNAL_FLAGS_NONE, lockwatcher_session_removed, lockwatcher, NULL);
+			result = true;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Get the state of a session, creating it if it's not been seen before. A
+ * newly created session starts looking up the user that owns it.
+ *
+ * @param lockwatcher The object watching the session.
+ * @param path The session's logind object path.
+ * @return The state of the session.
+ */
+static WatchedSession * lockwatcher_get_session(LockWatcher * lockwatcher, char const * path) {
+	WatchedSession * session;
+	SessionLookup * lookup;
+
+	session = (WatchedSession *)g_hash_table_lookup(lockwatcher->sessions, path);
+	if (session == NULL) {
+		session = CALLOC(sizeof(WatchedSession), 1);
+		session->username = NULL;
+		session->locked = FALSE;
+		session->idle = FALSE;
+		session->away = FALSE;
+		g_hash_table_insert(lockwatcher->sessions, g_strdup(path), session);
+
+		lookup = CALLOC(sizeof(SessionLookup), 1);
+		lookup->lockwatcher = lockwatcher;
+		lookup->path = g_strdup(path);
+		g_dbus_connection_call(lockwatcher->connection, LOCKWATCHER_LOGIND, path, "org.freedesktop.DBus.Properties", "Get", g_variant_new("(ss)", LOCKWATCHER_SESSION_INTERFACE, "Name"), G_VARIANT_TYPE("(v)"), G_DBUS_CALL_FLAGS_NONE, LOCKWATCHER_DBUS_TIMEOUT, lockwatcher->cancellable, lockwatcher_name_received, lookup);
+	}
+
+	return session;
+}
+
+/**
+ * Free the state of a session when it's removed from the table.
+ *
+ * @param data The session to free, cast to a gpointer.
+ */
+static void lockwatcher_session_delete(gpointer data) {
+	WatchedSession * session = (WatchedSession *)data;
+
+	if (session->username) {
+		g_free(session->username);
+		session->username = NULL;
+	}
+
+	FREE(session);
+}
+
+/**
+ * Internal callback with the name of the user owning a session. Once the
+ * name is known, the session's current state can be reported.
+ *
+ * @param source The GDBusConnection the call was made on.
+ * @param res The result of the call.
+ * @param user_data The lookup in progress, cast to (void *).
+ */
+static void lockwatcher_name_received(GObject * source, GAsyncResult * res, gpointer user_data) {
+	SessionLookup * lookup = (SessionLookup *)user_data;
+	GVariant * result;
+	GVariant * value;
+	GError * error;
+	WatchedSession * session;
+
+	error = NULL;
+	result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, & error);
+	if (result == NULL) {
+		// The LockWatcher may already have been deleted if it was cancelled
+		if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED) == FALSE) {
+			LOG(LOG_ERR, "Failed to get user for session %s: %s", lookup->path, error->message);
+		}
+		g_error_free(error);
+	}
+	else {
+		session = (WatchedSession *)g_hash_table_lookup(lookup->lockwatcher->sessions, lookup->path);
+		if (session != NULL) {
+			g_variant_get(result, "(v)", & value);
+			if (g_variant_is_of_type(value, G_VARIANT_TYPE_STRING)) {
+				session->username = g_variant_dup_string(value, NULL);
+				lockwatcher_update(lookup->lockwatcher, session);
+			}
+			g_variant_unref(value);
+		}
+		g_variant_unref(result);
+	}
+
+	g_free(lookup->path);
+	FREE(lookup);
+}
+
+/**
+ * Report a change to whether the user owning a session is away, if there
+ * is one. Nothing's reported until the user is known.
+ *
+ * @param lockwatcher The object watching the session.
+ * @param session The session that may have changed.
+ */
+static void lockwatcher_update(LockWatcher * lockwatcher, WatchedSession * session) {
+	bool away;
+
+	away = session->locked || session->idle;
+	if ((session->username != NULL) && (away != session->away)) {
+		session->away = away;
+		LOG(LOG_INFO, "Session for %s is %s", session->username, away ? "away" : "back");
+		if (lockwatcher->changed != NULL) {
+			lockwatcher->changed(lockwatcher, session->username, away, lockwatcher->user_data);
+		}
+	}
+}
+
+/**
+ * Internal callback for a change to the properties of a logind session.
+ * Only the LockedHint and IdleHint properties are of interest.
+ *
+ * @param connection The connection the signal arrived on.
+ * @param sender_name The unique name of the sender.
+ * @param object_path The object path of the session.
+ * @param interface_name The interface of the signal.
+ * @param signal_name The name of the signal.
+ * @param parameters The changed interface, properties and invalidated
+ *        properties.
+ * @param user_data The LockWatcher, cast to a gpointer.
+ */
+static void lockwatcher_properties_changed(GDBusConnection * connection, const gchar * sender_name, const gchar * object_path, const gchar * interface_name, const gchar * signal_name, GVariant * parameters, gpointer user_data) {
+	LockWatcher * lockwatcher = (LockWatcher *)user_data;
+	WatchedSession * session;
+	GVariant * changed;
+	gboolean value;
+	bool found;
+
+	found = false;
+	changed = g_variant_get_child_value(parameters, 1);
+	if (g_variant_lookup(changed, "LockedHint", "b", & value)) {
+		session = lockwatcher_get_session(lockwatcher, object_path);
+		session->locked = value;
+		found = true;
+	}
+	if (g_variant_lookup(changed, "IdleHint", "b", & value)) {
+		session = lockwatcher_get_session(lockwatcher, object_path);
+		session->idle = value;
+		found = true;
+	}
+	g_variant_unref(changed);
+
+	if (found) {
+		lockwatcher_update(lockwatcher, session);
+	}
+}
+
+/**
+ * Internal callback for a signal from a logind session. The Lock and
+ * Unlock signals are sent before the screen locker has acted on them, so
+ * are used to report the change as early as possible.
+ *
+ * @param connection The connection the signal arrived on.
+ * @param sender_name The unique name of the sender.
+ * @param object_path The object path of the session.
+ * @param interface_name The interface of the signal.
+ * @param signal_name The name of the signal.
+ * @param parameters The signal's parameters.
+ * @param user_data The LockWatcher, cast to a gpointer.
+ */
+static void lockwatcher_session_signal(GDBusConnection * connection, const gchar * sender_name, const gchar * object_path, const gchar * interface_name, const gchar * signal_name, GVariant * parameters, gpointer user_data) {
+	LockWatcher * lockwatcher = (LockWatcher *)user_data;
+	WatchedSession * session;
+
+	if ((strcmp(signal_name, "Lock") == 0) || (strcmp(signal_name, "Unlock") == 0)) {
+		session = lockwatcher_get_session(lockwatcher, object_path);
+		session->locked = (strcmp(signal_name, "Lock") == 0);
+		if (session->locked == FALSE) {
+			session->idle = FALSE;
+		}
+		lockwatcher_update(lockwatcher, session);
+	}
+}
+
+/**
+ * Internal callback for a logind session ending. If the session was away,
+ * it's reported as no longer being so, and its state is forgotten.
+ *
+ * @param connection The connection the signal arrived on.
+ * @param sender_name The unique name of the sender.
+ * @param object_path The object path of the logind manager.
+ * @param interface_name The interface of the signal.
+ * @param signal_name The name of the signal.
+ * @param parameters The session id and object path.
+ * @param user_data The LockWatcher, cast to a gpointer.
+ */
+static void lockwatcher_session_removed(GDBusConnection * connection, const gchar * sender_name, const gchar * object_path, const gchar * interface_name, const gchar * signal_name, GVariant * parameters, gpointer user_data) {
+	LockWatcher * lockwatcher = (LockWatcher *)user_data;
+	WatchedSession * session;
+	gchar const * path;
+
+	g_variant_get(parameters, "(&s&o)", NULL, & path);
+	session = (WatchedSession *)g_hash_table_lookup(lockwatcher->sessions, path);
+	if (session != NULL) {
+		session->locked = FALSE;
+		session->idle = FALSE;
+		lockwatcher_update(lockwatcher, session);
+		g_hash_table_remove(lockwatcher->sessions, path);
+	}
+}
+
+/** @} addtogroup Service */
+
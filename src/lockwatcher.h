@@ -0,0 +1,88 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * @brief Watch for users' sessions locking or going idle
+ * @section DESCRIPTION
+ *
+ * When a user's screen locks, they'll need to authenticate to get back in.
+ * Starting the authentication session only once the greeter asks for it
+ * means the user has to wait for the session to be set up, and then for
+ * their Pico to find it, before they can unlock.
+ *
+ * LockWatcher listens to logind on the system bus so that sessions can be
+ * started speculatively instead. It follows the LockedHint and IdleHint
+ * properties of each session, as well as the Lock and Unlock signals, and
+ * reports whenever a user's session goes away (locked or idle) or comes back.
+ * The name of the user owning each session is looked up asynchronously the
+ * first time the session is seen.
+ *
+ * Only changes are reported, so sessions that are already locked when the
+ * watcher starts aren't reported until they change again.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#ifndef __LOCKWATCHER_H
+#define __LOCKWATCHER_H (1)
+
+#include <stdbool.h>
+#include <glib.h>
+
+// Defines
+
+// Structure definitions
+
+/**
+ * The internal structure can be found in lockwatcher.c
+ */
+typedef struct _LockWatcher LockWatcher;
+
+/**
+ * Callback used to report a user's session going away or coming back.
+ *
+ * @param lockwatcher The LockWatcher reporting the change.
+ * @param username The user owning the session.
+ * @param away true if the session has locked or gone idle, false if it's
+ *        active again or has ended.
+ * @param user_data The user data passed when the callback was set.
+ */
+typedef void (*LockWatcherChanged)(LockWatcher * lockwatcher, char const * username, bool away, void * user_data);
+
+// Function prototypes
+
+LockWatcher * lockwatcher_new();
+void lockwatcher_delete(LockWatcher * lockwatcher);
+void lockwatcher_set_changed_callback(LockWatcher * lockwatcher, LockWatcherChanged changed, void * user_data);
+bool lockwatcher_start(LockWatcher * lockwatcher);
+
+// Function definitions
+
+#endif
+
+/** @} addtogroup Service */
+
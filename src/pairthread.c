@@ -0,0 +1,636 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Pair users with a Pico from within the service
+ * @section DESCRIPTION
+ *
+ * Runs the blocking libpico pairing calls on a worker thread, passing the
+ * code to show and the result back to the main loop, and adds the new user
+ * to the UsersCache once the pairing succeeds.
+ *
+ * See pairthread.h for more details.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include "pico/debug.h"
+#include "pico/pico.h"
+#include "pico/shared.h"
+#include "pico/channel.h"
+#include "pico/keypairing.h"
+#include "pico/sigmaverifier.h"
+#include "pico/cryptosupport.h"
+#include "pico/json.h"
+
+#include "log.h"
+#include "processstore.h"
+#include "usersjournal.h"
+#include "pairthread.h"
+
+// Defines
+
+// Structure definitions
+
+/**
+ * @brief Opaque structure used for managing a pairing
+ *
+ * The details of the pairing are set up on the main thread before the
+ * worker thread starts, and aren't touched by the main thread again until
+ * the worker has finished. The worker reports back using idle sources on
+ * the main loop; the mutex protects their ids, so that the sources can be
+ * removed if the PairThread is deleted before they're dispatched. The
+ * cancel flag is accessed atomically.
+ *
+ * The lifecycle of this data is managed by ProcessStore.
+ *
+ */
+struct _PairThread {
+	KeyCache * keycache;
+	UsersCache * userscache;
+	PairThreadStarted started_callback;
+	PairThreadFinished finished_callback;
+	void * user_data;
+	PairThreadChannel channel_new;
+	void * channel_data;
+	PAIRTHREADSTATE state;
+	GThread * thread;
+	GMutex mutex;
+	guint startedid;
+	guint finishedid;
+	gint cancel;
+	Buffer * username;
+	Buffer * password;
+	Buffer * configdir;
+	Buffer * hostname;
+	Shared * shared;
+	Buffer * symmetrickey;
+	Buffer * storeddata;
+	Buffer * code;
+	bool started;
+	bool result;
+};
+
+// Function prototypes
+
+static void pairthread_load_keys(PairThread * pairthread);
+static void pairthread_release_keys(PairThread * pairthread);
+static gpointer pairthread_thread(gpointer user_data);
+static bool pairthread_setup(PairThread * pairthread, RVPChannel * channel, Buffer * extradata);
+static gboolean pairthread_started(gpointer user_data);
+static gboolean pairthread_finished(gpointer user_data);
+static bool pairthread_add_user(PairThread * pairthread);
+
+// Function definitions
+
+/**
+ * Create a new instance of the class.
+ *
+ * @return The newly created object.
+ */
+PairThread * pairthread_new() {
+	PairThread * pairthread;
+
+	pairthread = CALLOC(sizeof(PairThread), 1);
+
+	pairthread->keycache = NULL;
+	pairthread->userscache = NULL;
+	pairthread->started_callback = NULL;
+	pairthread->finished_callback = NULL;
+	pairthread->user_data = NULL;
+	pairthread->channel_new = NULL;
+	pairthread->channel_data = NULL;
+	pairthread->state = PAIRTHREADSTATE_DORMANT;
+	pairthread->thread = NULL;
+	g_mutex_init(& pairthread->mutex);
+	pairthread->startedid = 0;
+	pairthread->finishedid = 0;
+	pairthread->cancel = 0;
+	pairthread->username = buffer_new(0);
+	pairthread->password = buffer_new(0);
+	pairthread->configdir = buffer_new(0);
+	pairthread->hostname = buffer_new(0);
+	pairthread->shared = NULL;
+	pairthread->symmetrickey = buffer_new(CRYPTOSUPPORT_AESKEY_SIZE);
+	pairthread->storeddata = buffer_new(0);
+	pairthread->code = buffer_new(0);
+	pairthread->started = FALSE;
+	pairthread->result = FALSE;
+
+	return pairthread;
+}
+
+/**
+ * Delete an instance of the class, freeing up the memory allocated to it.
+ *
+ * If the pairing is still in progress it's abandoned, but the worker thread
+ * can only notice this between waits on the channel, so this may block for
+ * up to the Rendezvous Point's timeout. Rather than deleting a pairing that
+ * may still be waiting, use pairthread_cancel() and delete it once it's
+ * finished.
+ *
+ * @param pairthread The object to free.
+ */
+void pairthread_delete(PairThread * pairthread) {
+	if (pairthread) {
+		if (pairthread->thread != NULL) {
+			g_atomic_int_set(& pairthread->cancel, 1);
+			g_thread_join(pairthread->thread);
+			pairthread->thread = NULL;
+		}
+
+		// The worker has finished, so no more sources will be added
+		if (pairthread->startedid != 0) {
+			g_source_remove(pairthread->startedid);
+			pairthread->startedid = 0;
+		}
+		if (pairthread->finishedid != 0) {
+			g_source_remove(pairthread->finishedid);
+			pairthread->finishedid = 0;
+		}
+
+		pairthread_release_keys(pairthread);
+		g_mutex_clear(& pairthread->mutex);
+
+		if (pairthread->password) {
+			memset(buffer_get_buffer(pairthread->password), 0, buffer_get_pos(pairthread->password));
+			buffer_delete(pairthread->password);
+			pairthread->password = NULL;
+		}
+
+		if (pairthread->symmetrickey) {
+			memset(buffer_get_buffer(pairthread->symmetrickey), 0, buffer_get_pos(pairthread->symmetrickey));
+			buffer_delete(pairthread->symmetrickey);
+			pairthread->symmetrickey = NULL;
+		}
+
+		if (pairthread->username) {
+			buffer_delete(pairthread->username);
+			pairthread->username = NULL;
+		}
+
+		if (pairthread->configdir) {
+			buffer_delete(pairthread->configdir);
+			pairthread->configdir = NULL;
+		}
+
+		if (pairthread->hostname) {
+			buffer_delete(pairthread->hostname);
+			pairthread->hostname = NULL;
+		}
+
+		if (pairthread->storeddata) {
+			buffer_delete(pairthread->storeddata);
+			pairthread->storeddata = NULL;
+		}
+
+		if (pairthread->code) {
+			buffer_delete(pairthread->code);
+			pairthread->code = NULL;
+		}
+
+		FREE(pairthread);
+	}
+}
+
+/**
+ * Set the cache of service identity keys to take the key from. The cache
+ * remains owned by the caller.
+ *
+ * @param pairthread The object to set the value of.
+ * @param keycache The cache to use, or NULL to load the key from the
+ *        configuration directory.
+ */
+void pairthread_set_keycache(PairThread * pairthread, KeyCache * keycache) {
+	pairthread->keycache = keycache;
+}
+
+/**
+ * Set the cache to add the newly paired user to. The cache remains owned by
+ * the caller and must outlive the PairThread.
+ *
+ * @param pairthread The object to set the value of.
+ * @param userscache The cache to use, or NULL to write the user straight to
+ *        the users journal.
+ */
+void pairthread_set_userscache(PairThread * pairthread, UsersCache * userscache) {
+	pairthread->userscache = userscache;
+}
+
+/**
+ * Set the functions to call on the main loop as the pairing progresses.
+ * The PairThread may be deleted from within either callback.
+ *
+ * @param pairthread The object to set the callbacks for.
+ * @param started Called once the code to show the user is ready, or once
+ *        it's clear the pairing couldn't be started.
+ * @param finished Called once the pairing has completed, either way. This
+ *        is always called after the started callback.
+ * @param user_data Passed to both callbacks.
+ */
+void pairthread_set_callbacks(PairThread * pairthread, PairThreadStarted started, PairThreadFinished finished, void * user_data) {
+	pairthread->started_callback = started;
+	pairthread->finished_callback = finished;
+	pairthread->user_data = user_data;
+}
+
+/**
+ * Set the function used to create the channel for the Pico to connect to.
+ * By default a new Rendezvous Point channel is used; the tests use this to
+ * replace it with a channel of their own. This must be set before
+ * pairthread_start() is called.
+ *
+ * @param pairthread The object to set the function for.
+ * @param channel The function to create the channel, or NULL to use a
+ *        Rendezvous Point channel.
+ * @param user_data Passed to the function.
+ */
+void pairthread_set_channel(PairThread * pairthread, PairThreadChannel channel, void * user_data) {
+	pairthread->channel_new = channel;
+	pairthread->channel_data = user_data;
+}
+
+/**
+ * Start pairing a user. The service's keys are loaded and the pairing
+ * handed to a worker thread; the code to show the user is returned through
+ * the started callback. This should be called from the main loop, and can
+ * only be called once for each PairThread.
+ *
+ * The password is encrypted with a new symmetric key and given to the
+ * Pico, as pico-pair does, so it's up to the caller to check it first.
+ *
+ * @param pairthread The object to start.
+ * @param username The user to pair.
+ * @param password The user's password.
+ * @param configdir The configuration directory containing the service's
+ *        keys and paired users, with a trailing slash.
+ * @param hostname The name to give the service in the Pico app.
+ * @return true if the worker thread was started, false o/w.
+ */
+bool pairthread_start(PairThread * pairthread, char const * username, char const * password, Buffer const * configdir, char const * hostname) {
+	bool result;
+
+	result = (pairthread->state == PAIRTHREADSTATE_DORMANT);
+
+	if (result) {
+		buffer_append_string(pairthread->username, username);
+		buffer_append_string(pairthread->password, password);
+		buffer_append_buffer(pairthread->configdir, configdir);
+		buffer_append_string(pairthread->hostname, hostname);
+
+		pairthread_load_keys(pairthread);
+
+		LOG(LOG_INFO, "Starting pairing for user %s", username);
+		pairthread->state = PAIRTHREADSTATE_STARTING;
+		pairthread->thread = g_thread_new("pair", pairthread_thread, pairthread);
+	}
+
+	return result;
+}
+
+/**
+ * Abandon the pairing. The worker thread notices this the next time its
+ * wait on the channel ends, after which the finished callback is called as
+ * usual.
+ *
+ * @param pairthread The object to cancel.
+ */
+void pairthread_cancel(PairThread * pairthread) {
+	g_atomic_int_set(& pairthread->cancel, 1);
+}
+
+/**
+ * Get the stage the pairing has reached.
+ *
+ * @param pairthread The object to get the state of.
+ * @return The current state.
+ */
+PAIRTHREADSTATE pairthread_get_state(PairThread const * pairthread) {
+	return pairthread->state;
+}
+
+/**
+ * Get the result of a completed pairing.
+ *
+ * @param pairthread The object to get the result from.
+ * @return true if the user was paired and added, false if the pairing
+ *         failed or hasn't completed yet.
+ */
+bool pairthread_get_result(PairThread const * pairthread) {
+	return pairthread->result;
+}
+
+/**
+ * Get the name of the user being paired.
+ *
+ * @param pairthread The object to get the username from.
+ * @return The username, which remains owned by the PairThread.
+ */
+char const * pairthread_get_username(PairThread const * pairthread) {
+	return buffer_get_buffer(pairthread->username);
+}
+
+/**
+ * Give the Shared object the service's long-term identity key, taking it
+ * from the KeyCache if one has been set. This must be called on the main
+ * thread, since the KeyCache isn't thread safe.
+ *
+ * @param pairthread The object to load the keys for.
+ */
+static void pairthread_load_keys(PairThread * pairthread) {
+	KeyPair * identitykey;
+	Buffer * pubfilename;
+	Buffer * privfilename;
+
+	pairthread->shared = shared_new();
+
+	identitykey = NULL;
+	if (pairthread->keycache != NULL) {
+		identitykey = keycache_get(pairthread->keycache, pairthread->configdir);
+	}
+	if (identitykey != NULL) {
+		shared_set_service_identity_key(pairthread->shared, identitykey);
+	}
+	else {
+		pubfilename = buffer_new(0);
+		privfilename = buffer_new(0);
+		buffer_append_buffer(pubfilename, pairthread->configdir);
+		buffer_append_buffer(privfilename, pairthread->configdir);
+		buffer_append_string(pubfilename, PUB_FILE);
+		buffer_append_string(privfilename, PRIV_FILE);
+
+		shared_load_or_generate_keys(pairthread->shared, buffer_get_buffer(pubfilename), buffer_get_buffer(privfilename));
+
+		buffer_delete(pubfilename);
+		buffer_delete(privfilename);
+	}
+}
+
+/**
+ * Free the Shared object, along with the identity key it owns.
+ *
+ * @param pairthread The object to release the keys for.
+ */
+static void pairthread_release_keys(PairThread * pairthread) {
+	if (pairthread->shared) {
+		shared_delete(pairthread->shared);
+		pairthread->shared = NULL;
+	}
+}
+
+/**
+ * The worker thread. Sets up the pairing, reports the code back to the
+ * main loop, and then waits for the Pico to connect and complete the sigma
+ * protocol.
+ *
+ * @param user_data The PairThread, cast to (gpointer).
+ * @return Always NULL.
+ */
+static gpointer pairthread_thread(gpointer user_data) {
+	PairThread * pairthread = (PairThread *)user_data;
+	RVPChannel * channel;
+	Buffer * extradata;
+	bool result;
+	int attempt;
+
+	if (pairthread->channel_new != NULL) {
+		channel = pairthread->channel_new(pairthread->channel_data);
+	}
+	else {
+		channel = channel_new();
+	}
+	extradata = buffer_new(0);
+
+	result = pairthread_setup(pairthread, channel, extradata);
+	pairthread->started = result;
+
+	g_mutex_lock(& pairthread->mutex);
+	pairthread->startedid = g_idle_add(pairthread_started, pairthread);
+	g_mutex_unlock(& pairthread->mutex);
+
+	if (result) {
+		result = FALSE;
+		for (attempt = 0; (attempt < PAIRTHREAD_ATTEMPTS) && (result == FALSE) && (g_atomic_int_get(& pairthread->cancel) == 0); attempt++) {
+			result = sigmaverifier(pairthread->shared, channel, NULL, buffer_get_buffer(extradata), pairthread->storeddata, NULL);
+		}
+	}
+	pairthread->result = result;
+
+	memset(buffer_get_buffer(extradata), 0, buffer_get_pos(extradata));
+	buffer_delete(extradata);
+	channel_delete(channel);
+
+	g_mutex_lock(& pairthread->mutex);
+	pairthread->finishedid = g_idle_add(pairthread_finished, pairthread);
+	g_mutex_unlock(& pairthread->mutex);
+
+	return NULL;
+}
+
+/**
+ * Generate the user's symmetric key, encrypt their password with it, and
+ * generate the Key Pairing code for the user to scan. Called on the worker
+ * thread.
+ *
+ * @param pairthread The object being started.
+ * @param channel The channel the Pico will connect to.
+ * @param extradata A buffer to store the data to send to the Pico in.
+ * @return true if the code was generated successfully, false o/w.
+ */
+static bool pairthread_setup(PairThread * pairthread, RVPChannel * channel, Buffer * extradata) {
+	bool result;
+	Buffer * cleartext;
+	Buffer * ciphertext;
+	Buffer * url;
+	Json * json;
+	KeyPairing * keypairing;
+	size_t size;
+	char * code;
+
+	cleartext = buffer_new(0);
+	ciphertext = buffer_new(0);
+	url = buffer_new(0);
+
+	result = cryptosupport_generate_symmetric_key(pairthread->symmetrickey, CRYPTOSUPPORT_AESKEY_SIZE);
+
+	if (result) {
+		buffer_append_buffer(cleartext, pairthread->password);
+		result = cryptosupport_encrypt_iv_base64(pairthread->symmetrickey, cleartext, ciphertext);
+		buffer_append(ciphertext, "", 1);
+		memset(buffer_get_buffer(cleartext), 0, buffer_get_pos(cleartext));
+	}
+
+	if (result) {
+		json = json_new();
+		json_add_string(json, "data", buffer_get_buffer(ciphertext));
+		json_add_string(json, "name", buffer_get_buffer(pairthread->username));
+		json_serialize_buffer(json, extradata);
+		buffer_append(extradata, "", 1);
+		json_delete(json);
+
+		// Request a new rendezvous channel
+		channel_get_url(channel, url);
+		result = (buffer_get_pos(url) > 0);
+		if (result == FALSE) {
+			LOG(LOG_ERR, "Failed to get a Rendezvous Point channel for pairing");
+		}
+	}
+
+	if (result) {
+		keypairing = keypairing_new();
+		keypairing_set(keypairing, url, "", NULL, buffer_get_buffer(pairthread->hostname), shared_get_service_identity_key(pairthread->shared));
+		size = keypairing_serialize_size(keypairing);
+		code = MALLOC(size + 1);
+		keypairing_serialize(keypairing, code, size + 1);
+		buffer_append_string(pairthread->code, code);
+		FREE(code);
+		keypairing_delete(keypairing);
+	}
+
+	buffer_delete(cleartext);
+	buffer_delete(ciphertext);
+	buffer_delete(url);
+
+	return result;
+}
+
+/**
+ * Called on the main loop once the worker thread has the code ready, or
+ * has failed to generate it.
+ *
+ * @param user_data The PairThread, cast to (gpointer).
+ * @return Always FALSE, so the source is removed.
+ */
+static gboolean pairthread_started(gpointer user_data) {
+	PairThread * pairthread = (PairThread *)user_data;
+	char const * code;
+
+	g_mutex_lock(& pairthread->mutex);
+	pairthread->startedid = 0;
+	g_mutex_unlock(& pairthread->mutex);
+
+	code = NULL;
+	if (pairthread->started) {
+		pairthread->state = PAIRTHREADSTATE_WAITING;
+		code = buffer_get_buffer(pairthread->code);
+	}
+	else {
+		LOG(LOG_ERR, "Failed to start pairing for user %s", buffer_get_buffer(pairthread->username));
+	}
+
+	// The callback may delete the PairThread
+	if (pairthread->started_callback != NULL) {
+		pairthread->started_callback(pairthread, code, pairthread->user_data);
+	}
+
+	return FALSE;
+}
+
+/**
+ * Called on the main loop once the worker thread has finished. If the Pico
+ * completed the pairing, the user is added to the paired users.
+ *
+ * @param user_data The PairThread, cast to (gpointer).
+ * @return Always FALSE, so the source is removed.
+ */
+static gboolean pairthread_finished(gpointer user_data) {
+	PairThread * pairthread = (PairThread *)user_data;
+
+	g_mutex_lock(& pairthread->mutex);
+	pairthread->finishedid = 0;
+	g_mutex_unlock(& pairthread->mutex);
+
+	g_thread_join(pairthread->thread);
+	pairthread->thread = NULL;
+
+	// The Pico considers itself paired even if the pairing was cancelled
+	if (pairthread->result) {
+		pairthread->result = pairthread_add_user(pairthread);
+	}
+
+	if (pairthread->result) {
+		LOG(LOG_INFO, "User %s successfully paired", buffer_get_buffer(pairthread->username));
+	}
+	else {
+		LOG(LOG_INFO, "Pairing failed for user %s", buffer_get_buffer(pairthread->username));
+	}
+
+	pairthread_release_keys(pairthread);
+	pairthread->state = PAIRTHREADSTATE_COMPLETED;
+
+	// The callback may delete the PairThread
+	if (pairthread->finished_callback != NULL) {
+		pairthread->finished_callback(pairthread, pairthread->result, pairthread->user_data);
+	}
+
+	return FALSE;
+}
+
+/**
+ * Add the newly paired user, along with their Pico's Bluetooth address if
+ * it sent one. With a UsersCache the user can authenticate straight away;
+ * otherwise they're written to the journal for sessions to pick up.
+ *
+ * @param pairthread The object that completed the pairing.
+ * @return true if the user was added, false o/w.
+ */
+static bool pairthread_add_user(PairThread * pairthread) {
+	UsersJournal * usersjournal;
+	EC_KEY * publickey;
+	char const * address;
+	bool result;
+
+	publickey = shared_get_pico_identity_public_key(pairthread->shared);
+	address = NULL;
+	if (buffer_get_pos(pairthread->storeddata) > 0) {
+		address = buffer_get_buffer(pairthread->storeddata);
+	}
+
+	if (pairthread->userscache != NULL) {
+		result = userscache_add(pairthread->userscache, pairthread->configdir, buffer_get_buffer(pairthread->username), publickey, pairthread->symmetrickey, address);
+	}
+	else {
+		usersjournal = usersjournal_new();
+		usersjournal_set_configdir(usersjournal, buffer_get_buffer(pairthread->configdir));
+		result = usersjournal_append_user(usersjournal, buffer_get_buffer(pairthread->username), publickey, pairthread->symmetrickey);
+		if (result && (address != NULL)) {
+			result = usersjournal_append_device(usersjournal, address);
+		}
+		usersjournal_delete(usersjournal);
+	}
+
+	return result;
+}
+
+/** @} addtogroup Service */
+
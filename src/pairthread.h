@@ -0,0 +1,132 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Pair users with a Pico from within the service
+ * @section DESCRIPTION
+ *
+ * Pairing a Pico means showing the user a Key Pairing QR code, waiting on a
+ * Rendezvous Point channel for their Pico app to connect, and running the
+ * sigma protocol to learn the Pico's identity key. When pico-pair does this
+ * itself it has to load the service's keys from disk, and the service then
+ * only learns about the new user the next time it reads the users files.
+ *
+ * PairThread performs a pairing on behalf of the service. The service's
+ * identity key is taken from the KeyCache, and once the pairing succeeds
+ * the user is added through the UsersCache, so they can authenticate
+ * straight away without anything being reloaded.
+ *
+ * The libpico pairing calls block, for up to half an hour while waiting for
+ * the Pico, so each pairing runs on its own thread. Its progress is passed
+ * back to the main loop through the started and finished callbacks. If the
+ * PairThread is deleted before the pairing finishes, the pairing is
+ * abandoned once the current wait on the channel ends.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#ifndef __PAIRTHREAD_H
+#define __PAIRTHREAD_H (1)
+
+#include <stdbool.h>
+#include "pico/buffer.h"
+#include "pico/channel.h"
+#include "keycache.h"
+#include "userscache.h"
+
+// Defines
+
+/**
+ * @brief The number of times to wait on the channel for the Pico to connect
+ *
+ * Each wait lasts for the Rendezvous Point's timeout, so this keeps the
+ * channel open for around half an hour, as pico-pair does.
+ */
+#define PAIRTHREAD_ATTEMPTS (45)
+
+// Structure definitions
+
+/**
+ * The internal structure can be found in pairthread.c
+ */
+typedef struct _PairThread PairThread;
+
+/**
+ * @brief The stages of a pairing
+ */
+typedef enum _PAIRTHREADSTATE {
+	PAIRTHREADSTATE_INVALID = -1,
+
+	PAIRTHREADSTATE_DORMANT,
+	PAIRTHREADSTATE_STARTING,
+	PAIRTHREADSTATE_WAITING,
+	PAIRTHREADSTATE_COMPLETED,
+
+	PAIRTHREADSTATE_NUM
+} PAIRTHREADSTATE;
+
+/**
+ * @brief Called once the QR code is ready to show to the user
+ *
+ * The code is NULL if the pairing couldn't be started.
+ */
+typedef void (*PairThreadStarted)(PairThread * pairthread, char const * code, void * user_data);
+
+/**
+ * @brief Called once the pairing has completed, successfully or otherwise
+ */
+typedef void (*PairThreadFinished)(PairThread * pairthread, bool success, void * user_data);
+
+/**
+ * @brief Creates the channel for the Pico to connect to
+ *
+ * Called on the worker thread. The PairThread deletes the channel once the
+ * pairing has finished.
+ */
+typedef RVPChannel * (*PairThreadChannel)(void * user_data);
+
+// Function prototypes
+
+PairThread * pairthread_new();
+void pairthread_delete(PairThread * pairthread);
+void pairthread_set_keycache(PairThread * pairthread, KeyCache * keycache);
+void pairthread_set_userscache(PairThread * pairthread, UsersCache * userscache);
+void pairthread_set_callbacks(PairThread * pairthread, PairThreadStarted started, PairThreadFinished finished, void * user_data);
+void pairthread_set_channel(PairThread * pairthread, PairThreadChannel channel, void * user_data);
+bool pairthread_start(PairThread * pairthread, char const * username, char const * password, Buffer const * configdir, char const * hostname);
+void pairthread_cancel(PairThread * pairthread);
+PAIRTHREADSTATE pairthread_get_state(PairThread const * pairthread);
+bool pairthread_get_result(PairThread const * pairthread);
+char const * pairthread_get_username(PairThread const * pairthread);
+
+// Function definitions
+
+#endif
+
+/** @} addtogroup Service */
+
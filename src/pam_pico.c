@@ -62,14 +62,13 @@
 
 #include <string.h>
 #include <pthread.h>
-#include <assert.h>
 #include "pico/pico.h"
-#include "pico/displayqr.h"
 #include "pico/json.h"
 #include "pico/debug.h"
 #include <dbus/dbus.h>
 
 #include "log.h"
+#include "qrtext.h"
 
 #ifdef HAVE_SYS_FSUID_H
 // We much rather prefer to use setfsuid(), but this function is unfortunately
@@ -130,13 +129,13 @@
 #define URL_PREFIX "http://rendezvous.mypico.org/channel/"
 
 /**
- * @brief Message to display to the user
+ * @brief The name used to keep a pending session with the PAM handle
+ *
+ * This is the name passed to pam_set_data() and pam_get_data() to store the
+ * PendingSession for a PAM handle.
  *
- * Message to print to indicate the user must hit ENTER to log in
- * This is needed for SSH login, which won't allow messages to
- * be displayed to the user without expect some response back from them
  */
-#define MESSAGE_PRESS_ENTER "\nPress ENTER then scan the Pico QR code to login\n"
+#define PENDING_SESSION_DATA "pam_pico_pending_session"
 
 /**
  * @brief Set the configuration variable as unset
@@ -217,6 +216,9 @@ typedef enum _ARG {
 	ARG_TIMEOUT,
 	ARG_RVPURL,
 	ARG_CONFIGDIR,
+	ARG_HEARTBEATMIN,
+	ARG_HEARTBEATMAX,
+	ARG_RESUMEGRACE,
 
 	ARG_NUM
 } ARG;
@@ -246,6 +248,9 @@ static char const * const argstring[ARG_NUM] = {
 	"timeout=",
 	"rvpurl=",
 	"configdir=",
+	"heartbeatmin=",
+	"heartbeatmax=",
+	"resumegrace=",
 };
 
 /**
@@ -302,6 +307,8 @@ typedef enum _CHANNELTYPE {
 
 	CHANNELTYPE_RVP,
 	CHANNELTYPE_BTC,
+	CHANNELTYPE_RACE,
+	CHANNELTYPE_TCP,
 
 	CHANNELTYPE_NUM
 } CHANNELTYPE;
@@ -326,32 +333,10 @@ typedef enum _CHANNELTYPE {
 static char const * const channeltypestring[CHANNELTYPE_NUM] = {
 	"rvp",
 	"btc",
+	"race",
+	"tcp",
 };
 
-/**
- * @brief An enum representating all parameters to the "qrtype" argument
- *
- * Strings are hard to deal with; when considering command line arguments it's
- * easier to use an enum. This enum lists every parameter that will be accepted
- * following a "qrtype=" command line argument.
- *
- * The actual parameter comes in as a string, but can be converted to a member
- * of this enum using the convert_to_enum() function.
- *
- */
-typedef enum _QRTYPE {
-	QRTYPE_INVALID = -1,
-
-	QRTYPE_JSON,
-	QRTYPE_COLORUTF8,
-	QRTYPE_COLORLESSUTF8,
-	QRTYPE_ANSI,
-	QRTYPE_TTTAG,
-	QRTYPE_NONE,
-
-	QRTYPE_NUM
-} QRTYPE;
-
 /**
  * @brief List of possible parameters following a "qrtype" argument
  *
@@ -410,8 +395,35 @@ typedef struct _CompleteAuthResult {
 	char * username;
 	char * password;
 	bool success;
+	bool replied;
 } CompleteAuthResult;
 
+/**
+ * @brief A session started with the service that hasn't been used yet
+ *
+ * Some applications, such as sshd, call pam_sm_authenticate() more than once
+ * on the same PAM handle when a login is retried. The session started by the
+ * first attempt is kept with the handle using pam_set_data(), so that a retry
+ * can resume it and show the same QR code, rather than starting a new
+ * session. Once the service has authenticated the user, it's removed. If
+ * the authentication failed, it's kept, and the service decides whether a
+ * retry can resume it.
+ *
+ * If the PAM handle is cleaned up while the session is still pending, the
+ * session is cancelled, unless cancel has been cleared.
+ *
+ */
+typedef struct _PendingSession {
+	int handle;
+	char * code;
+	char * username;
+	char * parameters;
+	char * qrtext;
+	QRTYPE mode;
+	bool requestinput;
+	bool cancel;
+} PendingSession;
+
 /**
  * @brief Structure to hold the data that must be passed to the input thread
  *
@@ -516,6 +528,9 @@ typedef struct _ExternalConfig {
 	FloatConfig timeout;
 	StringConfig rvpurl;
 	StringConfig configdir;
+	FloatConfig heartbeatmin;
+	FloatConfig heartbeatmax;
+	FloatConfig resumegrace;
 } ExternalConfig;
 
 // Function prototypes
@@ -523,13 +538,15 @@ typedef struct _ExternalConfig {
 static int converse(pam_handle_t *pamh, int nargs, PAM_CONST struct pam_message **message, struct pam_response **response);
 void prompt(pam_handle_t *pamh, int style, PAM_CONST char *prompt);
 void * thread_input(void * t);
-char * convert_text_to_qr_code(const char * qrtext, QRTYPE mode, bool requireInput);
 bool pam_auth(pam_handle_t *pamh, ExternalConfig * externalconfig, QRTYPE mode, bool requestInput);
 PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv);
 PAM_EXTERN int pam_sm_setcred(pam_handle_t *pamh, int flags, int argc, const char **argv);
 const char * get_user_name(pam_handle_t * pamh);
 StartAuthResult * notify_service_start_auth(char const * username, char const * parameters);
 CompleteAuthResult * notify_service_complete_auth(int handle);
+bool notify_service_resume_auth(int handle, char const * username, char const * code);
+void notify_service_cancel_auth(int handle, char const * code);
+void pending_session_cleanup(pam_handle_t * pamh, void * data, int error_status);
 ExternalConfig * externalconfig_new();
 void externalconfig_delete(ExternalConfig * externalconfig);
 void externalconfig_generate_json(ExternalConfig * externalconfig, Buffer * json);
@@ -634,70 +651,6 @@ void * thread_input(void * t) {
 	return NULL;
 }
 
-/**
- * Converts qrtext to the text that should be printed in the terminal
- *
- * @param qrtext Text to be converted
- * @param mode Terminal mode
- * @param tttag The output will be wrapped with <tt>
- * @param requireInput The "Press enter" message will be included in the end
- *
- * @return Newly allocated memory containing the text
- */
-char * convert_text_to_qr_code(const char * qrtext, QRTYPE mode, bool requireInput) {
-	Buffer * qrbuffer;
-	DisplayQR * displayqr;
-	char * return_text;
-	int length;
-	int current;
-
-	LOG(LOG_INFO, "Generating text QR code");
-	if (mode == QRTYPE_ANSI) {
-		displayqr = displayqr_new_params(QRMODE_ANSI);
-	}
-	else if (mode == QRTYPE_COLORLESSUTF8) {
-		displayqr = displayqr_new_params(QRMODE_COLORLESS_UTF8);
-	}
-	else {
-		displayqr = displayqr_new_params(QRMODE_COLOR_UTF8);
-	}
-	displayqr_generate(displayqr, qrtext);
-	
-	// Allocate enough memory to store the QR code ASCII
-	qrbuffer = displayqr_get_output(displayqr);
-	length = buffer_get_pos(qrbuffer);
-	if (mode == QRTYPE_TTTAG) {
-		// Add length required to include "<tt>\n</tt>\n" (the actual strings are added later)
-		length += 11;
-	}
-	if (requireInput == TRUE) {
-		length += strlen(MESSAGE_PRESS_ENTER);
-	}
-	return_text = MALLOC(length + 1);
-	current = 0;
-	if (mode == QRTYPE_TTTAG) {
-		strcpy(return_text, "<tt>\n");
-		current += 5;
-	}
-	memcpy(return_text + current, buffer_get_buffer(qrbuffer), buffer_get_pos(qrbuffer));
-	return_text[current + buffer_get_pos(qrbuffer)] = '\0';
-	current += buffer_get_pos(qrbuffer);
-	if (mode == QRTYPE_TTTAG) {
-		strncat(return_text, "</tt>\n", length - current);
-		current += 6;
-	}
-	if (requireInput == TRUE) {
-		// If we're requesting user input, add a message so the user is aware
-		strncat(return_text, MESSAGE_PRESS_ENTER, length - current);
-		current += strlen(MESSAGE_PRESS_ENTER);
-	}
-	return_text[length] = '\0';
-	displayqr_delete(displayqr);
-	assert(length == current);
-
-	return return_text;
-}
-
 /**
  * Convert a null-terminated string to an enum value. This function essentially
  * accepts a string and an array of strings, and returns the index of the string
@@ -773,6 +726,9 @@ ExternalConfig * externalconfig_new() {
 	config_clear(& externalconfig->timeout);
 	config_clear(& externalconfig->rvpurl);
 	config_clear(& externalconfig->configdir);
+	config_clear(& externalconfig->heartbeatmin);
+	config_clear(& externalconfig->heartbeatmax);
+	config_clear(& externalconfig->resumegrace);
 
 	return externalconfig;
 }
@@ -822,6 +778,12 @@ void externalconfig_generate_json(ExternalConfig * externalconfig, Buffer * json
 		case CHANNELTYPE_BTC:
 			json_add_string(parameters, "channeltype", "btc");
 			break;
+		case CHANNELTYPE_RACE:
+			json_add_string(parameters, "channeltype", "race");
+			break;
+		case CHANNELTYPE_TCP:
+			json_add_string(parameters, "channeltype", "tcp");
+			break;
 		default:
 			// Do nothing
 			break;
@@ -857,6 +819,24 @@ void externalconfig_generate_json(ExternalConfig * externalconfig, Buffer * json
 		json_add_string(parameters, "configdir", string);
 	}
 
+	is_set = config_is_set(& externalconfig->heartbeatmin);
+	if (is_set) {
+		decimal = config_get(& externalconfig->heartbeatmin, 0.0);
+		json_add_decimal(parameters, "heartbeatmin", decimal);
+	}
+
+	is_set = config_is_set(& externalconfig->heartbeatmax);
+	if (is_set) {
+		decimal = config_get(& externalconfig->heartbeatmax, 0.0);
+		json_add_decimal(parameters, "heartbeatmax", decimal);
+	}
+
+	is_set = config_is_set(& externalconfig->resumegrace);
+	if (is_set) {
+		decimal = config_get(& externalconfig->resumegrace, 0.0);
+		json_add_decimal(parameters, "resumegrace", decimal);
+	}
+
 	json_serialize_buffer(parameters, json);
 	json_delete(parameters);
 }
@@ -955,6 +935,21 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
 			LOG(LOG_INFO, "Setting config dir to %s", remainder);
 			config_set(& externalconfig->configdir, remainder);
 			break;
+		case ARG_HEARTBEATMIN:
+			sscanf(remainder, "%f", & decimal);
+			LOG(LOG_INFO, "Setting minimum heartbeat interval of %f seconds", decimal);
+			config_set(& externalconfig->heartbeatmin, decimal);
+			break;
+		case ARG_HEARTBEATMAX:
+			sscanf(remainder, "%f", & decimal);
+			LOG(LOG_INFO, "Setting maximum heartbeat interval of %f seconds", decimal);
+			config_set(& externalconfig->heartbeatmax, decimal);
+			break;
+		case ARG_RESUMEGRACE:
+			sscanf(remainder, "%f", & decimal);
+			LOG(LOG_INFO, "Setting resumption grace period of %f seconds", decimal);
+			config_set(& externalconfig->resumegrace, decimal);
+			break;
 		default:
 			LOG(LOG_ERR, "Unknown argument \"%s\"", argv[count]);
 			break;
@@ -976,6 +971,10 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
  * to display a QR code, then performs the Pico protocol via a Rendezvous
  * Point channel with Pico.
  *
+ * If an earlier attempt using the same PAM handle left a session pending,
+ * with the same user and configuration, that session is resumed rather than
+ * starting a new one.
+ *
  * @param pamh The handle provided by PAM
  * @param An external config structure containing the values to sent to the
  *        pico-continuous servive.
@@ -987,6 +986,7 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
 bool pam_auth(pam_handle_t * pamh, ExternalConfig * externalconfig, QRTYPE mode, bool requestInput) {
 	bool result;
 	char * qrtext;
+	char * threadtext;
 	int threadResult;
 	pthread_t threadInput;
 	pthread_attr_t threadAttr;
@@ -998,8 +998,13 @@ bool pam_auth(pam_handle_t * pamh, ExternalConfig * externalconfig, QRTYPE mode,
 	Buffer * parameters;
 	bool anyuser;
 	int length;
+	PendingSession * pending;
+	void const * data;
+	bool resumed;
 
+	startauthresult = NULL;
 	completeauthresult = NULL;
+	threadtext = NULL;
 	anyuser = config_get(& externalconfig->anyuser, false);
 
 	parameters = buffer_new(0);
@@ -1008,28 +1013,73 @@ bool pam_auth(pam_handle_t * pamh, ExternalConfig * externalconfig, QRTYPE mode,
 	username = get_user_name(pamh);
 	LOG(LOG_INFO, "Authenticating for user %s", username);
 
-	startauthresult = notify_service_start_auth(username, buffer_get_buffer(parameters));
-	result = startauthresult->success;
+	// Look for a session started by an earlier attempt using the same handle
+	pending = NULL;
+	if (pam_get_data(pamh, PENDING_SESSION_DATA, & data) == PAM_SUCCESS) {
+		pending = (PendingSession *)data;
+	}
+
+	resumed = false;
+	if ((pending != NULL) && (username != NULL) && (strcmp(pending->username, username) == 0) && (strcmp(pending->parameters, buffer_get_buffer(parameters)) == 0)) {
+		resumed = notify_service_resume_auth(pending->handle, username, pending->code);
+		LOG(LOG_INFO, "Resuming session from previous attempt: %d", resumed);
+	}
+
+	if (resumed) {
+		result = true;
+	}
+	else {
+		// Replacing the pending session cancels it
+		pam_set_data(pamh, PENDING_SESSION_DATA, NULL, NULL);
+		pending = NULL;
+
+		startauthresult = notify_service_start_auth(username, buffer_get_buffer(parameters));
+		result = startauthresult->success;
+	}
+
+	if (result && (resumed == false)) {
+		pending = CALLOC(sizeof(PendingSession), 1);
+		pending->handle = startauthresult->handle;
+		pending->code = CALLOC(sizeof(char), strlen(startauthresult->code) + 1);
+		strcpy(pending->code, startauthresult->code);
+		pending->username = CALLOC(sizeof(char), strlen(username) + 1);
+		strcpy(pending->username, username);
+		pending->parameters = CALLOC(sizeof(char), buffer_get_pos(parameters) + 1);
+		strcpy(pending->parameters, buffer_get_buffer(parameters));
+		pending->qrtext = NULL;
+		pending->cancel = true;
+		pam_set_data(pamh, PENDING_SESSION_DATA, pending, pending_session_cleanup);
+	}
 
 	buffer_delete(parameters);
 	qrtext = NULL;
 
 	if (result) {
-		// Prepare the QR code to be displayed to the user
-		switch (mode) {
-		case QRTYPE_NONE:
-			qrtext = MALLOC(1);
-			qrtext[0] = '\0';
-			break;
-		case QRTYPE_JSON:
-			length = strlen(startauthresult->code);
-			qrtext = MALLOC(length + 1);
-			memcpy(qrtext, startauthresult->code, length + 1);
-			break;
-		default:
-			qrtext = convert_text_to_qr_code(startauthresult->code, mode, requestInput);
-			break;
+		// Prepare the QR code to be displayed to the user, unless an earlier
+		// attempt already has
+		if ((pending->qrtext == NULL) || (pending->mode != mode) || (pending->requestinput != requestInput)) {
+			if (pending->qrtext) {
+				FREE(pending->qrtext);
+			}
+
+			switch (mode) {
+			case QRTYPE_NONE:
+				pending->qrtext = MALLOC(1);
+				pending->qrtext[0] = '\0';
+				break;
+			case QRTYPE_JSON:
+				length = strlen(pending->code);
+				pending->qrtext = MALLOC(length + 1);
+				memcpy(pending->qrtext, pending->code, length + 1);
+				break;
+			default:
+				pending->qrtext = convert_text_to_qr_code(pending->code, mode, requestInput);
+				break;
+			}
+			pending->mode = mode;
+			pending->requestinput = requestInput;
 		}
+		qrtext = pending->qrtext;
 
 		LOG(LOG_ERR, "Pam Pico Pre Prompt");
 
@@ -1038,7 +1088,12 @@ bool pam_auth(pam_handle_t * pamh, ExternalConfig * externalconfig, QRTYPE mode,
 			pthread_attr_init(& threadAttr);
 			pthread_attr_setdetachstate(& threadAttr, PTHREAD_CREATE_JOINABLE);
 
-			promptthreaddata.qrtext = qrtext;
+			// The pending session may be freed while the thread is still running
+			length = strlen(qrtext);
+			threadtext = MALLOC(length + 1);
+			memcpy(threadtext, qrtext, length + 1);
+
+			promptthreaddata.qrtext = threadtext;
 			promptthreaddata.pamh = pamh;
 
 			// Invoke the use input thread
@@ -1056,9 +1111,19 @@ bool pam_auth(pam_handle_t * pamh, ExternalConfig * externalconfig, QRTYPE mode,
 		LOG(LOG_ERR, "Pam Pico Post Prompt");
 
 		// Perform the Pico authentication protocol
-		completeauthresult = notify_service_complete_auth(startauthresult->handle);
+		completeauthresult = notify_service_complete_auth(pending->handle);
 		result = completeauthresult->success;
 
+		// Once the user has been authenticated, the session has been used.
+		// Otherwise it's kept for a retry, which resumes it if the service
+		// says it's still resumable, or cancels it and starts a new one
+		if (completeauthresult->replied && completeauthresult->success) {
+			pending->cancel = false;
+			pam_set_data(pamh, PENDING_SESSION_DATA, NULL, NULL);
+			pending = NULL;
+			qrtext = NULL;
+		}
+
 		LOG(LOG_INFO, "Pam Pico result %d", result);
 	}
 
@@ -1078,8 +1143,8 @@ bool pam_auth(pam_handle_t * pamh, ExternalConfig * externalconfig, QRTYPE mode,
 			}
 		}
 
-		if (qrtext) {
-			FREE(qrtext);
+		if (threadtext) {
+			FREE(threadtext);
 		}
 	}
 
@@ -1098,6 +1163,45 @@ bool pam_auth(pam_handle_t * pamh, ExternalConfig * externalconfig, QRTYPE mode,
 	return result;
 }
 
+/**
+ * Clean up a pending session kept with a PAM handle. This is called by PAM
+ * when the handle is ended, or the session is replaced using
+ * pam_set_data(). Unless it's been used, the session is cancelled so that
+ * the service doesn't keep it running until it times out.
+ *
+ * @param pamh The handle provided by PAM
+ * @param data The PendingSession to clean up, cast to (void *).
+ * @param error_status The status passed to pam_end(), along with flags
+ *        such as PAM_DATA_REPLACE.
+ */
+void pending_session_cleanup(pam_handle_t * pamh, void * data, int error_status) {
+	PendingSession * pending = (PendingSession *)data;
+	bool cancel;
+
+	if (pending) {
+		cancel = pending->cancel;
+#ifdef PAM_DATA_SILENT
+		// A forked process mustn't cancel the session its parent is using
+		if ((error_status & PAM_DATA_SILENT) != 0) {
+			cancel = false;
+		}
+#endif
+
+		if (cancel) {
+			LOG(LOG_INFO, "Cancelling unused session");
+			notify_service_cancel_auth(pending->handle, pending->code);
+		}
+
+		FREE(pending->code);
+		FREE(pending->username);
+		FREE(pending->parameters);
+		if (pending->qrtext) {
+			FREE(pending->qrtext);
+		}
+		FREE(pending);
+	}
+}
+
 /**
  * Service function to alter credentials.
  * This function performs the task of altering the credentials of the user
@@ -1345,6 +1449,7 @@ CompleteAuthResult * notify_service_complete_auth(int handle) {
 
 	completeauthresult = CALLOC(sizeof(CompleteAuthResult), 1);
 	completeauthresult->success = success;
+	completeauthresult->replied = result;
 
 	if (result) {
 		completeauthresult->username = CALLOC(sizeof(char), strlen(username) + 1);
@@ -1380,6 +1485,166 @@ CompleteAuthResult * notify_service_complete_auth(int handle) {
 	return completeauthresult;
 }
 
+/**
+ * Ask the service to resume an authentication process started by an earlier
+ * attempt. If it can be resumed, notify_service_complete_auth() should then
+ * be called with the same handle to get the result.
+ *
+ * @param handle The service's handle for the authentication process.
+ * @param username The user being authenticated.
+ * @param code The code returned when the authentication process started.
+ * @return true if the authentication process was resumed, false o/w.
+ */
+bool notify_service_resume_auth(int handle, char const * username, char const * code) {
+	DBusConnection * connection;
+	DBusMessage * msg;
+	DBusMessage * reply;
+	DBusError error = DBUS_ERROR_INIT;
+	DBusMessageIter msg_iter;
+	bool result;
+	// Returned values
+	dbus_bool_t success;
+
+	success = false;
+	result = true;
+	msg = NULL;
+	reply = NULL;
+	LOG(LOG_INFO, "Getting dbus proxy for continuous auth server\n");
+
+	connection = dbus_bus_get(DBUS_BUS_SYSTEM, &error);
+	if (connection == NULL) {
+		LOG(LOG_ERR, "Unable to connect to D-Bus: %s\n", error.message);
+		result = false;
+	}
+
+	if (result) {
+		msg = dbus_message_new_method_call("uk.ac.cam.cl.pico.service", "/PicoObject", "uk.ac.cam.cl.pico.interface", "ResumeAuth");
+		if (msg == NULL) {
+			LOG(LOG_ERR, "Could not allocate memory for message\n");
+			result = false;
+		}
+	}
+
+	if (result) {
+		dbus_message_iter_init_append(msg, &msg_iter);
+
+		result = dbus_message_iter_append_basic(&msg_iter, DBUS_TYPE_INT32, &handle);
+		result = result && dbus_message_iter_append_basic(&msg_iter, DBUS_TYPE_STRING, &username);
+		result = result && dbus_message_iter_append_basic(&msg_iter, DBUS_TYPE_STRING, &code);
+		if (!result) {
+			LOG(LOG_ERR, "Not enough memory to add parameter to message\n");
+		}
+	}
+
+	if (result) {
+		reply = dbus_connection_send_with_reply_and_block(connection, msg, DBUS_TIMEOUT_USE_DEFAULT, &error);
+
+		if (reply == NULL) {
+			LOG(LOG_ERR, "Error sending D-Bus message: %s: %s\n", error.name, error.message);
+			result = false;
+		}
+	}
+
+	if (result) {
+		result = !dbus_set_error_from_message(&error, reply);
+		if (!result) {
+			LOG(LOG_ERR, "Error from D-Bus message: %s: %s\n", error.name, error.message);
+			result = false;
+		}
+	}
+
+	if (result) {
+		result = dbus_message_get_args(reply, &error, DBUS_TYPE_BOOLEAN, &success, DBUS_TYPE_INVALID);
+		if (!result) {
+			LOG(LOG_ERR, "Returned argument types are incorrect: %s: %s\n", error.name, error.message);
+			result = false;
+		}
+	}
+
+	if (reply) {
+		dbus_message_unref(reply);
+		reply = NULL;
+	}
+
+	if (msg) {
+		dbus_message_unref(msg);
+		msg = NULL;
+	}
+
+	if (connection) {
+		dbus_connection_unref(connection);
+		connection = NULL;
+	}
+
+	dbus_error_free(&error);
+
+	return (result && success);
+}
+
+/**
+ * Ask the service to cancel an authentication process that's no longer
+ * needed. The call doesn't wait for a reply, since it's made while the PAM
+ * handle is being cleaned up.
+ *
+ * @param handle The service's handle for the authentication process.
+ * @param code The code returned when the authentication process started.
+ */
+void notify_service_cancel_auth(int handle, char const * code) {
+	DBusConnection * connection;
+	DBusMessage * msg;
+	DBusError error = DBUS_ERROR_INIT;
+	DBusMessageIter msg_iter;
+	bool result;
+
+	result = true;
+	msg = NULL;
+
+	connection = dbus_bus_get(DBUS_BUS_SYSTEM, &error);
+	if (connection == NULL) {
+		LOG(LOG_ERR, "Unable to connect to D-Bus: %s\n", error.message);
+		result = false;
+	}
+
+	if (result) {
+		msg = dbus_message_new_method_call("uk.ac.cam.cl.pico.service", "/PicoObject", "uk.ac.cam.cl.pico.interface", "CancelAuth");
+		if (msg == NULL) {
+			LOG(LOG_ERR, "Could not allocate memory for message\n");
+			result = false;
+		}
+	}
+
+	if (result) {
+		dbus_message_iter_init_append(msg, &msg_iter);
+
+		result = dbus_message_iter_append_basic(&msg_iter, DBUS_TYPE_INT32, &handle);
+		result = result && dbus_message_iter_append_basic(&msg_iter, DBUS_TYPE_STRING, &code);
+		if (!result) {
+			LOG(LOG_ERR, "Not enough memory to add parameter to message\n");
+		}
+	}
+
+	if (result) {
+		dbus_message_set_no_reply(msg, TRUE);
+		result = dbus_connection_send(connection, msg, NULL);
+		if (!result) {
+			LOG(LOG_ERR, "Error sending D-Bus message\n");
+		}
+		dbus_connection_flush(connection);
+	}
+
+	if (msg) {
+		dbus_message_unref(msg);
+		msg = NULL;
+	}
+
+	if (connection) {
+		dbus_connection_unref(connection);
+		connection = NULL;
+	}
+
+	dbus_error_free(&error);
+}
+
 /**
  * @brief Provide details of the module and callbacks
  *
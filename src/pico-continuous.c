@@ -96,6 +96,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <syslog.h>
+#include <getopt.h>
 
 #include "pico/buffer.h"
 #include "pico/shared.h"
@@ -111,14 +112,87 @@
 
 #include "log.h"
 #include "processstore.h"
+#include "cryptopool.h"
+#include "keycache.h"
+#include "userscache.h"
+#include "locker.h"
+#include "lockwatcher.h"
+#include "rvpendpoints.h"
+#include "rvpwarmer.h"
+#include "authconfig.h"
 #include "gdbus-generated.h"
 
 // Defines
 
+/**
+ * @brief How often to check whether the service is idle, in seconds
+ */
+#define IDLE_CHECK_INTERVAL (10)
+
+/**
+ * @brief How long to wait with no sessions before exiting, in seconds
+ *
+ * The service is started on demand by D-Bus activation, so it can give its
+ * memory back between logins. This can be changed using --idle-timeout, and
+ * doesn't apply when pre-authenticating.
+ *
+ * Exiting loses the state built up across sessions: the service identity
+ * keys and paired users held by the KeyCache and UsersCache, the
+ * Rendezvous Point performance figures in the RvpEndpoints, the warm
+ * connections held by the RvpWarmer, and the activity the LockWatcher has
+ * seen, so continuous sessions revert to their default heartbeats until
+ * users next lock or unlock.
+ */
+#define IDLE_TIMEOUT_DEFAULT (300)
+
+/**
+ * @brief How long to keep handling calls after giving up the bus name
+ *
+ * Calls sent just before the name was released are still delivered to
+ * this instance, so they're given this many seconds to arrive before the
+ * service checks one last time whether it's idle.
+ */
+#define IDLE_DRAIN_INTERVAL (1)
+
+/**
+ * @brief The well-known name the service owns on the system bus
+ */
+#define SERVICE_BUS_NAME "uk.ac.cam.cl.pico.service"
+
 // Structure definitions
 
+/**
+ * @brief The state needed to exit the service once it's been idle
+ *
+ * The service exits once there have been no sessions in progress for
+ * timeout seconds. The idlesince field holds the time the service was
+ * first seen to be idle, in microseconds on the monotonic clock, or zero
+ * if it's busy. The ownerid field holds the id returned when owning the
+ * bus name, or zero while the name is released.
+ */
+typedef struct _IdleExit {
+	ProcessStore * processstoredata;
+	GMainLoop * loop;
+	int timeout;
+	gint64 idlesince;
+	guint ownerid;
+} IdleExit;
+
 // Function prototypes
 
+static void warm_configured(RvpWarmer * rvpwarmer);
+static gboolean idle_check(gpointer user_data);
+static gboolean idle_drained(gpointer user_data);
+static void help();
+
+// Static variables
+
+/**
+ * @brief The time the service started, in microseconds on the monotonic
+ * clock, used to report how long it took to become ready
+ */
+static gint64 starttime = 0;
+
 // Function definitions
 
 /**
@@ -169,6 +243,97 @@ static gboolean on_handle_complete_auth(PicoUkAcCamClPicoInterface * object, GDB
 	return result;
 }
 
+/**
+ * Handle the message to resume an authentication when it's received over
+ * dbus.
+ *
+ * @param object the dbus proxy object
+ * @param invocation the dbus method invocation object
+ * @param handle the handle of the authentication to resume
+ * @param arg_username the authenticating user
+ * @param arg_code the code returned when the authentication started
+ * @param user_data the user data passed to the signal connect
+ * @return TRUE if the function completed successfully
+ */
+static gboolean on_handle_resume_auth(PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, gint handle, const gchar * arg_username, const gchar * arg_code, gpointer user_data) {
+	ProcessStore * processstoredata = (ProcessStore *)user_data;
+	bool result;
+
+	syslog(LOG_INFO, "Resume auth\n");
+
+	result = resume_auth(processstoredata, object, invocation, handle, arg_username, arg_code);
+
+	return result;
+}
+
+/**
+ * Handle the message to cancel an authentication when it's received over
+ * dbus.
+ *
+ * @param object the dbus proxy object
+ * @param invocation the dbus method invocation object
+ * @param handle the handle of the authentication to cancel
+ * @param arg_code the code returned when the authentication started
+ * @param user_data the user data passed to the signal connect
+ * @return TRUE if the function completed successfully
+ */
+static gboolean on_handle_cancel_auth(PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, gint handle, const gchar * arg_code, gpointer user_data) {
+	ProcessStore * processstoredata = (ProcessStore *)user_data;
+	bool result;
+
+	syslog(LOG_INFO, "Cancel auth\n");
+
+	result = cancel_auth(processstoredata, object, invocation, handle, arg_code);
+
+	return result;
+}
+
+/**
+ * Handle the pairing message when it's received over dbus.
+ *
+ * @param object the dbus proxy object
+ * @param invocation the dbus method invocation object
+ * @param arg_username the user to pair
+ * @param arg_password the user's password
+ * @param arg_parameters json encoded paramter list
+ * @param user_data the user data passed to the signal connect
+ * @return TRUE if the function completed successfully
+ */
+static gboolean on_handle_start_pair(PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, const gchar * arg_username, const gchar * arg_password, const gchar * arg_parameters, gpointer user_data) {
+	ProcessStore * processstoredata = (ProcessStore *)user_data;
+	bool result;
+
+	syslog(LOG_INFO, "Start pair\n");
+	syslog(LOG_INFO, "Unique name: %s\n", g_dbus_method_invocation_get_sender(invocation));
+
+	start_pair(processstoredata, object, invocation, arg_username, arg_password, arg_parameters);
+	result = TRUE;
+
+	return result;
+}
+
+/**
+ * Handle the pairing completion message when it's received over dbus.
+ *
+ * @param object the dbus proxy object
+ * @param invocation the dbus method invocation object
+ * @param handle the handle returned by StartPair
+ * @param user_data the user data passed to the signal connect
+ * @return TRUE if the function completed successfully
+ */
+static gboolean on_handle_complete_pair(PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, gint handle, gpointer user_data) {
+	ProcessStore * processstoredata = (ProcessStore *)user_data;
+	bool result;
+
+	syslog(LOG_INFO, "Complete pair\n");
+	syslog(LOG_INFO, "Unique name: %s\n", g_dbus_method_invocation_get_sender(invocation));
+
+	complete_pair(processstoredata, object, invocation, handle);
+	result = TRUE;
+
+	return result;
+}
+
 /**
  * Handle the dbus exit signal.
  *
@@ -262,6 +427,14 @@ static void on_bus_acquired(GDBusConnection * connection, const gchar * name, gp
 
 	g_signal_connect(interface, "handle-complete-auth", G_CALLBACK(on_handle_complete_auth), user_data);
 
+	g_signal_connect(interface, "handle-resume-auth", G_CALLBACK(on_handle_resume_auth), user_data);
+
+	g_signal_connect(interface, "handle-cancel-auth", G_CALLBACK(on_handle_cancel_auth), user_data);
+
+	g_signal_connect(interface, "handle-start-pair", G_CALLBACK(on_handle_start_pair), user_data);
+
+	g_signal_connect(interface, "handle-complete-pair", G_CALLBACK(on_handle_complete_pair), user_data);
+
 	g_signal_connect(interface, "handle-exit", G_CALLBACK(on_handle_exit), user_data);
 
 	g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(interface), connection, "/PicoObject", & error);
@@ -280,6 +453,7 @@ static void on_bus_acquired(GDBusConnection * connection, const gchar * name, gp
  */
 static void on_name_acquired(GDBusConnection * connection, const gchar * name, gpointer user_data) {
 	syslog(LOG_INFO, "Acquired name: %s\n", name);
+	syslog(LOG_INFO, "Ready %" G_GINT64_FORMAT " ms after starting\n", (g_get_monotonic_time() - starttime) / 1000);
 }
 
 /**
@@ -293,6 +467,133 @@ static void on_name_lost(GDBusConnection * connection, const gchar * name, gpoin
 	syslog(LOG_INFO, "Lost name: %s\n", name);
 }
 
+/**
+ * Start warming up connections to the Rendezvous Points in the default
+ * configuration, so that the first authentication after the service starts
+ * doesn't have to wait for them. Rendezvous Points configured elsewhere
+ * are added as the sessions that use them start.
+ *
+ * @param rvpwarmer The object to warm the connections with.
+ */
+static void warm_configured(RvpWarmer * rvpwarmer) {
+	AuthConfig * authconfig;
+	Buffer * filename;
+	AUTHCHANNEL channeltype;
+
+	authconfig = authconfig_new();
+	filename = buffer_new(0);
+	buffer_append_buffer(filename, authconfig_get_configdir(authconfig));
+	buffer_append_string(filename, CONFIG_FILE);
+
+	if (authconfig_load_json(authconfig, buffer_get_buffer(filename))) {
+		channeltype = authconfig_get_channeltype(authconfig);
+		if ((channeltype == AUTHCHANNEL_RVP) || (channeltype == AUTHCHANNEL_RACE)) {
+			rvpwarmer_add(rvpwarmer, buffer_get_buffer(authconfig_get_rvpurl(authconfig)));
+		}
+	}
+	else {
+		syslog(LOG_ERR, "Failed to load config to warm Rendezvous Points\n");
+	}
+
+	buffer_delete(filename);
+	authconfig_delete(authconfig);
+}
+
+/**
+ * Callback triggered periodically to check whether the service has been
+ * idle for long enough to exit. When started by D-Bus activation, the
+ * service is started again the next time it's needed.
+ *
+ * @param user_data The IdleExit structure.
+ * @return TRUE to continue checking, FALSE once the service is exiting.
+ */
+static gboolean idle_check(gpointer user_data) {
+	IdleExit * idleexit = (IdleExit *)user_data;
+	gint64 now;
+	gboolean result;
+
+	result = TRUE;
+	now = g_get_monotonic_time();
+	if (processstore_is_idle(idleexit->processstoredata)) {
+		if (idleexit->idlesince == 0) {
+			idleexit->idlesince = now;
+		}
+		else if ((now - idleexit->idlesince) >= ((gint64)idleexit->timeout * G_USEC_PER_SEC)) {
+			// Give up the name first, so that new calls start a new
+			// instance, then let any calls already sent here arrive
+			syslog(LOG_INFO, "Idle for %d seconds, releasing name\n", idleexit->timeout);
+			g_bus_unown_name(idleexit->ownerid);
+			idleexit->ownerid = 0;
+			g_timeout_add_seconds(IDLE_DRAIN_INTERVAL, idle_drained, idleexit);
+			result = FALSE;
+		}
+	}
+	else {
+		idleexit->idlesince = 0;
+	}
+
+	return result;
+}
+
+/**
+ * Callback triggered once the bus name has been released and calls sent
+ * before then have had time to arrive. Anything still queued is handled,
+ * and the service exits if it's still idle. If one of the calls started a
+ * session, the name is owned again and the service carries on as normal.
+ * The object exported on the bus is kept throughout, so only the name
+ * needs owning again.
+ *
+ * @param user_data The IdleExit structure.
+ * @return FALSE, since this is only triggered once.
+ */
+static gboolean idle_drained(gpointer user_data) {
+	IdleExit * idleexit = (IdleExit *)user_data;
+
+	while (g_main_context_iteration(NULL, FALSE)) {
+		// Dispatch everything that's ready
+	}
+
+	if (processstore_is_idle(idleexit->processstoredata)) {
+		syslog(LOG_INFO, "Idle for %d seconds, exiting\n", idleexit->timeout);
+		g_main_loop_quit(idleexit->loop);
+	}
+	else {
+		syslog(LOG_INFO, "Session started while releasing name, staying\n");
+		idleexit->ownerid = g_bus_own_name(G_BUS_TYPE_SYSTEM, SERVICE_BUS_NAME, G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT | G_BUS_NAME_OWNER_FLAGS_REPLACE, NULL, on_name_acquired, on_name_lost, NULL, NULL);
+		idleexit->idlesince = 0;
+		g_timeout_add_seconds(IDLE_CHECK_INTERVAL, idle_check, idleexit);
+	}
+
+	return FALSE;
+}
+
+/**
+ * Callback triggered when a user's session locks or goes idle, or comes
+ * back. The user's continuous sessions adjust their heartbeat interval to
+ * match and, if pre-authenticating, a speculative session is started or
+ * stopped for the user so that they can unlock as soon as their Pico finds
+ * it.
+ *
+ * @param lockwatcher The LockWatcher reporting the change.
+ * @param username The user owning the session.
+ * @param away true if the session locked or went idle, false o/w.
+ * @param user_data The ProcessStore to start the session in.
+ */
+static void on_away_changed(LockWatcher * lockwatcher, char const * username, bool away, void * user_data) {
+	ProcessStore * processstoredata = (ProcessStore *)user_data;
+
+	processstore_away(processstoredata, username, away);
+}
+
+/**
+ * Output the command line usage.
+ */
+static void help() {
+	printf("Syntax: pico-continuous [--idle-timeout=SECONDS] [--preauth]\n");
+	printf("\t--idle-timeout=SECONDS: exit after SECONDS with no sessions in progress (default %d, 0 to never exit).\n", IDLE_TIMEOUT_DEFAULT);
+	printf("\t--preauth: start authenticating users as soon as their sessions lock or go idle (implies --idle-timeout=0).\n");
+}
+
 /**
  * Main; the entry point of the service.
  *
@@ -302,20 +603,117 @@ static void on_name_lost(GDBusConnection * connection, const gchar * name, gpoin
  */
 gint main(gint argc, gchar * argv[]) {
 	GMainLoop * loop;
-	guint id;
 	ProcessStore * processstoredata;
+	CryptoPool * cryptopool;
+	KeyCache * keycache;
+	UsersCache * userscache;
+	Locker * locker;
+	RvpEndpoints * rvpendpoints;
+	RvpWarmer * rvpwarmer;
+	LockWatcher * lockwatcher;
+	bool watchactivity;
+	IdleExit idleexit;
+	int c;
+	int option_index;
+	int idletimeout;
+	bool preauth;
+
+	starttime = g_get_monotonic_time();
+
+	// Parse arguments
+	static struct option long_options[] = {
+		{"idle-timeout", required_argument, 0, 'i'},
+		{"preauth", no_argument, 0, 'p'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	idletimeout = IDLE_TIMEOUT_DEFAULT;
+	preauth = false;
+	c = 0;
+	for (option_index = 0; c != -1;) {
+		opterr = 0;
+		c = getopt_long (argc, argv, "i:ph", long_options, &option_index);
+
+		switch (c) {
+			case 'i':
+				idletimeout = atoi(optarg);
+				break;
+			case 'p':
+				preauth = true;
+				break;
+			case -1:
+				// Do nothing
+				break;
+			default:
+				help();
+				exit(EXIT_FAILURE);
+		};
+	}
 
 	loop = g_main_loop_new(NULL, FALSE);
 
+	// Process messages from Picos on worker threads, off the main loop
+	cryptopool = cryptopool_new(NULL);
+	syslog(LOG_INFO, "Using %d worker threads\n", cryptopool_get_threads(cryptopool));
+
+	// Keep the service identity keys loaded between sessions
+	keycache = keycache_new();
+
+	// Keep the paired users loaded between sessions
+	userscache = userscache_new();
+
+	// Lock sessions without blocking the main loop
+	locker = locker_new();
+
+	// Track the performance of the Rendezvous Points across sessions
+	rvpendpoints = rvpendpoints_new();
+
+	// Resolve and connect to the Rendezvous Points before they're needed
+	rvpwarmer = rvpwarmer_new();
+	rvpwarmer_set_endpoints(rvpwarmer, rvpendpoints);
+	warm_configured(rvpwarmer);
+
 	processstoredata = processstore_new();
 	processstore_set_loop(processstoredata, loop);
+	processstore_set_cryptopool(processstoredata, cryptopool);
+	processstore_set_keycache(processstoredata, keycache);
+	processstore_set_userscache(processstoredata, userscache);
+	processstore_set_locker(processstoredata, locker);
+	processstore_set_rvpendpoints(processstoredata, rvpendpoints);
+	processstore_set_rvpwarmer(processstoredata, rvpwarmer);
+
+	// Bluetooth is initialised by the ProcessStore when a session needs it
+
+	// Start sessions speculatively when users lock their screens. The
+	// settings to use are only known to the running service, so it mustn't
+	// exit while idle
+	if (preauth) {
+		if (idletimeout > 0) {
+			syslog(LOG_INFO, "Pre-authenticating, so ignoring the idle timeout\n");
+			idletimeout = 0;
+		}
+		processstore_set_preauth(processstoredata, TRUE);
+	}
 
-	// Initialise Bluetooth
-	syslog(LOG_INFO, "Initialising Bluetooth\n");
-	bt_init();
+	// Follow users' activity, so continuous sessions can adapt their
+	// heartbeats and speculative sessions can be started. Heartbeats can
+	// only adapt if libpico lets the state machine's timeouts be changed
+	watchactivity = preauth;
+#if defined(HAVE_FSMSERVICE_SET_CUSTOM_TIMEOUT)
+	watchactivity = TRUE;
+#endif
+	lockwatcher = NULL;
+	if (watchactivity) {
+		lockwatcher = lockwatcher_new();
+		lockwatcher_set_changed_callback(lockwatcher, on_away_changed, processstoredata);
+		if (lockwatcher_start(lockwatcher) == false) {
+			syslog(LOG_ERR, "Failed to watch sessions, user activity will be ignored\n");
+		}
+	}
 
 	syslog(LOG_INFO, "Requesting to own bus\n");
-	id = g_bus_own_name(G_BUS_TYPE_SYSTEM, "uk.ac.cam.cl.pico.service", G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT | G_BUS_NAME_OWNER_FLAGS_REPLACE, on_bus_acquired, on_name_acquired, on_name_lost, (void *)processstoredata, NULL);
+	idleexit.ownerid = g_bus_own_name(G_BUS_TYPE_SYSTEM, SERVICE_BUS_NAME, G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT | G_BUS_NAME_OWNER_FLAGS_REPLACE, on_bus_acquired, on_name_acquired, on_name_lost, (void *)processstoredata, NULL);
 	
 	// TODO: Check interaction with signals
 	// See g_unix_signal_add()
@@ -325,20 +723,36 @@ gint main(gint argc, gchar * argv[]) {
 	// http://gtk.10911.n7.nabble.com/Unix-signals-in-GLib-td29344.html
 
 
+	// Exit once idle if requested, relying on D-Bus activation to start
+	// the service again when it's next needed
+	if (idletimeout > 0) {
+		idleexit.processstoredata = processstoredata;
+		idleexit.loop = loop;
+		idleexit.timeout = idletimeout;
+		idleexit.idlesince = 0;
+		g_timeout_add_seconds(IDLE_CHECK_INTERVAL, idle_check, & idleexit);
+		syslog(LOG_INFO, "Exiting after %d seconds idle\n", idletimeout);
+	}
+
 	syslog(LOG_INFO, "Entering main loop\n");
 	g_main_loop_run(loop);
 
 	syslog(LOG_INFO, "Exited main loop\n");	
-	g_bus_unown_name(id);
+	if (idleexit.ownerid != 0) {
+		g_bus_unown_name(idleexit.ownerid);
+	}
+	lockwatcher_delete(lockwatcher);
 	g_main_loop_unref(loop);
 
-	// Deinitialise Bluetooth
-	syslog(LOG_INFO, "Deinit Bluetooth\n");
-	bt_exit();
-
 	syslog(LOG_INFO, "The End\n");
 
 	processstore_delete(processstoredata);
+	cryptopool_delete(cryptopool);
+	keycache_delete(keycache);
+	userscache_delete(userscache);
+	locker_delete(locker);
+	rvpwarmer_delete(rvpwarmer);
+	rvpendpoints_delete(rvpendpoints);
 
 	return 0;
 }
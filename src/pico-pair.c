@@ -66,16 +66,17 @@
 #include <picobt/devicelist.h>
 #include <security/pam_appl.h>
 #include <security/pam_misc.h>
+#include <gio/gio.h>
 #include <gtk/gtk.h>
 #include <qrencode.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 
+#include "usersjournal.h"
+
 // Defines
 
 #define PUB_FILE "pico_pub_key.der"
 #define PRIV_FILE "pico_priv_key.der"
-#define USERS_FILE "users.txt"
-#define BT_ADDRESS_FILE "bluetooth.txt"
 #define LOCK_FILE ".lock"
 
 // This should now be defined by the automake file
@@ -92,8 +93,30 @@
 #define QR_SCALE (6)
 #define QR_BORDER (4)
 
+// The number of users paired at the same time in batch mode by default
+#define BATCH_JOBS (16)
+
+// The pico-continuous service, which pairs users itself if it's running
+#define SERVICE_NAME "uk.ac.cam.cl.pico.service"
+#define SERVICE_PATH "/PicoObject"
+#define SERVICE_INTERFACE "uk.ac.cam.cl.pico.interface"
+
+// The time in milliseconds to wait for the service to generate the code
+#define SERVICE_START_TIMEOUT (60000)
+
 // Structure definitions
 
+/**
+ * @brief The outcome of asking pico-continuous to start pairing a user
+ *
+ * If the service can't be reached the user is paired locally instead.
+ */
+typedef enum _PAIRSERVICE {
+	PAIRSERVICE_UNAVAILABLE,
+	PAIRSERVICE_FAILED,
+	PAIRSERVICE_STARTED
+} PAIRSERVICE;
+
 typedef struct _GuiData {
 	bool scancomplete;
 	GtkBuilder * xml;
@@ -106,27 +129,59 @@ typedef struct _GuiData {
 	Buffer * password_ciphertext;
 	int verbose;
 	GString * code;
-	Users * users;
 	Buffer * symmetric_key;
-	bt_device_list_t * device_list;
 	GtkWidget * cancel;
 	bool keypressed;
 	GString * datadir;
 	GString * keydir;
 	bool result;
+	PAIRSERVICE service;
+	GDBusConnection * connection;
+	int handle;
 } GuiData;
 
+/**
+ * @brief A user to be paired in batch mode
+ */
+typedef struct _BatchUser {
+	GString * username;
+	GString * password;
+} BatchUser;
+
+/**
+ * @brief The context shared by the pairing threads in batch mode
+ *
+ * The mutex protects the users journal, the paired count and stdout.
+ */
+typedef struct _BatchData {
+	char const * hostname;
+	char const * keydir;
+	char const * qrdir;
+	int verbose;
+	UsersJournal * users_journal;
+	int paired;
+	GMutex mutex;
+} BatchData;
+
 // Function prototypes
 
 void help();
 bool create_config_dir(char const * keydir);
 char * config_file_full_path(char const * root, char const * leaf);
+static void compact_journal(char const * keydir);
 bool check_user_password(char const * user, char const * pass);
 void set_echo(bool enable);
 bool show_qr_code(char * qrtext, void * localdata);
 bool feedback_trigger(Feedback const * feedback, void * data);
 bool command_line(char const * username, char const * hostname, int verbose, char const * keydir);
+static PAIRSERVICE service_start_pair(char const * username, char const * password, char const * keydir, GDBusConnection ** connection, int * handle, GString * code);
+static bool service_complete_pair(GDBusConnection * connection, int handle);
 bool gui(char const * username, char const * hostname, int verbose, char const * keydir, char const * datadir, int argc, char * argv[]);
+bool batch(char const * manifest, char const * hostname, int verbose, char const * keydir, char const * qrdir, int jobs);
+static GSList * batch_read_manifest(char const * manifest, int * count);
+static void batch_pair_user(gpointer data, gpointer user_data);
+static bool batch_write_qr(BatchData * batch_data, char const * username, char const * qrtext);
+static void batch_user_delete(gpointer data);
 static gboolean key_press(GtkWidget * widget, gpointer data);
 static gint next_page(gint current_page, gpointer data);
 bool check_user(GuiData * gui_data);
@@ -134,6 +189,8 @@ GuiData * guidata_new();
 void guidata_delete(GuiData * gui_data);
 bool gui_pair_setup(GuiData * gui_data);
 bool gui_pair_complete(GuiData * gui_data, Buffer * returned_stored_data);
+static bool gui_pair_local_setup(GuiData * gui_data);
+static bool gui_pair_local_complete(GuiData * gui_data, Buffer * returned_stored_data);
 void set_qr_code(GuiData * gui_data);
 void * thread_start_pair(void * t);
 void trigger_pair_thread(GuiData * gui_data);
@@ -171,6 +228,9 @@ int main(int argc, char * argv[]) {
 	bool use_gui;
 	char * datadir;
 	char * keydir;
+	char * manifest;
+	char * qrdir;
+	int jobs;
 
 	// Parse arguments
 	static struct option long_options[] = {
@@ -179,6 +239,9 @@ int main(int argc, char * argv[]) {
 		{"gui", no_argument, 0, 'g'},
 		{"datadir", required_argument, 0, 'd'},
 		{"keydir", required_argument, 0, 'k'},
+		{"batch", required_argument, 0, 'b'},
+		{"qrdir", required_argument, 0, 'q'},
+		{"jobs", required_argument, 0, 'j'},
 		{0, 0, 0, 0}
 	};
 
@@ -187,9 +250,12 @@ int main(int argc, char * argv[]) {
 	use_gui = false;
 	datadir = NULL;
 	keydir = NULL;
+	manifest = NULL;
+	qrdir = NULL;
+	jobs = BATCH_JOBS;
 	for (option_index = 0; c != -1;) {
 		opterr = 0;
-		c = getopt_long (argc, argv, "bu", long_options, &option_index);
+		c = getopt_long (argc, argv, "b:u", long_options, &option_index);
 		
 		switch (c) {
 			case 'u':
@@ -207,6 +273,18 @@ int main(int argc, char * argv[]) {
 			case 'k':
 				keydir = strdup(optarg);
 				break;
+			case 'b':
+				manifest = strdup(optarg);
+				break;
+			case 'q':
+				qrdir = strdup(optarg);
+				break;
+			case 'j':
+				jobs = atoi(optarg);
+				if (jobs < 1) {
+					jobs = 1;
+				}
+				break;
 			case -1:
 				// Do nothing
 				break;
@@ -252,7 +330,10 @@ int main(int argc, char * argv[]) {
 	}
 	
 	if (result == true) {
-		if (use_gui) {
+		if (manifest != NULL) {
+			result = batch(manifest, hostname, verbose, keydir, qrdir, jobs);
+		}
+		else if (use_gui) {
 			result = gui(username, hostname, verbose, keydir, datadir, argc, argv);
 		}
 		else {
@@ -263,6 +344,8 @@ int main(int argc, char * argv[]) {
 	free(username);
 	free(datadir);
 	free(keydir);
+	free(manifest);
+	free(qrdir);
 
 	return (result ? 0 : -1);
 }
@@ -356,6 +439,32 @@ char * config_file_full_path(char const * root, char const * leaf) {
 	return path;
 }
 
+/**
+ * Fold the users journal into the users and Bluetooth device files once
+ * pairing has finished, unless it's in the system configuration directory.
+ * The pico-continuous service compacts the journal there itself, but won't
+ * touch directories chosen by its callers, so without this their journals
+ * would grow with every pairing. This applies whether the user was added
+ * by pico-pair or by the service.
+ *
+ * @param keydir The directory containing the journal.
+ */
+static void compact_journal(char const * keydir) {
+	char * journal_dir;
+	UsersJournal * users_journal;
+
+	journal_dir = config_file_full_path(keydir, "");
+	if (strcmp(journal_dir, PICOKEYDIR "/") != 0) {
+		users_journal = usersjournal_new();
+		usersjournal_set_configdir(users_journal, journal_dir);
+		if (usersjournal_compact(users_journal) == false) {
+			printf("Error compacting the users journal\n");
+		}
+		usersjournal_delete(users_journal);
+	}
+	free(journal_dir);
+}
+
 
 ///////////////////////////////////////////////////////////////////////////
 // Command line functions
@@ -375,19 +484,19 @@ bool command_line(char const * username, char const * hostname, int verbose, cha
 	bool result;
 	char * pub;
 	char * priv;
-	char * users_file;
-	char * bt_devices_file;
-	Users * users;
-	USERFILE load_result;
+	UsersJournal * users_journal;
+	char * journal_dir;
 	char password[PASSWORD_MAX];
 	char * read;
 	Buffer * bt_addr_buffer;
-	bt_device_list_t * device_list;
-	bt_err_t bt_e;
 	int count_pass_tries;
 	Buffer * symmetric_key;
 	Buffer * password_cleartext;
 	Buffer * password_ciphertext;
+	PAIRSERVICE service;
+	GDBusConnection * connection;
+	GString * code;
+	int handle;
 
 	printf("Pico pairing user %s with host %s\n", username, hostname);
 
@@ -408,8 +517,6 @@ bool command_line(char const * username, char const * hostname, int verbose, cha
 		// Set up the paths to the public key, private key and user list files
 		pub = config_file_full_path(keydir, PUB_FILE);
 		priv = config_file_full_path(keydir, PRIV_FILE);
-		users_file = config_file_full_path(keydir, USERS_FILE);
-		bt_devices_file = config_file_full_path(keydir, BT_ADDRESS_FILE);
 		bt_addr_buffer = buffer_new(0);
 
 		shared = shared_new();
@@ -420,25 +527,11 @@ bool command_line(char const * username, char const * hostname, int verbose, cha
 		// ones otherwise
 		shared_load_or_generate_keys(shared, pub, priv);
 
-		users = users_new();
-
-		device_list = bt_list_new();
-
-		// Load in the user list files
-		load_result = users_load(users, users_file);
-		if ((load_result != USERFILE_SUCCESS) && (load_result != USERFILE_IOERROR)) {
-			printf("Error reading users file: %d\n", load_result);
-			result = false;
-		}
-
-		// Load the bluetooth address list
-		if (result) {
-			bt_e = bt_list_load(device_list, bt_devices_file);
-			if ((bt_e != BT_SUCCESS) && (bt_e != BT_ERR_FILE_NOT_FOUND)) {
-				printf("Error reading bluetooth address: %d\n", bt_e);
-				result = false;
-			}
-		}
+		// New users are appended to the journal, so the users file needn't be read
+		users_journal = usersjournal_new();
+		journal_dir = config_file_full_path(keydir, "");
+		usersjournal_set_configdir(users_journal, journal_dir);
+		free(journal_dir);
 
 		if (result == true) {
 			result = false;
@@ -466,19 +559,37 @@ bool command_line(char const * username, char const * hostname, int verbose, cha
 			} while (++count_pass_tries < 3 && !result);
 		}
 
+		service = PAIRSERVICE_UNAVAILABLE;
+		if (result == true) {
+			// If pico-continuous is running it pairs the user, so they can
+			// authenticate straight away
+			code = g_string_new("");
+			service = service_start_pair(username, password, keydir, &connection, &handle, code);
+			if (service == PAIRSERVICE_STARTED) {
+				show_qr_code(code->str, NULL);
+				result = service_complete_pair(connection, handle);
+				g_object_unref(connection);
+			}
+			else if (service == PAIRSERVICE_FAILED) {
+				printf("The Pico service could not start pairing.\n");
+				result = false;
+			}
+			g_string_free(code, TRUE);
+		}
+
 		symmetric_key = buffer_new(CRYPTOSUPPORT_AESKEY_SIZE);
 		password_cleartext = buffer_new(0);
 		password_ciphertext = buffer_new(0);
 
 		// Generate a symmetric key for the user
-		if (result == true) {
+		if ((result == true) && (service == PAIRSERVICE_UNAVAILABLE)) {
 			result = cryptosupport_generate_symmetric_key(symmetric_key, CRYPTOSUPPORT_AESKEY_SIZE);
 			if (result == false) {
 				printf("Failed to generate local symmetric key.\n");
 			}
 		}
 
-		if (result == true) {
+		if ((result == true) && (service == PAIRSERVICE_UNAVAILABLE)) {
 			buffer_clear(password_cleartext);
 			buffer_append_string(password_cleartext, password);
 			result = cryptosupport_encrypt_iv_base64(symmetric_key, password_cleartext, password_ciphertext);
@@ -487,25 +598,21 @@ bool command_line(char const * username, char const * hostname, int verbose, cha
 			}
 		}
 
-		if (result == true) {
+		if ((result == true) && (service == PAIRSERVICE_UNAVAILABLE)) {
 			buffer_append(password_ciphertext, "", 1);
 			// Actually enact the Pico pairing protocol
 			// Looping 45 times, this will keep the channel open for 30 minutes
 			result = pair_send_username_loop(shared, hostname, buffer_get_buffer(password_ciphertext), username, bt_addr_buffer, show_qr_code, NULL, 45);
 		}
 
-		if (result == true) {
-			// If everything went well, store the user in the list to allow authentication in future
-			users_add_user(users, username, shared_get_pico_identity_public_key(shared), symmetric_key);
-
-			// Export out the resulting user list file
-			load_result = users_export(users, users_file);
-			if (load_result != USERFILE_SUCCESS) {
-				printf("Error saving users file: %d\n", load_result);
-				result = false;
+		if ((result == true) && (service == PAIRSERVICE_UNAVAILABLE)) {
+			// If everything went well, store the user to allow authentication in future
+			result = usersjournal_append_user(users_journal, username, shared_get_pico_identity_public_key(shared), symmetric_key);
+			if (result == false) {
+				printf("Error saving user to the users journal\n");
 			}
 		}
-		else {
+		else if (result == false) {
 			printf("Pairing failed.\n");
 		}
 
@@ -514,36 +621,137 @@ bool command_line(char const * username, char const * hostname, int verbose, cha
 		buffer_delete(password_ciphertext);
 
 		if (result && buffer_get_pos(bt_addr_buffer)) {
-			bt_addr_t addr;
-			bt_str_to_addr(buffer_get_buffer(bt_addr_buffer), &addr);
 			// Save bluetooth address
-			bt_list_add_device(device_list, &addr);
-			bt_list_save(device_list, bt_devices_file);
+			usersjournal_append_device(users_journal, buffer_get_buffer(bt_addr_buffer));
 		}
 
 		if (result) {
+			compact_journal(keydir);
 			printf ("User %s successfully paired with %s\n", username, hostname);
 		}
 
 		// Tidy things up
 		buffer_delete(bt_addr_buffer);
-		bt_list_delete(device_list);
+		usersjournal_delete(users_journal);
 		shared_delete(shared);
 		free(pub);
 		free(priv);
-		free(users_file);
-		free(bt_devices_file);
 	}
 
 	return result;
 }
 
+/**
+ * Ask the pico-continuous service to start pairing a user. The service
+ * pairs the user using the keys it already has loaded, and adds them to
+ * its paired users as soon as the pairing completes, so they can
+ * authenticate straight away. The service only accepts the request from
+ * root, and checks neither the username nor the password.
+ *
+ * The connection must be kept open until service_complete_pair() has been
+ * called, since the service abandons the pairing if it's closed.
+ *
+ * @param username The user to pair.
+ * @param password The user's password, already checked.
+ * @param keydir The directory where user credentials are stored.
+ * @param connection Returns the connection to the service, which the
+ *        caller should unref once done, if the pairing started.
+ * @param handle Returns the handle to pass to service_complete_pair().
+ * @param code Returns the code to display to the user.
+ * @return PAIRSERVICE_STARTED if the service started the pairing,
+ *         PAIRSERVICE_FAILED if it couldn't, or PAIRSERVICE_UNAVAILABLE
+ *         if the service couldn't be reached.
+ */
+static PAIRSERVICE service_start_pair(char const * username, char const * password, char const * keydir, GDBusConnection ** connection, int * handle, GString * code) {
+	PAIRSERVICE result;
+	GError * error;
+	GVariant * reply;
+	Json * json;
+	Buffer * parameters;
+	gint32 reply_handle;
+	gchar * reply_code;
+	gboolean success;
+
+	result = PAIRSERVICE_UNAVAILABLE;
+	error = NULL;
+	reply = NULL;
+
+	*connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
+	if (*connection != NULL) {
+		parameters = buffer_new(0);
+		json = json_new();
+		json_add_string(json, "configdir", keydir);
+		json_serialize_buffer(json, parameters);
+		buffer_append(parameters, "", 1);
+		json_delete(json);
+
+		reply = g_dbus_connection_call_sync(*connection, SERVICE_NAME, SERVICE_PATH, SERVICE_INTERFACE, "StartPair", g_variant_new("(sss)", username, password, buffer_get_buffer(parameters)), G_VARIANT_TYPE("(isb)"), G_DBUS_CALL_FLAGS_NONE, SERVICE_START_TIMEOUT, NULL, &error);
+
+		buffer_delete(parameters);
+	}
+
+	if (reply != NULL) {
+		g_variant_get(reply, "(isb)", &reply_handle, &reply_code, &success);
+		if (success) {
+			*handle = reply_handle;
+			g_string_assign(code, reply_code);
+			result = PAIRSERVICE_STARTED;
+		}
+		else {
+			result = PAIRSERVICE_FAILED;
+		}
+		g_free(reply_code);
+		g_variant_unref(reply);
+	}
+	else {
+		printf("Pico service unavailable (%s), pairing locally.\n", error->message);
+		g_error_free(error);
+	}
+
+	if ((result != PAIRSERVICE_STARTED) && (*connection != NULL)) {
+		g_object_unref(*connection);
+		*connection = NULL;
+	}
+
+	return result;
+}
+
+/**
+ * Wait for a pairing started by service_start_pair() to complete. This
+ * blocks until the Pico has paired, or the service gives up waiting for it.
+ *
+ * @param connection The connection the pairing was started on.
+ * @param handle The handle of the pairing.
+ * @return true if the user was paired and added by the service, false o/w.
+ */
+static bool service_complete_pair(GDBusConnection * connection, int handle) {
+	GError * error;
+	GVariant * reply;
+	gboolean success;
+
+	error = NULL;
+	success = FALSE;
+
+	reply = g_dbus_connection_call_sync(connection, SERVICE_NAME, SERVICE_PATH, SERVICE_INTERFACE, "CompletePair", g_variant_new("(i)", handle), G_VARIANT_TYPE("(b)"), G_DBUS_CALL_FLAGS_NONE, G_MAXINT, NULL, &error);
+
+	if (reply != NULL) {
+		g_variant_get(reply, "(b)", &success);
+		g_variant_unref(reply);
+	}
+	else {
+		printf("Error completing pairing: %s\n", error->message);
+		g_error_free(error);
+	}
+
+	return success;
+}
+
 /**
  * Display some helpful text to stdout.
  */
 void help() {
 	printf("Pico pairing tool, for pairng a Pico with a computer\n");
-	printf("Syntax: pico-pair [--help] [--user <username>] [--verbose] [--gui] [--datadir <path>] [--keydir <path>]\n");
+	printf("Syntax: pico-pair [--help] [--user <username>] [--verbose] [--gui] [--datadir <path>] [--keydir <path>] [--batch <file> [--qrdir <path>] [--jobs <number>]]\n");
 	printf("\n");
 	printf("Parameters:\n");
 	printf("\thelp - display this help text.\n");
@@ -553,6 +761,9 @@ void help() {
 	printf("\tgui - run with a graphical user interface, rather than command line.\n");
 	printf("\tkeydir <path> - directory to store the credentials in (default %s).\n", PICOKEYDIR);
 	printf("\tdatadir <path> - directory to load assets from (default %s).\n", PICOPAIRDIR);
+	printf("\tbatch <file> - pair the users listed as username:password lines in the file (- for stdin).\n");
+	printf("\tqrdir <path> - in batch mode, write each user's QR code text to <path>/<username>.qr rather than stdout.\n");
+	printf("\tjobs <number> - in batch mode, the number of users to pair at the same time (default %d).\n", BATCH_JOBS);
 
 	printf("Example:\n");
 	printf("\tpico-user --user $USER\n");
@@ -680,6 +891,361 @@ bool feedback_trigger(Feedback const * feedback, void * data) {
 }
 
 
+///////////////////////////////////////////////////////////////////////////
+// Batch functions
+
+/**
+ * Pair the users listed in a manifest without any interaction. Each line of
+ * the manifest has the form username:password, in the same way as for
+ * chpasswd(8). Blank lines and lines starting with # are ignored.
+ *
+ * The passwords are checked first, then a pairing QR code is generated for
+ * each user and written to the output directory (or stdout) so that it can
+ * be distributed to the user. Up to jobs pairings are run at the same
+ * time. Once they've all finished, the successfully paired users are added
+ * to the users journal in a single commit.
+ *
+ * @param manifest The file to read the users from, or "-" for stdin.
+ * @param hostname The name of the host to pair with.
+ * @param verbose The level of verbosity to use.
+ * @param keydir The directory where user credentials are stored.
+ * @param qrdir The directory to write the QR code payloads to, or NULL to
+ *        write them to stdout.
+ * @param jobs The maximum number of pairings to run at the same time.
+ * @return true if every user in the manifest was paired.
+ */
+bool batch(char const * manifest, char const * hostname, int verbose, char const * keydir, char const * qrdir, int jobs) {
+	bool result;
+	BatchData batch_data;
+	GSList * batch_users;
+	GSList * batch_user;
+	GThreadPool * pool;
+	Shared * shared;
+	char * pub;
+	char * priv;
+	char * journal_dir;
+	int count;
+	gint64 start;
+	double elapsed;
+
+	batch_users = NULL;
+	count = 0;
+
+	result = check_write_keydir(keydir);
+	if (result == false) {
+		printf("\nYou do not have permissions to write to the key directory \"%s\".\nYou may need to run pico-pair as root.\n", keydir);
+	}
+
+	if (result == true) {
+		result = set_permissions_keydir(keydir);
+		if (result == false) {
+			printf("\nCould not set permissions on the key directory \"%s\": %s\nYou may need to run pico-pair as root.\n", keydir, strerror(errno));
+		}
+	}
+
+	if (result == true) {
+		batch_users = batch_read_manifest(manifest, &count);
+		result = (count > 0);
+		if (result == false) {
+			printf("No users to pair in %s\n", manifest);
+		}
+	}
+
+	if (result == true) {
+		// Generate the service's identity keys now if needed, rather than
+		// having the pairing threads race to do it
+		pub = config_file_full_path(keydir, PUB_FILE);
+		priv = config_file_full_path(keydir, PRIV_FILE);
+		shared = shared_new();
+		shared_load_or_generate_keys(shared, pub, priv);
+		shared_delete(shared);
+		free(pub);
+		free(priv);
+
+		batch_data.hostname = hostname;
+		batch_data.keydir = keydir;
+		batch_data.qrdir = qrdir;
+		batch_data.verbose = verbose;
+		batch_data.users_journal = usersjournal_new();
+		journal_dir = config_file_full_path(keydir, "");
+		usersjournal_set_configdir(batch_data.users_journal, journal_dir);
+		free(journal_dir);
+		batch_data.paired = 0;
+		g_mutex_init(&batch_data.mutex);
+
+		printf("Pico pairing %d users with host %s\n", count, hostname);
+
+		start = g_get_monotonic_time();
+		pool = g_thread_pool_new(batch_pair_user, &batch_data, jobs, TRUE, NULL);
+		for (batch_user = batch_users; batch_user != NULL; batch_user = batch_user->next) {
+			g_thread_pool_push(pool, batch_user->data, NULL);
+		}
+		// Wait for all of the pairings to finish
+		g_thread_pool_free(pool, FALSE, TRUE);
+		elapsed = (g_get_monotonic_time() - start) / (double)G_USEC_PER_SEC;
+
+		// Add all of the paired users in one go
+		result = usersjournal_commit(batch_data.users_journal);
+		if (result == false) {
+			printf("Error saving users to the users journal\n");
+		}
+		else {
+			compact_journal(keydir);
+			printf("Paired %d of %d users in %.1f seconds (%.1f users per minute)\n", batch_data.paired, count, elapsed, (elapsed > 0.0) ? (batch_data.paired * 60.0 / elapsed) : 0.0);
+			result = (batch_data.paired == count);
+		}
+
+		g_mutex_clear(&batch_data.mutex);
+		usersjournal_delete(batch_data.users_journal);
+	}
+
+	g_slist_free_full(batch_users, batch_user_delete);
+
+	return result;
+}
+
+/**
+ * Read the users to pair from a manifest, checking each user's password.
+ * Users whose password is wrong are reported and left out.
+ *
+ * @param manifest The file to read the users from, or "-" for stdin.
+ * @param count Returns the number of users to pair.
+ * @return A list of BatchUser structures, owned by the caller.
+ */
+static GSList * batch_read_manifest(char const * manifest, int * count) {
+	FILE * file;
+	char line[USERNAME_MAX + PASSWORD_MAX + 2];
+	char * separator;
+	size_t length;
+	BatchUser * batch_user;
+	GSList * batch_users;
+
+	batch_users = NULL;
+	*count = 0;
+
+	if (strcmp(manifest, "-") == 0) {
+		file = stdin;
+	}
+	else {
+		file = fopen(manifest, "r");
+		if (file == NULL) {
+			printf("Could not open manifest %s: %s\n", manifest, strerror(errno));
+		}
+	}
+
+	while ((file != NULL) && (fgets(line, sizeof(line), file) != NULL)) {
+		// Remove newline ending
+		length = strlen(line);
+		if ((length > 0) && (line[length - 1] == '\n')) {
+			line[length - 1] = '\0';
+		}
+
+		separator = strchr(line, ':');
+		if ((line[0] != '\0') && (line[0] != '#')) {
+			if ((separator == NULL) || (separator == line)) {
+				printf("Skipping malformed manifest line\n");
+			}
+			else {
+				*separator = '\0';
+				if (check_user_password(line, separator + 1)) {
+					batch_user = calloc(sizeof(BatchUser), 1);
+					batch_user->username = g_string_new(line);
+					batch_user->password = g_string_new(separator + 1);
+					batch_users = g_slist_prepend(batch_users, batch_user);
+					(*count)++;
+				}
+				else {
+					printf("Password for user %s is not valid, skipping.\n", line);
+				}
+			}
+		}
+		// Don't leave passwords lying around in memory
+		memset(line, 0, sizeof(line));
+	}
+
+	if ((file != NULL) && (file != stdin)) {
+		fclose(file);
+	}
+
+	return g_slist_reverse(batch_users);
+}
+
+/**
+ * Pair a single user from the manifest. This is called on one of the
+ * batch thread pool's threads, and blocks until the pairing completes or
+ * times out.
+ *
+ * @param data The BatchUser to pair.
+ * @param user_data The BatchData shared by all of the pairings.
+ */
+static void batch_pair_user(gpointer data, gpointer user_data) {
+	BatchUser * batch_user = (BatchUser *)data;
+	BatchData * batch_data = (BatchData *)user_data;
+	bool result;
+	Shared * shared;
+	RVPChannel * channel;
+	char * pub;
+	char * priv;
+	Buffer * symmetric_key;
+	Buffer * password_cleartext;
+	Buffer * password_ciphertext;
+	Buffer * extra_data;
+	Buffer * returned_stored_data;
+	Buffer * url;
+	Json * extra_data_json;
+	KeyPairing * key_pairing;
+	size_t size;
+	char * qrtext;
+	int i;
+
+	pub = config_file_full_path(batch_data->keydir, PUB_FILE);
+	priv = config_file_full_path(batch_data->keydir, PRIV_FILE);
+	symmetric_key = buffer_new(CRYPTOSUPPORT_AESKEY_SIZE);
+	password_cleartext = buffer_new(0);
+	password_ciphertext = buffer_new(0);
+	extra_data = buffer_new(0);
+	returned_stored_data = buffer_new(0);
+	url = buffer_new(0);
+	channel = NULL;
+
+	shared = shared_new();
+	shared_set_feedback_trigger(shared, feedback_trigger, &batch_data->verbose);
+	shared_load_or_generate_keys(shared, pub, priv);
+
+	// Generate a symmetric key for the user and encrypt their password with it
+	result = cryptosupport_generate_symmetric_key(symmetric_key, CRYPTOSUPPORT_AESKEY_SIZE);
+	if (result == true) {
+		buffer_append_string(password_cleartext, batch_user->password->str);
+		result = cryptosupport_encrypt_iv_base64(symmetric_key, password_cleartext, password_ciphertext);
+		buffer_append(password_ciphertext, "", 1);
+	}
+
+	if (result == true) {
+		extra_data_json = json_new();
+		json_add_string(extra_data_json, "data", buffer_get_buffer(password_ciphertext));
+		json_add_string(extra_data_json, "name", batch_user->username->str);
+		json_serialize_buffer(extra_data_json, extra_data);
+		buffer_append(extra_data, "", 1);
+		json_delete(extra_data_json);
+
+		// Request a new rendezvous channel
+		channel = channel_new();
+		channel_get_url(channel, url);
+		result = (buffer_get_pos(url) > 0);
+	}
+
+	if (result == true) {
+		// Generate the Key Pairing code for the user to scan
+		key_pairing = keypairing_new();
+		keypairing_set(key_pairing, url, "", NULL, batch_data->hostname, shared_get_service_identity_key(shared));
+		size = keypairing_serialize_size(key_pairing);
+		qrtext = MALLOC(size + 1);
+		keypairing_serialize(key_pairing, qrtext, size + 1);
+		keypairing_delete(key_pairing);
+
+		result = batch_write_qr(batch_data, batch_user->username->str, qrtext);
+		FREE(qrtext);
+	}
+
+	if (result == true) {
+		// Looping 45 times, this will keep the channel open for 30 minutes
+		result = false;
+		for (i = 0; i < 45 && !result; i++) {
+			result = sigmaverifier(shared, channel, NULL, buffer_get_buffer(extra_data), returned_stored_data, NULL);
+		}
+	}
+
+	g_mutex_lock(&batch_data->mutex);
+	if (result == true) {
+		// Queue the user, to be committed along with the rest of the batch
+		result = usersjournal_queue_user(batch_data->users_journal, batch_user->username->str, shared_get_pico_identity_public_key(shared), symmetric_key);
+	}
+	if (result && buffer_get_pos(returned_stored_data)) {
+		usersjournal_queue_device(batch_data->users_journal, buffer_get_buffer(returned_stored_data));
+	}
+	if (result == true) {
+		batch_data->paired++;
+		printf("User %s successfully paired with %s\n", batch_user->username->str, batch_data->hostname);
+	}
+	else {
+		printf("User %s pairing failed with %s\n", batch_user->username->str, batch_data->hostname);
+	}
+	g_mutex_unlock(&batch_data->mutex);
+
+	if (channel != NULL) {
+		channel_delete(channel);
+	}
+	shared_delete(shared);
+	buffer_delete(url);
+	buffer_delete(returned_stored_data);
+	buffer_delete(extra_data);
+	buffer_delete(password_ciphertext);
+	buffer_delete(password_cleartext);
+	buffer_delete(symmetric_key);
+	free(pub);
+	free(priv);
+}
+
+/**
+ * Write out the Key Pairing code for a user, so that it can be distributed
+ * to them to scan with their Pico app. If an output directory was given
+ * the code is written to a file named after the user, otherwise it's
+ * written to stdout on a line starting with the username.
+ *
+ * @param batch_data The BatchData shared by all of the pairings.
+ * @param username The user the code is for.
+ * @param qrtext The text to be encoded in the QR code.
+ * @return true if the code was written successfully, false o/w.
+ */
+static bool batch_write_qr(BatchData * batch_data, char const * username, char const * qrtext) {
+	bool result;
+	char * leaf;
+	char * filename;
+	GError * error;
+
+	result = true;
+	if (batch_data->qrdir != NULL) {
+		error = NULL;
+		leaf = g_strconcat(username, ".qr", NULL);
+		filename = config_file_full_path(batch_data->qrdir, leaf);
+		result = g_file_set_contents(filename, qrtext, -1, &error);
+		if (result == false) {
+			printf("Could not write QR code for user %s: %s\n", username, error->message);
+			g_error_free(error);
+		}
+		g_free(leaf);
+		free(filename);
+	}
+	else {
+		g_mutex_lock(&batch_data->mutex);
+		printf("%s\t%s\n", username, qrtext);
+		fflush(stdout);
+		g_mutex_unlock(&batch_data->mutex);
+	}
+
+	return result;
+}
+
+/**
+ * Free up the memory used by a BatchUser, clearing the password first.
+ *
+ * @param data The BatchUser to delete.
+ */
+static void batch_user_delete(gpointer data) {
+	BatchUser * batch_user = (BatchUser *)data;
+
+	if (batch_user) {
+		if (batch_user->username) {
+			g_string_free(batch_user->username, TRUE);
+		}
+		if (batch_user->password) {
+			memset(batch_user->password->str, 0, batch_user->password->len);
+			g_string_free(batch_user->password, TRUE);
+		}
+		free(batch_user);
+	}
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // GUI functions
 
@@ -705,12 +1271,13 @@ GuiData * guidata_new() {
 	gui_data->extraDataBuffer = buffer_new(0);
 	gui_data->password_ciphertext = buffer_new(0);
 	gui_data->verbose = 1;
-	gui_data->users = users_new();
 	gui_data->symmetric_key = buffer_new(CRYPTOSUPPORT_AESKEY_SIZE);
-	gui_data->device_list = bt_list_new();
 	gui_data->keypressed = false;
 	gui_data->datadir = g_string_new(PICOPAIRDIR);
 	gui_data->keydir = g_string_new("");
+	gui_data->service = PAIRSERVICE_UNAVAILABLE;
+	gui_data->connection = NULL;
+	gui_data->handle = -1;
 
 	return gui_data;
 }
@@ -746,21 +1313,18 @@ void guidata_delete(GuiData * gui_data) {
 		if (gui_data->password_ciphertext) {
 			buffer_delete(gui_data->password_ciphertext);
 		}
-		if (gui_data->users) {
-			users_delete(gui_data->users);
-		}
 		if (gui_data->symmetric_key) {
 			buffer_delete(gui_data->symmetric_key);
 		}
-		if (gui_data->device_list) {
-			bt_list_delete(gui_data->device_list);
-		}
 		if (gui_data->datadir) {
 			g_string_free(gui_data->datadir, TRUE);
 		}
 		if (gui_data->keydir) {
 			g_string_free(gui_data->keydir, TRUE);
 		}
+		if (gui_data->connection) {
+			g_object_unref(gui_data->connection);
+		}
 
 		free(gui_data);
 	}
@@ -1010,17 +1574,51 @@ gboolean pairing_complete (gpointer user_data) {
  * pairing QR code to be generated. The gui_pair_complete() function should
  * then be called to complete the process.
  *
+ * If pico-continuous is running it performs the pairing, otherwise the
+ * pairing is performed locally.
+ *
  * @param gui_data Data structure containing the GUI context.
  * @return true if things went as expected, false if there was an error.
  */
 bool gui_pair_setup(GuiData * gui_data) {
 	bool result;
+
+	printf("Pico pairing user %s with host %s\n", gui_data->username->str, gui_data->hostname->str);
+
+	if (gui_data->connection) {
+		g_object_unref(gui_data->connection);
+		gui_data->connection = NULL;
+	}
+
+	gui_data->service = service_start_pair(gui_data->username->str, gui_data->password->str, gui_data->keydir->str, &gui_data->connection, &gui_data->handle, gui_data->code);
+
+	switch (gui_data->service) {
+		case PAIRSERVICE_STARTED:
+			result = true;
+			break;
+		case PAIRSERVICE_FAILED:
+			printf("The Pico service could not start pairing.\n");
+			result = false;
+			break;
+		default:
+			result = gui_pair_local_setup(gui_data);
+			break;
+	}
+
+	return result;
+}
+
+/**
+ * Start the pairing process locally, for when pico-continuous isn't
+ * running. This loads the service's keys and generates the QR code itself.
+ *
+ * @param gui_data Data structure containing the GUI context.
+ * @return true if things went as expected, false if there was an error.
+ */
+static bool gui_pair_local_setup(GuiData * gui_data) {
+	bool result;
 	char * pub;
 	char * priv;
-	char * bt_devices_file;
-	char * users_file;
-	USERFILE load_result;
-	bt_err_t bt_e;
 	Buffer * password_cleartext;
 	Json * extra_data_json;
 	Buffer * buffer;
@@ -1031,13 +1629,9 @@ bool gui_pair_setup(GuiData * gui_data) {
 
 	result = true;
 
-	printf("Pico pairing user %s with host %s\n", gui_data->username->str, gui_data->hostname->str);
-
 	// Set up the paths to the public key, private key and user list files
 	pub = config_file_full_path(gui_data->keydir->str, PUB_FILE);
 	priv = config_file_full_path(gui_data->keydir->str, PRIV_FILE);
-	users_file = config_file_full_path(gui_data->keydir->str, USERS_FILE);
-	bt_devices_file = config_file_full_path(gui_data->keydir->str, BT_ADDRESS_FILE);
 
 	shared_set_feedback_trigger(gui_data->shared, feedback_trigger, &gui_data->verbose);
 	
@@ -1048,25 +1642,6 @@ bool gui_pair_setup(GuiData * gui_data) {
 	free(pub);
 	free(priv);
 
-	// Load in the user list files
-	load_result = users_load(gui_data->users, users_file);
-	if ((load_result != USERFILE_SUCCESS) && (load_result != USERFILE_IOERROR)) {
-		printf("Error reading users file: %d\n", load_result);
-		result = false;
-	}
-	free(users_file);
-
-	// Load the bluetooth address list
-	if (result) {
-		bt_e = bt_list_load(gui_data->device_list, bt_devices_file);
-		if ((bt_e != BT_SUCCESS) && (bt_e != BT_ERR_FILE_NOT_FOUND)) {
-			printf("Error reading bluetooth address: %d\n", bt_e);
-			result = false;
-		}
-	}
-
-	free(bt_devices_file);
-
 	password_cleartext = buffer_new(0);
 	
 	// Generate a symmetric key for the user
@@ -1149,14 +1724,42 @@ bool gui_pair_setup(GuiData * gui_data) {
  * @param gui_data Data structure containing the GUI context.
  * @param returned_stored_data Any data that's sent by the Pico app during the
  *        pairing process (a pre-allocated buffer should be passed in, owned
- *        by the caller).
+ *        by the caller). This is only filled when pairing locally.
  * @return true if the pairing completed successfully, false o/w.
  */
 bool gui_pair_complete(GuiData * gui_data, Buffer * returned_stored_data) {
 	bool result;
-	char * users_file;
-	USERFILE export_result;
-	char * bt_devices_file;
+
+	if (gui_data->service == PAIRSERVICE_STARTED) {
+		result = service_complete_pair(gui_data->connection, gui_data->handle);
+		if (result == false) {
+			printf("Pairing failed.\n");
+		}
+	}
+	else {
+		result = gui_pair_local_complete(gui_data, returned_stored_data);
+	}
+
+	if (result) {
+		compact_journal(gui_data->keydir->str);
+	}
+
+	return result;
+}
+
+/**
+ * Complete a pairing started locally by gui_pair_local_setup(), storing
+ * the user in the users journal.
+ *
+ * @param gui_data Data structure containing the GUI context.
+ * @param returned_stored_data A buffer to store any data sent by the Pico
+ *        app during the pairing process.
+ * @return true if the pairing completed successfully, false o/w.
+ */
+static bool gui_pair_local_complete(GuiData * gui_data, Buffer * returned_stored_data) {
+	bool result;
+	UsersJournal * users_journal;
+	char * journal_dir;
 	int i;
 
 	result = false;
@@ -1164,35 +1767,30 @@ bool gui_pair_complete(GuiData * gui_data, Buffer * returned_stored_data) {
 		result = sigmaverifier(gui_data->shared, gui_data->channel, NULL, buffer_get_buffer(gui_data->extraDataBuffer), returned_stored_data, NULL);
 	}
 
+	// New users are appended to the journal, so the users file needn't be read
+	users_journal = usersjournal_new();
+	journal_dir = config_file_full_path(gui_data->keydir->str, "");
+	usersjournal_set_configdir(users_journal, journal_dir);
+	free(journal_dir);
+
 	if (result == true) {
-		users_file = config_file_full_path(gui_data->keydir->str, USERS_FILE);
-		// If everything went well, store the user in the list to allow authentication in future
-		users_add_user(gui_data->users, gui_data->username->str, shared_get_pico_identity_public_key(gui_data->shared), gui_data->symmetric_key);
-
-		// Export out the resulting user list file
-		export_result = users_export(gui_data->users, users_file);
-		if (export_result != USERFILE_SUCCESS) {
-			printf("Error saving users file: %d\n", export_result);
-			result = false;
+		// If everything went well, store the user to allow authentication in future
+		result = usersjournal_append_user(users_journal, gui_data->username->str, shared_get_pico_identity_public_key(gui_data->shared), gui_data->symmetric_key);
+		if (result == false) {
+			printf("Error saving user to the users journal\n");
 		}
-		free(users_file);
 	}
 	else {
 		printf("Pairing failed.\n");
 	}
 
 	if (result && buffer_get_pos(returned_stored_data)) {
-		bt_devices_file = config_file_full_path(gui_data->keydir->str, BT_ADDRESS_FILE);
-
-		bt_addr_t addr;
-		bt_str_to_addr(buffer_get_buffer(returned_stored_data), &addr);
 		// Save bluetooth address
-		bt_list_add_device(gui_data->device_list, &addr);
-		bt_list_save(gui_data->device_list, bt_devices_file);
-
-		free(bt_devices_file);
+		usersjournal_append_device(users_journal, buffer_get_buffer(returned_stored_data));
 	}
 
+	usersjournal_delete(users_journal);
+
 	return result;
 }
 
@@ -0,0 +1,531 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Replay the handshake prefix of a recorded authentication session
+ * @section DESCRIPTION
+ *
+ * If the pico-continuous service is configured with a tracedir, it records
+ * a trace of each authentication session. This tool replays the start of
+ * such a trace against a fresh FsmService, feeding in the recorded
+ * connections, frames, timeouts and disconnections in their original order,
+ * either with their original timing or as fast as possible, and measures
+ * the time the state machine spends processing each of them.
+ *
+ * This is a timing tool for the handshake only, not a full reproduction of
+ * the session. The service generates a fresh ephemeral key and nonce for
+ * the replay, and libpico offers no way to inject the recorded ones, so the
+ * recorded Pico frames stop making sense to the replayed state machine once
+ * the keys derived from them are used. The replay therefore stops at the
+ * first sign of divergence: a state machine error, a failed authentication,
+ * or a frame written by the replayed service that doesn't match the length
+ * of the one recorded. The events replayed up to that point, and the time
+ * taken to process them, are reported, along with the recorded timing of
+ * the whole trace.
+ *
+ */
+
+/** \addtogroup Testing
+ *  @{
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <glib.h>
+#include "pico/pico.h"
+#include "pico/users.h"
+#include "pico/shared.h"
+#include "pico/fsmservice.h"
+#include "pico/messagestatus.h"
+
+#include "log.h"
+#include "timesource.h"
+#include "sessiontrace.h"
+
+// Defines
+
+#define PUB_FILE "pico_pub_key.der"
+#define PRIV_FILE "pico_priv_key.der"
+#define USERS_FILE "users.txt"
+
+/**
+ * @brief The default directory to load the service keys and users from
+ */
+#define KEYDIR_DEFAULT "/etc/pam-pico/"
+
+// Structure definitions
+
+/**
+ * @brief The state of a replay in progress
+ *
+ * Holds the trace being replayed, the state machine it's being replayed
+ * into, and the statistics collected along the way.
+ */
+typedef struct _Replay {
+	SessionTrace * trace;
+	FsmService * fsmservice;
+	Shared * shared;
+	Users * users;
+	Buffer * extraData;
+	GMainLoop * loop;
+	double speed;
+	bool verbose;
+	Buffer * data;
+	SESSIONTRACEEVENT pending;
+	bool diverged;
+
+	// The most recent frame written by the replayed service
+	size_t written;
+	bool writepending;
+
+	// Statistics
+	int events;
+	int reads;
+	int writes;
+	int mismatches;
+	gint64 recorded;
+	gint64 replayed;
+	gint64 processing;
+	gint64 slowest;
+	SESSIONTRACEEVENT slowestevent;
+} Replay;
+
+// Function prototypes
+
+static void help();
+static void replay_schedule_next(Replay * replay);
+static gboolean replay_event(gpointer user_data);
+static void replay_write(char const * data, size_t length, void * user_data);
+static void replay_set_timeout(int timeout, void * user_data);
+static void replay_error(void * user_data);
+static void replay_listen(void * user_data);
+static void replay_disconnect(void * user_data);
+static void replay_authenticated(int status, void * user_data);
+static void replay_session_ended(void * user_data);
+static void replay_status_updated(int state, void * user_data);
+
+// Function definitions
+
+/**
+ * Application entry point.
+ *
+ * @param argc The number of arguments provided
+ * @param argv An array of pointers to the argument strings
+ * @return EXIT_SUCCESS if the trace was replayed, EXIT_FAILURE o/w
+ */
+int main(int argc, char * argv[]) {
+	Replay replay;
+	int c;
+	int option_index;
+	char * keydir;
+	char const * filename;
+	Buffer * pubfilename;
+	Buffer * privfilename;
+	Buffer * usersfilename;
+	USERFILE usersresult;
+	gint64 start;
+	gint64 elapsed;
+	gint64 delta;
+	bool result;
+
+	// Parse arguments
+	static struct option long_options[] = {
+		{"keydir", required_argument, 0, 'k'},
+		{"speed", required_argument, 0, 's'},
+		{"verbose", no_argument, 0, 'v'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	keydir = NULL;
+	replay.speed = 1.0;
+	replay.verbose = FALSE;
+	c = 0;
+	for (option_index = 0; c != -1;) {
+		opterr = 0;
+		c = getopt_long (argc, argv, "k:s:vh", long_options, &option_index);
+
+		switch (c) {
+			case 'k':
+				keydir = strdup(optarg);
+				break;
+			case 's':
+				replay.speed = atof(optarg);
+				break;
+			case 'v':
+				replay.verbose = TRUE;
+				break;
+			case -1:
+				// Do nothing
+				break;
+			default:
+				help();
+				exit(EXIT_FAILURE);
+		};
+	}
+
+	if (optind != (argc - 1)) {
+		help();
+		exit(EXIT_FAILURE);
+	}
+	filename = argv[optind];
+	if (keydir == NULL) {
+		keydir = strdup(KEYDIR_DEFAULT);
+	}
+
+	replay.trace = sessiontrace_new();
+	result = sessiontrace_open_read(replay.trace, filename);
+
+	if (result) {
+		// Load the keys and users, in the same way the service does
+		pubfilename = buffer_new(0);
+		privfilename = buffer_new(0);
+		usersfilename = buffer_new(0);
+		buffer_append_string(pubfilename, keydir);
+		buffer_append_string(privfilename, keydir);
+		buffer_append_string(usersfilename, keydir);
+		buffer_append_string(pubfilename, "/" PUB_FILE);
+		buffer_append_string(privfilename, "/" PRIV_FILE);
+		buffer_append_string(usersfilename, "/" USERS_FILE);
+
+		replay.shared = shared_new();
+		shared_load_or_generate_keys(replay.shared, buffer_get_buffer(pubfilename), buffer_get_buffer(privfilename));
+		replay.users = users_new();
+		usersresult = users_load(replay.users, buffer_get_buffer(usersfilename));
+		if (usersresult != USERFILE_SUCCESS) {
+			printf("Failed to load users file, error: %d\n", usersresult);
+		}
+
+		buffer_delete(pubfilename);
+		buffer_delete(privfilename);
+		buffer_delete(usersfilename);
+
+		replay.extraData = buffer_new(0);
+		replay.data = buffer_new(0);
+		replay.loop = g_main_loop_new(NULL, FALSE);
+		replay.written = 0;
+		replay.writepending = FALSE;
+		replay.events = 0;
+		replay.reads = 0;
+		replay.writes = 0;
+		replay.mismatches = 0;
+		replay.recorded = 0;
+		replay.replayed = 0;
+		replay.processing = 0;
+		replay.slowest = 0;
+		replay.slowestevent = SESSIONTRACEEVENT_INVALID;
+		replay.diverged = FALSE;
+
+		replay.fsmservice = fsmservice_new();
+		fsmservice_set_functions(replay.fsmservice, replay_write, replay_set_timeout, replay_error, replay_listen, replay_disconnect, replay_authenticated, replay_session_ended, replay_status_updated);
+		fsmservice_set_userdata(replay.fsmservice, &replay);
+
+		start = g_get_monotonic_time();
+		replay_schedule_next(&replay);
+		g_main_loop_run(replay.loop);
+		elapsed = g_get_monotonic_time() - start;
+
+		// The rest of the trace isn't replayed, but its timing is still of interest
+		while (replay.diverged && sessiontrace_read(replay.trace, &replay.pending, &delta, replay.data)) {
+			replay.recorded += delta;
+		}
+
+		printf("Events replayed: %d\n", replay.events);
+		printf("Diverged from recording: %s\n", (replay.diverged ? "yes" : "no"));
+		printf("Frames read: %d\n", replay.reads);
+		printf("Frames written: %d\n", replay.writes);
+		printf("Write mismatches: %d\n", replay.mismatches);
+		printf("Recorded duration: %" G_GINT64_FORMAT " us\n", replay.recorded);
+		printf("Recorded duration of replayed events: %" G_GINT64_FORMAT " us\n", replay.replayed);
+		printf("Replay duration: %" G_GINT64_FORMAT " us\n", elapsed);
+		printf("State machine processing: %" G_GINT64_FORMAT " us\n", replay.processing);
+		if (replay.slowestevent != SESSIONTRACEEVENT_INVALID) {
+			printf("Slowest event: %s (%" G_GINT64_FORMAT " us)\n", sessiontrace_event_name(replay.slowestevent), replay.slowest);
+		}
+
+		fsmservice_set_functions(replay.fsmservice, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+		fsmservice_delete(replay.fsmservice);
+		g_main_loop_unref(replay.loop);
+		buffer_delete(replay.data);
+		buffer_delete(replay.extraData);
+		users_delete(replay.users);
+		shared_delete(replay.shared);
+	}
+	else {
+		printf("Failed to open trace file: %s\n", filename);
+	}
+
+	sessiontrace_delete(replay.trace);
+	free(keydir);
+
+	return (result ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/**
+ * Display some helpful text to stdout.
+ */
+static void help() {
+	printf("Pico handshake replay tool, for timing the handshake of a recorded authentication session\n");
+	printf("The replay stops where the replayed service diverges from the recording.\n");
+	printf("Syntax: pico-replay-handshake [--help] [--keydir <path>] [--speed <factor>] [--verbose] <trace>\n");
+	printf("\n");
+	printf("Parameters:\n");
+	printf("\thelp - display this help text.\n");
+	printf("\tkeydir <path> - directory to load the service keys and users from (default %s).\n", KEYDIR_DEFAULT);
+	printf("\tspeed <factor> - multiple of the original speed to replay at, or 0 to replay as fast as possible (default 1).\n");
+	printf("\tverbose - display each event as it's replayed.\n");
+	printf("\ttrace - the trace file to replay.\n");
+
+	printf("Example:\n");
+	printf("\tpico-replay-handshake --speed 0 session-1-1500000000000.trace\n");
+}
+
+/**
+ * Read the next event from the trace and schedule it to be replayed after
+ * the recorded delay, adjusted for the replay speed. If there are no more
+ * events, or the replay has diverged from the recording, the main loop is
+ * quit.
+ *
+ * @param replay The replay in progress.
+ */
+static void replay_schedule_next(Replay * replay) {
+	gint64 delta;
+	guint interval;
+	bool result;
+
+	result = FALSE;
+	if (replay->diverged == FALSE) {
+		result = sessiontrace_read(replay->trace, &replay->pending, &delta, replay->data);
+	}
+	if (result) {
+		replay->recorded += delta;
+		replay->replayed += delta;
+		interval = 0;
+		if (replay->speed > 0.0) {
+			interval = (guint)((delta / 1000) / replay->speed);
+		}
+		timesource_timeout_add(interval, replay_event, replay);
+	}
+	else {
+		g_main_loop_quit(replay->loop);
+	}
+}
+
+/**
+ * Replay the pending event into the state machine, then schedule the
+ * next one. Frames and connection events are passed to the FsmService;
+ * recorded writes are compared against what the replayed service wrote,
+ * and a mismatch marks the replay as diverged. Timeouts are replayed at the
+ * point they were recorded, rather than when the replayed state machine
+ * requests them.
+ *
+ * @param user_data The replay in progress, cast to (void *).
+ * @return Always FALSE, so the timeout only fires once.
+ */
+static gboolean replay_event(gpointer user_data) {
+	Replay * replay = (Replay *)user_data;
+	size_t length;
+	char const * data;
+	gint64 start;
+	gint64 taken;
+
+	replay->events++;
+	length = buffer_get_pos(replay->data);
+	data = buffer_get_buffer(replay->data);
+
+	if (replay->verbose) {
+		printf("%s (%lu bytes)\n", sessiontrace_event_name(replay->pending), length);
+	}
+
+	start = g_get_monotonic_time();
+	switch (replay->pending) {
+		case SESSIONTRACEEVENT_START:
+			fsmservice_set_continuous(replay->fsmservice, ((length > 0) && (data[0] != 0)));
+			fsmservice_start(replay->fsmservice, replay->shared, replay->users, replay->extraData);
+			break;
+		case SESSIONTRACEEVENT_CONNECTED:
+			fsmservice_connected(replay->fsmservice);
+			break;
+		case SESSIONTRACEEVENT_READ:
+			replay->reads++;
+			fsmservice_read(replay->fsmservice, data, length);
+			break;
+		case SESSIONTRACEEVENT_WRITE:
+			if ((replay->writepending == FALSE) || (replay->written != length)) {
+				if (replay->verbose) {
+					printf("Recorded write of %lu bytes not matched\n", length);
+				}
+				replay->mismatches++;
+				replay->diverged = TRUE;
+			}
+			replay->writepending = FALSE;
+			break;
+		case SESSIONTRACEEVENT_TIMEOUT:
+			fsmservice_timeout(replay->fsmservice);
+			break;
+		case SESSIONTRACEEVENT_DISCONNECTED:
+			fsmservice_disconnected(replay->fsmservice);
+			break;
+		default:
+			// Timers, dbus calls and state changes are informational only
+			if (replay->verbose && (replay->pending != SESSIONTRACEEVENT_STATE)) {
+				printf("\t%.*s\n", (int)length, data);
+			}
+			break;
+	}
+	taken = g_get_monotonic_time() - start;
+	replay->processing += taken;
+	if (taken > replay->slowest) {
+		replay->slowest = taken;
+		replay->slowestevent = replay->pending;
+	}
+
+	replay_schedule_next(replay);
+
+	return FALSE;
+}
+
+/**
+ * Internal function provided to the FsmService to write data to the
+ * channel. Nothing is actually sent; the length is kept so it can be
+ * compared with the next write in the trace.
+ *
+ * @param data The data to write on the channel.
+ * @param length The length of data to write.
+ * @param user_data The replay in progress, cast to (void *).
+ */
+static void replay_write(char const * data, size_t length, void * user_data) {
+	Replay * replay = (Replay *)user_data;
+
+	replay->writes++;
+	replay->written = length;
+	replay->writepending = TRUE;
+}
+
+/**
+ * Internal function provided to the FsmService to request timeouts to be set.
+ * Timeouts are taken from the trace instead, so this does nothing.
+ *
+ * @param timeout The time, in milliseconds, before the timeout should trigger.
+ * @param user_data The replay in progress, cast to (void *).
+ */
+static void replay_set_timeout(int timeout, void * user_data) {
+	Replay * replay = (Replay *)user_data;
+
+	if (replay->verbose) {
+		printf("\tTimeout requested: %d ms\n", timeout);
+	}
+}
+
+/**
+ * Internal function provided to the FsmService that will be called if a
+ * state machine error occurs. This marks the replay as diverged.
+ *
+ * @param user_data The replay in progress, cast to (void *).
+ */
+static void replay_error(void * user_data) {
+	Replay * replay = (Replay *)user_data;
+
+	if (replay->verbose) {
+		printf("\tState machine error\n");
+	}
+	replay->diverged = TRUE;
+}
+
+/**
+ * Internal function provided to the FsmService to request that the service
+ * listen for incoming connections. Connections are taken from the trace, so
+ * this does nothing.
+ *
+ * @param user_data The replay in progress, cast to (void *).
+ */
+static void replay_listen(void * user_data) {
+	// Do nothing
+}
+
+/**
+ * Internal function provided to the FsmService to request the connected
+ * device be disconnected. Disconnections are taken from the trace, so this
+ * does nothing.
+ *
+ * @param user_data The replay in progress, cast to (void *).
+ */
+static void replay_disconnect(void * user_data) {
+	// Do nothing
+}
+
+/**
+ * Internal function provided to the FsmService that the state machine will
+ * call to indicate the authentication completed. A failed authentication
+ * marks the replay as diverged.
+ *
+ * @param status The result of the authentication.
+ * @param user_data The replay in progress, cast to (void *).
+ */
+static void replay_authenticated(int status, void * user_data) {
+	Replay * replay = (Replay *)user_data;
+
+	if (replay->verbose) {
+		printf("\tAuthenticated with status %d\n", status);
+	}
+	if ((status != MESSAGESTATUS_OK_DONE) && (status != MESSAGESTATUS_OK_CONTINUE)) {
+		replay->diverged = TRUE;
+	}
+}
+
+/**
+ * Internal function provided to the FsmService that will be called to
+ * indicate that the continuous authentication session has ended.
+ *
+ * @param user_data The replay in progress, cast to (void *).
+ */
+static void replay_session_ended(void * user_data) {
+	Replay * replay = (Replay *)user_data;
+
+	if (replay->verbose) {
+		printf("\tSession ended\n");
+	}
+}
+
+/**
+ * Internal function provided to the FsmService that will be called every
+ * time the FSM changes state.
+ *
+ * @param state The new state that the FSM has just moved to.
+ * @param user_data The replay in progress, cast to (void *).
+ */
+static void replay_status_updated(int state, void * user_data) {
+	Replay * replay = (Replay *)user_data;
+
+	if (replay->verbose) {
+		printf("\tState: %d\n", state);
+	}
+}
+
+/** @} addtogroup Testing */
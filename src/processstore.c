@@ -52,7 +52,6 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
-#include <pwd.h>
 #include <stdarg.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -86,30 +85,34 @@
 // Defines
 
 /**
- * @brief The command to call to lock the user's session
+ * @brief The time to wait for an existing session's Pico to answer
  *
- * There's no canonical way to lock a user's session. A common approach is
- * to send a dbus message to the desktop manager to trigger a lock. Given there
- * are different ways to do this, it's easiest to keep the command in a bash
- * script that can be called from this service.
+ * With instant unlock, the Pico in an existing continuous session is given
+ * this many milliseconds to answer a challenge before the new
+ * authentication is left to proceed as usual.
  *
- * This define sets the command to use.
  */
-#define LOCK_COMMAND "/usr/share/pam-pico/lock.sh"
+#define INSTANT_UNLOCK_TIMEOUT (5000)
 
 /**
- * @brief The maximum number of simultaneous authentications suppported
+ * @brief The maximum number of speculative sessions running at once
  *
- * This define sets the maximum number of authentications which can be
- * simultaneously ongoing. Note that this includes continuous authentication
- * sessions, and this is a system-wide (rather than per-user) value, so the
- * number has to be adequaely large to cover all scenarios.
+ * Speculative sessions are started by processstore_away() without anyone
+ * having asked, so they're kept well below MAX_SIMULTANEOUS_AUTHS, leaving
+ * the rest of the pool for StartAuth calls. Should the pool still fill up, a
+ * speculative session is evicted to make room (see processstore_add()).
  *
- * Given that Bluetooth only supports up to 32 separate channels, there's not
- * much point in setting a number larger than 32.
+ */
+#define MAX_SPECULATIVE_SESSIONS (4)
+
+/**
+ * @brief The maximum number of simultaneous pairings supported
+ *
+ * Each pairing holds a thread and a Rendezvous Point channel open for up to
+ * half an hour while waiting for the Pico, so the number is limited.
  *
  */
-#define MAX_SIMULTANEOUS_AUTHS (16)
+#define MAX_SIMULTANEOUS_PAIRINGS (16)
 
 // Structure definitions
 
@@ -130,6 +133,8 @@ struct _ProcessItem {
 	ProcessItem * prev;
 	AuthThread * auththread;
 	char * owner;
+	bool privileged;
+	unsigned int generation;
 };
 
 /**
@@ -151,12 +156,110 @@ struct _ProcessStore {
 	ProcessItem * items[MAX_SIMULTANEOUS_AUTHS];
 	int nextAvailable;
 	GMainLoop * loop;
+	CryptoPool * cryptopool;
+	KeyCache * keycache;
+	UsersCache * userscache;
+	Locker * locker;
+	RvpEndpoints * rvpendpoints;
+	RvpWarmer * rvpwarmer;
+	bool bluetooth;
+	GHashTable * pairings;
+	int nextpairing;
+	GHashTable * preauthparams;
+	bool preauth;
+	unsigned int generation;
+	PairThreadChannel pairchannel;
+	void * pairchannel_data;
+};
+
+/**
+ * @brief Structure used to store data associated with an individual pairing
+ *
+ * Pairings are stored in a hash table keyed on their handle, which is
+ * separate from the authentication handles. The object and invocation are
+ * set while a StartPair or CompletePair call is waiting for its reply. A
+ * pairing whose owner has gone away is abandoned and removed once its
+ * PairThread finishes.
+ *
+ * The lifecycle of this data is managed by ProcessStore.
+ *
+ */
+typedef struct _PairItem {
+	ProcessStore * processstoredata;
+	int handle;
+	PairThread * pairthread;
+	PicoUkAcCamClPicoInterface * object;
+	GDBusMethodInvocation * invocation;
+	char * owner;
+	bool started;
+	bool orphaned;
+} PairItem;
+
+/**
+ * @brief An instant unlock waiting for an existing session's Pico to answer
+ *
+ * The new session is referenced by handle, since it may finish before the
+ * answer arrives. Its handle may then be given to a different session, so
+ * the session's AuthThread and generation are kept to check that the
+ * handle still refers to the same session.
+ *
+ */
+typedef struct _InstantUnlock {
+	ProcessStore * processstoredata;
+	int handle;
+	AuthThread * auththread;
+	unsigned int generation;
+} InstantUnlock;
+
+/**
+ * @brief A dbus call waiting for the user id of its caller
+ *
+ * The user id of a caller can only be found by asking the bus daemon. This
+ * is done asynchronously, so that the main loop isn't held up while the bus
+ * daemon replies. The arguments of the call are kept here until the user id
+ * arrives, and the call is then handled by the ready function.
+ *
+ * The lifecycle of this data is managed by ProcessStore.
+ *
+ */
+typedef struct _CallerLookup CallerLookup;
+
+/**
+ * @brief Function to handle a dbus call once its caller's user id is known
+ */
+typedef void (*CallerReady)(CallerLookup * lookup, uid_t calleruid);
+
+struct _CallerLookup {
+	ProcessStore * processstoredata;
+	PicoUkAcCamClPicoInterface * object;
+	GDBusMethodInvocation * invocation;
+	CallerReady ready;
+	int handle;
+	char * username;
+	char * password;
+	char * parameters;
+	char * code;
 };
 
 // Function prototypes
 
 static void processstore_set_owner(ProcessStore * processstoredata, int handle, GDBusMethodInvocation * invocation);
-static void processstore_stop_similar(ProcessStore * processstoredata, AuthThread const * auththread);
+static CallerLookup * processstore_lookup_new(ProcessStore * processstoredata, PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, CallerReady ready);
+static void processstore_lookup_delete(CallerLookup * lookup);
+static void processstore_lookup_caller(CallerLookup * lookup);
+static void processstore_lookup_finished(GObject * source, GAsyncResult * res, gpointer user_data);
+static void processstore_start_auth_ready(CallerLookup * lookup, uid_t calleruid);
+static void processstore_resume_auth_ready(CallerLookup * lookup, uid_t calleruid);
+static void processstore_start_pair_ready(CallerLookup * lookup, uid_t calleruid);
+static bool processstore_trusted(ProcessItem const * item, char const * caller, uid_t calleruid);
+static void processstore_stop_similar(ProcessStore * processstoredata, AuthThread * auththread, char const * caller, uid_t calleruid);
+static void processstore_instant_result(AuthThread * existing, bool present, void * user_data);
+static void processstore_start_bluetooth(ProcessStore * processstoredata);
+static void processstore_pair_delete(gpointer data);
+static void processstore_pair_started(PairThread * pairthread, char const * code, void * user_data);
+static void processstore_pair_finished(PairThread * pairthread, bool success, void * user_data);
+static bool processstore_attach(ProcessStore * processstoredata, PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, char const * username, char const * parameters, char const * caller, uid_t calleruid);
+static bool processstore_evict_speculative(ProcessStore * processstoredata);
 
 // Function definitions
 
@@ -175,6 +278,20 @@ ProcessStore * processstore_new() {
 		processstoredata->items[item] = NULL;
 	}
 	processstoredata->nextAvailable = 0;
+	processstoredata->cryptopool = NULL;
+	processstoredata->keycache = NULL;
+	processstoredata->userscache = NULL;
+	processstoredata->locker = NULL;
+	processstoredata->rvpendpoints = NULL;
+	processstoredata->rvpwarmer = NULL;
+	processstoredata->bluetooth = FALSE;
+	processstoredata->pairings = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, processstore_pair_delete);
+	processstoredata->nextpairing = 0;
+	processstoredata->preauthparams = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	processstoredata->preauth = FALSE;
+	processstoredata->pairchannel = NULL;
+	processstoredata->pairchannel_data = NULL;
+	processstoredata->generation = 0;
 	
 	return processstoredata;
 }
@@ -210,6 +327,22 @@ void processstore_delete(ProcessStore * processstoredata) {
 		processstoredata->nextAvailable = 0;
 		processstoredata->first = NULL;
 
+		if (processstoredata->pairings) {
+			g_hash_table_destroy(processstoredata->pairings);
+			processstoredata->pairings = NULL;
+		}
+
+		if (processstoredata->preauthparams) {
+			g_hash_table_destroy(processstoredata->preauthparams);
+			processstoredata->preauthparams = NULL;
+		}
+
+		if (processstoredata->bluetooth) {
+			LOG(LOG_INFO, "Deinit Bluetooth");
+			bt_exit();
+			processstoredata->bluetooth = FALSE;
+		}
+
 		FREE(processstoredata);
 	}
 }
@@ -219,7 +352,9 @@ void processstore_delete(ProcessStore * processstoredata) {
  * data structures and find a free handle to use if there is one.
  *
  * Before asigning a new handle, any completed processes will first be
- * harvested so they can be used again.
+ * harvested so they can be used again. If every handle is still in use, the
+ * oldest speculative session nobody has attached to is removed to make room,
+ * since it was started without anyone having asked for it.
  *
  * @param processstoredata The object to store the new bundle in.
  * @return The handle of the new bundle if one is available, or -1 o/w.
@@ -230,6 +365,10 @@ int processstore_add(ProcessStore * processstoredata) {
 
 	processstore_harvest(processstoredata);
 
+	if (processstoredata->nextAvailable >= MAX_SIMULTANEOUS_AUTHS) {
+		processstore_evict_speculative(processstoredata);
+	}
+
 	handle = processstoredata->nextAvailable;
 	if (handle < MAX_SIMULTANEOUS_AUTHS) {
 		LOG(LOG_INFO, "Creating thread with handle %d\n", handle);
@@ -237,6 +376,9 @@ int processstore_add(ProcessStore * processstoredata) {
 		item->auththread = auththread_new();
 		auththread_set_handle(item->auththread, handle);
 		item->owner = NULL;
+		item->privileged = false;
+		// Distinguishes this session from others given the same handle
+		item->generation = processstoredata->generation++;
 		item->next = processstoredata->first;
 		item->prev = NULL;
 		if (item->next) {
@@ -294,10 +436,45 @@ void processstore_remove(ProcessStore * processstoredata, int handle) {
 	}
 }
 
+/**
+ * Remove the oldest speculative session that nobody has attached to yet, to
+ * free up its handle. The session is removed straight away rather than
+ * stopped, so that the handle can be used by the caller.
+ *
+ * @param processstoredata The object to remove the session from.
+ * @return true if a session was removed, false if there were none to remove.
+ */
+static bool processstore_evict_speculative(ProcessStore * processstoredata) {
+	ProcessItem * item;
+	ProcessItem * oldest;
+	int handle;
+
+	oldest = NULL;
+	for (item = processstoredata->first; item != NULL; item = item->next) {
+		if (auththread_get_speculative(item->auththread) && (auththread_get_state(item->auththread) < AUTHTHREADSTATE_HARVESTABLE)) {
+			if ((oldest == NULL) || (item->generation < oldest->generation)) {
+				oldest = item;
+			}
+		}
+	}
+
+	if (oldest != NULL) {
+		handle = auththread_get_handle(oldest->auththread);
+		LOG(LOG_INFO, "Evicting speculative session %d for %s", handle, auththread_get_username(oldest->auththread));
+		processstore_remove(processstoredata, handle);
+	}
+
+	return (oldest != NULL);
+}
+
 /**
  * Harvest any harvestable (completed) sessions and free up any resources
  * allocated to them, to allow the handles used by them to be re-used.
  *
+ * Before a session is freed, if it was requested by root and authenticated
+ * successfully, its parameters are remembered for starting speculative
+ * sessions for the same user with processstore_away().
+ *
  * @param processstoredata The object to harvest completed bundles from.
  */
 void processstore_harvest(ProcessStore * processstoredata) {
@@ -305,6 +482,7 @@ void processstore_harvest(ProcessStore * processstoredata) {
 	ProcessItem * next;
 	AUTHTHREADSTATE authstate;
 	int handle;
+	Buffer const * parameters;
 	
 	item = processstoredata->first;
 	
@@ -313,6 +491,10 @@ void processstore_harvest(ProcessStore * processstoredata) {
 		authstate = auththread_get_state(item->auththread);
 
 		if (authstate == AUTHTHREADSTATE_HARVESTABLE) {
+			if (item->privileged && auththread_get_result(item->auththread)) {
+				parameters = auththread_get_parameters(item->auththread);
+				g_hash_table_replace(processstoredata->preauthparams, g_strdup(auththread_get_username(item->auththread)), g_strndup(buffer_get_buffer(parameters), buffer_get_pos(parameters)));
+			}
 			handle = auththread_get_handle(item->auththread);
 			processstore_remove(processstoredata, handle);
 		}
@@ -367,6 +549,126 @@ GMainLoop * processstore_get_loop(ProcessStore * processstoredata) {
 	return loop;
 }
 
+/**
+ * Set the pool of worker threads for new sessions to process messages from
+ * the Pico on. The pool remains owned by the caller and must outlive the
+ * ProcessStore.
+ *
+ * @param processstoredata The object to set the value of.
+ * @param cryptopool The pool to use, or NULL to process messages on the
+ *        main loop.
+ */
+void processstore_set_cryptopool(ProcessStore * processstoredata, CryptoPool * cryptopool) {
+	processstoredata->cryptopool = cryptopool;
+}
+
+/**
+ * Set the cache of service identity keys for new sessions to use. The cache
+ * remains owned by the caller and must outlive the ProcessStore.
+ *
+ * @param processstoredata The object to set the value of.
+ * @param keycache The cache to use, or NULL to load the key for each
+ *        session.
+ */
+void processstore_set_keycache(ProcessStore * processstoredata, KeyCache * keycache) {
+	processstoredata->keycache = keycache;
+}
+
+/**
+ * Set the cache of paired users for new sessions to use. The cache remains
+ * owned by the caller and must outlive the ProcessStore.
+ *
+ * @param processstoredata The object to set the value of.
+ * @param userscache The cache to use, or NULL to load the users for each
+ *        session.
+ */
+void processstore_set_userscache(ProcessStore * processstoredata, UsersCache * userscache) {
+	processstoredata->userscache = userscache;
+}
+
+/**
+ * Set the Locker for sessions to lock users with when their continuous
+ * authentication ends. The Locker remains owned by the caller and must
+ * outlive the ProcessStore.
+ *
+ * @param processstoredata The object to set the value of.
+ * @param locker The Locker to use, or NULL to run the lock command
+ *        synchronously.
+ */
+void processstore_set_locker(ProcessStore * processstoredata, Locker * locker) {
+	processstoredata->locker = locker;
+}
+
+/**
+ * Set the RvpEndpoints object that sessions use to choose between the
+ * configured Rendezvous Points. Since it's shared by all sessions, what one
+ * session learns about an endpoint's performance benefits the others. The
+ * object remains owned by the caller and must outlive the ProcessStore.
+ *
+ * @param processstoredata The object to set the value of.
+ * @param rvpendpoints The object to use, or NULL to always use the first
+ *        Rendezvous Point listed.
+ */
+void processstore_set_rvpendpoints(ProcessStore * processstoredata, RvpEndpoints * rvpendpoints) {
+	processstoredata->rvpendpoints = rvpendpoints;
+}
+
+/**
+ * Set the RvpWarmer that keeps connections to the Rendezvous Points warm.
+ * Sessions make their Rendezvous Point requests through its SoupSession so
+ * that they can pick up the warm connections. The object remains owned by
+ * the caller and must outlive the ProcessStore.
+ *
+ * @param processstoredata The object to set the value of.
+ * @param rvpwarmer The object to use, or NULL for each session to connect
+ *        afresh.
+ */
+void processstore_set_rvpwarmer(ProcessStore * processstoredata, RvpWarmer * rvpwarmer) {
+	processstoredata->rvpwarmer = rvpwarmer;
+}
+
+/**
+ * Set whether speculative sessions should be started when a user's desktop
+ * session locks or goes idle (see processstore_away()). This is off by
+ * default.
+ *
+ * @param processstoredata The object to set the value of.
+ * @param preauth true to start speculative sessions, false o/w.
+ */
+void processstore_set_preauth(ProcessStore * processstoredata, bool preauth) {
+	processstoredata->preauth = preauth;
+}
+
+/**
+ * Set the function used to create the channel for each new pairing. See
+ * pairthread_set_channel() for details.
+ *
+ * @param processstoredata The object to set the value of.
+ * @param channel The function to create the channel, or NULL to use a
+ *        Rendezvous Point channel.
+ * @param user_data Passed to the function.
+ */
+void processstore_set_pairchannel(ProcessStore * processstoredata, PairThreadChannel channel, void * user_data) {
+	processstoredata->pairchannel = channel;
+	processstoredata->pairchannel_data = user_data;
+}
+
+/**
+ * Get the PairThread for a pairing with a specified handle.
+ *
+ * @param processstoredata The object to get the PairThread from.
+ * @param handle The handle returned by StartPair.
+ * @return The PairThread for the pairing, or NULL if there's no pairing
+ *         with the handle.
+ */
+PairThread * processstore_get_pairthread(ProcessStore * processstoredata, int handle) {
+	PairItem * item;
+
+	item = g_hash_table_lookup(processstoredata->pairings, GINT_TO_POINTER(handle));
+
+	return (item != NULL) ? item->pairthread : NULL;
+}
+
 /**
  * Set the owner's unique dbus name. The owner is the process that initiated
  * the authentication request via dbus. If the owner drops the request a
@@ -401,7 +703,140 @@ static void processstore_set_owner(ProcessStore * processstoredata, int handle,
 }
 
 /**
- * Lock the user's session.
+ * Create a new CallerLookup to hold a dbus call while its caller's user id
+ * is found. The arguments specific to the call can then be copied into it.
+ *
+ * @param processstoredata The object that will handle the call.
+ * @param object The object data needed to reply to the dbus message.
+ * @param invocation The invocaion data needed to reply to the dbus message.
+ * @param ready The function to handle the call once the user id is known.
+ * @return The newly created object.
+ */
+static CallerLookup * processstore_lookup_new(ProcessStore * processstoredata, PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, CallerReady ready) {
+	CallerLookup * lookup;
+
+	lookup = CALLOC(sizeof(CallerLookup), 1);
+	lookup->processstoredata = processstoredata;
+	lookup->object = object;
+	lookup->invocation = invocation;
+	lookup->ready = ready;
+	lookup->handle = -1;
+	lookup->username = NULL;
+	lookup->password = NULL;
+	lookup->parameters = NULL;
+	lookup->code = NULL;
+
+	return lookup;
+}
+
+/**
+ * Delete a CallerLookup, freeing the copies of the call's arguments. The
+ * password is cleared before it's freed.
+ *
+ * @param lookup The object to free.
+ */
+static void processstore_lookup_delete(CallerLookup * lookup) {
+	if (lookup != NULL) {
+		if (lookup->password != NULL) {
+			memset(lookup->password, 0, strlen(lookup->password));
+			g_free(lookup->password);
+		}
+		g_free(lookup->username);
+		g_free(lookup->parameters);
+		g_free(lookup->code);
+
+		FREE(lookup);
+	}
+}
+
+/**
+ * Ask the bus daemon for the user id of the process that sent a dbus
+ * message. The request is made asynchronously, and the lookup's ready
+ * function is called with the user id once the reply arrives. The user id
+ * is (uid_t)-1 if it couldn't be found.
+ *
+ * Ownership of the lookup passes to this function, which deletes it once
+ * the ready function has returned.
+ *
+ * @param lookup The dbus call to find the caller's user id for.
+ */
+static void processstore_lookup_caller(CallerLookup * lookup) {
+	GDBusConnection * connection;
+	char const * sender;
+
+	connection = g_dbus_method_invocation_get_connection(lookup->invocation);
+	sender = g_dbus_method_invocation_get_sender(lookup->invocation);
+
+	if ((connection != NULL) && (sender != NULL)) {
+		g_dbus_connection_call(connection, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus", "GetConnectionUnixUser", g_variant_new("(s)", sender), G_VARIANT_TYPE("(u)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL, processstore_lookup_finished, lookup);
+	}
+	else {
+		lookup->ready(lookup, (uid_t)-1);
+		processstore_lookup_delete(lookup);
+	}
+}
+
+/**
+ * Internal callback with the bus daemon's reply giving the user id of a
+ * caller. The call waiting for it is handled and the lookup deleted.
+ *
+ * @param source The dbus connection the request was made on.
+ * @param res The result of the request.
+ * @param user_data The CallerLookup, cast to (gpointer).
+ */
+static void processstore_lookup_finished(GObject * source, GAsyncResult * res, gpointer user_data) {
+	CallerLookup * lookup = (CallerLookup *)user_data;
+	GVariant * reply;
+	GError * error;
+	guint32 uid;
+	uid_t calleruid;
+
+	calleruid = (uid_t)-1;
+	error = NULL;
+	reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+	if (reply != NULL) {
+		g_variant_get(reply, "(u)", &uid);
+		calleruid = (uid_t)uid;
+		g_variant_unref(reply);
+	}
+	else {
+		LOG(LOG_ERR, "Failed to get caller's user id: %s", error->message);
+		g_error_free(error);
+	}
+
+	lookup->ready(lookup, calleruid);
+	processstore_lookup_delete(lookup);
+}
+
+/**
+ * Check whether a caller is allowed to use an existing session. Using it
+ * means either taking the session's password (instant unlock) or sharing
+ * its link, so the caller must be root or the dbus client that owns the
+ * session. Other processes running as the session's user aren't trusted,
+ * since the Pico may answer without the user doing anything.
+ *
+ * @param item The existing session the caller wants to use.
+ * @param caller The unique dbus name of the caller, or NULL if unknown.
+ * @param calleruid The user id of the caller, or (uid_t)-1 if unknown.
+ * @return true if the caller may use the session, false o/w.
+ */
+static bool processstore_trusted(ProcessItem const * item, char const * caller, uid_t calleruid) {
+	bool result;
+
+	result = false;
+	if (calleruid == 0) {
+		result = true;
+	}
+	else if ((caller != NULL) && (item->owner != NULL) && (strcmp(caller, item->owner) == 0)) {
+		result = true;
+	}
+
+	return result;
+}
+
+/**
+ * Lock the user's session. This blocks until the lock command completes,
+ * so is only used if no Locker has been set.
  *
  * @param username the name of the user who's session should be locked
  */
@@ -430,42 +865,99 @@ void lock(char const * username) {
  * (channels, threads, etc) and returns (via dbus) the code that should be
  * displayed to the user (as a QR code).
  *
- * The return value represents whether the authentication was set up correctly,
- * not whether authentication occurred, or was successful.
+ * Since the caller's user id is needed, the authentication is only set up
+ * once the bus daemon has replied with it, so the main loop isn't blocked
+ * while it does.
+ *
+ * If a speculative session is already running for the user with the same
+ * parameters, started by processstore_away(), the call attaches to it
+ * rather than starting a new session. If the caller is root, the parameters
+ * are remembered once the session authenticates successfully, so that the
+ * next speculative session for the user can be started with them.
  *
  * @param processstoredata The object to store the associated thread bundle in.
  * @param object The object data needed to reply to the dbus message.
  * @param invocation The invocaion data needed to reply to the dbus message.
  * @param parameters The parameters to use for the authentication, in the form
  *        of a JSON dictionary.
- * @return TRUE if the authentication process was set up correctlt, FALSE o/w.
+ * @return TRUE, since the call is always handled. The reply is sent once
+ *         the caller's user id has been found.
  */
 bool start_auth(ProcessStore * processstoredata, PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, char const * username, char const * parameters) {
+	CallerLookup * lookup;
+
+	lookup = processstore_lookup_new(processstoredata, object, invocation, processstore_start_auth_ready);
+	lookup->username = g_strdup(username);
+	lookup->parameters = g_strdup(parameters);
+	processstore_lookup_caller(lookup);
+
+	return true;
+}
+
+/**
+ * Set up an authentication requested by a StartAuth call, once the user id
+ * of the caller is known. See start_auth() for details.
+ *
+ * @param lookup The StartAuth call.
+ * @param calleruid The user id of the caller, or (uid_t)-1 if unknown.
+ */
+static void processstore_start_auth_ready(CallerLookup * lookup, uid_t calleruid) {
+	ProcessStore * processstoredata;
+	PicoUkAcCamClPicoInterface * object;
+	GDBusMethodInvocation * invocation;
+	char const * username;
+	char const * parameters;
 	bool result;
 	int handle;
 	AuthThread * auththread;
 	gboolean success;
 	gchar const * code = "";
+	bool attached;
+	gchar * caller;
+
+	processstoredata = lookup->processstoredata;
+	object = lookup->object;
+	invocation = lookup->invocation;
+	username = lookup->username;
+	parameters = lookup->parameters;
+
+	// The caller's identity is needed after the invocation has been replied to
+	caller = g_strdup(g_dbus_method_invocation_get_sender(invocation));
+
+	attached = processstore_attach(processstoredata, object, invocation, username, parameters, caller, calleruid);
 
 	result = true;
-	handle = processstore_add(processstoredata);
+	if (attached == false) {
+		handle = processstore_add(processstoredata);
 
-	if (handle < 0) {
-		result = false;
-		success = result;
-		pico_uk_ac_cam_cl_pico_interface_complete_start_auth(object, invocation, handle, code, success);
+		if (handle < 0) {
+			result = false;
+			success = result;
+			pico_uk_ac_cam_cl_pico_interface_complete_start_auth(object, invocation, handle, code, success);
+		}
 	}
 
-	if (result) {
+	if (result && (attached == false)) {
+		processstoredata->items[handle]->privileged = (calleruid == 0);
 		auththread = processstore_get_auththread(processstoredata, handle);
 		result = auththread_config(auththread, parameters);
 	}
 
-	if (result) {
+	if (result && (attached == false) && auththread_get_bluetooth(auththread)) {
+		processstore_start_bluetooth(processstoredata);
+	}
+
+	if (result && (attached == false)) {
 		auththread_set_object(auththread, object);
 		auththread_set_invocation(auththread, invocation);
 		auththread_set_username(auththread, username);
 		auththread_set_loop(auththread, processstoredata->loop);
+		auththread_set_cryptopool(auththread, processstoredata->cryptopool);
+		auththread_set_keycache(auththread, processstoredata->keycache);
+		auththread_set_userscache(auththread, processstoredata->userscache);
+		auththread_set_locker(auththread, processstoredata->locker);
+		auththread_set_rvpendpoints(auththread, processstoredata->rvpendpoints);
+		auththread_set_rvpwarmer(auththread, processstoredata->rvpwarmer);
 
 		LOG(LOG_INFO, "Starting authentication");
 
@@ -475,12 +967,145 @@ bool start_auth(ProcessStore * processstoredata, PicoUkAcCamClPicoInterface * ob
 
 		// Stop any pre-existing AuthThreads with the same commitment and in a
 		// continuously authenticating state
-		processstore_stop_similar(processstoredata, auththread);
+		processstore_stop_similar(processstoredata, auththread, caller, calleruid);
+	}
+
+	g_free(caller);
+}
+
+/**
+ * Attach a StartAuth call to a speculative session for the same user, if
+ * there is one that was started with the same parameters and the caller is
+ * trusted to use it. Any other continuous sessions it replaces are stopped,
+ * just as if the session had been started by the call. See
+ * auththread_attach() for details.
+ *
+ * @param processstoredata The object managing the sessions.
+ * @param object The object data needed to reply to the dbus message.
+ * @param invocation The invocaion data needed to reply to the dbus message.
+ * @param username The user the call is authenticating.
+ * @param parameters The parameters passed in the call.
+ * @param caller The unique dbus name of the caller.
+ * @param calleruid The user id of the caller, or (uid_t)-1 if unknown.
+ * @return true if the call was attached and replied to, false o/w.
+ */
+static bool processstore_attach(ProcessStore * processstoredata, PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, char const * username, char const * parameters, char const * caller, uid_t calleruid) {
+	ProcessItem * item;
+	bool result;
+
+	result = false;
+	item = processstoredata->first;
+	while ((item != NULL) && (result == false)) {
+		if (auththread_get_speculative(item->auththread) && (strcmp(auththread_get_username(item->auththread), username) == 0) && processstore_trusted(item, caller, calleruid)) {
+			result = auththread_attach(item->auththread, parameters, object, invocation);
+			if (result) {
+				item->privileged = (calleruid == 0);
+				processstore_stop_similar(processstoredata, item->auththread, caller, calleruid);
+			}
+		}
+		item = item->next;
 	}
 
 	return result;
 }
 
+/**
+ * Respond to a user's desktop session locking or going idle, or becoming
+ * active again. The user's continuous sessions are told, so that the
+ * interval between their Pico's heartbeats can follow the user's activity.
+ *
+ * If pre-authentication is enabled (see processstore_set_preauth()), a
+ * speculative session is also started or stopped for the user. When the
+ * user goes away, a session is started so that the code is ready and the
+ * Pico can authenticate before the greeter asks, at which point the
+ * greeter's StartAuth call attaches to it. When the user comes back without
+ * the greeter having asked, the speculative session is stopped.
+ *
+ * The speculative session uses the parameters from the user's last StartAuth call, so
+ * nothing is started for users who haven't authenticated since the daemon
+ * started. Nothing is started either if the user already has a session in
+ * progress, if MAX_SPECULATIVE_SESSIONS are already running, or if there's
+ * no free handle.
+ *
+ * @param processstoredata The object managing the sessions.
+ * @param username The user who's session changed.
+ * @param away true if the user's session locked or went idle, false if it
+ *        became active again.
+ */
+void processstore_away(ProcessStore * processstoredata, char const * username, bool away) {
+	ProcessItem * item;
+	AuthThread * auththread;
+	char const * parameters;
+	bool result;
+	int handle;
+	int speculative;
+
+	processstore_harvest(processstoredata);
+
+	// Check whether the user already has a session
+	result = true;
+	speculative = 0;
+	item = processstoredata->first;
+	while (item != NULL) {
+		if ((strcmp(auththread_get_username(item->auththread), username) == 0) && (auththread_get_state(item->auththread) < AUTHTHREADSTATE_HARVESTABLE)) {
+			auththread_set_user_away(item->auththread, away);
+			if ((away == false) && auththread_get_speculative(item->auththread)) {
+				LOG(LOG_INFO, "Stopping speculative session for %s", username);
+				auththread_stop(item->auththread);
+			}
+			result = false;
+		}
+		if (auththread_get_speculative(item->auththread) && (auththread_get_state(item->auththread) < AUTHTHREADSTATE_HARVESTABLE)) {
+			speculative++;
+		}
+		item = item->next;
+	}
+
+	// Speculative sessions never take the last handles from StartAuth calls
+	if ((away == true) && (result == true) && ((speculative >= MAX_SPECULATIVE_SESSIONS) || (processstoredata->nextAvailable >= MAX_SIMULTANEOUS_AUTHS))) {
+		LOG(LOG_INFO, "Not starting speculative session for %s; too many sessions running", username);
+		result = false;
+	}
+
+	parameters = g_hash_table_lookup(processstoredata->preauthparams, username);
+	if ((processstoredata->preauth) && (away == true) && (result == true) && (parameters != NULL)) {
+		handle = processstore_add(processstoredata);
+		result = (handle >= 0);
+
+		if (result) {
+			auththread = processstore_get_auththread(processstoredata, handle);
+			result = auththread_config(auththread, parameters);
+			if (result == false) {
+				processstore_remove(processstoredata, handle);
+			}
+		}
+
+		if (result && auththread_get_bluetooth(auththread)) {
+			processstore_start_bluetooth(processstoredata);
+		}
+
+		if (result) {
+			auththread_set_username(auththread, username);
+			auththread_set_loop(auththread, processstoredata->loop);
+			auththread_set_cryptopool(auththread, processstoredata->cryptopool);
+			auththread_set_keycache(auththread, processstoredata->keycache);
+			auththread_set_userscache(auththread, processstoredata->userscache);
+			auththread_set_locker(auththread, processstoredata->locker);
+			auththread_set_rvpendpoints(auththread, processstoredata->rvpendpoints);
+			auththread_set_rvpwarmer(auththread, processstoredata->rvpwarmer);
+			auththread_set_speculative(auththread, TRUE);
+
+			LOG(LOG_INFO, "Starting speculative session for %s", username);
+
+			result = auththread_start_auth(auththread);
+			if (result == false) {
+				LOG(LOG_ERR, "Failed to start speculative session");
+				auththread_stop(auththread);
+			}
+		}
+	}
+}
+
 /**
  * Compare all existing running AuthThreads and compare their commitment
  * against the AuthThread just started. If there are any existing AuthThreads
@@ -496,12 +1121,28 @@ bool start_auth(ProcessStore * processstoredata, PicoUkAcCamClPicoInterface * ob
  * this case, it doesn't make sense to keep the existing continuous session
  * running.
  *
+ * If the new AuthThread is configured for instant unlock, the Pico in the
+ * existing session is challenged first. If it answers, the new AuthThread
+ * completes straight away. Either way the existing session is left
+ * running; if the Pico fails to answer, for example because its app
+ * doesn't support challenges, the new AuthThread authenticates as usual.
+ *
+ * The same happens if the new AuthThread is configured to share links, in
+ * which case it then subscribes to the existing session's link rather than
+ * continuously authenticating over a channel of its own.
+ *
+ * Existing sessions are only touched if the caller who started the new
+ * AuthThread is trusted to use them (see processstore_trusted()). Otherwise
+ * any local user could stop another user's session, or take its password.
+ *
  * @param processstoredata The object managing the thread bundle for the
  *        authentication.
  * @param auththread The AuthThread that was just started. This AuthThread
  *        takes precedence.
+ * @param caller The unique dbus name of the caller who started it.
+ * @param calleruid The user id of the caller, or (uid_t)-1 if unknown.
  */
-static void processstore_stop_similar(ProcessStore * processstoredata, AuthThread const * auththread) {
+static void processstore_stop_similar(ProcessStore * processstoredata, AuthThread * auththread, char const * caller, uid_t calleruid) {
 	bool result;
 	Buffer * commitment;
 	Buffer * compare;
@@ -509,6 +1150,8 @@ static void processstore_stop_similar(ProcessStore * processstoredata, AuthThrea
 	AUTHTHREADSTATE authstate;
 	char const * user;
 	char const * usercompare;
+	bool instantunlock;
+	InstantUnlock * instant;
 
 	// Get the commitment for the current AuthThread
 	commitment = buffer_new(0);
@@ -517,6 +1160,7 @@ static void processstore_stop_similar(ProcessStore * processstoredata, AuthThrea
 	// Search through all of the existing AuthThreads and compare the commitment
 	if (result == true) {
 		user = auththread_get_username(auththread);
+		instantunlock = auththread_get_instantunlock(auththread) || auththread_get_sharelink(auththread);
 		compare = buffer_new(0);
 
 		item = processstoredata->first;
@@ -537,6 +1181,30 @@ static void processstore_stop_similar(ProcessStore * processstoredata, AuthThrea
 				result = buffer_equals(commitment, compare);
 			}
 
+			if (result == true) {
+				result = processstore_trusted(item, caller, calleruid);
+				if (result == false) {
+					LOG(LOG_WARNING, "Caller not allowed to use existing session for %s", user);
+				}
+			}
+
+			if ((result == true) && (instantunlock == true)) {
+				instant = CALLOC(sizeof(InstantUnlock), 1);
+				instant->processstoredata = processstoredata;
+				instant->handle = auththread_get_handle(auththread);
+				instant->auththread = auththread;
+				instant->generation = processstoredata->items[instant->handle]->generation;
+				if (auththread_request_presence(item->auththread, INSTANT_UNLOCK_TIMEOUT, processstore_instant_result, instant)) {
+					LOG(LOG_INFO, "Challenging existing continuous session for instant unlock");
+					// Only one existing session needs to answer
+					instantunlock = false;
+					result = false;
+				}
+				else {
+					FREE(instant);
+				}
+			}
+
 			if (result == true) {
 				// Stop the AuthThread; the new AuthThread takes priority
 				LOG(LOG_INFO, "Already continuously authenticating with this service");
@@ -552,6 +1220,42 @@ static void processstore_stop_similar(ProcessStore * processstoredata, AuthThrea
 	buffer_delete(commitment);
 }
 
+/**
+ * Internal callback with the result of challenging an existing continuous
+ * session for instant unlock. If the Pico answered, the new authentication
+ * completes using the existing session. Otherwise the new authentication
+ * carries on as usual. The challenge isn't part of the Pico protocol, so
+ * a Pico app that doesn't support it never answers; the existing session
+ * is therefore left running, and only ends if its own continuous
+ * authentication fails. If the new authentication has gone away in the
+ * meantime, nothing is done, even if its handle has since been given to
+ * another session.
+ *
+ * @param existing The existing AuthThread that was challenged.
+ * @param present true if the Pico answered the challenge, false o/w.
+ * @param user_data The InstantUnlock structure, cast to (void *).
+ */
+static void processstore_instant_result(AuthThread * existing, bool present, void * user_data) {
+	InstantUnlock * instant = (InstantUnlock *)user_data;
+	AuthThread * auththread;
+	ProcessItem * item;
+
+	auththread = NULL;
+	item = instant->processstoredata->items[instant->handle];
+	if ((item != NULL) && (item->generation == instant->generation) && (item->auththread == instant->auththread)) {
+		auththread = item->auththread;
+	}
+
+	if ((present == true) && (auththread != NULL)) {
+		auththread_complete_instant(auththread, existing);
+	}
+	else if (auththread != NULL) {
+		LOG(LOG_INFO, "Existing continuous session didn't answer, authenticating as usual");
+	}
+
+	FREE(instant);
+}
+
 /**
  * Complete the process of authentication. This function is called in response
  * to a CompleteAuth dbus message being received. It waits for a Pico app to
@@ -587,6 +1291,9 @@ bool complete_auth(ProcessStore * processstoredata, PicoUkAcCamClPicoInterface *
 		if (auththread) {
 			state = auththread_get_state(auththread);
 
+			// Later progress goes to the caller waiting for the result
+			auththread_set_listener(auththread, invocation);
+
 			if (state >= AUTHTHREADSTATE_COMPLETED) {
 				auththread_set_object(auththread, NULL);
 				auththread_set_invocation(auththread, NULL);
@@ -611,6 +1318,353 @@ bool complete_auth(ProcessStore * processstoredata, PicoUkAcCamClPicoInterface *
 	return result;
 }
 
+/**
+ * Resume an authentication session started by an earlier StartAuth call.
+ * This function is called in response to a ResumeAuth dbus message being
+ * received, which pam_pico sends when it's called again for the same login
+ * rather than starting a new session. See auththread_resume() for when a
+ * session can be resumed.
+ *
+ * If the session is resumed, the caller becomes its owner and should call
+ * CompleteAuth with the same handle to get the result. Since the code is
+ * shown to anyone nearby, it isn't enough to resume a session on its own.
+ * The caller must also be trusted to use the session (see
+ * processstore_trusted()).
+ *
+ * @param processstoredata The object managing the sessions.
+ * @param object The object data needed to reply to the dbus message.
+ * @param invocation The invocaion data needed to reply to the dbus message.
+ * @param handle The handle returned by the earlier StartAuth call.
+ * @param username The user the caller is authenticating.
+ * @param code The code returned by the earlier StartAuth call.
+ * @return TRUE, since the call is always handled. The reply, saying whether
+ *         the session was resumed, is sent once the caller's user id has
+ *         been found.
+ */
+bool resume_auth(ProcessStore * processstoredata, PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, int handle, char const * username, char const * code) {
+	CallerLookup * lookup;
+
+	lookup = processstore_lookup_new(processstoredata, object, invocation, processstore_resume_auth_ready);
+	lookup->handle = handle;
+	lookup->username = g_strdup(username);
+	lookup->code = g_strdup(code);
+	processstore_lookup_caller(lookup);
+
+	return true;
+}
+
+/**
+ * Resume a session as requested by a ResumeAuth call, once the user id of
+ * the caller is known. See resume_auth() for details.
+ *
+ * @param lookup The ResumeAuth call.
+ * @param calleruid The user id of the caller, or (uid_t)-1 if unknown.
+ */
+static void processstore_resume_auth_ready(CallerLookup * lookup, uid_t calleruid) {
+	ProcessStore * processstoredata;
+	GDBusMethodInvocation * invocation;
+	int handle;
+	AuthThread * auththread;
+	char const * caller;
+	bool success;
+
+	processstoredata = lookup->processstoredata;
+	invocation = lookup->invocation;
+	handle = lookup->handle;
+
+	success = false;
+	auththread = processstore_get_auththread(processstoredata, handle);
+	if (auththread != NULL) {
+		caller = g_dbus_method_invocation_get_sender(invocation);
+		success = processstore_trusted(processstoredata->items[handle], caller, calleruid);
+		if (success == false) {
+			LOG(LOG_ERR, "Caller not trusted to resume session %d", handle);
+		}
+	}
+
+	if (success) {
+		success = auththread_resume(auththread, lookup->username, lookup->code);
+	}
+
+	if (success) {
+		processstore_set_owner(processstoredata, handle, invocation);
+		auththread_set_listener(auththread, invocation);
+	}
+	else {
+		LOG(LOG_INFO, "Session %d can't be resumed", handle);
+	}
+
+	pico_uk_ac_cam_cl_pico_interface_complete_resume_auth(lookup->object, invocation, success);
+}
+
+/**
+ * Cancel an authentication session that's no longer needed. This function
+ * is called in response to a CancelAuth dbus message being received, which
+ * pam_pico sends when it's cleaned up without having used a session it
+ * started. The session stops as if its owner had gone away, so that a
+ * session that has already authenticated the user, and may now be
+ * authenticating them continuously, is left running.
+ *
+ * The caller must pass the code returned by the StartAuth call, and must be
+ * the session's owner if it has one.
+ *
+ * @param processstoredata The object managing the sessions.
+ * @param object The object data needed to reply to the dbus message.
+ * @param invocation The invocaion data needed to reply to the dbus message.
+ * @param handle The handle returned by the StartAuth call.
+ * @param code The code returned by the StartAuth call.
+ * @return TRUE if the call was handled, whether or not the session was
+ *         cancelled.
+ */
+bool cancel_auth(ProcessStore * processstoredata, PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, int handle, char const * code) {
+	AuthThread * auththread;
+	char const * sender;
+	bool result;
+
+	result = false;
+	auththread = processstore_get_auththread(processstoredata, handle);
+	if (auththread != NULL) {
+		result = auththread_check_code(auththread, code);
+	}
+
+	if (result && (processstoredata->items[handle]->owner != NULL)) {
+		sender = g_dbus_method_invocation_get_sender(invocation);
+		result = (sender != NULL) && (strcmp(processstoredata->items[handle]->owner, sender) == 0);
+	}
+
+	if (result) {
+		LOG(LOG_INFO, "Cancelling session %d", handle);
+		auththread_ownerlost(auththread);
+	}
+
+	pico_uk_ac_cam_cl_pico_interface_complete_cancel_auth(object, invocation);
+
+	return true;
+}
+
+/**
+ * Start pairing a user with a Pico. This function is called in response to
+ * a StartPair dbus message being received. The pairing is handed to a
+ * PairThread, and the reply, containing the code to display to the user
+ * (as a QR code), is sent once the PairThread has generated it.
+ *
+ * The password isn't checked here. Only root may call the method, and it's
+ * up to the caller (e.g. pico-pair) to check the password before requesting
+ * the pairing. The dbus policy already restricts the method to root, but
+ * the caller's user id is checked here as well, so that a permissive or
+ * misconfigured policy can't let other users pair a Pico with any account.
+ *
+ * The pairing is only set up once the bus daemon has replied with the
+ * caller's user id, so the main loop isn't blocked while it does.
+ *
+ * @param processstoredata The object to store the pairing in.
+ * @param object The object data needed to reply to the dbus message.
+ * @param invocation The invocaion data needed to reply to the dbus message.
+ * @param username The user to pair.
+ * @param password The user's password, to be stored on their Pico.
+ * @param parameters The parameters to use for the pairing, in the form of
+ *        a JSON dictionary. Only the configuration directory is used.
+ * @return TRUE, since the call is always handled. The reply is sent once
+ *         the caller's user id has been found.
+ */
+bool start_pair(ProcessStore * processstoredata, PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, char const * username, char const * password, char const * parameters) {
+	CallerLookup * lookup;
+
+	lookup = processstore_lookup_new(processstoredata, object, invocation, processstore_start_pair_ready);
+	lookup->username = g_strdup(username);
+	lookup->password = g_strdup(password);
+	lookup->parameters = g_strdup(parameters);
+	processstore_lookup_caller(lookup);
+
+	return true;
+}
+
+/**
+ * Start a pairing requested by a StartPair call, once the user id of the
+ * caller is known. See start_pair() for details.
+ *
+ * @param lookup The StartPair call.
+ * @param calleruid The user id of the caller, or (uid_t)-1 if unknown.
+ */
+static void processstore_start_pair_ready(CallerLookup * lookup, uid_t calleruid) {
+	ProcessStore * processstoredata;
+	PicoUkAcCamClPicoInterface * object;
+	GDBusMethodInvocation * invocation;
+	bool result;
+	AuthConfig * authconfig;
+	PairItem * item;
+
+	processstoredata = lookup->processstoredata;
+	object = lookup->object;
+	invocation = lookup->invocation;
+
+	item = NULL;
+	authconfig = authconfig_new();
+	result = (calleruid == 0);
+	if (result == FALSE) {
+		LOG(LOG_ERR, "Cannot start pairing; caller isn't root");
+	}
+
+	if (result) {
+		result = (g_hash_table_size(processstoredata->pairings) < MAX_SIMULTANEOUS_PAIRINGS);
+		if (result == FALSE) {
+			LOG(LOG_ERR, "Cannot start pairing; limit of %d reached", MAX_SIMULTANEOUS_PAIRINGS);
+		}
+	}
+
+	if (result) {
+		result = authconfig_read_json(authconfig, lookup->parameters);
+	}
+
+	if (result) {
+		item = CALLOC(sizeof(PairItem), 1);
+		item->processstoredata = processstoredata;
+		item->handle = processstoredata->nextpairing;
+		item->pairthread = pairthread_new();
+		item->object = object;
+		item->invocation = invocation;
+		item->owner = g_strdup(g_dbus_method_invocation_get_sender(invocation));
+		item->started = FALSE;
+		item->orphaned = FALSE;
+		processstoredata->nextpairing = (processstoredata->nextpairing + 1) & G_MAXINT;
+
+		pairthread_set_keycache(item->pairthread, processstoredata->keycache);
+		pairthread_set_userscache(item->pairthread, processstoredata->userscache);
+		pairthread_set_callbacks(item->pairthread, processstore_pair_started, processstore_pair_finished, item);
+		pairthread_set_channel(item->pairthread, processstoredata->pairchannel, processstoredata->pairchannel_data);
+		g_hash_table_insert(processstoredata->pairings, GINT_TO_POINTER(item->handle), item);
+
+		result = pairthread_start(item->pairthread, lookup->username, lookup->password, authconfig_get_configdir(authconfig), g_get_host_name());
+		if (result == FALSE) {
+			item->invocation = NULL;
+			g_hash_table_remove(processstoredata->pairings, GINT_TO_POINTER(item->handle));
+		}
+	}
+
+	if (result == FALSE) {
+		pico_uk_ac_cam_cl_pico_interface_complete_start_pair(object, invocation, -1, "", FALSE);
+	}
+
+	authconfig_delete(authconfig);
+}
+
+/**
+ * Complete the process of pairing. This function is called in response to
+ * a CompletePair dbus message being received. The reply is sent once the
+ * Pico has paired and the user has been added, or the pairing has failed.
+ *
+ * The return value represents whether the handle was valid, not whether
+ * pairing was successful.
+ *
+ * @param processstoredata The object managing the pairing.
+ * @param object The object data needed to reply to the dbus message.
+ * @param invocation The invocaion data needed to reply to the dbus message.
+ * @param handle The handle returned by StartPair.
+ * @return TRUE if the pairing was found, FALSE o/w.
+ */
+bool complete_pair(ProcessStore * processstoredata, PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, int handle) {
+	bool result;
+	PairItem * item;
+	gboolean success;
+
+	item = g_hash_table_lookup(processstoredata->pairings, GINT_TO_POINTER(handle));
+	result = ((item != NULL) && (item->started == TRUE) && (item->invocation == NULL));
+
+	if (result == FALSE) {
+		LOG(LOG_ERR, "Returning on error with success %d\n", false);
+		pico_uk_ac_cam_cl_pico_interface_complete_complete_pair(object, invocation, FALSE);
+	}
+	else if (pairthread_get_state(item->pairthread) >= PAIRTHREADSTATE_COMPLETED) {
+		success = pairthread_get_result(item->pairthread);
+		LOG(LOG_INFO, "Returning immediately with success %d\n", success);
+		pico_uk_ac_cam_cl_pico_interface_complete_complete_pair(object, invocation, success);
+		g_hash_table_remove(processstoredata->pairings, GINT_TO_POINTER(handle));
+	}
+	else {
+		g_free(item->owner);
+		item->owner = g_strdup(g_dbus_method_invocation_get_sender(invocation));
+		item->object = object;
+		item->invocation = invocation;
+	}
+
+	return result;
+}
+
+/**
+ * Internal callback used once a PairThread has generated the code to show
+ * the user, or failed to. Replies to the StartPair call.
+ *
+ * @param pairthread The PairThread being started.
+ * @param code The code to display, or NULL if the pairing couldn't start.
+ * @param user_data The PairItem, cast to (void *).
+ */
+static void processstore_pair_started(PairThread * pairthread, char const * code, void * user_data) {
+	PairItem * item = (PairItem *)user_data;
+
+	item->started = (code != NULL);
+	if (item->invocation != NULL) {
+		pico_uk_ac_cam_cl_pico_interface_complete_start_pair(item->object, item->invocation, item->started ? item->handle : -1, item->started ? code : "", item->started);
+		item->object = NULL;
+		item->invocation = NULL;
+	}
+}
+
+/**
+ * Internal callback used once a PairThread has finished. Replies to the
+ * CompletePair call if there is one waiting, and removes the pairing if
+ * nobody will collect its result.
+ *
+ * @param pairthread The PairThread that finished.
+ * @param success true if the user was paired, false o/w.
+ * @param user_data The PairItem, cast to (void *).
+ */
+static void processstore_pair_finished(PairThread * pairthread, bool success, void * user_data) {
+	PairItem * item = (PairItem *)user_data;
+	bool collected;
+
+	collected = FALSE;
+	if (item->invocation != NULL) {
+		LOG(LOG_INFO, "Returning with success %d\n", success);
+		pico_uk_ac_cam_cl_pico_interface_complete_complete_pair(item->object, item->invocation, success);
+		item->object = NULL;
+		item->invocation = NULL;
+		collected = TRUE;
+	}
+
+	if ((collected == TRUE) || (item->started == FALSE) || (item->orphaned == TRUE)) {
+		// Deletes the PairThread, which is allowed from within the callback
+		g_hash_table_remove(item->processstoredata->pairings, GINT_TO_POINTER(item->handle));
+	}
+}
+
+/**
+ * Free up a pairing removed from the hash table. A pairing still in
+ * progress is abandoned, which may block until the PairThread's current
+ * wait for the Pico ends, and any call still waiting is failed.
+ *
+ * @param data The PairItem, cast to (gpointer).
+ */
+static void processstore_pair_delete(gpointer data) {
+	PairItem * item = (PairItem *)data;
+
+	if (item) {
+		if (item->invocation != NULL) {
+			g_dbus_method_invocation_return_dbus_error(item->invocation, "org.freedesktop.DBus.Error.Failed", "Pairing abandoned");
+			item->invocation = NULL;
+		}
+
+		if (item->pairthread) {
+			pairthread_delete(item->pairthread);
+			item->pairthread = NULL;
+		}
+
+		g_free(item->owner);
+		item->owner = NULL;
+
+		FREE(item);
+	}
+}
+
 /**
  * When the dbus calling process loses interest (e.g. the process is killed
  * unexpectedly) a "NameOwnerChanged" signal is received. We use this as a
@@ -628,6 +1682,8 @@ bool complete_auth(ProcessStore * processstoredata, PicoUkAcCamClPicoInterface *
 void processstore_owner_lost(ProcessStore * processstoredata, char const * old_owner) {
 	ProcessItem * item;
 	ProcessItem * next;
+	GHashTableIter iter;
+	PairItem * pairitem;
 
 	if (old_owner != NULL) {
 		item = processstoredata->first;
@@ -642,6 +1698,55 @@ void processstore_owner_lost(ProcessStore * processstoredata, char const * old_o
 			}
 			item = next;
 		}
+
+		g_hash_table_iter_init(& iter, processstoredata->pairings);
+		while (g_hash_table_iter_next(& iter, NULL, (gpointer *)& pairitem)) {
+			if ((pairitem->owner != NULL) && (strcmp(pairitem->owner, old_owner) == 0)) {
+				LOG(LOG_DEBUG, "Owner %s of pairing lost", old_owner);
+				if (pairthread_get_state(pairitem->pairthread) >= PAIRTHREADSTATE_COMPLETED) {
+					g_hash_table_iter_remove(& iter);
+				}
+				else {
+					// The pairing is removed once the PairThread notices
+					pairitem->orphaned = TRUE;
+					pairthread_cancel(pairitem->pairthread);
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Check whether there are any sessions in progress, including continuous
+ * sessions and pairings. Completed sessions are harvested first, so they
+ * don't count.
+ *
+ * @param processstoredata The object to check.
+ * @return true if there are no sessions in progress, false o/w.
+ */
+bool processstore_is_idle(ProcessStore * processstoredata) {
+	processstore_harvest(processstoredata);
+
+	return ((processstoredata->first == NULL) && (g_hash_table_size(processstoredata->pairings) == 0));
+}
+
+/**
+ * Initialise Bluetooth, unless it's already been initialised. This is left
+ * until the first session that needs Bluetooth starts, so that the service
+ * starts quickly and doesn't hold the adapter when Bluetooth isn't used.
+ * Bluetooth is deinitialised again when the ProcessStore is deleted.
+ *
+ * @param processstoredata The object managing the sessions.
+ */
+static void processstore_start_bluetooth(ProcessStore * processstoredata) {
+	gint64 start;
+
+	if (processstoredata->bluetooth == FALSE) {
+		LOG(LOG_INFO, "Initialising Bluetooth");
+		start = g_get_monotonic_time();
+		bt_init();
+		processstoredata->bluetooth = TRUE;
+		LOG(LOG_INFO, "Initialised Bluetooth in %" G_GINT64_FORMAT " ms", (g_get_monotonic_time() - start) / 1000);
 	}
 }
 
@@ -41,6 +41,9 @@
  * ProcessStore only needs to handle the one object in order to keep track
  * of all this.
  *
+ * ProcessStore also keeps track of pairings requested over dbus, each of
+ * which is handled by a PairThread object.
+ *
  */
 
 /** \addtogroup Service
@@ -55,9 +58,23 @@
 #include "gdbus-generated.h"
 #include "auththread.h"
 #include "beaconthread.h"
+#include "pairthread.h"
 
 // Defines
 
+/**
+ * @brief The maximum number of simultaneous authentications suppported
+ *
+ * This define sets the maximum number of authentications which can be
+ * simultaneously ongoing. Note that this includes continuous authentication
+ * sessions, and this is a system-wide (rather than per-user) value, so the
+ * number has to be adequaely large to cover all scenarios.
+ *
+ * Given that Bluetooth only supports up to 32 separate channels, there's not
+ * much point in setting a number larger than 32.
+ *
+ */
+#define MAX_SIMULTANEOUS_AUTHS (16)
 
 // Standard names to use for the configuration files
 #define PUB_FILE "pico_pub_key.der"
@@ -87,9 +104,24 @@ void lock(char const * username);
 
 bool start_auth(ProcessStore * processstoredata, PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, char const * username, char const * parameters);
 bool complete_auth(ProcessStore * processstoredata, PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, int handle);
+bool resume_auth(ProcessStore * processstoredata, PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, int handle, char const * username, char const * code);
+bool cancel_auth(ProcessStore * processstoredata, PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, int handle, char const * code);
+bool start_pair(ProcessStore * processstoredata, PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, char const * username, char const * password, char const * parameters);
+bool complete_pair(ProcessStore * processstoredata, PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, int handle);
 void processstore_set_loop(ProcessStore * processstoredata, GMainLoop * loop);
 GMainLoop * processstore_get_loop(ProcessStore * processstoredata);
+void processstore_set_cryptopool(ProcessStore * processstoredata, CryptoPool * cryptopool);
+void processstore_set_keycache(ProcessStore * processstoredata, KeyCache * keycache);
+void processstore_set_userscache(ProcessStore * processstoredata, UsersCache * userscache);
+void processstore_set_locker(ProcessStore * processstoredata, Locker * locker);
+void processstore_set_rvpendpoints(ProcessStore * processstoredata, RvpEndpoints * rvpendpoints);
+void processstore_set_rvpwarmer(ProcessStore * processstoredata, RvpWarmer * rvpwarmer);
+void processstore_set_preauth(ProcessStore * processstoredata, bool preauth);
+void processstore_set_pairchannel(ProcessStore * processstoredata, PairThreadChannel channel, void * user_data);
+PairThread * processstore_get_pairthread(ProcessStore * processstoredata, int handle);
 void processstore_owner_lost(ProcessStore * processstoredata, char const * old_owner);
+bool processstore_is_idle(ProcessStore * processstoredata);
+void processstore_away(ProcessStore * processstoredata, char const * username, bool away);
 
 // Function definitions
 
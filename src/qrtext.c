@@ -0,0 +1,131 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Render a code as a text QR code for display by a PAM client
+ * @section DESCRIPTION
+ *
+ * Converts the code to display into a QR code drawn using text, in the form
+ * requested by the "qrtype" argument to the PAM. See qrtext.h for details.
+ *
+ */
+
+/** \addtogroup PAM
+ *  @{
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <assert.h>
+#include "pico/pico.h"
+#include "pico/displayqr.h"
+
+#include "log.h"
+#include "qrtext.h"
+
+// Defines
+
+/**
+ * @brief Message to display to the user
+ *
+ * Message to print to indicate the user must hit ENTER to log in
+ * This is needed for SSH login, which won't allow messages to
+ * be displayed to the user without expect some response back from them
+ */
+#define MESSAGE_PRESS_ENTER "\nPress ENTER then scan the Pico QR code to login\n"
+
+// Structure definitions
+
+// Function prototypes
+
+// Function definitions
+
+/**
+ * Converts qrtext to the text that should be printed in the terminal
+ *
+ * @param qrtext Text to be converted
+ * @param mode Terminal mode. For QRTYPE_TTTAG the output will be wrapped
+ *        with <tt>
+ * @param requireInput The "Press enter" message will be included in the end
+ *
+ * @return Newly allocated memory containing the text
+ */
+char * convert_text_to_qr_code(const char * qrtext, QRTYPE mode, bool requireInput) {
+	Buffer * qrbuffer;
+	DisplayQR * displayqr;
+	char * return_text;
+	int length;
+	int current;
+
+	LOG(LOG_INFO, "Generating text QR code");
+	if (mode == QRTYPE_ANSI) {
+		displayqr = displayqr_new_params(QRMODE_ANSI);
+	}
+	else if (mode == QRTYPE_COLORLESSUTF8) {
+		displayqr = displayqr_new_params(QRMODE_COLORLESS_UTF8);
+	}
+	else {
+		displayqr = displayqr_new_params(QRMODE_COLOR_UTF8);
+	}
+	displayqr_generate(displayqr, qrtext);
+	
+	// Allocate enough memory to store the QR code ASCII
+	qrbuffer = displayqr_get_output(displayqr);
+	length = buffer_get_pos(qrbuffer);
+	if (mode == QRTYPE_TTTAG) {
+		// Add length required to include "<tt>\n</tt>\n" (the actual strings are added later)
+		length += 11;
+	}
+	if (requireInput == true) {
+		length += strlen(MESSAGE_PRESS_ENTER);
+	}
+	return_text = MALLOC(length + 1);
+	current = 0;
+	if (mode == QRTYPE_TTTAG) {
+		strcpy(return_text, "<tt>\n");
+		current += 5;
+	}
+	memcpy(return_text + current, buffer_get_buffer(qrbuffer), buffer_get_pos(qrbuffer));
+	return_text[current + buffer_get_pos(qrbuffer)] = '\0';
+	current += buffer_get_pos(qrbuffer);
+	if (mode == QRTYPE_TTTAG) {
+		strncat(return_text, "</tt>\n", length - current);
+		current += 6;
+	}
+	if (requireInput == true) {
+		// If we're requesting user input, add a message so the user is aware
+		strncat(return_text, MESSAGE_PRESS_ENTER, length - current);
+		current += strlen(MESSAGE_PRESS_ENTER);
+	}
+	return_text[length] = '\0';
+	displayqr_delete(displayqr);
+	assert(length == current);
+
+	return return_text;
+}
+
+/** @} addtogroup PAM */
+
@@ -0,0 +1,86 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Render a code as a text QR code for display by a PAM client
+ * @section DESCRIPTION
+ *
+ * pam_pico displays the code returned by the service as a QR code, drawn
+ * using text so that it can be shown through the PAM conversation. How it's
+ * drawn depends on the "qrtype" argument passed to the PAM, since not all
+ * clients can display colour or UTF-8 characters.
+ *
+ * The rendering lives here rather than in pam_pico.c so that the benchmarks
+ * can call it with the same QRTYPE values the PAM uses.
+ *
+ */
+
+/** \addtogroup PAM
+ *  @{
+ */
+
+#ifndef __QRTEXT_H
+#define __QRTEXT_H (1)
+
+#include <stdbool.h>
+
+// Defines
+
+// Structure definitions
+
+/**
+ * @brief An enum representating all parameters to the "qrtype" argument
+ *
+ * Strings are hard to deal with; when considering command line arguments it's
+ * easier to use an enum. This enum lists every parameter that will be accepted
+ * following a "qrtype=" command line argument.
+ *
+ * The actual parameter comes in as a string, but can be converted to a member
+ * of this enum using the convert_to_enum() function.
+ *
+ */
+typedef enum _QRTYPE {
+	QRTYPE_INVALID = -1,
+
+	QRTYPE_JSON,
+	QRTYPE_COLORUTF8,
+	QRTYPE_COLORLESSUTF8,
+	QRTYPE_ANSI,
+	QRTYPE_TTTAG,
+	QRTYPE_NONE,
+
+	QRTYPE_NUM
+} QRTYPE;
+
+// Function prototypes
+
+char * convert_text_to_qr_code(const char * qrtext, QRTYPE mode, bool requireInput);
+
+// Function definitions
+
+#endif
+
+/** @} addtogroup PAM */
+
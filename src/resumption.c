@@ -0,0 +1,422 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Abbreviated re-authentication for continuous sessions
+ * @section DESCRIPTION
+ *
+ * Verifies the single round trip messages a Pico uses to resume a continuous
+ * session after a brief loss of link, and generates the reply. See
+ * resumption.h for the format of the messages.
+ *
+ * The service can also issue a challenge, to check that a Pico that's still
+ * connected is present right now.
+ *
+ * The prover side is also provided, for use by tests and tools simulating a
+ * Pico.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <openssl/rand.h>
+#include "pico/debug.h"
+#include "pico/json.h"
+
+#include "log.h"
+#include "resumption.h"
+
+// Defines
+
+/**
+ * @brief The label MACed into a Pico's resumption request
+ */
+#define RESUMPTION_LABEL_REQUEST "resume"
+
+/**
+ * @brief The label MACed into the service's reply
+ */
+#define RESUMPTION_LABEL_REPLY "resumed"
+
+/**
+ * @brief The number of random bytes in a challenge
+ */
+#define RESUMPTION_CHALLENGE_BYTES (16)
+
+/**
+ * @brief The most Pico nonces remembered in one session
+ *
+ * Once this many resumptions and challenge answers have been accepted, any
+ * further ones are refused, so the Pico has to authenticate in full again.
+ */
+#define RESUMPTION_MAX_USED (256)
+
+// Structure definitions
+
+/**
+ * @brief Opaque structure used for verifying resumptions
+ *
+ * The used table holds the Pico nonces already accepted, so that a captured
+ * resumption can't be replayed during the same session. It holds at most
+ * RESUMPTION_MAX_USED entries. The challenge is
+ * the hex nonce most recently sent to the Pico, or empty if there's none
+ * outstanding.
+ *
+ * The lifecycle of this data is managed by Service.
+ *
+ */
+struct _Resumption {
+	Buffer * symmetrickey;
+	Buffer * sessionnonce;
+	GHashTable * used;
+	Buffer * challenge;
+};
+
+// Function prototypes
+
+static gchar * resumption_mac(Buffer const * symmetrickey, char const * label, char const * first, size_t firstlength, char const * second, size_t secondlength);
+static void resumption_mac_field(Buffer * data, char const * field, size_t length);
+static bool resumption_equal(char const * first, char const * second);
+
+// Function definitions
+
+/**
+ * Create a new instance of the class. Resumption will be refused until the
+ * keys have been set using resumption_set_keys(), and for as long as the
+ * session nonce set there is empty.
+ *
+ * @return The newly created object.
+ */
+Resumption * resumption_new() {
+	Resumption * resumption;
+
+	resumption = CALLOC(sizeof(Resumption), 1);
+
+	resumption->symmetrickey = buffer_new(0);
+	resumption->sessionnonce = buffer_new(0);
+	resumption->used = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	resumption->challenge = buffer_new(0);
+
+	return resumption;
+}
+
+/**
+ * Delete an instance of the class, freeing up the memory allocated to it.
+ * The key material is cleared before being freed.
+ *
+ * @param resumption The object to free.
+ */
+void resumption_delete(Resumption * resumption) {
+	if (resumption) {
+		if (resumption->symmetrickey != NULL) {
+			memset(buffer_get_buffer(resumption->symmetrickey), 0, buffer_get_pos(resumption->symmetrickey));
+			buffer_delete(resumption->symmetrickey);
+			resumption->symmetrickey = NULL;
+		}
+
+		if (resumption->sessionnonce != NULL) {
+			buffer_delete(resumption->sessionnonce);
+			resumption->sessionnonce = NULL;
+		}
+
+		if (resumption->used != NULL) {
+			g_hash_table_destroy(resumption->used);
+			resumption->used = NULL;
+		}
+
+		if (resumption->challenge != NULL) {
+			buffer_delete(resumption->challenge);
+			resumption->challenge = NULL;
+		}
+
+		FREE(resumption);
+	}
+}
+
+/**
+ * Set the keys that resumption requests must prove possession of. This
+ * should be the symmetric key shared with the authenticated Pico, and the
+ * service nonce used in the session's handshake. Both are copied.
+ *
+ * @param resumption The object to set the keys for.
+ * @param symmetrickey The symmetric key shared with the Pico.
+ * @param sessionnonce The service nonce from the session's handshake.
+ */
+void resumption_set_keys(Resumption * resumption, Buffer const * symmetrickey, Buffer const * sessionnonce) {
+	memset(buffer_get_buffer(resumption->symmetrickey), 0, buffer_get_pos(resumption->symmetrickey));
+	buffer_clear(resumption->symmetrickey);
+	buffer_append_buffer(resumption->symmetrickey, symmetrickey);
+	buffer_clear(resumption->sessionnonce);
+	buffer_append_buffer(resumption->sessionnonce, sessionnonce);
+}
+
+/**
+ * Generate a new challenge for the Pico to answer, replacing any that's
+ * still outstanding.
+ *
+ * @param resumption The object to generate the challenge for.
+ * @param message A buffer to store the challenge message to send to the
+ *        Pico in. Any existing contents are replaced.
+ */
+void resumption_challenge(Resumption * resumption, Buffer * message) {
+	unsigned char random[RESUMPTION_CHALLENGE_BYTES];
+	char hex[3];
+	Json * json;
+	int pos;
+
+	RAND_bytes(random, RESUMPTION_CHALLENGE_BYTES);
+	buffer_clear(resumption->challenge);
+	for (pos = 0; pos < RESUMPTION_CHALLENGE_BYTES; pos++) {
+		snprintf(hex, sizeof(hex), "%02x", random[pos]);
+		buffer_append(resumption->challenge, hex, 2);
+	}
+	buffer_append(resumption->challenge, "\0", 1);
+
+	json = json_new();
+	json_add_string(json, "challenge", buffer_get_buffer(resumption->challenge));
+	buffer_clear(message);
+	json_serialize_buffer(json, message);
+	json_delete(json);
+}
+
+/**
+ * Check a message received from the Pico during the grace window, or while
+ * a challenge is outstanding. If it's a valid resumption request or answer,
+ * the reply to send back is stored in the reply buffer.
+ *
+ * @param resumption The object to check the message with.
+ * @param data The message received.
+ * @param length The length of the message.
+ * @param reply A buffer to store the reply in, if the resumption is
+ *        accepted. Any existing contents are replaced.
+ * @return RESUMPTIONRESULT_ACCEPTED if the request was valid,
+ *         RESUMPTIONRESULT_ANSWERED if it was a valid answer to the
+ *         challenge, RESUMPTIONRESULT_REJECTED if it wasn't valid, or
+ *         RESUMPTIONRESULT_OTHER if the message isn't a resumption request.
+ */
+RESUMPTIONRESULT resumption_read(Resumption * resumption, char const * data, size_t length, Buffer * reply) {
+	RESUMPTIONRESULT result;
+	Json * json;
+	Json * response;
+	bool parsed;
+	char const * picononce;
+	char const * mac;
+	gchar * expected;
+
+	result = RESUMPTIONRESULT_OTHER;
+	json = json_new();
+	parsed = FALSE;
+	if ((length > 0) && (data[0] == '{')) {
+		parsed = json_deserialize_string(json, data, length);
+	}
+
+	if (parsed && (json_get_type(json, "resume") == JSONTYPE_STRING)) {
+		result = RESUMPTIONRESULT_REJECTED;
+		picononce = json_get_string(json, "resume");
+		mac = NULL;
+		if (json_get_type(json, "mac") == JSONTYPE_STRING) {
+			mac = json_get_string(json, "mac");
+		}
+
+		if ((mac == NULL) || (strlen(picononce) == 0)) {
+			LOG(LOG_ERR, "Malformed resumption request");
+		}
+		else if ((buffer_get_pos(resumption->symmetrickey) == 0) || (buffer_get_pos(resumption->sessionnonce) == 0)) {
+			// Without the handshake nonce the proof isn't bound to this session
+			LOG(LOG_ERR, "Resumption not available for this session");
+		}
+		else if (g_hash_table_contains(resumption->used, picononce)) {
+			LOG(LOG_ERR, "Replayed resumption request");
+		}
+		else if (g_hash_table_size(resumption->used) >= RESUMPTION_MAX_USED) {
+			LOG(LOG_ERR, "Resumption limit reached for this session");
+		}
+		else {
+			expected = resumption_mac(resumption->symmetrickey, RESUMPTION_LABEL_REQUEST, buffer_get_buffer(resumption->sessionnonce), buffer_get_pos(resumption->sessionnonce), picononce, strlen(picononce));
+			if (resumption_equal(expected, mac)) {
+				g_hash_table_add(resumption->used, g_strdup(picononce));
+				g_free(expected);
+
+				expected = resumption_mac(resumption->symmetrickey, RESUMPTION_LABEL_REPLY, picononce, strlen(picononce), buffer_get_buffer(resumption->sessionnonce), buffer_get_pos(resumption->sessionnonce));
+				response = json_new();
+				json_add_string(response, RESUMPTION_LABEL_REPLY, expected);
+				buffer_clear(reply);
+				json_serialize_buffer(response, reply);
+				json_delete(response);
+
+				result = RESUMPTIONRESULT_ACCEPTED;
+				if ((buffer_get_pos(resumption->challenge) > 0) && (strcmp(picononce, buffer_get_buffer(resumption->challenge)) == 0)) {
+					buffer_clear(resumption->challenge);
+					result = RESUMPTIONRESULT_ANSWERED;
+				}
+			}
+			else {
+				LOG(LOG_ERR, "Resumption request failed verification");
+			}
+			g_free(expected);
+		}
+	}
+
+	json_delete(json);
+
+	return result;
+}
+
+/**
+ * Generate a resumption request as a Pico would send it. This is for use by
+ * tests and tools that simulate a Pico.
+ *
+ * @param symmetrickey The symmetric key shared with the service.
+ * @param sessionnonce The service nonce from the session's handshake.
+ * @param picononce A fresh nonce string chosen by the Pico.
+ * @param message A buffer to store the request in. Any existing contents are
+ *        replaced.
+ */
+void resumption_prove(Buffer const * symmetrickey, Buffer const * sessionnonce, char const * picononce, Buffer * message) {
+	Json * json;
+	gchar * mac;
+
+	mac = resumption_mac(symmetrickey, RESUMPTION_LABEL_REQUEST, buffer_get_buffer(sessionnonce), buffer_get_pos(sessionnonce), picononce, strlen(picononce));
+
+	json = json_new();
+	json_add_string(json, RESUMPTION_LABEL_REQUEST, picononce);
+	json_add_string(json, "mac", mac);
+	buffer_clear(message);
+	json_serialize_buffer(json, message);
+	json_delete(json);
+
+	g_free(mac);
+}
+
+/**
+ * Check the reply the service sent to a resumption request, as a Pico would.
+ * This is for use by tests and tools that simulate a Pico.
+ *
+ * @param symmetrickey The symmetric key shared with the service.
+ * @param sessionnonce The service nonce from the session's handshake.
+ * @param picononce The nonce string sent in the request.
+ * @param data The reply received.
+ * @param length The length of the reply.
+ * @return true if the reply proves possession of the key, false o/w.
+ */
+bool resumption_check_reply(Buffer const * symmetrickey, Buffer const * sessionnonce, char const * picononce, char const * data, size_t length) {
+	Json * json;
+	gchar * expected;
+	bool result;
+
+	result = FALSE;
+	json = json_new();
+	if (json_deserialize_string(json, data, length) && (json_get_type(json, RESUMPTION_LABEL_REPLY) == JSONTYPE_STRING)) {
+		expected = resumption_mac(symmetrickey, RESUMPTION_LABEL_REPLY, picononce, strlen(picononce), buffer_get_buffer(sessionnonce), buffer_get_pos(sessionnonce));
+		result = resumption_equal(expected, json_get_string(json, RESUMPTION_LABEL_REPLY));
+		g_free(expected);
+	}
+	json_delete(json);
+
+	return result;
+}
+
+/**
+ * Calculate the MAC over a label followed by two values, using HMAC-SHA256.
+ * Each is preceded by its length, so that no choice of values can make the
+ * input for one label or ordering match that for another.
+ *
+ * @param symmetrickey The key to use.
+ * @param label A NULL-terminated string to MAC first.
+ * @param first The second item to MAC.
+ * @param firstlength The length of the second item.
+ * @param second The third item to MAC.
+ * @param secondlength The length of the third item.
+ * @return The MAC as a hex string, to be freed using g_free().
+ */
+static gchar * resumption_mac(Buffer const * symmetrickey, char const * label, char const * first, size_t firstlength, char const * second, size_t secondlength) {
+	Buffer * data;
+	gchar * mac;
+
+	data = buffer_new(0);
+	resumption_mac_field(data, label, strlen(label));
+	resumption_mac_field(data, first, firstlength);
+	resumption_mac_field(data, second, secondlength);
+
+	mac = g_compute_hmac_for_data(G_CHECKSUM_SHA256, (guchar const *)buffer_get_buffer(symmetrickey), buffer_get_pos(symmetrickey), (guchar const *)buffer_get_buffer(data), buffer_get_pos(data));
+
+	buffer_delete(data);
+
+	return mac;
+}
+
+/**
+ * Append a value to the data to be MACed, preceded by its length as four
+ * bytes in network byte order.
+ *
+ * @param data The buffer to append to.
+ * @param field The value to append.
+ * @param length The length of the value.
+ */
+static void resumption_mac_field(Buffer * data, char const * field, size_t length) {
+	unsigned char prefix[4];
+
+	prefix[0] = (unsigned char)((length >> 24) & 0xff);
+	prefix[1] = (unsigned char)((length >> 16) & 0xff);
+	prefix[2] = (unsigned char)((length >> 8) & 0xff);
+	prefix[3] = (unsigned char)(length & 0xff);
+
+	buffer_append(data, (char const *)prefix, sizeof(prefix));
+	buffer_append(data, field, length);
+}
+
+/**
+ * Compare two strings in time that depends only on their length, so that
+ * the comparison doesn't leak how much of a MAC was correct.
+ *
+ * @param first The first string to compare.
+ * @param second The second string to compare.
+ * @return true if the strings are equal, false o/w.
+ */
+static bool resumption_equal(char const * first, char const * second) {
+	size_t length;
+	size_t pos;
+	unsigned char difference;
+
+	length = strlen(first);
+	difference = (length == strlen(second)) ? 0 : 1;
+	if (difference == 0) {
+		for (pos = 0; pos < length; pos++) {
+			difference |= (unsigned char)(first[pos] ^ second[pos]);
+		}
+	}
+
+	return (difference == 0);
+}
+
+/** @} addtogroup Service */
+
@@ -0,0 +1,129 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Abbreviated re-authentication for continuous sessions
+ * @section DESCRIPTION
+ *
+ * When the link to a continuously authenticated Pico drops for a moment, the
+ * continuous session would normally end and the user's screen be locked,
+ * requiring a full authentication to get back in. Resumption allows the Pico
+ * to pick the session back up within a short grace window, using a single
+ * round trip rather than a new handshake.
+ *
+ * To resume, the Pico sends a message of the following form.
+ *
+ * {"resume":"<nonce>","mac":"<HMAC-SHA256>"}
+ *
+ * The nonce is a fresh random string chosen by the Pico. The MAC is taken
+ * using the symmetric key shared with the service, over the string "resume",
+ * the service nonce from the session's original handshake, and the Pico's
+ * nonce, in that order. Each of the three is preceded by its length as four
+ * bytes in network byte order. Binding in the handshake nonce stops a
+ * resumption from one session being replayed in another; remembering the
+ * nonces already used stops replay within the same session. Resumption is
+ * refused if the handshake nonce isn't known, and once a session has used
+ * up its allowance of nonces.
+ *
+ * If the proof is valid, the service replies as follows, with the MAC taken
+ * in the same way over the string "resumed", the Pico's nonce and the
+ * service nonce. This proves to the Pico that it resumed with the right
+ * service.
+ *
+ * {"resumed":"<HMAC-SHA256>"}
+ *
+ * The Pico then continues sending continuous authentication messages as
+ * before.
+ *
+ * The service can also challenge a Pico that's still connected to check
+ * it's present, by sending the following.
+ *
+ * {"challenge":"<nonce>"}
+ *
+ * The Pico answers with a resumption request using the challenge as its
+ * nonce, and the service replies as above. The challenge is an extension
+ * to the Pico protocol, so only Pico apps that support it will answer.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#ifndef __RESUMPTION_H
+#define __RESUMPTION_H (1)
+
+#include <stdbool.h>
+#include "pico/buffer.h"
+
+// Defines
+
+// Structure definitions
+
+/**
+ * @brief The result of checking a message received during the grace window
+ *
+ *  - RESUMPTIONRESULT_ACCEPTED: a valid resumption; the reply should be
+ *    sent and the session continued.
+ *  - RESUMPTIONRESULT_ANSWERED: a valid answer to the outstanding
+ *    challenge; the reply should be sent and the session continued.
+ *  - RESUMPTIONRESULT_REJECTED: a resumption that failed verification or
+ *    was a replay; the session should end.
+ *  - RESUMPTIONRESULT_OTHER: not a resumption message, so should be passed
+ *    on to the state machine as usual.
+ *
+ */
+typedef enum _RESUMPTIONRESULT {
+	RESUMPTIONRESULT_INVALID = -1,
+
+	RESUMPTIONRESULT_ACCEPTED,
+	RESUMPTIONRESULT_ANSWERED,
+	RESUMPTIONRESULT_REJECTED,
+	RESUMPTIONRESULT_OTHER,
+
+	RESUMPTIONRESULT_NUM
+} RESUMPTIONRESULT;
+
+/**
+ * The internal structure can be found in resumption.c
+ */
+typedef struct _Resumption Resumption;
+
+// Function prototypes
+
+Resumption * resumption_new();
+void resumption_delete(Resumption * resumption);
+void resumption_set_keys(Resumption * resumption, Buffer const * symmetrickey, Buffer const * sessionnonce);
+void resumption_challenge(Resumption * resumption, Buffer * message);
+RESUMPTIONRESULT resumption_read(Resumption * resumption, char const * data, size_t length, Buffer * reply);
+void resumption_prove(Buffer const * symmetrickey, Buffer const * sessionnonce, char const * picononce, Buffer * message);
+bool resumption_check_reply(Buffer const * symmetrickey, Buffer const * sessionnonce, char const * picononce, char const * data, size_t length);
+
+// Function definitions
+
+#endif
+
+/** @} addtogroup Service */
+
@@ -0,0 +1,311 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Tracks the health of Rendezvous Point endpoints
+ * @section DESCRIPTION
+ *
+ * Keeps per-endpoint round trip times and error rates, and uses them to
+ * choose the Rendezvous Point for each new session. See rvpendpoints.h for
+ * an overview.
+ *
+ * Round trip times and error rates are smoothed using an exponentially
+ * weighted moving average, in the same way TCP smooths its round trip time
+ * estimate, so that a single slow request doesn't cause a switch, but a
+ * sustained change does.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include "pico/debug.h"
+#include "pico/buffer.h"
+
+#include "log.h"
+#include "timesource.h"
+#include "rvpendpoints.h"
+
+// Defines
+
+/**
+ * @brief The characters that can separate the endpoints in a list
+ */
+#define RVPENDPOINTS_SEPARATORS ", \t\n"
+
+/**
+ * @brief The weight given to each new sample when smoothing
+ *
+ * Each new sample contributes 1/RVPENDPOINTS_SMOOTHING of the smoothed
+ * value.
+ */
+#define RVPENDPOINTS_SMOOTHING (8)
+
+/**
+ * @brief How heavily errors count against an endpoint
+ *
+ * An endpoint's score is its round trip time scaled up by this multiple of
+ * its error rate, so an endpoint that fails half its requests scores as
+ * though it were three times slower.
+ */
+#define RVPENDPOINTS_ERROR_WEIGHT (4.0)
+
+// Structure definitions
+
+/**
+ * @brief Opaque structure used for tracking the endpoints
+ *
+ * The endpoints table maps URL prefixes to RvpEndpointStats structures.
+ * Endpoints are added the first time a request to them is reported.
+ *
+ * The lifecycle of this data is managed by pico-continuous.
+ *
+ */
+struct _RvpEndpoints {
+	GHashTable * endpoints;
+};
+
+// Function prototypes
+
+static double rvpendpoints_score(RvpEndpointStats const * endpoint);
+
+// Function definitions
+
+/**
+ * Create a new instance of the class.
+ *
+ * @return The newly created object.
+ */
+RvpEndpoints * rvpendpoints_new() {
+	RvpEndpoints * rvpendpoints;
+
+	rvpendpoints = CALLOC(sizeof(RvpEndpoints), 1);
+
+	rvpendpoints->endpoints = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	return rvpendpoints;
+}
+
+/**
+ * Delete an instance of the class, freeing up the memory allocated to it.
+ *
+ * @param rvpendpoints The object to free.
+ */
+void rvpendpoints_delete(RvpEndpoints * rvpendpoints) {
+	if (rvpendpoints) {
+		g_hash_table_destroy(rvpendpoints->endpoints);
+		rvpendpoints->endpoints = NULL;
+
+		FREE(rvpendpoints);
+	}
+}
+
+/**
+ * Choose the Rendezvous Point to use for a new session from a list of URL
+ * prefixes separated by commas or whitespace.
+ *
+ * Endpoints that are backing off after a failure are skipped, and the
+ * endpoint with the lowest score from those that remain is chosen. Where
+ * scores are equal, the endpoint earlier in the list wins. If every endpoint
+ * is backing off, the one whose backoff ends soonest is chosen.
+ *
+ * If rvpendpoints is NULL, the first endpoint in the list is chosen.
+ *
+ * @param rvpendpoints The object to use, or NULL.
+ * @param list The URL prefixes to choose from.
+ * @param urlprefix A buffer to store the chosen URL prefix in. This is left
+ *        unchanged if the list is empty.
+ */
+void rvpendpoints_choose(RvpEndpoints * rvpendpoints, char const * list, Buffer * urlprefix) {
+	gchar ** entries;
+	int count;
+	RvpEndpointStats const * endpoint;
+	char const * best;
+	double bestscore;
+	double score;
+	char const * soonest;
+	gint64 soonestbackoff;
+	gint64 now;
+
+	entries = g_strsplit_set(list, RVPENDPOINTS_SEPARATORS, -1);
+	now = timesource_get_monotonic_time();
+	best = NULL;
+	bestscore = 0.0;
+	soonest = NULL;
+	soonestbackoff = 0;
+
+	for (count = 0; entries[count] != NULL; count++) {
+		if (entries[count][0] != 0) {
+			endpoint = NULL;
+			if (rvpendpoints != NULL) {
+				endpoint = g_hash_table_lookup(rvpendpoints->endpoints, entries[count]);
+			}
+
+			if ((endpoint != NULL) && (endpoint->backoff > now)) {
+				if ((soonest == NULL) || (endpoint->backoff < soonestbackoff)) {
+					soonest = entries[count];
+					soonestbackoff = endpoint->backoff;
+				}
+			}
+			else {
+				score = rvpendpoints_score(endpoint);
+				if ((best == NULL) || (score < bestscore)) {
+					best = entries[count];
+					bestscore = score;
+				}
+			}
+
+			if ((rvpendpoints == NULL) && (best != NULL)) {
+				// Without any statistics, stick with the first endpoint
+				break;
+			}
+		}
+	}
+
+	if (best == NULL) {
+		best = soonest;
+	}
+
+	if (best != NULL) {
+		buffer_clear(urlprefix);
+		buffer_append_string(urlprefix, best);
+		LOG(LOG_INFO, "Chose Rendezvous Point %s", best);
+	}
+
+	g_strfreev(entries);
+}
+
+/**
+ * Report the outcome of a request to a Rendezvous Point endpoint.
+ *
+ * A failure puts the endpoint into backoff, so that it's skipped by
+ * rvpendpoints_choose() until the backoff period ends. The period starts at
+ * RVPENDPOINTS_BACKOFF_MIN and doubles with each consecutive failure, up to
+ * RVPENDPOINTS_BACKOFF_MAX. A success ends any backoff.
+ *
+ * Requests that are held open by the Rendezvous Point until the Pico sends
+ * something don't give a meaningful round trip time, in which case a
+ * negative rtt should be provided so that only the outcome is recorded.
+ *
+ * @param rvpendpoints The object to use.
+ * @param urlprefix The URL prefix of the endpoint the request was made to.
+ * @param rtt The round trip time of the request in microseconds, or a
+ *        negative value if it isn't known.
+ * @param success true if the request succeeded, false o/w.
+ */
+void rvpendpoints_report(RvpEndpoints * rvpendpoints, char const * urlprefix, gint64 rtt, bool success) {
+	RvpEndpointStats * endpoint;
+	gint64 backoff;
+	unsigned int doublings;
+
+	endpoint = g_hash_table_lookup(rvpendpoints->endpoints, urlprefix);
+	if (endpoint == NULL) {
+		endpoint = CALLOC(sizeof(RvpEndpointStats), 1);
+		g_hash_table_insert(rvpendpoints->endpoints, g_strdup(urlprefix), endpoint);
+	}
+
+	endpoint->requests++;
+	endpoint->errorrate += ((success ? 0.0 : 1.0) - endpoint->errorrate) / RVPENDPOINTS_SMOOTHING;
+
+	if (success) {
+		endpoint->consecutive = 0;
+		endpoint->backoff = 0;
+
+		if (rtt >= 0) {
+			if (endpoint->rtt == 0) {
+				endpoint->rtt = rtt;
+			}
+			else {
+				endpoint->rtt += (rtt - endpoint->rtt) / RVPENDPOINTS_SMOOTHING;
+			}
+		}
+	}
+	else {
+		endpoint->failures++;
+		endpoint->consecutive++;
+
+		backoff = RVPENDPOINTS_BACKOFF_MIN;
+		for (doublings = 1; (doublings < endpoint->consecutive) && (backoff < RVPENDPOINTS_BACKOFF_MAX); doublings++) {
+			backoff *= 2;
+		}
+		if (backoff > RVPENDPOINTS_BACKOFF_MAX) {
+			backoff = RVPENDPOINTS_BACKOFF_MAX;
+		}
+		endpoint->backoff = timesource_get_monotonic_time() + backoff;
+
+		LOG(LOG_INFO, "Rendezvous Point %s failed; skipping for %" G_GINT64_FORMAT " seconds", urlprefix, backoff / 1000000);
+	}
+}
+
+/**
+ * Get what's known about a Rendezvous Point endpoint.
+ *
+ * @param rvpendpoints The object to use.
+ * @param urlprefix The URL prefix of the endpoint.
+ * @param stats A structure to store the details in.
+ * @return true if any requests to the endpoint have been reported, false
+ *         o/w, in which case stats is left unchanged.
+ */
+bool rvpendpoints_get_stats(RvpEndpoints const * rvpendpoints, char const * urlprefix, RvpEndpointStats * stats) {
+	RvpEndpointStats const * endpoint;
+
+	endpoint = g_hash_table_lookup(rvpendpoints->endpoints, urlprefix);
+	if (endpoint != NULL) {
+		*stats = *endpoint;
+	}
+
+	return (endpoint != NULL);
+}
+
+/**
+ * Calculate the score for an endpoint, where lower is better. This is the
+ * smoothed round trip time scaled up according to the error rate.
+ *
+ * @param endpoint The endpoint to score, or NULL if nothing is known about
+ *        it.
+ * @return The endpoint's score.
+ */
+static double rvpendpoints_score(RvpEndpointStats const * endpoint) {
+	double score;
+
+	score = RVPENDPOINTS_DEFAULT_RTT;
+	if (endpoint != NULL) {
+		if (endpoint->rtt > 0) {
+			score = endpoint->rtt;
+		}
+		score *= 1.0 + (RVPENDPOINTS_ERROR_WEIGHT * endpoint->errorrate);
+	}
+
+	return score;
+}
+
+/** @} addtogroup Service */
+
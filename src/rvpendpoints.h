@@ -0,0 +1,120 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Tracks the health of Rendezvous Point endpoints
+ * @section DESCRIPTION
+ *
+ * The rvpurl configuration option can list several Rendezvous Point URL
+ * prefixes. Every message exchanged with the Pico passes through the
+ * Rendezvous Point, so a slow or distant endpoint adds its round trip time
+ * to every step of the protocol.
+ *
+ * RvpEndpoints keeps a smoothed round trip time and error rate for each
+ * endpoint, fed by ServiceRvp as its requests complete. When a session
+ * starts, the endpoint with the best score from the session's list is
+ * chosen. An endpoint that fails is skipped for a backoff period, which
+ * doubles with each consecutive failure, so that sessions fail over to the
+ * other endpoints quickly and return once it's recovered.
+ *
+ * The statistics are shared by all sessions, and the lifecycle of the
+ * object is managed by pico-continuous.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#ifndef __RVPENDPOINTS_H
+#define __RVPENDPOINTS_H (1)
+
+#include <stdbool.h>
+#include <glib.h>
+#include "pico/buffer.h"
+
+// Defines
+
+/**
+ * @brief The round trip time assumed for an endpoint that has no samples
+ *
+ * In microseconds. An endpoint known to be faster than this is preferred
+ * over one that hasn't been tried yet, while one known to be slower loses
+ * out to it.
+ */
+#define RVPENDPOINTS_DEFAULT_RTT (250 * 1000)
+
+/**
+ * @brief The first backoff period after an endpoint fails, in microseconds
+ */
+#define RVPENDPOINTS_BACKOFF_MIN (10 * 1000000)
+
+/**
+ * @brief The longest backoff period for a failing endpoint, in microseconds
+ */
+#define RVPENDPOINTS_BACKOFF_MAX (300 * 1000000)
+
+// Structure definitions
+
+/**
+ * The internal structure can be found in rvpendpoints.c
+ */
+typedef struct _RvpEndpoints RvpEndpoints;
+
+/**
+ * @brief What's known about a single endpoint
+ *
+ *  - requests: completed requests reported for the endpoint.
+ *  - failures: requests that failed.
+ *  - consecutive: failures since the last successful request.
+ *  - rtt: the smoothed round trip time, in microseconds, or zero if there
+ *    are no samples yet.
+ *  - errorrate: the smoothed proportion of requests that fail.
+ *  - backoff: the time the endpoint is skipped until, in microseconds on
+ *    the monotonic clock, or zero if it isn't being skipped.
+ */
+typedef struct _RvpEndpointStats {
+	unsigned long requests;
+	unsigned long failures;
+	unsigned int consecutive;
+	gint64 rtt;
+	double errorrate;
+	gint64 backoff;
+} RvpEndpointStats;
+
+// Function prototypes
+
+RvpEndpoints * rvpendpoints_new();
+void rvpendpoints_delete(RvpEndpoints * rvpendpoints);
+void rvpendpoints_choose(RvpEndpoints * rvpendpoints, char const * list, Buffer * urlprefix);
+void rvpendpoints_report(RvpEndpoints * rvpendpoints, char const * urlprefix, gint64 rtt, bool success);
+bool rvpendpoints_get_stats(RvpEndpoints const * rvpendpoints, char const * urlprefix, RvpEndpointStats * stats);
+
+// Function definitions
+
+#endif
+
+/** @} addtogroup Service */
+
@@ -0,0 +1,405 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Keeps connections to the Rendezvous Points warm
+ * @section DESCRIPTION
+ *
+ * Warms up connections to the Rendezvous Points ahead of the sessions that
+ * need them, so that DNS resolution, the TCP connection and the TLS
+ * handshake are no longer paid for while the user waits to log in.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+#include "pico/debug.h"
+#include "pico/buffer.h"
+
+#include "log.h"
+#include "timesource.h"
+#include "processstore.h"
+#include "rvpwarmer.h"
+
+// Defines
+
+/**
+ * @brief The characters that can separate the URLs in a list
+ */
+#define RVPWARMER_SEPARATORS ", \t\n"
+
+/**
+ * @brief The most connections the shared session may open to one host
+ *
+ * Every session may be using the same Rendezvous Point, and each holds a
+ * long-polling GET open while it sends with a POST, so needs two
+ * connections at once. The rest leaves room for the warming requests.
+ * libsoup's default of two would leave all but one session queued behind
+ * the others' long polls.
+ */
+#define RVPWARMER_MAX_CONNS_PER_HOST ((2 * MAX_SIMULTANEOUS_AUTHS) + 4)
+
+/**
+ * @brief The most connections the shared session may open in total
+ *
+ * This allows for sessions spread over several Rendezvous Points, each with
+ * its own warming requests.
+ */
+#define RVPWARMER_MAX_CONNS (RVPWARMER_MAX_CONNS_PER_HOST + 8)
+
+// Structure definitions
+
+/**
+ * @brief Opaque structure used for warming connections
+ *
+ * The urls table is the set of URL prefixes to keep warm, and the pending
+ * table maps those with a warming request in progress to the WarmRequest,
+ * so that a second request isn't made before the first has completed.
+ *
+ * The lifecycle of this data is managed by pico-continuous.
+ *
+ */
+struct _RvpWarmer {
+	SoupSession * session;
+	GHashTable * urls;
+	GHashTable * pending;
+	GDBusConnection * connection;
+	guint subscriptionid;
+	guint timerid;
+	RvpEndpoints * endpoints;
+	RvpWarmerStats stats;
+};
+
+/**
+ * @brief A single warming request in progress
+ *
+ * The request outlives the RvpWarmer if the RvpWarmer is deleted while the
+ * request is still in progress, in which case rvpwarmer is set to NULL and
+ * the request is simply freed once it completes.
+ *
+ */
+typedef struct _WarmRequest {
+	RvpWarmer * rvpwarmer;
+	char * url;
+} WarmRequest;
+
+// Function prototypes
+
+static void rvpwarmer_warm_url(RvpWarmer * rvpwarmer, char const * url);
+static void rvpwarmer_warmed(SoupSession * session, SoupMessage * msg, gpointer user_data);
+static gboolean rvpwarmer_timeout(gpointer user_data);
+static void rvpwarmer_prepare_for_sleep(GDBusConnection * connection, gchar const * sender_name, gchar const * object_path, gchar const * interface_name, gchar const * signal_name, GVariant * parameters, gpointer user_data);
+static void rvpwarmer_orphan(gpointer key, gpointer value, gpointer user_data);
+
+// Function definitions
+
+/**
+ * Create a new instance of the class. The warming timer is started and
+ * logind is subscribed to straight away, but nothing is warmed until URLs
+ * are added using rvpwarmer_add().
+ *
+ * @return The newly created object.
+ */
+RvpWarmer * rvpwarmer_new() {
+	RvpWarmer * rvpwarmer;
+	GError * error;
+
+	rvpwarmer = CALLOC(sizeof(RvpWarmer), 1);
+
+	rvpwarmer->session = soup_session_new_with_options(SOUP_SESSION_SSL_STRICT, TRUE, SOUP_SESSION_USER_AGENT, "Pico ", SOUP_SESSION_TIMEOUT, 60, SOUP_SESSION_IDLE_TIMEOUT, RVPWARMER_IDLE_TIMEOUT, SOUP_SESSION_MAX_CONNS_PER_HOST, RVPWARMER_MAX_CONNS_PER_HOST, SOUP_SESSION_MAX_CONNS, RVPWARMER_MAX_CONNS, NULL);
+	rvpwarmer->urls = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	rvpwarmer->pending = g_hash_table_new(g_str_hash, g_str_equal);
+	rvpwarmer->endpoints = NULL;
+	memset(& rvpwarmer->stats, 0, sizeof(RvpWarmerStats));
+
+	// Connections held open while suspended won't survive, so warm them up
+	// again on resume
+	rvpwarmer->subscriptionid = 0;
+	error = NULL;
+	rvpwarmer->connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, & error);
+	if (rvpwarmer->connection != NULL) {
+		rvpwarmer->subscriptionid = g_dbus_connection_signal_subscribe(rvpwarmer->connection, "org.freedesktop.login1", "org.freedesktop.login1.Manager", "PrepareForSleep", "/org/freedesktop/login1", NULL, G_DBUS_SIGNAL_FLAGS_NONE, rvpwarmer_prepare_for_sleep, rvpwarmer, NULL);
+	}
+	else {
+		LOG(LOG_ERR, "Failed to connect to system bus to watch for resume: %s", error->message);
+		g_error_free(error);
+	}
+
+	rvpwarmer->timerid = timesource_timeout_add(RVPWARMER_INTERVAL * 1000, rvpwarmer_timeout, rvpwarmer);
+
+	return rvpwarmer;
+}
+
+/**
+ * Delete an instance of the class, freeing up the memory allocated to it.
+ * Any warming requests still in progress are cancelled.
+ *
+ * The ServiceRvp objects using the session should be deleted first.
+ *
+ * @param rvpwarmer The object to free.
+ */
+void rvpwarmer_delete(RvpWarmer * rvpwarmer) {
+	if (rvpwarmer) {
+		if (rvpwarmer->timerid != 0) {
+			g_source_remove(rvpwarmer->timerid);
+			rvpwarmer->timerid = 0;
+		}
+
+		if (rvpwarmer->connection != NULL) {
+			if (rvpwarmer->subscriptionid != 0) {
+				g_dbus_connection_signal_unsubscribe(rvpwarmer->connection, rvpwarmer->subscriptionid);
+				rvpwarmer->subscriptionid = 0;
+			}
+			g_object_unref(rvpwarmer->connection);
+			rvpwarmer->connection = NULL;
+		}
+
+		// The requests will be freed as they're cancelled
+		g_hash_table_foreach(rvpwarmer->pending, rvpwarmer_orphan, NULL);
+		g_hash_table_destroy(rvpwarmer->pending);
+		rvpwarmer->pending = NULL;
+
+		soup_session_abort(rvpwarmer->session);
+		g_object_unref(rvpwarmer->session);
+		rvpwarmer->session = NULL;
+
+		g_hash_table_destroy(rvpwarmer->urls);
+		rvpwarmer->urls = NULL;
+
+		FREE(rvpwarmer);
+	}
+}
+
+/**
+ * Get the SoupSession holding the warm connections. A ServiceRvp using this
+ * session will pick up the connections warmed for it.
+ *
+ * @param rvpwarmer The object to get the session from.
+ * @return The session, which remains owned by the RvpWarmer.
+ */
+SoupSession * rvpwarmer_get_session(RvpWarmer * rvpwarmer) {
+	return rvpwarmer->session;
+}
+
+/**
+ * Set the RvpEndpoints object to report failed warming requests to. This
+ * allows a Rendezvous Point that can't be reached to be skipped before any
+ * session has tried to use it.
+ *
+ * @param rvpwarmer The object to set the value for.
+ * @param endpoints The object to report to, which remains owned by the
+ *        caller, or NULL to not report.
+ */
+void rvpwarmer_set_endpoints(RvpWarmer * rvpwarmer, RvpEndpoints * endpoints) {
+	rvpwarmer->endpoints = endpoints;
+}
+
+/**
+ * Add Rendezvous Point URL prefixes to keep warm, from a list separated by
+ * commas or whitespace, in the same format as the rvpurl configuration
+ * option. Any URLs not already being kept warm are warmed straight away.
+ *
+ * @param rvpwarmer The object to add the URLs to.
+ * @param list The list of URL prefixes.
+ */
+void rvpwarmer_add(RvpWarmer * rvpwarmer, char const * list) {
+	gchar ** urls;
+	int pos;
+
+	urls = g_strsplit_set(list, RVPWARMER_SEPARATORS, -1);
+	for (pos = 0; urls[pos] != NULL; pos++) {
+		if ((urls[pos][0] != 0) && (g_hash_table_contains(rvpwarmer->urls, urls[pos]) == FALSE)) {
+			LOG(LOG_INFO, "Keeping Rendezvous Point warm: %s", urls[pos]);
+			g_hash_table_add(rvpwarmer->urls, g_strdup(urls[pos]));
+			rvpwarmer_warm_url(rvpwarmer, urls[pos]);
+		}
+	}
+	g_strfreev(urls);
+}
+
+/**
+ * Warm up the connections to all of the Rendezvous Points that have been
+ * added. This happens periodically and on resume anyway, so there's
+ * usually no need to call it.
+ *
+ * @param rvpwarmer The object to warm the connections for.
+ */
+void rvpwarmer_warm(RvpWarmer * rvpwarmer) {
+	GHashTableIter iter;
+	gpointer key;
+
+	g_hash_table_iter_init(& iter, rvpwarmer->urls);
+	while (g_hash_table_iter_next(& iter, & key, NULL)) {
+		rvpwarmer_warm_url(rvpwarmer, (char const *)key);
+	}
+}
+
+/**
+ * Get the counts of warming requests made so far.
+ *
+ * @param rvpwarmer The object to get the counts from.
+ * @param stats A structure to copy the counts into.
+ */
+void rvpwarmer_get_stats(RvpWarmer const * rvpwarmer, RvpWarmerStats * stats) {
+	memcpy(stats, & rvpwarmer->stats, sizeof(RvpWarmerStats));
+}
+
+/**
+ * Make a HEAD request to a Rendezvous Point, unless there's one already in
+ * progress. The reply isn't important: it's the connection left behind in
+ * the pool that's wanted. Any response at all from the server shows that
+ * the host name resolved and the connection was made.
+ *
+ * @param rvpwarmer The object to make the request for.
+ * @param url The URL prefix of the Rendezvous Point.
+ */
+static void rvpwarmer_warm_url(RvpWarmer * rvpwarmer, char const * url) {
+	WarmRequest * request;
+	SoupMessage * msg;
+
+	if (g_hash_table_contains(rvpwarmer->pending, url) == FALSE) {
+		msg = soup_message_new("HEAD", url);
+		if (msg != NULL) {
+			request = CALLOC(sizeof(WarmRequest), 1);
+			request->rvpwarmer = rvpwarmer;
+			request->url = g_strdup(url);
+			g_hash_table_insert(rvpwarmer->pending, request->url, request);
+
+			// The session takes ownership of the message
+			soup_session_queue_message(rvpwarmer->session, msg, rvpwarmer_warmed, request);
+		}
+		else {
+			LOG(LOG_ERR, "Can't warm malformed Rendezvous Point URL: %s", url);
+		}
+	}
+}
+
+/**
+ * Internal callback triggered when a warming request has completed or been
+ * cancelled.
+ *
+ * @param session The Soup session object used to field the request.
+ * @param msg The completed request.
+ * @param user_data The WarmRequest the request was made for.
+ */
+static void rvpwarmer_warmed(SoupSession * session, SoupMessage * msg, gpointer user_data) {
+	WarmRequest * request = (WarmRequest *)user_data;
+	RvpWarmer * rvpwarmer;
+	bool success;
+
+	rvpwarmer = request->rvpwarmer;
+	if (rvpwarmer != NULL) {
+		g_hash_table_remove(rvpwarmer->pending, request->url);
+
+		if (msg->status_code != SOUP_STATUS_CANCELLED) {
+			success = (SOUP_STATUS_IS_TRANSPORT_ERROR(msg->status_code) == FALSE);
+			if (success) {
+				rvpwarmer->stats.warmed++;
+			}
+			else {
+				LOG(LOG_ERR, "Failed to warm Rendezvous Point %s: %s", request->url, msg->reason_phrase);
+				rvpwarmer->stats.failed++;
+			}
+
+			if (rvpwarmer->endpoints != NULL) {
+				rvpendpoints_report(rvpwarmer->endpoints, request->url, -1, success);
+			}
+		}
+	}
+
+	g_free(request->url);
+	FREE(request);
+}
+
+/**
+ * Internal callback triggered periodically to stop the warm connections
+ * being closed for being idle.
+ *
+ * @param user_data The RvpWarmer object.
+ * @return TRUE to continue the timer.
+ */
+static gboolean rvpwarmer_timeout(gpointer user_data) {
+	RvpWarmer * rvpwarmer = (RvpWarmer *)user_data;
+
+	rvpwarmer_warm(rvpwarmer);
+
+	return TRUE;
+}
+
+/**
+ * Internal callback triggered when logind signals that the computer is
+ * about to suspend or has just resumed. The connections are warmed up again
+ * on resume.
+ *
+ * @param connection The system bus connection.
+ * @param sender_name The unique bus name of the sender.
+ * @param object_path The object path the signal was emitted on.
+ * @param interface_name The interface of the signal.
+ * @param signal_name The name of the signal.
+ * @param parameters A tuple containing true if suspending, false if
+ *        resuming.
+ * @param user_data The RvpWarmer object.
+ */
+static void rvpwarmer_prepare_for_sleep(GDBusConnection * connection, gchar const * sender_name, gchar const * object_path, gchar const * interface_name, gchar const * signal_name, GVariant * parameters, gpointer user_data) {
+	RvpWarmer * rvpwarmer = (RvpWarmer *)user_data;
+	gboolean sleeping;
+
+	sleeping = TRUE;
+	if (g_variant_is_of_type(parameters, G_VARIANT_TYPE("(b)"))) {
+		g_variant_get(parameters, "(b)", & sleeping);
+	}
+
+	if (sleeping == FALSE) {
+		LOG(LOG_INFO, "Resumed, warming Rendezvous Point connections");
+		rvpwarmer->stats.resumes++;
+		rvpwarmer_warm(rvpwarmer);
+	}
+}
+
+/**
+ * Detach a pending request from the RvpWarmer, so that it can complete
+ * after the RvpWarmer has been deleted. Used with g_hash_table_foreach().
+ *
+ * @param key The URL prefix the request was made for.
+ * @param value The WarmRequest.
+ * @param user_data Unused.
+ */
+static void rvpwarmer_orphan(gpointer key, gpointer value, gpointer user_data) {
+	WarmRequest * request = (WarmRequest *)value;
+
+	request->rvpwarmer = NULL;
+}
+
+/** @} addtogroup Service */
+
@@ -0,0 +1,110 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Keeps connections to the Rendezvous Points warm
+ * @section DESCRIPTION
+ *
+ * The first request a session makes to a Rendezvous Point has to resolve
+ * its host name, open a TCP connection and, for https URLs, perform a TLS
+ * handshake. Left until the user is waiting to log in, these add several
+ * round trips to the login time.
+ *
+ * RvpWarmer owns a SoupSession that's shared by the ServiceRvp objects of
+ * all sessions. Each Rendezvous Point added to it is contacted straight
+ * away with a lightweight HEAD request, leaving an idle keep-alive
+ * connection in the session's pool for the next ServiceRvp to pick up.
+ * The request is repeated periodically so that the connection isn't
+ * dropped for being idle, and again when the computer resumes from
+ * suspend, since connections held open across a suspend are unlikely to
+ * have survived it.
+ *
+ * The lifecycle of the object is managed by pico-continuous.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#ifndef __RVPWARMER_H
+#define __RVPWARMER_H (1)
+
+#include <stdbool.h>
+#include <glib.h>
+#include <libsoup/soup.h>
+#include "rvpendpoints.h"
+
+// Defines
+
+/**
+ * @brief The time in seconds between requests to keep a connection warm
+ *
+ * This should be shorter than the time the Rendezvous Point's web server
+ * keeps idle connections open for, which is commonly a minute.
+ */
+#define RVPWARMER_INTERVAL (45)
+
+/**
+ * @brief The time in seconds an idle connection is kept in the pool
+ */
+#define RVPWARMER_IDLE_TIMEOUT (120)
+
+// Structure definitions
+
+/**
+ * The internal structure can be found in rvpwarmer.c
+ */
+typedef struct _RvpWarmer RvpWarmer;
+
+/**
+ * @brief Counts of the warming requests made
+ *
+ *  - warmed: requests that reached the Rendezvous Point.
+ *  - failed: requests that failed to connect.
+ *  - resumes: times the computer was seen resuming from suspend.
+ */
+typedef struct _RvpWarmerStats {
+	unsigned long warmed;
+	unsigned long failed;
+	unsigned long resumes;
+} RvpWarmerStats;
+
+// Function prototypes
+
+RvpWarmer * rvpwarmer_new();
+void rvpwarmer_delete(RvpWarmer * rvpwarmer);
+SoupSession * rvpwarmer_get_session(RvpWarmer * rvpwarmer);
+void rvpwarmer_set_endpoints(RvpWarmer * rvpwarmer, RvpEndpoints * endpoints);
+void rvpwarmer_add(RvpWarmer * rvpwarmer, char const * list);
+void rvpwarmer_warm(RvpWarmer * rvpwarmer);
+void rvpwarmer_get_stats(RvpWarmer const * rvpwarmer, RvpWarmerStats * stats);
+
+// Function definitions
+
+#endif
+
+/** @} addtogroup Service */
+
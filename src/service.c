@@ -40,6 +40,47 @@
  * BeaconThread to manage the sending of beacons and FsmService from libpico
  * to manage the authentication control flow.
  *
+ * Processing a message from the Pico involves elliptic curve and symmetric
+ * cryptography. If a CryptoPool is set, messages are passed to the state
+ * machine on a worker thread rather than the main loop. While this happens
+ * the state machine belongs to the worker: any further input for it is
+ * queued, and any callbacks it makes are recorded. Once the message has been
+ * processed, the callbacks are replayed on the main loop in the order they
+ * were made, followed by the queued input. The subclasses therefore see
+ * exactly the same sequence of calls as when the state machine runs inline.
+ * The main loop never waits for a worker: the state reported while one is
+ * busy is the state the message was handed over in, and a subclass that's
+ * stopping holds back its stop callback until the worker has finished, so
+ * that the state machine is never deleted from under it.
+ *
+ * If a resumption grace period is set, a continuous session isn't ended
+ * straight away when the Pico goes quiet or the link drops. Instead the
+ * state machine is held where it is for the grace period, giving the Pico
+ * the chance to reconnect and prove it still holds the session's key using
+ * a single round trip (see resumption.h). If it does, the session carries on
+ * as if nothing happened; if not, the state machine is told about the
+ * timeout or disconnection as usual and the session ends. Resumption needs
+ * the Pico app to support it too: an app that doesn't will never reconnect,
+ * so the session ends once the grace period expires. The proof is bound to
+ * the service nonce from the session's handshake, so resumption is only
+ * offered where libpico provides shared_get_service_nonce().
+ *
+ * The same proof can be requested at any time during a continuous session,
+ * using service_request_presence(). This allows a new authentication for
+ * the same user to be satisfied by the Pico that's already connected, rather
+ * than waiting for it to scan a new QR code.
+ *
+ * If heartbeat bounds are set, the interval the Pico is asked to wait
+ * between continuous authentication messages adapts to how reliably they
+ * arrive and whether the user is at their desk (see heartbeat.h), rather
+ * than being fixed by the state machine. This relies on libpico providing
+ * fsmservice_set_custom_timeout(); if it doesn't, the bounds are ignored,
+ * nothing is tracked and the state machine's own timing is used.
+ *
+ * A composite Service, such as ServiceRace, hands its session to one of the
+ * Services it contains. Queries about the session are then passed on to
+ * that Service, its delegate.
+ *
  */
 
 /** \addtogroup Service
@@ -50,6 +91,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
 #include <stdbool.h>
 #include <glib.h>
@@ -65,8 +107,11 @@
 #include "pico/fsmservice.h"
 #include "pico/keyauth.h"
 #include "pico/messagestatus.h"
+#include "pico/shared.h"
+#include "pico/nonce.h"
 
 #include "beaconthread.h"
+#include "timesource.h"
 #include "service.h"
 #include "service_private.h"
 
@@ -74,8 +119,94 @@
 
 // Structure definitions
 
+/**
+ * @brief The types of input to, and callbacks from, the state machine
+ *
+ * The first group are input passed to the state machine, which are queued
+ * while the state machine is busy on a worker thread. The second group are
+ * callbacks from the state machine, which are recorded while on a worker
+ * thread to be replayed on the main loop.
+ */
+typedef enum _SERVICEEVENT {
+	SERVICEEVENT_INVALID = -1,
+
+	SERVICEEVENT_READ,
+	SERVICEEVENT_CONNECTED,
+	SERVICEEVENT_DISCONNECTED,
+	SERVICEEVENT_TIMEOUT,
+	SERVICEEVENT_STOP,
+
+	SERVICEEVENT_WRITE,
+	SERVICEEVENT_SET_TIMEOUT,
+	SERVICEEVENT_ERROR,
+	SERVICEEVENT_LISTEN,
+	SERVICEEVENT_DISCONNECT,
+	SERVICEEVENT_AUTHENTICATED,
+	SERVICEEVENT_SESSION_ENDED,
+	SERVICEEVENT_STATUS_UPDATED,
+
+	SERVICEEVENT_NUM
+} SERVICEEVENT;
+
+/**
+ * @brief An input or callback that's been queued or recorded
+ */
+typedef struct _ServiceEvent {
+	SERVICEEVENT event;
+	int value;
+	char * data;
+	size_t length;
+} ServiceEvent;
+
+/**
+ * @brief A message being processed by the state machine on a worker thread
+ *
+ * The service is set to NULL if the service is deleted while the message is
+ * being processed, in which case the results are discarded on completion.
+ */
+struct _ServiceJob {
+	Service * service;
+	char * data;
+	size_t length;
+	GQueue * deferred;
+	GMutex mutex;
+	GCond cond;
+	bool done;
+};
+
 // Function prototypes
 
+static ServiceEvent * service_event_new(SERVICEEVENT event, int value, char const * data, size_t length);
+static void service_event_delete(gpointer data);
+static void service_fsm_input(Service * service, SERVICEEVENT event, char const * data, size_t length);
+static void service_fsm_apply(Service * service, SERVICEEVENT event, char const * data, size_t length);
+static void service_fsm_callback(Service * service, SERVICEEVENT event, int value, char const * data, size_t length);
+static void service_job_work(void * user_data);
+static void service_job_complete(void * user_data);
+static void service_job_delete(ServiceJob * job);
+static void service_job_wait(Service * service);
+static void service_write(Service * service, char const * data, size_t length);
+static void service_on_write(char const * data, size_t length, void * user_data);
+static void service_on_set_timeout(int timeout, void * user_data);
+static void service_on_error(void * user_data);
+static void service_on_listen(void * user_data);
+static void service_on_disconnect(void * user_data);
+static void service_on_authenticated(int status, void * user_data);
+static void service_on_session_ended(void * user_data);
+static void service_on_status_updated(int state, void * user_data);
+static void service_resume_prepare(Service * service);
+static void service_get_session_nonce(Service * service, Buffer * sessionnonce);
+static bool service_resume_begin(Service * service, bool timedout);
+static bool service_resume_input(Service * service, SERVICEEVENT event, char const * data, size_t length);
+static bool service_resume_read(Service * service, char const * data, size_t length);
+static void service_presence_end(Service * service, bool present);
+static gboolean service_presence_expired(gpointer user_data);
+static void service_resume_end(Service * service);
+static void service_resume_fail(Service * service);
+static gboolean service_resume_expired(gpointer user_data);
+static void service_heartbeat_beat(Service * service);
+static void service_heartbeat_apply(Service * service);
+
 // Function definitions
 
 /**
@@ -105,16 +236,49 @@ Service * service_new() {
 void service_init(Service * service) {
 	service->loop = NULL;
 	service->fsmservice = fsmservice_new();
-	service->beaconthread = beaconthread_new();
+	// The beacon thread is only created if beacons are actually sent
+	service->beaconthread = NULL;
 	service->stopping = FALSE;
 	service->beacon = NULL;
 	service->beacons = FALSE;
 	service->timeoutid = 0;
 	service->configdir = buffer_new(0);
+	// Only devices paired since the device file was last compacted are held
+	service->beacondevices = NULL;
+	service->trace = NULL;
+	memset(& service->functions, 0, sizeof(ServiceFsmFunctions));
+	// Messages are processed inline unless a pool is set
+	service->cryptopool = NULL;
+	service->job = NULL;
+	service->pending = g_queue_new();
+	service->fsmstate = FSMSERVICESTATE_INVALID;
+	service->shared = NULL;
+	// Sessions end as soon as the link is lost unless a grace period is set
+	service->resumegrace = 0;
+	service->resumption = NULL;
+	service->continuing = FALSE;
+	service->resuming = FALSE;
+	service->resumetimeout = FALSE;
+	service->resumeid = 0;
+	service->lasttimeout = 0;
+	service->presence_callback = NULL;
+	service->presence_user_data = NULL;
+	service->presenceid = 0;
+	// The state machine's own interval is used unless bounds are set
+	service->heartbeat = NULL;
+	service->lastheard = 0;
+	service->continuous = FALSE;
+	// Only a composite service hands its session to another service
+	service->delegate = NULL;
+	service->heldbeacons = FALSE;
 
 	service->service_delete = NULL;
 	service->service_start = NULL;
 	service->service_stop = NULL;
+	// Only needed by services that send beacons through another service
+	service->service_set_held_beacons = NULL;
+	// Only needed by services that process messages on a worker thread
+	service->service_stop_check = NULL;
 }
 
 /**
@@ -131,6 +295,40 @@ void service_deinit(Service * service) {
 	if (service->stopping) {
 		LOG(LOG_ERR, "Should not delete service while stopping");
 	}
+
+	// The state machine can't be deleted while a worker is still using it
+	if (service->job != NULL) {
+		LOG(LOG_ERR, "Should not delete service while processing a message");
+		service_job_wait(service);
+		// The job will be freed when its completion is dispatched
+		service->job->service = NULL;
+		service->job = NULL;
+	}
+
+	if (service->pending != NULL) {
+		g_queue_free_full(service->pending, service_event_delete);
+		service->pending = NULL;
+	}
+
+	if (service->resumeid != 0) {
+		g_source_remove(service->resumeid);
+		service->resumeid = 0;
+	}
+	service->resuming = FALSE;
+
+	// Anyone waiting on a presence check needs to know it won't complete
+	service_presence_end(service, FALSE);
+
+	if (service->resumption != NULL) {
+		resumption_delete(service->resumption);
+		service->resumption = NULL;
+	}
+
+	if (service->heartbeat != NULL) {
+		heartbeat_delete(service->heartbeat);
+		service->heartbeat = NULL;
+	}
+
 	if (service->fsmservice != NULL) {
 		fsmservice_set_functions(service->fsmservice, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
 		fsmservice_set_userdata(service->fsmservice, NULL);
@@ -148,6 +346,9 @@ void service_deinit(Service * service) {
 		service->beaconthread = NULL;
 	}
 
+	g_slist_free_full(service->beacondevices, g_free);
+	service->beacondevices = NULL;
+
 	if (service->configdir != NULL) {
 		buffer_delete(service->configdir);
 		service->configdir = NULL;
@@ -220,6 +421,7 @@ char const * service_get_beacon(Service const * service) {
  *        Pico during the authentication process.
  */
 void service_start(Service * service, Shared * shared, Users const * users, Buffer const * extraData) {
+	service->shared = shared;
 	service->service_start(service, shared, users, extraData);
 }
 
@@ -276,6 +478,7 @@ void service_set_update_callback(Service * service, ServiceUpdate callback, void
  *        Pico, false o/w.
  */
 void service_set_continuous(Service * service, bool continuous) {
+	service->continuous = continuous;
 	fsmservice_set_continuous(service->fsmservice, continuous);
 }
 
@@ -289,6 +492,25 @@ void service_set_beacons(Service * service, bool beacons) {
 	service->beacons = beacons;
 }
 
+/**
+ * Set whether to hold Bluetooth beacons back. This is used while a session
+ * is waiting for a user who hasn't yet asked to authenticate, so that no
+ * Pico is invited to authenticate until someone has. It can be changed
+ * while the beacons are being sent.
+ *
+ * @param service The object to set the value for.
+ * @param held True if beacons should be held back, false o/w.
+ */
+void service_set_held_beacons(Service * service, bool held) {
+	service->heldbeacons = held;
+	if (service->beaconthread != NULL) {
+		beaconthread_set_held(service->beaconthread, held);
+	}
+	if (service->service_set_held_beacons != NULL) {
+		service->service_set_held_beacons(service, held);
+	}
+}
+
 /**
  * Get the latest piece of extra data sent by the Pico to the service. See
  * fsmservice_get_received_extra_data() for more details about when this
@@ -302,7 +524,16 @@ void service_set_beacons(Service * service, bool beacons) {
  *         but will never be NULL.
  */
 Buffer const * service_get_received_extra_data(Service * service) {
-	return fsmservice_get_received_extra_data(service->fsmservice);
+	Buffer const * extradata;
+
+	if (service->delegate != NULL) {
+		extradata = service_get_received_extra_data(service->delegate);
+	}
+	else {
+		extradata = fsmservice_get_received_extra_data(service->fsmservice);
+	}
+
+	return extradata;
 }
 
 /**
@@ -318,7 +549,37 @@ Buffer const * service_get_received_extra_data(Service * service) {
  * @return A buffer containing the symmetric key stored for the user.
  */
 Buffer const * service_get_symmetric_key(Service * service) {
-	return fsmservice_get_symmetric_key(service->fsmservice);
+	Buffer const * symmetrickey;
+
+	if (service->delegate != NULL) {
+		symmetrickey = service_get_symmetric_key(service->delegate);
+	}
+	else {
+		symmetrickey = fsmservice_get_symmetric_key(service->fsmservice);
+	}
+
+	return symmetrickey;
+}
+
+/**
+ * Get the time the most recent message arrived from the Pico. If the link
+ * has been lost, this is the last time it was known to be up.
+ *
+ * @param service The object to get the value from.
+ * @return The monotonic time in microseconds, or 0 if no message has
+ *         arrived.
+ */
+gint64 service_get_last_heard(Service const * service) {
+	gint64 lastheard;
+
+	if (service->delegate != NULL) {
+		lastheard = service_get_last_heard(service->delegate);
+	}
+	else {
+		lastheard = service->lastheard;
+	}
+
+	return lastheard;
 }
 
 /**
@@ -332,5 +593,1056 @@ void service_set_configdir(Service * service, Buffer const * configdir) {
 	buffer_append_buffer(service->configdir, configdir);
 }
 
+/**
+ * Set extra Bluetooth devices to send beacons to, on top of those in the
+ * device file in the configuration directory. This is used for devices
+ * paired since the device file was last compacted, which are only recorded
+ * in the users journal. The addresses are copied, so the list remains
+ * owned by the caller. Set to NULL (the default) to only use the device
+ * file.
+ *
+ * @param service The object to set the value for.
+ * @param devices A list of Bluetooth addresses as strings, or NULL.
+ */
+void service_set_beacon_devices(Service * service, GSList const * devices) {
+	g_slist_free_full(service->beacondevices, g_free);
+	service->beacondevices = g_slist_copy_deep((GSList *)devices, (GCopyFunc)g_strdup, NULL);
+}
+
+/**
+ * Set the trace to record the session's events into. The trace remains
+ * owned by the caller, which must keep it alive for as long as the service
+ * is running. Set to NULL (the default) to stop recording.
+ *
+ * @param service The object to set the value for.
+ * @param trace The trace to record into, or NULL.
+ */
+void service_set_trace(Service * service, SessionTrace * trace) {
+	service->trace = trace;
+}
+
+/**
+ * Set the pool of worker threads to process messages from the Pico on. The
+ * pool remains owned by the caller and must outlive the service. Set to NULL
+ * (the default) to process messages inline on the main loop.
+ *
+ * @param service The object to set the value for.
+ * @param cryptopool The pool to use, or NULL.
+ */
+void service_set_cryptopool(Service * service, CryptoPool * cryptopool) {
+	service->cryptopool = cryptopool;
+}
+
+/**
+ * Set how long a continuous session is kept open for the Pico to resume
+ * after it goes quiet or the link drops. Set to 0 (the default) to end the
+ * session, and so lock the user's screen, straight away.
+ *
+ * @param service The object to set the value for.
+ * @param grace The grace period in milliseconds, or 0 to disable
+ *        resumption.
+ */
+void service_set_resume_grace(Service * service, int grace) {
+	service->resumegrace = grace;
+}
+
+/**
+ * Set the bounds for the interval between continuous authentication
+ * messages from the Pico. The interval starts at the minimum and grows
+ * towards the maximum while the link is healthy. Set the minimum to 0 (the
+ * default) to leave the interval to the state machine.
+ *
+ * The bounds are ignored if libpico doesn't provide
+ * fsmservice_set_custom_timeout(), since the interval couldn't be passed
+ * on to the state machine.
+ *
+ * @param service The object to set the value for.
+ * @param minimum The shortest interval in milliseconds, or 0.
+ * @param maximum The longest interval in milliseconds.
+ */
+void service_set_heartbeat(Service * service, int minimum, int maximum) {
+	if (service->heartbeat != NULL) {
+		heartbeat_delete(service->heartbeat);
+		service->heartbeat = NULL;
+	}
+
+	if (minimum > 0) {
+#if defined(HAVE_FSMSERVICE_SET_CUSTOM_TIMEOUT)
+		service->heartbeat = heartbeat_new(minimum, maximum);
+		service_heartbeat_apply(service);
+#else
+		LOG(LOG_INFO, "Adaptive heartbeats not supported by libpico, ignoring heartbeat bounds");
+#endif
+	}
+}
+
+/**
+ * Tell the service whether the user is at their desktop session, so that
+ * the heartbeat interval can follow their activity. This has no effect
+ * unless heartbeat bounds have been set.
+ *
+ * @param service The object to update.
+ * @param away true if the user's session is locked or idle, false if it's
+ *        active.
+ */
+void service_set_user_away(Service * service, bool away) {
+	if (service->delegate != NULL) {
+		service_set_user_away(service->delegate, away);
+	}
+	else if ((service->heartbeat != NULL) && (heartbeat_get_away(service->heartbeat) != away)) {
+		heartbeat_set_away(service->heartbeat, away);
+		service_heartbeat_apply(service);
+	}
+}
+
+/**
+ * Record an event in the session trace, if one has been set. If not, this
+ * does nothing.
+ *
+ * This is for use by subclasses of Service.
+ *
+ * @param service The object to record the event for.
+ * @param event The type of event to record.
+ * @param data The data associated with the event, or NULL.
+ * @param length The length of the data.
+ */
+void service_trace(Service const * service, SESSIONTRACEEVENT event, char const * data, size_t length) {
+	if (service->trace != NULL) {
+		sessiontrace_record(service->trace, event, data, length);
+	}
+}
+
+/**
+ * Start sending Bluetooth beacons advertising the service. The BeaconThread
+ * used to send the beacons is only allocated when this is called, so that
+ * sessions with beacons turned off don't pay for it.
+ *
+ * This is for use by subclasses of Service.
+ *
+ * @param service The object to start sending beacons for.
+ * @param users The users to send beacons to.
+ * @param callback The function to call once the beacons have stopped.
+ * @param user_data The user data to pass to the callback.
+ */
+void service_start_beacons(Service * service, Users const * users, BeaconThreadFinishCallback callback, void * user_data) {
+	if (service->beaconthread == NULL) {
+		service->beaconthread = beaconthread_new();
+	}
+
+	beaconthread_set_code(service->beaconthread, service->beacon);
+	beaconthread_set_configdir(service->beaconthread, service->configdir);
+	beaconthread_set_devices(service->beaconthread, service->beacondevices);
+	beaconthread_set_finished_callback(service->beaconthread, callback, user_data);
+	beaconthread_set_held(service->beaconthread, service->heldbeacons);
+
+	LOG(LOG_INFO, "Starting beacons");
+	beaconthread_start(service->beaconthread, users);
+}
+
+/**
+ * Request that any beacons being sent stop being sent. If no beacons are
+ * being sent, this will do nothing.
+ *
+ * This is for use by subclasses of Service.
+ *
+ * @param service The object to stop sending beacons for.
+ */
+void service_stop_beacons(Service * service) {
+	BEACONTHREADSTATE state;
+
+	// It may take some time for this to action, if there are already broadcasts in progress
+	state = service_get_beacon_state(service);
+
+	if ((state > BEACONTHREADSTATE_INVALID) && (state < BEACONTHREADSTATE_HARVESTABLE)) {
+		beaconthread_stop(service->beaconthread);
+	}
+}
+
+/**
+ * Get the state of the beacons being sent by the service. If beacons were
+ * never started, BEACONTHREADSTATE_INVALID is returned.
+ *
+ * This is for use by subclasses of Service.
+ *
+ * @param service The object to get the beacon state for.
+ * @return The state of the BeaconThread sending beacons.
+ */
+BEACONTHREADSTATE service_get_beacon_state(Service const * service) {
+	BEACONTHREADSTATE state;
+
+	state = BEACONTHREADSTATE_INVALID;
+	if (service->beaconthread != NULL) {
+		state = beaconthread_get_state(service->beaconthread);
+	}
+
+	return state;
+}
+
+/**
+ * Set the callbacks for the FsmService state machine to use. This should be
+ * used in place of fsmservice_set_functions(), so that the callbacks can be
+ * deferred when the state machine is running on a worker thread.
+ *
+ * This is for use by subclasses of Service.
+ *
+ * @param service The object to set the callbacks for.
+ * @param functions The callbacks, along with the user data to pass to them.
+ *        The structure is copied.
+ */
+void service_set_fsm_functions(Service * service, ServiceFsmFunctions const * functions) {
+	service->functions = *functions;
+
+	fsmservice_set_functions(service->fsmservice, service_on_write, service_on_set_timeout, service_on_error, service_on_listen, service_on_disconnect, service_on_authenticated, service_on_session_ended, service_on_status_updated);
+	fsmservice_set_userdata(service->fsmservice, service);
+}
+
+/**
+ * Pass a message received from the Pico to the state machine. If a
+ * CryptoPool has been set, the message is processed on a worker thread.
+ *
+ * This is for use by subclasses of Service, in place of fsmservice_read().
+ *
+ * @param service The object to pass the message to.
+ * @param data The message received.
+ * @param length The length of the message.
+ */
+void service_fsm_read(Service * service, char const * data, size_t length) {
+	service_fsm_input(service, SERVICEEVENT_READ, data, length);
+}
+
+/**
+ * Get the current state of the state machine. If a message is being
+ * processed on a worker thread, the state machine belongs to the worker, so
+ * the state returned is the one it was in when the message was handed over.
+ * Any change the message makes will be reported through the status_updated
+ * callback once the worker has finished.
+ *
+ * This is for use by subclasses of Service, in place of
+ * fsmservice_get_state().
+ *
+ * @param service The object to get the state of.
+ * @return The state of the state machine.
+ */
+FSMSERVICESTATE service_fsm_get_state(Service * service) {
+	FSMSERVICESTATE state;
+
+	if (service->job != NULL) {
+		state = service->fsmstate;
+	}
+	else {
+		state = fsmservice_get_state(service->fsmservice);
+	}
+
+	return state;
+}
+
+/**
+ * Check whether a message is being processed on a worker thread. A
+ * subclass that's stopping should wait until this returns false before
+ * calling its stop callback. It will be asked to check again, using its
+ * service_stop_check() function, once the worker has finished.
+ *
+ * This is for use by subclasses of Service.
+ *
+ * @param service The object to check.
+ * @return true if a worker is using the state machine, false o/w.
+ */
+bool service_fsm_busy(Service const * service) {
+	return (service->job != NULL);
+}
+
+/**
+ * Notify the state machine that the Pico has connected.
+ *
+ * This is for use by subclasses of Service, in place of
+ * fsmservice_connected().
+ *
+ * @param service The object to notify.
+ */
+void service_fsm_connected(Service * service) {
+	service_fsm_input(service, SERVICEEVENT_CONNECTED, NULL, 0);
+}
+
+/**
+ * Notify the state machine that the Pico has disconnected.
+ *
+ * This is for use by subclasses of Service, in place of
+ * fsmservice_disconnected().
+ *
+ * @param service The object to notify.
+ */
+void service_fsm_disconnected(Service * service) {
+	service_fsm_input(service, SERVICEEVENT_DISCONNECTED, NULL, 0);
+}
+
+/**
+ * Notify the state machine that the timeout it requested has fired.
+ *
+ * This is for use by subclasses of Service, in place of
+ * fsmservice_timeout().
+ *
+ * @param service The object to notify.
+ */
+void service_fsm_timeout(Service * service) {
+	service_fsm_input(service, SERVICEEVENT_TIMEOUT, NULL, 0);
+}
+
+/**
+ * Request that the state machine stops.
+ *
+ * This is for use by subclasses of Service, in place of fsmservice_stop().
+ *
+ * @param service The object to stop.
+ */
+void service_fsm_stop(Service * service) {
+	service_fsm_input(service, SERVICEEVENT_STOP, NULL, 0);
+}
+
+/**
+ * Notify the service that the link to the Pico has dropped without the
+ * state machine asking for it. If the session can be resumed, the grace
+ * period starts and the subclass should release the link and listen for the
+ * Pico to reconnect. Otherwise the link should be handled as before.
+ *
+ * This is for use by subclasses of Service.
+ *
+ * @param service The object to notify.
+ * @return true if the Pico may resume the session, false o/w.
+ */
+bool service_link_lost(Service * service) {
+	bool result;
+
+	result = service->resuming;
+	if ((result == FALSE) && (service->job == NULL)) {
+		result = service_resume_begin(service, FALSE);
+	}
+
+	return result;
+}
+
+/**
+ * Check that the Pico in a continuous session is present right now, by
+ * sending it a challenge over the existing channel. The callback is called
+ * exactly once with the result: as soon as the Pico answers, when the
+ * timeout expires, or if the session ends first.
+ *
+ * @param service The object whose Pico should be challenged.
+ * @param timeout The time in milliseconds to wait for an answer.
+ * @param callback The function to call with the result.
+ * @param user_data The user data to pass to the callback.
+ * @return true if the challenge was sent, false if the session isn't
+ *         continuing or a check is already outstanding, in which case the
+ *         callback won't be called.
+ */
+bool service_request_presence(Service * service, int timeout, ServicePresence callback, void * user_data) {
+	Buffer * message;
+	bool result;
+
+	result = FALSE;
+	if (service->delegate != NULL) {
+		result = service_request_presence(service->delegate, timeout, callback, user_data);
+	}
+	else if ((service->continuing) && (service->resumption != NULL) && (service->presence_callback == NULL) && (service->resuming == FALSE) && (service->stopping == FALSE)) {
+		message = buffer_new(0);
+		resumption_challenge(service->resumption, message);
+		service_trace(service, SESSIONTRACEEVENT_TIMER, "challenge", strlen("challenge"));
+		// The challenge doesn't involve the state machine, so can be sent even while a worker has it
+		service_write(service, buffer_get_buffer(message), buffer_get_pos(message));
+		buffer_delete(message);
+
+		service->presence_callback = callback;
+		service->presence_user_data = user_data;
+		service->presenceid = timesource_timeout_add(timeout, service_presence_expired, service);
+		result = TRUE;
+	}
+
+	return result;
+}
+
+/**
+ * Create a record of an input or callback. Any data is copied.
+ *
+ * @param event The type of input or callback.
+ * @param value The integer parameter of the callback, if it has one.
+ * @param data The data associated with the event, or NULL.
+ * @param length The length of the data.
+ * @return The newly created record.
+ */
+static ServiceEvent * service_event_new(SERVICEEVENT event, int value, char const * data, size_t length) {
+	ServiceEvent * serviceevent;
+
+	serviceevent = CALLOC(sizeof(ServiceEvent), 1);
+	serviceevent->event = event;
+	serviceevent->value = value;
+	serviceevent->data = NULL;
+	serviceevent->length = 0;
+	if (data != NULL) {
+		serviceevent->data = MALLOC(length + 1);
+		memcpy(serviceevent->data, data, length);
+		serviceevent->data[length] = 0;
+		serviceevent->length = length;
+	}
+
+	return serviceevent;
+}
+
+/**
+ * Delete a record of an input or callback.
+ *
+ * @param data The record to delete.
+ */
+static void service_event_delete(gpointer data) {
+	ServiceEvent * serviceevent = (ServiceEvent *)data;
+
+	if (serviceevent) {
+		if (serviceevent->data != NULL) {
+			FREE(serviceevent->data);
+		}
+		FREE(serviceevent);
+	}
+}
+
+/**
+ * Pass an input to the state machine, or queue it if the state machine is
+ * busy on a worker thread.
+ *
+ * @param service The object to pass the input to.
+ * @param event The type of input.
+ * @param data The data associated with the input, or NULL.
+ * @param length The length of the data.
+ */
+static void service_fsm_input(Service * service, SERVICEEVENT event, char const * data, size_t length) {
+	if (service->job != NULL) {
+		g_queue_push_tail(service->pending, service_event_new(event, 0, data, length));
+	}
+	else {
+		service_fsm_apply(service, event, data, length);
+	}
+}
+
+/**
+ * Pass an input to the state machine. Messages from the Pico are handed to
+ * a worker thread if there's a pool to use; all other input is handled
+ * inline.
+ *
+ * @param service The object to pass the input to.
+ * @param event The type of input.
+ * @param data The data associated with the input, or NULL.
+ * @param length The length of the data.
+ */
+static void service_fsm_apply(Service * service, SERVICEEVENT event, char const * data, size_t length) {
+	ServiceJob * job;
+	bool consumed;
+
+	if (event == SERVICEEVENT_READ) {
+		service->lastheard = timesource_get_monotonic_time();
+	}
+
+	// During the grace period input goes to the resumption first
+	if ((event == SERVICEEVENT_READ) && (service->resuming || (service->presence_callback != NULL))) {
+		consumed = service_resume_read(service, data, length);
+	}
+	else if (service->resuming) {
+		consumed = service_resume_input(service, event, data, length);
+	}
+	else {
+		consumed = ((event == SERVICEEVENT_TIMEOUT) && service_resume_begin(service, TRUE));
+	}
+
+	if (consumed) {
+		event = SERVICEEVENT_INVALID;
+	}
+	else if ((event == SERVICEEVENT_READ) && (service->continuing)) {
+		service_heartbeat_beat(service);
+	}
+
+	switch (event) {
+	case SERVICEEVENT_READ:
+		if (service->cryptopool != NULL) {
+			job = CALLOC(sizeof(ServiceJob), 1);
+			job->service = service;
+			job->data = MALLOC(length + 1);
+			memcpy(job->data, data, length);
+			job->length = length;
+			job->deferred = g_queue_new();
+			g_mutex_init(& job->mutex);
+			g_cond_init(& job->cond);
+			job->done = FALSE;
+
+			// Reported as the current state until the worker is done
+			service->fsmstate = fsmservice_get_state(service->fsmservice);
+			service->job = job;
+			cryptopool_submit(service->cryptopool, service_job_work, service_job_complete, job);
+		}
+		else {
+			fsmservice_read(service->fsmservice, data, length);
+		}
+		break;
+	case SERVICEEVENT_CONNECTED:
+		fsmservice_connected(service->fsmservice);
+		break;
+	case SERVICEEVENT_DISCONNECTED:
+		fsmservice_disconnected(service->fsmservice);
+		break;
+	case SERVICEEVENT_TIMEOUT:
+		fsmservice_timeout(service->fsmservice);
+		break;
+	case SERVICEEVENT_STOP:
+		fsmservice_stop(service->fsmservice);
+		break;
+	case SERVICEEVENT_INVALID:
+		// Consumed by the resumption
+		break;
+	default:
+		LOG(LOG_ERR, "Invalid state machine input %d", event);
+		break;
+	}
+}
+
+/**
+ * Handle a callback from the state machine. If the state machine is running
+ * on a worker thread the callback is recorded to be replayed later on the
+ * main loop. Otherwise the subclass's callback is called straight away.
+ *
+ * While a job is outstanding, only the worker may call this, since the
+ * job's queue isn't shared with the main loop. Writes originating on the
+ * main loop should use service_write() instead.
+ *
+ * @param service The object the callback is for.
+ * @param event The type of callback.
+ * @param value The integer parameter of the callback, if it has one.
+ * @param data The data associated with the callback, or NULL.
+ * @param length The length of the data.
+ */
+static void service_fsm_callback(Service * service, SERVICEEVENT event, int value, char const * data, size_t length) {
+	ServiceFsmFunctions * functions;
+
+	if (service->job != NULL) {
+		// Only the worker uses the job's queue until the job completes
+		g_queue_push_tail(service->job->deferred, service_event_new(event, value, data, length));
+	}
+	else {
+		functions = & service->functions;
+		switch (event) {
+		case SERVICEEVENT_WRITE:
+			service_write(service, data, length);
+			break;
+		case SERVICEEVENT_SET_TIMEOUT:
+			// Remembered so the timer can be restarted after a resumption
+			service->lasttimeout = value;
+			if (functions->set_timeout != NULL) {
+				functions->set_timeout(value, functions->user_data);
+			}
+			break;
+		case SERVICEEVENT_ERROR:
+			service->continuing = FALSE;
+			service_presence_end(service, FALSE);
+			if (functions->error != NULL) {
+				functions->error(functions->user_data);
+			}
+			break;
+		case SERVICEEVENT_LISTEN:
+			if (functions->listen != NULL) {
+				functions->listen(functions->user_data);
+			}
+			break;
+		case SERVICEEVENT_DISCONNECT:
+			if (functions->disconnect != NULL) {
+				functions->disconnect(functions->user_data);
+			}
+			break;
+		case SERVICEEVENT_AUTHENTICATED:
+			if (value == MESSAGESTATUS_OK_CONTINUE) {
+				service_resume_prepare(service);
+			}
+			if (functions->authenticated != NULL) {
+				functions->authenticated(value, functions->user_data);
+			}
+			break;
+		case SERVICEEVENT_SESSION_ENDED:
+			service->continuing = FALSE;
+			service_presence_end(service, FALSE);
+			if (functions->session_ended != NULL) {
+				functions->session_ended(functions->user_data);
+			}
+			break;
+		case SERVICEEVENT_STATUS_UPDATED:
+			if (functions->status_updated != NULL) {
+				functions->status_updated(value, functions->user_data);
+			}
+			break;
+		default:
+			LOG(LOG_ERR, "Invalid state machine callback %d", event);
+			break;
+		}
+	}
+}
+
+/**
+ * Called on a worker thread to pass a message to the state machine.
+ *
+ * @param user_data The job to process, cast to (void *).
+ */
+static void service_job_work(void * user_data) {
+	ServiceJob * job = (ServiceJob *)user_data;
+
+	fsmservice_read(job->service->fsmservice, job->data, job->length);
+
+	g_mutex_lock(& job->mutex);
+	job->done = TRUE;
+	g_cond_signal(& job->cond);
+	g_mutex_unlock(& job->mutex);
+}
+
+/**
+ * Wait for the worker processing the outstanding job, if there is one, to
+ * finish with the state machine. The job's completion still has to be
+ * dispatched on the main loop for the callbacks it recorded to be replayed.
+ *
+ * @param service The object to wait for.
+ */
+static void service_job_wait(Service * service) {
+	if (service->job != NULL) {
+		g_mutex_lock(& service->job->mutex);
+		while (service->job->done == FALSE) {
+			g_cond_wait(& service->job->cond, & service->job->mutex);
+		}
+		g_mutex_unlock(& service->job->mutex);
+	}
+}
+
+/**
+ * Called on the main loop once a worker has finished processing a message.
+ * The callbacks made by the state machine are replayed in order, followed
+ * by any input that was queued in the meantime. If another message is among
+ * the queued input, it's handed to a worker in turn and the rest of the
+ * input remains queued. Once the state machine is idle again, a subclass
+ * that's stopping is asked to check whether it can now finish.
+ *
+ * @param user_data The job that completed, cast to (void *).
+ */
+static void service_job_complete(void * user_data) {
+	ServiceJob * job = (ServiceJob *)user_data;
+	Service * service;
+	ServiceEvent * serviceevent;
+
+	service = job->service;
+	if (service != NULL) {
+		service->job = NULL;
+
+		while ((serviceevent = g_queue_pop_head(job->deferred)) != NULL) {
+			service_fsm_callback(service, serviceevent->event, serviceevent->value, serviceevent->data, serviceevent->length);
+			service_event_delete(serviceevent);
+		}
+
+		while ((service->job == NULL) && ((serviceevent = g_queue_pop_head(service->pending)) != NULL)) {
+			service_fsm_apply(service, serviceevent->event, serviceevent->data, serviceevent->length);
+			service_event_delete(serviceevent);
+		}
+
+		if (service->job == NULL) {
+			if (service->heartbeat != NULL) {
+				// The interval may have changed while the worker had the state machine
+				service_heartbeat_apply(service);
+			}
+			if ((service->stopping) && (service->service_stop_check != NULL)) {
+				service->service_stop_check(service);
+			}
+		}
+	}
+
+	service_job_delete(job);
+}
+
+/**
+ * Delete a job once it has completed.
+ *
+ * @param job The job to delete.
+ */
+static void service_job_delete(ServiceJob * job) {
+	if (job) {
+		g_queue_free_full(job->deferred, service_event_delete);
+		g_mutex_clear(& job->mutex);
+		g_cond_clear(& job->cond);
+		FREE(job->data);
+		FREE(job);
+	}
+}
+
+/**
+ * Write data to the Pico using the subclass's channel. This is called on the
+ * main loop only, and doesn't involve the state machine.
+ *
+ * @param service The object to write the data for.
+ * @param data The data to write.
+ * @param length The length of the data.
+ */
+static void service_write(Service * service, char const * data, size_t length) {
+	if (service->functions.write != NULL) {
+		service->functions.write(data, length, service->functions.user_data);
+	}
+}
+
+/**
+ * Callback from the state machine requesting data be written to the Pico.
+ */
+static void service_on_write(char const * data, size_t length, void * user_data) {
+	service_fsm_callback((Service *)user_data, SERVICEEVENT_WRITE, 0, data, length);
+}
+
+/**
+ * Callback from the state machine requesting a timeout.
+ */
+static void service_on_set_timeout(int timeout, void * user_data) {
+	service_fsm_callback((Service *)user_data, SERVICEEVENT_SET_TIMEOUT, timeout, NULL, 0);
+}
+
+/**
+ * Callback from the state machine signalling an error.
+ */
+static void service_on_error(void * user_data) {
+	service_fsm_callback((Service *)user_data, SERVICEEVENT_ERROR, 0, NULL, 0);
+}
+
+/**
+ * Callback from the state machine requesting the channel listens.
+ */
+static void service_on_listen(void * user_data) {
+	service_fsm_callback((Service *)user_data, SERVICEEVENT_LISTEN, 0, NULL, 0);
+}
+
+/**
+ * Callback from the state machine requesting the channel disconnects.
+ */
+static void service_on_disconnect(void * user_data) {
+	service_fsm_callback((Service *)user_data, SERVICEEVENT_DISCONNECT, 0, NULL, 0);
+}
+
+/**
+ * Callback from the state machine signalling the authentication result.
+ */
+static void service_on_authenticated(int status, void * user_data) {
+	service_fsm_callback((Service *)user_data, SERVICEEVENT_AUTHENTICATED, status, NULL, 0);
+}
+
+/**
+ * Callback from the state machine signalling the session has ended.
+ */
+static void service_on_session_ended(void * user_data) {
+	service_fsm_callback((Service *)user_data, SERVICEEVENT_SESSION_ENDED, 0, NULL, 0);
+}
+
+/**
+ * Callback from the state machine signalling its state has changed.
+ */
+static void service_on_status_updated(int state, void * user_data) {
+	service_fsm_callback((Service *)user_data, SERVICEEVENT_STATUS_UPDATED, state, NULL, 0);
+}
+
+/**
+ * Called once the Pico has authenticated and the session is continuing.
+ * This captures the keys a resumption or presence check will need the Pico
+ * to prove possession of. If the handshake nonce isn't available the
+ * session can be neither resumed nor checked for presence.
+ *
+ * @param service The object that's now continuing.
+ */
+static void service_resume_prepare(Service * service) {
+	Buffer * sessionnonce;
+
+	service->continuing = TRUE;
+
+	if ((service->resumption == NULL) && (service->shared != NULL)) {
+		sessionnonce = buffer_new(0);
+		service_get_session_nonce(service, sessionnonce);
+
+		if (buffer_get_pos(sessionnonce) > 0) {
+			service->resumption = resumption_new();
+			resumption_set_keys(service->resumption, fsmservice_get_symmetric_key(service->fsmservice), sessionnonce);
+		}
+		else {
+			LOG(LOG_INFO, "Session nonce not available, so session can't be resumed");
+		}
+
+		buffer_delete(sessionnonce);
+	}
+}
+
+/**
+ * Append the service nonce from the session's handshake to a buffer, so
+ * that proofs of possession can be bound to this session. Nothing is
+ * appended if libpico doesn't make the nonce available.
+ *
+ * @param service The object to get the nonce for.
+ * @param sessionnonce The buffer to append the nonce to.
+ */
+static void service_get_session_nonce(Service * service, Buffer * sessionnonce) {
+#if defined(HAVE_SHARED_GET_SERVICE_NONCE) && defined(HAVE_NONCE_GET_BUFFER) && defined(HAVE_NONCE_GET_LENGTH)
+	Nonce * nonce;
+
+	nonce = shared_get_service_nonce(service->shared);
+	if (nonce != NULL) {
+		buffer_append(sessionnonce, (char const *)nonce_get_buffer(nonce), nonce_get_length(nonce));
+	}
+#endif
+}
+
+/**
+ * Start the grace period, if the session is one that can be resumed.
+ *
+ * @param service The object to start the grace period for.
+ * @param timedout true if the grace period is starting because the state
+ *        machine's timeout fired, false if because the link dropped.
+ * @return true if the grace period started, false o/w.
+ */
+static bool service_resume_begin(Service * service, bool timedout) {
+	bool result;
+
+	result = FALSE;
+	if ((service->resumegrace > 0) && (service->continuing) && (service->resumption != NULL) && (service->stopping == FALSE)) {
+		LOG(LOG_INFO, "Waiting %d ms for Pico to resume", service->resumegrace);
+		service_trace(service, SESSIONTRACEEVENT_TIMER, "resume", strlen("resume"));
+
+		service->resuming = TRUE;
+		service->resumetimeout = timedout;
+		if (service->heartbeat != NULL) {
+			// Probe quickly until the link has proved itself again
+			heartbeat_anomaly(service->heartbeat);
+			service_heartbeat_apply(service);
+		}
+		service->resumeid = timesource_timeout_add(service->resumegrace, service_resume_expired, service);
+		result = TRUE;
+	}
+
+	return result;
+}
+
+/**
+ * Handle input other than messages for the state machine during the grace
+ * period. A timeout or change in the link is held back from the state
+ * machine until the grace period is over.
+ *
+ * @param service The object the input is for.
+ * @param event The type of input.
+ * @param data The data associated with the input, or NULL.
+ * @param length The length of the data.
+ * @return true if the input was consumed, false if it should be passed on
+ *         to the state machine.
+ */
+static bool service_resume_input(Service * service, SERVICEEVENT event, char const * data, size_t length) {
+	bool consumed;
+
+	consumed = TRUE;
+	switch (event) {
+	case SERVICEEVENT_TIMEOUT:
+		service->resumetimeout = TRUE;
+		break;
+	case SERVICEEVENT_CONNECTED:
+	case SERVICEEVENT_DISCONNECTED:
+		// The state machine doesn't need to know the link was replaced
+		break;
+	default:
+		service_resume_end(service);
+		consumed = FALSE;
+		break;
+	}
+
+	return consumed;
+}
+
+/**
+ * Handle a message from the Pico during the grace period or while a presence
+ * check is outstanding. Resumption requests and answers to the challenge are
+ * dealt with here. Any other message from the Pico means it has simply
+ * caught up, so the grace period ends and the message is passed on as
+ * normal.
+ *
+ * @param service The object the message is for.
+ * @param data The message received.
+ * @param length The length of the message.
+ * @return true if the message was consumed, false if it should be passed on
+ *         to the state machine.
+ */
+static bool service_resume_read(Service * service, char const * data, size_t length) {
+	RESUMPTIONRESULT result;
+	Buffer * reply;
+	bool timedout;
+	bool consumed;
+
+	consumed = TRUE;
+	reply = buffer_new(0);
+	result = resumption_read(service->resumption, data, length, reply);
+	switch (result) {
+	case RESUMPTIONRESULT_ACCEPTED:
+	case RESUMPTIONRESULT_ANSWERED:
+		service_fsm_callback(service, SERVICEEVENT_WRITE, 0, buffer_get_buffer(reply), buffer_get_pos(reply));
+		if (service->resuming) {
+			LOG(LOG_INFO, "Pico resumed session");
+			service_trace(service, SESSIONTRACEEVENT_TIMER, "resumed", strlen("resumed"));
+			timedout = service->resumetimeout;
+			service_resume_end(service);
+			if (timedout) {
+				// The state machine is still waiting for the Pico, so restart its timer
+				service_fsm_callback(service, SERVICEEVENT_SET_TIMEOUT, service->lasttimeout, NULL, 0);
+			}
+		}
+		if (result == RESUMPTIONRESULT_ANSWERED) {
+			service_presence_end(service, TRUE);
+		}
+		break;
+	case RESUMPTIONRESULT_REJECTED:
+		service_presence_end(service, FALSE);
+		if (service->resuming) {
+			service_resume_fail(service);
+		}
+		break;
+	default:
+		if (service->resuming) {
+			service_resume_end(service);
+		}
+		consumed = FALSE;
+		break;
+	}
+	buffer_delete(reply);
+
+	return consumed;
+}
+
+/**
+ * End the grace period.
+ *
+ * @param service The object to end the grace period for.
+ */
+static void service_resume_end(Service * service) {
+	service->resuming = FALSE;
+	if (service->resumeid != 0) {
+		g_source_remove(service->resumeid);
+		service->resumeid = 0;
+	}
+}
+
+/**
+ * End the grace period without the session being resumed. The state machine
+ * is told about whatever started the grace period, which will end the
+ * session. This goes through the usual input queue, in case a worker has
+ * the state machine.
+ *
+ * @param service The object that failed to resume.
+ */
+static void service_resume_fail(Service * service) {
+	bool timedout;
+
+	LOG(LOG_INFO, "Pico failed to resume session");
+	timedout = service->resumetimeout;
+	service_resume_end(service);
+	service->continuing = FALSE;
+
+	// No longer continuing, so this won't start another grace period
+	service_fsm_input(service, (timedout ? SERVICEEVENT_TIMEOUT : SERVICEEVENT_DISCONNECTED), NULL, 0);
+}
+
+/**
+ * Internal callback triggered when the grace period runs out.
+ *
+ * @param user_data The Service the grace period was for, cast to (void *).
+ * @return Always FALSE, so the timer only fires once.
+ */
+static gboolean service_resume_expired(gpointer user_data) {
+	Service * service = (Service *)user_data;
+
+	// This timeout fires only once
+	service->resumeid = 0;
+	service_resume_fail(service);
+
+	return FALSE;
+}
+
+/**
+ * Finish a presence check, if there's one outstanding, and let the caller
+ * know the result.
+ *
+ * @param service The object the presence check was for.
+ * @param present true if the Pico answered the challenge, false o/w.
+ */
+static void service_presence_end(Service * service, bool present) {
+	ServicePresence callback;
+	void * user_data;
+
+	if (service->presenceid != 0) {
+		g_source_remove(service->presenceid);
+		service->presenceid = 0;
+	}
+
+	callback = service->presence_callback;
+	user_data = service->presence_user_data;
+	service->presence_callback = NULL;
+	service->presence_user_data = NULL;
+
+	if (callback != NULL) {
+		LOG(LOG_INFO, "Presence check %s", present ? "answered" : "failed");
+		callback(service, present, user_data);
+	}
+}
+
+/**
+ * Internal callback triggered when the Pico fails to answer a presence
+ * check in time.
+ *
+ * @param user_data The Service the check was for, cast to (void *).
+ * @return Always FALSE, so the timer only fires once.
+ */
+static gboolean service_presence_expired(gpointer user_data) {
+	Service * service = (Service *)user_data;
+
+	// This timeout fires only once
+	service->presenceid = 0;
+	service_presence_end(service, FALSE);
+
+	return FALSE;
+}
+
+/**
+ * Called when a continuous authentication message arrives from the Pico,
+ * before it's passed to the state machine. If the heartbeat interval
+ * changes as a result, the state machine is told, so that its reply gives
+ * the Pico the new interval.
+ *
+ * @param service The object the message arrived for.
+ */
+static void service_heartbeat_beat(Service * service) {
+	int previous;
+	int interval;
+
+	if (service->heartbeat != NULL) {
+		previous = heartbeat_get_interval(service->heartbeat);
+		interval = heartbeat_beat(service->heartbeat, timesource_get_monotonic_time() / 1000);
+		if (interval != previous) {
+			service_heartbeat_apply(service);
+		}
+	}
+}
+
+/**
+ * Pass the current heartbeat interval to the state machine. The interval
+ * used while the Pico has paused authentication is the maximum, since
+ * there's no need to probe a paused Pico quickly. This is only called once
+ * service_set_heartbeat() has found that libpico supports it. If a worker
+ * has the state machine, the interval is applied once it's finished.
+ *
+ * @param service The object to apply the interval for.
+ */
+static void service_heartbeat_apply(Service * service) {
+#if defined(HAVE_FSMSERVICE_SET_CUSTOM_TIMEOUT)
+	int interval;
+	int paused;
+
+	if (service->job == NULL) {
+		interval = heartbeat_get_interval(service->heartbeat);
+		paused = heartbeat_get_maximum(service->heartbeat);
+		fsmservice_set_custom_timeout(service->fsmservice, interval, paused);
+	}
+#endif
+}
+
 /** @} addtogroup Service */
 
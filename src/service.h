@@ -46,6 +46,8 @@
 #define __SERVICE_H (1)
 
 #include "pico/fsmservice.h"
+#include "sessiontrace.h"
+#include "cryptopool.h"
 
 // Defines
 
@@ -55,6 +57,7 @@ typedef struct _Service Service;
 
 typedef void (*ServiceStopped)(Service * service, void * user_data);
 typedef void (*ServiceUpdate)(Service * service, int state, void * user_data);
+typedef void (*ServicePresence)(Service * service, bool present, void * user_data);
 
 // Function prototypes
 
@@ -67,10 +70,19 @@ char const * service_get_beacon(Service const * service);
 void service_set_stop_callback(Service * service, ServiceStopped callback, void * user_data);
 void service_set_continuous(Service * service, bool continuous);
 void service_set_beacons(Service * service, bool beacons);
+void service_set_held_beacons(Service * service, bool held);
 void service_set_update_callback(Service * service, ServiceUpdate callback, void * user_data);
 Buffer const * service_get_received_extra_data(Service * service);
 Buffer const * service_get_symmetric_key(Service * service);
+gint64 service_get_last_heard(Service const * service);
 void service_set_configdir(Service * service, Buffer const * configdir);
+void service_set_beacon_devices(Service * service, GSList const * devices);
+void service_set_trace(Service * service, SessionTrace * trace);
+void service_set_cryptopool(Service * service, CryptoPool * cryptopool);
+void service_set_resume_grace(Service * service, int grace);
+void service_set_heartbeat(Service * service, int minimum, int maximum);
+void service_set_user_away(Service * service, bool away);
+bool service_request_presence(Service * service, int timeout, ServicePresence callback, void * user_data);
 
 // Virtual functions
 void service_start(Service * service, Shared * shared, Users const * users, Buffer const * extraData);
@@ -46,11 +46,38 @@
 #define __SERVICE_PRIVATE_H (1)
 
 #include "pico/fsmservice.h"
+#include "resumption.h"
+#include "heartbeat.h"
 
 // Defines
 
 // Structure definitions
 
+/**
+ * The internal structure can be found in service.c
+ */
+typedef struct _ServiceJob ServiceJob;
+
+/**
+ * @brief The callbacks a subclass provides for the FsmService state machine
+ *
+ * These have the same signatures as the callbacks passed to
+ * fsmservice_set_functions(), but are called via the Service so that the
+ * state machine can be run on a worker thread. See
+ * service_set_fsm_functions() for details.
+ */
+typedef struct _ServiceFsmFunctions {
+	void (*write)(char const * data, size_t length, void * user_data);
+	void (*set_timeout)(int timeout, void * user_data);
+	void (*error)(void * user_data);
+	void (*listen)(void * user_data);
+	void (*disconnect)(void * user_data);
+	void (*authenticated)(int status, void * user_data);
+	void (*session_ended)(void * user_data);
+	void (*status_updated)(int state, void * user_data);
+	void * user_data;
+} ServiceFsmFunctions;
+
 typedef struct _Service {
 	GMainLoop * loop;
 	FsmService * fsmservice;
@@ -63,12 +90,37 @@ typedef struct _Service {
 	char * beacon;
 	bool beacons;
 	Buffer * configdir;
+	GSList * beacondevices;
+	SessionTrace * trace;
 	bool stopping;
+	ServiceFsmFunctions functions;
+	CryptoPool * cryptopool;
+	ServiceJob * job;
+	GQueue * pending;
+	FSMSERVICESTATE fsmstate;
+	Shared * shared;
+	int resumegrace;
+	Resumption * resumption;
+	bool continuing;
+	bool resuming;
+	bool resumetimeout;
+	guint resumeid;
+	int lasttimeout;
+	ServicePresence presence_callback;
+	void * presence_user_data;
+	guint presenceid;
+	Heartbeat * heartbeat;
+	gint64 lastheard;
+	bool continuous;
+	Service * delegate;
+	bool heldbeacons;
 
 	// Virtual functions
 	void (*service_delete)(Service * service);
 	void (*service_start)(Service * service, Shared * shared, Users const * users, Buffer const * extraData);
 	void (*service_stop)(Service * service);
+	void (*service_set_held_beacons)(Service * service, bool held);
+	bool (*service_stop_check)(Service * service);
 } Service;
 
 
@@ -76,6 +128,19 @@ typedef struct _Service {
 
 void service_init(Service * service);
 void service_deinit(Service * service);
+void service_start_beacons(Service * service, Users const * users, BeaconThreadFinishCallback callback, void * user_data);
+void service_stop_beacons(Service * service);
+BEACONTHREADSTATE service_get_beacon_state(Service const * service);
+void service_trace(Service const * service, SESSIONTRACEEVENT event, char const * data, size_t length);
+void service_set_fsm_functions(Service * service, ServiceFsmFunctions const * functions);
+void service_fsm_read(Service * service, char const * data, size_t length);
+FSMSERVICESTATE service_fsm_get_state(Service * service);
+bool service_fsm_busy(Service const * service);
+void service_fsm_connected(Service * service);
+void service_fsm_disconnected(Service * service);
+void service_fsm_timeout(Service * service);
+void service_fsm_stop(Service * service);
+bool service_link_lost(Service * service);
 
 // Function definitions
 
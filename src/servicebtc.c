@@ -69,6 +69,7 @@
 #include "beaconthread.h"
 #include "service.h"
 #include "service_private.h"
+#include "timesource.h"
 #include "servicebtc.h"
 
 // Defines
@@ -77,7 +78,8 @@
  * @brief The maximum amount of data to read in a single Bluetooth read
  *
  * We create a buffer to read the data into, and this is the size the buffer
- * takes, so no more than this should be read at a time.
+ * takes, so no more than this should be read at a time. The buffer is only
+ * allocated once a device connects.
  *
  */
 #define INPUT_SIZE_MAX	(1024)
@@ -113,7 +115,7 @@ typedef struct _ServiceBtc {
 	// Extend with new fields
 	GSocketConnection * connection;
 	GSocketService * socketservice;
-	char message[INPUT_SIZE_MAX];
+	char * message;
 	int channel;
 } ServiceBtc;
 
@@ -127,6 +129,7 @@ static void servicebtc_write(char const * data, size_t length, void * user_data)
 static void servicebtc_set_timeout(int timeout, void * user_data);
 static void servicebtc_error(void * user_data);
 static void servicebtc_disconnect(void * user_data);
+static void servicebtc_release(ServiceBtc * servicebtc);
 static void servicebtc_authenticated(int status, void * user_data);
 static void servicebtc_listen(void * user_data);
 static void servicebtc_session_ended(void * user_data);
@@ -162,6 +165,7 @@ static void report_error(GError ** error, char const * hint) {
  */
 ServiceBtc * servicebtc_new() {
 	ServiceBtc * servicebtc;
+	ServiceFsmFunctions functions;
 
 	servicebtc = CALLOC(sizeof(ServiceBtc), 1);
 
@@ -172,14 +176,25 @@ ServiceBtc * servicebtc_new() {
 	servicebtc->service.service_delete = (void*)servicebtc_delete;
 	servicebtc->service.service_start = (void*)servicebtc_start;
 	servicebtc->service.service_stop = (void*)servicebtc_stop;
+	servicebtc->service.service_stop_check = (void*)servicebtc_stop_check;
 
 	// Initialise the extra fields
 	servicebtc->connection = NULL;
 	servicebtc->socketservice = g_socket_service_new ();
+	// The input buffer is only allocated once a device connects
+	servicebtc->message = NULL;
 	servicebtc->channel = 0;
 
-	fsmservice_set_functions(servicebtc->service.fsmservice, servicebtc_write, servicebtc_set_timeout, servicebtc_error, servicebtc_listen, servicebtc_disconnect, servicebtc_authenticated, servicebtc_session_ended, servicebtc_status_updated);
-	fsmservice_set_userdata(servicebtc->service.fsmservice, servicebtc);
+	functions.write = servicebtc_write;
+	functions.set_timeout = servicebtc_set_timeout;
+	functions.error = servicebtc_error;
+	functions.listen = servicebtc_listen;
+	functions.disconnect = servicebtc_disconnect;
+	functions.authenticated = servicebtc_authenticated;
+	functions.session_ended = servicebtc_session_ended;
+	functions.status_updated = servicebtc_status_updated;
+	functions.user_data = servicebtc;
+	service_set_fsm_functions(& servicebtc->service, & functions);
 
 	return servicebtc;
 }
@@ -196,6 +211,18 @@ void servicebtc_delete(ServiceBtc * servicebtc) {
 		if (servicebtc->connection != NULL) {
 			LOG(LOG_ERR, "Should not delete service while still connected");
 		}
+
+		if (servicebtc->socketservice != NULL) {
+			g_object_unref(servicebtc->socketservice);
+			servicebtc->socketservice = NULL;
+		}
+
+		if (servicebtc->message != NULL) {
+			FREE(servicebtc->message);
+			servicebtc->message = NULL;
+		}
+
+		FREE(servicebtc);
 	}
 }
 
@@ -293,12 +320,7 @@ void servicebtc_start(ServiceBtc * servicebtc, Shared * shared, Users const * us
 
 		if (servicebtc->service.beacons) {
 			// Send Bluetooth beacons
-			beaconthread_set_code(servicebtc->service.beaconthread, servicebtc->service.beacon);
-			beaconthread_set_configdir(servicebtc->service.beaconthread, servicebtc->service.configdir);
-			beaconthread_set_finished_callback(servicebtc->service.beaconthread, servicebtc_beaconthread_finish, servicebtc);
-
-			LOG(LOG_INFO, "Starting beacons");
-			beaconthread_start(servicebtc->service.beaconthread, users);
+			service_start_beacons(&servicebtc->service, users, servicebtc_beaconthread_finish, servicebtc);
 		}
 
 		fsmservice_start(servicebtc->service.fsmservice, shared, users, extraData);
@@ -316,21 +338,14 @@ void servicebtc_start(ServiceBtc * servicebtc, Shared * shared, Users const * us
  * @param servicebtc The Service to stop.
  */
 void servicebtc_stop(ServiceBtc * servicebtc) {
-	BEACONTHREADSTATE state;
-
 	// If we're already stopping, we shouldn't interrupt the process
 	if (servicebtc->service.stopping == FALSE) {
 		servicebtc->service.stopping = TRUE;
 
 		// Update the state machine
-		fsmservice_stop(servicebtc->service.fsmservice);
+		service_fsm_stop(& servicebtc->service);
 		// Stop sending out beacons
-		// It may take some time for this to action, if there are already broadcasts in progress
-		state = beaconthread_get_state(servicebtc->service.beaconthread);
-
-		if ((state > BEACONTHREADSTATE_INVALID) && (state < BEACONTHREADSTATE_HARVESTABLE)) {
-			beaconthread_stop(servicebtc->service.beaconthread);
-		}
+		service_stop_beacons(&servicebtc->service);
 
 		// Stop accepting new connections
 		g_socket_service_stop(servicebtc->socketservice);
@@ -383,11 +398,11 @@ static bool servicebtc_stop_check(ServiceBtc * servicebtc) {
 	BEACONTHREADSTATE state;
 
 	stopped = FALSE;
-	state = beaconthread_get_state(servicebtc->service.beaconthread);
+	state = service_get_beacon_state(&servicebtc->service);
 
 	if (servicebtc->service.stopping == TRUE) {
-		// Ensure we're not connected to a device
-		if (servicebtc->connection == NULL) {
+		// Ensure we're not connected to a device or processing a message
+		if ((servicebtc->connection == NULL) && (service_fsm_busy(&servicebtc->service) == FALSE)) {
 			// Ensure we're not still advertising
 			if ((state == BEACONTHREADSTATE_HARVESTABLE) || (state == BEACONTHREADSTATE_INVALID)) {
 				// Clear any waiting timeout
@@ -434,6 +449,7 @@ static void servicebtc_write(char const * data, size_t length, void * user_data)
 	error = NULL;
 
 	LOG(LOG_INFO, "Sending: %d bytes", length);
+	service_trace(&servicebtc->service, SESSIONTRACEEVENT_WRITE, data, length);
 
 	// Get the output stream to write to
 	output = g_io_stream_get_output_stream(G_IO_STREAM(servicebtc->connection));
@@ -471,7 +487,7 @@ static void servicebtc_set_timeout(int timeout, void * user_data) {
 		servicebtc->service.timeoutid = 0;
 	}
 
-	servicebtc->service.timeoutid = g_timeout_add(timeout, servicebtc_timeout, servicebtc);
+	servicebtc->service.timeoutid = timesource_timeout_add(timeout, servicebtc_timeout, servicebtc);
 }
 
 /**
@@ -499,30 +515,43 @@ static void servicebtc_error(void * user_data) {
  */
 static void servicebtc_disconnect(void * user_data) {
 	ServiceBtc * servicebtc = (ServiceBtc *)user_data;
-	GSocket * gsocket;
-	GError * error;
 	FSMSERVICESTATE state;
 
 	LOG(LOG_DEBUG, "Disconnect");
-	error = NULL;
 
 	if (servicebtc->connection) {
-		gsocket = g_socket_connection_get_socket (G_SOCKET_CONNECTION(servicebtc->connection));
-		g_socket_close (gsocket, & error);
-		report_error(&error, "disconnecting");
-		g_object_unref(servicebtc->connection);
-		servicebtc->connection = NULL;
+		servicebtc_release(servicebtc);
 
 		g_socket_service_stop(servicebtc->socketservice);
 
-		state = fsmservice_get_state(servicebtc->service.fsmservice);
+		state = service_fsm_get_state(& servicebtc->service);
 
 		if ((state > FSMSERVICESTATE_INVALID) && (state < FSMSERVICESTATE_FIN)) {
-			fsmservice_disconnected(servicebtc->service.fsmservice);
+			service_trace(&servicebtc->service, SESSIONTRACEEVENT_DISCONNECTED, NULL, 0);
+			service_fsm_disconnected(& servicebtc->service);
 		}
 	}
 }
 
+/**
+ * Internal function to close and release the current Bluetooth connection,
+ * without notifying the state machine.
+ *
+ * @param servicebtc The service to release the connection for.
+ */
+static void servicebtc_release(ServiceBtc * servicebtc) {
+	GSocket * gsocket;
+	GError * error;
+
+	error = NULL;
+
+	gsocket = g_socket_connection_get_socket (G_SOCKET_CONNECTION(servicebtc->connection));
+	g_socket_close (gsocket, & error);
+	report_error(&error, "disconnecting");
+	g_object_unref(servicebtc->connection);
+	servicebtc->connection = NULL;
+}
+
 /**
  * Internal function provided to the FsmService to request that the service
  * listen for incoming Bluetooth connections.
@@ -582,9 +611,13 @@ static void servicebtc_session_ended(void * user_data) {
  */
 static void servicebtc_status_updated(int state, void * user_data) {
 	ServiceBtc * servicebtc = (ServiceBtc *)user_data;
+	char statebyte;
 
 	LOG(LOG_DEBUG, "Update, state: %d", state);
 
+	statebyte = (char)state;
+	service_trace(&servicebtc->service, SESSIONTRACEEVENT_STATE, &statebyte, 1);
+
 	if (servicebtc->service.update_callback != NULL) {
 		servicebtc->service.update_callback(&servicebtc->service, state, servicebtc->service.update_user_data);
 	}
@@ -608,7 +641,8 @@ static gboolean servicebtc_timeout(gpointer user_data) {
 	servicebtc->service.timeoutid = 0;
 
 	LOG(LOG_DEBUG, "Calling timeout");
-	fsmservice_timeout(servicebtc->service.fsmservice);
+	service_trace(&servicebtc->service, SESSIONTRACEEVENT_TIMEOUT, NULL, 0);
+	service_fsm_timeout(& servicebtc->service);
 
 	return FALSE;
 }
@@ -644,10 +678,20 @@ static void servicebtc_read(GObject * source_object, GAsyncResult *res, gpointer
 
 		//g_object_unref(G_SOCKET_CONNECTION (servicebtc->connection));
 
-		fsmservice_read(servicebtc->service.fsmservice, servicebtc->message + 4, count - 4);
+		service_trace(&servicebtc->service, SESSIONTRACEEVENT_READ, servicebtc->message + 4, count - 4);
+		service_fsm_read(& servicebtc->service, servicebtc->message + 4, count - 4);
 
 		g_input_stream_read_async (input, servicebtc->message, INPUT_SIZE_MAX, G_PRIORITY_DEFAULT, NULL, servicebtc_read, (gpointer)servicebtc);
 	}
+	else if ((servicebtc->connection != NULL) && (servicebtc->service.stopping == FALSE)) {
+		LOG(LOG_DEBUG, "Link lost");
+		if (service_link_lost(& servicebtc->service)) {
+			// Drop the dead link and wait for the Pico to reconnect to resume
+			service_trace(&servicebtc->service, SESSIONTRACEEVENT_DISCONNECTED, NULL, 0);
+			servicebtc_release(servicebtc);
+			g_socket_service_start(servicebtc->socketservice);
+		}
+	}
 }
 
 /**
@@ -669,15 +713,18 @@ static gboolean servicebtc_incoming_connect(GSocketService * socketservice, GSoc
 	LOG(LOG_DEBUG, "Incoming connection");
 
 	servicebtc->connection = g_object_ref(connection);
-	fsmservice_connected(servicebtc->service.fsmservice);
+	service_trace(&servicebtc->service, SESSIONTRACEEVENT_CONNECTED, NULL, 0);
+	service_fsm_connected(& servicebtc->service);
 
 	input = g_io_stream_get_input_stream(G_IO_STREAM(servicebtc->connection));
 
+	if (servicebtc->message == NULL) {
+		servicebtc->message = MALLOC(INPUT_SIZE_MAX);
+	}
+
 	g_input_stream_read_async (input, servicebtc->message, INPUT_SIZE_MAX, G_PRIORITY_DEFAULT, NULL, servicebtc_read, (gpointer)servicebtc);
 
-	if (servicebtc->service.beacons) {
-		beaconthread_stop(servicebtc->service.beaconthread);
-	}
+	service_stop_beacons(&servicebtc->service);
 
 	return false;
 }
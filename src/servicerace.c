@@ -0,0 +1,573 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Race Rendezvous Point and Bluetooth channels against each other
+ * @section DESCRIPTION
+ *
+ * ServiceRace is a subclass of Service that contains a ServiceRvp and a
+ * ServiceBtc, starts them both, and continues the session over whichever a
+ * Pico connects to first. See servicerace.h for details.
+ *
+ * The race's own state machine is never started. Instead, the state
+ * updates of the winning channel are passed on as if they were the race's
+ * own, and queries about the session are delegated to the winner.
+ *
+ * The execution of this code is managed by AuthThread.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "pico/pico.h"
+#include "pico/fsmservice.h"
+#include "pico/shared.h"
+
+#include "log.h"
+#include "beaconthread.h"
+#include "service.h"
+#include "service_private.h"
+#include "timesource.h"
+#include "keycache.h"
+#include "servicervp.h"
+#include "servicebtc.h"
+#include "servicerace.h"
+
+// Defines
+
+/**
+ * @brief The index of the Rendezvous Point channel in the race
+ */
+#define SERVICERACE_RVP (0)
+
+/**
+ * @brief The index of the Bluetooth Classic channel in the race
+ */
+#define SERVICERACE_BTC (1)
+
+/**
+ * @brief The number of channels in the race
+ */
+#define SERVICERACE_CHANNELS (2)
+
+// Structure definitions
+
+/**
+ * @brief Opaque structure used for racing channels against each other
+ *
+ * This is a subclass of the Service struct, and inherits all members of
+ * Service as well as adding the channels being raced.
+ *
+ * Each channel is given its own Shared object and copy of the extra data,
+ * so the two state machines never write to the same object while they
+ * race. A channel is marked as stopped until it's started, and again once
+ * its stop callback has been called. The race is running from when it's
+ * started until both channels have stopped.
+ *
+ * The lifecycle of this data is managed by AuthThread.
+ *
+ */
+typedef struct _ServiceRace {
+	// Inheret from Service
+	Service service;
+
+	// Extend with new fields
+	Service * channels[SERVICERACE_CHANNELS];
+	Shared * shared[SERVICERACE_CHANNELS];
+	Buffer * extradata[SERVICERACE_CHANNELS];
+	bool stopped[SERVICERACE_CHANNELS];
+	Service * winner;
+	gint64 started;
+	bool running;
+} ServiceRace;
+
+// Function prototypes
+
+static void servicerace_channel_update(Service * service, int state, void * user_data);
+static void servicerace_channel_stopped(Service * service, void * user_data);
+static int servicerace_channel_index(ServiceRace const * servicerace, Service const * service);
+static void servicerace_configure(ServiceRace * servicerace, Service * channel);
+static void servicerace_prepare(ServiceRace * servicerace, int channel, Shared * shared, Buffer const * extraData);
+static void servicerace_release(ServiceRace * servicerace, int channel);
+static bool servicerace_stop_check(ServiceRace * servicerace);
+static void servicerace_set_held_beacons(ServiceRace * servicerace, bool held);
+
+// Local variables
+
+/**
+ * @brief The results of all races run by the service
+ *
+ * All races run on the main loop, so no locking is needed.
+ */
+static ServiceRaceStats servicerace_stats;
+
+// Function definitions
+
+/**
+ * Create a new instance of the class, which inherits from Service.
+ *
+ * @return The newly created object.
+ */
+ServiceRace * servicerace_new() {
+	ServiceRace * servicerace;
+	int channel;
+
+	servicerace = CALLOC(sizeof(ServiceRace), 1);
+
+	// Initialise the base class
+	service_init(&servicerace->service);
+
+	// Set up the virtual functions
+	servicerace->service.service_delete = (void*)servicerace_delete;
+	servicerace->service.service_start = (void*)servicerace_start;
+	servicerace->service.service_stop = (void*)servicerace_stop;
+	servicerace->service.service_set_held_beacons = (void*)servicerace_set_held_beacons;
+
+	// Initialise the extra fields
+	servicerace->channels[SERVICERACE_RVP] = (Service *)servicervp_new();
+	servicerace->channels[SERVICERACE_BTC] = (Service *)servicebtc_new();
+	for (channel = 0; channel < SERVICERACE_CHANNELS; channel++) {
+		servicerace->shared[channel] = NULL;
+		servicerace->extradata[channel] = NULL;
+		servicerace->stopped[channel] = TRUE;
+		service_set_update_callback(servicerace->channels[channel], servicerace_channel_update, servicerace);
+		service_set_stop_callback(servicerace->channels[channel], servicerace_channel_stopped, servicerace);
+	}
+	servicerace->winner = NULL;
+	servicerace->started = 0;
+	servicerace->running = FALSE;
+
+	return servicerace;
+}
+
+/**
+ * Delete an instance of the class, freeing up the memory allocated to it.
+ *
+ * @param servicerace The object to free.
+ */
+void servicerace_delete(ServiceRace * servicerace) {
+	int channel;
+
+	if (servicerace != NULL) {
+		// The winner mustn't be used once it's been deleted
+		servicerace->service.delegate = NULL;
+		servicerace->winner = NULL;
+
+		for (channel = 0; channel < SERVICERACE_CHANNELS; channel++) {
+			if (servicerace->channels[channel] != NULL) {
+				service_delete(servicerace->channels[channel]);
+				servicerace->channels[channel] = NULL;
+			}
+			servicerace_release(servicerace, channel);
+		}
+
+		service_deinit(&servicerace->service);
+
+		FREE(servicerace);
+	}
+}
+
+/**
+ * Set the Rendezvous Point URL to create the race's Rendezvous Point
+ * channel under. See servicervp_set_urlprefix() for details.
+ *
+ * @param servicerace The object to set the value for.
+ * @param urlprefix The URL to use.
+ */
+void servicerace_set_urlprefix(ServiceRace * servicerace, char const * urlprefix) {
+	servicervp_set_urlprefix((ServiceRvp *)servicerace->channels[SERVICERACE_RVP], urlprefix);
+}
+
+/**
+ * Set the RvpEndpoints object for the race's Rendezvous Point channel to
+ * report to. See servicervp_set_endpoints() for details.
+ *
+ * @param servicerace The object to set the value for.
+ * @param endpoints The object to report to, which remains owned by the
+ *        caller, or NULL to not report.
+ */
+void servicerace_set_endpoints(ServiceRace * servicerace, RvpEndpoints * endpoints) {
+	servicervp_set_endpoints((ServiceRvp *)servicerace->channels[SERVICERACE_RVP], endpoints);
+}
+
+/**
+ * Set the SoupSession for the race's Rendezvous Point channel to make its
+ * requests with. See servicervp_set_session() for details.
+ *
+ * @param servicerace The object to set the value for.
+ * @param session The session to use, or NULL for the channel to create its
+ *        own.
+ */
+void servicerace_set_session(ServiceRace * servicerace, SoupSession * session) {
+	servicervp_set_session((ServiceRvp *)servicerace->channels[SERVICERACE_RVP], session);
+}
+
+/**
+ * Replace the channels raced against each other, so that the race can be
+ * run without a Rendezvous Point or Bluetooth, for example in tests. The
+ * race takes ownership of the new channels, and deletes the ones they
+ * replace. It mustn't be running.
+ *
+ * The first channel stands in for the Rendezvous Point: its address is used
+ * for the QR code, and its wins are counted as the Rendezvous Point's. The
+ * second stands in for Bluetooth and sends any beacons. Since the first
+ * needn't be a ServiceRvp, servicerace_set_urlprefix(),
+ * servicerace_set_endpoints() and servicerace_set_session() mustn't be
+ * called once it's been replaced.
+ *
+ * @param servicerace The object to set the channels for.
+ * @param rvp The channel to race in place of the Rendezvous Point.
+ * @param btc The channel to race in place of Bluetooth.
+ */
+void servicerace_set_channels(ServiceRace * servicerace, Service * rvp, Service * btc) {
+	int channel;
+
+	service_delete(servicerace->channels[SERVICERACE_RVP]);
+	service_delete(servicerace->channels[SERVICERACE_BTC]);
+	servicerace->channels[SERVICERACE_RVP] = rvp;
+	servicerace->channels[SERVICERACE_BTC] = btc;
+
+	for (channel = 0; channel < SERVICERACE_CHANNELS; channel++) {
+		servicerace_release(servicerace, channel);
+		servicerace->stopped[channel] = TRUE;
+		service_set_update_callback(servicerace->channels[channel], servicerace_channel_update, servicerace);
+		service_set_stop_callback(servicerace->channels[channel], servicerace_channel_stopped, servicerace);
+	}
+}
+
+/**
+ * Start both channels to allow Pico devices to authenticate over either of
+ * them. The QR code returned by service_get_beacon() uses the Rendezvous
+ * Point address, unless the Rendezvous Point channel failed to start, in
+ * which case the Bluetooth address is used.
+ *
+ * Each channel is started with its own Shared object holding a copy of the
+ * service identity key from the one passed in, so the keys must already
+ * have been loaded into it.
+ *
+ * Note that the race is won by the first Pico to connect to either channel.
+ * Bluetooth Picos aren't checked against the user the QR code was shown
+ * for until the handshake completes, so any Bluetooth device that connects
+ * first wins and the Rendezvous Point channel is cancelled, even if the
+ * intended user was about to scan the QR code. If that device then
+ * fails to authenticate, so does the session.
+ *
+ * Care is needed with the users parameter. If this is set to NULL, any
+ * well-formed attempt to authenticate will succeed.
+ *
+ * @param servicerace The object to use.
+ * @param shared A Shared object that contains the keys needed for
+          authentication.
+ * @param users The users that are allowed to authenticate, or NULL to
+          allow any user to authenticate.
+ * @param extraData A buffer containing any extra data to be sent to the
+ *        Pico during the authentication process.
+ */
+void servicerace_start(ServiceRace * servicerace, Shared * shared, Users const * users, Buffer const * extraData) {
+	int channel;
+	char const * beacon;
+
+	// We can't start if we're mid-stop
+	if (servicerace->service.stopping == FALSE) {
+		LOG(LOG_INFO, "Racing Rendezvous Point against Bluetooth");
+		servicerace_stats.races++;
+		servicerace->winner = NULL;
+		servicerace->service.delegate = NULL;
+		servicerace->started = timesource_get_monotonic_time();
+		servicerace->running = TRUE;
+
+		for (channel = 0; channel < SERVICERACE_CHANNELS; channel++) {
+			servicerace_configure(servicerace, servicerace->channels[channel]);
+			servicerace->stopped[channel] = FALSE;
+		}
+		// Beacons advertise the Bluetooth channel; the QR code covers the Rendezvous Point
+		service_set_beacons(servicerace->channels[SERVICERACE_BTC], servicerace->service.beacons);
+
+		for (channel = 0; channel < SERVICERACE_CHANNELS; channel++) {
+			servicerace_prepare(servicerace, channel, shared, extraData);
+			service_start(servicerace->channels[channel], servicerace->shared[channel], users, servicerace->extradata[channel]);
+		}
+
+		beacon = service_get_beacon(servicerace->channels[SERVICERACE_RVP]);
+		if ((beacon == NULL) || (strcmp(beacon, "ERROR") == 0)) {
+			beacon = service_get_beacon(servicerace->channels[SERVICERACE_BTC]);
+		}
+		if (beacon == NULL) {
+			beacon = "ERROR";
+		}
+		servicerace->service.beacon = CALLOC(sizeof(char), strlen(beacon) + 1);
+		strcpy(servicerace->service.beacon, beacon);
+	}
+}
+
+/**
+ * Request that the service stops whatever it's doing and finish off. Both
+ * channels are stopped, and once they've both finished the callback set
+ * using service_set_stop_callback() will be called.
+ *
+ * This call is asynchronous, hence the need for the callback.
+ *
+ * @param servicerace The Service to stop.
+ */
+void servicerace_stop(ServiceRace * servicerace) {
+	int channel;
+
+	LOG(LOG_DEBUG, "Requesting stop");
+	// If we're already stopping, we shouldn't interrupt the process
+	if (servicerace->service.stopping == FALSE) {
+		servicerace->service.stopping = TRUE;
+
+		for (channel = 0; channel < SERVICERACE_CHANNELS; channel++) {
+			if (servicerace->stopped[channel] == FALSE) {
+				service_stop(servicerace->channels[channel]);
+			}
+		}
+
+		servicerace_stop_check(servicerace);
+	}
+}
+
+/**
+ * Get the results of all races run so far.
+ *
+ * @param stats A structure to copy the values into.
+ */
+void servicerace_get_stats(ServiceRaceStats * stats) {
+	memcpy(stats, & servicerace_stats, sizeof(ServiceRaceStats));
+}
+
+/**
+ * Pass on whether beacons are held back to the Bluetooth channel, which
+ * sends the beacons on behalf of the race.
+ *
+ * @param servicerace The race to hold the beacons for.
+ * @param held True if beacons should be held back, false o/w.
+ */
+static void servicerace_set_held_beacons(ServiceRace * servicerace, bool held) {
+	service_set_held_beacons(servicerace->channels[SERVICERACE_BTC], held);
+}
+
+/**
+ * Copy the configuration set on the race to one of its channels.
+ *
+ * @param servicerace The race to copy the configuration from.
+ * @param channel The channel to configure.
+ */
+static void servicerace_configure(ServiceRace * servicerace, Service * channel) {
+	Service * service;
+
+	service = &servicerace->service;
+	service_set_loop(channel, service->loop);
+	service_set_continuous(channel, service->continuous);
+	service_set_beacons(channel, FALSE);
+	service_set_configdir(channel, service->configdir);
+	service_set_beacon_devices(channel, service->beacondevices);
+	service_set_trace(channel, service->trace);
+	service_set_cryptopool(channel, service->cryptopool);
+	service_set_resume_grace(channel, service->resumegrace);
+	if (service->heartbeat != NULL) {
+		service_set_heartbeat(channel, heartbeat_get_minimum(service->heartbeat), heartbeat_get_maximum(service->heartbeat));
+	}
+}
+
+/**
+ * Create the Shared object and extra data for one of the race's channels to
+ * run its state machine with, replacing those from any previous race. The
+ * service identity key is copied by reference from the Shared object the
+ * race was started with.
+ *
+ * @param servicerace The race the channel belongs to.
+ * @param channel The index of the channel to prepare.
+ * @param shared The Shared object the race was started with.
+ * @param extraData The extra data the race was started with, or NULL.
+ */
+static void servicerace_prepare(ServiceRace * servicerace, int channel, Shared * shared, Buffer const * extraData) {
+	KeyPair * identitykey;
+
+	servicerace_release(servicerace, channel);
+
+	servicerace->shared[channel] = shared_new();
+	identitykey = shared_get_service_identity_key(shared);
+	if (identitykey != NULL) {
+		shared_set_service_identity_key(servicerace->shared[channel], keycache_copy(identitykey));
+	}
+
+	if (extraData != NULL) {
+		servicerace->extradata[channel] = buffer_new(0);
+		buffer_append_buffer(servicerace->extradata[channel], extraData);
+	}
+}
+
+/**
+ * Free the Shared object and extra data used by one of the race's channels.
+ * The channel must have stopped, or not yet have been started with them.
+ *
+ * @param servicerace The race the channel belongs to.
+ * @param channel The index of the channel to release.
+ */
+static void servicerace_release(ServiceRace * servicerace, int channel) {
+	if (servicerace->shared[channel] != NULL) {
+		shared_delete(servicerace->shared[channel]);
+		servicerace->shared[channel] = NULL;
+	}
+	if (servicerace->extradata[channel] != NULL) {
+		buffer_delete(servicerace->extradata[channel]);
+		servicerace->extradata[channel] = NULL;
+	}
+}
+
+/**
+ * Find which of the race's channels a Service is.
+ *
+ * @param servicerace The race to search.
+ * @param service The channel to look for.
+ * @return The index of the channel, or -1 if it's not part of the race.
+ */
+static int servicerace_channel_index(ServiceRace const * servicerace, Service const * service) {
+	int channel;
+	int index;
+
+	index = -1;
+	for (channel = 0; channel < SERVICERACE_CHANNELS; channel++) {
+		if (servicerace->channels[channel] == service) {
+			index = channel;
+		}
+	}
+
+	return index;
+}
+
+/**
+ * Internal callback with the state updates of each channel. The first
+ * channel to have a Pico connect wins the race and the other channel is
+ * stopped. From then on, the winner's updates are passed on as the race's
+ * own.
+ *
+ * @param service The channel whose state machine changed state.
+ * @param state The state the state machine just changed to.
+ * @param user_data The race, cast to (void *).
+ */
+static void servicerace_channel_update(Service * service, int state, void * user_data) {
+	ServiceRace * servicerace = (ServiceRace *)user_data;
+	ServiceRaceChannelStats * stats;
+	int channel;
+	int loser;
+	gint64 latency;
+
+	if ((servicerace->winner == NULL) && (state == FSMSERVICESTATE_START)) {
+		channel = servicerace_channel_index(servicerace, service);
+		latency = timesource_get_monotonic_time() - servicerace->started;
+		stats = (channel == SERVICERACE_RVP) ? & servicerace_stats.rvp : & servicerace_stats.btc;
+		stats->wins++;
+		stats->latencytotal += latency;
+		if (latency > stats->latencymax) {
+			stats->latencymax = latency;
+		}
+		LOG(LOG_INFO, "%s won the race after %" G_GINT64_FORMAT " ms", (channel == SERVICERACE_RVP) ? "Rendezvous Point" : "Bluetooth", latency / 1000);
+
+		servicerace->winner = service;
+		servicerace->service.delegate = service;
+
+		loser = (channel == SERVICERACE_RVP) ? SERVICERACE_BTC : SERVICERACE_RVP;
+		if (servicerace->stopped[loser] == FALSE) {
+			service_stop(servicerace->channels[loser]);
+		}
+	}
+
+	if ((service == servicerace->winner) && (servicerace->service.update_callback != NULL)) {
+		servicerace->service.update_callback(&servicerace->service, state, servicerace->service.update_user_data);
+	}
+}
+
+/**
+ * Internal callback called when one of the channels has stopped. Once both
+ * have stopped, so has the race.
+ *
+ * @param service The channel that stopped.
+ * @param user_data The race, cast to (void *).
+ */
+static void servicerace_channel_stopped(Service * service, void * user_data) {
+	ServiceRace * servicerace = (ServiceRace *)user_data;
+	int channel;
+
+	channel = servicerace_channel_index(servicerace, service);
+	if (channel >= 0) {
+		servicerace->stopped[channel] = TRUE;
+		if ((servicerace->winner == NULL) && (servicerace->service.stopping == FALSE)) {
+			LOG(LOG_INFO, "%s dropped out of the race", (channel == SERVICERACE_RVP) ? "Rendezvous Point" : "Bluetooth");
+		}
+	}
+
+	servicerace_stop_check(servicerace);
+}
+
+/**
+ * Check whether both channels have stopped, and if so, call the callback to
+ * signify that the race has completed and it's safe to delete it.
+ *
+ * @param servicerace The Service to check completion of.
+ * @return TRUE if the service has completed its tasks, FALSE o/w.
+ */
+static bool servicerace_stop_check(ServiceRace * servicerace) {
+	bool stopped;
+	int channel;
+
+	stopped = TRUE;
+	for (channel = 0; channel < SERVICERACE_CHANNELS; channel++) {
+		if (servicerace->stopped[channel] == FALSE) {
+			stopped = FALSE;
+		}
+	}
+
+	// The race may be stopped without ever having started
+	if ((stopped) && ((servicerace->running) || (servicerace->service.stopping))) {
+		if ((servicerace->running) && (servicerace->winner == NULL)) {
+			servicerace_stats.unfinished++;
+		}
+		servicerace->running = FALSE;
+
+		// We're ready to stop
+		if (servicerace->service.stop_callback != NULL) {
+			servicerace->service.stop_callback(&servicerace->service, servicerace->service.stop_user_data);
+		}
+		LOG(LOG_INFO, "Full stop");
+		servicerace->service.stopping = FALSE;
+	}
+	else if ((stopped == FALSE) && (servicerace->service.stopping)) {
+		LOG(LOG_INFO, "Stopping, but still waiting for a channel");
+	}
+
+	return stopped;
+}
+
+/** @} addtogroup Service */
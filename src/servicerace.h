@@ -0,0 +1,114 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Race Rendezvous Point and Bluetooth channels against each other
+ * @section DESCRIPTION
+ *
+ * Which of the Rendezvous Point and Bluetooth Classic channels is quicker to
+ * connect depends on the environment: the Rendezvous Point may be slow or
+ * unreachable on a poor network, while Bluetooth may be unavailable or out
+ * of range. Choosing one channel up front means the slower one can set the
+ * login latency.
+ *
+ * ServiceRace is a composite Service that starts both a ServiceRvp and a
+ * ServiceBtc. The QR code carries the Rendezvous Point address, while the
+ * Bluetooth beacons sent to nearby Picos carry the Bluetooth address. The
+ * first channel a Pico connects to wins: the other channel is stopped and
+ * the winner becomes the race's delegate, so the rest of the session runs
+ * over it exactly as if it had been the only channel.
+ *
+ * Since nothing about the user is known until the handshake completes, any
+ * Bluetooth device that connects before the QR code is scanned wins the
+ * race and cancels the Rendezvous Point channel.
+ *
+ * The number of races each channel wins, and the time each took to connect,
+ * are collected across all sessions, so that the better channel for a site
+ * can be identified.
+ *
+ */
+
+#ifndef __SERVICERACE_H
+#define __SERVICERACE_H (1)
+
+#include <libsoup/soup.h>
+#include "pico/fsmservice.h"
+#include "service.h"
+#include "rvpendpoints.h"
+
+// Defines
+
+// Structure definitions
+
+typedef struct _ServiceRace ServiceRace;
+
+/**
+ * @brief Counters describing how well one channel performs in races
+ *
+ *  - wins: races the channel connected first in.
+ *  - latencytotal: the sum of the times taken to connect in the races won,
+ *    in microseconds.
+ *  - latencymax: the longest time taken to connect in a race won, in
+ *    microseconds.
+ */
+typedef struct _ServiceRaceChannelStats {
+	unsigned long wins;
+	gint64 latencytotal;
+	gint64 latencymax;
+} ServiceRaceChannelStats;
+
+/**
+ * @brief Counters describing the races run
+ *
+ *  - races: races started.
+ *  - unfinished: races that ended without either channel connecting.
+ *  - rvp: the Rendezvous Point channel's results.
+ *  - btc: the Bluetooth Classic channel's results.
+ */
+typedef struct _ServiceRaceStats {
+	unsigned long races;
+	unsigned long unfinished;
+	ServiceRaceChannelStats rvp;
+	ServiceRaceChannelStats btc;
+} ServiceRaceStats;
+
+// Function prototypes
+
+ServiceRace * servicerace_new();
+void servicerace_delete(ServiceRace * servicerace);
+
+void servicerace_start(ServiceRace * servicerace, Shared * shared, Users const * users, Buffer const * extraData);
+void servicerace_stop(ServiceRace * servicerace);
+
+void servicerace_set_urlprefix(ServiceRace * servicerace, char const * urlprefix);
+void servicerace_set_endpoints(ServiceRace * servicerace, RvpEndpoints * endpoints);
+void servicerace_set_session(ServiceRace * servicerace, SoupSession * session);
+void servicerace_set_channels(ServiceRace * servicerace, Service * rvp, Service * btc);
+void servicerace_get_stats(ServiceRaceStats * stats);
+
+// Function definitions
+
+#endif
+
@@ -68,19 +68,12 @@
 #include "beaconthread.h"
 #include "service.h"
 #include "service_private.h"
+#include "timesource.h"
+#include "rvpendpoints.h"
 #include "servicervp.h"
 
 // Defines
 
-/**
- * @brief The maximum amount of data to read in a single Bluetooth read
- *
- * We create a buffer to read the data into, and this is the size the buffer
- * takes, so no more than this should be read at a time.
- *
- */
-#define INPUT_SIZE_MAX	(1024)
-
 /**
  * @brief The format to use for a Rendezvous Channel URI
  *
@@ -135,9 +128,9 @@ typedef struct _ServiceRvp {
 	Service service;
 
 	// Extend with new fields
-	char message[INPUT_SIZE_MAX];
 	SoupSession * session;
 	SoupMessage * msg;
+	SoupMessage * sidemsg;
 	Buffer * urlprefix;
 	Buffer * url;
 	bool reading;
@@ -148,6 +141,9 @@ typedef struct _ServiceRvp {
 	gint64 wallclocktimeout;
 	guint retryid;
 	int connections;
+	RvpEndpoints * endpoints;
+	gint64 requeststart;
+	bool sharedsession;
 } ServiceRvp;
 
 // Function prototypes
@@ -168,6 +164,8 @@ static bool servicervp_get_url(ServiceRvp const * servicervp, Buffer * buffer);
 
 static void servicervp_write_complete(SoupSession * session, SoupMessage * msg, gpointer user_data);
 static void servicervp_post(ServiceRvp * servicervp, Buffer const * data);
+static void servicervp_side_complete(SoupSession * session, SoupMessage * msg, gpointer user_data);
+static void servicervp_post_side(ServiceRvp * servicervp, Buffer const * data);
 static void servicervp_read_complete(SoupSession * session, SoupMessage * msg, gpointer user_data);
 static void servicervp_get(ServiceRvp * servicervp);
 
@@ -175,6 +173,7 @@ static void servicervp_wallclock_start(ServiceRvp * servicervp);
 static void servicervp_wallclock_stop(ServiceRvp * servicervp);
 static gboolean servicervp_wallclock_timeout(gpointer user_data);
 static gboolean servicervp_retry_connection(gpointer user_data);
+static void servicervp_report(ServiceRvp * servicervp, gint64 rtt, bool success);
 
 // Function definitions
 
@@ -185,6 +184,7 @@ static gboolean servicervp_retry_connection(gpointer user_data);
  */
 ServiceRvp * servicervp_new() {
 	ServiceRvp * servicervp;
+	ServiceFsmFunctions functions;
 
 	servicervp = CALLOC(sizeof(ServiceRvp), 1);
 
@@ -195,10 +195,13 @@ ServiceRvp * servicervp_new() {
 	servicervp->service.service_delete = (void*)servicervp_delete;
 	servicervp->service.service_start = (void*)servicervp_start;
 	servicervp->service.service_stop = (void*)servicervp_stop;
+	servicervp->service.service_stop_check = (void*)servicervp_stop_check;
 
 	// Initialise the extra fields
-	servicervp->session = soup_session_new_with_options(SOUP_SESSION_SSL_STRICT, TRUE, SOUP_SESSION_USER_AGENT, "Pico ", SOUP_SESSION_TIMEOUT, 60, NULL);
+	// The Soup session is only created once the service is started
+	servicervp->session = NULL;
 	servicervp->msg = NULL;
+	servicervp->sidemsg = NULL;
 	servicervp->url = buffer_new(0);
 	servicervp->urlprefix = buffer_new(0);
 	buffer_append(servicervp->urlprefix, URL_PREFIX, sizeof(URL_PREFIX) - 1);
@@ -210,9 +213,20 @@ ServiceRvp * servicervp_new() {
 	servicervp->wallclocktimeout = DEFAULT_WALLCLOCK_TIMEOUT;
 	servicervp->connections = 0;
 	servicervp->retryid = 0;
-
-	fsmservice_set_functions(servicervp->service.fsmservice, servicervp_write, servicervp_set_timeout, servicervp_error, servicervp_listen, servicervp_disconnect, servicervp_authenticated, servicervp_session_ended, servicervp_status_updated);
-	fsmservice_set_userdata(servicervp->service.fsmservice, servicervp);
+	servicervp->endpoints = NULL;
+	servicervp->requeststart = 0;
+	servicervp->sharedsession = FALSE;
+
+	functions.write = servicervp_write;
+	functions.set_timeout = servicervp_set_timeout;
+	functions.error = servicervp_error;
+	functions.listen = servicervp_listen;
+	functions.disconnect = servicervp_disconnect;
+	functions.authenticated = servicervp_authenticated;
+	functions.session_ended = servicervp_session_ended;
+	functions.status_updated = servicervp_status_updated;
+	functions.user_data = servicervp;
+	service_set_fsm_functions(& servicervp->service, & functions);
 
 	return servicervp;
 }
@@ -239,7 +253,10 @@ void servicervp_delete(ServiceRvp * servicervp) {
 		}
 
 		if (servicervp->session) {
-			soup_session_abort(servicervp->session);
+			// A shared session may still be in use by other services
+			if (servicervp->sharedsession == FALSE) {
+				soup_session_abort(servicervp->session);
+			}
 			g_object_unref(servicervp->session);
 			servicervp->session = NULL;
 		}
@@ -263,6 +280,8 @@ void servicervp_delete(ServiceRvp * servicervp) {
 			g_source_remove(servicervp->retryid);
 			servicervp->retryid = 0;
 		}
+
+		FREE(servicervp);
 	}
 }
 
@@ -319,6 +338,10 @@ void servicervp_start(ServiceRvp * servicervp, Shared * shared, Users const * us
 
 	// We can't start if we're mid-stop
 	if (servicervp->service.stopping == FALSE) {
+		if (servicervp->session == NULL) {
+			servicervp->session = soup_session_new_with_options(SOUP_SESSION_SSL_STRICT, TRUE, SOUP_SESSION_USER_AGENT, "Pico ", SOUP_SESSION_TIMEOUT, 60, NULL);
+		}
+
 		buffer_clear(servicervp->url);
 		buffer_append_buffer(servicervp->url, servicervp->urlprefix);
 		LOG(LOG_INFO, "Using Rendezvous Point")
@@ -366,12 +389,7 @@ void servicervp_start(ServiceRvp * servicervp, Shared * shared, Users const * us
 
 		if (servicervp->service.beacons) {
 			// Send Bluetooth beacons
-			beaconthread_set_code(servicervp->service.beaconthread, servicervp->service.beacon);
-			beaconthread_set_configdir(servicervp->service.beaconthread, servicervp->service.configdir);
-			beaconthread_set_finished_callback(servicervp->service.beaconthread, servicervp_beaconthread_finish, servicervp);
-
-			LOG(LOG_INFO, "Starting beacons");
-			beaconthread_start(servicervp->service.beaconthread, users);
+			service_start_beacons(&servicervp->service, users, servicervp_beaconthread_finish, servicervp);
 		}
 
 		fsmservice_start(servicervp->service.fsmservice, shared, users, extraData);
@@ -389,22 +407,15 @@ void servicervp_start(ServiceRvp * servicervp, Shared * shared, Users const * us
  * @param servicervp The Service to stop.
  */
 void servicervp_stop(ServiceRvp * servicervp) {
-	BEACONTHREADSTATE state;
-
 	LOG(LOG_DEBUG, "Requesting stop");
 	// If we're already stopping, we shouldn't interrupt the process
 	if (servicervp->service.stopping == FALSE) {
 		servicervp->service.stopping = TRUE;
 
 		// Update the state machine
-		fsmservice_stop(servicervp->service.fsmservice);
+		service_fsm_stop(& servicervp->service);
 		// Stop sending out beacons
-		// It may take some time for this to action, if there are already broadcasts in progress
-		state = beaconthread_get_state(servicervp->service.beaconthread);
-
-		if ((state > BEACONTHREADSTATE_INVALID) && (state < BEACONTHREADSTATE_HARVESTABLE)) {
-			beaconthread_stop(servicervp->service.beaconthread);
-		}
+		service_stop_beacons(&servicervp->service);
 
 		// Stop the current connection
 		// We only stop reads: if it's a write, we let it finish of its own accord
@@ -456,11 +467,11 @@ static bool servicervp_stop_check(ServiceRvp * servicervp) {
 	LOG(LOG_DEBUG, "Checking whether we're ready to stop");
 
 	stopped = FALSE;
-	state = beaconthread_get_state(servicervp->service.beaconthread);
+	state = service_get_beacon_state(&servicervp->service);
 
 	if (servicervp->service.stopping == TRUE) {
-		// Ensure we're not connected to a device
-		if ((servicervp->reading == FALSE) && (servicervp->writing == FALSE)) {
+		// Ensure we're not connected to a device or processing a message
+		if ((servicervp->reading == FALSE) && (servicervp->writing == FALSE) && (service_fsm_busy(&servicervp->service) == FALSE)) {
 			if (servicervp->connections == 0) {
 				// Ensure we're not still advertising
 				if ((state == BEACONTHREADSTATE_HARVESTABLE) || (state == BEACONTHREADSTATE_INVALID)) {
@@ -484,7 +495,7 @@ static bool servicervp_stop_check(ServiceRvp * servicervp) {
 			}
 		}
 		else {
-			LOG(LOG_INFO, "Stopping, but still %s", (servicervp->reading ? "reading" : "writing"));
+			LOG(LOG_INFO, "Stopping, but still %s", (servicervp->reading ? "reading" : (servicervp->writing ? "writing" : "processing")));
 		}
 	}
 
@@ -506,12 +517,21 @@ static void servicervp_write(char const * data, size_t length, void * user_data)
 	Buffer * message;
 
 	LOG(LOG_INFO, "Sending: %d bytes", length);
+	service_trace(&servicervp->service, SESSIONTRACEEVENT_WRITE, data, length);
 
 	message = buffer_new(0);
 	buffer_append_lengthprepend(message, data, length);
 
-	// Perform POST request
-	servicervp_post(servicervp, message);
+	// The service may write while waiting for the Pico, for example to send it
+	// a challenge, in which case the read is left open so nothing it brings
+	// back is lost
+	if ((servicervp->reading) && (servicervp->msg != NULL)) {
+		servicervp_post_side(servicervp, message);
+	}
+	else {
+		// Perform POST request
+		servicervp_post(servicervp, message);
+	}
 
 	buffer_delete(message);
 }
@@ -537,7 +557,7 @@ static void servicervp_set_timeout(int timeout, void * user_data) {
 		servicervp->service.timeoutid = 0;
 	}
 
-	servicervp->service.timeoutid = g_timeout_add(timeout, servicervp_timeout, servicervp);
+	servicervp->service.timeoutid = timesource_timeout_add(timeout, servicervp_timeout, servicervp);
 }
 
 /**
@@ -558,6 +578,9 @@ static void servicervp_error(void * user_data) {
 		soup_session_cancel_message(servicervp->session, servicervp->msg, SOUP_STATUS_CANCELLED);
 		servicervp->connected = FALSE;
 	}
+	if (servicervp->sidemsg) {
+		soup_session_cancel_message(servicervp->session, servicervp->sidemsg, SOUP_STATUS_CANCELLED);
+	}
 	servicervp_wallclock_stop(servicervp);
 
 	servicervp_stop(servicervp);
@@ -584,7 +607,8 @@ static void servicervp_disconnect(void * user_data) {
 
 	servicervp->connected = FALSE;
 
-	fsmservice_disconnected(servicervp->service.fsmservice);
+	service_trace(&servicervp->service, SESSIONTRACEEVENT_DISCONNECTED, NULL, 0);
+	service_fsm_disconnected(& servicervp->service);
 }
 
 /**
@@ -646,9 +670,13 @@ static void servicervp_session_ended(void * user_data) {
  */
 static void servicervp_status_updated(int state, void * user_data) {
 	ServiceRvp * servicervp = (ServiceRvp *)user_data;
+	char statebyte;
 
 	LOG(LOG_DEBUG, "Update, state: %d", state);
 
+	statebyte = (char)state;
+	service_trace(&servicervp->service, SESSIONTRACEEVENT_STATE, &statebyte, 1);
+
 	if (servicervp->service.update_callback != NULL) {
 		servicervp->service.update_callback(&servicervp->service, state, servicervp->service.update_user_data);
 	}
@@ -672,7 +700,8 @@ static gboolean servicervp_timeout(gpointer user_data) {
 	servicervp->service.timeoutid = 0;
 
 	LOG(LOG_DEBUG, "Calling timeout");
-	fsmservice_timeout(servicervp->service.fsmservice);
+	service_trace(&servicervp->service, SESSIONTRACEEVENT_TIMEOUT, NULL, 0);
+	service_fsm_timeout(& servicervp->service);
 
 	return FALSE;
 }
@@ -698,15 +727,20 @@ static void servicervp_read_complete(SoupSession * session, SoupMessage * msg, g
 
 	LOG(LOG_DEBUG, "Status: %d\n", msg->status_code);
 
-	servicervp_wallclock_stop(servicervp);
-
-	servicervp->reading = FALSE;
 	servicervp->connections--;
 	msgalive = servicervp->msg;
-	servicervp->msg = NULL;
+	// A cancelled read may complete after a new request has replaced it
+	if (msgalive == msg) {
+		servicervp_wallclock_stop(servicervp);
+		servicervp->reading = FALSE;
+		servicervp->msg = NULL;
+	}
 
 	success = SOUP_STATUS_IS_SUCCESSFUL(msg->status_code);
 	if (success) {
+		// Reads are held open until there's data, so give no round trip time
+		servicervp_report(servicervp, -1, TRUE);
+
 		length = msg->response_body->length;
 		data = msg->response_body->data;
 
@@ -720,7 +754,8 @@ static void servicervp_read_complete(SoupSession * session, SoupMessage * msg, g
 				servicervp_incoming_connect(servicervp);
 
 				LOG(LOG_DEBUG, "Read message size: %d\n", length);
-				fsmservice_read(servicervp->service.fsmservice, data + 4, length - 4);
+				service_trace(&servicervp->service, SESSIONTRACEEVENT_READ, data + 4, length - 4);
+				service_fsm_read(& servicervp->service, data + 4, length - 4);
 			}
 		}
 		else {
@@ -749,9 +784,10 @@ static void servicervp_read_complete(SoupSession * session, SoupMessage * msg, g
 			break;
 		default:
 			// Connection failed
+			servicervp_report(servicervp, -1, FALSE);
 			if (servicervp->retryid == 0) {
 				LOG(LOG_ERR, "Connection failure on read: try again in a second");
-				servicervp->retryid = g_timeout_add(1000.0, servicervp_retry_connection, servicervp);
+				servicervp->retryid = timesource_timeout_add(1000, servicervp_retry_connection, servicervp);
 			}
 			break;
 		}
@@ -770,11 +806,10 @@ static void servicervp_incoming_connect(ServiceRvp * servicervp) {
 
 	if (servicervp->connected == FALSE) {
 		servicervp->connected = TRUE;
-		fsmservice_connected(servicervp->service.fsmservice);
+		service_trace(&servicervp->service, SESSIONTRACEEVENT_CONNECTED, NULL, 0);
+		service_fsm_connected(& servicervp->service);
 
-		if (servicervp->service.beacons) {
-			beaconthread_stop(servicervp->service.beaconthread);
-		}
+		service_stop_beacons(&servicervp->service);
 	}
 }
 
@@ -803,6 +838,8 @@ static void servicervp_write_complete(SoupSession * session, SoupMessage * msg,
 
 	success = SOUP_STATUS_IS_SUCCESSFUL(msg->status_code);
 	if (success) {
+		servicervp_report(servicervp, timesource_get_monotonic_time() - servicervp->requeststart, TRUE);
+
 		if (servicervp->connected) {
 			servicervp_get(servicervp);
 		}
@@ -817,6 +854,7 @@ static void servicervp_write_complete(SoupSession * session, SoupMessage * msg,
 		else {
 			// Connection failed
 			LOG(LOG_ERR, "Connection failure on write");
+			servicervp_report(servicervp, -1, FALSE);
 			servicervp_stop(servicervp);
 		}
 	}
@@ -849,6 +887,8 @@ static void servicervp_post(ServiceRvp * servicervp, Buffer const * data) {
 
 		soup_message_set_request(servicervp->msg, "application/octet-stream", SOUP_MEMORY_COPY, send, length);
 
+		servicervp->requeststart = timesource_get_monotonic_time();
+
 		soup_session_queue_message(servicervp->session, servicervp->msg, servicervp_write_complete, servicervp);
 
 		servicervp_wallclock_start(servicervp);
@@ -858,6 +898,66 @@ static void servicervp_post(ServiceRvp * servicervp, Buffer const * data) {
 	}
 }
 
+/**
+ * Internal function used to make an HTTP (or HTTPS) POST request to the
+ * Rendezvous Point while a GET request is waiting for the Pico. The POST is
+ * sent as a separate request alongside the GET, which is left open so that
+ * any data the Pico sends in the meantime still arrives. Only one such write
+ * can be outstanding at a time.
+ *
+ * Once completed the servicervp_side_complete() function will be called.
+ *
+ * @param servicervp The service that should perform the write.
+ * @param data A buffer containing the data to send.
+ */
+static void servicervp_post_side(ServiceRvp * servicervp, Buffer const * data) {
+	char const * url;
+
+	if (servicervp->sidemsg == NULL) {
+		servicervp->connections++;
+		url = buffer_get_buffer(servicervp->url);
+		servicervp->sidemsg = soup_message_new("POST", url);
+		LOG(LOG_DEBUG, "Sending message size alongside read: %d", buffer_get_pos(data));
+
+		soup_message_set_request(servicervp->sidemsg, "application/octet-stream", SOUP_MEMORY_COPY, buffer_get_buffer(data), buffer_get_pos(data));
+
+		soup_session_queue_message(servicervp->session, servicervp->sidemsg, servicervp_side_complete, servicervp);
+	}
+	else {
+		LOG(LOG_ERR, "Cannot send while a write alongside a read is ongoing");
+	}
+}
+
+/**
+ * Internal callback triggered when a POST request made alongside a read has
+ * completed. Unlike servicervp_write_complete() this doesn't start a new
+ * read, since the original read is still waiting for the Pico. If the write
+ * failed, the Pico will never answer it, which is left to whatever is
+ * waiting for the answer to time out.
+ *
+ * @param session The Soup session object used to field the request..
+ * @param msg The data received (e.g. hader and body of the HTTP request).
+ * @param user_data The user data, which in this case is the ServiceRvp
+ *        structure cast to (void *).
+ */
+static void servicervp_side_complete(SoupSession * session, SoupMessage * msg, gpointer user_data) {
+	ServiceRvp * servicervp = (ServiceRvp *)user_data;
+
+	servicervp->connections--;
+	servicervp->sidemsg = NULL;
+
+	LOG(LOG_DEBUG, "Write alongside read status: %d", msg->status_code);
+
+	if (SOUP_STATUS_IS_SUCCESSFUL(msg->status_code) == FALSE) {
+		if (msg->status_code != SOUP_STATUS_CANCELLED) {
+			LOG(LOG_ERR, "Connection failure on write alongside read");
+			servicervp_report(servicervp, -1, FALSE);
+		}
+	}
+
+	servicervp_stop_check(servicervp);
+}
+
 /**
  * Internal function used to make an HTTP (or HTTPS) GET request to the
  * Rendezvous Point. This is equivalent to a read by the Service from the
@@ -907,6 +1007,49 @@ void servicervp_set_urlprefix(ServiceRvp * servicervp, char const * urlprefix) {
 	buffer_append_string(servicervp->urlprefix, urlprefix);
 }
 
+/**
+ * Set the RvpEndpoints object to report the round trip times and failures of
+ * requests to. This allows the daemon to choose the best Rendezvous Point
+ * for future sessions. The URL prefix set using servicervp_set_urlprefix()
+ * identifies the endpoint the reports are for.
+ *
+ * @param servicervp The service to set the value for.
+ * @param endpoints The object to report to, which remains owned by the
+ *        caller, or NULL to not report.
+ */
+void servicervp_set_endpoints(ServiceRvp * servicervp, RvpEndpoints * endpoints) {
+	servicervp->endpoints = endpoints;
+}
+
+/**
+ * Set the SoupSession to make requests to the Rendezvous Point with. If
+ * the session is shared with other services, any idle connections in its
+ * pool can be reused, avoiding the cost of connecting to the Rendezvous
+ * Point afresh. If no session is set, the service creates its own when
+ * it's started.
+ *
+ * This must be called before the service is started.
+ *
+ * @param servicervp The service to set the value for.
+ * @param session The session to use, or NULL for the service to create its
+ *        own.
+ */
+void servicervp_set_session(ServiceRvp * servicervp, SoupSession * session) {
+	if (servicervp->session != NULL) {
+		if (servicervp->sharedsession == FALSE) {
+			soup_session_abort(servicervp->session);
+		}
+		g_object_unref(servicervp->session);
+		servicervp->session = NULL;
+	}
+
+	servicervp->sharedsession = FALSE;
+	if (session != NULL) {
+		servicervp->session = g_object_ref(session);
+		servicervp->sharedsession = TRUE;
+	}
+}
+
 /**
  * SoupSession connection timeouts use the monotoic timer, which freezes while
  * the computer is suspended. As a result, if the computer is suspended for
@@ -949,10 +1092,10 @@ static void servicervp_wallclock_start(ServiceRvp * servicervp) {
 
 	if (servicervp->wallclocktimerid == 0) {
 		// Tick every second
-		servicervp->wallclocktimerid = g_timeout_add(1000.0, servicervp_wallclock_timeout, servicervp);
+		servicervp->wallclocktimerid = timesource_timeout_add(1000, servicervp_wallclock_timeout, servicervp);
 	}
 
-	servicervp->wallclockstart = g_get_real_time();
+	servicervp->wallclockstart = timesource_get_real_time();
 }
 
 /**
@@ -1002,13 +1145,14 @@ static gboolean servicervp_wallclock_timeout(gpointer user_data) {
 	gint64 ellapsed;
 	bool more;
 
-	timenow = g_get_real_time();
+	timenow = timesource_get_real_time();
 	ellapsed = timenow - servicervp->wallclockstart;
 	more = TRUE;
 
 	if (ellapsed >= servicervp->wallclocktimeout) {
 		if (servicervp->msg != NULL) {
 			LOG(LOG_INFO, "Wall clock timeout; cancelling request");
+			service_trace(&servicervp->service, SESSIONTRACEEVENT_TIMER, "wallclock", strlen("wallclock"));
 			soup_session_cancel_message(servicervp->session, servicervp->msg, SOUP_STATUS_IO_ERROR);
 			servicervp->wallclocktimerid = 0;
 			more = FALSE;
@@ -1040,6 +1184,8 @@ static gboolean servicervp_retry_connection(gpointer user_data) {
 	ServiceRvp * servicervp = (ServiceRvp *)user_data;
 	servicervp->retryid = 0;
 
+	service_trace(&servicervp->service, SESSIONTRACEEVENT_TIMER, "retry", strlen("retry"));
+
 	if (servicervp->service.stopping == FALSE) {
 		if (servicervp->msg == NULL) {
 			LOG(LOG_ERR, "Retry connection");
@@ -1057,5 +1203,20 @@ static gboolean servicervp_retry_connection(gpointer user_data) {
 	return FALSE;
 }
 
+/**
+ * Report the outcome of a request to the RvpEndpoints object, if one has
+ * been set using servicervp_set_endpoints().
+ *
+ * @param servicervp The service that made the request.
+ * @param rtt The round trip time of the request in microseconds, or a
+ *        negative value if it isn't known.
+ * @param success true if the request succeeded, false o/w.
+ */
+static void servicervp_report(ServiceRvp * servicervp, gint64 rtt, bool success) {
+	if (servicervp->endpoints != NULL) {
+		rvpendpoints_report(servicervp->endpoints, buffer_get_buffer(servicervp->urlprefix), rtt, success);
+	}
+}
+
 /** @} addtogroup Service */
 
@@ -45,7 +45,9 @@
 #ifndef __SERVICERVP_H
 #define __SERVICERVP_H (1)
 
+#include <libsoup/soup.h>
 #include "pico/fsmservice.h"
+#include "rvpendpoints.h"
 
 // Defines
 
@@ -62,6 +64,8 @@ void servicervp_start(ServiceRvp * servicervp, Shared * shared, Users const * us
 void servicervp_stop(ServiceRvp * servicervp);
 
 void servicervp_set_urlprefix(ServiceRvp * servicervp, char const * urlprefix);
+void servicervp_set_endpoints(ServiceRvp * servicervp, RvpEndpoints * endpoints);
+void servicervp_set_session(ServiceRvp * servicervp, SoupSession * session);
 void servicervp_set_wallclocktimeout(ServiceRvp * servicervp, gint64 wallclocktimeout);
 
 // Function definitions
@@ -0,0 +1,1155 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Provides direct LAN TCP event support to tie to FsmService
+ * @section DESCRIPTION
+ *
+ * FSMService provides only a framework of callbacks and events, but without
+ * any way of communicating. The communication channel has to be tied to it
+ * to make it work. This code provides the implementation of the callbacks to
+ * allow the state machine to work over a plain TCP connection on the local
+ * network.
+ *
+ * Unlike Bluetooth, TCP is a byte stream, so a single read may return part
+ * of a message or several messages at once. Incoming data is collected and
+ * split into messages using the four-byte length prefix before being passed
+ * to the state machine.
+ *
+ * The execution of this code is managed by AuthThread, while this code uses
+ * BeaconThread to manage the sending of beacons and FsmService from libpico
+ * to manage the authentication control flow.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <stdbool.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#include "pico/pico.h"
+#include "pico/log.h"
+#include "pico/keypair.h"
+#include "pico/fsmservice.h"
+#include "pico/keyauth.h"
+#include "pico/messagestatus.h"
+
+#include "beaconthread.h"
+#include "service.h"
+#include "service_private.h"
+#include "timesource.h"
+#include "servicetcp.h"
+
+// Defines
+
+/**
+ * @brief The maximum amount of data to read in a single TCP read
+ *
+ * We create a buffer to read the data into, and this is the size the buffer
+ * takes, so no more than this should be read at a time. The buffer is only
+ * allocated once a device connects.
+ *
+ */
+#define INPUT_SIZE_MAX	(1024)
+
+/**
+ * @brief The largest message that will be accepted from the Pico
+ *
+ * A connection that claims to be sending a longer message than this is
+ * dropped, so that a misbehaving device can't make us buffer without limit.
+ *
+ */
+#define MESSAGE_SIZE_MAX (64 * 1024)
+
+/**
+ * @brief The number of bytes used for the length prefix of each message
+ */
+#define LENGTH_PREFIX_SIZE (4)
+
+/**
+ * @brief The format to use for a TCP channel URI
+ *
+ * This is the format to use for a TCP channel URI. A string of this type is
+ * added to the QR code and/or beacon to allow other devices to authenticate
+ * to the service. It contains the host and port to connect to, followed by
+ * the random token that the Pico must send first.
+ *
+ */
+#define URL_FORMAT "tcp://%s:%d/%s"
+
+/**
+ * @brief The number of bytes to use for the random token
+ *
+ * The token is a hex representation of a random number. This define
+ * specifies the number of random bytes this number should contain.
+ *
+ */
+#define TOKEN_BYTES (16)
+
+/**
+ * @brief An address used to find the interface for the local network
+ *
+ * When no host has been set, a UDP socket is connected to this address and
+ * the local address it's given is advertised. Connecting a UDP socket sends
+ * no packets, and the address is reserved for documentation (RFC 5737), so
+ * it's only used to select the route.
+ *
+ */
+#define ROUTE_PROBE_ADDRESS "192.0.2.1"
+
+// Structure definitions
+
+/**
+ * @brief Opaque structure used for authenticating using a TCP connection
+ *
+ * This is a subclass of the Service struct, and inherits all members of
+ * Service as well as adding some more TCP-specific fields.
+ *
+ * This opaque data structure contains the persistent data associated with the
+ * authentication process.
+ *
+ * The lifecycle of this data is managed by AuthThread.
+ *
+ */
+typedef struct _ServiceTcp {
+	// Inheret from Service
+	Service service;
+
+	// Extend with new fields
+	GSocketConnection * connection;
+	GSocketService * socketservice;
+	GCancellable * cancellable;
+	char * message;
+	GByteArray * input;
+	GByteArray * output;
+	GByteArray * sending;
+	Buffer * host;
+	int port;
+	char token[(TOKEN_BYTES * 2) + 1];
+	bool verified;
+	int reads;
+	int writes;
+} ServiceTcp;
+
+// Function prototypes
+
+static int servicetcp_start_listen(ServiceTcp * servicetcp);
+static void report_error(GError ** error, char const * hint);
+static gboolean servicetcp_incoming_connect (GSocketService * socketservice, GSocketConnection * connection, GObject * source_object, gpointer user_data);
+static void servicetcp_beaconthread_finish(BeaconThread const * beaconthread, void * user_data);
+static void servicetcp_write(char const * data, size_t length, void * user_data);
+static void servicetcp_set_timeout(int timeout, void * user_data);
+static void servicetcp_error(void * user_data);
+static void servicetcp_disconnect(void * user_data);
+static void servicetcp_release(ServiceTcp * servicetcp);
+static void servicetcp_authenticated(int status, void * user_data);
+static void servicetcp_listen(void * user_data);
+static void servicetcp_session_ended(void * user_data);
+static void servicetcp_status_updated(int state, void * user_data);
+static gboolean servicetcp_timeout(gpointer user_data);
+static void servicetcp_read (GObject * source_object, GAsyncResult *res, gpointer user_data);
+static void servicetcp_read_next(ServiceTcp * servicetcp);
+static void servicetcp_write_next(ServiceTcp * servicetcp);
+static void servicetcp_write_complete(GObject * source_object, GAsyncResult * res, gpointer user_data);
+static bool servicetcp_process_input(ServiceTcp * servicetcp);
+static void servicetcp_link_lost(ServiceTcp * servicetcp);
+static bool servicetcp_stop_check(ServiceTcp * servicetcp);
+static bool servicetcp_get_host(ServiceTcp const * servicetcp, Buffer * buffer);
+static bool servicetcp_get_url(ServiceTcp const * servicetcp, Buffer * buffer);
+
+// Function definitions
+
+/**
+ * Deal with errors by outputting them to the log, then freeing
+ * and clearning the error structure.
+ *
+ * This is for internal use.
+ *
+ * @param error the error structure to check and report if it exists
+ * @param hint a human-readable hint that will be output alongside the error
+ */
+static void report_error(GError ** error, char const * hint) {
+	if (*error) {
+		LOG(LOG_ERR, "Error %s: %s", hint, (*error)->message);
+		g_error_free(*error);
+		*error = NULL;
+	}
+}
+
+/**
+ * Create a new instance of the class, which inherits from Service.
+ *
+ * @return The newly created object.
+ */
+ServiceTcp * servicetcp_new() {
+	ServiceTcp * servicetcp;
+	ServiceFsmFunctions functions;
+
+	servicetcp = CALLOC(sizeof(ServiceTcp), 1);
+
+	// Initialise the base class
+	service_init(&servicetcp->service);
+
+	// Set up the virtual functions
+	servicetcp->service.service_delete = (void*)servicetcp_delete;
+	servicetcp->service.service_start = (void*)servicetcp_start;
+	servicetcp->service.service_stop = (void*)servicetcp_stop;
+	servicetcp->service.service_stop_check = (void*)servicetcp_stop_check;
+
+	// Initialise the extra fields
+	servicetcp->connection = NULL;
+	servicetcp->socketservice = g_socket_service_new ();
+	servicetcp->cancellable = NULL;
+	// The input buffer is only allocated once a device connects
+	servicetcp->message = NULL;
+	servicetcp->input = g_byte_array_new();
+	// Data waiting to be written, and the data being written
+	servicetcp->output = g_byte_array_new();
+	servicetcp->sending = g_byte_array_new();
+	servicetcp->host = buffer_new(0);
+	servicetcp->port = 0;
+	servicetcp->token[0] = 0;
+	servicetcp->verified = FALSE;
+	servicetcp->reads = 0;
+	servicetcp->writes = 0;
+
+	functions.write = servicetcp_write;
+	functions.set_timeout = servicetcp_set_timeout;
+	functions.error = servicetcp_error;
+	functions.listen = servicetcp_listen;
+	functions.disconnect = servicetcp_disconnect;
+	functions.authenticated = servicetcp_authenticated;
+	functions.session_ended = servicetcp_session_ended;
+	functions.status_updated = servicetcp_status_updated;
+	functions.user_data = servicetcp;
+	service_set_fsm_functions(& servicetcp->service, & functions);
+
+	return servicetcp;
+}
+
+/**
+ * Delete an instance of the class, freeing up the memory allocated to it.
+ *
+ * @param servicetcp The object to free.
+ */
+void servicetcp_delete(ServiceTcp * servicetcp) {
+	if (servicetcp != NULL) {
+		service_deinit(&servicetcp->service);
+
+		if (servicetcp->connection != NULL) {
+			LOG(LOG_ERR, "Should not delete service while still connected");
+		}
+
+		if (servicetcp->reads != 0) {
+			LOG(LOG_ERR, "Should not delete service while reads are pending (%d)", servicetcp->reads);
+		}
+
+		if (servicetcp->writes != 0) {
+			LOG(LOG_ERR, "Should not delete service while writes are pending (%d)", servicetcp->writes);
+		}
+
+		if (servicetcp->socketservice != NULL) {
+			g_object_unref(servicetcp->socketservice);
+			servicetcp->socketservice = NULL;
+		}
+
+		if (servicetcp->message != NULL) {
+			FREE(servicetcp->message);
+			servicetcp->message = NULL;
+		}
+
+		if (servicetcp->input != NULL) {
+			g_byte_array_unref(servicetcp->input);
+			servicetcp->input = NULL;
+		}
+
+		if (servicetcp->output != NULL) {
+			g_byte_array_unref(servicetcp->output);
+			servicetcp->output = NULL;
+		}
+
+		if (servicetcp->sending != NULL) {
+			g_byte_array_unref(servicetcp->sending);
+			servicetcp->sending = NULL;
+		}
+
+		if (servicetcp->host != NULL) {
+			buffer_delete(servicetcp->host);
+			servicetcp->host = NULL;
+		}
+
+		FREE(servicetcp);
+	}
+}
+
+/**
+ * Get the host to advertise for the Pico to connect to. This is the host
+ * set using servicetcp_set_host() if there is one, or otherwise the local
+ * IPv4 address of the interface used to reach other networks.
+ *
+ * @param servicetcp The object to get the host for.
+ * @param buffer A buffer to store the resulting host string in.
+ * @return true if the host could be determined, false o/w.
+ */
+static bool servicetcp_get_host(ServiceTcp const * servicetcp, Buffer * buffer) {
+	GSocket * gsocket;
+	GSocketAddress * probe;
+	GSocketAddress * local;
+	GInetAddress * inetaddress;
+	gchar * address;
+	GError * error;
+	bool success;
+
+	success = FALSE;
+	error = NULL;
+
+	if (buffer_get_pos(servicetcp->host) > 0) {
+		buffer_clear(buffer);
+		buffer_append_buffer(buffer, servicetcp->host);
+		success = TRUE;
+	}
+	else {
+		gsocket = g_socket_new(G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, & error);
+		report_error(&error, "creating route probe");
+
+		if (gsocket != NULL) {
+			probe = g_inet_socket_address_new_from_string(ROUTE_PROBE_ADDRESS, 9);
+			if (g_socket_connect(gsocket, probe, NULL, & error)) {
+				local = g_socket_get_local_address(gsocket, & error);
+				if (local != NULL) {
+					inetaddress = g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(local));
+					address = g_inet_address_to_string(inetaddress);
+					buffer_clear(buffer);
+					buffer_append_string(buffer, address);
+					g_free(address);
+					g_object_unref(local);
+					success = TRUE;
+				}
+			}
+			report_error(&error, "finding local address");
+
+			g_object_unref(probe);
+			g_socket_close(gsocket, NULL);
+			g_object_unref(gsocket);
+		}
+	}
+
+	return success;
+}
+
+/**
+ * Get the URI of the TCP channel, to allow other devices to connect to
+ * it. This URI is included in the advertising beacon and QR code.
+ *
+ * @param servicetcp The object to get the URI for.
+ * @param buffer A buffer to store the resulting URI string in.
+ * @return true if the URI could be determined, false o/w.
+ */
+static bool servicetcp_get_url(ServiceTcp const * servicetcp, Buffer * buffer) {
+	Buffer * host;
+	bool success;
+
+	success = FALSE;
+
+	if (servicetcp->port != 0) {
+		host = buffer_new(0);
+		success = servicetcp_get_host(servicetcp, host);
+
+		if (success) {
+			buffer_clear(buffer);
+			buffer_sprintf(buffer, URL_FORMAT, buffer_get_buffer(host), servicetcp->port, servicetcp->token);
+		}
+
+		buffer_delete(host);
+	}
+
+	return success;
+}
+
+/**
+ * Start the service to allow Pico devices to authenticate to it. Starting opens
+ * a TCP port for listening on, then starts sending Bluetooth beacons out to
+ * potential nearby Picos. If a Pico connects and presents the token,
+ * authentication can then proceed.
+ *
+ * Care is needed with the users parameter. If this is set to NULL, any
+ * well-formed attempt to authenticate will succeed.
+ *
+ * @param servicetcp The object to use.
+ * @param shared A Shared object that contains the keys needed for
+          authentication.
+ * @param users The users that are allowed to authenticate, or NULL to
+          allow any user to authenticate.
+ * @param extraData A buffer containing any extra data to be sent to the
+ *        Pico during the authentication process.
+ */
+void servicetcp_start(ServiceTcp * servicetcp, Shared * shared, Users const * users, Buffer const * extraData) {
+	KeyAuth * keyauth;
+	Buffer * address;
+	KeyPair * serviceIdentityKey;
+	bool result;
+	size_t size;
+	int res;
+	unsigned char random[TOKEN_BYTES];
+	int count;
+
+	// We can't start if we're mid-stop
+	if (servicetcp->service.stopping == FALSE) {
+		g_signal_connect(servicetcp->socketservice, "incoming", G_CALLBACK(servicetcp_incoming_connect), (gpointer)servicetcp);
+
+		// Generate the token the Pico must present
+		servicetcp->token[0] = 0;
+		res = RAND_bytes(random, TOKEN_BYTES);
+		if (res) {
+			for (count = 0; count < TOKEN_BYTES; count++) {
+				sprintf(servicetcp->token + (count * 2), "%02x", random[count]);
+			}
+		}
+
+		// Listen for incoming connections
+		servicetcp->port = servicetcp_start_listen(servicetcp);
+		servicetcp_listen((void *)servicetcp);
+
+		address = buffer_new(0);
+		result = (res == 1) && servicetcp_get_url(servicetcp, address);
+
+		if (result) {
+			LOG(LOG_INFO, "Listening on %s", buffer_get_buffer(address));
+
+			// Get the service's long-term identity key pair
+			serviceIdentityKey = shared_get_service_identity_key(shared);
+
+			// SEND
+			// Generate a visual QR code for Key Pairing
+			// {"sn":"NAME","spk":"PUB-KEY","sig":"B64-SIG","ed":"","sa":"URL","td":{},"t":"KP"}
+			keyauth = keyauth_new();
+			keyauth_set(keyauth, address, "", NULL, serviceIdentityKey);
+
+			size = keyauth_serialize_size(keyauth);
+			servicetcp->service.beacon = CALLOC(sizeof(char), size + 1);
+			keyauth_serialize(keyauth, servicetcp->service.beacon, size + 1);
+			servicetcp->service.beacon[size] = 0;
+			keyauth_delete(keyauth);
+
+			// Prepare the QR code to be displayed to the user
+			LOG(LOG_ERR, "Pam Pico Pre Prompt");
+		}
+		else {
+			servicetcp->service.beacon = CALLOC(sizeof(char), strlen("ERROR") + 1);
+			strcpy(servicetcp->service.beacon, "ERROR");
+		}
+
+		buffer_delete(address);
+
+		if (servicetcp->service.beacons) {
+			// Send Bluetooth beacons
+			service_start_beacons(&servicetcp->service, users, servicetcp_beaconthread_finish, servicetcp);
+		}
+
+		fsmservice_start(servicetcp->service.fsmservice, shared, users, extraData);
+	}
+}
+
+/**
+ * Request that the service stops whatever it's doing and finish off. Having
+ * called this, the callback set using service_set_stop_callback() will be
+ * called -- potentially after a period of time -- to signify that the Service
+ * has indeed completed everything, tidies up, and is ready to be deleted.
+ *
+ * This call is asynchronous, hence the need for the callback.
+ *
+ * @param servicetcp The Service to stop.
+ */
+void servicetcp_stop(ServiceTcp * servicetcp) {
+	// If we're already stopping, we shouldn't interrupt the process
+	if (servicetcp->service.stopping == FALSE) {
+		servicetcp->service.stopping = TRUE;
+
+		// Update the state machine
+		service_fsm_stop(& servicetcp->service);
+		// Stop sending out beacons
+		service_stop_beacons(&servicetcp->service);
+
+		// Stop accepting new connections
+		g_socket_service_stop(servicetcp->socketservice);
+
+		// Close all listening sockets on this service
+		g_socket_listener_close(G_SOCKET_LISTENER(servicetcp->socketservice));
+
+		// Disconnect any connected devices
+		if (servicetcp->connection != NULL) {
+			servicetcp_disconnect((void *)servicetcp);
+		}
+
+		servicetcp_stop_check(servicetcp);
+	}
+}
+
+/**
+ * Set the host to advertise in the URI for the Pico to connect to. This can
+ * be a host name or an IP address. If it's not set, the local IPv4 address
+ * of the interface used to reach other networks is advertised.
+ *
+ * @param servicetcp The object to set the value for.
+ * @param host The host to advertise, or NULL or an empty string to detect
+ *        it automatically.
+ */
+void servicetcp_set_host(ServiceTcp * servicetcp, char const * host) {
+	buffer_clear(servicetcp->host);
+	if (host != NULL) {
+		buffer_append_string(servicetcp->host, host);
+	}
+}
+
+/**
+ * Set the TCP port to listen on. If this is zero, which is the default, a
+ * free port is chosen when the service starts.
+ *
+ * @param servicetcp The object to set the value for.
+ * @param port The port to listen on, or zero to choose one.
+ */
+void servicetcp_set_port(ServiceTcp * servicetcp, int port) {
+	servicetcp->port = port;
+}
+
+/**
+ * Get the TCP port the service is listening on. Once the service has
+ * started, this is the port actually being used, or zero if it couldn't
+ * listen.
+ *
+ * @param servicetcp The object to get the value from.
+ * @return The port.
+ */
+int servicetcp_get_port(ServiceTcp const * servicetcp) {
+	return servicetcp->port;
+}
+
+/**
+ * This internal callback is used to determine when the beacons have finished
+ * being sent.
+ *
+ * If both the beacons and any authentications have completed, this signifies
+ * that the Service has completed all of its tasks (and so it becomes safe to
+ * delete it).
+ *
+ * @param beaconthread The BeaconThread to monitor.
+ * @param user_data The data that's sent with the callback, which is set to
+ *        the Service data structure.
+ */
+static void servicetcp_beaconthread_finish(BeaconThread const * beaconthread, void * user_data) {
+	ServiceTcp * servicetcp = (ServiceTcp *)user_data;
+
+	LOG(LOG_INFO, "Beaconthread finished advertising");
+
+	servicetcp_stop_check(servicetcp);
+}
+
+/**
+ * The Service performs two main tasks: sending out beacons and manaaging
+ * authentications. When a caller requests the service to finish, both of these
+ * tasks must end gracefully before it safe to delete the service. This
+ * internal function checks whether both have completed, and if so, calls the
+ * callback to signify that the service has completed and it's safe to delete
+ * it.
+ *
+ * @param servicetcp The Service to check completion of.
+ * @return TRUE if the service has completed its tasks, FALSE o/w.
+ */
+static bool servicetcp_stop_check(ServiceTcp * servicetcp) {
+	bool stopped;
+	BEACONTHREADSTATE state;
+
+	stopped = FALSE;
+	state = service_get_beacon_state(&servicetcp->service);
+
+	if (servicetcp->service.stopping == TRUE) {
+		// Ensure we're not connected to a device, waiting for a read or write to finish or processing a message
+		if ((servicetcp->connection == NULL) && (servicetcp->reads == 0) && (servicetcp->writes == 0) && (service_fsm_busy(&servicetcp->service) == FALSE)) {
+			// Ensure we're not still advertising
+			if ((state == BEACONTHREADSTATE_HARVESTABLE) || (state == BEACONTHREADSTATE_INVALID)) {
+				// Clear any waiting timeout
+				if (servicetcp->service.timeoutid != 0) {
+					g_source_remove(servicetcp->service.timeoutid);
+					servicetcp->service.timeoutid = 0;
+				}
+
+				// We're ready to stop
+				if (servicetcp->service.stop_callback != NULL) {
+					servicetcp->service.stop_callback(&servicetcp->service, servicetcp->service.stop_user_data);
+				}
+				LOG(LOG_INFO, "Full stop");
+				servicetcp->service.stopping = FALSE;
+				stopped = TRUE;
+			}
+		}
+		else {
+			LOG(LOG_INFO, "Stopping, but still connected");
+		}
+	}
+
+	return stopped;
+}
+
+///////////////////////////////////////////
+
+/**
+ * Internal function provided to the FsmService to perform TCP writes. The
+ * data is queued and written asynchronously, so that a peer that stops
+ * reading can't stall the main loop.
+ *
+ * @param data The data to write on the TCP channel.
+ * @param length The length of data to write.
+ * @param user_data The user data, which in this case is the Service structure
+ *        cast to (void *).
+ */
+static void servicetcp_write(char const * data, size_t length, void * user_data) {
+	ServiceTcp * servicetcp = (ServiceTcp *)user_data;
+	Buffer * message;
+
+	LOG(LOG_INFO, "Sending: %d bytes", length);
+	service_trace(&servicetcp->service, SESSIONTRACEEVENT_WRITE, data, length);
+
+	if (servicetcp->connection != NULL) {
+		message = buffer_new(0);
+		buffer_append_lengthprepend(message, data, length);
+		g_byte_array_append(servicetcp->output, (guint8 const *)buffer_get_buffer(message), buffer_get_pos(message));
+		buffer_delete(message);
+
+		if (servicetcp->writes == 0) {
+			servicetcp_write_next(servicetcp);
+		}
+	}
+	else {
+		LOG(LOG_ERR, "Write requested while not connected");
+	}
+}
+
+/**
+ * Internal function to start an asynchronous write of everything queued
+ * for the current connection. The result is passed to
+ * servicetcp_write_complete(). Only one write is in progress at a time.
+ *
+ * @param servicetcp The service to write for.
+ */
+static void servicetcp_write_next(ServiceTcp * servicetcp) {
+	GOutputStream * output;
+
+	// The queued data is moved aside, since it must stay put until the write completes
+	g_byte_array_set_size(servicetcp->sending, 0);
+	g_byte_array_append(servicetcp->sending, servicetcp->output->data, servicetcp->output->len);
+	g_byte_array_set_size(servicetcp->output, 0);
+
+	output = g_io_stream_get_output_stream(G_IO_STREAM(servicetcp->connection));
+
+	servicetcp->writes++;
+	g_output_stream_write_all_async(output, servicetcp->sending->data, servicetcp->sending->len, G_PRIORITY_DEFAULT, servicetcp->cancellable, servicetcp_write_complete, (gpointer)servicetcp);
+}
+
+/**
+ * Internal callback triggered when an asynchronous write completes. If
+ * more data was queued in the meantime, it's written next. A failed write
+ * is left for the read side to notice, since the connection will have gone.
+ *
+ * @param source_object The object that data was written to (in this case a
+ *        TCP connection IO stream).
+ * @param res The result of the write.
+ * @param user_data The user data, which in this case is the Service structure
+ *        cast to (void *).
+ */
+static void servicetcp_write_complete(GObject * source_object, GAsyncResult * res, gpointer user_data) {
+	ServiceTcp * servicetcp = (ServiceTcp *)user_data;
+	GError * error;
+	GOutputStream * output;
+	bool current;
+
+	error = NULL;
+
+	servicetcp->writes--;
+	output = G_OUTPUT_STREAM(source_object);
+
+	g_output_stream_write_all_finish(output, res, NULL, &error);
+	report_error(&error, "sending");
+
+	// The write may complete after its connection has been released
+	current = (servicetcp->connection != NULL) && (output == g_io_stream_get_output_stream(G_IO_STREAM(servicetcp->connection)));
+
+	if (current == FALSE) {
+		servicetcp_stop_check(servicetcp);
+	}
+	else if (servicetcp->output->len > 0) {
+		servicetcp_write_next(servicetcp);
+	}
+}
+
+/**
+ * Internal function provided to the FsmService to request timeouts to be set.
+ *
+ * Any new timeout will override any previous timeout that has yet to trigger.
+ * In other words, only one timeout (the latest) can be in operation at a time.
+ *
+ * @param timeout The time, in milliseconds, before the timeout should trigger.
+ * @param user_data The user data, which in this case is the Service structure
+ *        cast to (void *).
+ */
+static void servicetcp_set_timeout(int timeout, void * user_data) {
+	ServiceTcp * servicetcp = (ServiceTcp *)user_data;
+
+	LOG(LOG_DEBUG, "Requesting timeout of %d", timeout);
+
+	// Remove any previous timeout
+	if (servicetcp->service.timeoutid != 0) {
+		g_source_remove(servicetcp->service.timeoutid);
+		servicetcp->service.timeoutid = 0;
+	}
+
+	servicetcp->service.timeoutid = timesource_timeout_add(timeout, servicetcp_timeout, servicetcp);
+}
+
+/**
+ * Internal function provided to the FsmService that will be called if a
+ * state machine error occurs. For example, this may be triggered if the Pico
+ * disconnects unexpectedly mid-authentication.
+ *
+ * @param user_data The user data, which in this case is the Service structure
+ *        cast to (void *).
+ */
+static void servicetcp_error(void * user_data) {
+	ServiceTcp * servicetcp = (ServiceTcp *)user_data;
+
+	LOG(LOG_DEBUG, "Error");
+
+	servicetcp_stop(servicetcp);
+}
+
+/**
+ * Internal function provided to the FsmService to request the connected
+ * device be disconnected.
+ *
+ * @param user_data The user data, which in this case is the Service structure
+ *        cast to (void *).
+ */
+static void servicetcp_disconnect(void * user_data) {
+	ServiceTcp * servicetcp = (ServiceTcp *)user_data;
+	FSMSERVICESTATE state;
+	bool verified;
+
+	LOG(LOG_DEBUG, "Disconnect");
+
+	if (servicetcp->connection) {
+		verified = servicetcp->verified;
+		servicetcp_release(servicetcp);
+
+		g_socket_service_stop(servicetcp->socketservice);
+
+		state = service_fsm_get_state(& servicetcp->service);
+
+		// The state machine only knows about connections that presented the token
+		if (verified && (state > FSMSERVICESTATE_INVALID) && (state < FSMSERVICESTATE_FIN)) {
+			service_trace(&servicetcp->service, SESSIONTRACEEVENT_DISCONNECTED, NULL, 0);
+			service_fsm_disconnected(& servicetcp->service);
+		}
+	}
+}
+
+/**
+ * Internal function to close and release the current TCP connection,
+ * without notifying the state machine. Any read or write in progress on the
+ * connection is cancelled, and any data collected from it or queued for it
+ * is discarded.
+ *
+ * @param servicetcp The service to release the connection for.
+ */
+static void servicetcp_release(ServiceTcp * servicetcp) {
+	GError * error;
+
+	error = NULL;
+
+	if (servicetcp->cancellable != NULL) {
+		g_cancellable_cancel(servicetcp->cancellable);
+		g_object_unref(servicetcp->cancellable);
+		servicetcp->cancellable = NULL;
+	}
+
+	g_io_stream_close(G_IO_STREAM(servicetcp->connection), NULL, & error);
+	report_error(&error, "disconnecting");
+	g_object_unref(servicetcp->connection);
+	servicetcp->connection = NULL;
+
+	g_byte_array_set_size(servicetcp->input, 0);
+	g_byte_array_set_size(servicetcp->output, 0);
+	servicetcp->verified = FALSE;
+}
+
+/**
+ * Internal function provided to the FsmService to request that the service
+ * listen for incoming TCP connections.
+ *
+ * @param user_data The user data, which in this case is the Service structure
+ *        cast to (void *).
+ */
+static void servicetcp_listen(void * user_data) {
+	ServiceTcp * servicetcp = (ServiceTcp *)user_data;
+
+	LOG(LOG_DEBUG, "Listen");
+
+	g_socket_service_start(servicetcp->socketservice);
+}
+
+/**
+ * Internal function provided to the FsmService that the state machine will
+ * call to indicate the authentication completed.
+ *
+ * @param user_data The user data, which in this case is the Service structure
+ *        cast to (void *).
+ */
+static void servicetcp_authenticated(int status, void * user_data) {
+	ServiceTcp * servicetcp = (ServiceTcp *)user_data;
+
+	LOG(LOG_DEBUG, "Authenticated");
+
+	// If we're not continuously authentication, or authentication failed, we're done
+	if (status != MESSAGESTATUS_OK_CONTINUE) {
+		servicetcp_stop(servicetcp);
+	}
+}
+
+/**
+ * Internal function provided to the FsmService that will be called to indicate
+ * that the continuous authentication session has ended. The most likely cause
+ * is that the Pico disconnected.
+ *
+ * @param user_data The user data, which in this case is the Service structure
+ *        cast to (void *).
+ */
+static void servicetcp_session_ended(void * user_data) {
+	ServiceTcp * servicetcp = (ServiceTcp *)user_data;
+
+	LOG(LOG_DEBUG, "Session ended");
+
+	servicetcp_stop(servicetcp);
+}
+
+/**
+ * Internal function provided to the FsmService that will be called every time
+ * the FSM changes stage.
+ *
+ * @param state The new state that the FSM has just moved to.
+ * @param user_data The user data, which in this case is the Service structure
+ *        cast to (void *).
+ */
+static void servicetcp_status_updated(int state, void * user_data) {
+	ServiceTcp * servicetcp = (ServiceTcp *)user_data;
+	char statebyte;
+
+	LOG(LOG_DEBUG, "Update, state: %d", state);
+
+	statebyte = (char)state;
+	service_trace(&servicetcp->service, SESSIONTRACEEVENT_STATE, &statebyte, 1);
+
+	if (servicetcp->service.update_callback != NULL) {
+		servicetcp->service.update_callback(&servicetcp->service, state, servicetcp->service.update_user_data);
+	}
+}
+
+///////////////////////////////////////////
+
+
+/**
+ * Internal callback triggered when a timeout, that will have been requested by
+ * the FSM,.occurs. The action of this function should be to let the FSM know
+ * that the timeout occured.
+ *
+ * @param user_data The user data, which in this case is the Service structure
+ *        cast to (void *).
+ */
+static gboolean servicetcp_timeout(gpointer user_data) {
+	ServiceTcp * servicetcp = (ServiceTcp *)user_data;
+
+	// This timeout fires only once
+	servicetcp->service.timeoutid = 0;
+
+	LOG(LOG_DEBUG, "Calling timeout");
+	service_trace(&servicetcp->service, SESSIONTRACEEVENT_TIMEOUT, NULL, 0);
+	service_fsm_timeout(& servicetcp->service);
+
+	return FALSE;
+}
+
+/**
+ * Internal function to start an asynchronous read on the current
+ * connection. The result is passed to servicetcp_read().
+ *
+ * @param servicetcp The service to read for.
+ */
+static void servicetcp_read_next(ServiceTcp * servicetcp) {
+	GInputStream * input;
+
+	input = g_io_stream_get_input_stream(G_IO_STREAM(servicetcp->connection));
+
+	servicetcp->reads++;
+	g_input_stream_read_async (input, servicetcp->message, INPUT_SIZE_MAX, G_PRIORITY_DEFAULT, servicetcp->cancellable, servicetcp_read, (gpointer)servicetcp);
+}
+
+/**
+ * Internal callback triggered when there's available data to read on the
+ * TCP channel. The data is added to any already collected, and any complete
+ * messages are passed on to the FSM.
+ *
+ * @param source_object The object that data was read on (in this case a
+ *        TCP connection IO stream).
+ * @param res The result of the read.
+ * @param user_data The user data, which in this case is the Service structure
+ *        cast to (void *).
+ */
+static void servicetcp_read(GObject * source_object, GAsyncResult *res, gpointer user_data) {
+	ServiceTcp * servicetcp = (ServiceTcp *)user_data;
+	gssize count;
+	GError * error;
+	GInputStream * input;
+	bool current;
+	bool keep;
+
+	LOG(LOG_DEBUG, "Incoming data");
+	error = NULL;
+
+	servicetcp->reads--;
+	input = G_INPUT_STREAM (source_object);
+
+	count = g_input_stream_read_finish(input, res, & error);
+	report_error(&error, "reading message");
+
+	// The read may complete after its connection has been released
+	current = (servicetcp->connection != NULL) && (input == g_io_stream_get_input_stream(G_IO_STREAM(servicetcp->connection)));
+
+	if (current == FALSE) {
+		servicetcp_stop_check(servicetcp);
+	}
+	else if (count > 0) {
+		LOG(LOG_DEBUG, "Read %d bytes", count);
+
+		g_byte_array_append(servicetcp->input, (guint8 *)servicetcp->message, count);
+		keep = servicetcp_process_input(servicetcp);
+
+		if (keep == FALSE) {
+			if (servicetcp->verified) {
+				LOG(LOG_INFO, "Dropping connection after invalid message");
+				servicetcp_disconnect((void *)servicetcp);
+			}
+			else {
+				LOG(LOG_INFO, "Dropping connection that didn't present the token");
+				servicetcp_release(servicetcp);
+			}
+			servicetcp_stop_check(servicetcp);
+		}
+		else if (servicetcp->connection != NULL) {
+			// The state machine may have disconnected while processing
+			servicetcp_read_next(servicetcp);
+		}
+	}
+	else if (servicetcp->service.stopping == FALSE) {
+		servicetcp_link_lost(servicetcp);
+	}
+	else {
+		servicetcp_release(servicetcp);
+		servicetcp_stop_check(servicetcp);
+	}
+}
+
+/**
+ * Internal function to split the data collected from the connection into
+ * messages using their length prefixes. The first message on a connection
+ * must be the token; subsequent messages are passed on to the FSM. Any
+ * incomplete message is left until more data arrives.
+ *
+ * @param servicetcp The service to process the input for.
+ * @return false if the connection should be dropped, true o/w.
+ */
+static bool servicetcp_process_input(ServiceTcp * servicetcp) {
+	guint8 const * data;
+	size_t length;
+	bool keep;
+	bool complete;
+
+	keep = TRUE;
+	complete = TRUE;
+
+	while (keep && complete && (servicetcp->connection != NULL)) {
+		complete = FALSE;
+		if (servicetcp->input->len >= LENGTH_PREFIX_SIZE) {
+			data = servicetcp->input->data;
+			// The prefix matches buffer_append_lengthprepend(): big-endian
+			length = ((size_t)data[0] << 24) | ((size_t)data[1] << 16) | ((size_t)data[2] << 8) | (size_t)data[3];
+
+			if (length > MESSAGE_SIZE_MAX) {
+				LOG(LOG_ERR, "Message too long: %lu bytes", length);
+				keep = FALSE;
+			}
+			else if (servicetcp->input->len >= (LENGTH_PREFIX_SIZE + length)) {
+				complete = TRUE;
+				data += LENGTH_PREFIX_SIZE;
+
+				if (servicetcp->verified) {
+					service_trace(&servicetcp->service, SESSIONTRACEEVENT_READ, (char const *)data, length);
+					service_fsm_read(& servicetcp->service, (char const *)data, length);
+				}
+				else if ((length == strlen(servicetcp->token)) && (length > 0) && (CRYPTO_memcmp(data, servicetcp->token, length) == 0)) {
+					LOG(LOG_DEBUG, "Token accepted");
+					servicetcp->verified = TRUE;
+					service_trace(&servicetcp->service, SESSIONTRACEEVENT_CONNECTED, NULL, 0);
+					service_fsm_connected(& servicetcp->service);
+
+					service_stop_beacons(&servicetcp->service);
+				}
+				else {
+					keep = FALSE;
+				}
+
+				// The connection may have been released by the state machine
+				if (servicetcp->connection != NULL) {
+					g_byte_array_remove_range(servicetcp->input, 0, LENGTH_PREFIX_SIZE + length);
+				}
+			}
+		}
+	}
+
+	return keep;
+}
+
+/**
+ * Internal function called when the connection closes without the state
+ * machine asking for it. A connection that never presented the token is
+ * just dropped. Otherwise, if the session can be resumed, the dead link is
+ * dropped and the service waits for the Pico to reconnect; if not, the
+ * state machine is told of the disconnection.
+ *
+ * @param servicetcp The service whose connection closed.
+ */
+static void servicetcp_link_lost(ServiceTcp * servicetcp) {
+	LOG(LOG_DEBUG, "Link lost");
+
+	if (servicetcp->verified == FALSE) {
+		servicetcp_release(servicetcp);
+	}
+	else if (service_link_lost(& servicetcp->service)) {
+		// Drop the dead link and wait for the Pico to reconnect to resume
+		service_trace(&servicetcp->service, SESSIONTRACEEVENT_DISCONNECTED, NULL, 0);
+		servicetcp_release(servicetcp);
+		g_socket_service_start(servicetcp->socketservice);
+	}
+	else {
+		servicetcp_disconnect((void *)servicetcp);
+	}
+}
+
+/**
+ * Internal callback triggered when a device connects to the listening TCP
+ * port. The connection isn't passed to the FSM until it's presented the
+ * token. While a connection is waiting to present the token, a new
+ * connection replaces it, so that a stray connection can't block the Pico.
+ *
+ * @param socketservice The listening service.
+ * @param connection The connection that's just been made.
+ * @param source_object The object that requested to listen for incoming
+ *        connections.
+ * @param user_data The user data, which in this case is the Service structure
+ *        cast to (void *).
+ */
+static gboolean servicetcp_incoming_connect(GSocketService * socketservice, GSocketConnection * connection, GObject * source_object, gpointer user_data) {
+	ServiceTcp * servicetcp = (ServiceTcp *)user_data;
+
+	LOG(LOG_DEBUG, "Incoming connection");
+
+	if ((servicetcp->connection != NULL) && servicetcp->verified) {
+		// Only one Pico at a time; the connection is closed when we return
+		LOG(LOG_INFO, "Rejecting connection while already connected");
+	}
+	else {
+		if (servicetcp->connection != NULL) {
+			LOG(LOG_INFO, "Replacing connection that hasn't presented the token");
+			servicetcp_release(servicetcp);
+		}
+
+		servicetcp->connection = g_object_ref(connection);
+		servicetcp->cancellable = g_cancellable_new();
+		g_socket_set_option(g_socket_connection_get_socket(connection), IPPROTO_TCP, TCP_NODELAY, 1, NULL);
+
+		if (servicetcp->message == NULL) {
+			servicetcp->message = MALLOC(INPUT_SIZE_MAX);
+		}
+
+		servicetcp_read_next(servicetcp);
+	}
+
+	return FALSE;
+}
+
+/**
+ * Internal function that sets up a TCP port to listen for incoming
+ * connections on, on all interfaces.
+ *
+ * @param servicetcp The service that should listen for incoming connections.
+ * @return The port being listened on, or zero if listening failed.
+ */
+static int servicetcp_start_listen(ServiceTcp * servicetcp) {
+	GError * error;
+	bool result;
+	int port;
+
+	error = NULL;
+
+	if (servicetcp->port != 0) {
+		port = servicetcp->port;
+		result = g_socket_listener_add_inet_port(G_SOCKET_LISTENER(servicetcp->socketservice), port, NULL, & error);
+	}
+	else {
+		port = g_socket_listener_add_any_inet_port(G_SOCKET_LISTENER(servicetcp->socketservice), NULL, & error);
+		result = (port != 0);
+	}
+	report_error(&error, "listening");
+
+	if (!result) {
+		LOG(LOG_ERR, "Errors listening for connection");
+		port = 0;
+	}
+
+	LOG(LOG_DEBUG, "Listening on port: %d", port);
+
+	return port;
+}
+
+/** @} addtogroup Service */
+
@@ -0,0 +1,75 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Provides direct LAN TCP event support to tie to FsmService
+ * @section DESCRIPTION
+ *
+ * FSMService provides only a framework of callbacks and events, but without
+ * any way of communicating. The communication channel has to be tied to it
+ * to make it work. This code provides the implementation of the callbacks to
+ * allow the state machine to work over a plain TCP connection.
+ *
+ * The service listens on a local TCP port and advertises a URI of the form
+ * tcp://host:port/token in the QR code and beacons. A Pico on the same
+ * network connects directly, avoiding the round trip to a Rendezvous Point
+ * on the internet for every protocol step. The first message the Pico sends
+ * must be the random token from the URI, so that other devices on the
+ * network can't interfere with the session; after that, messages are
+ * framed in the same length-prepended way as for the other channels.
+ *
+ * The execution of this code is managed by AuthThread, while this code uses
+ * BeaconThread to manage the sending of beacons and FsmService from libpico
+ * to manage the authentication control flow.
+ *
+ */
+
+#ifndef __SERVICETCP_H
+#define __SERVICETCP_H (1)
+
+#include "pico/fsmservice.h"
+
+// Defines
+
+// Structure definitions
+
+typedef struct _ServiceTcp ServiceTcp;
+
+// Function prototypes
+
+ServiceTcp * servicetcp_new();
+void servicetcp_delete(ServiceTcp * servicetcp);
+
+void servicetcp_start(ServiceTcp * servicetcp, Shared * shared, Users const * users, Buffer const * extraData);
+void servicetcp_stop(ServiceTcp * servicetcp);
+
+void servicetcp_set_host(ServiceTcp * servicetcp, char const * host);
+void servicetcp_set_port(ServiceTcp * servicetcp, int port);
+int servicetcp_get_port(ServiceTcp const * servicetcp);
+
+// Function definitions
+
+#endif
+
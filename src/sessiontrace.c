@@ -0,0 +1,385 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Record and replay traces of authentication sessions
+ * @section DESCRIPTION
+ *
+ * To allow slow or failed authentications to be analysed offline, the
+ * service can record a trace of each session: the frames sent and received
+ * on the channel, the timeouts that fire and the dbus calls made. Each event
+ * is stored alongside the time it occurred, so the timing of the session
+ * can later be inspected, and the handshake replayed using the
+ * pico-replay-handshake tool with either the original or compressed timing.
+ *
+ * See sessiontrace.h for details of the file format.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "pico/debug.h"
+
+#include "log.h"
+#include "timesource.h"
+#include "sessiontrace.h"
+
+// Defines
+
+/**
+ * @brief The maximum number of bytes used to encode a 64-bit LEB128 value
+ */
+#define SESSIONTRACE_LEB128_MAX (10)
+
+// Structure definitions
+
+/**
+ * @brief Opaque structure used for recording or replaying a session trace
+ *
+ * The structure wraps a file that's either being written to (when recording)
+ * or read from (when replaying), along with the time of the last event
+ * recorded, so that each record need only store the time difference.
+ *
+ * When recording, the lifecycle of this data is managed by AuthThread.
+ *
+ */
+struct _SessionTrace {
+	FILE * file;
+	bool writing;
+	gint64 last;
+};
+
+// Function prototypes
+
+static void sessiontrace_write_leb128(SessionTrace * sessiontrace, guint64 value);
+static bool sessiontrace_read_leb128(SessionTrace * sessiontrace, guint64 * value);
+
+// Function definitions
+
+/**
+ * Create a new instance of the class.
+ *
+ * @return The newly created object.
+ */
+SessionTrace * sessiontrace_new() {
+	SessionTrace * sessiontrace;
+
+	sessiontrace = CALLOC(sizeof(SessionTrace), 1);
+
+	sessiontrace->file = NULL;
+	sessiontrace->writing = FALSE;
+	sessiontrace->last = 0;
+
+	return sessiontrace;
+}
+
+/**
+ * Delete an instance of the class, freeing up the memory allocated to it.
+ * If the trace file is still open, it will be closed.
+ *
+ * @param sessiontrace The object to free.
+ */
+void sessiontrace_delete(SessionTrace * sessiontrace) {
+	if (sessiontrace) {
+		sessiontrace_close(sessiontrace);
+
+		FREE(sessiontrace);
+	}
+}
+
+/**
+ * Open a file to record a trace into. The file is created so that only the
+ * owner can read it. If the file already exists, or is a symbolic link,
+ * this fails rather than write through it, since traces are written by a
+ * privileged process.
+ *
+ * @param sessiontrace The object to record with.
+ * @param filename The file to record the trace into.
+ * @return TRUE if the file was opened successfully, FALSE o/w.
+ */
+bool sessiontrace_open_write(SessionTrace * sessiontrace, char const * filename) {
+	int fd;
+	bool result;
+
+	sessiontrace_close(sessiontrace);
+
+	result = FALSE;
+	fd = open(filename, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd >= 0) {
+		sessiontrace->file = fdopen(fd, "wb");
+		if (sessiontrace->file != NULL) {
+			fwrite(SESSIONTRACE_MAGIC, 1, strlen(SESSIONTRACE_MAGIC), sessiontrace->file);
+			sessiontrace->writing = TRUE;
+			sessiontrace->last = timesource_get_monotonic_time();
+			result = TRUE;
+		}
+		else {
+			close(fd);
+		}
+	}
+
+	if (result == FALSE) {
+		LOG(LOG_ERR, "Failed to open session trace for writing: %s", filename);
+	}
+
+	return result;
+}
+
+/**
+ * Open a previously recorded trace file for reading. The records can then
+ * be read in order using sessiontrace_read().
+ *
+ * @param sessiontrace The object to replay with.
+ * @param filename The file to read the trace from.
+ * @return TRUE if the file was opened and is a valid trace, FALSE o/w.
+ */
+bool sessiontrace_open_read(SessionTrace * sessiontrace, char const * filename) {
+	char magic[sizeof(SESSIONTRACE_MAGIC)];
+	size_t read;
+	bool result;
+
+	sessiontrace_close(sessiontrace);
+
+	result = FALSE;
+	sessiontrace->file = fopen(filename, "rb");
+	if (sessiontrace->file != NULL) {
+		read = fread(magic, 1, strlen(SESSIONTRACE_MAGIC), sessiontrace->file);
+		if ((read == strlen(SESSIONTRACE_MAGIC)) && (memcmp(magic, SESSIONTRACE_MAGIC, read) == 0)) {
+			sessiontrace->writing = FALSE;
+			result = TRUE;
+		}
+		else {
+			LOG(LOG_ERR, "Not a session trace file: %s", filename);
+			sessiontrace_close(sessiontrace);
+		}
+	}
+	else {
+		LOG(LOG_ERR, "Failed to open session trace for reading: %s", filename);
+	}
+
+	return result;
+}
+
+/**
+ * Close the trace file, flushing any events that have been recorded. If no
+ * file is open, this does nothing.
+ *
+ * @param sessiontrace The object to close the file for.
+ */
+void sessiontrace_close(SessionTrace * sessiontrace) {
+	if (sessiontrace->file != NULL) {
+		fclose(sessiontrace->file);
+		sessiontrace->file = NULL;
+	}
+	sessiontrace->writing = FALSE;
+}
+
+/**
+ * Record an event in the trace, timestamped with the current time. If the
+ * trace isn't open for writing, this does nothing, so it's safe to call even
+ * if tracing is turned off.
+ *
+ * @param sessiontrace The object to record the event with, or NULL.
+ * @param event The type of event to record.
+ * @param data The data associated with the event, or NULL.
+ * @param length The length of the data.
+ */
+void sessiontrace_record(SessionTrace * sessiontrace, SESSIONTRACEEVENT event, char const * data, size_t length) {
+	gint64 now;
+	unsigned char type;
+
+	if ((sessiontrace != NULL) && (sessiontrace->writing)) {
+		now = timesource_get_monotonic_time();
+		type = (unsigned char)event;
+
+		fwrite(& type, 1, 1, sessiontrace->file);
+		sessiontrace_write_leb128(sessiontrace, (guint64)(now - sessiontrace->last));
+		sessiontrace_write_leb128(sessiontrace, (guint64)((data != NULL) ? length : 0));
+		if ((data != NULL) && (length > 0)) {
+			fwrite(data, 1, length, sessiontrace->file);
+		}
+
+		sessiontrace->last = now;
+	}
+}
+
+/**
+ * Record an event in the trace with a string as its data. The terminating
+ * null character isn't stored.
+ *
+ * @param sessiontrace The object to record the event with, or NULL.
+ * @param event The type of event to record.
+ * @param string The null-terminated string to store with the event.
+ */
+void sessiontrace_record_string(SessionTrace * sessiontrace, SESSIONTRACEEVENT event, char const * string) {
+	sessiontrace_record(sessiontrace, event, string, (string != NULL) ? strlen(string) : 0);
+}
+
+/**
+ * Read the next event from a trace that's been opened for reading.
+ *
+ * @param sessiontrace The object to read the event from.
+ * @param event Returns the type of event read.
+ * @param delta Returns the time in microseconds since the previous event.
+ * @param data A buffer to store the data associated with the event in. Any
+ *        existing contents will be cleared.
+ * @return TRUE if an event was read, FALSE if the end of the file was reached
+ *         or the file is malformed. A record with more than
+ *         SESSIONTRACE_MAX_RECORD bytes of data counts as malformed.
+ */
+bool sessiontrace_read(SessionTrace * sessiontrace, SESSIONTRACEEVENT * event, gint64 * delta, Buffer * data) {
+	int type;
+	guint64 time;
+	guint64 length;
+	size_t read;
+	bool result;
+
+	result = FALSE;
+	buffer_clear(data);
+
+	if ((sessiontrace->file != NULL) && (sessiontrace->writing == FALSE)) {
+		type = fgetc(sessiontrace->file);
+		if ((type != EOF) && (type < SESSIONTRACEEVENT_NUM)) {
+			result = sessiontrace_read_leb128(sessiontrace, & time);
+			if (result) {
+				result = sessiontrace_read_leb128(sessiontrace, & length);
+			}
+			if (result && (length > SESSIONTRACE_MAX_RECORD)) {
+				LOG(LOG_ERR, "Session trace record is too long");
+				result = FALSE;
+			}
+			if (result && (length > 0)) {
+				buffer_set_min_size(data, length + 1);
+				read = fread(buffer_get_buffer(data), 1, length, sessiontrace->file);
+				buffer_set_pos(data, read);
+				result = (read == length);
+			}
+			if (result) {
+				*event = (SESSIONTRACEEVENT)type;
+				*delta = (gint64)time;
+			}
+			else {
+				LOG(LOG_ERR, "Session trace is truncated");
+			}
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Get a human-readable name for an event type.
+ *
+ * @param event The event type to get the name of.
+ * @return The name of the event type.
+ */
+char const * sessiontrace_event_name(SESSIONTRACEEVENT event) {
+	static char const * const names[SESSIONTRACEEVENT_NUM] = {
+		"start",
+		"connected",
+		"read",
+		"write",
+		"timeout",
+		"timer",
+		"disconnected",
+		"dbus",
+		"state"
+	};
+	char const * name;
+
+	name = "invalid";
+	if ((event > SESSIONTRACEEVENT_INVALID) && (event < SESSIONTRACEEVENT_NUM)) {
+		name = names[event];
+	}
+
+	return name;
+}
+
+/**
+ * Internal function to write an unsigned value to the trace file using a
+ * LEB128 variable-length encoding. Small values, which are the common case,
+ * take a single byte.
+ *
+ * @param sessiontrace The object to write the value with.
+ * @param value The value to write.
+ */
+static void sessiontrace_write_leb128(SessionTrace * sessiontrace, guint64 value) {
+	unsigned char bytes[SESSIONTRACE_LEB128_MAX];
+	size_t size;
+
+	size = 0;
+	do {
+		bytes[size] = value & 0x7f;
+		value >>= 7;
+		if (value != 0) {
+			bytes[size] |= 0x80;
+		}
+		size++;
+	} while (value != 0);
+
+	fwrite(bytes, 1, size, sessiontrace->file);
+}
+
+/**
+ * Internal function to read an unsigned LEB128-encoded value from the trace
+ * file.
+ *
+ * @param sessiontrace The object to read the value with.
+ * @param value Returns the value read.
+ * @return TRUE if the value was read successfully, FALSE o/w.
+ */
+static bool sessiontrace_read_leb128(SessionTrace * sessiontrace, guint64 * value) {
+	int byte;
+	int shift;
+	bool more;
+
+	*value = 0;
+	shift = 0;
+	more = TRUE;
+	while (more && (shift < (SESSIONTRACE_LEB128_MAX * 7))) {
+		byte = fgetc(sessiontrace->file);
+		if (byte == EOF) {
+			shift = SESSIONTRACE_LEB128_MAX * 7;
+		}
+		else {
+			*value |= ((guint64)(byte & 0x7f)) << shift;
+			more = ((byte & 0x80) != 0);
+			shift += 7;
+		}
+	}
+
+	return (more == FALSE);
+}
+
+/** @} addtogroup Service */
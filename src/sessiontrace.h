@@ -0,0 +1,138 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Record and replay traces of authentication sessions
+ * @section DESCRIPTION
+ *
+ * To allow slow or failed authentications to be analysed offline, the
+ * service can record a trace of each session: the frames sent and received
+ * on the channel, the timeouts that fire and the dbus calls made. Each event
+ * is stored alongside the time it occurred, so the timing of the session
+ * can later be inspected, and the handshake replayed using the
+ * pico-replay-handshake tool with either the original or compressed timing.
+ *
+ * Traces are stored in a compact binary format. The file starts with the
+ * SESSIONTRACE_MAGIC string, followed by a sequence of records. Each record
+ * comprises a one byte event type, the time since the previous record in
+ * microseconds and the length of the data, both encoded as unsigned LEB128
+ * variable-length integers, followed by the data itself.
+ *
+ * Note that traces contain the (encrypted) protocol frames, so should be
+ * treated as sensitive. They're created readable only by their owner, and
+ * never written through a symbolic link or over an existing file.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#ifndef __SESSIONTRACE_H
+#define __SESSIONTRACE_H (1)
+
+#include <stdbool.h>
+#include <glib.h>
+#include "pico/buffer.h"
+
+// Defines
+
+/**
+ * @brief The string that identifies a session trace file
+ *
+ * The last character identifies the version of the format.
+ */
+#define SESSIONTRACE_MAGIC "PICOTRC1"
+
+/**
+ * @brief The longest data a record read from a trace can have, in bytes
+ *
+ * Protocol frames are far smaller than this. The limit stops a corrupt or
+ * malicious trace from causing a huge allocation when it's read.
+ */
+#define SESSIONTRACE_MAX_RECORD (1024 * 1024)
+
+// Structure definitions
+
+/**
+ * @brief The types of event that can be recorded in a session trace
+ *
+ *  - SESSIONTRACEEVENT_START: The service started; the data is a single byte
+ *    set to 1 for a continuous session, 0 o/w.
+ *  - SESSIONTRACEEVENT_CONNECTED: A device connected to the channel.
+ *  - SESSIONTRACEEVENT_READ: A frame was received on the channel.
+ *  - SESSIONTRACEEVENT_WRITE: A frame was sent on the channel.
+ *  - SESSIONTRACEEVENT_TIMEOUT: A timeout requested by the state machine
+ *    fired.
+ *  - SESSIONTRACEEVENT_TIMER: Some other timer fired; the data is the name of
+ *    the timer.
+ *  - SESSIONTRACEEVENT_DISCONNECTED: The device disconnected.
+ *  - SESSIONTRACEEVENT_DBUS: A dbus method was called or replied to; the data
+ *    is the name of the method, plus any non-secret details.
+ *  - SESSIONTRACEEVENT_STATE: The state machine changed state; the data is
+ *    the new state as a single byte.
+ *
+ */
+typedef enum _SESSIONTRACEEVENT {
+	SESSIONTRACEEVENT_INVALID = -1,
+
+	SESSIONTRACEEVENT_START,
+	SESSIONTRACEEVENT_CONNECTED,
+	SESSIONTRACEEVENT_READ,
+	SESSIONTRACEEVENT_WRITE,
+	SESSIONTRACEEVENT_TIMEOUT,
+	SESSIONTRACEEVENT_TIMER,
+	SESSIONTRACEEVENT_DISCONNECTED,
+	SESSIONTRACEEVENT_DBUS,
+	SESSIONTRACEEVENT_STATE,
+
+	SESSIONTRACEEVENT_NUM
+} SESSIONTRACEEVENT;
+
+/**
+ * The internal structure can be found in sessiontrace.c
+ */
+typedef struct _SessionTrace SessionTrace;
+
+// Function prototypes
+
+SessionTrace * sessiontrace_new();
+void sessiontrace_delete(SessionTrace * sessiontrace);
+
+bool sessiontrace_open_write(SessionTrace * sessiontrace, char const * filename);
+bool sessiontrace_open_read(SessionTrace * sessiontrace, char const * filename);
+void sessiontrace_close(SessionTrace * sessiontrace);
+
+void sessiontrace_record(SessionTrace * sessiontrace, SESSIONTRACEEVENT event, char const * data, size_t length);
+void sessiontrace_record_string(SessionTrace * sessiontrace, SESSIONTRACEEVENT event, char const * string);
+bool sessiontrace_read(SessionTrace * sessiontrace, SESSIONTRACEEVENT * event, gint64 * delta, Buffer * data);
+
+char const * sessiontrace_event_name(SESSIONTRACEEVENT event);
+
+// Function definitions
+
+#endif
+
+/** @} addtogroup Service */
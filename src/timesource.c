@@ -0,0 +1,343 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Timeouts that can be driven by either a real or virtual clock
+ * @section DESCRIPTION
+ *
+ * Much of the service's behaviour is driven by timeouts: the authentication
+ * timeout, the timeouts requested by the state machine, the Rendezvous Point
+ * wall clock and retries, and the gaps between beacons. Rather than calling
+ * g_timeout_add() directly, these timeouts are created using
+ * timesource_timeout_add(), which attaches a custom GSource to the default
+ * GMainContext.
+ *
+ * Ordinarily the GSource uses the system clock, so behaves in the same way as
+ * g_timeout_add(). However, the clock can be switched to a virtual clock
+ * using timesource_set_virtual(). Virtual time only moves forwards when
+ * timesource_advance() is called, at which point any timeouts that would have
+ * triggered in the intervening period are dispatched in order. This allows
+ * tests to run scenarios lasting hours in a matter of milliseconds.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <glib.h>
+
+#include "timesource.h"
+
+// Defines
+
+// Structure definitions
+
+/**
+ * @brief A GSource that triggers after a timeout measured by the TimeSource
+ * clock
+ *
+ * This is equivalent to the GSource created by g_timeout_add(), except that
+ * the time is read using timesource_get_monotonic_time(), so may be virtual.
+ *
+ * The lifecycle of this data is managed by GLib.
+ *
+ */
+typedef struct _TimeSource {
+	GSource source;
+	gint64 expiry;
+	guint interval;
+} TimeSource;
+
+// Function prototypes
+
+static gboolean timesource_prepare(GSource * source, gint * timeout);
+static gboolean timesource_check(GSource * source);
+static gboolean timesource_dispatch(GSource * source, GSourceFunc callback, gpointer user_data);
+static void timesource_finalize(GSource * source);
+static bool timesource_next_expiry(gint64 * expiry);
+
+// Local variables
+
+/**
+ * @brief Whether the virtual clock is in use
+ */
+static bool virtualclock = FALSE;
+
+/**
+ * @brief The current virtual time in microseconds
+ */
+static gint64 virtualtime = 0;
+
+/**
+ * @brief All of the TimeSources that are currently active
+ *
+ * These are needed to find the next timeout to trigger when advancing
+ * virtual time.
+ */
+static GList * timesources = NULL;
+
+/**
+ * @brief The functions that allow TimeSource to act as a GSource
+ */
+static GSourceFuncs timesourcefuncs = {
+	timesource_prepare,
+	timesource_check,
+	timesource_dispatch,
+	timesource_finalize
+};
+
+// Function definitions
+
+/**
+ * Set a function to be called at regular intervals, using the TimeSource
+ * clock. This is a direct replacement for g_timeout_add() and the same
+ * semantics apply: the function will be called repeatedly until it returns
+ * FALSE, at which point the timeout is destroyed.
+ *
+ * The source is attached to the default GMainContext.
+ *
+ * @param interval The time between calls to the function, in milliseconds.
+ * @param function The function to call.
+ * @param data The data to pass to the function.
+ * @return The id of the GSource, which can be passed to g_source_remove().
+ */
+guint timesource_timeout_add(guint interval, GSourceFunc function, gpointer data) {
+	GSource * source;
+	TimeSource * timesource;
+	guint id;
+
+	source = g_source_new(& timesourcefuncs, sizeof(TimeSource));
+	timesource = (TimeSource *)source;
+	timesource->interval = interval;
+	timesource->expiry = timesource_get_monotonic_time() + (interval * (gint64)1000);
+
+	timesources = g_list_prepend(timesources, timesource);
+
+	g_source_set_callback(source, function, data, NULL);
+	id = g_source_attach(source, NULL);
+	g_source_unref(source);
+
+	return id;
+}
+
+/**
+ * Get the current monotonic time. If the virtual clock is in use this
+ * will return the virtual time, otherwise it's equivalent to
+ * g_get_monotonic_time().
+ *
+ * @return The monotonic time in microseconds.
+ */
+gint64 timesource_get_monotonic_time() {
+	return (virtualclock ? virtualtime : g_get_monotonic_time());
+}
+
+/**
+ * Get the current wall clock time. If the virtual clock is in use this
+ * will return the virtual time, otherwise it's equivalent to
+ * g_get_real_time().
+ *
+ * @return The wall clock time in microseconds.
+ */
+gint64 timesource_get_real_time() {
+	return (virtualclock ? virtualtime : g_get_real_time());
+}
+
+/**
+ * Switch between using the virtual clock and the system clock. This should
+ * be set before any timeouts are added, since existing timeouts will not be
+ * adjusted to the new clock.
+ *
+ * @param virtual TRUE to use the virtual clock, FALSE to use the system
+ *        clock.
+ */
+void timesource_set_virtual(bool virtual) {
+	virtualclock = virtual;
+}
+
+/**
+ * Get whether the virtual clock is in use.
+ *
+ * @return TRUE if the virtual clock is in use, FALSE o/w.
+ */
+bool timesource_get_virtual() {
+	return virtualclock;
+}
+
+/**
+ * Advance the virtual clock. Any timeouts that trigger during the interval
+ * will be dispatched in order, with the virtual time set to the time each
+ * was due to trigger. Any other pending events on the default GMainContext
+ * will also be dispatched.
+ *
+ * If the system clock is in use, this does nothing.
+ *
+ * @param interval The time to advance the clock by, in microseconds.
+ */
+void timesource_advance(gint64 interval) {
+	gint64 target;
+	gint64 next;
+	bool found;
+
+	if (virtualclock) {
+		target = virtualtime + interval;
+
+		found = timesource_next_expiry(& next);
+		while (found && (next <= target)) {
+			if (next > virtualtime) {
+				virtualtime = next;
+			}
+			while (g_main_context_iteration(NULL, FALSE)) {
+				// Dispatch everything that's ready
+			}
+			found = timesource_next_expiry(& next);
+		}
+
+		virtualtime = target;
+		while (g_main_context_iteration(NULL, FALSE)) {
+			// Dispatch everything that's ready
+		}
+	}
+}
+
+/**
+ * Find the time at which the next TimeSource is due to trigger.
+ *
+ * @param expiry Returns the time the next TimeSource is due to trigger.
+ * @return TRUE if there are any active TimeSources, FALSE o/w.
+ */
+static bool timesource_next_expiry(gint64 * expiry) {
+	GList * item;
+	TimeSource * timesource;
+	bool found;
+
+	found = FALSE;
+	for (item = timesources; item != NULL; item = item->next) {
+		timesource = (TimeSource *)item->data;
+		if (g_source_is_destroyed(& timesource->source) == FALSE) {
+			if ((found == FALSE) || (timesource->expiry < *expiry)) {
+				*expiry = timesource->expiry;
+				found = TRUE;
+			}
+		}
+	}
+
+	return found;
+}
+
+/**
+ * Internal GSource callback used to determine whether the source is ready
+ * and, if not, how long the GMainContext should wait before checking again.
+ *
+ * When the virtual clock is in use, the context doesn't need to wake up,
+ * since time only moves forward when timesource_advance() is called.
+ *
+ * @param source The TimeSource to check.
+ * @param timeout Returns the time in milliseconds until the source is ready.
+ * @return TRUE if the source is ready to be dispatched, FALSE o/w.
+ */
+static gboolean timesource_prepare(GSource * source, gint * timeout) {
+	TimeSource * timesource = (TimeSource *)source;
+	gint64 now;
+	gboolean ready;
+
+	now = timesource_get_monotonic_time();
+	ready = (now >= timesource->expiry);
+
+	if (ready) {
+		*timeout = 0;
+	}
+	else if (virtualclock) {
+		*timeout = -1;
+	}
+	else {
+		*timeout = (gint)(((timesource->expiry - now) + 999) / 1000);
+	}
+
+	return ready;
+}
+
+/**
+ * Internal GSource callback used to determine whether the source is ready
+ * to be dispatched.
+ *
+ * @param source The TimeSource to check.
+ * @return TRUE if the source is ready to be dispatched, FALSE o/w.
+ */
+static gboolean timesource_check(GSource * source) {
+	TimeSource * timesource = (TimeSource *)source;
+
+	return (timesource_get_monotonic_time() >= timesource->expiry);
+}
+
+/**
+ * Internal GSource callback used to call the function associated with the
+ * source. If the function returns TRUE, the source is scheduled to trigger
+ * again after the interval.
+ *
+ * With the virtual clock, the next expiry is measured from when the source
+ * was due rather than when it was dispatched, so that repeating timeouts
+ * don't drift when the clock is advanced by a long interval.
+ *
+ * @param source The TimeSource to dispatch.
+ * @param callback The function to call.
+ * @param user_data The data to pass to the function.
+ * @return TRUE if the source should continue, FALSE if it should be
+ *         destroyed.
+ */
+static gboolean timesource_dispatch(GSource * source, GSourceFunc callback, gpointer user_data) {
+	TimeSource * timesource = (TimeSource *)source;
+	gboolean again;
+
+	again = FALSE;
+	if (callback != NULL) {
+		again = callback(user_data);
+	}
+
+	if (again) {
+		if (virtualclock) {
+			timesource->expiry += (timesource->interval * (gint64)1000);
+		}
+		else {
+			timesource->expiry = timesource_get_monotonic_time() + (timesource->interval * (gint64)1000);
+		}
+	}
+
+	return again;
+}
+
+/**
+ * Internal GSource callback called when the source is about to be freed.
+ *
+ * @param source The TimeSource being freed.
+ */
+static void timesource_finalize(GSource * source) {
+	timesources = g_list_remove(timesources, source);
+}
+
+/** @} addtogroup Service */
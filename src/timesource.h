@@ -0,0 +1,77 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Timeouts that can be driven by either a real or virtual clock
+ * @section DESCRIPTION
+ *
+ * Much of the service's behaviour is driven by timeouts: the authentication
+ * timeout, the timeouts requested by the state machine, the Rendezvous Point
+ * wall clock and retries, and the gaps between beacons. Rather than calling
+ * g_timeout_add() directly, these timeouts are created using
+ * timesource_timeout_add(), which attaches a custom GSource to the default
+ * GMainContext.
+ *
+ * Ordinarily the GSource uses the system clock, so behaves in the same way as
+ * g_timeout_add(). However, the clock can be switched to a virtual clock
+ * using timesource_set_virtual(). Virtual time only moves forwards when
+ * timesource_advance() is called, at which point any timeouts that would have
+ * triggered in the intervening period are dispatched in order. This allows
+ * tests to run scenarios lasting hours in a matter of milliseconds.
+ *
+ * The sources returned are standard GSource ids, so can be removed using
+ * g_source_remove() as usual.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#ifndef __TIMESOURCE_H
+#define __TIMESOURCE_H (1)
+
+#include <stdbool.h>
+#include <glib.h>
+
+// Defines
+
+// Structure definitions
+
+// Function prototypes
+
+guint timesource_timeout_add(guint interval, GSourceFunc function, gpointer data);
+gint64 timesource_get_monotonic_time();
+gint64 timesource_get_real_time();
+
+void timesource_set_virtual(bool virtual);
+bool timesource_get_virtual();
+void timesource_advance(gint64 interval);
+
+// Function definitions
+
+#endif
+
+/** @} addtogroup Service */
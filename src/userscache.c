@@ -0,0 +1,372 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Long-lived cache of paired users
+ * @section DESCRIPTION
+ *
+ * Holds a UsersJournal for each configuration directory, refreshing it
+ * incrementally for each session and compacting it on a background thread.
+ *
+ * See userscache.h for more details.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include "pico/debug.h"
+
+#include "log.h"
+#include "usersjournal.h"
+#include "userscache.h"
+
+// Defines
+
+/**
+ * @brief The maximum number of configuration directories to hold users for
+ *
+ * The configuration directory is chosen by the dbus caller, so the number
+ * of journals held has to be limited. The least recently used journal is
+ * dropped to make space.
+ */
+#define USERSCACHE_MAX_ENTRIES (4)
+
+/**
+ * @brief The only configuration directory whose journal is compacted
+ *
+ * Compaction runs as root and replaces files in the directory, so isn't
+ * done in directories chosen by the dbus caller. This matches the default
+ * configuration directory in authconfig.c. Journals elsewhere are compacted
+ * by pico-pair, which already writes to the directory when pairing.
+ */
+#define USERSCACHE_SYSTEM_CONFIGDIR "/etc/pam-pico/"
+
+// Structure definitions
+
+/**
+ * @brief The journal for a single configuration directory
+ *
+ * The time the entry was last used, on the monotonic clock, decides which
+ * entry is dropped when the cache is full.
+ */
+typedef struct _UsersCacheEntry {
+	UsersJournal * usersjournal;
+	gint64 used;
+} UsersCacheEntry;
+
+/**
+ * @brief Opaque structure used for managing the cache
+ *
+ * The journals table maps configuration directory paths to UsersCacheEntry
+ * structures. The compacting flag is set while the compaction thread is
+ * running, and cleared by the thread when it finishes.
+ *
+ * The lifecycle of this data is managed by pico-continuous.
+ *
+ */
+struct _UsersCache {
+	GHashTable * journals;
+	GThread * compactor;
+	gint compacting;
+};
+
+/**
+ * @brief The work handed to the compaction thread
+ */
+typedef struct _UsersCacheCompaction {
+	UsersCache * userscache;
+	UsersJournal * usersjournal;
+} UsersCacheCompaction;
+
+// Function prototypes
+
+static void userscache_entry_delete(gpointer data);
+static void userscache_evict(UsersCache * userscache);
+static UsersJournal * userscache_get_journal(UsersCache * userscache, Buffer const * configdir);
+static void userscache_compact(UsersCache * userscache, Buffer const * configdir);
+static gpointer userscache_compact_thread(gpointer user_data);
+
+// Function definitions
+
+/**
+ * Create a new instance of the class. Users are only loaded when they're
+ * first requested.
+ *
+ * @return The newly created object.
+ */
+UsersCache * userscache_new() {
+	UsersCache * userscache;
+
+	userscache = CALLOC(sizeof(UsersCache), 1);
+
+	userscache->journals = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, userscache_entry_delete);
+	userscache->compactor = NULL;
+	userscache->compacting = 0;
+
+	return userscache;
+}
+
+/**
+ * Delete an instance of the class, freeing up the memory allocated to it.
+ * If a compaction is in progress this waits for it to finish.
+ *
+ * @param userscache The object to free.
+ */
+void userscache_delete(UsersCache * userscache) {
+	if (userscache) {
+		if (userscache->compactor != NULL) {
+			g_thread_join(userscache->compactor);
+			userscache->compactor = NULL;
+		}
+
+		g_hash_table_destroy(userscache->journals);
+		userscache->journals = NULL;
+
+		FREE(userscache);
+	}
+}
+
+/**
+ * Get the users paired with a configuration directory. When a username is
+ * given, only that user's entries are copied from the cached list, which
+ * avoids reading the users file again. Otherwise the full list is loaded
+ * afresh, since there's no cheap way to copy the whole cached list.
+ *
+ * If enough journal records have built up, a compaction is started in the
+ * background.
+ *
+ * @param userscache The cache to get the users from.
+ * @param configdir The directory containing the users files.
+ * @param username The user to get the entries for, or NULL for all users.
+ * @param users A list, owned by the caller, to add the users to.
+ * @return The result of loading the users file.
+ */
+USERFILE userscache_get(UsersCache * userscache, Buffer const * configdir, char const * username, Users * users) {
+	UsersJournal * usersjournal;
+	USERFILE result;
+
+	usersjournal = userscache_get_journal(userscache, configdir);
+
+	// Refreshing also finds out whether the journal needs compacting
+	result = usersjournal_refresh(usersjournal);
+	if (username != NULL) {
+		users_filter_by_name(usersjournal_get_users(usersjournal), username, users);
+	}
+	else {
+		result = usersjournal_load(usersjournal, users);
+	}
+
+	if ((usersjournal_get_pending(usersjournal) >= USERSCACHE_COMPACT_THRESHOLD) || (usersjournal_get_devices(usersjournal) > 0) || usersjournal_get_interrupted(usersjournal)) {
+		userscache_compact(userscache, configdir);
+	}
+
+	return result;
+}
+
+/**
+ * Get the Bluetooth devices paired with a configuration directory that
+ * haven't yet been compacted into its device file. The journal isn't
+ * refreshed, so this should follow a call to userscache_get() for the same
+ * directory.
+ *
+ * @param userscache The cache to get the devices from.
+ * @param configdir The directory containing the users files.
+ * @param devices A list, owned by the caller, to prepend copies of the
+ *        device addresses to.
+ */
+void userscache_get_devices(UsersCache * userscache, Buffer const * configdir, GSList ** devices) {
+	UsersJournal * usersjournal;
+	GSList const * address;
+
+	usersjournal = userscache_get_journal(userscache, configdir);
+
+	for (address = usersjournal_get_device_list(usersjournal); address != NULL; address = address->next) {
+		*devices = g_slist_prepend(*devices, g_strdup(address->data));
+	}
+}
+
+/**
+ * Add a newly paired user, and optionally their Pico's Bluetooth device, to
+ * a configuration directory. The records are appended to the journal, and
+ * the cached list is refreshed straight away so that the user can
+ * authenticate, and be sent beacons, in the next session.
+ *
+ * @param userscache The cache to add the user to.
+ * @param configdir The directory containing the users files.
+ * @param name The name of the user.
+ * @param publickey The identity public key of the user's Pico.
+ * @param symmetrickey The symmetric key shared with the user's Pico.
+ * @param address The Bluetooth address of the user's Pico, or NULL if
+ *        there isn't one.
+ * @return true if the user was written to the journal, false o/w.
+ */
+bool userscache_add(UsersCache * userscache, Buffer const * configdir, char const * name, EC_KEY * publickey, Buffer const * symmetrickey, char const * address) {
+	UsersJournal * usersjournal;
+	bool result;
+
+	usersjournal = userscache_get_journal(userscache, configdir);
+
+	result = usersjournal_append_user(usersjournal, name, publickey, symmetrickey);
+	if (result && (address != NULL)) {
+		result = usersjournal_append_device(usersjournal, address);
+	}
+
+	usersjournal_refresh(usersjournal);
+
+	// Keep the device file up to date for sessions without the cache
+	if ((address != NULL) || (usersjournal_get_pending(usersjournal) >= USERSCACHE_COMPACT_THRESHOLD)) {
+		userscache_compact(userscache, configdir);
+	}
+
+	return result;
+}
+
+/**
+ * Free an entry in the cache. Used as the value destroy function of the
+ * journals table.
+ *
+ * @param data The UsersCacheEntry to free.
+ */
+static void userscache_entry_delete(gpointer data) {
+	UsersCacheEntry * entry = (UsersCacheEntry *)data;
+
+	usersjournal_delete(entry->usersjournal);
+	FREE(entry);
+}
+
+/**
+ * Drop the least recently used journal from the cache. A compaction in
+ * progress has its own journal object, so isn't affected.
+ *
+ * @param userscache The cache to drop the journal from.
+ */
+static void userscache_evict(UsersCache * userscache) {
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+	gpointer oldest;
+	gint64 used;
+
+	oldest = NULL;
+	used = G_MAXINT64;
+	g_hash_table_iter_init(& iter, userscache->journals);
+	while (g_hash_table_iter_next(& iter, & key, & value)) {
+		if (((UsersCacheEntry *)value)->used < used) {
+			used = ((UsersCacheEntry *)value)->used;
+			oldest = key;
+		}
+	}
+
+	if (oldest != NULL) {
+		LOG(LOG_INFO, "Dropping paired users for %s", (char *)oldest);
+		g_hash_table_remove(userscache->journals, oldest);
+	}
+}
+
+/**
+ * Get the journal for a configuration directory, creating it if this is the
+ * first time the directory has been used, or it's been dropped since.
+ *
+ * @param userscache The cache holding the journals.
+ * @param configdir The directory containing the users files.
+ * @return The journal, which remains owned by the cache.
+ */
+static UsersJournal * userscache_get_journal(UsersCache * userscache, Buffer const * configdir) {
+	UsersCacheEntry * entry;
+
+	entry = g_hash_table_lookup(userscache->journals, buffer_get_buffer(configdir));
+	if (entry == NULL) {
+		if (g_hash_table_size(userscache->journals) >= USERSCACHE_MAX_ENTRIES) {
+			userscache_evict(userscache);
+		}
+		entry = CALLOC(sizeof(UsersCacheEntry), 1);
+		entry->usersjournal = usersjournal_new();
+		usersjournal_set_configdir(entry->usersjournal, buffer_get_buffer(configdir));
+		g_hash_table_insert(userscache->journals, g_strdup(buffer_get_buffer(configdir)), entry);
+		LOG(LOG_INFO, "Loading paired users for %s", buffer_get_buffer(configdir));
+	}
+	entry->used = g_get_monotonic_time();
+
+	return entry->usersjournal;
+}
+
+/**
+ * Start compacting the journal for a configuration directory on a
+ * background thread, unless a compaction is already running. Only the
+ * system configuration directory is compacted; the journals in any other
+ * directory are compacted by pico-pair.
+ *
+ * @param userscache The cache holding the journal.
+ * @param configdir The directory containing the journal.
+ */
+static void userscache_compact(UsersCache * userscache, Buffer const * configdir) {
+	UsersCacheCompaction * compaction;
+
+	if (strcmp(buffer_get_buffer(configdir), USERSCACHE_SYSTEM_CONFIGDIR) != 0) {
+		LOG(LOG_DEBUG, "Not compacting users journal outside %s", USERSCACHE_SYSTEM_CONFIGDIR);
+	}
+	else if (g_atomic_int_compare_and_exchange(& userscache->compacting, 0, 1)) {
+		if (userscache->compactor != NULL) {
+			g_thread_join(userscache->compactor);
+			userscache->compactor = NULL;
+		}
+
+		// The thread has its own journal object, since this one isn't thread safe
+		compaction = CALLOC(sizeof(UsersCacheCompaction), 1);
+		compaction->userscache = userscache;
+		compaction->usersjournal = usersjournal_new();
+		usersjournal_set_configdir(compaction->usersjournal, buffer_get_buffer(configdir));
+
+		userscache->compactor = g_thread_new("userscompact", userscache_compact_thread, compaction);
+	}
+}
+
+/**
+ * The entry point of the compaction thread.
+ *
+ * @param user_data The UsersCacheCompaction to perform, cast to (void *).
+ * @return Always NULL.
+ */
+static gpointer userscache_compact_thread(gpointer user_data) {
+	UsersCacheCompaction * compaction = (UsersCacheCompaction *)user_data;
+
+	usersjournal_compact(compaction->usersjournal);
+	g_atomic_int_set(& compaction->userscache->compacting, 0);
+
+	usersjournal_delete(compaction->usersjournal);
+	FREE(compaction);
+
+	return NULL;
+}
+
+/** @} addtogroup Service */
+
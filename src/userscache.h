@@ -0,0 +1,91 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Long-lived cache of paired users
+ * @section DESCRIPTION
+ *
+ * Paired users are recorded in the users file plus an append-only journal
+ * (see usersjournal.h). Reading the whole users file for every session
+ * takes time proportional to the number of users paired with the machine,
+ * which dominates session start-up once there are many of them.
+ *
+ * UsersCache keeps a UsersJournal for each of the last few configuration
+ * directories used, so that each session only needs to read the journal
+ * records appended since the last one. Bluetooth devices paired since the
+ * last compaction are picked up from the journal in the same way, so that
+ * beacons are sent to them straight away. When enough records have built
+ * up, or a new Bluetooth device has been paired, the journal in the system
+ * configuration directory is compacted into the users and device files on a
+ * background thread. Only one compaction runs at a time, and sessions
+ * continue to use the cached users while it does. Journals in other
+ * directories are compacted by pico-pair when it appends to them.
+ *
+ * Users paired by the service itself are added through the cache, so they
+ * can authenticate straight away.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#ifndef __USERSCACHE_H
+#define __USERSCACHE_H (1)
+
+#include <stdbool.h>
+#include <glib.h>
+#include <openssl/ec.h>
+#include "pico/buffer.h"
+#include "pico/users.h"
+
+// Defines
+
+/**
+ * @brief The number of journal records that triggers a compaction
+ */
+#define USERSCACHE_COMPACT_THRESHOLD (128)
+
+// Structure definitions
+
+/**
+ * The internal structure can be found in userscache.c
+ */
+typedef struct _UsersCache UsersCache;
+
+// Function prototypes
+
+UsersCache * userscache_new();
+void userscache_delete(UsersCache * userscache);
+USERFILE userscache_get(UsersCache * userscache, Buffer const * configdir, char const * username, Users * users);
+void userscache_get_devices(UsersCache * userscache, Buffer const * configdir, GSList ** devices);
+bool userscache_add(UsersCache * userscache, Buffer const * configdir, char const * name, EC_KEY * publickey, Buffer const * symmetrickey, char const * address);
+
+// Function definitions
+
+#endif
+
+/** @} addtogroup Service */
+
@@ -0,0 +1,1115 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Append-only journal of paired users and Bluetooth devices
+ * @section DESCRIPTION
+ *
+ * Appends user and device records to a checksummed journal, reads the
+ * journal incrementally alongside the users file, and compacts the journal
+ * into the users and Bluetooth device files.
+ *
+ * See usersjournal.h for more details.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <picobt/bt.h>
+#include <picobt/devicelist.h>
+#include "pico/debug.h"
+#include "pico/buffer.h"
+#include "pico/base64.h"
+#include "pico/json.h"
+#include "pico/users.h"
+#include "pico/cryptosupport.h"
+
+#include "log.h"
+#include "usersjournal.h"
+
+// Defines
+
+/**
+ * @brief The users file the journal is compacted into
+ */
+#define USERSJOURNAL_USERS_FILE "users.txt"
+
+/**
+ * @brief The Bluetooth device file the journal is compacted into
+ */
+#define USERSJOURNAL_DEVICES_FILE "bluetooth.txt"
+
+/**
+ * @brief The lock file used to keep compaction apart from readers and
+ * writers
+ */
+#define USERSJOURNAL_LOCK_FILE "users.lock"
+
+/**
+ * @brief The suffix added to files while they're being replaced
+ */
+#define USERSJOURNAL_TEMP_SUFFIX ".new"
+
+/**
+ * @brief The name the journal is moved to once its records have been
+ * written to the new users and Bluetooth device files
+ *
+ * The presence of this file means a compaction was committed but the new
+ * files may not all have been moved into place yet.
+ */
+#define USERSJOURNAL_FOLDED_FILE USERS_JOURNAL_FILE ".folded"
+
+/**
+ * @brief The number of hex digits of the SHA-256 digest used as each
+ * record's checksum
+ */
+#define USERSJOURNAL_CHECKSUM_LENGTH (16)
+
+/**
+ * @brief The size of the chunks the journal is read in
+ */
+#define USERSJOURNAL_READ_SIZE (4096)
+
+// Structure definitions
+
+/**
+ * @brief The types of record the journal can hold
+ */
+typedef enum _USERSJOURNALRECORD {
+	USERSJOURNALRECORD_INVALID = -1,
+
+	USERSJOURNALRECORD_USER,
+	USERSJOURNALRECORD_DEVICE,
+
+	USERSJOURNALRECORD_NUM
+} USERSJOURNALRECORD;
+
+/**
+ * @brief Opaque structure used for reading and writing the journal
+ *
+ * The users list holds the contents of the users file plus the journal
+ * records read so far, which end at offset. The addresses of the devices in
+ * the journal records read so far are held alongside them, most recent
+ * first. The identities of the two files are recorded so that a reload can
+ * be triggered if either is replaced. The queue holds formatted records
+ * waiting for usersjournal_commit().
+ *
+ */
+struct _UsersJournal {
+	Buffer * configdir;
+	Users * users;
+	bool loaded;
+	dev_t device;
+	ino_t inode;
+	off_t offset;
+	ino_t usersinode;
+	struct timespec usersmodified;
+	int pending;
+	int devices;
+	GSList * addresses;
+	bool interrupted;
+	Buffer * queue;
+};
+
+// Function prototypes
+
+static void usersjournal_path(UsersJournal const * usersjournal, char const * leaf, Buffer * path);
+static int usersjournal_lock(UsersJournal const * usersjournal, int operation);
+static void usersjournal_unlock(int lockfd);
+static bool usersjournal_format_user(char const * name, EC_KEY * publickey, Buffer const * symmetrickey, Buffer * lines);
+static void usersjournal_format_device(char const * address, Buffer * lines);
+static void usersjournal_format(Json * json, Buffer * lines);
+static bool usersjournal_write(UsersJournal const * usersjournal, Buffer const * lines, int operation);
+static void usersjournal_checksum(char const * data, size_t length, char * checksum);
+static USERSJOURNALRECORD usersjournal_read_record(char const * line, size_t length, Users * users, GSList ** devices);
+static off_t usersjournal_read(int fd, off_t offset, Users * users, GSList ** devices, int * pending, int * devicecount);
+static bool usersjournal_prepare_devices(UsersJournal const * usersjournal, GSList * devices);
+static int usersjournal_create_temp(Buffer const * path);
+static bool usersjournal_seal(int fd, Buffer const * path);
+static bool usersjournal_sync_dir(UsersJournal const * usersjournal);
+static bool usersjournal_recover(UsersJournal const * usersjournal);
+
+// Function definitions
+
+/**
+ * Create a new instance of the class. The configuration directory should be
+ * set before it's used.
+ *
+ * @return The newly created object.
+ */
+UsersJournal * usersjournal_new() {
+	UsersJournal * usersjournal;
+
+	usersjournal = CALLOC(sizeof(UsersJournal), 1);
+
+	usersjournal->configdir = buffer_new(0);
+	usersjournal->users = users_new();
+	usersjournal->loaded = FALSE;
+	usersjournal->device = 0;
+	usersjournal->inode = 0;
+	usersjournal->offset = 0;
+	usersjournal->usersinode = 0;
+	usersjournal->usersmodified.tv_sec = 0;
+	usersjournal->usersmodified.tv_nsec = 0;
+	usersjournal->pending = 0;
+	usersjournal->devices = 0;
+	usersjournal->addresses = NULL;
+	usersjournal->interrupted = FALSE;
+	usersjournal->queue = buffer_new(0);
+
+	return usersjournal;
+}
+
+/**
+ * Delete an instance of the class, freeing up the memory allocated to it.
+ *
+ * @param usersjournal The object to free.
+ */
+void usersjournal_delete(UsersJournal * usersjournal) {
+	if (usersjournal) {
+		buffer_delete(usersjournal->configdir);
+		usersjournal->configdir = NULL;
+
+		users_delete(usersjournal->users);
+		usersjournal->users = NULL;
+
+		g_slist_free_full(usersjournal->addresses, g_free);
+		usersjournal->addresses = NULL;
+
+		buffer_delete(usersjournal->queue);
+		usersjournal->queue = NULL;
+
+		FREE(usersjournal);
+	}
+}
+
+/**
+ * Set the configuration directory containing the journal and the files it's
+ * compacted into. The path should include a trailing slash. This should
+ * only be set once, before the object is used.
+ *
+ * @param usersjournal The object to set the value for.
+ * @param configdir The configuration directory.
+ */
+void usersjournal_set_configdir(UsersJournal * usersjournal, char const * configdir) {
+	buffer_clear(usersjournal->configdir);
+	buffer_append_string(usersjournal->configdir, configdir);
+}
+
+/**
+ * Append a newly paired user to the journal. This doesn't need the users
+ * file to be read or written, so takes the same time however many users
+ * have already been paired.
+ *
+ * @param usersjournal The journal to append to.
+ * @param name The name of the user.
+ * @param publickey The identity public key of the user's Pico.
+ * @param symmetrickey The symmetric key shared with the user's Pico.
+ * @return true if the record was written to disk, false o/w.
+ */
+bool usersjournal_append_user(UsersJournal const * usersjournal, char const * name, EC_KEY * publickey, Buffer const * symmetrickey) {
+	bool result;
+	Buffer * lines;
+
+	lines = buffer_new(0);
+	result = usersjournal_format_user(name, publickey, symmetrickey, lines);
+	if (result) {
+		result = usersjournal_write(usersjournal, lines, LOCK_SH);
+	}
+	buffer_delete(lines);
+
+	return result;
+}
+
+/**
+ * Append a newly paired Bluetooth device to the journal. The device is only
+ * sent beacons once the journal has been compacted into the Bluetooth device
+ * file.
+ *
+ * @param usersjournal The journal to append to.
+ * @param address The Bluetooth address of the device, in the usual
+ *        colon-separated hex form.
+ * @return true if the record was written to disk, false o/w.
+ */
+bool usersjournal_append_device(UsersJournal const * usersjournal, char const * address) {
+	bool result;
+	Buffer * lines;
+
+	lines = buffer_new(0);
+	usersjournal_format_device(address, lines);
+	result = usersjournal_write(usersjournal, lines, LOCK_SH);
+	buffer_delete(lines);
+
+	return result;
+}
+
+/**
+ * Queue a newly paired user to be appended to the journal by the next call
+ * to usersjournal_commit(). Nothing is written to disk until then.
+ *
+ * @param usersjournal The journal to queue the record on.
+ * @param name The name of the user.
+ * @param publickey The identity public key of the user's Pico.
+ * @param symmetrickey The symmetric key shared with the user's Pico.
+ * @return true if the record was queued, false if the key couldn't be
+ *         encoded.
+ */
+bool usersjournal_queue_user(UsersJournal * usersjournal, char const * name, EC_KEY * publickey, Buffer const * symmetrickey) {
+	return usersjournal_format_user(name, publickey, symmetrickey, usersjournal->queue);
+}
+
+/**
+ * Queue a newly paired Bluetooth device to be appended to the journal by
+ * the next call to usersjournal_commit().
+ *
+ * @param usersjournal The journal to queue the record on.
+ * @param address The Bluetooth address of the device, in the usual
+ *        colon-separated hex form.
+ */
+void usersjournal_queue_device(UsersJournal * usersjournal, char const * address) {
+	usersjournal_format_device(address, usersjournal->queue);
+}
+
+/**
+ * Append all of the queued records to the journal in a single write. The
+ * exclusive lock is held while writing, so readers see either none of the
+ * records or all of them.
+ *
+ * @param usersjournal The journal to append to.
+ * @return true if the records were written to disk (or there were none),
+ *         false o/w, in which case the records stay queued.
+ */
+bool usersjournal_commit(UsersJournal * usersjournal) {
+	bool result;
+
+	result = TRUE;
+	if (buffer_get_pos(usersjournal->queue) > 0) {
+		result = usersjournal_write(usersjournal, usersjournal->queue, LOCK_EX);
+		if (result) {
+			buffer_clear(usersjournal->queue);
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Bring the in-memory list of users up to date. Only the journal records
+ * appended since the last refresh are read, unless the users file or the
+ * journal has been replaced (for example by compaction), in which case
+ * everything is read afresh.
+ *
+ * If a compaction is in progress the refresh is skipped and the existing
+ * list is kept, unless nothing has been loaded yet.
+ *
+ * @param usersjournal The object to refresh.
+ * @return The result of loading the users file if it was read, or
+ *         USERFILE_SUCCESS o/w.
+ */
+USERFILE usersjournal_refresh(UsersJournal * usersjournal) {
+	USERFILE result;
+	int lockfd;
+	int fd;
+	bool reload;
+	bool exists;
+	Buffer * path;
+	struct stat status;
+	struct stat journalstatus;
+
+	result = USERFILE_SUCCESS;
+	lockfd = usersjournal_lock(usersjournal, LOCK_SH | LOCK_NB);
+	if ((lockfd < 0) && (usersjournal->loaded)) {
+		LOG(LOG_DEBUG, "Users journal busy, using cached users");
+	}
+	else {
+		if (lockfd < 0) {
+			lockfd = usersjournal_lock(usersjournal, LOCK_SH);
+		}
+
+		path = buffer_new(0);
+		usersjournal_path(usersjournal, USERSJOURNAL_USERS_FILE, path);
+		exists = (stat(buffer_get_buffer(path), & status) == 0);
+		if (exists == FALSE) {
+			status.st_ino = 0;
+			status.st_mtim.tv_sec = 0;
+			status.st_mtim.tv_nsec = 0;
+		}
+
+		reload = (usersjournal->loaded == FALSE);
+		reload |= (status.st_ino != usersjournal->usersinode);
+		reload |= (status.st_mtim.tv_sec != usersjournal->usersmodified.tv_sec);
+		reload |= (status.st_mtim.tv_nsec != usersjournal->usersmodified.tv_nsec);
+
+		usersjournal_path(usersjournal, USERS_JOURNAL_FILE, path);
+		fd = open(buffer_get_buffer(path), O_RDONLY | O_CLOEXEC);
+		if ((fd >= 0) && (fstat(fd, & journalstatus) == 0)) {
+			reload |= (journalstatus.st_dev != usersjournal->device);
+			reload |= (journalstatus.st_ino != usersjournal->inode);
+			reload |= (journalstatus.st_size < usersjournal->offset);
+		}
+		else {
+			reload |= (usersjournal->offset > 0);
+		}
+
+		if (reload) {
+			usersjournal_path(usersjournal, USERSJOURNAL_USERS_FILE, path);
+			users_delete(usersjournal->users);
+			usersjournal->users = users_new();
+			result = users_load(usersjournal->users, buffer_get_buffer(path));
+
+			usersjournal->usersinode = status.st_ino;
+			usersjournal->usersmodified = status.st_mtim;
+			usersjournal->device = 0;
+			usersjournal->inode = 0;
+			usersjournal->offset = 0;
+			usersjournal->pending = 0;
+			usersjournal->devices = 0;
+			g_slist_free_full(usersjournal->addresses, g_free);
+			usersjournal->addresses = NULL;
+			usersjournal->loaded = TRUE;
+		}
+
+		usersjournal_path(usersjournal, USERSJOURNAL_FOLDED_FILE, path);
+		usersjournal->interrupted = (lstat(buffer_get_buffer(path), & status) == 0);
+
+		if (fd >= 0) {
+			usersjournal->device = journalstatus.st_dev;
+			usersjournal->inode = journalstatus.st_ino;
+			usersjournal->offset = usersjournal_read(fd, usersjournal->offset, usersjournal->users, & usersjournal->addresses, & usersjournal->pending, & usersjournal->devices);
+			close(fd);
+		}
+
+		buffer_delete(path);
+	}
+	usersjournal_unlock(lockfd);
+
+	return result;
+}
+
+/**
+ * Get the list of users as of the last refresh. The list belongs to the
+ * journal and is replaced when the journal is next refreshed.
+ *
+ * @param usersjournal The object to get the list from.
+ * @return The list of users.
+ */
+Users const * usersjournal_get_users(UsersJournal const * usersjournal) {
+	return usersjournal->users;
+}
+
+/**
+ * Get the number of journal records, of either type, that were read by the
+ * last refresh and have yet to be compacted.
+ *
+ * @param usersjournal The object to get the value from.
+ * @return The number of records.
+ */
+int usersjournal_get_pending(UsersJournal const * usersjournal) {
+	return usersjournal->pending;
+}
+
+/**
+ * Get the number of Bluetooth device records that were read by the last
+ * refresh and have yet to be compacted.
+ *
+ * @param usersjournal The object to get the value from.
+ * @return The number of device records.
+ */
+int usersjournal_get_devices(UsersJournal const * usersjournal) {
+	return usersjournal->devices;
+}
+
+/**
+ * Get the addresses of the Bluetooth devices in the journal records read by
+ * the last refresh, which have yet to be compacted into the Bluetooth
+ * device file. The list belongs to the journal and is replaced when the
+ * journal is next refreshed.
+ *
+ * @param usersjournal The object to get the list from.
+ * @return The addresses as strings, most recently paired first.
+ */
+GSList const * usersjournal_get_device_list(UsersJournal const * usersjournal) {
+	return usersjournal->addresses;
+}
+
+/**
+ * Get whether the last refresh found a compaction that was interrupted
+ * after being committed. Until usersjournal_compact() is called to complete
+ * it, the users it was folding in may be missing.
+ *
+ * @param usersjournal The object to get the value from.
+ * @return true if a compaction needs completing, false o/w.
+ */
+bool usersjournal_get_interrupted(UsersJournal const * usersjournal) {
+	return usersjournal->interrupted;
+}
+
+/**
+ * Load the users file and every user in the journal into a list owned by
+ * the caller. Unlike usersjournal_refresh() this reads everything each
+ * time.
+ *
+ * @param usersjournal The journal to load.
+ * @param users The list to add the users to.
+ * @return The result of loading the users file.
+ */
+USERFILE usersjournal_load(UsersJournal const * usersjournal, Users * users) {
+	USERFILE result;
+	int lockfd;
+	int fd;
+	int pending;
+	int devicecount;
+	Buffer * path;
+
+	path = buffer_new(0);
+	lockfd = usersjournal_lock(usersjournal, LOCK_SH);
+
+	usersjournal_path(usersjournal, USERSJOURNAL_USERS_FILE, path);
+	result = users_load(users, buffer_get_buffer(path));
+
+	usersjournal_path(usersjournal, USERS_JOURNAL_FILE, path);
+	fd = open(buffer_get_buffer(path), O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		pending = 0;
+		devicecount = 0;
+		usersjournal_read(fd, 0, users, NULL, & pending, & devicecount);
+		close(fd);
+	}
+
+	usersjournal_unlock(lockfd);
+	buffer_delete(path);
+
+	return result;
+}
+
+/**
+ * Fold the journal into the users and Bluetooth device files. The new files
+ * are written and synced alongside the old ones, then the journal is moved
+ * aside, which commits the compaction, and finally the new files are moved
+ * into place. The next append starts a fresh journal.
+ *
+ * If the compaction is interrupted before it's committed, the journal is
+ * left in place and the partly written files are discarded next time. If
+ * it's interrupted afterwards, the next call completes it. Either way the
+ * records are only ever folded in once.
+ *
+ * This reads and writes every user, so it's intended to be run
+ * occasionally, off the main loop. Only the configuration directory is
+ * used, so this can safely run on another thread while the journal is
+ * refreshed.
+ *
+ * @param usersjournal The journal to compact.
+ * @return true if the journal was compacted or was already empty, false if
+ *         there was an error, in which case the journal is left in place.
+ */
+bool usersjournal_compact(UsersJournal const * usersjournal) {
+	bool result;
+	USERFILE loadresult;
+	int lockfd;
+	int fd;
+	int pending;
+	int devicecount;
+	Users * users;
+	GSList * devices;
+	Buffer * path;
+	Buffer * temppath;
+
+	path = buffer_new(0);
+	temppath = buffer_new(0);
+	users = users_new();
+	devices = NULL;
+	pending = 0;
+	devicecount = 0;
+
+	lockfd = usersjournal_lock(usersjournal, LOCK_EX);
+	result = (lockfd >= 0);
+
+	if (result) {
+		result = usersjournal_recover(usersjournal);
+	}
+
+	if (result) {
+		usersjournal_path(usersjournal, USERSJOURNAL_USERS_FILE, path);
+		loadresult = users_load(users, buffer_get_buffer(path));
+		result = ((loadresult == USERFILE_SUCCESS) || (loadresult == USERFILE_IOERROR));
+	}
+
+	if (result) {
+		usersjournal_path(usersjournal, USERS_JOURNAL_FILE, path);
+		fd = open(buffer_get_buffer(path), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd >= 0) {
+			usersjournal_read(fd, 0, users, & devices, & pending, & devicecount);
+			close(fd);
+		}
+	}
+
+	if (result && (pending > 0)) {
+		usersjournal_path(usersjournal, USERSJOURNAL_USERS_FILE USERSJOURNAL_TEMP_SUFFIX, temppath);
+		fd = usersjournal_create_temp(temppath);
+		result = (fd >= 0) && (users_export(users, buffer_get_buffer(temppath)) == USERFILE_SUCCESS);
+		result = usersjournal_seal(fd, temppath) && result;
+	}
+
+	if (result && (devices != NULL)) {
+		result = usersjournal_prepare_devices(usersjournal, devices);
+	}
+
+	if (result && (pending > 0)) {
+		// Moving the journal aside commits the compaction, and tells readers to reload
+		usersjournal_path(usersjournal, USERS_JOURNAL_FILE, path);
+		usersjournal_path(usersjournal, USERSJOURNAL_FOLDED_FILE, temppath);
+		result = (g_rename(buffer_get_buffer(path), buffer_get_buffer(temppath)) == 0);
+		result = result && usersjournal_sync_dir(usersjournal);
+		result = result && usersjournal_recover(usersjournal);
+	}
+
+	if (result == FALSE) {
+		LOG(LOG_ERR, "Failed to compact users journal");
+	}
+	else if (pending > 0) {
+		LOG(LOG_INFO, "Compacted %d users journal records", pending);
+	}
+
+	usersjournal_unlock(lockfd);
+	g_slist_free_full(devices, g_free);
+	users_delete(users);
+	buffer_delete(temppath);
+	buffer_delete(path);
+
+	return result;
+}
+
+/**
+ * Get the full path of a file in the configuration directory.
+ *
+ * @param usersjournal The object holding the configuration directory.
+ * @param leaf The name of the file.
+ * @param path A buffer to store the path in, replacing its contents.
+ */
+static void usersjournal_path(UsersJournal const * usersjournal, char const * leaf, Buffer * path) {
+	buffer_clear(path);
+	buffer_append_buffer(path, usersjournal->configdir);
+	buffer_append_string(path, leaf);
+}
+
+/**
+ * Take the lock on the configuration directory's users files. Appending and
+ * reading take a shared lock; compaction takes an exclusive lock.
+ *
+ * @param usersjournal The object holding the configuration directory.
+ * @param operation The flock() operation to perform.
+ * @return The file descriptor holding the lock, or -1 if the lock couldn't
+ *         be taken.
+ */
+static int usersjournal_lock(UsersJournal const * usersjournal, int operation) {
+	Buffer * path;
+	int lockfd;
+
+	path = buffer_new(0);
+	usersjournal_path(usersjournal, USERSJOURNAL_LOCK_FILE, path);
+	lockfd = open(buffer_get_buffer(path), O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if ((lockfd >= 0) && (flock(lockfd, operation) != 0)) {
+		close(lockfd);
+		lockfd = -1;
+	}
+	buffer_delete(path);
+
+	return lockfd;
+}
+
+/**
+ * Release a lock taken using usersjournal_lock().
+ *
+ * @param lockfd The file descriptor holding the lock, or -1 if the lock
+ *        wasn't taken.
+ */
+static void usersjournal_unlock(int lockfd) {
+	if (lockfd >= 0) {
+		flock(lockfd, LOCK_UN);
+		close(lockfd);
+	}
+}
+
+/**
+ * Format a user record, ready to be written to the journal.
+ *
+ * @param name The name of the user.
+ * @param publickey The identity public key of the user's Pico.
+ * @param symmetrickey The symmetric key shared with the user's Pico.
+ * @param lines A buffer to append the formatted record to.
+ * @return true if the record was formatted, false if the key couldn't be
+ *         encoded.
+ */
+static bool usersjournal_format_user(char const * name, EC_KEY * publickey, Buffer const * symmetrickey, Buffer * lines) {
+	bool result;
+	Json * json;
+	Buffer * der;
+	Buffer * encoded;
+
+	der = buffer_new(0);
+	encoded = buffer_new(0);
+	json = json_new();
+
+	json_add_string(json, "type", "user");
+	json_add_string(json, "name", name);
+
+	result = cryptosupport_getpublicder(publickey, der);
+	if (result) {
+		base64_encode_buffer(der, encoded);
+		json_add_string(json, "pub", buffer_get_buffer(encoded));
+
+		buffer_clear(encoded);
+		base64_encode_buffer(symmetrickey, encoded);
+		json_add_string(json, "key", buffer_get_buffer(encoded));
+
+		usersjournal_format(json, lines);
+	}
+
+	json_delete(json);
+	buffer_delete(encoded);
+	buffer_delete(der);
+
+	return result;
+}
+
+/**
+ * Format a Bluetooth device record, ready to be written to the journal.
+ *
+ * @param address The Bluetooth address of the device.
+ * @param lines A buffer to append the formatted record to.
+ */
+static void usersjournal_format_device(char const * address, Buffer * lines) {
+	Json * json;
+
+	json = json_new();
+	json_add_string(json, "type", "device");
+	json_add_string(json, "address", address);
+	usersjournal_format(json, lines);
+	json_delete(json);
+}
+
+/**
+ * Format a record as a line of the journal: its checksum, a space, the
+ * serialised JSON and a newline.
+ *
+ * @param json The record to format.
+ * @param lines A buffer to append the line to.
+ */
+static void usersjournal_format(Json * json, Buffer * lines) {
+	Buffer * record;
+	char checksum[USERSJOURNAL_CHECKSUM_LENGTH + 1];
+	size_t length;
+
+	record = buffer_new(0);
+	json_serialize_buffer(json, record);
+	length = strnlen(buffer_get_buffer(record), buffer_get_pos(record));
+
+	usersjournal_checksum(buffer_get_buffer(record), length, checksum);
+	buffer_append(lines, checksum, USERSJOURNAL_CHECKSUM_LENGTH);
+	buffer_append(lines, " ", 1);
+	buffer_append(lines, buffer_get_buffer(record), length);
+	buffer_append(lines, "\n", 1);
+
+	buffer_delete(record);
+}
+
+/**
+ * Write formatted records to the end of the journal. They're written with a
+ * single call to an append-only file descriptor, so records from concurrent
+ * writers don't interleave.
+ *
+ * @param usersjournal The journal to append to.
+ * @param lines The formatted records.
+ * @param operation The lock to hold while writing: LOCK_SH to allow other
+ *        writers and readers at the same time, or LOCK_EX to keep them out.
+ * @return true if the records were written to disk, false o/w.
+ */
+static bool usersjournal_write(UsersJournal const * usersjournal, Buffer const * lines, int operation) {
+	bool result;
+	Buffer * path;
+	ssize_t written;
+	int lockfd;
+	int fd;
+
+	path = buffer_new(0);
+	usersjournal_path(usersjournal, USERS_JOURNAL_FILE, path);
+
+	lockfd = usersjournal_lock(usersjournal, operation);
+	result = (lockfd >= 0);
+	if (result) {
+		fd = open(buffer_get_buffer(path), O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		result = (fd >= 0);
+		if (result) {
+			written = write(fd, buffer_get_buffer(lines), buffer_get_pos(lines));
+			result = (written == (ssize_t)buffer_get_pos(lines)) && (fsync(fd) == 0);
+			close(fd);
+		}
+	}
+	usersjournal_unlock(lockfd);
+
+	if (result == FALSE) {
+		LOG(LOG_ERR, "Failed to append to users journal %s", buffer_get_buffer(path));
+	}
+
+	buffer_delete(path);
+
+	return result;
+}
+
+/**
+ * Calculate the checksum of a record.
+ *
+ * @param data The record to calculate the checksum of.
+ * @param length The length of the record.
+ * @param checksum A buffer of at least USERSJOURNAL_CHECKSUM_LENGTH + 1
+ *        characters to store the null-terminated checksum in.
+ */
+static void usersjournal_checksum(char const * data, size_t length, char * checksum) {
+	gchar * digest;
+
+	digest = g_compute_checksum_for_data(G_CHECKSUM_SHA256, (guchar const *)data, length);
+	g_strlcpy(checksum, digest, USERSJOURNAL_CHECKSUM_LENGTH + 1);
+	g_free(digest);
+}
+
+/**
+ * Check and parse a single line of the journal, adding any user it contains
+ * to the list.
+ *
+ * @param line The line, without its newline.
+ * @param length The length of the line.
+ * @param users The list to add users to.
+ * @param devices A list to prepend the addresses of devices to, as newly
+ *        allocated strings, or NULL if they're not needed.
+ * @return The type of the record, or USERSJOURNALRECORD_INVALID if it's
+ *         malformed or fails its checksum.
+ */
+static USERSJOURNALRECORD usersjournal_read_record(char const * line, size_t length, Users * users, GSList ** devices) {
+	USERSJOURNALRECORD record;
+	char checksum[USERSJOURNAL_CHECKSUM_LENGTH + 1];
+	char const * body;
+	size_t bodylength;
+	Json * json;
+	char const * type;
+	char const * name;
+	char const * address;
+	Buffer * encoded;
+	Buffer * der;
+	Buffer * symmetrickey;
+	EC_KEY * publickey;
+
+	record = USERSJOURNALRECORD_INVALID;
+	if ((length > USERSJOURNAL_CHECKSUM_LENGTH + 1) && (line[USERSJOURNAL_CHECKSUM_LENGTH] == ' ')) {
+		body = line + USERSJOURNAL_CHECKSUM_LENGTH + 1;
+		bodylength = length - USERSJOURNAL_CHECKSUM_LENGTH - 1;
+		usersjournal_checksum(body, bodylength, checksum);
+
+		json = json_new();
+		if ((memcmp(checksum, line, USERSJOURNAL_CHECKSUM_LENGTH) == 0) && json_deserialize_string(json, body, bodylength) && (json_get_type(json, "type") == JSONTYPE_STRING)) {
+			type = json_get_string(json, "type");
+			if ((strcmp(type, "user") == 0) && (json_get_type(json, "name") == JSONTYPE_STRING) && (json_get_type(json, "pub") == JSONTYPE_STRING) && (json_get_type(json, "key") == JSONTYPE_STRING)) {
+				name = json_get_string(json, "name");
+				encoded = buffer_new(0);
+				der = buffer_new(0);
+				symmetrickey = buffer_new(0);
+
+				buffer_append_string(encoded, json_get_string(json, "pub"));
+				base64_decode_buffer(encoded, der);
+				publickey = cryptosupport_read_buffer_public_key(der);
+
+				buffer_clear(encoded);
+				buffer_append_string(encoded, json_get_string(json, "key"));
+				base64_decode_buffer(encoded, symmetrickey);
+
+				if ((publickey != NULL) && (name[0] != 0)) {
+					// Ownership of the key passes to the list
+					users_add_user(users, name, publickey, symmetrickey);
+					record = USERSJOURNALRECORD_USER;
+				}
+
+				buffer_delete(symmetrickey);
+				buffer_delete(der);
+				buffer_delete(encoded);
+			}
+			else if ((strcmp(type, "device") == 0) && (json_get_type(json, "address") == JSONTYPE_STRING)) {
+				address = json_get_string(json, "address");
+				if (devices != NULL) {
+					*devices = g_slist_prepend(*devices, g_strdup(address));
+				}
+				record = USERSJOURNALRECORD_DEVICE;
+			}
+		}
+		json_delete(json);
+	}
+
+	return record;
+}
+
+/**
+ * Read the complete records in the journal from the given offset onwards.
+ * A final record without a newline may still be being written, so is left
+ * to be read next time.
+ *
+ * @param fd A file descriptor for the journal.
+ * @param offset The offset to start reading from.
+ * @param users The list to add users to.
+ * @param devices A list to prepend device addresses to, or NULL.
+ * @param pending Incremented for each valid record read.
+ * @param devicecount Incremented for each valid device record read.
+ * @return The offset following the last complete record read.
+ */
+static off_t usersjournal_read(int fd, off_t offset, Users * users, GSList ** devices, int * pending, int * devicecount) {
+	Buffer * data;
+	char chunk[USERSJOURNAL_READ_SIZE];
+	ssize_t size;
+	char const * contents;
+	char const * end;
+	size_t start;
+	size_t length;
+	size_t total;
+
+	data = buffer_new(0);
+	if (lseek(fd, offset, SEEK_SET) == offset) {
+		do {
+			size = read(fd, chunk, sizeof(chunk));
+			if (size > 0) {
+				buffer_append(data, chunk, size);
+			}
+		} while (size > 0);
+	}
+
+	contents = buffer_get_buffer(data);
+	total = buffer_get_pos(data);
+	start = 0;
+	end = (total > 0) ? memchr(contents, '\n', total) : NULL;
+	while (end != NULL) {
+		length = end - (contents + start);
+		switch (usersjournal_read_record(contents + start, length, users, devices)) {
+		case USERSJOURNALRECORD_USER:
+			(*pending)++;
+			break;
+		case USERSJOURNALRECORD_DEVICE:
+			(*pending)++;
+			(*devicecount)++;
+			break;
+		default:
+			LOG(LOG_ERR, "Skipping malformed users journal record");
+			break;
+		}
+		start += length + 1;
+		end = (start < total) ? memchr(contents + start, '\n', total - start) : NULL;
+	}
+	buffer_delete(data);
+
+	return offset + start;
+}
+
+/**
+ * Write the Bluetooth device file with the devices from the journal added,
+ * ready to be moved into place once the compaction is committed.
+ *
+ * @param usersjournal The object holding the configuration directory.
+ * @param devices The addresses of the devices to add.
+ * @return true if the file was written, false o/w.
+ */
+static bool usersjournal_prepare_devices(UsersJournal const * usersjournal, GSList * devices) {
+	bool result;
+	bt_device_list_t * devicelist;
+	bt_err_t error;
+	bt_addr_t addr;
+	Buffer * path;
+	Buffer * temppath;
+	GSList * device;
+	int fd;
+
+	path = buffer_new(0);
+	temppath = buffer_new(0);
+	usersjournal_path(usersjournal, USERSJOURNAL_DEVICES_FILE, path);
+	usersjournal_path(usersjournal, USERSJOURNAL_DEVICES_FILE USERSJOURNAL_TEMP_SUFFIX, temppath);
+
+	devicelist = bt_list_new();
+	error = bt_list_load(devicelist, buffer_get_buffer(path));
+	result = ((error == BT_SUCCESS) || (error == BT_ERR_FILE_NOT_FOUND));
+
+	if (result) {
+		// The addresses were prepended, so add them oldest first
+		devices = g_slist_reverse(devices);
+		for (device = devices; device != NULL; device = device->next) {
+			bt_str_to_addr((char const *)device->data, & addr);
+			bt_list_add_device(devicelist, & addr);
+		}
+		devices = g_slist_reverse(devices);
+
+		fd = usersjournal_create_temp(temppath);
+		result = (fd >= 0) && (bt_list_save(devicelist, buffer_get_buffer(temppath)) == BT_SUCCESS);
+		result = usersjournal_seal(fd, temppath) && result;
+	}
+
+	bt_list_delete(devicelist);
+	buffer_delete(temppath);
+	buffer_delete(path);
+
+	return result;
+}
+
+/**
+ * Create a file to write the new contents of a users file to. The file must
+ * not already exist, and a symlink in its place isn't followed, so a
+ * configuration directory writable by others can't be used to overwrite
+ * files elsewhere. The files hold secrets, so only the owner can read them,
+ * whatever the umask.
+ *
+ * @param path The path of the file to create.
+ * @return A file descriptor for the file, or -1 if it couldn't be created.
+ */
+static int usersjournal_create_temp(Buffer const * path) {
+	int fd;
+
+	fd = open(buffer_get_buffer(path), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if ((fd >= 0) && (fchmod(fd, S_IRUSR | S_IWUSR) != 0)) {
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0) {
+		LOG(LOG_ERR, "Failed to create %s: %s", buffer_get_buffer(path), strerror(errno));
+	}
+
+	return fd;
+}
+
+/**
+ * Finish writing a file created using usersjournal_create_temp(). The file
+ * is written by name, so this checks the name still refers to the file that
+ * was created before syncing it to disk. The file descriptor is closed.
+ *
+ * @param fd The file descriptor returned when the file was created, or -1.
+ * @param path The path of the file.
+ * @return true if the file is the one created and was synced, false o/w.
+ */
+static bool usersjournal_seal(int fd, Buffer const * path) {
+	bool result;
+	struct stat pathstatus;
+	struct stat fdstatus;
+
+	result = (fd >= 0);
+	if (result) {
+		result = (lstat(buffer_get_buffer(path), & pathstatus) == 0) && (fstat(fd, & fdstatus) == 0);
+		result = result && S_ISREG(pathstatus.st_mode) && (pathstatus.st_dev == fdstatus.st_dev) && (pathstatus.st_ino == fdstatus.st_ino);
+		result = result && (fsync(fd) == 0);
+		close(fd);
+	}
+
+	return result;
+}
+
+/**
+ * Sync the configuration directory, so that files moved within it stay
+ * moved if the system goes down.
+ *
+ * @param usersjournal The object holding the configuration directory.
+ * @return true if the directory was synced, false o/w.
+ */
+static bool usersjournal_sync_dir(UsersJournal const * usersjournal) {
+	bool result;
+	int fd;
+
+	fd = open(buffer_get_buffer(usersjournal->configdir), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	result = (fd >= 0);
+	if (result) {
+		result = (fsync(fd) == 0);
+		close(fd);
+	}
+
+	return result;
+}
+
+/**
+ * Tidy up after a compaction, which must be done with the exclusive lock
+ * held. If the journal has been moved aside then the compaction was
+ * committed, so any new users and Bluetooth device files still waiting are
+ * moved into place and the old journal is removed. Otherwise any new files
+ * are left over from a compaction that didn't get that far, so are removed.
+ *
+ * @param usersjournal The object holding the configuration directory.
+ * @return true if there was nothing to do or everything was tidied up,
+ *         false o/w.
+ */
+static bool usersjournal_recover(UsersJournal const * usersjournal) {
+	static char const * const leaves[] = {USERSJOURNAL_USERS_FILE, USERSJOURNAL_DEVICES_FILE};
+	bool result;
+	bool committed;
+	Buffer * path;
+	Buffer * temppath;
+	struct stat status;
+	size_t leaf;
+
+	path = buffer_new(0);
+	temppath = buffer_new(0);
+	result = TRUE;
+
+	usersjournal_path(usersjournal, USERSJOURNAL_FOLDED_FILE, path);
+	committed = (lstat(buffer_get_buffer(path), & status) == 0);
+
+	for (leaf = 0; leaf < G_N_ELEMENTS(leaves); leaf++) {
+		usersjournal_path(usersjournal, leaves[leaf], path);
+		buffer_clear(temppath);
+		buffer_append_buffer(temppath, path);
+		buffer_append_string(temppath, USERSJOURNAL_TEMP_SUFFIX);
+		if (lstat(buffer_get_buffer(temppath), & status) == 0) {
+			if (committed) {
+				result = result && (g_rename(buffer_get_buffer(temppath), buffer_get_buffer(path)) == 0);
+			}
+			else {
+				g_unlink(buffer_get_buffer(temppath));
+			}
+		}
+	}
+
+	if (result && committed) {
+		usersjournal_path(usersjournal, USERSJOURNAL_FOLDED_FILE, path);
+		result = usersjournal_sync_dir(usersjournal) && (g_unlink(buffer_get_buffer(path)) == 0);
+	}
+
+	buffer_delete(temppath);
+	buffer_delete(path);
+
+	return result;
+}
+
+/** @} addtogroup Service */
+
@@ -0,0 +1,111 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Append-only journal of paired users and Bluetooth devices
+ * @section DESCRIPTION
+ *
+ * Adding a user directly to the users file means loading the whole file,
+ * adding the user and writing the whole file out again, and the same for
+ * the list of Bluetooth devices. With many users this makes provisioning
+ * quadratic, and a reader could see a partly written file.
+ *
+ * Instead, pico-pair appends a single record to a journal file in the
+ * configuration directory for each user or device paired. Each record is a
+ * line holding a checksum followed by a JSON object, written with a single
+ * append so that concurrent writers don't interleave. Records that are torn
+ * or fail their checksum are skipped by readers.
+ *
+ * The users known to a configuration directory are those in the users file
+ * plus those in the journal, and likewise for the Bluetooth devices. A
+ * UsersJournal keeps the combined list of users, and the devices from the
+ * journal, in memory and, when refreshed, only reads the records appended
+ * since the last refresh. From time to time the journal is compacted: its
+ * records are folded into the users and Bluetooth device files, and it's
+ * moved aside so the next append starts a fresh journal. Readers notice and
+ * reload the users file. Compaction can be interrupted at any point without
+ * records being lost or folded in twice.
+ *
+ * Records can also be queued and committed together, for example when
+ * many users are paired in one go, in which case readers see either all of
+ * them or none.
+ *
+ * A lock file in the configuration directory stops compaction from running
+ * while records are being appended or the files are being read.
+ *
+ */
+
+/** \addtogroup Service
+ *  @{
+ */
+
+#ifndef __USERSJOURNAL_H
+#define __USERSJOURNAL_H (1)
+
+#include <stdbool.h>
+#include <glib.h>
+#include <openssl/ec.h>
+#include "pico/buffer.h"
+#include "pico/users.h"
+
+// Defines
+
+/**
+ * @brief The name of the journal file in the configuration directory
+ */
+#define USERS_JOURNAL_FILE "users.journal"
+
+// Structure definitions
+
+/**
+ * The internal structure can be found in usersjournal.c
+ */
+typedef struct _UsersJournal UsersJournal;
+
+// Function prototypes
+
+UsersJournal * usersjournal_new();
+void usersjournal_delete(UsersJournal * usersjournal);
+void usersjournal_set_configdir(UsersJournal * usersjournal, char const * configdir);
+bool usersjournal_append_user(UsersJournal const * usersjournal, char const * name, EC_KEY * publickey, Buffer const * symmetrickey);
+bool usersjournal_append_device(UsersJournal const * usersjournal, char const * address);
+bool usersjournal_queue_user(UsersJournal * usersjournal, char const * name, EC_KEY * publickey, Buffer const * symmetrickey);
+void usersjournal_queue_device(UsersJournal * usersjournal, char const * address);
+bool usersjournal_commit(UsersJournal * usersjournal);
+USERFILE usersjournal_refresh(UsersJournal * usersjournal);
+Users const * usersjournal_get_users(UsersJournal const * usersjournal);
+int usersjournal_get_pending(UsersJournal const * usersjournal);
+int usersjournal_get_devices(UsersJournal const * usersjournal);
+GSList const * usersjournal_get_device_list(UsersJournal const * usersjournal);
+bool usersjournal_get_interrupted(UsersJournal const * usersjournal);
+USERFILE usersjournal_load(UsersJournal const * usersjournal, Users * users);
+bool usersjournal_compact(UsersJournal const * usersjournal);
+
+// Function definitions
+
+#endif
+
+/** @} addtogroup Service */
+
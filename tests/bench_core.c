@@ -0,0 +1,831 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Microbenchmarks for the core data paths
+ * @section DESCRIPTION
+ *
+ * Times the hot paths of the PAM module and the pico-continuous service in
+ * isolation, so that changes in performance can be tracked across releases.
+ * The following are measured:
+ *
+ *  - processstore_add(), processstore_remove() and processstore_harvest() at
+ *    varying occupancy.
+ *  - authconfig_read_json() and authconfig_load_json().
+ *  - convert_text_to_qr_code() for each QR code mode.
+ *  - externalconfig_generate_json().
+ *  - users_load() and users_filter_by_name() for 10k to 100k users.
+ *  - Signing and verifying with the service identity key from a KeyCache.
+ *  - Beacon scheduling using the mockbt Bluetooth stubs.
+ *  - Beacon delivery and teardown latency against the simulated Bluetooth
+ *    adapter, measured in virtual time.
+ *  - Complete authentications with a simulated Pico over the direct TCP
+ *    channel on loopback, and over the Rendezvous Point channel if
+ *    PICO_BENCH_RVP is set in the environment (this needs network access).
+ *    The simulated Pico needs libpico to allow a channel to be given its own
+ *    transport, so these are skipped if it doesn't.
+ *
+ * The results are written to stdout as a JSON array, one object per
+ * measurement. Build and run using "make bench".
+ *
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <glib.h>
+#include <pico/pico.h>
+#include <pico/buffer.h>
+#include <pico/users.h>
+#include <pico/cryptosupport.h>
+#include <pico/shared.h>
+#include <pico/json.h>
+#include "mockbt/mockbt.h"
+#include "mockbt/mockbtsim.h"
+#include "testpico.h"
+#include "../src/processstore.h"
+#include "../src/authconfig.h"
+#include "../src/beaconsend.h"
+#include "../src/timesource.h"
+#include "../src/keycache.h"
+#include "../src/qrtext.h"
+#include "../src/service.h"
+#include "../src/servicetcp.h"
+#include "../src/servicervp.h"
+
+// Defines
+
+/**
+ * @brief The number of times each operation is repeated
+ *
+ * Operations that complete quickly are repeated this many times and the
+ * mean time per operation is reported.
+ */
+#define BENCH_ITERATIONS (10000)
+
+/**
+ * @brief The number of repetitions for the slower QR code operations
+ */
+#define BENCH_ITERATIONS_QR (200)
+
+/**
+ * @brief The number of repetitions for operations on large user files
+ */
+#define BENCH_ITERATIONS_USERS (5)
+
+/**
+ * @brief The number of repetitions for operations using the service's keys
+ */
+#define BENCH_ITERATIONS_KEYS (100)
+
+/**
+ * @brief The number of signatures to make and check with the cached keys
+ */
+#define BENCH_ITERATIONS_SIGN (1000)
+
+/**
+ * @brief Matches MAX_SIMULTANEOUS_AUTHS in processstore.c
+ */
+#define BENCH_MAX_OCCUPANCY (16)
+
+/**
+ * @brief The number of complete authentications to time for each channel
+ */
+#define BENCH_ITERATIONS_AUTH (20)
+
+/**
+ * @brief The maximum number of devices to send beacons to
+ *
+ * Bluetooth supports at most 32 separate channels, so there's little point
+ * measuring more than this.
+ */
+#define BENCH_MAX_DEVICES (32)
+
+/**
+ * @brief The step in microseconds by which virtual time is advanced when
+ * running against the simulated Bluetooth adapter
+ */
+#define BENCH_SIM_STEP (10 * 1000)
+
+/**
+ * @brief The longest period in microseconds to run each simulation phase
+ */
+#define BENCH_SIM_LIMIT (60 * G_USEC_PER_SEC)
+
+/**
+ * @brief An example configuration as sent by pam_pico
+ */
+#define BENCH_CONFIG "{\"continuous\":1,\"channeltype\":\"btc\",\"beacons\":1,\"anyuser\":0,\"timeout\":40.0,\"rvpurl\":\"http://rendezvous.mypico.org/channel/\",\"configdir\":\"/etc/pam-pico/\"}"
+
+/**
+ * @brief An example invitation code, as would be displayed in a QR code
+ */
+#define BENCH_QRTEXT "{\"sn\":\"Pico\",\"spk\":\"MFkwEwYHKoZIzj0CAQYIKoZIzj0DAQcDQgAEzpNscJDHgvg+49E79yDor/BP/ZFIXgmS5n9CaRUDN37mBgxeZFLWT2Q5PiNvOYsDm6yvt0VNCOz2r2vjRi+4qQ==\",\"sa\":\"http://rendezvous.mypico.org/channel/0123456789abcdef0123456789abcdef\",\"td\":{},\"t\":\"KP\"}"
+
+/**
+ * @brief The tail of each line written to the generated users files
+ *
+ * Only the username changes from line to line. The remaining fields are
+ * copied from the test key directory.
+ */
+#define BENCH_USER_TAIL ":jfRg5WiiyDttTT2UbkbcjYm0NGXic56BGm66ZiU+R3E=:MFkwEwYHKoZIzj0CAQYIKoZIzj0DAQcDQgAEzpNscJDHgvg+49E79yDor/BP/ZFIXgmS5n9CaRUDN37mBgxeZFLWT2Q5PiNvOYsDm6yvt0VNCOz2r2vjRi+4qQ==:+tuLmm0nYpgVjlrYihL6IA==\n"
+
+// Structure definitions
+
+/**
+ * The internal structure can be found in pam_pico.c
+ */
+typedef struct _ExternalConfig ExternalConfig;
+
+/**
+ * @brief Accumulates the output from a benchmark run
+ */
+typedef struct _Bench {
+	int results;
+	struct timespec start;
+} Bench;
+
+// Function prototypes
+
+// pam_pico.c has no header file, so we provide the function signatures here
+ExternalConfig * externalconfig_new();
+void externalconfig_delete(ExternalConfig * externalconfig);
+void externalconfig_generate_json(ExternalConfig * externalconfig, Buffer * json);
+
+// Function definitions
+
+/**
+ * Start timing an operation.
+ *
+ * @param bench The benchmark run to start timing for.
+ */
+static void bench_start(Bench * bench) {
+	clock_gettime(CLOCK_MONOTONIC, & bench->start);
+}
+
+/**
+ * Output the result of timing an operation as a JSON object.
+ *
+ * @param bench The benchmark run to output the result for.
+ * @param name The name of the operation measured.
+ * @param param A parameter that characterises the run (e.g. the occupancy
+ *        or number of users), or -1 if there is no parameter.
+ * @param iterations The number of times the operation was performed.
+ * @param elapsed The total time taken in nanoseconds.
+ */
+static void bench_output(Bench * bench, char const * name, long param, long iterations, double elapsed) {
+	printf("%s\n\t{\"name\": \"%s\", \"param\": %ld, \"iterations\": %ld, \"total_ns\": %.0f, \"ns_per_op\": %.1f}", (bench->results > 0 ? "," : ""), name, param, iterations, elapsed, elapsed / iterations);
+	fflush(stdout);
+	bench->results++;
+}
+
+/**
+ * Output a measurement that isn't a time (e.g. a count) as a JSON object.
+ *
+ * @param bench The benchmark run to output the result for.
+ * @param name The name of the quantity measured.
+ * @param param A parameter that characterises the run, or -1 if there is
+ *        no parameter.
+ * @param value The value measured.
+ */
+static void bench_output_value(Bench * bench, char const * name, long param, long value) {
+	printf("%s\n\t{\"name\": \"%s\", \"param\": %ld, \"value\": %ld}", (bench->results > 0 ? "," : ""), name, param, value);
+	fflush(stdout);
+	bench->results++;
+}
+
+/**
+ * Stop timing an operation and output the result as a JSON object.
+ *
+ * @param bench The benchmark run to output the result for.
+ * @param name The name of the operation measured.
+ * @param param A parameter that characterises the run (e.g. the occupancy
+ *        or number of users), or -1 if there is no parameter.
+ * @param iterations The number of times the operation was performed.
+ */
+static void bench_stop(Bench * bench, char const * name, long param, long iterations) {
+	struct timespec end;
+	double elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, & end);
+	elapsed = ((end.tv_sec - bench->start.tv_sec) * 1.0e9) + (end.tv_nsec - bench->start.tv_nsec);
+
+	bench_output(bench, name, param, iterations, elapsed);
+}
+
+/**
+ * Time adding and removing sessions from the ProcessStore, with the store
+ * already holding a given number of sessions.
+ *
+ * @param bench The benchmark run to output the results to.
+ */
+static void bench_processstore(Bench * bench) {
+	ProcessStore * processstore;
+	int occupancy;
+	int count;
+	int handle;
+	int handles[BENCH_MAX_OCCUPANCY];
+
+	for (occupancy = 0; occupancy < BENCH_MAX_OCCUPANCY; occupancy += 5) {
+		processstore = processstore_new();
+		for (count = 0; count < occupancy; count++) {
+			processstore_add(processstore);
+		}
+
+		bench_start(bench);
+		for (count = 0; count < BENCH_ITERATIONS; count++) {
+			handle = processstore_add(processstore);
+			processstore_remove(processstore, handle);
+		}
+		bench_stop(bench, "processstore_add_remove", occupancy, BENCH_ITERATIONS);
+
+		processstore_delete(processstore);
+	}
+
+	for (occupancy = 1; occupancy <= BENCH_MAX_OCCUPANCY; occupancy += 5) {
+		processstore = processstore_new();
+
+		bench_start(bench);
+		for (count = 0; count < (BENCH_ITERATIONS / occupancy); count++) {
+			for (handle = 0; handle < occupancy; handle++) {
+				handles[handle] = processstore_add(processstore);
+				auththread_set_state(processstore_get_auththread(processstore, handles[handle]), AUTHTHREADSTATE_HARVESTABLE);
+			}
+			processstore_harvest(processstore);
+		}
+		bench_stop(bench, "processstore_harvest", occupancy, (BENCH_ITERATIONS / occupancy));
+
+		processstore_delete(processstore);
+	}
+}
+
+/**
+ * Time parsing and loading the JSON configuration for an authentication.
+ *
+ * @param bench The benchmark run to output the results to.
+ */
+static void bench_authconfig(Bench * bench) {
+	AuthConfig * authconfig;
+	int count;
+	gchar * filename;
+	GError * error;
+	bool result;
+
+	authconfig = authconfig_new();
+
+	bench_start(bench);
+	for (count = 0; count < BENCH_ITERATIONS; count++) {
+		authconfig_read_json(authconfig, BENCH_CONFIG);
+	}
+	bench_stop(bench, "authconfig_read_json", -1, BENCH_ITERATIONS);
+
+	error = NULL;
+	filename = NULL;
+	result = g_file_set_contents("bench_config.txt", BENCH_CONFIG, -1, & error);
+	if (result) {
+		filename = g_strdup("bench_config.txt");
+		bench_start(bench);
+		for (count = 0; count < BENCH_ITERATIONS; count++) {
+			authconfig_load_json(authconfig, filename);
+		}
+		bench_stop(bench, "authconfig_load_json", -1, BENCH_ITERATIONS);
+		unlink(filename);
+		g_free(filename);
+	}
+	else {
+		fprintf(stderr, "Failed to write config file: %s\n", error->message);
+		g_error_free(error);
+	}
+
+	authconfig_delete(authconfig);
+}
+
+/**
+ * Time the conversion of an invitation into a printable QR code for each of
+ * the modes supported by pam_pico.
+ *
+ * @param bench The benchmark run to output the results to.
+ */
+static void bench_qrcode(Bench * bench) {
+	QRTYPE mode;
+	int count;
+	char * qrtext;
+	char name[64];
+
+	// No QR code is generated for QRTYPE_NONE
+	for (mode = QRTYPE_JSON; mode < QRTYPE_NONE; mode++) {
+		snprintf(name, sizeof(name), "convert_text_to_qr_code_mode%d", mode);
+		bench_start(bench);
+		for (count = 0; count < BENCH_ITERATIONS_QR; count++) {
+			qrtext = convert_text_to_qr_code(BENCH_QRTEXT, mode, false);
+			FREE(qrtext);
+		}
+		bench_stop(bench, name, mode, BENCH_ITERATIONS_QR);
+	}
+}
+
+/**
+ * Time generating the JSON configuration string sent by pam_pico to the
+ * service.
+ *
+ * @param bench The benchmark run to output the results to.
+ */
+static void bench_externalconfig(Bench * bench) {
+	ExternalConfig * externalconfig;
+	Buffer * json;
+	int count;
+
+	externalconfig = externalconfig_new();
+	json = buffer_new(0);
+
+	bench_start(bench);
+	for (count = 0; count < BENCH_ITERATIONS; count++) {
+		buffer_clear(json);
+		externalconfig_generate_json(externalconfig, json);
+	}
+	bench_stop(bench, "externalconfig_generate_json", -1, BENCH_ITERATIONS);
+
+	buffer_delete(json);
+	externalconfig_delete(externalconfig);
+}
+
+/**
+ * Time loading and filtering the list of paired users for lists of various
+ * sizes.
+ *
+ * @param bench The benchmark run to output the results to.
+ */
+static void bench_users(Bench * bench) {
+	Users * users;
+	Users * filtered;
+	FILE * file;
+	long usercount;
+	long count;
+	int iteration;
+	char name[64];
+
+	for (usercount = 10000; usercount <= 100000; usercount += 30000) {
+		file = fopen("bench_users.txt", "w");
+		if (file == NULL) {
+			fprintf(stderr, "Failed to write users file\n");
+			break;
+		}
+		for (count = 0; count < usercount; count++) {
+			fprintf(file, "user%ld%s", count, BENCH_USER_TAIL);
+		}
+		fclose(file);
+
+		users = users_new();
+		bench_start(bench);
+		for (iteration = 0; iteration < BENCH_ITERATIONS_USERS; iteration++) {
+			users_delete(users);
+			users = users_new();
+			users_load(users, "bench_users.txt");
+		}
+		bench_stop(bench, "users_load", usercount, BENCH_ITERATIONS_USERS);
+
+		// Filter for the last user, which is the worst case
+		snprintf(name, sizeof(name), "user%ld", usercount - 1);
+		filtered = users_new();
+		bench_start(bench);
+		for (iteration = 0; iteration < BENCH_ITERATIONS_USERS; iteration++) {
+			users_delete(filtered);
+			filtered = users_new();
+			users_filter_by_name(users, name, filtered);
+		}
+		bench_stop(bench, "users_filter_by_name", usercount, BENCH_ITERATIONS_USERS);
+
+		users_delete(filtered);
+		users_delete(users);
+		unlink("bench_users.txt");
+	}
+}
+
+/**
+ * Time obtaining the service identity key and signing with it, as happens
+ * for each session. The load case imports the key from file for every
+ * session, as happens without a KeyCache. The cached case takes a reference
+ * to the long-lived key from a KeyCache instead. Both cases sign with an
+ * identical key, so the difference is the cost of loading the key.
+ *
+ * @param bench The benchmark run to output the results to.
+ */
+static void bench_keycache(Bench * bench) {
+	KeyCache * keycache;
+	KeyPair * identitykey;
+	Buffer * configdir;
+	Buffer * data;
+	Buffer * signature;
+	int count;
+
+	configdir = buffer_new(0);
+	buffer_append_string(configdir, "tests/keydir/");
+	data = buffer_new(0);
+	buffer_append_string(data, BENCH_QRTEXT);
+	signature = buffer_new(0);
+
+	bench_start(bench);
+	for (count = 0; count < BENCH_ITERATIONS_KEYS; count++) {
+		identitykey = keypair_new();
+		keypair_import(identitykey, "tests/keydir/" PUB_FILE, "tests/keydir/" PRIV_FILE);
+		buffer_clear(signature);
+		keypair_sign_data(identitykey, data, signature);
+		keypair_delete(identitykey);
+	}
+	bench_stop(bench, "keycache_session_load", -1, BENCH_ITERATIONS_KEYS);
+
+	keycache = keycache_new();
+	// Load outside the timed section, since this only happens once
+	keycache_get(keycache, configdir);
+	bench_start(bench);
+	for (count = 0; count < BENCH_ITERATIONS_KEYS; count++) {
+		identitykey = keycache_get(keycache, configdir);
+		buffer_clear(signature);
+		keypair_sign_data(identitykey, data, signature);
+		keypair_delete(identitykey);
+	}
+	bench_stop(bench, "keycache_session_cached", -1, BENCH_ITERATIONS_KEYS);
+	keycache_delete(keycache);
+
+	buffer_delete(signature);
+	buffer_delete(data);
+	buffer_delete(configdir);
+}
+
+/**
+ * Time signing and verifying with the long-lived service identity key held
+ * by a KeyCache. Each session signs once with the key during the handshake,
+ * so this is the throughput available to sessions once the key is cached.
+ *
+ * @param bench The benchmark run to output the results to.
+ */
+static void bench_keycache_sign(Bench * bench) {
+	KeyCache * keycache;
+	KeyPair * identitykey;
+	Buffer * configdir;
+	Buffer * data;
+	Buffer * signature;
+	int count;
+	int failures;
+
+	configdir = buffer_new(0);
+	buffer_append_string(configdir, "tests/keydir/");
+	data = buffer_new(0);
+	buffer_append_string(data, BENCH_QRTEXT);
+	signature = buffer_new(0);
+	keycache = keycache_new();
+	identitykey = keycache_get(keycache, configdir);
+
+	bench_start(bench);
+	for (count = 0; count < BENCH_ITERATIONS_SIGN; count++) {
+		buffer_clear(signature);
+		keypair_sign_data(identitykey, data, signature);
+	}
+	bench_stop(bench, "keycache_sign", -1, BENCH_ITERATIONS_SIGN);
+
+	failures = 0;
+	bench_start(bench);
+	for (count = 0; count < BENCH_ITERATIONS_SIGN; count++) {
+		if (cryptosupport_verify_signature(keypair_getpublickey(identitykey), data, signature) == FALSE) {
+			failures++;
+		}
+	}
+	bench_stop(bench, "keycache_verify", -1, BENCH_ITERATIONS_SIGN);
+	bench_output_value(bench, "keycache_verify_failures", -1, failures);
+
+	keypair_delete(identitykey);
+	keycache_delete(keycache);
+	buffer_delete(signature);
+	buffer_delete(data);
+	buffer_delete(configdir);
+}
+
+/**
+ * Mock replacement for str2ba() that always succeeds.
+ */
+static int bench_str2ba(const char * str, bdaddr_t * ba) {
+	memset(ba, 0, sizeof(bdaddr_t));
+	return 0;
+}
+
+/**
+ * Callback for when a BeaconSend event chain finishes. Quits the main loop
+ * once all of the event chains have completed.
+ *
+ * @param beaconsend The event chain that finished.
+ * @param user_data The count of chains still running.
+ */
+static void bench_beacon_finished(BeaconSend const * beaconsend, void * user_data) {
+	int * running = (int *)user_data;
+
+	(*running)--;
+}
+
+/**
+ * Time the scheduling of beacons to a varying number of devices, using the
+ * mockbt stubs in place of the Bluetooth stack. The SDP connection is
+ * stubbed to fail, so this measures the overhead of setting up and
+ * tearing down the event chains rather than any radio activity.
+ *
+ * @param bench The benchmark run to output the results to.
+ */
+static void bench_beacons(Bench * bench) {
+	BeaconSend * beaconsend[BENCH_MAX_DEVICES];
+	int devices;
+	int count;
+	int running;
+
+	bt_funcs.str2ba = bench_str2ba;
+
+	for (devices = 1; devices <= BENCH_MAX_DEVICES; devices *= 2) {
+		running = devices;
+		bench_start(bench);
+		for (count = 0; count < devices; count++) {
+			beaconsend[count] = beaconsend_new();
+			beaconsend_set_device(beaconsend[count], "00:00:00:00:00:00");
+			beaconsend_set_code(beaconsend[count], BENCH_QRTEXT);
+			beaconsend_set_finished_callback(beaconsend[count], bench_beacon_finished, & running);
+			beaconsend_start(beaconsend[count]);
+		}
+		for (count = 0; count < devices; count++) {
+			beaconsend_stop(beaconsend[count]);
+		}
+		bench_stop(bench, "beaconsend_schedule", devices, devices);
+
+		// Allow the pending timers to fire so the chains can finish cleanly
+		while (running > 0) {
+			g_main_context_iteration(NULL, TRUE);
+		}
+
+		for (count = 0; count < devices; count++) {
+			beaconsend_delete(beaconsend[count]);
+		}
+	}
+}
+
+/**
+ * Time beacon delivery against the simulated Bluetooth adapter, with a mix
+ * of devices: most are in range with varying SDP latencies, while every
+ * fourth device is out of range so its pages time out. The simulation runs
+ * in virtual time, so the times reported are those the radio activity
+ * would take, rather than the time taken to run the benchmark.
+ *
+ * For each number of devices the following are reported:
+ *
+ *  - The time until the first beacon is received by a device.
+ *  - The time until every in-range device has received a beacon.
+ *  - The time for beaconsend_stop() to complete for all devices.
+ *  - The peak number of simultaneous connections and the number of
+ *    connection attempts refused because the adapter was busy.
+ *
+ * @param bench The benchmark run to output the results to.
+ */
+static void bench_beacons_sim(Bench * bench) {
+	BeaconSend * beaconsend[BENCH_MAX_DEVICES];
+	char addresses[BENCH_MAX_DEVICES][18];
+	MockBtDevice device;
+	MockBtStats const * stats;
+	int devices;
+	int count;
+	int running;
+	int inrange;
+	gint64 start;
+	gint64 first;
+	gint64 all;
+	size_t expected;
+
+	timesource_set_virtual(TRUE);
+
+	for (devices = 4; devices <= BENCH_MAX_DEVICES; devices *= 2) {
+		mockbtsim_start(timesource_timeout_add);
+		stats = mockbtsim_get_stats();
+
+		inrange = 0;
+		for (count = 0; count < devices; count++) {
+			snprintf(addresses[count], sizeof(addresses[count]), "00:00:00:00:00:%02X", count);
+			device.address = addresses[count];
+			device.inrange = ((count % 4) != 3);
+			device.sdplatency = 100 + ((count * 37) % 400);
+			device.rfcommdelay = 300;
+			device.throughput = 2000;
+			device.channel = 1;
+			mockbtsim_add_device(& device);
+			if (device.inrange) {
+				inrange++;
+			}
+		}
+		expected = inrange * strlen(BENCH_QRTEXT);
+
+		running = devices;
+		start = timesource_get_monotonic_time();
+		for (count = 0; count < devices; count++) {
+			beaconsend[count] = beaconsend_new();
+			beaconsend_set_device(beaconsend[count], addresses[count]);
+			beaconsend_set_code(beaconsend[count], BENCH_QRTEXT);
+			beaconsend_set_finished_callback(beaconsend[count], bench_beacon_finished, & running);
+			beaconsend_start(beaconsend[count]);
+		}
+
+		// Run until every in-range device has received at least one beacon
+		first = -1;
+		all = -1;
+		while ((all < 0) && ((timesource_get_monotonic_time() - start) < BENCH_SIM_LIMIT)) {
+			timesource_advance(BENCH_SIM_STEP);
+			if ((first < 0) && (stats->bytesreceived > 0)) {
+				first = timesource_get_monotonic_time() - start;
+			}
+			if (stats->bytesreceived >= expected) {
+				all = timesource_get_monotonic_time() - start;
+			}
+		}
+		bench_output(bench, "beaconsend_sim_first_beacon", devices, 1, first * 1000.0);
+		bench_output(bench, "beaconsend_sim_all_beacons", devices, 1, all * 1000.0);
+
+		// Time how long it takes for all of the event chains to wind down
+		start = timesource_get_monotonic_time();
+		for (count = 0; count < devices; count++) {
+			beaconsend_stop(beaconsend[count]);
+		}
+		while ((running > 0) && ((timesource_get_monotonic_time() - start) < BENCH_SIM_LIMIT)) {
+			timesource_advance(BENCH_SIM_STEP);
+		}
+		bench_output(bench, "beaconsend_sim_teardown", devices, 1, (timesource_get_monotonic_time() - start) * 1000.0);
+		bench_output_value(bench, "beaconsend_sim_max_connections", devices, stats->maxactive);
+		bench_output_value(bench, "beaconsend_sim_busy", devices, stats->busy);
+
+		for (count = 0; count < devices; count++) {
+			beaconsend_delete(beaconsend[count]);
+		}
+		mockbtsim_stop();
+	}
+
+	timesource_set_virtual(FALSE);
+}
+
+#ifdef TESTPICO_SUPPORTED
+/**
+ * Callback for when a Service has stopped.
+ *
+ * @param service The service that stopped.
+ * @param user_data A bool to set to true.
+ */
+static void bench_service_stopped(Service * service, void * user_data) {
+	bool * stopped = (bool *)user_data;
+
+	*stopped = TRUE;
+}
+
+/**
+ * Perform a single complete authentication between a Service and a
+ * simulated Pico, from the service starting to it stopping.
+ *
+ * @param service The service to authenticate to, which will be deleted.
+ * @param connect The function to connect the simulated Pico with.
+ * @return true if the authentication succeeded, false o/w.
+ */
+static bool bench_authenticate(Service * service, TestPicoConnect connect) {
+	Shared * shared;
+	Buffer * extradata;
+	Buffer * picoextradata;
+	Json * json;
+	TestPico * testpico;
+	char const * beacon;
+	bool stopped;
+	bool result;
+
+	shared = shared_new();
+	shared_load_or_generate_keys(shared, "tests/keydir/" PUB_FILE, "tests/keydir/" PRIV_FILE);
+	extradata = buffer_new(0);
+	picoextradata = buffer_new(0);
+	stopped = FALSE;
+	result = FALSE;
+
+	service_set_beacons(service, FALSE);
+	service_set_stop_callback(service, bench_service_stopped, & stopped);
+	service_start(service, shared, NULL, extradata);
+
+	beacon = service_get_beacon(service);
+	json = json_new();
+	if (json_deserialize_string(json, beacon, strlen(beacon)) && (json_get_type(json, "sa") == JSONTYPE_STRING)) {
+		testpico = testpico_new();
+		testpico_set_connect(testpico, connect, NULL);
+		buffer_append_string(picoextradata, "bench");
+		testpico_set_extradata(testpico, picoextradata);
+		testpico_start(testpico, json_get_string(json, "sa"));
+
+		while ((stopped == FALSE) || (testpico_get_done(testpico) == FALSE)) {
+			g_main_context_iteration(NULL, TRUE);
+		}
+		result = testpico_get_result(testpico);
+		testpico_delete(testpico);
+	}
+	else {
+		service_stop(service);
+		while (stopped == FALSE) {
+			g_main_context_iteration(NULL, TRUE);
+		}
+	}
+	json_delete(json);
+
+	service_delete(service);
+	buffer_delete(picoextradata);
+	buffer_delete(extradata);
+	shared_delete(shared);
+
+	return result;
+}
+
+/**
+ * Time complete authentications with a simulated Pico. The direct TCP
+ * channel is measured on loopback. The Rendezvous Point channel needs a
+ * Rendezvous Point to relay through, so is only measured if PICO_BENCH_RVP
+ * is set in the environment.
+ *
+ * @param bench The benchmark run to output the results to.
+ */
+static void bench_channels(Bench * bench) {
+	ServiceTcp * servicetcp;
+	int count;
+	int failures;
+
+	failures = 0;
+	bench_start(bench);
+	for (count = 0; count < BENCH_ITERATIONS_AUTH; count++) {
+		servicetcp = servicetcp_new();
+		servicetcp_set_host(servicetcp, "127.0.0.1");
+		if (bench_authenticate((Service *)servicetcp, testpico_connect_tcp) == FALSE) {
+			failures++;
+		}
+	}
+	bench_stop(bench, "servicetcp_authenticate", -1, BENCH_ITERATIONS_AUTH);
+	bench_output_value(bench, "servicetcp_authenticate_failures", -1, failures);
+
+	if (g_getenv("PICO_BENCH_RVP") != NULL) {
+		failures = 0;
+		bench_start(bench);
+		for (count = 0; count < BENCH_ITERATIONS_AUTH; count++) {
+			if (bench_authenticate((Service *)servicervp_new(), testpico_connect_rvp) == FALSE) {
+				failures++;
+			}
+		}
+		bench_stop(bench, "servicervp_authenticate", -1, BENCH_ITERATIONS_AUTH);
+		bench_output_value(bench, "servicervp_authenticate_failures", -1, failures);
+	}
+}
+
+#endif
+
+/**
+ * Main entry point for the benchmarks.
+ *
+ * @return Always returns 0.
+ */
+int main(void) {
+	Bench bench;
+
+	bench.results = 0;
+
+	printf("[");
+	bench_processstore(& bench);
+	bench_authconfig(& bench);
+	bench_qrcode(& bench);
+	bench_externalconfig(& bench);
+	bench_users(& bench);
+	bench_keycache(& bench);
+	bench_keycache_sign(& bench);
+	bench_beacons(& bench);
+	bench_beacons_sim(& bench);
+#ifdef TESTPICO_SUPPORTED
+	bench_channels(& bench);
+#endif
+	printf("\n]\n");
+
+	return 0;
+}
@@ -1,5 +1,36 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include "mockbt.h"
+#include <stdio.h>
+#include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <dlfcn.h>
+
+typedef int (*SocketFunction)(int domain, int type, int protocol);
+typedef int (*ConnectFunction)(int fd, const struct sockaddr *addr, socklen_t len);
+
+// The socket() and connect() that would have been called without the mocks
+static int real_socket(int domain, int type, int protocol) {
+	static SocketFunction function = NULL;
+
+	if (function == NULL) {
+		function = (SocketFunction)dlsym(RTLD_NEXT, "socket");
+	}
+
+	return function(domain, type, protocol);
+}
+
+static int real_connect(int fd, const struct sockaddr *addr, socklen_t len) {
+	static ConnectFunction function = NULL;
+
+	if (function == NULL) {
+		function = (ConnectFunction)dlsym(RTLD_NEXT, "connect");
+	}
+
+	return function(fd, addr, len);
+}
 
 bt_err_t bt_init_default(void) {
 	return 0; //BT_SUCCESS
@@ -20,6 +51,26 @@ bt_err_t bt_list_load_default(bt_device_list_t *list, const char *filename) {
 	return BT_ERR_UNKNOWN;
 }
 
+bt_err_t bt_list_add_device_default(bt_device_list_t *list, const bt_addr_t *addr) {
+	return BT_SUCCESS;
+}
+
+bt_err_t bt_list_save_default(bt_device_list_t *list, const char *filename) {
+	FILE * file;
+
+	file = fopen(filename, "w");
+	if (file == NULL) {
+		return BT_ERR_UNKNOWN;
+	}
+	fclose(file);
+	return BT_SUCCESS;
+}
+
+bt_err_t bt_str_to_addr_default(const char *str, bt_addr_t *addr) {
+	memset(addr, 0, sizeof(bt_addr_t));
+	return BT_SUCCESS;
+}
+
 bt_err_t bt_str_to_uuid_default(const char *str, bt_uuid_t *uuid) {
 #define BT_UUID_FORMAT		"%02x%02x%02x%02x-%02x%02x-%02x%02x-" \
 								"%02x%02x-%02x%02x%02x%02x%02x%02x"
@@ -77,12 +128,23 @@ int sdp_get_access_protos_default(const sdp_record_t *rec, sdp_list_t **protos)
 	return 0;
 }
 
+int socket_default(int domain, int type, int protocol) {
+	return real_socket(domain, type, protocol);
+}
+
+int connect_default(int fd, const struct sockaddr *addr, socklen_t len) {
+	return real_connect(fd, addr, len);
+}
+
 BTFunctions bt_funcs = {
 	.bt_init = bt_init_default,
 	.bt_exit = bt_exit_default,
 	.bt_list_new = bt_list_new_default,
 	.bt_list_delete = bt_list_delete_default,
 	.bt_list_load = bt_list_load_default,
+	.bt_list_add_device = bt_list_add_device_default,
+	.bt_list_save = bt_list_save_default,
+	.bt_str_to_addr = bt_str_to_addr_default,
 	.bt_str_to_uuid = bt_str_to_uuid_default,
 	.str2ba = str2ba_default,
 	.sdp_close = sdp_close_default,
@@ -94,6 +156,8 @@ BTFunctions bt_funcs = {
 	.sdp_uuid128_create = sdp_uuid128_create_default,
 	.sdp_list_free = sdp_list_free_default,
 	.sdp_get_access_protos = sdp_get_access_protos_default,
+	.socket = socket_default,
+	.connect = connect_default,
 };
 
 bt_err_t bt_init(void) {
@@ -115,6 +179,18 @@ bt_err_t bt_list_load(bt_device_list_t *list, const char *filename) {
 	return bt_funcs.bt_list_load(list, filename);
 }
 
+bt_err_t bt_list_add_device(bt_device_list_t *list, const bt_addr_t *addr) {
+	return bt_funcs.bt_list_add_device(list, addr);
+}
+
+bt_err_t bt_list_save(bt_device_list_t *list, const char *filename) {
+	return bt_funcs.bt_list_save(list, filename);
+}
+
+bt_err_t bt_str_to_addr(const char *str, bt_addr_t *addr) {
+	return bt_funcs.bt_str_to_addr(str, addr);
+}
+
 bt_err_t bt_str_to_uuid(const char *str, bt_uuid_t *uuid) {
 	return bt_funcs.bt_str_to_uuid(str, uuid);
 }
@@ -164,3 +240,30 @@ int sdp_get_access_protos(const sdp_record_t *rec, sdp_list_t **protos) {
 	return bt_funcs.sdp_get_access_protos(rec, protos);
 }
 
+// Only Bluetooth sockets go through the mocks; everything else goes straight
+// to the real functions
+int socket(int domain, int type, int protocol) {
+	int fd;
+
+	if (domain == AF_BLUETOOTH) {
+		fd = bt_funcs.socket(domain, type, protocol);
+	}
+	else {
+		fd = real_socket(domain, type, protocol);
+	}
+
+	return fd;
+}
+
+int connect(int fd, const struct sockaddr *addr, socklen_t len) {
+	int result;
+
+	if ((addr != NULL) && (addr->sa_family == AF_BLUETOOTH)) {
+		result = bt_funcs.connect(fd, addr, len);
+	}
+	else {
+		result = real_connect(fd, addr, len);
+	}
+
+	return result;
+}
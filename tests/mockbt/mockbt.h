@@ -1,3 +1,4 @@
+#include <sys/socket.h>
 #include <picobt/bt.h>
 #include <picobt/devicelist.h>
 #include "../../src/beaconsend.h"
@@ -8,6 +9,9 @@ typedef struct {
 	bt_device_list_t* (*bt_list_new)(void);
 	void (*bt_list_delete)(bt_device_list_t *list);
 	bt_err_t (*bt_list_load)(bt_device_list_t *list, const char *filename);
+	bt_err_t (*bt_list_add_device)(bt_device_list_t *list, const bt_addr_t *addr);
+	bt_err_t (*bt_list_save)(bt_device_list_t *list, const char *filename);
+	bt_err_t (*bt_str_to_addr)(const char *str, bt_addr_t *addr);
 	bt_err_t (*bt_str_to_uuid)(const char *str, bt_uuid_t *uuid);
 
 	int (*str2ba)(const char *str, bdaddr_t *ba);
@@ -22,6 +26,9 @@ typedef struct {
 	void (*sdp_list_free)(sdp_list_t *list, sdp_free_func_t f);
 	int (*sdp_get_access_protos)(const sdp_record_t *rec, sdp_list_t **protos);
 
+	int (*socket)(int domain, int type, int protocol);
+	int (*connect)(int fd, const struct sockaddr *addr, socklen_t len);
+
 } BTFunctions;
 
 extern BTFunctions bt_funcs;
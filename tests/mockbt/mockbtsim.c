@@ -0,0 +1,685 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Simulated Bluetooth adapter and devices for tests and benchmarks
+ * @section DESCRIPTION
+ *
+ * Each simulated connection (an SDP session or an RFCOMM link) is a local
+ * socket pair. The local end is handed to the code under test, while the
+ * simulator keeps the remote end to act as the device.
+ *
+ * To stop the local end becoming writable (which is how a non-blocking
+ * connect signals completion) until the configured delay has passed, the
+ * simulator fills the socket's send buffer with padding. When the delay
+ * expires the padding is drained from the remote end, so the local end
+ * becomes writable. If the device is out of range the remote end is
+ * closed instead, so the local end hangs up.
+ *
+ * Once an RFCOMM link is established, the remote end reads the data sent
+ * at the device's configured throughput, until the local end is closed.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/rfcomm.h>
+#include <bluetooth/sdp.h>
+#include <bluetooth/sdp_lib.h>
+#include "mockbt.h"
+#include "mockbtsim.h"
+
+// Defines
+
+/**
+ * @brief The interval in milliseconds at which devices read incoming data
+ */
+#define MOCKBTSIM_TICK (10)
+
+/**
+ * @brief The size of the send buffer for the local end of each connection
+ *
+ * Keeping this small reduces the padding needed to block the socket.
+ */
+#define MOCKBTSIM_SNDBUF (4096)
+
+/**
+ * @brief The maximum number of devices that can be added to the simulation
+ */
+#define MOCKBTSIM_MAX_DEVICES (64)
+
+// Structure definitions
+
+/**
+ * @brief A simulated connection to a device
+ *
+ * The sdp_session_t must come first, so that the session pointer returned
+ * by sdp_connect() can be cast back to the link.
+ */
+typedef struct _MockBtLink {
+	sdp_session_t session;
+	bool sdp;
+	int local;
+	int remote;
+	MockBtDevice device;
+	size_t padding;
+	bool counted;
+	bool established;
+	guint timerid;
+	sdp_list_t response;
+	sdp_list_t protos;
+} MockBtLink;
+
+// Function prototypes
+
+static int mockbtsim_str2ba(const char * str, bdaddr_t * ba);
+static MockBtDevice const * mockbtsim_find_device(bdaddr_t const * address);
+static MockBtLink * mockbtsim_link_new(bool sdp);
+static void mockbtsim_link_delete(MockBtLink * link);
+static bool mockbtsim_link_count(MockBtLink * link);
+static void mockbtsim_link_block(MockBtLink * link);
+static void mockbtsim_link_unblock(MockBtLink * link);
+static gboolean mockbtsim_sdp_ready(gpointer user_data);
+static gboolean mockbtsim_rfcomm_ready(gpointer user_data);
+static gboolean mockbtsim_rfcomm_receive(gpointer user_data);
+static sdp_session_t * mockbtsim_sdp_connect(const bdaddr_t * src, const bdaddr_t * dst, uint32_t flags);
+static int mockbtsim_sdp_get_socket(const sdp_session_t * session);
+static int mockbtsim_sdp_service_search_attr_req(sdp_session_t * session, const sdp_list_t * search, sdp_attrreq_type_t reqtype, const sdp_list_t * attrid_list, sdp_list_t ** rsp_list);
+static int mockbtsim_sdp_get_access_protos(const sdp_record_t * rec, sdp_list_t ** protos);
+static int mockbtsim_sdp_get_proto_port(const sdp_list_t * list, int proto);
+static int mockbtsim_sdp_close(sdp_session_t * session);
+static int mockbtsim_socket(int domain, int type, int protocol);
+static int mockbtsim_connect(int fd, const struct sockaddr * addr, socklen_t len);
+
+// Local variables
+
+/**
+ * @brief The mockbt functions in place before the simulator was started
+ */
+static BTFunctions saved;
+
+/**
+ * @brief Whether the simulator is currently installed
+ */
+static bool running = FALSE;
+
+/**
+ * @brief The function used to schedule the simulated delays
+ */
+static MockBtTimeoutAdd timeoutadd = g_timeout_add;
+
+/**
+ * @brief The number of simultaneous connections the adapter allows
+ */
+static int maxconnections = MOCKBTSIM_MAX_CONNECTIONS;
+
+/**
+ * @brief The time in milliseconds for a page to an absent device to fail
+ */
+static guint pagetimeout = MOCKBTSIM_PAGE_TIMEOUT;
+
+/**
+ * @brief The devices in the simulation, along with their parsed addresses
+ */
+static MockBtDevice devices[MOCKBTSIM_MAX_DEVICES];
+static bdaddr_t addresses[MOCKBTSIM_MAX_DEVICES];
+static int devicenum = 0;
+
+/**
+ * @brief The characteristics used for any device not explicitly added
+ */
+static MockBtDevice defaultdevice;
+
+/**
+ * @brief All of the connections that are currently open
+ */
+static GList * links = NULL;
+
+/**
+ * @brief Counters for the activity seen by the adapter
+ */
+static MockBtStats stats;
+
+// Function definitions
+
+/**
+ * Install the simulator in place of the current mockbt functions. Any
+ * devices previously added are removed, the statistics are reset and the
+ * adapter returns to its default configuration.
+ *
+ * By default devices that haven't been added are out of range.
+ *
+ * @param timeout_add The function to use to schedule the simulated delays,
+ *        for example timesource_timeout_add(), or NULL to use
+ *        g_timeout_add().
+ */
+void mockbtsim_start(MockBtTimeoutAdd timeout_add) {
+	if (running) {
+		mockbtsim_stop();
+	}
+
+	timeoutadd = (timeout_add != NULL) ? timeout_add : g_timeout_add;
+	maxconnections = MOCKBTSIM_MAX_CONNECTIONS;
+	pagetimeout = MOCKBTSIM_PAGE_TIMEOUT;
+	devicenum = 0;
+	memset(& stats, 0, sizeof(stats));
+
+	defaultdevice.address = NULL;
+	defaultdevice.inrange = FALSE;
+	defaultdevice.sdplatency = 0;
+	defaultdevice.rfcommdelay = 0;
+	defaultdevice.throughput = 0;
+	defaultdevice.channel = -1;
+
+	saved = bt_funcs;
+	bt_funcs.str2ba = mockbtsim_str2ba;
+	bt_funcs.sdp_connect = mockbtsim_sdp_connect;
+	bt_funcs.sdp_get_socket = mockbtsim_sdp_get_socket;
+	bt_funcs.sdp_service_search_attr_req = mockbtsim_sdp_service_search_attr_req;
+	bt_funcs.sdp_get_access_protos = mockbtsim_sdp_get_access_protos;
+	bt_funcs.sdp_get_proto_port = mockbtsim_sdp_get_proto_port;
+	bt_funcs.sdp_close = mockbtsim_sdp_close;
+	bt_funcs.socket = mockbtsim_socket;
+	bt_funcs.connect = mockbtsim_connect;
+
+	running = TRUE;
+}
+
+/**
+ * Remove the simulator, restoring the mockbt functions that were in place
+ * when it was started. Any connections still open are torn down from the
+ * device end.
+ */
+void mockbtsim_stop() {
+	if (running) {
+		while (links != NULL) {
+			mockbtsim_link_delete((MockBtLink *)links->data);
+		}
+
+		bt_funcs = saved;
+		running = FALSE;
+	}
+}
+
+/**
+ * Configure the simulated adapter.
+ *
+ * @param max The number of simultaneous connections (SDP sessions and
+ *        RFCOMM links combined) the adapter allows. Further connection
+ *        attempts fail immediately with EBUSY.
+ * @param timeout The time in milliseconds for a page to an absent device
+ *        to fail.
+ */
+void mockbtsim_set_adapter(int max, guint timeout) {
+	maxconnections = max;
+	pagetimeout = timeout;
+}
+
+/**
+ * Add a device to the simulation. The details are copied, but the address
+ * string is only used during this call.
+ *
+ * @param device The characteristics of the device to add.
+ */
+void mockbtsim_add_device(MockBtDevice const * device) {
+	if (devicenum < MOCKBTSIM_MAX_DEVICES) {
+		mockbtsim_str2ba(device->address, & addresses[devicenum]);
+		devices[devicenum] = *device;
+		devices[devicenum].address = NULL;
+		devicenum++;
+	}
+}
+
+/**
+ * Set the characteristics used for any device that hasn't been explicitly
+ * added to the simulation.
+ *
+ * @param device The characteristics to use. The address is ignored.
+ */
+void mockbtsim_set_default_device(MockBtDevice const * device) {
+	defaultdevice = *device;
+	defaultdevice.address = NULL;
+}
+
+/**
+ * Get the counters for the activity seen by the simulated adapter since
+ * the simulator was started.
+ *
+ * @return The counters. These belong to the simulator.
+ */
+MockBtStats const * mockbtsim_get_stats() {
+	return & stats;
+}
+
+/**
+ * Replacement for str2ba() that parses the address properly, so that
+ * devices can be distinguished.
+ *
+ * @param str The address in string form.
+ * @param ba Returns the parsed address.
+ * @return 0 on success, -1 if the string isn't a valid address.
+ */
+static int mockbtsim_str2ba(const char * str, bdaddr_t * ba) {
+	unsigned int bytes[6];
+	int count;
+	int result;
+
+	memset(ba, 0, sizeof(bdaddr_t));
+	result = -1;
+	if ((str != NULL) && (sscanf(str, "%02x:%02x:%02x:%02x:%02x:%02x", & bytes[0], & bytes[1], & bytes[2], & bytes[3], & bytes[4], & bytes[5]) == 6)) {
+		// Addresses are stored in reverse order
+		for (count = 0; count < 6; count++) {
+			ba->b[5 - count] = (uint8_t)bytes[count];
+		}
+		result = 0;
+	}
+
+	return result;
+}
+
+/**
+ * Find the characteristics of the device with the given address.
+ *
+ * @param address The address of the device to find.
+ * @return The device's characteristics, or the default characteristics if
+ *         it hasn't been added.
+ */
+static MockBtDevice const * mockbtsim_find_device(bdaddr_t const * address) {
+	MockBtDevice const * device;
+	int count;
+
+	device = & defaultdevice;
+	for (count = 0; count < devicenum; count++) {
+		if (memcmp(& addresses[count], address, sizeof(bdaddr_t)) == 0) {
+			device = & devices[count];
+		}
+	}
+
+	return device;
+}
+
+/**
+ * Create a new simulated connection, backed by a socket pair.
+ *
+ * @param sdp TRUE if this is an SDP session, FALSE for an RFCOMM link.
+ * @return The new connection, or NULL if the sockets couldn't be created.
+ */
+static MockBtLink * mockbtsim_link_new(bool sdp) {
+	MockBtLink * link;
+	int fds[2];
+	int size;
+
+	link = NULL;
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) == 0) {
+		size = MOCKBTSIM_SNDBUF;
+		setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, & size, sizeof(size));
+
+		link = g_new0(MockBtLink, 1);
+		link->sdp = sdp;
+		link->local = fds[0];
+		link->remote = fds[1];
+		link->device = defaultdevice;
+		link->session.sock = fds[0];
+		links = g_list_prepend(links, link);
+	}
+
+	return link;
+}
+
+/**
+ * Tear down a simulated connection from the device end. The local end
+ * belongs to the code under test, so is left open.
+ *
+ * @param link The connection to tear down.
+ */
+static void mockbtsim_link_delete(MockBtLink * link) {
+	if (link->timerid != 0) {
+		g_source_remove(link->timerid);
+		link->timerid = 0;
+	}
+	if (link->remote >= 0) {
+		close(link->remote);
+		link->remote = -1;
+	}
+	if (link->counted) {
+		stats.active--;
+		link->counted = FALSE;
+	}
+
+	links = g_list_remove(links, link);
+	g_free(link);
+}
+
+/**
+ * Claim one of the adapter's connection slots for the connection.
+ *
+ * @param link The connection to claim the slot for.
+ * @return TRUE if a slot was available, FALSE if the adapter is busy.
+ */
+static bool mockbtsim_link_count(MockBtLink * link) {
+	bool result;
+
+	result = FALSE;
+	if (stats.active < maxconnections) {
+		stats.active++;
+		if (stats.active > stats.maxactive) {
+			stats.maxactive = stats.active;
+		}
+		link->counted = TRUE;
+		result = TRUE;
+	}
+	else {
+		stats.busy++;
+	}
+
+	return result;
+}
+
+/**
+ * Fill the local end's send buffer so that it doesn't report as writable.
+ *
+ * @param link The connection to block.
+ */
+static void mockbtsim_link_block(MockBtLink * link) {
+	char padding[MOCKBTSIM_SNDBUF];
+	ssize_t written;
+
+	memset(padding, 0, sizeof(padding));
+	do {
+		written = write(link->local, padding, sizeof(padding));
+		if (written > 0) {
+			link->padding += written;
+		}
+	} while (written > 0);
+}
+
+/**
+ * Drain the padding from the remote end so that the local end becomes
+ * writable.
+ *
+ * @param link The connection to unblock.
+ */
+static void mockbtsim_link_unblock(MockBtLink * link) {
+	char discard[MOCKBTSIM_SNDBUF];
+	ssize_t received;
+
+	received = 1;
+	while ((link->padding > 0) && (received > 0)) {
+		received = read(link->remote, discard, MIN(sizeof(discard), link->padding));
+		if (received > 0) {
+			link->padding -= received;
+		}
+	}
+}
+
+/**
+ * Called when an SDP session's connection delay has passed. The session
+ * becomes writable if the device is in range, or hangs up if the page
+ * timed out.
+ *
+ * @param user_data The connection, cast to (void *).
+ * @return Always FALSE, so the timeout only fires once.
+ */
+static gboolean mockbtsim_sdp_ready(gpointer user_data) {
+	MockBtLink * link = (MockBtLink *)user_data;
+
+	link->timerid = 0;
+	if (link->device.inrange) {
+		mockbtsim_link_unblock(link);
+		link->established = TRUE;
+	}
+	else {
+		stats.pagetimeouts++;
+		close(link->remote);
+		link->remote = -1;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Called when an RFCOMM link's connection delay has passed. If the device
+ * is in range the connect completes and the device starts receiving data.
+ * If the page timed out the link hangs up.
+ *
+ * @param user_data The connection, cast to (void *).
+ * @return Always FALSE, so the timeout only fires once.
+ */
+static gboolean mockbtsim_rfcomm_ready(gpointer user_data) {
+	MockBtLink * link = (MockBtLink *)user_data;
+
+	link->timerid = 0;
+	if (link->device.inrange) {
+		mockbtsim_link_unblock(link);
+		link->established = TRUE;
+		link->timerid = timeoutadd(MOCKBTSIM_TICK, mockbtsim_rfcomm_receive, link);
+	}
+	else {
+		stats.pagetimeouts++;
+		mockbtsim_link_delete(link);
+	}
+
+	return FALSE;
+}
+
+/**
+ * Called periodically while an RFCOMM link is established, to read the data
+ * sent to the device at the device's throughput. Once the local end has
+ * been closed and all the data read, the link is torn down.
+ *
+ * @param user_data The connection, cast to (void *).
+ * @return TRUE while the link remains open, FALSE o/w.
+ */
+static gboolean mockbtsim_rfcomm_receive(gpointer user_data) {
+	MockBtLink * link = (MockBtLink *)user_data;
+	char data[MOCKBTSIM_SNDBUF];
+	size_t allowance;
+	ssize_t received;
+	gboolean more;
+
+	allowance = G_MAXSIZE;
+	if (link->device.throughput > 0) {
+		allowance = MAX(1, (link->device.throughput * MOCKBTSIM_TICK) / 1000);
+	}
+
+	more = TRUE;
+	received = 1;
+	while ((allowance > 0) && (received > 0)) {
+		received = read(link->remote, data, MIN(sizeof(data), allowance));
+		if (received > 0) {
+			stats.bytesreceived += received;
+			allowance -= received;
+		}
+		else if (received == 0) {
+			// The local end has closed the link
+			stats.linksclosed++;
+			link->timerid = 0;
+			mockbtsim_link_delete(link);
+			more = FALSE;
+		}
+	}
+
+	return more;
+}
+
+/**
+ * Replacement for sdp_connect(). Opens a non-blocking SDP session to the
+ * device, which becomes writable after the device's SDP latency.
+ */
+static sdp_session_t * mockbtsim_sdp_connect(const bdaddr_t * src, const bdaddr_t * dst, uint32_t flags) {
+	MockBtLink * link;
+	sdp_session_t * session;
+
+	stats.sdpconnects++;
+	session = NULL;
+	link = mockbtsim_link_new(TRUE);
+	if (link != NULL) {
+		link->device = *mockbtsim_find_device(dst);
+		if (mockbtsim_link_count(link)) {
+			mockbtsim_link_block(link);
+			link->timerid = timeoutadd(link->device.inrange ? link->device.sdplatency : pagetimeout, mockbtsim_sdp_ready, link);
+			session = & link->session;
+		}
+		else {
+			close(link->local);
+			mockbtsim_link_delete(link);
+			errno = EBUSY;
+		}
+	}
+
+	return session;
+}
+
+/**
+ * Replacement for sdp_get_socket().
+ */
+static int mockbtsim_sdp_get_socket(const sdp_session_t * session) {
+	return ((MockBtLink const *)session)->local;
+}
+
+/**
+ * Replacement for sdp_service_search_attr_req(). Returns a single record if
+ * the session was established and the device advertises the service.
+ */
+static int mockbtsim_sdp_service_search_attr_req(sdp_session_t * session, const sdp_list_t * search, sdp_attrreq_type_t reqtype, const sdp_list_t * attrid_list, sdp_list_t ** rsp_list) {
+	MockBtLink * link = (MockBtLink *)session;
+	int result;
+
+	stats.sdpsearches++;
+	*rsp_list = NULL;
+	result = -1;
+	if (link->established && (link->device.channel >= 0)) {
+		// The record is never dereferenced outside the simulator
+		link->response.data = link;
+		link->response.next = NULL;
+		*rsp_list = & link->response;
+		result = 0;
+	}
+
+	return result;
+}
+
+/**
+ * Replacement for sdp_get_access_protos().
+ */
+static int mockbtsim_sdp_get_access_protos(const sdp_record_t * rec, sdp_list_t ** protos) {
+	MockBtLink * link = (MockBtLink *)rec;
+
+	link->protos.data = link;
+	link->protos.next = NULL;
+	*protos = & link->protos;
+
+	return 0;
+}
+
+/**
+ * Replacement for sdp_get_proto_port(). Returns the channel the device
+ * advertises the service on.
+ */
+static int mockbtsim_sdp_get_proto_port(const sdp_list_t * list, int proto) {
+	return ((MockBtLink const *)list->data)->device.channel;
+}
+
+/**
+ * Replacement for sdp_close(). As with BlueZ, this closes the session's
+ * socket.
+ */
+static int mockbtsim_sdp_close(sdp_session_t * session) {
+	MockBtLink * link = (MockBtLink *)session;
+
+	close(link->local);
+	mockbtsim_link_delete(link);
+
+	return 0;
+}
+
+/**
+ * Replacement for socket(). RFCOMM sockets are simulated; anything else is
+ * passed on to the functions in place before the simulator was started.
+ */
+static int mockbtsim_socket(int domain, int type, int protocol) {
+	MockBtLink * link;
+	int fd;
+
+	if ((domain == AF_BLUETOOTH) && (protocol == BTPROTO_RFCOMM)) {
+		fd = -1;
+		link = mockbtsim_link_new(FALSE);
+		if (link != NULL) {
+			fd = link->local;
+		}
+	}
+	else {
+		fd = saved.socket(domain, type, protocol);
+	}
+
+	return fd;
+}
+
+/**
+ * Replacement for connect(). Connecting a simulated RFCOMM socket starts a
+ * non-blocking connect that completes after the device's RFCOMM delay.
+ * Anything else is passed on to the functions in place before the
+ * simulator was started.
+ */
+static int mockbtsim_connect(int fd, const struct sockaddr * addr, socklen_t len) {
+	GList * item;
+	MockBtLink * link;
+	int result;
+
+	link = NULL;
+	if (addr->sa_family == AF_BLUETOOTH) {
+		for (item = links; (item != NULL) && (link == NULL); item = item->next) {
+			if ((((MockBtLink *)item->data)->sdp == FALSE) && (((MockBtLink *)item->data)->local == fd)) {
+				link = (MockBtLink *)item->data;
+			}
+		}
+	}
+
+	if (link != NULL) {
+		stats.rfcommconnects++;
+		link->device = *mockbtsim_find_device(& ((struct sockaddr_rc const *)addr)->rc_bdaddr);
+		if (mockbtsim_link_count(link)) {
+			mockbtsim_link_block(link);
+			link->timerid = timeoutadd(link->device.inrange ? link->device.rfcommdelay : pagetimeout, mockbtsim_rfcomm_ready, link);
+			errno = EINPROGRESS;
+		}
+		else {
+			// The socket remains open for the caller to close
+			mockbtsim_link_delete(link);
+			errno = EBUSY;
+		}
+		result = -1;
+	}
+	else {
+		result = saved.connect(fd, addr, len);
+	}
+
+	return result;
+}
+
@@ -0,0 +1,123 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Simulated Bluetooth adapter and devices for tests and benchmarks
+ * @section DESCRIPTION
+ *
+ * The plain mockbt stubs return fixed results immediately. The simulator
+ * replaces them with a model of a Bluetooth adapter and a set of nearby
+ * devices, each with its own SDP latency, RFCOMM connect delay and
+ * throughput. Devices can also be set as out of range, in which case
+ * connections to them fail after the adapter's page timeout. The adapter
+ * only allows a limited number of simultaneous connections, as with a real
+ * controller.
+ *
+ * Connections are represented by local socket pairs, so the code under test
+ * sees real file descriptors that become writable, hang up or deliver data
+ * with the configured timing. The timing is driven by a timeout function
+ * passed to mockbtsim_start(), so it can be run against the virtual clock
+ * to simulate long periods of radio activity quickly.
+ *
+ */
+
+#ifndef __MOCKBTSIM_H
+#define __MOCKBTSIM_H (1)
+
+#include <stdbool.h>
+#include <glib.h>
+
+// Defines
+
+/**
+ * @brief The default time a page to an absent device takes to fail
+ *
+ * This is the BlueZ default of 8192 slots of 0.625 ms.
+ */
+#define MOCKBTSIM_PAGE_TIMEOUT (5120)
+
+/**
+ * @brief The default number of simultaneous connections the adapter allows
+ */
+#define MOCKBTSIM_MAX_CONNECTIONS (7)
+
+// Structure definitions
+
+/**
+ * @brief The characteristics of a simulated device
+ *
+ *  - address: the device's MAC address, in the usual string form.
+ *  - inrange: FALSE if pages to the device should time out.
+ *  - sdplatency: time in milliseconds for an SDP session to be established.
+ *  - rfcommdelay: time in milliseconds for an RFCOMM connect to complete.
+ *  - throughput: the rate in bytes per second at which the device receives
+ *    data, or 0 for unlimited.
+ *  - channel: the RFCOMM channel the Pico service is advertised on, or -1
+ *    if the device doesn't advertise the service.
+ *
+ */
+typedef struct _MockBtDevice {
+	char const * address;
+	bool inrange;
+	guint sdplatency;
+	guint rfcommdelay;
+	guint throughput;
+	int channel;
+} MockBtDevice;
+
+/**
+ * @brief Counters for the activity seen by the simulated adapter
+ */
+typedef struct _MockBtStats {
+	int sdpconnects;
+	int sdpsearches;
+	int pagetimeouts;
+	int rfcommconnects;
+	int busy;
+	int linksclosed;
+	int active;
+	int maxactive;
+	size_t bytesreceived;
+} MockBtStats;
+
+/**
+ * @brief A function for adding timeouts, with the same semantics as
+ * g_timeout_add()
+ */
+typedef guint (*MockBtTimeoutAdd)(guint interval, GSourceFunc function, gpointer data);
+
+// Function prototypes
+
+void mockbtsim_start(MockBtTimeoutAdd timeout_add);
+void mockbtsim_stop();
+void mockbtsim_set_adapter(int maxconnections, guint pagetimeout);
+void mockbtsim_add_device(MockBtDevice const * device);
+void mockbtsim_set_default_device(MockBtDevice const * device);
+MockBtStats const * mockbtsim_get_stats();
+
+// Function definitions
+
+#endif
+
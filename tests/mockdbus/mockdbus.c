@@ -39,6 +39,16 @@ void dbus_connection_unref_default(DBusConnection * connection) {
 void dbus_error_free_default(DBusError * error) {
 }
 
+void dbus_message_set_no_reply_default(DBusMessage * message, dbus_bool_t no_reply) {
+}
+
+dbus_bool_t dbus_connection_send_default(DBusConnection * connection, DBusMessage * message, dbus_uint32_t * serial) {
+	return true;
+}
+
+void dbus_connection_flush_default(DBusConnection * connection) {
+}
+
 DBUSFunctions dbus_funcs = {
 	.dbus_bus_get = dbus_bus_get_default,
 	.dbus_message_new_method_call = dbus_message_new_method_call_default,
@@ -50,6 +60,9 @@ DBUSFunctions dbus_funcs = {
 	.dbus_message_unref = dbus_message_unref_default,
 	.dbus_connection_unref = dbus_connection_unref_default,
 	.dbus_error_free = dbus_error_free_default,
+	.dbus_message_set_no_reply = dbus_message_set_no_reply_default,
+	.dbus_connection_send = dbus_connection_send_default,
+	.dbus_connection_flush = dbus_connection_flush_default,
 };
 
 DBusConnection * dbus_bus_get(DBusBusType type, DBusError * error) {
@@ -99,5 +112,17 @@ void dbus_error_free(DBusError * error) {
 	dbus_funcs.dbus_error_free(error);
 }
 
+void dbus_message_set_no_reply(DBusMessage * message, dbus_bool_t no_reply) {
+	dbus_funcs.dbus_message_set_no_reply(message, no_reply);
+}
+
+dbus_bool_t dbus_connection_send(DBusConnection * connection, DBusMessage * message, dbus_uint32_t * serial) {
+	return dbus_funcs.dbus_connection_send(connection, message, serial);
+}
+
+void dbus_connection_flush(DBusConnection * connection) {
+	dbus_funcs.dbus_connection_flush(connection);
+}
+
 
 
@@ -12,6 +12,9 @@ typedef struct {
 	void (*dbus_message_unref)(DBusMessage * message);
 	void (*dbus_connection_unref)(DBusConnection * connection);
 	void (*dbus_error_free)(DBusError * error);
+	void (*dbus_message_set_no_reply)(DBusMessage * message, dbus_bool_t no_reply);
+	dbus_bool_t (*dbus_connection_send)(DBusConnection * connection, DBusMessage * message, dbus_uint32_t * serial);
+	void (*dbus_connection_flush)(DBusConnection * connection);
 } DBUSFunctions;
 
 extern DBUSFunctions dbus_funcs;
@@ -1,6 +1,65 @@
 #include "mockpam.h"
+#include <stddef.h>
+#include <string.h>
 
-PamFunctions pam_funcs;
+#define MOCKPAM_DATA_MAX (8)
+
+typedef struct {
+	const char * name;
+	void * data;
+	void (*cleanup)(pam_handle_t *pamh, void *data, int error_status);
+} MockPamData;
+
+static MockPamData mockpam_data[MOCKPAM_DATA_MAX];
+
+// By default, module data is kept as PAM would keep it, calling the cleanup
+// function of any item that's replaced
+
+static int pam_set_data_default(pam_handle_t *pamh, const char *module_data_name, void *data, void (*cleanup)(pam_handle_t *pamh, void *data, int error_status)) {
+	int pos;
+	int slot;
+
+	slot = -1;
+	for (pos = 0; pos < MOCKPAM_DATA_MAX; pos++) {
+		if ((mockpam_data[pos].name != NULL) && (strcmp(mockpam_data[pos].name, module_data_name) == 0)) {
+			if (mockpam_data[pos].cleanup != NULL) {
+				mockpam_data[pos].cleanup(pamh, mockpam_data[pos].data, PAM_DATA_REPLACE | PAM_SUCCESS);
+			}
+			mockpam_data[pos].name = NULL;
+		}
+		if ((slot < 0) && (mockpam_data[pos].name == NULL)) {
+			slot = pos;
+		}
+	}
+
+	if (slot >= 0) {
+		mockpam_data[slot].name = module_data_name;
+		mockpam_data[slot].data = data;
+		mockpam_data[slot].cleanup = cleanup;
+	}
+
+	return (slot >= 0) ? PAM_SUCCESS : PAM_BUF_ERR;
+}
+
+static int pam_get_data_default(const pam_handle_t *pamh, const char *module_data_name, const void **data) {
+	int pos;
+	int result;
+
+	result = PAM_NO_MODULE_DATA;
+	for (pos = 0; pos < MOCKPAM_DATA_MAX; pos++) {
+		if ((mockpam_data[pos].name != NULL) && (strcmp(mockpam_data[pos].name, module_data_name) == 0)) {
+			*data = mockpam_data[pos].data;
+			result = PAM_SUCCESS;
+		}
+	}
+
+	return result;
+}
+
+PamFunctions pam_funcs = {
+	.pam_set_data = pam_set_data_default,
+	.pam_get_data = pam_get_data_default,
+};
 
 int pam_set_item(pam_handle_t *pamh, int item_type, const void *item) {
 	return pam_funcs.pam_set_item(pamh, item_type, item);
@@ -14,3 +73,25 @@ int pam_get_user(pam_handle_t *pamh, const char **user, const char *prompt) {
 	return pam_funcs.pam_get_user(pamh, user, prompt);
 }
 
+int pam_set_data(pam_handle_t *pamh, const char *module_data_name, void *data, void (*cleanup)(pam_handle_t *pamh, void *data, int error_status)) {
+	return pam_funcs.pam_set_data(pamh, module_data_name, data, cleanup);
+}
+
+int pam_get_data(const pam_handle_t *pamh, const char *module_data_name, const void **data) {
+	return pam_funcs.pam_get_data(pamh, module_data_name, data);
+}
+
+// Clean up the module data kept by the default functions, as pam_end() would
+
+void mockpam_end(pam_handle_t *pamh, int error_status) {
+	int pos;
+
+	for (pos = 0; pos < MOCKPAM_DATA_MAX; pos++) {
+		if (mockpam_data[pos].name != NULL) {
+			mockpam_data[pos].name = NULL;
+			if (mockpam_data[pos].cleanup != NULL) {
+				mockpam_data[pos].cleanup(pamh, mockpam_data[pos].data, error_status);
+			}
+		}
+	}
+}
@@ -4,7 +4,11 @@ typedef struct {
 	int (*pam_set_item)(pam_handle_t *pamh, int item_type, const void *item);
 	int (*pam_get_item)(const pam_handle_t *pamh, int item_type, const void **item);
 	int (*pam_get_user)(pam_handle_t *pamh, const char **user, const char *prompt);
+	int (*pam_set_data)(pam_handle_t *pamh, const char *module_data_name, void *data, void (*cleanup)(pam_handle_t *pamh, void *data, int error_status));
+	int (*pam_get_data)(const pam_handle_t *pamh, const char *module_data_name, const void **data);
 } PamFunctions;
 
 extern PamFunctions pam_funcs;
 
+void mockpam_end(pam_handle_t *pamh, int error_status);
+
@@ -33,13 +33,23 @@
 
 #include <check.h>
 #include <stdbool.h>
+#include <string.h>
 #include <unistd.h>
 #include <pico/shared.h>
 #include <pico/users.h>
 #include <pico/beacons.h>
+#include <glib.h>
+#include "mockbt/mockbtsim.h"
+#include "../src/beaconsend.h"
+#include "../src/timesource.h"
 
 // Defines
 
+/**
+ * @brief The beacon code sent to the simulated devices
+ */
+#define TEST_CODE "{\"sn\":\"Pico\",\"t\":\"KP\"}"
+
 // Structure definitions
 
 // Function prototypes
@@ -52,7 +62,90 @@ START_TEST(test_beacons) {
 }
 END_TEST
 
+START_TEST(test_beacons_sim) {
+	BeaconSend * beaconsend;
+	MockBtDevice device;
+	MockBtStats const * stats;
+
+	timesource_set_virtual(TRUE);
+	mockbtsim_start(timesource_timeout_add);
+	stats = mockbtsim_get_stats();
+
+	device.address = "00:11:22:33:44:55";
+	device.inrange = TRUE;
+	device.sdplatency = 200;
+	device.rfcommdelay = 300;
+	device.throughput = 0;
+	device.channel = 3;
+	mockbtsim_add_device(& device);
+
+	// A device in range should receive the beacon once the delays pass
+	beaconsend = beaconsend_new();
+	beaconsend_set_device(beaconsend, device.address);
+	beaconsend_set_code(beaconsend, TEST_CODE);
+	beaconsend_start(beaconsend);
+
+	// The first search happens after the beacon gap of two seconds
+	timesource_advance(2100 * 1000);
+	ck_assert_int_eq(stats->sdpconnects, 1);
+	ck_assert_int_eq(stats->active, 1);
+	ck_assert_int_eq(stats->rfcommconnects, 0);
+
+	timesource_advance(200 * 1000);
+	ck_assert_int_eq(stats->sdpsearches, 1);
+	ck_assert_int_eq(stats->rfcommconnects, 1);
+	ck_assert_int_eq(stats->bytesreceived, 0);
+
+	timesource_advance(400 * 1000);
+	ck_assert_int_eq(stats->bytesreceived, strlen(TEST_CODE));
+	ck_assert_int_eq(stats->linksclosed, 1);
+	ck_assert_int_eq(stats->active, 0);
+	ck_assert_int_eq(stats->maxactive, 1);
+
+	beaconsend_stop(beaconsend);
+	timesource_advance(2100 * 1000);
+	beaconsend_delete(beaconsend);
 
+	// A device out of range should fail after the page timeout
+	mockbtsim_start(timesource_timeout_add);
+	stats = mockbtsim_get_stats();
+	beaconsend = beaconsend_new();
+	beaconsend_set_device(beaconsend, "66:77:88:99:AA:BB");
+	beaconsend_set_code(beaconsend, TEST_CODE);
+	beaconsend_start(beaconsend);
+
+	timesource_advance((2000 + MOCKBTSIM_PAGE_TIMEOUT - 100) * 1000);
+	ck_assert_int_eq(stats->sdpconnects, 1);
+	ck_assert_int_eq(stats->pagetimeouts, 0);
+
+	timesource_advance(200 * 1000);
+	ck_assert_int_eq(stats->pagetimeouts, 1);
+	ck_assert_int_eq(stats->rfcommconnects, 0);
+	ck_assert_int_eq(stats->active, 0);
+
+	beaconsend_stop(beaconsend);
+	timesource_advance(2100 * 1000);
+	beaconsend_delete(beaconsend);
+
+	// The adapter should refuse connections beyond its limit
+	mockbtsim_set_adapter(0, MOCKBTSIM_PAGE_TIMEOUT);
+	beaconsend = beaconsend_new();
+	beaconsend_set_device(beaconsend, device.address);
+	beaconsend_set_code(beaconsend, TEST_CODE);
+	beaconsend_start(beaconsend);
+
+	timesource_advance(2100 * 1000);
+	ck_assert_int_eq(stats->busy, 1);
+	ck_assert_int_eq(stats->active, 0);
+
+	beaconsend_stop(beaconsend);
+	timesource_advance(2100 * 1000);
+	beaconsend_delete(beaconsend);
+
+	mockbtsim_stop();
+	timesource_set_virtual(FALSE);
+}
+END_TEST
 
 int main (void) {
 	int number_failed;
@@ -66,6 +159,7 @@ int main (void) {
 	tc = tcase_create("Beacons");
 	tcase_set_timeout(tc, 20.0);
 	tcase_add_test(tc, test_beacons);
+	tcase_add_test(tc, test_beacons_sim);
 
 	suite_add_tcase(s, tc);
 	sr = srunner_create(s);
@@ -0,0 +1,192 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Worker pool tests
+ * @section DESCRIPTION
+ *
+ * Performs unit tests for the worker pool used to offload cryptographic
+ * work from the main loop.
+ *
+ */
+
+#include <check.h>
+#include <stdbool.h>
+#include <glib.h>
+#include "../src/cryptopool.h"
+
+// Defines
+
+/**
+ * @brief The number of items of work to submit
+ */
+#define TEST_ITEMS (100)
+
+/**
+ * @brief The longest time in microseconds to wait for the work to complete
+ */
+#define TEST_COMPLETE_TIMEOUT (10 * G_USEC_PER_SEC)
+
+// Structure definitions
+
+/**
+ * @brief Records where and whether each item of work was performed
+ */
+typedef struct _TestItem {
+	GThread * worked;
+	GThread * completed;
+	int * count;
+	guint64 result;
+} TestItem;
+
+// Function prototypes
+
+static void test_work(void * user_data);
+static void test_complete(void * user_data);
+
+// Function definitions
+
+/**
+ * Work function that performs a small amount of computation, recording the
+ * thread it ran on.
+ *
+ * @param user_data The TestItem, cast to (void *).
+ */
+static void test_work(void * user_data) {
+	TestItem * item = (TestItem *)user_data;
+	guint64 value;
+	int count;
+
+	value = 1;
+	for (count = 0; count < 10000; count++) {
+		value = (value * 6364136223846793005ull) + 1442695040888963407ull;
+	}
+	item->result = value;
+	item->worked = g_thread_self();
+}
+
+/**
+ * Completion function that records the thread it ran on and counts the
+ * number of completions.
+ *
+ * @param user_data The TestItem, cast to (void *).
+ */
+static void test_complete(void * user_data) {
+	TestItem * item = (TestItem *)user_data;
+
+	item->completed = g_thread_self();
+	(*item->count)++;
+}
+
+START_TEST(test_cryptopool_complete) {
+	CryptoPool * cryptopool;
+	TestItem items[TEST_ITEMS];
+	int count;
+	int completed;
+	gint64 start;
+
+	cryptopool = cryptopool_new(NULL);
+	ck_assert_int_ge(cryptopool_get_threads(cryptopool), 1);
+	ck_assert_int_le(cryptopool_get_threads(cryptopool), CRYPTOPOOL_MAX_THREADS);
+
+	completed = 0;
+	for (count = 0; count < TEST_ITEMS; count++) {
+		items[count].worked = NULL;
+		items[count].completed = NULL;
+		items[count].count = & completed;
+		items[count].result = 0;
+		cryptopool_submit(cryptopool, test_work, test_complete, & items[count]);
+	}
+
+	// Completions are only delivered when the main context is iterated
+	start = g_get_monotonic_time();
+	while ((completed < TEST_ITEMS) && ((g_get_monotonic_time() - start) < TEST_COMPLETE_TIMEOUT)) {
+		g_main_context_iteration(NULL, TRUE);
+	}
+	ck_assert_int_eq(completed, TEST_ITEMS);
+
+	for (count = 0; count < TEST_ITEMS; count++) {
+		ck_assert(items[count].result != 0);
+		// The work should happen off the main thread, the completion on it
+		ck_assert(items[count].worked != g_thread_self());
+		ck_assert(items[count].completed == g_thread_self());
+	}
+
+	cryptopool_delete(cryptopool);
+}
+END_TEST
+
+START_TEST(test_cryptopool_delete) {
+	CryptoPool * cryptopool;
+	TestItem items[TEST_ITEMS];
+	int count;
+	int completed;
+
+	cryptopool = cryptopool_new(NULL);
+
+	completed = 0;
+	for (count = 0; count < TEST_ITEMS; count++) {
+		items[count].worked = NULL;
+		items[count].completed = NULL;
+		items[count].count = & completed;
+		items[count].result = 0;
+		cryptopool_submit(cryptopool, test_work, test_complete, & items[count]);
+	}
+
+	// Deleting should finish the outstanding work and deliver its completions
+	cryptopool_delete(cryptopool);
+	ck_assert_int_eq(completed, TEST_ITEMS);
+
+	for (count = 0; count < TEST_ITEMS; count++) {
+		ck_assert(items[count].result != 0);
+		ck_assert(items[count].completed == g_thread_self());
+	}
+}
+END_TEST
+
+int main (void) {
+	int number_failed;
+	Suite * s;
+	SRunner *sr;
+	TCase * tc;
+
+	s = suite_create("Pico Crypto Pool");
+
+	// Crypto pool test case
+	tc = tcase_create("CryptoPool");
+	tcase_set_timeout(tc, 20.0);
+	tcase_add_test(tc, test_cryptopool_complete);
+	tcase_add_test(tc, test_cryptopool_delete);
+
+	suite_add_tcase(s, tc);
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+
+	return (number_failed == 0) ? 0 : -1;
+}
+
@@ -0,0 +1,256 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Adaptive heartbeat interval tests
+ * @section DESCRIPTION
+ *
+ * Performs unit tests for the policy choosing the interval between
+ * continuous authentication heartbeats, feeding it heartbeats that arrive
+ * on time and late.
+ *
+ */
+
+#include <check.h>
+#include <stdbool.h>
+#include <glib.h>
+#include "../src/heartbeat.h"
+
+// Defines
+
+/**
+ * @brief The shortest interval to use in the tests
+ */
+#define TEST_MINIMUM (5000)
+
+/**
+ * @brief The longest interval to use in the tests
+ */
+#define TEST_MAXIMUM (30000)
+
+// Structure definitions
+
+// Function prototypes
+
+// Function definitions
+
+START_TEST(test_heartbeat_grow) {
+	Heartbeat * heartbeat;
+	gint64 now;
+	int interval;
+	int beat;
+
+	heartbeat = heartbeat_new(TEST_MINIMUM, TEST_MAXIMUM);
+	ck_assert_int_eq(heartbeat_get_interval(heartbeat), TEST_MINIMUM);
+
+	// The first heartbeat has nothing to be measured against
+	now = 1000;
+	interval = heartbeat_beat(heartbeat, now);
+	ck_assert_int_eq(interval, TEST_MINIMUM);
+
+	// Each run of on-time heartbeats doubles the interval
+	for (beat = 0; beat < HEARTBEAT_STABLE_BEATS; beat++) {
+		now += interval + 500;
+		interval = heartbeat_beat(heartbeat, now);
+	}
+	ck_assert_int_eq(interval, 2 * TEST_MINIMUM);
+
+	for (beat = 0; beat < HEARTBEAT_STABLE_BEATS; beat++) {
+		now += interval + 500;
+		interval = heartbeat_beat(heartbeat, now);
+	}
+	ck_assert_int_eq(interval, 4 * TEST_MINIMUM);
+
+	// But never beyond the maximum
+	for (beat = 0; beat < 4 * HEARTBEAT_STABLE_BEATS; beat++) {
+		now += interval + 500;
+		interval = heartbeat_beat(heartbeat, now);
+	}
+	ck_assert_int_eq(interval, TEST_MAXIMUM);
+	ck_assert_int_eq(heartbeat_get_maximum(heartbeat), TEST_MAXIMUM);
+
+	heartbeat_delete(heartbeat);
+}
+END_TEST
+
+START_TEST(test_heartbeat_late) {
+	Heartbeat * heartbeat;
+	gint64 now;
+	int interval;
+	int beat;
+
+	heartbeat = heartbeat_new(TEST_MINIMUM, TEST_MAXIMUM);
+
+	now = 0;
+	interval = heartbeat_beat(heartbeat, now);
+	for (beat = 0; beat < 2 * HEARTBEAT_STABLE_BEATS; beat++) {
+		now += interval;
+		interval = heartbeat_beat(heartbeat, now);
+	}
+	ck_assert_int_eq(interval, 4 * TEST_MINIMUM);
+
+	// Lateness within the tolerance is fine
+	now += interval + (interval / 4);
+	interval = heartbeat_beat(heartbeat, now);
+	ck_assert_int_eq(interval, 4 * TEST_MINIMUM);
+
+	// A late heartbeat drops straight back to the minimum
+	now += interval + (interval / 4) + 1;
+	interval = heartbeat_beat(heartbeat, now);
+	ck_assert_int_eq(interval, TEST_MINIMUM);
+
+	// The tolerance never drops below the fixed minimum
+	now += interval + HEARTBEAT_TOLERANCE;
+	interval = heartbeat_beat(heartbeat, now);
+	ck_assert_int_eq(interval, TEST_MINIMUM);
+
+	heartbeat_delete(heartbeat);
+}
+END_TEST
+
+START_TEST(test_heartbeat_anomaly) {
+	Heartbeat * heartbeat;
+	gint64 now;
+	int interval;
+	int beat;
+
+	heartbeat = heartbeat_new(TEST_MINIMUM, TEST_MAXIMUM);
+
+	now = 0;
+	interval = heartbeat_beat(heartbeat, now);
+	for (beat = 0; beat < HEARTBEAT_STABLE_BEATS; beat++) {
+		now += interval;
+		interval = heartbeat_beat(heartbeat, now);
+	}
+	ck_assert_int_eq(interval, 2 * TEST_MINIMUM);
+
+	// The link dropping resets the interval
+	heartbeat_anomaly(heartbeat);
+	ck_assert_int_eq(heartbeat_get_interval(heartbeat), TEST_MINIMUM);
+
+	// The gap spanning the outage isn't counted as a late heartbeat
+	now += 60000;
+	interval = heartbeat_beat(heartbeat, now);
+	ck_assert_int_eq(interval, TEST_MINIMUM);
+	for (beat = 0; beat < HEARTBEAT_STABLE_BEATS; beat++) {
+		now += interval;
+		interval = heartbeat_beat(heartbeat, now);
+	}
+	ck_assert_int_eq(interval, 2 * TEST_MINIMUM);
+
+	heartbeat_delete(heartbeat);
+
+	// A maximum below the minimum fixes the interval at the minimum
+	heartbeat = heartbeat_new(TEST_MINIMUM, 0);
+	now = 0;
+	interval = heartbeat_beat(heartbeat, now);
+	for (beat = 0; beat < 2 * HEARTBEAT_STABLE_BEATS; beat++) {
+		now += interval;
+		interval = heartbeat_beat(heartbeat, now);
+	}
+	ck_assert_int_eq(interval, TEST_MINIMUM);
+
+	heartbeat_delete(heartbeat);
+}
+END_TEST
+
+START_TEST(test_heartbeat_away) {
+	Heartbeat * heartbeat;
+	gint64 now;
+	int interval;
+	int beat;
+
+	heartbeat = heartbeat_new(TEST_MINIMUM, TEST_MAXIMUM);
+	ck_assert(heartbeat_get_away(heartbeat) == false);
+
+	// The interval goes straight to the maximum while the user is away
+	heartbeat_set_away(heartbeat, true);
+	ck_assert(heartbeat_get_away(heartbeat) == true);
+	ck_assert_int_eq(heartbeat_get_interval(heartbeat), TEST_MAXIMUM);
+
+	now = 0;
+	interval = heartbeat_beat(heartbeat, now);
+	ck_assert_int_eq(interval, TEST_MAXIMUM);
+	for (beat = 0; beat < HEARTBEAT_STABLE_BEATS; beat++) {
+		now += interval;
+		interval = heartbeat_beat(heartbeat, now);
+	}
+	ck_assert_int_eq(interval, TEST_MAXIMUM);
+
+	// Reporting the same activity again changes nothing
+	heartbeat_set_away(heartbeat, true);
+	ck_assert_int_eq(heartbeat_get_interval(heartbeat), TEST_MAXIMUM);
+
+	// When the user comes back the Pico is probed quickly again
+	heartbeat_set_away(heartbeat, false);
+	ck_assert_int_eq(heartbeat_get_interval(heartbeat), TEST_MINIMUM);
+
+	// The heartbeat requested using the old interval isn't counted as early
+	now += TEST_MAXIMUM;
+	interval = heartbeat_beat(heartbeat, now);
+	ck_assert_int_eq(interval, TEST_MINIMUM);
+	for (beat = 0; beat < HEARTBEAT_STABLE_BEATS; beat++) {
+		now += interval;
+		interval = heartbeat_beat(heartbeat, now);
+	}
+	ck_assert_int_eq(interval, 2 * TEST_MINIMUM);
+
+	// A late heartbeat still drops to the minimum while the user is away
+	heartbeat_set_away(heartbeat, true);
+	now += 1000;
+	interval = heartbeat_beat(heartbeat, now);
+	now += interval + (interval / 4) + 1;
+	interval = heartbeat_beat(heartbeat, now);
+	ck_assert_int_eq(interval, TEST_MINIMUM);
+
+	heartbeat_delete(heartbeat);
+}
+END_TEST
+
+int main (void) {
+	int number_failed;
+	Suite * s;
+	SRunner *sr;
+	TCase * tc;
+
+	s = suite_create("Pico Heartbeat");
+
+	// Heartbeat test case
+	tc = tcase_create("Heartbeat");
+	tcase_set_timeout(tc, 20.0);
+	tcase_add_test(tc, test_heartbeat_grow);
+	tcase_add_test(tc, test_heartbeat_late);
+	tcase_add_test(tc, test_heartbeat_anomaly);
+	tcase_add_test(tc, test_heartbeat_away);
+
+	suite_add_tcase(s, tc);
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+
+	return (number_failed == 0) ? 0 : -1;
+}
@@ -0,0 +1,198 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Service identity key cache tests
+ * @section DESCRIPTION
+ *
+ * Performs unit tests for the cache of long-lived service identity keys.
+ *
+ */
+
+#include <check.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <glib.h>
+#include <openssl/evp.h>
+#include "pico/buffer.h"
+#include "pico/keypair.h"
+#include "../src/processstore.h"
+#include "../src/keycache.h"
+
+// Defines
+
+// Structure definitions
+
+// Function prototypes
+
+static Buffer * test_make_configdir();
+static void test_remove_configdir(Buffer * configdir);
+
+// Function definitions
+
+/**
+ * Create an empty temporary configuration directory.
+ *
+ * @return The directory path, including a trailing slash.
+ */
+static Buffer * test_make_configdir() {
+	Buffer * configdir;
+	gchar * dirname;
+
+	dirname = g_dir_make_tmp("test_keycache_XXXXXX", NULL);
+	ck_assert(dirname != NULL);
+
+	configdir = buffer_new(0);
+	buffer_append_string(configdir, dirname);
+	buffer_append_string(configdir, "/");
+	g_free(dirname);
+
+	return configdir;
+}
+
+/**
+ * Remove a temporary configuration directory and the key files in it.
+ *
+ * @param configdir The directory path, including a trailing slash.
+ */
+static void test_remove_configdir(Buffer * configdir) {
+	gchar * filename;
+
+	filename = g_strconcat(buffer_get_buffer(configdir), PUB_FILE, NULL);
+	unlink(filename);
+	g_free(filename);
+	filename = g_strconcat(buffer_get_buffer(configdir), PRIV_FILE, NULL);
+	unlink(filename);
+	g_free(filename);
+	rmdir(buffer_get_buffer(configdir));
+
+	buffer_delete(configdir);
+}
+
+START_TEST(test_keycache_reuse) {
+	KeyCache * keycache;
+	Buffer * configdir;
+	KeyPair * first;
+	KeyPair * second;
+
+	configdir = test_make_configdir();
+	keycache = keycache_new();
+
+	// The first request should generate and save a key
+	first = keycache_get(keycache, configdir);
+	ck_assert(first != NULL);
+
+	// Later requests should share the same key without reloading it
+	second = keycache_get(keycache, configdir);
+	ck_assert(second != first);
+	ck_assert(keypair_getprivatekey(second) == keypair_getprivatekey(first));
+
+	// Each caller owns its key pair, which outlives the cache
+	keypair_delete(second);
+	keycache_delete(keycache);
+	ck_assert(keypair_getprivatekey(first) != NULL);
+
+	// A new cache should load the saved key from disk
+	keycache = keycache_new();
+	second = keycache_get(keycache, configdir);
+	ck_assert(second != NULL);
+	keycache_delete(keycache);
+	ck_assert(EVP_PKEY_cmp(keypair_getprivatekey(first), keypair_getprivatekey(second)) == 1);
+	keypair_delete(first);
+	keypair_delete(second);
+
+	test_remove_configdir(configdir);
+}
+END_TEST
+
+START_TEST(test_keycache_reload) {
+	KeyCache * keycache;
+	Buffer * configdir;
+	Buffer * pubfilename;
+	Buffer * privfilename;
+	KeyPair * first;
+	KeyPair * second;
+	KeyPair * replacement;
+
+	configdir = test_make_configdir();
+	keycache = keycache_new();
+
+	first = keycache_get(keycache, configdir);
+	ck_assert(first != NULL);
+
+	// Re-key the service by overwriting the key files
+	pubfilename = buffer_new(0);
+	privfilename = buffer_new(0);
+	buffer_append_buffer(pubfilename, configdir);
+	buffer_append_buffer(privfilename, configdir);
+	buffer_append_string(pubfilename, PUB_FILE);
+	buffer_append_string(privfilename, PRIV_FILE);
+
+	// Make sure the modification time will differ
+	g_usleep(10000);
+	replacement = keypair_new();
+	keypair_generate(replacement);
+	keypair_export(replacement, buffer_get_buffer(pubfilename), buffer_get_buffer(privfilename));
+	keypair_delete(replacement);
+
+	// The cache should notice and load the new key
+	second = keycache_get(keycache, configdir);
+	ck_assert(second != NULL);
+	ck_assert(keypair_getprivatekey(second) != keypair_getprivatekey(first));
+	keypair_delete(first);
+	keypair_delete(second);
+
+	buffer_delete(pubfilename);
+	buffer_delete(privfilename);
+	keycache_delete(keycache);
+	test_remove_configdir(configdir);
+}
+END_TEST
+
+int main (void) {
+	int number_failed;
+	Suite * s;
+	SRunner *sr;
+	TCase * tc;
+
+	s = suite_create("Pico Key Cache");
+
+	// Key cache test case
+	tc = tcase_create("KeyCache");
+	tcase_set_timeout(tc, 20.0);
+	tcase_add_test(tc, test_keycache_reuse);
+	tcase_add_test(tc, test_keycache_reload);
+
+	suite_add_tcase(s, tc);
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+
+	return (number_failed == 0) ? 0 : -1;
+}
+
@@ -0,0 +1,494 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Session locking tests
+ * @section DESCRIPTION
+ *
+ * Performs unit tests for the Locker, using stand-in lock commands so that
+ * no real sessions are locked. Locking through logind is tested against a
+ * stand-in logind on a private bus.
+ *
+ */
+
+#include <check.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include "../src/locker.h"
+#include "../src/timesource.h"
+
+// Defines
+
+/**
+ * @brief The longest time in microseconds to wait for locks to complete
+ */
+#define TEST_WAIT (5000000)
+
+/**
+ * @brief A command that locks successfully
+ */
+#define TEST_COMMAND_SUCCEED "/bin/true"
+
+/**
+ * @brief A command that fails to lock
+ */
+#define TEST_COMMAND_FAIL "/bin/false"
+
+/**
+ * @brief The time in milliseconds the Locker waits for LockedHint
+ *
+ * This matches LOCKER_CONFIRM_TIMEOUT in locker.c.
+ */
+#define TEST_CONFIRM_TIMEOUT (3000)
+
+/**
+ * @brief The number of sessions the stand-in logind knows about
+ */
+#define TEST_SESSIONS (4)
+
+/**
+ * @brief The parts of logind's interfaces the Locker uses
+ */
+#define TEST_LOGIND_XML \
+	"<node>" \
+	"  <interface name='org.freedesktop.login1.Manager'>" \
+	"    <method name='ListSessions'>" \
+	"      <arg type='a(susso)' direction='out'/>" \
+	"    </method>" \
+	"    <method name='LockSession'>" \
+	"      <arg type='s' direction='in'/>" \
+	"    </method>" \
+	"  </interface>" \
+	"  <interface name='org.freedesktop.login1.Session'>" \
+	"    <property name='Type' type='s' access='read'/>" \
+	"    <property name='LockedHint' type='b' access='read'/>" \
+	"  </interface>" \
+	"</node>"
+
+// Structure definitions
+
+/**
+ * @brief A session known to the stand-in logind
+ *
+ * If confirm is set, the session's LockedHint is set as soon as it's asked
+ * to lock, as a screen locker would. The number of times it was asked to
+ * lock is counted.
+ */
+typedef struct _TestSession {
+	char const * id;
+	char const * user;
+	char const * type;
+	bool confirm;
+	bool lockedhint;
+	int locks;
+	char path[64];
+} TestSession;
+
+/**
+ * @brief A stand-in logind on a private bus
+ */
+typedef struct _TestLogind {
+	GTestDBus * bus;
+	GDBusConnection * connection;
+	GDBusNodeInfo * info;
+	guint ownerid;
+	guint objectids[TEST_SESSIONS + 1];
+	TestSession sessions[TEST_SESSIONS];
+	bool owned;
+} TestLogind;
+
+// Function prototypes
+
+static void wait_for_locks(Locker * locker, unsigned long finished);
+static TestLogind * test_logind_new(bool confirm);
+static void test_logind_delete(TestLogind * logind);
+static void test_logind_manager_call(GDBusConnection * connection, gchar const * sender, gchar const * object_path, gchar const * interface_name, gchar const * method_name, GVariant * parameters, GDBusMethodInvocation * invocation, gpointer user_data);
+static GVariant * test_logind_session_property(GDBusConnection * connection, gchar const * sender, gchar const * object_path, gchar const * interface_name, gchar const * property_name, GError ** error, gpointer user_data);
+static void test_logind_acquired(GDBusConnection * connection, gchar const * name, gpointer user_data);
+
+// Local variables
+
+/**
+ * @brief The methods of the stand-in logind's Manager
+ */
+static GDBusInterfaceVTable const test_manager_vtable = {
+	test_logind_manager_call,
+	NULL,
+	NULL
+};
+
+/**
+ * @brief The properties of the stand-in logind's sessions
+ */
+static GDBusInterfaceVTable const test_session_vtable = {
+	NULL,
+	test_logind_session_property,
+	NULL
+};
+
+// Function definitions
+
+/**
+ * Run the main loop until the given number of locks have finished, either
+ * successfully or not, or until the wait times out.
+ *
+ * @param locker The Locker performing the locks.
+ * @param finished The number of finished locks to wait for.
+ */
+static void wait_for_locks(Locker * locker, unsigned long finished) {
+	LockerStats stats;
+	gint64 end;
+
+	end = g_get_monotonic_time() + TEST_WAIT;
+	locker_get_stats(locker, & stats);
+	while (((stats.locks + stats.failures) < finished) && (g_get_monotonic_time() < end)) {
+		g_main_context_iteration(NULL, TRUE);
+		locker_get_stats(locker, & stats);
+	}
+}
+
+/**
+ * Start a private system bus with a stand-in logind on it. Alice has a text
+ * session and a graphical session, Bob has a graphical session and Carol
+ * only has a text session. Lockers created afterwards use the private bus.
+ *
+ * @param confirm true if the graphical sessions should set their LockedHint
+ *        when asked to lock, false if they should ignore the request.
+ * @return The newly created object.
+ */
+static TestLogind * test_logind_new(bool confirm) {
+	TestLogind * logind;
+	GError * error;
+	gchar const * address;
+	int count;
+	gint64 end;
+
+	logind = g_new0(TestLogind, 1);
+	logind->sessions[0] = (TestSession){"1", "alice", "tty", FALSE, FALSE, 0, ""};
+	logind->sessions[1] = (TestSession){"2", "alice", "x11", confirm, FALSE, 0, ""};
+	logind->sessions[2] = (TestSession){"3", "bob", "wayland", confirm, FALSE, 0, ""};
+	logind->sessions[3] = (TestSession){"4", "carol", "tty", FALSE, FALSE, 0, ""};
+
+	logind->bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+	g_test_dbus_up(logind->bus);
+	address = g_test_dbus_get_bus_address(logind->bus);
+	setenv("DBUS_SYSTEM_BUS_ADDRESS", address, TRUE);
+
+	error = NULL;
+	logind->connection = g_dbus_connection_new_for_address_sync(address, G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION, NULL, NULL, & error);
+	ck_assert_msg(logind->connection != NULL, "Failed to connect logind: %s", (error ? error->message : ""));
+
+	logind->info = g_dbus_node_info_new_for_xml(TEST_LOGIND_XML, & error);
+	ck_assert(logind->info != NULL);
+	logind->objectids[0] = g_dbus_connection_register_object(logind->connection, "/org/freedesktop/login1", g_dbus_node_info_lookup_interface(logind->info, "org.freedesktop.login1.Manager"), & test_manager_vtable, logind, NULL, & error);
+	ck_assert(logind->objectids[0] != 0);
+	for (count = 0; count < TEST_SESSIONS; count++) {
+		g_snprintf(logind->sessions[count].path, sizeof(logind->sessions[count].path), "/org/freedesktop/login1/session/_3%s", logind->sessions[count].id);
+		logind->objectids[count + 1] = g_dbus_connection_register_object(logind->connection, logind->sessions[count].path, g_dbus_node_info_lookup_interface(logind->info, "org.freedesktop.login1.Session"), & test_session_vtable, & logind->sessions[count], NULL, & error);
+		ck_assert(logind->objectids[count + 1] != 0);
+	}
+
+	logind->owned = FALSE;
+	logind->ownerid = g_bus_own_name_on_connection(logind->connection, "org.freedesktop.login1", G_BUS_NAME_OWNER_FLAGS_NONE, test_logind_acquired, NULL, logind, NULL);
+	end = g_get_monotonic_time() + TEST_WAIT;
+	while ((logind->owned == FALSE) && (g_get_monotonic_time() < end)) {
+		g_main_context_iteration(NULL, TRUE);
+	}
+	ck_assert(logind->owned == TRUE);
+
+	return logind;
+}
+
+/**
+ * Stop the stand-in logind and its private bus. Any Lockers using the bus
+ * must have been deleted.
+ *
+ * @param logind The object to free.
+ */
+static void test_logind_delete(TestLogind * logind) {
+	int count;
+
+	g_bus_unown_name(logind->ownerid);
+	for (count = 0; count < (TEST_SESSIONS + 1); count++) {
+		g_dbus_connection_unregister_object(logind->connection, logind->objectids[count]);
+	}
+	g_dbus_node_info_unref(logind->info);
+	g_dbus_connection_close_sync(logind->connection, NULL, NULL);
+	g_object_unref(logind->connection);
+	g_test_dbus_down(logind->bus);
+	g_object_unref(logind->bus);
+	unsetenv("DBUS_SYSTEM_BUS_ADDRESS");
+	g_free(logind);
+}
+
+/**
+ * Handle a call to the stand-in logind's Manager. Asking a session that
+ * confirms locks to lock sets its LockedHint and signals the change.
+ */
+static void test_logind_manager_call(GDBusConnection * connection, gchar const * sender, gchar const * object_path, gchar const * interface_name, gchar const * method_name, GVariant * parameters, GDBusMethodInvocation * invocation, gpointer user_data) {
+	TestLogind * logind = (TestLogind *)user_data;
+	GVariantBuilder builder;
+	GVariantBuilder changed;
+	TestSession * session;
+	gchar const * id;
+	int count;
+
+	if (g_strcmp0(method_name, "ListSessions") == 0) {
+		g_variant_builder_init(& builder, G_VARIANT_TYPE("a(susso)"));
+		for (count = 0; count < TEST_SESSIONS; count++) {
+			session = & logind->sessions[count];
+			g_variant_builder_add(& builder, "(susso)", session->id, (guint32)(1000 + count), session->user, "seat0", session->path);
+		}
+		g_dbus_method_invocation_return_value(invocation, g_variant_new("(a(susso))", & builder));
+	}
+	else {
+		g_variant_get(parameters, "(&s)", & id);
+		session = NULL;
+		for (count = 0; count < TEST_SESSIONS; count++) {
+			if (strcmp(logind->sessions[count].id, id) == 0) {
+				session = & logind->sessions[count];
+			}
+		}
+
+		if (session == NULL) {
+			g_dbus_method_invocation_return_dbus_error(invocation, "org.freedesktop.login1.NoSuchSession", "No such session");
+		}
+		else {
+			session->locks++;
+			g_dbus_method_invocation_return_value(invocation, NULL);
+			if (session->confirm) {
+				session->lockedhint = TRUE;
+				g_variant_builder_init(& changed, G_VARIANT_TYPE("a{sv}"));
+				g_variant_builder_add(& changed, "{sv}", "LockedHint", g_variant_new_boolean(TRUE));
+				g_dbus_connection_emit_signal(connection, NULL, session->path, "org.freedesktop.DBus.Properties", "PropertiesChanged", g_variant_new("(sa{sv}as)", "org.freedesktop.login1.Session", & changed, NULL), NULL);
+			}
+		}
+	}
+}
+
+/**
+ * Get a property of one of the stand-in logind's sessions.
+ */
+static GVariant * test_logind_session_property(GDBusConnection * connection, gchar const * sender, gchar const * object_path, gchar const * interface_name, gchar const * property_name, GError ** error, gpointer user_data) {
+	TestSession * session = (TestSession *)user_data;
+	GVariant * value;
+
+	if (g_strcmp0(property_name, "Type") == 0) {
+		value = g_variant_new_string(session->type);
+	}
+	else {
+		value = g_variant_new_boolean(session->lockedhint);
+	}
+
+	return value;
+}
+
+/**
+ * Callback for when the stand-in logind has its name on the bus.
+ */
+static void test_logind_acquired(GDBusConnection * connection, gchar const * name, gpointer user_data) {
+	TestLogind * logind = (TestLogind *)user_data;
+
+	logind->owned = TRUE;
+}
+
+START_TEST(test_locker_coalesce) {
+	Locker * locker;
+	LockerStats stats;
+
+	locker = locker_new();
+	locker_set_logind(locker, FALSE);
+	locker_set_command(locker, TEST_COMMAND_SUCCEED);
+
+	// The second lock for the same user joins the first
+	locker_lock(locker, "alice", 0);
+	locker_lock(locker, "alice", 0);
+	locker_lock(locker, "bob", 0);
+
+	wait_for_locks(locker, 2);
+	// Let anything else that might be outstanding finish
+	while (g_main_context_iteration(NULL, FALSE)) {
+	}
+
+	locker_get_stats(locker, & stats);
+	ck_assert_int_eq(stats.requests, 3);
+	ck_assert_int_eq(stats.coalesced, 1);
+	ck_assert_int_eq(stats.locks, 2);
+	ck_assert_int_eq(stats.commands, 2);
+	ck_assert_int_eq(stats.failures, 0);
+	ck_assert(stats.latencymax >= stats.latencylast);
+	ck_assert(stats.latencytotal >= stats.latencymax);
+
+	// Once the lock has finished, a new request starts a new lock
+	locker_lock(locker, "alice", 0);
+	wait_for_locks(locker, 3);
+
+	locker_get_stats(locker, & stats);
+	ck_assert_int_eq(stats.requests, 4);
+	ck_assert_int_eq(stats.coalesced, 1);
+	ck_assert_int_eq(stats.locks, 3);
+
+	locker_delete(locker);
+}
+END_TEST
+
+START_TEST(test_locker_fail) {
+	Locker * locker;
+	LockerStats stats;
+
+	locker = locker_new();
+	locker_set_logind(locker, FALSE);
+	locker_set_command(locker, TEST_COMMAND_FAIL);
+
+	locker_lock(locker, "alice", 0);
+	wait_for_locks(locker, 1);
+
+	locker_get_stats(locker, & stats);
+	ck_assert_int_eq(stats.requests, 1);
+	ck_assert_int_eq(stats.locks, 0);
+	ck_assert_int_eq(stats.failures, 1);
+	ck_assert_int_eq(stats.latencytotal, 0);
+
+	// A command that doesn't exist also fails
+	locker_set_command(locker, "/nonexistent/lock.sh");
+	locker_lock(locker, "alice", 0);
+	wait_for_locks(locker, 2);
+
+	locker_get_stats(locker, & stats);
+	ck_assert_int_eq(stats.failures, 2);
+
+	locker_delete(locker);
+}
+END_TEST
+
+START_TEST(test_locker_logind) {
+	TestLogind * logind;
+	Locker * locker;
+	LockerStats stats;
+
+	logind = test_logind_new(TRUE);
+	locker = locker_new();
+	locker_set_command(locker, TEST_COMMAND_SUCCEED);
+
+	// Only Alice's graphical session is locked, confirmed by its LockedHint
+	locker_lock(locker, "alice", 0);
+	wait_for_locks(locker, 1);
+
+	locker_get_stats(locker, & stats);
+	ck_assert_int_eq(stats.locks, 1);
+	ck_assert_int_eq(stats.commands, 0);
+	ck_assert_int_eq(stats.failures, 0);
+	ck_assert_int_eq(logind->sessions[0].locks, 0);
+	ck_assert_int_eq(logind->sessions[1].locks, 1);
+	ck_assert_int_eq(logind->sessions[2].locks, 0);
+
+	// A session that's already locked isn't asked again
+	locker_lock(locker, "alice", 0);
+	wait_for_locks(locker, 2);
+
+	locker_get_stats(locker, & stats);
+	ck_assert_int_eq(stats.locks, 2);
+	ck_assert_int_eq(logind->sessions[1].locks, 1);
+
+	// Carol has no graphical session, so the lock command is run
+	locker_lock(locker, "carol", 0);
+	wait_for_locks(locker, 3);
+
+	locker_get_stats(locker, & stats);
+	ck_assert_int_eq(stats.locks, 3);
+	ck_assert_int_eq(stats.commands, 1);
+	ck_assert_int_eq(logind->sessions[3].locks, 0);
+
+	locker_delete(locker);
+	test_logind_delete(logind);
+}
+END_TEST
+
+START_TEST(test_locker_unconfirmed) {
+	TestLogind * logind;
+	Locker * locker;
+	LockerStats stats;
+	gint64 end;
+
+	timesource_set_virtual(TRUE);
+	logind = test_logind_new(FALSE);
+	locker = locker_new();
+	locker_set_command(locker, TEST_COMMAND_SUCCEED);
+
+	locker_lock(locker, "bob", 0);
+	end = g_get_monotonic_time() + TEST_WAIT;
+	while ((logind->sessions[2].locks == 0) && (g_get_monotonic_time() < end)) {
+		g_main_context_iteration(NULL, FALSE);
+		g_usleep(1000);
+	}
+	ck_assert_int_eq(logind->sessions[2].locks, 1);
+
+	// Nothing is counted while waiting for the session's LockedHint
+	locker_get_stats(locker, & stats);
+	ck_assert_int_eq(stats.locks + stats.failures, 0);
+
+	// It never comes, so the lock command is run instead
+	timesource_advance(TEST_CONFIRM_TIMEOUT * 1000);
+	wait_for_locks(locker, 1);
+
+	locker_get_stats(locker, & stats);
+	ck_assert_int_eq(stats.locks, 1);
+	ck_assert_int_eq(stats.commands, 1);
+	ck_assert(stats.latencylast >= (TEST_CONFIRM_TIMEOUT * 1000));
+
+	locker_delete(locker);
+	test_logind_delete(logind);
+	timesource_set_virtual(FALSE);
+}
+END_TEST
+
+int main (void) {
+	int number_failed;
+	Suite * s;
+	SRunner *sr;
+	TCase * tc;
+
+	s = suite_create("Pico Locker");
+
+	// Locker test case
+	tc = tcase_create("Locker");
+	tcase_set_timeout(tc, 20.0);
+	tcase_add_test(tc, test_locker_coalesce);
+	tcase_add_test(tc, test_locker_fail);
+	tcase_add_test(tc, test_locker_logind);
+	tcase_add_test(tc, test_locker_unconfirmed);
+
+	suite_add_tcase(s, tc);
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+
+	return (number_failed == 0) ? 0 : -1;
+}
@@ -0,0 +1,495 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Memory budget tests
+ * @section DESCRIPTION
+ *
+ * Checks the heap memory used by each session held by the service stays
+ * within budget, so that a host with many simultaneous continuous sessions
+ * has a small, fixed memory footprint. Memory is measured by counting the
+ * bytes allocated on the heap using mallinfo2(), or mallinfo() where it
+ * isn't available, with the Bluetooth stack replaced by mocks.
+ *
+ * A session is also measured part way through an authentication, and once
+ * it's continuing, by authenticating a simulated Pico over the direct TCP
+ * channel on loopback. The simulated Pico runs in a child process, so that
+ * its own allocations aren't counted against the session. It needs libpico
+ * to allow a channel to be given its own transport, so these measurements
+ * are skipped if it doesn't.
+ *
+ */
+
+#include "config.h"
+
+#include <check.h>
+#include <stdbool.h>
+#include <string.h>
+#include <malloc.h>
+#include <glib.h>
+#include <pico/cryptosupport.h>
+#include <pico/base64.h>
+#include <pico/json.h>
+#include "mockbt/mockbt.h"
+#include "testpico.h"
+#include "../src/auththread.h"
+#include "../src/service.h"
+#include "../src/servicervp.h"
+#include "../src/servicebtc.h"
+
+// Defines
+
+/**
+ * @brief The number of sessions to create when measuring memory usage
+ *
+ * The sessions are created directly, rather than through the ProcessStore,
+ * which holds at most MAX_SIMULTANEOUS_AUTHS sessions at once. The budgets
+ * per session are what matter; they bound the footprint however many
+ * sessions the store allows.
+ */
+#define SESSIONS (1000)
+
+/**
+ * @brief The maximum heap memory in bytes an idle AuthThread may use
+ */
+#define BUDGET_AUTHTHREAD (16 * 1024)
+
+/**
+ * @brief The maximum heap memory in bytes an unstarted Service may use
+ */
+#define BUDGET_SERVICE (32 * 1024)
+
+/**
+ * @brief The maximum heap memory in bytes a continuing AuthThread may use
+ *
+ * This includes the session's Service, state machine, keys and users, as
+ * well as the TCP connection to the Pico.
+ */
+#define BUDGET_CONTINUING (96 * 1024)
+
+/**
+ * @brief The maximum heap memory in bytes an AuthThread may use part way
+ * through the handshake
+ *
+ * This includes the session's Service, the state of the handshake and the
+ * TCP connection to the Pico.
+ */
+#define BUDGET_AUTHENTICATING (96 * 1024)
+
+/**
+ * @brief The heap memory in bytes allowed to remain after deleting sessions
+ *
+ * Some small allocations (e.g. GLib's type system) can persist; anything
+ * more than this suggests a leak.
+ */
+#define LEAK_TOLERANCE (4 * 1024)
+
+/**
+ * @brief The longest time to wait for a session to change state, in
+ * microseconds
+ */
+#define TEST_WAIT (20 * 1000000)
+
+/**
+ * @brief The parameters used to start the continuing session
+ */
+#define TEST_CONTINUING_CONFIG "{\"continuous\":1,\"channeltype\":\"tcp\",\"beacons\":0,\"anyuser\":0,\"timeout\":0,\"configdir\":\"tests/keydir/\"}"
+
+/**
+ * @brief The user the simulated Pico authenticates as
+ */
+#define TEST_USERNAME "Bob"
+
+/**
+ * @brief The password the simulated Pico returns to the service
+ */
+#define TEST_PASSWORD "Passuser1"
+
+/**
+ * @brief Bob's symmetric key, as stored in tests/keydir/users.txt
+ */
+#define TEST_SYMMETRIC_B64 "+tuLmm0nYpgVjlrYihL6IA=="
+
+/**
+ * @brief The public part of Bob's Pico identity key
+ */
+#define TEST_PUBLIC_B64 "MFkwEwYHKoZIzj0CAQYIKoZIzj0DAQcDQgAEzpNscJDHgvg+49E79yDor/BP/ZFIXgmS5n9CaRUDN37mBgxeZFLWT2Q5PiNvOYsDm6yvt0VNCOz2r2vjRi+4qQ=="
+
+/**
+ * @brief The private part of Bob's Pico identity key
+ */
+#define TEST_PRIVATE_B64 "MIGHAgEAMBMGByqGSM49AgEGCCqGSM49AwEHBG0wawIBAQQg8c/POOuOEr4JCZ7hZZYlFHLKecNZAvZmHMLAsx6j0CChRANCAATOk2xwkMeC+D7j0Tv3IOiv8E/9kUheCZLmf0JpFQM3fuYGDF5kUtZPZDk+I285iwObrK+3RU0I7Pava+NGL7ip"
+
+// Structure definitions
+
+/**
+ * @brief The type of session to measure the memory use of
+ */
+typedef enum _SESSIONTYPE {
+	SESSIONTYPE_INVALID = -1,
+
+	SESSIONTYPE_IDLE,
+	SESSIONTYPE_RVP,
+	SESSIONTYPE_BTC,
+
+	SESSIONTYPE_NUM
+} SESSIONTYPE;
+
+// Function prototypes
+
+// Function definitions
+
+/**
+ * Return the number of bytes currently allocated on the heap.
+ *
+ * @return The number of allocated bytes.
+ */
+static size_t heap_used() {
+#ifdef HAVE_MALLINFO2
+	struct mallinfo2 info;
+
+	info = mallinfo2();
+
+	return info.uordblks + info.hblkhd;
+#else
+	struct mallinfo info;
+
+	info = mallinfo();
+
+	return (size_t)info.uordblks + (size_t)info.hblkhd;
+#endif
+}
+
+/**
+ * Create a session of a particular type.
+ *
+ * @param type The type of session to create.
+ * @param continuous Whether the session should be continuous.
+ * @return The newly created session, as the AuthThread or Service.
+ */
+static void * session_new(SESSIONTYPE type, bool continuous) {
+	void * session;
+
+	switch (type) {
+	case SESSIONTYPE_RVP:
+		session = servicervp_new();
+		service_set_continuous((Service *)session, continuous);
+		break;
+	case SESSIONTYPE_BTC:
+		session = servicebtc_new();
+		service_set_continuous((Service *)session, continuous);
+		break;
+	default:
+		session = auththread_new();
+		break;
+	}
+
+	return session;
+}
+
+/**
+ * Delete a session of a particular type.
+ *
+ * @param type The type of session to delete.
+ * @param session The session to delete.
+ */
+static void session_delete(SESSIONTYPE type, void * session) {
+	switch (type) {
+	case SESSIONTYPE_RVP:
+	case SESSIONTYPE_BTC:
+		service_delete((Service *)session);
+		break;
+	default:
+		auththread_delete((AuthThread *)session);
+		break;
+	}
+}
+
+/**
+ * Measure the mean heap memory used per session for many sessions of the
+ * same type, and check no memory remains once they've all been deleted.
+ *
+ * @param type The type of session to measure.
+ * @param continuous Whether the sessions should be continuous.
+ * @param leaked Returns the number of bytes not released on deletion.
+ * @return The mean number of bytes allocated for each session.
+ */
+static size_t measure_sessions(SESSIONTYPE type, bool continuous, long * leaked) {
+	void ** sessions;
+	size_t before;
+	size_t during;
+	size_t after;
+	int count;
+
+	sessions = CALLOC(sizeof(void *), SESSIONS);
+
+	// Create and delete one session first to exclude one-off allocations
+	session_delete(type, session_new(type, continuous));
+
+	before = heap_used();
+	for (count = 0; count < SESSIONS; count++) {
+		sessions[count] = session_new(type, continuous);
+	}
+	during = heap_used();
+
+	for (count = 0; count < SESSIONS; count++) {
+		session_delete(type, sessions[count]);
+	}
+	after = heap_used();
+
+	FREE(sessions);
+
+	*leaked = (long)after - (long)before;
+
+	return (during - before) / SESSIONS;
+}
+
+#ifdef TESTPICO_SUPPORTED
+/**
+ * Drive a session through a complete continuous authentication with the
+ * simulated Pico, and measure the heap memory it uses either part way
+ * through the handshake or once it's continuing.
+ *
+ * @param midway true to measure part way through the handshake, false to
+ *        measure once the session is continuing.
+ * @param leaked Returns the number of bytes not released on deletion.
+ * @return The number of bytes allocated for the session, or 0 if the
+ *         session never reached the point to be measured.
+ */
+static size_t measure_authentication(bool midway, long * leaked) {
+	AuthThread * auththread;
+	TestPico * testpico;
+	Buffer * symmetric;
+	Buffer * passclear;
+	Buffer * extradata;
+	Json * json;
+	char const * code;
+	gint64 end;
+	size_t before;
+	size_t during;
+	size_t after;
+	bool result;
+
+	during = 0;
+
+	testpico = testpico_new();
+	// Keep the Pico's allocations out of the measurements
+	testpico_set_process(testpico, TRUE);
+	testpico_set_keys(testpico, TEST_PUBLIC_B64, TEST_PRIVATE_B64);
+	testpico_set_midway(testpico, midway);
+	// Keep the session continuing until it's been measured
+	testpico_set_hold(testpico, TRUE);
+
+	// The password is returned to the service encrypted with the user's key
+	symmetric = buffer_new(0);
+	base64_decode_mem(TEST_SYMMETRIC_B64, strlen(TEST_SYMMETRIC_B64), symmetric);
+	passclear = buffer_new(0);
+	buffer_append_string(passclear, TEST_PASSWORD);
+	extradata = buffer_new(0);
+	cryptosupport_encrypt_iv_base64(symmetric, passclear, extradata);
+	testpico_set_extradata(testpico, extradata);
+	buffer_delete(extradata);
+	buffer_delete(passclear);
+	buffer_delete(symmetric);
+
+	before = heap_used();
+
+	auththread = auththread_new();
+	result = auththread_config(auththread, TEST_CONTINUING_CONFIG);
+	if (result) {
+		auththread_set_username(auththread, TEST_USERNAME);
+		result = auththread_start_auth(auththread);
+	}
+
+	if (result) {
+		code = auththread_get_code(auththread);
+		json = json_new();
+		result = json_deserialize_string(json, code, strlen(code)) && (json_get_type(json, "sa") == JSONTYPE_STRING);
+		if (result) {
+			testpico_start(testpico, json_get_string(json, "sa"));
+		}
+		json_delete(json);
+	}
+
+	if (result) {
+		if (midway) {
+			// Wait for the Pico to stop part way through the handshake
+			end = g_get_monotonic_time() + TEST_WAIT;
+			while ((testpico_get_paused(testpico) == FALSE) && (testpico_get_finished(testpico) == FALSE) && (auththread_get_state(auththread) < AUTHTHREADSTATE_HARVESTABLE) && (g_get_monotonic_time() < end)) {
+				g_main_context_iteration(NULL, FALSE);
+				g_usleep(1000);
+			}
+
+			if (testpico_get_paused(testpico) && (auththread_get_state(auththread) == AUTHTHREADSTATE_STARTED)) {
+				during = heap_used();
+			}
+
+			testpico_proceed(testpico);
+		}
+
+		// Wait for the Pico to authenticate and the session to continue
+		end = g_get_monotonic_time() + TEST_WAIT;
+		while (((auththread_get_state(auththread) != AUTHTHREADSTATE_CONTINUING) || (testpico_get_finished(testpico) == FALSE)) && (auththread_get_state(auththread) < AUTHTHREADSTATE_HARVESTABLE) && (g_get_monotonic_time() < end)) {
+			g_main_context_iteration(NULL, FALSE);
+			g_usleep(1000);
+		}
+
+		if ((midway == false) && (auththread_get_state(auththread) == AUTHTHREADSTATE_CONTINUING) && testpico_get_result(testpico)) {
+			during = heap_used();
+		}
+
+		testpico_release(testpico);
+	}
+
+	// Wait for the session to end
+	auththread_stop(auththread);
+	end = g_get_monotonic_time() + TEST_WAIT;
+	while ((auththread_get_state(auththread) > AUTHTHREADSTATE_INVALID) && (auththread_get_state(auththread) < AUTHTHREADSTATE_HARVESTABLE) && (g_get_monotonic_time() < end)) {
+		g_main_context_iteration(NULL, FALSE);
+		g_usleep(1000);
+	}
+	testpico_finish(testpico);
+	auththread_delete(auththread);
+
+	// Let the sources for the session finish
+	while (g_main_context_iteration(NULL, FALSE)) {
+	}
+
+	after = heap_used();
+	*leaked = (long)after - (long)before;
+	testpico_delete(testpico);
+
+	return (during > before) ? (during - before) : 0;
+}
+#endif
+
+START_TEST(test_memory_idle) {
+	size_t used;
+	long leaked;
+
+	used = measure_sessions(SESSIONTYPE_IDLE, false, & leaked);
+	printf("Idle session: %lu bytes\n", used);
+
+	ck_assert_int_le(used, BUDGET_AUTHTHREAD);
+	ck_assert_int_le(leaked, LEAK_TOLERANCE);
+}
+END_TEST
+
+START_TEST(test_memory_rvp) {
+	size_t used;
+	long leaked;
+
+	used = measure_sessions(SESSIONTYPE_RVP, false, & leaked);
+	printf("Rendezvous Point session: %lu bytes\n", used);
+	ck_assert_int_le(used, BUDGET_SERVICE);
+	ck_assert_int_le(leaked, LEAK_TOLERANCE);
+
+	used = measure_sessions(SESSIONTYPE_RVP, true, & leaked);
+	printf("Continuous Rendezvous Point session: %lu bytes\n", used);
+	ck_assert_int_le(used, BUDGET_SERVICE);
+	ck_assert_int_le(leaked, LEAK_TOLERANCE);
+}
+END_TEST
+
+START_TEST(test_memory_btc) {
+	size_t used;
+	long leaked;
+
+	used = measure_sessions(SESSIONTYPE_BTC, false, & leaked);
+	printf("Bluetooth session: %lu bytes\n", used);
+	ck_assert_int_le(used, BUDGET_SERVICE);
+	ck_assert_int_le(leaked, LEAK_TOLERANCE);
+
+	used = measure_sessions(SESSIONTYPE_BTC, true, & leaked);
+	printf("Continuous Bluetooth session: %lu bytes\n", used);
+	ck_assert_int_le(used, BUDGET_SERVICE);
+	ck_assert_int_le(leaked, LEAK_TOLERANCE);
+}
+END_TEST
+
+START_TEST(test_memory_authenticating) {
+#ifdef TESTPICO_SUPPORTED
+	size_t used;
+	long leaked;
+
+	// Authenticate once first to exclude one-off allocations
+	measure_authentication(true, & leaked);
+
+	used = measure_authentication(true, & leaked);
+	printf("Authenticating session: %lu bytes\n", used);
+	ck_assert_int_gt(used, 0);
+	ck_assert_int_le(used, BUDGET_AUTHENTICATING);
+	ck_assert_int_le(leaked, LEAK_TOLERANCE);
+#else
+	printf("Authenticating session: not measured, libpico doesn't support custom channels\n");
+#endif
+}
+END_TEST
+
+START_TEST(test_memory_continuing) {
+#ifdef TESTPICO_SUPPORTED
+	size_t used;
+	long leaked;
+
+	// Authenticate once first to exclude one-off allocations
+	measure_authentication(false, & leaked);
+
+	used = measure_authentication(false, & leaked);
+	printf("Continuing session: %lu bytes\n", used);
+	ck_assert_int_gt(used, 0);
+	ck_assert_int_le(used, BUDGET_CONTINUING);
+	ck_assert_int_le(leaked, LEAK_TOLERANCE);
+#else
+	printf("Continuing session: not measured, libpico doesn't support custom channels\n");
+#endif
+}
+END_TEST
+
+int main (void) {
+	int number_failed;
+	Suite * s;
+	SRunner *sr;
+	TCase * tc;
+
+	s = suite_create("Pico Memory");
+
+	// Memory budget test case
+	tc = tcase_create("Memory");
+	tcase_set_timeout(tc, 60.0);
+	tcase_add_test(tc, test_memory_idle);
+	tcase_add_test(tc, test_memory_rvp);
+	tcase_add_test(tc, test_memory_btc);
+	tcase_add_test(tc, test_memory_authenticating);
+	tcase_add_test(tc, test_memory_continuing);
+
+	suite_add_tcase(s, tc);
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+
+	return (number_failed == 0) ? 0 : -1;
+}
@@ -30,16 +30,78 @@
 
 #include <check.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
 #include <pico/shared.h>
 #include "mockpam/mockpam.h"
+#include "mockdbus/mockdbus.h"
 
 // Defines
 #define PAM_CONST const
 
+#define TEST_USERNAME "MYUSER1"
+#define TEST_PASSWORD "MyPassword1"
+#define TEST_CODE "QR code"
+#define TEST_HANDLE (3652)
+#define TEST_CALLS_MAX (16)
+#define TEST_STRING_MAX (256)
+
+// Structure definitions
+
+/**
+ * @brief A call made to the stand-in pico-continuous service
+ */
+typedef struct _TestCall {
+	char method[32];
+	int handle;
+	int stringcount;
+	char strings[2][TEST_STRING_MAX];
+} TestCall;
+
+/**
+ * @brief The stand-in pico-continuous service, answering calls made through
+ * the mock dbus functions
+ *
+ * StartAuth hands out handles counting up from TEST_HANDLE. CompleteAuth
+ * either fails to get a reply, or replies with completesuccess. ResumeAuth
+ * replies with resume.
+ */
+typedef struct _TestService {
+	TestCall calls[TEST_CALLS_MAX];
+	int count;
+	int nexthandle;
+	bool completereply;
+	bool completesuccess;
+	bool resume;
+} TestService;
 
 // Function prototypes
 void prompt(pam_handle_t *pamh, int style, PAM_CONST char *prompt);
 const char * get_user_name(pam_handle_t * pamh);
+int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv);
+
+static void test_service_reset();
+static int test_service_count(char const * method);
+static TestCall const * test_service_find(char const * method, int index);
+static int test_service_conv(int num_msg, const struct pam_message **msg, struct pam_response **resp, void *appdata_ptr);
+static int test_service_get_user(pam_handle_t *pamh, const char **user, const char *prompt);
+static int test_service_get_item(const pam_handle_t *pamh, int item_type, const void **item);
+static int test_service_set_item(pam_handle_t *pamh, int item_type, const void *item);
+static DBusConnection * test_service_bus_get(DBusBusType type, DBusError * error);
+static DBusMessage * test_service_new_method_call(const char * bus_name, const char * path, const char * iface, const char * method);
+static dbus_bool_t test_service_append_basic(DBusMessageIter * iter, int type, const void * value);
+static DBusMessage * test_service_send_with_reply_and_block(DBusConnection * connection, DBusMessage * message, int timeout_milliseconds, DBusError * error);
+static dbus_bool_t test_service_set_error_from_message(DBusError * error, DBusMessage * message);
+static dbus_bool_t test_service_get_args(DBusMessage * message, DBusError * error, int first_arg_type, va_list args);
+static dbus_bool_t test_service_send(DBusConnection * connection, DBusMessage * message, dbus_uint32_t * serial);
+
+// Local variables
+
+static TestService testservice;
+static struct pam_conv testconv;
+static pam_handle_t * const testpamh = (pam_handle_t *)0x1234;
+static DBusConnection * const testconnection = (DBusConnection *)0x9ec7a9d;
+static const char * testargv[] = {"qrtype=json", "beacons=0", "anyuser=0", "input=0", "channeltype=btc"};
 
 
 // Function definitions
@@ -122,6 +184,278 @@ START_TEST(prompt_does_not_call_conv_if_get_item_returns_error) {
 }
 END_TEST
 
+/**
+ * Set up the stand-in service, with any module data left by an earlier test
+ * cleared, and the mock PAM and dbus functions directed to it. By default
+ * every call succeeds.
+ */
+static void test_service_reset() {
+	pam_funcs.pam_get_user = test_service_get_user;
+	pam_funcs.pam_get_item = test_service_get_item;
+	pam_funcs.pam_set_item = test_service_set_item;
+	dbus_funcs.dbus_bus_get = test_service_bus_get;
+	dbus_funcs.dbus_message_new_method_call = test_service_new_method_call;
+	dbus_funcs.dbus_message_iter_append_basic = test_service_append_basic;
+	dbus_funcs.dbus_connection_send_with_reply_and_block = test_service_send_with_reply_and_block;
+	dbus_funcs.dbus_set_error_from_message = test_service_set_error_from_message;
+	dbus_funcs.dbus_message_get_args = test_service_get_args;
+	dbus_funcs.dbus_connection_send = test_service_send;
+	testconv.conv = test_service_conv;
+	testconv.appdata_ptr = NULL;
+
+	mockpam_end(testpamh, PAM_SUCCESS);
+
+	memset(& testservice, 0, sizeof(TestService));
+	testservice.nexthandle = TEST_HANDLE;
+	testservice.completereply = true;
+	testservice.completesuccess = true;
+	testservice.resume = true;
+}
+
+/**
+ * Count the calls made to the stand-in service for a method.
+ *
+ * @param method The method to count the calls for.
+ * @return The number of calls.
+ */
+static int test_service_count(char const * method) {
+	int pos;
+	int count;
+
+	count = 0;
+	for (pos = 0; pos < testservice.count; pos++) {
+		if (strcmp(testservice.calls[pos].method, method) == 0) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/**
+ * Find a call made to the stand-in service for a method.
+ *
+ * @param method The method to find the call for.
+ * @param index Which of the calls for the method to find, starting from 0.
+ * @return The call, or NULL if there weren't enough calls.
+ */
+static TestCall const * test_service_find(char const * method, int index) {
+	int pos;
+	TestCall const * call;
+
+	call = NULL;
+	for (pos = 0; (pos < testservice.count) && (call == NULL); pos++) {
+		if (strcmp(testservice.calls[pos].method, method) == 0) {
+			if (index == 0) {
+				call = & testservice.calls[pos];
+			}
+			index--;
+		}
+	}
+
+	return call;
+}
+
+static int test_service_conv(int num_msg, const struct pam_message **msg, struct pam_response **resp, void *appdata_ptr) {
+	*resp = NULL;
+	return PAM_SUCCESS;
+}
+
+static int test_service_get_user(pam_handle_t *pamh, const char **user, const char *prompt) {
+	*user = TEST_USERNAME;
+	return PAM_SUCCESS;
+}
+
+static int test_service_get_item(const pam_handle_t *pamh, int item_type, const void **item) {
+	ck_assert_int_eq(item_type, PAM_CONV);
+	*item = & testconv;
+	return PAM_SUCCESS;
+}
+
+static int test_service_set_item(pam_handle_t *pamh, int item_type, const void *item) {
+	ck_assert_int_eq(item_type, PAM_AUTHTOK);
+	ck_assert_str_eq(item, TEST_PASSWORD);
+	return PAM_SUCCESS;
+}
+
+static DBusConnection * test_service_bus_get(DBusBusType type, DBusError * error) {
+	return testconnection;
+}
+
+static DBusMessage * test_service_new_method_call(const char * bus_name, const char * path, const char * iface, const char * method) {
+	TestCall * call;
+
+	ck_assert_int_lt(testservice.count, TEST_CALLS_MAX);
+	call = & testservice.calls[testservice.count];
+	testservice.count++;
+	snprintf(call->method, sizeof(call->method), "%s", method);
+	call->handle = -1;
+	call->stringcount = 0;
+
+	return (DBusMessage *)call;
+}
+
+static dbus_bool_t test_service_append_basic(DBusMessageIter * iter, int type, const void * value) {
+	TestCall * call;
+
+	// Parameters are added to the most recently created message
+	call = & testservice.calls[testservice.count - 1];
+	if (type == DBUS_TYPE_INT32) {
+		call->handle = *(int const *)value;
+	}
+	else {
+		ck_assert_int_eq(type, DBUS_TYPE_STRING);
+		ck_assert_int_lt(call->stringcount, 2);
+		snprintf(call->strings[call->stringcount], TEST_STRING_MAX, "%s", *(char const * const *)value);
+		call->stringcount++;
+	}
+
+	return true;
+}
+
+static DBusMessage * test_service_send_with_reply_and_block(DBusConnection * connection, DBusMessage * message, int timeout_milliseconds, DBusError * error) {
+	TestCall * call = (TestCall *)message;
+	DBusMessage * reply;
+
+	// The message doubles as its reply
+	reply = message;
+	if ((strcmp(call->method, "CompleteAuth") == 0) && (testservice.completereply == false)) {
+		reply = NULL;
+	}
+
+	return reply;
+}
+
+static dbus_bool_t test_service_set_error_from_message(DBusError * error, DBusMessage * message) {
+	return false;
+}
+
+static dbus_bool_t test_service_get_args(DBusMessage * message, DBusError * error, int first_arg_type, va_list args) {
+	TestCall * call = (TestCall *)message;
+
+	if (strcmp(call->method, "StartAuth") == 0) {
+		*va_arg(args, int *) = testservice.nexthandle;
+		testservice.nexthandle++;
+		va_arg(args, int);
+		*va_arg(args, char const **) = TEST_CODE;
+		va_arg(args, int);
+		*va_arg(args, dbus_bool_t *) = true;
+	}
+	else if (strcmp(call->method, "CompleteAuth") == 0) {
+		*va_arg(args, char const **) = TEST_USERNAME;
+		va_arg(args, int);
+		*va_arg(args, char const **) = TEST_PASSWORD;
+		va_arg(args, int);
+		*va_arg(args, dbus_bool_t *) = testservice.completesuccess;
+	}
+	else {
+		ck_assert_str_eq(call->method, "ResumeAuth");
+		*va_arg(args, dbus_bool_t *) = testservice.resume;
+	}
+
+	return true;
+}
+
+static dbus_bool_t test_service_send(DBusConnection * connection, DBusMessage * message, dbus_uint32_t * serial) {
+	return true;
+}
+
+START_TEST(test_resume_after_failed_complete) {
+	TestCall const * call;
+	int result;
+
+	test_service_reset();
+
+	// The first attempt fails, but the service still has the session
+	testservice.completesuccess = false;
+	result = pam_sm_authenticate(testpamh, 0, 5, testargv);
+	ck_assert_int_eq(result, PAM_AUTH_ERR);
+	ck_assert_int_eq(test_service_count("StartAuth"), 1);
+	ck_assert_int_eq(test_service_count("CancelAuth"), 0);
+
+	// The retry resumes it, rather than starting a new session
+	testservice.completesuccess = true;
+	result = pam_sm_authenticate(testpamh, 0, 5, testargv);
+	ck_assert_int_eq(result, PAM_SUCCESS);
+	ck_assert_int_eq(test_service_count("StartAuth"), 1);
+	ck_assert_int_eq(test_service_count("ResumeAuth"), 1);
+	ck_assert_int_eq(test_service_count("CompleteAuth"), 2);
+
+	call = test_service_find("ResumeAuth", 0);
+	ck_assert_int_eq(call->handle, TEST_HANDLE);
+	ck_assert_str_eq(call->strings[0], TEST_USERNAME);
+	ck_assert_str_eq(call->strings[1], TEST_CODE);
+	call = test_service_find("CompleteAuth", 1);
+	ck_assert_int_eq(call->handle, TEST_HANDLE);
+
+	// The session was used, so isn't cancelled
+	mockpam_end(testpamh, PAM_SUCCESS);
+	ck_assert_int_eq(test_service_count("CancelAuth"), 0);
+}
+END_TEST
+
+START_TEST(test_resume_refused) {
+	TestCall const * call;
+	int result;
+
+	test_service_reset();
+
+	// The first attempt gets no reply
+	testservice.completereply = false;
+	result = pam_sm_authenticate(testpamh, 0, 5, testargv);
+	ck_assert_int_eq(result, PAM_AUTH_ERR);
+
+	// The service can't resume the session, so it's cancelled and a new one started
+	testservice.completereply = true;
+	testservice.resume = false;
+	result = pam_sm_authenticate(testpamh, 0, 5, testargv);
+	ck_assert_int_eq(result, PAM_SUCCESS);
+	ck_assert_int_eq(test_service_count("ResumeAuth"), 1);
+	ck_assert_int_eq(test_service_count("StartAuth"), 2);
+	ck_assert_int_eq(test_service_count("CancelAuth"), 1);
+
+	call = test_service_find("CancelAuth", 0);
+	ck_assert_int_eq(call->handle, TEST_HANDLE);
+	ck_assert_str_eq(call->strings[0], TEST_CODE);
+	call = test_service_find("CompleteAuth", 1);
+	ck_assert_int_eq(call->handle, TEST_HANDLE + 1);
+
+	mockpam_end(testpamh, PAM_SUCCESS);
+	ck_assert_int_eq(test_service_count("CancelAuth"), 1);
+}
+END_TEST
+
+START_TEST(test_cancel_on_end) {
+	TestCall const * call;
+	int result;
+
+	test_service_reset();
+
+	testservice.completesuccess = false;
+	result = pam_sm_authenticate(testpamh, 0, 5, testargv);
+	ck_assert_int_eq(result, PAM_AUTH_ERR);
+	ck_assert_int_eq(test_service_count("CancelAuth"), 0);
+
+	// Ending the PAM handle cancels the session left pending
+	mockpam_end(testpamh, PAM_SUCCESS);
+	ck_assert_int_eq(test_service_count("CancelAuth"), 1);
+
+	call = test_service_find("CancelAuth", 0);
+	ck_assert_int_eq(call->handle, TEST_HANDLE);
+	ck_assert_str_eq(call->strings[0], TEST_CODE);
+
+#ifdef PAM_DATA_SILENT
+	// A forked process ending its copy of the handle leaves the session alone
+	test_service_reset();
+	testservice.completesuccess = false;
+	result = pam_sm_authenticate(testpamh, 0, 5, testargv);
+	ck_assert_int_eq(result, PAM_AUTH_ERR);
+
+	mockpam_end(testpamh, PAM_SUCCESS | PAM_DATA_SILENT);
+	ck_assert_int_eq(test_service_count("CancelAuth"), 0);
+#endif
+}
+END_TEST
 
 int main (void) {
 	int number_failed;
@@ -137,6 +471,9 @@ int main (void) {
 	tcase_add_test(tc, test_get_user_name);
 	tcase_add_test(tc, test_prompt);
 	tcase_add_test(tc, prompt_does_not_call_conv_if_get_item_returns_error);
+	tcase_add_test(tc, test_resume_after_failed_complete);
+	tcase_add_test(tc, test_resume_refused);
+	tcase_add_test(tc, test_cancel_on_end);
 
 	suite_add_tcase(s, tc);
 	sr = srunner_create(s);
@@ -0,0 +1,1224 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Process store tests
+ * @section DESCRIPTION
+ *
+ * Performs tests of the ProcessStore through its dbus methods. Each test
+ * starts a private bus, exports the service's interface on one connection
+ * and calls it from another, just as pam_pico would.
+ *
+ * Whether the caller is root matters to several of the methods. Since the
+ * tests don't run as root, the bus daemon's reply giving the caller's user
+ * id is replaced with the id the test chooses, by a filter on the service's
+ * connection.
+ *
+ * The configuration file is read from tests/keydir, which enables instant
+ * unlock and has the direct TCP channel listen on loopback. Sessions authenticate using the simulated Pico in testpico.c.
+ *
+ */
+
+#include "config.h"
+
+#include <check.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include "pico/pico.h"
+#include "pico/json.h"
+#include "../src/processstore.h"
+#include "../src/auththread.h"
+#include "../src/timesource.h"
+#include "../src/locker.h"
+#include "testpico.h"
+
+// Defines
+
+/**
+ * @brief The longest real time to wait for the service, in microseconds
+ */
+#define TEST_WAIT (20 * 1000000)
+
+/**
+ * @brief The object path the service's interface is exported on
+ */
+#define TEST_PATH "/PicoObject"
+
+/**
+ * @brief The service's interface
+ */
+#define TEST_INTERFACE "uk.ac.cam.cl.pico.interface"
+
+/**
+ * @brief The user id of a caller who isn't root
+ */
+#define TEST_UID_USER (1000)
+
+/**
+ * @brief The user the simulated Pico is paired with in tests/keydir/users.txt
+ */
+#define TEST_USERNAME "Bob"
+
+/**
+ * @brief A user with no Pico paired
+ */
+#define TEST_OTHER "Alice"
+
+/**
+ * @brief The parameters used to start a continuous session for Bob
+ */
+#define TEST_PARAMETERS "{\"continuous\":1,\"channeltype\":\"tcp\",\"beacons\":0,\"anyuser\":0,\"timeout\":0,\"configdir\":\"tests/keydir/\"}"
+
+/**
+ * @brief The parameters used to start a session that any user may complete
+ */
+#define TEST_PARAMETERS_ANYUSER "{\"continuous\":0,\"channeltype\":\"tcp\",\"beacons\":0,\"anyuser\":1,\"timeout\":0,\"configdir\":\"tests/keydir/\"}"
+
+/**
+ * @brief The time the Pico in an existing session is given to answer an
+ * instant unlock challenge, in milliseconds
+ *
+ * This matches INSTANT_UNLOCK_TIMEOUT in processstore.c.
+ */
+#define TEST_INSTANT_WINDOW (5000)
+
+/**
+ * @brief The public part of Bob's Pico identity key
+ */
+#define TEST_PUBLIC_B64 "MFkwEwYHKoZIzj0CAQYIKoZIzj0DAQcDQgAEzpNscJDHgvg+49E79yDor/BP/ZFIXgmS5n9CaRUDN37mBgxeZFLWT2Q5PiNvOYsDm6yvt0VNCOz2r2vjRi+4qQ=="
+
+/**
+ * @brief The private part of Bob's Pico identity key
+ */
+#define TEST_PRIVATE_B64 "MIGHAgEAMBMGByqGSM49AgEGCCqGSM49AwEHBG0wawIBAQQg8c/POOuOEr4JCZ7hZZYlFHLKecNZAvZmHMLAsx6j0CChRANCAATOk2xwkMeC+D7j0Tv3IOiv8E/9kUheCZLmf0JpFQM3fuYGDF5kUtZPZDk+I285iwObrK+3RU0I7Pava+NGL7ip"
+
+/**
+ * @brief Whether sessions can be authenticated against a real service
+ *
+ * Instant unlock needs the session nonce to challenge the Pico with.
+ */
+#if defined(TESTPICO_SUPPORTED) && defined(HAVE_SHARED_GET_SERVICE_NONCE) && defined(HAVE_NONCE_GET_BUFFER) && defined(HAVE_NONCE_GET_LENGTH)
+#define TEST_SESSIONS (1)
+#endif
+
+/**
+ * @brief The password passed when pairing Bob
+ */
+#define TEST_PASSWORD "Passuser1"
+
+/**
+ * @brief The parameters passed when pairing
+ */
+#define TEST_PAIR_PARAMETERS "{\"configdir\":\"tests/keydir/\"}"
+
+// Structure definitions
+
+/**
+ * @brief A private bus with the service's interface exported on it
+ */
+typedef struct _TestBus {
+	GTestDBus * bus;
+	GDBusConnection * service;
+	GDBusConnection * client;
+	PicoUkAcCamClPicoInterface * interface;
+	ProcessStore * processstore;
+	Locker * locker;
+	GMainLoop * loop;
+	guint filterid;
+} TestBus;
+
+/**
+ * @brief A dbus call from the client waiting for its reply
+ */
+typedef struct _TestCall {
+	bool done;
+	GVariant * reply;
+} TestCall;
+
+/**
+ * @brief The channels that pairings wait on for the Pico
+ *
+ * No Pico ever connects. Reads from the channels block until the test
+ * releases them, after which every read fails, so that the pairings finish
+ * at a time of the test's choosing.
+ */
+typedef struct _TestPair {
+	GMutex mutex;
+	GCond cond;
+	bool released;
+	int reads;
+} TestPair;
+
+// Function prototypes
+
+static TestBus * test_bus_new();
+static void test_bus_delete(TestBus * testbus);
+static void test_set_calleruid(uid_t uid);
+static GDBusMessage * test_filter(GDBusConnection * connection, GDBusMessage * message, gboolean incoming, gpointer user_data);
+static TestCall * test_call_start(TestBus * testbus, char const * method, GVariant * parameters, GVariantType const * type);
+static void test_call_finished(GObject * source, GAsyncResult * res, gpointer user_data);
+static GVariant * test_call_wait(TestCall * call);
+static GVariant * test_call(TestBus * testbus, char const * method, GVariant * parameters, GVariantType const * type);
+static int test_start_auth(TestBus * testbus, char const * username, char const * parameters, gchar ** code);
+static bool test_wait_state(TestBus * testbus, int handle, AUTHTHREADSTATE state);
+#ifdef TEST_SESSIONS
+static TestPico * test_pico_start(char const * code);
+#endif
+static void test_preauth(TestBus * testbus);
+static int test_find_speculative(TestBus * testbus, char const * username);
+#ifdef TESTPICO_SUPPORTED
+static TestPair * test_pair_new(TestBus * testbus);
+static void test_pair_delete(TestPair * pair);
+static void test_pair_release(TestPair * pair);
+static bool test_pair_wait_read(TestPair * pair);
+static RVPChannel * test_pair_channel(void * user_data);
+static bool test_pair_open(RVPChannel * channel);
+static bool test_pair_close(RVPChannel * channel);
+static bool test_pair_write(RVPChannel * channel, char * data, int length);
+static bool test_pair_read(RVPChannel * channel, Buffer * buffer);
+#endif
+static int test_start_pair(TestBus * testbus);
+static bool test_wait_pair_completed(TestBus * testbus, int handle);
+static gboolean on_handle_start_auth(PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, const gchar * arg_username, const gchar * arg_parameters, gpointer user_data);
+static gboolean on_handle_complete_auth(PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, gint handle, gpointer user_data);
+static gboolean on_handle_resume_auth(PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, gint handle, const gchar * arg_username, const gchar * arg_code, gpointer user_data);
+static gboolean on_handle_cancel_auth(PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, gint handle, const gchar * arg_code, gpointer user_data);
+static gboolean on_handle_start_pair(PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, const gchar * arg_username, const gchar * arg_password, const gchar * arg_parameters, gpointer user_data);
+static gboolean on_handle_complete_pair(PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, gint handle, gpointer user_data);
+
+// Local variables
+
+/**
+ * @brief Protects the values shared with the connection's worker thread
+ */
+static GMutex test_lock;
+
+/**
+ * @brief The serials of the requests for callers' user ids not yet answered
+ */
+static GHashTable * test_lookups = NULL;
+
+/**
+ * @brief The user id the bus daemon's replies are replaced with
+ */
+static uid_t test_calleruid = 0;
+
+// Function definitions
+
+/**
+ * Start a private bus and export the service's interface on it, backed by
+ * a new ProcessStore, and connect a client to it. Callers are treated as
+ * root until test_set_calleruid() is called.
+ *
+ * @return The newly created object.
+ */
+static TestBus * test_bus_new() {
+	TestBus * testbus;
+	gchar const * address;
+	GError * error;
+
+	testbus = CALLOC(sizeof(TestBus), 1);
+
+	g_mutex_lock(& test_lock);
+	test_lookups = g_hash_table_new(g_direct_hash, g_direct_equal);
+	test_calleruid = 0;
+	g_mutex_unlock(& test_lock);
+
+	testbus->bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+	g_test_dbus_up(testbus->bus);
+	address = g_test_dbus_get_bus_address(testbus->bus);
+
+	error = NULL;
+	testbus->service = g_dbus_connection_new_for_address_sync(address, G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION, NULL, NULL, & error);
+	ck_assert_msg(testbus->service != NULL, "Failed to connect service: %s", (error ? error->message : ""));
+	testbus->client = g_dbus_connection_new_for_address_sync(address, G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION, NULL, NULL, & error);
+	ck_assert_msg(testbus->client != NULL, "Failed to connect client: %s", (error ? error->message : ""));
+	testbus->filterid = g_dbus_connection_add_filter(testbus->service, test_filter, NULL, NULL);
+
+	// Sessions lock using a stand-in command, so nothing real is locked
+	testbus->locker = locker_new();
+	locker_set_logind(testbus->locker, FALSE);
+	locker_set_command(testbus->locker, "/bin/true");
+
+	testbus->loop = g_main_loop_new(NULL, FALSE);
+	testbus->processstore = processstore_new();
+	processstore_set_loop(testbus->processstore, testbus->loop);
+	processstore_set_locker(testbus->processstore, testbus->locker);
+
+	testbus->interface = pico_uk_ac_cam_cl_pico_interface_skeleton_new();
+	g_signal_connect(testbus->interface, "handle-start-auth", G_CALLBACK(on_handle_start_auth), testbus->processstore);
+	g_signal_connect(testbus->interface, "handle-complete-auth", G_CALLBACK(on_handle_complete_auth), testbus->processstore);
+	g_signal_connect(testbus->interface, "handle-resume-auth", G_CALLBACK(on_handle_resume_auth), testbus->processstore);
+	g_signal_connect(testbus->interface, "handle-cancel-auth", G_CALLBACK(on_handle_cancel_auth), testbus->processstore);
+	g_signal_connect(testbus->interface, "handle-start-pair", G_CALLBACK(on_handle_start_pair), testbus->processstore);
+	g_signal_connect(testbus->interface, "handle-complete-pair", G_CALLBACK(on_handle_complete_pair), testbus->processstore);
+	g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(testbus->interface), testbus->service, TEST_PATH, & error);
+	ck_assert_msg(error == NULL, "Failed to export interface: %s", (error ? error->message : ""));
+
+	return testbus;
+}
+
+/**
+ * Delete the ProcessStore and its sessions, then close the connections and
+ * stop the private bus.
+ *
+ * @param testbus The object to free.
+ */
+static void test_bus_delete(TestBus * testbus) {
+	if (testbus) {
+		processstore_delete(testbus->processstore);
+
+		// Let the sources for the sessions finish
+		while (g_main_context_iteration(NULL, FALSE)) {
+		}
+
+		g_dbus_interface_skeleton_unexport(G_DBUS_INTERFACE_SKELETON(testbus->interface));
+		g_object_unref(testbus->interface);
+		g_dbus_connection_remove_filter(testbus->service, testbus->filterid);
+		g_dbus_connection_close_sync(testbus->client, NULL, NULL);
+		g_dbus_connection_close_sync(testbus->service, NULL, NULL);
+		g_object_unref(testbus->client);
+		g_object_unref(testbus->service);
+		g_test_dbus_down(testbus->bus);
+		g_object_unref(testbus->bus);
+
+		locker_delete(testbus->locker);
+		g_main_loop_unref(testbus->loop);
+
+		g_mutex_lock(& test_lock);
+		g_hash_table_destroy(test_lookups);
+		test_lookups = NULL;
+		g_mutex_unlock(& test_lock);
+
+		FREE(testbus);
+	}
+}
+
+/**
+ * Set the user id the service is told later calls come from.
+ *
+ * @param uid The user id to use, such as 0 for root.
+ */
+static void test_set_calleruid(uid_t uid) {
+	g_mutex_lock(& test_lock);
+	test_calleruid = uid;
+	g_mutex_unlock(& test_lock);
+}
+
+/**
+ * Filter on the service's connection that replaces the bus daemon's
+ * replies to GetConnectionUnixUser with the user id set by
+ * test_set_calleruid(). This is called from the connection's worker thread.
+ *
+ * @param connection The service's connection.
+ * @param message The message being sent or received.
+ * @param incoming true if the message was received, false if it's being
+ *        sent.
+ * @param user_data Not used.
+ * @return The message to carry on with.
+ */
+static GDBusMessage * test_filter(GDBusConnection * connection, GDBusMessage * message, gboolean incoming, gpointer user_data) {
+	GDBusMessage * copy;
+	gpointer serial;
+	bool replace;
+	uid_t uid;
+
+	if (incoming == FALSE) {
+		if (g_strcmp0(g_dbus_message_get_member(message), "GetConnectionUnixUser") == 0) {
+			g_mutex_lock(& test_lock);
+			g_hash_table_add(test_lookups, GUINT_TO_POINTER(g_dbus_message_get_serial(message)));
+			g_mutex_unlock(& test_lock);
+		}
+	}
+	else if (g_dbus_message_get_message_type(message) == G_DBUS_MESSAGE_TYPE_METHOD_RETURN) {
+		serial = GUINT_TO_POINTER(g_dbus_message_get_reply_serial(message));
+		g_mutex_lock(& test_lock);
+		replace = g_hash_table_remove(test_lookups, serial);
+		uid = test_calleruid;
+		g_mutex_unlock(& test_lock);
+
+		if (replace) {
+			copy = g_dbus_message_copy(message, NULL);
+			g_dbus_message_set_body(copy, g_variant_new("(u)", (guint32)uid));
+			g_object_unref(message);
+			message = copy;
+		}
+	}
+
+	return message;
+}
+
+/**
+ * Start a call to the service from the client. The main loop must be run
+ * for the service to handle it; see test_call_wait().
+ *
+ * @param testbus The bus to make the call on.
+ * @param method The method to call.
+ * @param parameters The parameters of the call.
+ * @param type The type of the reply expected.
+ * @return The call, to be passed to test_call_wait().
+ */
+static TestCall * test_call_start(TestBus * testbus, char const * method, GVariant * parameters, GVariantType const * type) {
+	TestCall * call;
+
+	call = CALLOC(sizeof(TestCall), 1);
+	call->done = FALSE;
+	call->reply = NULL;
+
+	g_dbus_connection_call(testbus->client, g_dbus_connection_get_unique_name(testbus->service), TEST_PATH, TEST_INTERFACE, method, parameters, type, G_DBUS_CALL_FLAGS_NONE, -1, NULL, test_call_finished, call);
+
+	return call;
+}
+
+/**
+ * Internal callback with the reply to a call from the client.
+ *
+ * @param source The client's connection.
+ * @param res The result of the call.
+ * @param user_data The TestCall, cast to (gpointer).
+ */
+static void test_call_finished(GObject * source, GAsyncResult * res, gpointer user_data) {
+	TestCall * call = (TestCall *)user_data;
+	GError * error;
+
+	error = NULL;
+	call->reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, & error);
+	if (call->reply == NULL) {
+		printf("Call failed: %s\n", error->message);
+		g_error_free(error);
+	}
+	call->done = TRUE;
+}
+
+/**
+ * Run the main loop until a call has been replied to, then free the call.
+ *
+ * @param call The call to wait for.
+ * @return The reply, or NULL if the call failed or no reply arrived.
+ */
+static GVariant * test_call_wait(TestCall * call) {
+	GVariant * reply;
+	gint64 end;
+
+	end = g_get_monotonic_time() + TEST_WAIT;
+	while ((call->done == FALSE) && (g_get_monotonic_time() < end)) {
+		g_main_context_iteration(NULL, FALSE);
+		g_usleep(1000);
+	}
+
+	// A call that never finished is left for the callback to write to
+	reply = call->reply;
+	if (call->done) {
+		FREE(call);
+	}
+
+	return reply;
+}
+
+/**
+ * Call the service from the client and wait for the reply.
+ *
+ * @param testbus The bus to make the call on.
+ * @param method The method to call.
+ * @param parameters The parameters of the call.
+ * @param type The type of the reply expected.
+ * @return The reply, or NULL if the call failed.
+ */
+static GVariant * test_call(TestBus * testbus, char const * method, GVariant * parameters, GVariantType const * type) {
+	return test_call_wait(test_call_start(testbus, method, parameters, type));
+}
+
+/**
+ * Call StartAuth and check that it succeeded.
+ *
+ * @param testbus The bus to make the call on.
+ * @param username The user to authenticate.
+ * @param parameters The parameters for the session.
+ * @param code Returns the code for the session, to be freed by the caller.
+ * @return The handle of the session.
+ */
+static int test_start_auth(TestBus * testbus, char const * username, char const * parameters, gchar ** code) {
+	GVariant * reply;
+	gint handle;
+	gboolean success;
+
+	reply = test_call(testbus, "StartAuth", g_variant_new("(ss)", username, parameters), G_VARIANT_TYPE("(isb)"));
+	ck_assert(reply != NULL);
+	g_variant_get(reply, "(isb)", & handle, code, & success);
+	g_variant_unref(reply);
+	ck_assert(success == TRUE);
+	ck_assert_int_ge(handle, 0);
+
+	return handle;
+}
+
+/**
+ * Run the main loop until a session reaches a particular state.
+ *
+ * @param testbus The bus the session was started on.
+ * @param handle The handle of the session.
+ * @param state The state to wait for.
+ * @return true if the session reached the state, false o/w.
+ */
+static bool test_wait_state(TestBus * testbus, int handle, AUTHTHREADSTATE state) {
+	AuthThread * auththread;
+	gint64 end;
+
+	end = g_get_monotonic_time() + TEST_WAIT;
+	auththread = processstore_get_auththread(testbus->processstore, handle);
+	while ((auththread != NULL) && (auththread_get_state(auththread) != state) && (g_get_monotonic_time() < end)) {
+		g_main_context_iteration(NULL, FALSE);
+		g_usleep(1000);
+		auththread = processstore_get_auththread(testbus->processstore, handle);
+	}
+
+	return ((auththread != NULL) && (auththread_get_state(auththread) == state));
+}
+
+#ifdef TEST_SESSIONS
+/**
+ * Start Bob's simulated Pico authenticating to the session the code was
+ * returned for. The Pico holds its connection open once it's authenticated,
+ * so that the session carries on continuing until it's deleted.
+ *
+ * @param code The code returned by StartAuth.
+ * @return The simulated Pico.
+ */
+static TestPico * test_pico_start(char const * code) {
+	TestPico * testpico;
+	Json * json;
+	bool result;
+
+	testpico = testpico_new();
+	testpico_set_keys(testpico, TEST_PUBLIC_B64, TEST_PRIVATE_B64);
+	testpico_set_hold(testpico, TRUE);
+
+	json = json_new();
+	result = json_deserialize_string(json, code, strlen(code)) && (json_get_type(json, "sa") == JSONTYPE_STRING);
+	ck_assert(result == TRUE);
+	testpico_start(testpico, json_get_string(json, "sa"));
+	json_delete(json);
+
+	return testpico;
+}
+#endif
+
+/**
+ * Make Bob's parameters available for speculative sessions, as if root had
+ * authenticated him, and turn pre-authentication on. Rather than have a
+ * Pico authenticate, the session started is marked as having succeeded, so
+ * that it's harvested by the next call to processstore_away().
+ *
+ * @param testbus The bus to start the session on.
+ */
+static void test_preauth(TestBus * testbus) {
+	AuthThread * auththread;
+	gchar * code;
+	int handle;
+
+	test_set_calleruid(0);
+	handle = test_start_auth(testbus, TEST_USERNAME, TEST_PARAMETERS, & code);
+	g_free(code);
+
+	auththread = processstore_get_auththread(testbus->processstore, handle);
+	auththread_set_result(auththread, TRUE);
+	auththread_set_state(auththread, AUTHTHREADSTATE_HARVESTABLE);
+
+	processstore_set_preauth(testbus->processstore, TRUE);
+}
+
+/**
+ * Find the speculative session running for a user.
+ *
+ * @param testbus The bus the session was started on.
+ * @param username The user to find the session for.
+ * @return The handle of the session, or -1 if there isn't one.
+ */
+static int test_find_speculative(TestBus * testbus, char const * username) {
+	AuthThread * auththread;
+	int handle;
+	int found;
+
+	found = -1;
+	for (handle = 0; (handle < MAX_SIMULTANEOUS_AUTHS) && (found < 0); handle++) {
+		auththread = processstore_get_auththread(testbus->processstore, handle);
+		if ((auththread != NULL) && auththread_get_speculative(auththread) && (strcmp(auththread_get_username(auththread), username) == 0) && (auththread_get_state(auththread) < AUTHTHREADSTATE_HARVESTABLE)) {
+			found = handle;
+		}
+	}
+
+	return found;
+}
+
+#ifdef TESTPICO_SUPPORTED
+/**
+ * Create the channels for pairings started on a bus to wait on.
+ *
+ * @param testbus The bus pairings will be started on.
+ * @return The newly created object.
+ */
+static TestPair * test_pair_new(TestBus * testbus) {
+	TestPair * pair;
+
+	pair = CALLOC(sizeof(TestPair), 1);
+	g_mutex_init(& pair->mutex);
+	g_cond_init(& pair->cond);
+	pair->released = FALSE;
+	pair->reads = 0;
+
+	processstore_set_pairchannel(testbus->processstore, test_pair_channel, pair);
+
+	return pair;
+}
+
+/**
+ * Free the memory allocated to the pairing channels. The pairings using
+ * them must have finished.
+ *
+ * @param pair The object to free.
+ */
+static void test_pair_delete(TestPair * pair) {
+	g_mutex_clear(& pair->mutex);
+	g_cond_clear(& pair->cond);
+	FREE(pair);
+}
+
+/**
+ * Let the pairings finish, by failing the current and future reads from
+ * their channels.
+ *
+ * @param pair The channels to release.
+ */
+static void test_pair_release(TestPair * pair) {
+	g_mutex_lock(& pair->mutex);
+	pair->released = TRUE;
+	g_cond_broadcast(& pair->cond);
+	g_mutex_unlock(& pair->mutex);
+}
+
+/**
+ * Wait for a pairing to start waiting on its channel for the Pico.
+ *
+ * @param pair The channels to wait on.
+ * @return true if a read was made from a channel, false o/w.
+ */
+static bool test_pair_wait_read(TestPair * pair) {
+	gint64 end;
+	bool result;
+
+	end = g_get_monotonic_time() + TEST_WAIT;
+	g_mutex_lock(& pair->mutex);
+	while ((pair->reads == 0) && g_cond_wait_until(& pair->cond, & pair->mutex, end)) {
+	}
+	result = (pair->reads > 0);
+	g_mutex_unlock(& pair->mutex);
+
+	return result;
+}
+
+/**
+ * Create the channel for a pairing to wait on. Called on the PairThread's
+ * worker thread.
+ *
+ * @param user_data The TestPair, cast to (void *).
+ * @return The channel for the pairing to use.
+ */
+static RVPChannel * test_pair_channel(void * user_data) {
+	RVPChannel * channel;
+
+	channel = channel_new();
+	channel_set_functions(channel, test_pair_open, test_pair_close, test_pair_write, test_pair_read, NULL, NULL, NULL);
+	channel_set_data(channel, user_data);
+
+	return channel;
+}
+
+/**
+ * Channel function for the pairing channel. There's nothing to open.
+ *
+ * @param channel The channel to open.
+ * @return Always true.
+ */
+static bool test_pair_open(RVPChannel * channel) {
+	return TRUE;
+}
+
+/**
+ * Channel function for the pairing channel. There's nothing to close.
+ *
+ * @param channel The channel to close.
+ * @return Always true.
+ */
+static bool test_pair_close(RVPChannel * channel) {
+	return TRUE;
+}
+
+/**
+ * Channel function for the pairing channel. No Pico is listening, so
+ * writes always fail.
+ *
+ * @param channel The channel to write to.
+ * @param data The data to write.
+ * @param length The length of the data.
+ * @return Always false.
+ */
+static bool test_pair_write(RVPChannel * channel, char * data, int length) {
+	return FALSE;
+}
+
+/**
+ * Channel function for the pairing channel. Blocks until the test releases
+ * the channel, and then fails.
+ *
+ * @param channel The channel to read from.
+ * @param buffer The buffer to read into.
+ * @return Always false.
+ */
+static bool test_pair_read(RVPChannel * channel, Buffer * buffer) {
+	TestPair * pair;
+
+	pair = (TestPair *)channel_get_data(channel);
+
+	g_mutex_lock(& pair->mutex);
+	pair->reads++;
+	g_cond_broadcast(& pair->cond);
+	while (pair->released == FALSE) {
+		g_cond_wait(& pair->cond, & pair->mutex);
+	}
+	g_mutex_unlock(& pair->mutex);
+
+	return FALSE;
+}
+#endif
+
+/**
+ * Call StartPair for Bob.
+ *
+ * @param testbus The bus to make the call on.
+ * @return The handle returned, or -1 if the pairing wasn't started.
+ */
+static int test_start_pair(TestBus * testbus) {
+	GVariant * reply;
+	gint handle;
+	gchar * code;
+	gboolean success;
+
+	reply = test_call(testbus, "StartPair", g_variant_new("(sss)", TEST_USERNAME, TEST_PASSWORD, TEST_PAIR_PARAMETERS), G_VARIANT_TYPE("(isb)"));
+	ck_assert(reply != NULL);
+	g_variant_get(reply, "(isb)", & handle, & code, & success);
+	g_variant_unref(reply);
+
+	ck_assert((success == TRUE) == (handle >= 0));
+	ck_assert((success == TRUE) == (code[0] != 0));
+	g_free(code);
+
+	return handle;
+}
+
+/**
+ * Run the main loop until a pairing's PairThread has finished and reported
+ * back, while the pairing is kept for its result to be collected.
+ *
+ * @param testbus The bus the pairing was started on.
+ * @param handle The handle of the pairing.
+ * @return true if the pairing completed, false o/w.
+ */
+static bool test_wait_pair_completed(TestBus * testbus, int handle) {
+	PairThread * pairthread;
+	gint64 end;
+
+	end = g_get_monotonic_time() + TEST_WAIT;
+	pairthread = processstore_get_pairthread(testbus->processstore, handle);
+	while ((pairthread != NULL) && (pairthread_get_state(pairthread) < PAIRTHREADSTATE_COMPLETED) && (g_get_monotonic_time() < end)) {
+		g_main_context_iteration(NULL, FALSE);
+		g_usleep(1000);
+		pairthread = processstore_get_pairthread(testbus->processstore, handle);
+	}
+
+	return ((pairthread != NULL) && (pairthread_get_state(pairthread) >= PAIRTHREADSTATE_COMPLETED));
+}
+
+/**
+ * Handle the StartAuth method, as pico-continuous does.
+ */
+static gboolean on_handle_start_auth(PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, const gchar * arg_username, const gchar * arg_parameters, gpointer user_data) {
+	return start_auth((ProcessStore *)user_data, object, invocation, arg_username, arg_parameters);
+}
+
+/**
+ * Handle the CompleteAuth method, as pico-continuous does.
+ */
+static gboolean on_handle_complete_auth(PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, gint handle, gpointer user_data) {
+	return complete_auth((ProcessStore *)user_data, object, invocation, handle);
+}
+
+/**
+ * Handle the ResumeAuth method, as pico-continuous does.
+ */
+static gboolean on_handle_resume_auth(PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, gint handle, const gchar * arg_username, const gchar * arg_code, gpointer user_data) {
+	return resume_auth((ProcessStore *)user_data, object, invocation, handle, arg_username, arg_code);
+}
+
+/**
+ * Handle the CancelAuth method, as pico-continuous does.
+ */
+static gboolean on_handle_cancel_auth(PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, gint handle, const gchar * arg_code, gpointer user_data) {
+	return cancel_auth((ProcessStore *)user_data, object, invocation, handle, arg_code);
+}
+
+/**
+ * Handle the StartPair method, as pico-continuous does.
+ */
+static gboolean on_handle_start_pair(PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, const gchar * arg_username, const gchar * arg_password, const gchar * arg_parameters, gpointer user_data) {
+	start_pair((ProcessStore *)user_data, object, invocation, arg_username, arg_password, arg_parameters);
+
+	return TRUE;
+}
+
+/**
+ * Handle the CompletePair method, as pico-continuous does.
+ */
+static gboolean on_handle_complete_pair(PicoUkAcCamClPicoInterface * object, GDBusMethodInvocation * invocation, gint handle, gpointer user_data) {
+	complete_pair((ProcessStore *)user_data, object, invocation, handle);
+
+	return TRUE;
+}
+
+START_TEST(test_processstore_instant_other_user) {
+	AuthThread * auththread;
+	AuthThread * existing;
+
+	existing = auththread_new();
+	auththread_set_username(existing, TEST_USERNAME);
+	auththread_set_password(existing, "Passuser1");
+	auththread_set_state(existing, AUTHTHREADSTATE_CONTINUING);
+
+	auththread = auththread_new();
+	auththread_set_username(auththread, TEST_OTHER);
+	auththread_set_state(auththread, AUTHTHREADSTATE_STARTED);
+
+	// Bob's password is never handed to Alice's session
+	auththread_complete_instant(auththread, existing);
+	ck_assert(auththread_get_state(auththread) == AUTHTHREADSTATE_STARTED);
+	ck_assert(auththread_get_result(auththread) == FALSE);
+	ck_assert_str_eq(auththread_get_password(auththread), "");
+
+	auththread_delete(auththread);
+	auththread_delete(existing);
+}
+END_TEST
+
+START_TEST(test_processstore_instant_reuse) {
+#ifdef TEST_SESSIONS
+	TestBus * testbus;
+	TestPico * testpico;
+	AuthThread * auththread;
+	GVariant * reply;
+	gchar * code;
+	gchar * instantcode;
+	gchar * othercode;
+	int handle;
+	int instant;
+	int other;
+
+	timesource_set_virtual(TRUE);
+	testbus = test_bus_new();
+
+	// Bob authenticates and his session continues
+	handle = test_start_auth(testbus, TEST_USERNAME, TEST_PARAMETERS, & code);
+	testpico = test_pico_start(code);
+	ck_assert(test_wait_state(testbus, handle, AUTHTHREADSTATE_CONTINUING) == TRUE);
+
+	// A new session for Bob challenges his Pico for instant unlock
+	instant = test_start_auth(testbus, TEST_USERNAME, TEST_PARAMETERS, & instantcode);
+	ck_assert_int_ne(instant, handle);
+
+	// The new session goes away before the Pico answers
+	reply = test_call(testbus, "CancelAuth", g_variant_new("(is)", instant, instantcode), NULL);
+	ck_assert(reply != NULL);
+	g_variant_unref(reply);
+	ck_assert(test_wait_state(testbus, instant, AUTHTHREADSTATE_HARVESTABLE) == TRUE);
+
+	// Another user's session is given the same handle
+	test_set_calleruid(TEST_UID_USER);
+	other = test_start_auth(testbus, TEST_OTHER, TEST_PARAMETERS_ANYUSER, & othercode);
+	ck_assert_int_eq(other, instant);
+
+	// The challenge expires, and mustn't be applied to the new holder of the handle
+	timesource_advance(TEST_INSTANT_WINDOW * 1000);
+	while (g_main_context_iteration(NULL, FALSE)) {
+	}
+
+	auththread = processstore_get_auththread(testbus->processstore, handle);
+	ck_assert(auththread != NULL);
+	ck_assert(auththread_get_state(auththread) == AUTHTHREADSTATE_CONTINUING);
+
+	auththread = processstore_get_auththread(testbus->processstore, other);
+	ck_assert(auththread != NULL);
+	ck_assert_str_eq(auththread_get_username(auththread), TEST_OTHER);
+	ck_assert(auththread_get_state(auththread) == AUTHTHREADSTATE_STARTED);
+
+	testpico_delete(testpico);
+	test_bus_delete(testbus);
+	g_free(code);
+	g_free(instantcode);
+	g_free(othercode);
+	timesource_set_virtual(FALSE);
+#else
+	printf("Instant unlock handle reuse: not tested, libpico doesn't support custom channels or session nonces\n");
+#endif
+}
+END_TEST
+
+START_TEST(test_processstore_instant_unanswered) {
+#ifdef TEST_SESSIONS
+	TestBus * testbus;
+	TestPico * testpico;
+	AuthThread * auththread;
+	gchar * code;
+	gchar * instantcode;
+	int handle;
+	int instant;
+
+	timesource_set_virtual(TRUE);
+	testbus = test_bus_new();
+
+	// Bob authenticates and his session continues
+	handle = test_start_auth(testbus, TEST_USERNAME, TEST_PARAMETERS, & code);
+	testpico = test_pico_start(code);
+	ck_assert(test_wait_state(testbus, handle, AUTHTHREADSTATE_CONTINUING) == TRUE);
+
+	// A new session for Bob challenges his Pico, which doesn't support it
+	instant = test_start_auth(testbus, TEST_USERNAME, TEST_PARAMETERS, & instantcode);
+	ck_assert_int_ne(instant, handle);
+
+	timesource_advance(TEST_INSTANT_WINDOW * 1000);
+	while (g_main_context_iteration(NULL, FALSE)) {
+	}
+
+	// The new session authenticates as usual, and the existing one carries on
+	auththread = processstore_get_auththread(testbus->processstore, instant);
+	ck_assert(auththread != NULL);
+	ck_assert(auththread_get_state(auththread) == AUTHTHREADSTATE_STARTED);
+
+	auththread = processstore_get_auththread(testbus->processstore, handle);
+	ck_assert(auththread != NULL);
+	ck_assert(auththread_get_state(auththread) == AUTHTHREADSTATE_CONTINUING);
+
+	testpico_delete(testpico);
+	test_bus_delete(testbus);
+	g_free(code);
+	g_free(instantcode);
+	timesource_set_virtual(FALSE);
+#else
+	printf("Instant unlock unanswered: not tested, libpico doesn't support custom channels or session nonces\n");
+#endif
+}
+END_TEST
+
+START_TEST(test_processstore_away) {
+	TestBus * testbus;
+	int handle;
+
+	testbus = test_bus_new();
+	test_preauth(testbus);
+
+	// Nothing is started for a user who hasn't authenticated
+	processstore_away(testbus->processstore, TEST_OTHER, TRUE);
+	ck_assert_int_eq(test_find_speculative(testbus, TEST_OTHER), -1);
+
+	// A speculative session is started when Bob goes away
+	processstore_away(testbus->processstore, TEST_USERNAME, TRUE);
+	handle = test_find_speculative(testbus, TEST_USERNAME);
+	ck_assert_int_ge(handle, 0);
+	ck_assert(auththread_get_state(processstore_get_auththread(testbus->processstore, handle)) == AUTHTHREADSTATE_STARTED);
+
+	// Going away again doesn't start a second one
+	processstore_away(testbus->processstore, TEST_USERNAME, TRUE);
+	ck_assert_int_eq(test_find_speculative(testbus, TEST_USERNAME), handle);
+
+	// It's stopped when Bob comes back without the greeter having asked
+	processstore_away(testbus->processstore, TEST_USERNAME, FALSE);
+	ck_assert(test_wait_state(testbus, handle, AUTHTHREADSTATE_HARVESTABLE) == TRUE);
+
+	test_bus_delete(testbus);
+}
+END_TEST
+
+START_TEST(test_processstore_attach) {
+	TestBus * testbus;
+	AuthThread * auththread;
+	gchar * code;
+	int speculative;
+	int handle;
+
+	testbus = test_bus_new();
+	test_preauth(testbus);
+
+	processstore_away(testbus->processstore, TEST_USERNAME, TRUE);
+	speculative = test_find_speculative(testbus, TEST_USERNAME);
+	ck_assert_int_ge(speculative, 0);
+
+	// A StartAuth call with different parameters gets a session of its own
+	handle = test_start_auth(testbus, TEST_USERNAME, TEST_PARAMETERS_ANYUSER, & code);
+	g_free(code);
+	ck_assert_int_ne(handle, speculative);
+	ck_assert_int_eq(test_find_speculative(testbus, TEST_USERNAME), speculative);
+
+	// A call from root with the same parameters attaches to it
+	handle = test_start_auth(testbus, TEST_USERNAME, TEST_PARAMETERS, & code);
+	ck_assert_int_eq(handle, speculative);
+	auththread = processstore_get_auththread(testbus->processstore, handle);
+	ck_assert(auththread_get_speculative(auththread) == FALSE);
+	ck_assert_str_eq(code, auththread_get_code(auththread));
+	g_free(code);
+
+	test_bus_delete(testbus);
+}
+END_TEST
+
+START_TEST(test_processstore_evict) {
+	TestBus * testbus;
+	AuthThread * auththread;
+	gchar * code;
+	int speculative;
+	int handle;
+	int count;
+
+	testbus = test_bus_new();
+	test_preauth(testbus);
+
+	processstore_away(testbus->processstore, TEST_USERNAME, TRUE);
+	speculative = test_find_speculative(testbus, TEST_USERNAME);
+	ck_assert_int_ge(speculative, 0);
+
+	// Fill the rest of the pool with sessions other users asked for
+	test_set_calleruid(TEST_UID_USER);
+	for (count = 1; count < MAX_SIMULTANEOUS_AUTHS; count++) {
+		handle = test_start_auth(testbus, TEST_OTHER, TEST_PARAMETERS_ANYUSER, & code);
+		g_free(code);
+		ck_assert_int_ne(handle, speculative);
+	}
+
+	// No speculative session is started while the pool is full
+	processstore_away(testbus->processstore, TEST_OTHER, TRUE);
+	ck_assert_int_eq(test_find_speculative(testbus, TEST_OTHER), -1);
+
+	// A real request takes the speculative session's handle
+	handle = test_start_auth(testbus, TEST_OTHER, TEST_PARAMETERS_ANYUSER, & code);
+	g_free(code);
+	ck_assert_int_eq(handle, speculative);
+	ck_assert_int_eq(test_find_speculative(testbus, TEST_USERNAME), -1);
+	auththread = processstore_get_auththread(testbus->processstore, handle);
+	ck_assert_str_eq(auththread_get_username(auththread), TEST_OTHER);
+
+	test_bus_delete(testbus);
+}
+END_TEST
+
+START_TEST(test_processstore_pair_refused) {
+	TestBus * testbus;
+
+	testbus = test_bus_new();
+
+	// Only root may pair a Pico with an account
+	test_set_calleruid(TEST_UID_USER);
+	ck_assert_int_eq(test_start_pair(testbus), -1);
+	ck_assert(processstore_is_idle(testbus->processstore) == TRUE);
+
+	test_bus_delete(testbus);
+}
+END_TEST
+
+START_TEST(test_processstore_pair_waiting) {
+#ifdef TESTPICO_SUPPORTED
+	TestBus * testbus;
+	TestPair * pair;
+	TestCall * call;
+	GVariant * reply;
+	gboolean success;
+	int handle;
+	int count;
+
+	testbus = test_bus_new();
+	pair = test_pair_new(testbus);
+
+	handle = test_start_pair(testbus);
+	ck_assert_int_ge(handle, 0);
+	ck_assert(test_pair_wait_read(pair) == TRUE);
+
+	// CompletePair waits while the pairing is still in progress
+	call = test_call_start(testbus, "CompletePair", g_variant_new("(i)", handle), G_VARIANT_TYPE("(b)"));
+	for (count = 0; count < 100; count++) {
+		g_main_context_iteration(NULL, FALSE);
+		g_usleep(1000);
+	}
+	ck_assert(call->done == FALSE);
+
+	// It's answered once the pairing finishes
+	test_pair_release(pair);
+	reply = test_call_wait(call);
+	ck_assert(reply != NULL);
+	g_variant_get(reply, "(b)", & success);
+	g_variant_unref(reply);
+	ck_assert(success == FALSE);
+
+	// Having been collected, the pairing is removed
+	ck_assert(processstore_get_pairthread(testbus->processstore, handle) == NULL);
+	ck_assert(processstore_is_idle(testbus->processstore) == TRUE);
+
+	test_bus_delete(testbus);
+	test_pair_delete(pair);
+#else
+	printf("Pairing: not tested, libpico doesn't support custom channels\n");
+#endif
+}
+END_TEST
+
+START_TEST(test_processstore_pair_finished) {
+#ifdef TESTPICO_SUPPORTED
+	TestBus * testbus;
+	TestPair * pair;
+	GVariant * reply;
+	gboolean success;
+	int handle;
+
+	testbus = test_bus_new();
+	pair = test_pair_new(testbus);
+
+	handle = test_start_pair(testbus);
+	ck_assert_int_ge(handle, 0);
+	ck_assert(test_pair_wait_read(pair) == TRUE);
+
+	// The pairing is kept after it finishes until its result is collected
+	test_pair_release(pair);
+	ck_assert(test_wait_pair_completed(testbus, handle) == TRUE);
+	ck_assert(processstore_is_idle(testbus->processstore) == FALSE);
+
+	reply = test_call(testbus, "CompletePair", g_variant_new("(i)", handle), G_VARIANT_TYPE("(b)"));
+	ck_assert(reply != NULL);
+	g_variant_get(reply, "(b)", & success);
+	g_variant_unref(reply);
+	ck_assert(success == FALSE);
+
+	ck_assert(processstore_get_pairthread(testbus->processstore, handle) == NULL);
+	ck_assert(processstore_is_idle(testbus->processstore) == TRUE);
+
+	// The result can only be collected once
+	reply = test_call(testbus, "CompletePair", g_variant_new("(i)", handle), G_VARIANT_TYPE("(b)"));
+	ck_assert(reply != NULL);
+	g_variant_get(reply, "(b)", & success);
+	g_variant_unref(reply);
+	ck_assert(success == FALSE);
+
+	test_bus_delete(testbus);
+	test_pair_delete(pair);
+#else
+	printf("Pairing: not tested, libpico doesn't support custom channels\n");
+#endif
+}
+END_TEST
+
+START_TEST(test_processstore_pair_orphaned) {
+#ifdef TESTPICO_SUPPORTED
+	TestBus * testbus;
+	TestPair * pair;
+	int handle;
+	gint64 end;
+
+	testbus = test_bus_new();
+	pair = test_pair_new(testbus);
+
+	handle = test_start_pair(testbus);
+	ck_assert_int_ge(handle, 0);
+	ck_assert(test_pair_wait_read(pair) == TRUE);
+
+	// The caller goes away without calling CompletePair
+	processstore_owner_lost(testbus->processstore, g_dbus_connection_get_unique_name(testbus->client));
+	ck_assert(processstore_get_pairthread(testbus->processstore, handle) != NULL);
+
+	// Nobody will collect the result, so the pairing is reaped once it finishes
+	test_pair_release(pair);
+	end = g_get_monotonic_time() + TEST_WAIT;
+	while ((processstore_get_pairthread(testbus->processstore, handle) != NULL) && (g_get_monotonic_time() < end)) {
+		g_main_context_iteration(NULL, FALSE);
+		g_usleep(1000);
+	}
+	ck_assert(processstore_get_pairthread(testbus->processstore, handle) == NULL);
+	ck_assert(processstore_is_idle(testbus->processstore) == TRUE);
+
+	test_bus_delete(testbus);
+	test_pair_delete(pair);
+#else
+	printf("Pairing: not tested, libpico doesn't support custom channels\n");
+#endif
+}
+END_TEST
+
+int main (void) {
+	int number_failed;
+	Suite * s;
+	SRunner *sr;
+	TCase * tc;
+
+	s = suite_create("Pico ProcessStore");
+
+	// Instant unlock test case
+	tc = tcase_create("Instant");
+	tcase_set_timeout(tc, 60.0);
+	tcase_add_test(tc, test_processstore_instant_other_user);
+	tcase_add_test(tc, test_processstore_instant_reuse);
+	tcase_add_test(tc, test_processstore_instant_unanswered);
+	suite_add_tcase(s, tc);
+
+	// Speculative session test case
+	tc = tcase_create("Speculative");
+	tcase_set_timeout(tc, 60.0);
+	tcase_add_test(tc, test_processstore_away);
+	tcase_add_test(tc, test_processstore_attach);
+	tcase_add_test(tc, test_processstore_evict);
+	suite_add_tcase(s, tc);
+
+	// Pairing test case
+	tc = tcase_create("Pairing");
+	tcase_set_timeout(tc, 60.0);
+	tcase_add_test(tc, test_processstore_pair_refused);
+	tcase_add_test(tc, test_processstore_pair_waiting);
+	tcase_add_test(tc, test_processstore_pair_finished);
+	tcase_add_test(tc, test_processstore_pair_orphaned);
+	suite_add_tcase(s, tc);
+
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+
+	return (number_failed == 0) ? 0 : -1;
+}
+
@@ -0,0 +1,554 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Continuous session resumption tests
+ * @section DESCRIPTION
+ *
+ * Performs unit tests for abbreviated re-authentication, using a simulated
+ * Pico to generate the resumption requests and check the replies.
+ *
+ * The grace window is also tested end-to-end against a continuous
+ * ServiceTcp, with the service's timers on the virtual clock. A simulated
+ * Pico authenticates over loopback, drops the link and reconnects to resume,
+ * then drops it again and lets the grace window run out. This needs libpico
+ * to allow a channel to be given its own transport, and to make the
+ * handshake nonce available, so it's skipped if it doesn't.
+ *
+ */
+
+#include "config.h"
+
+#include <check.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <glib.h>
+#include "pico/buffer.h"
+#include "pico/json.h"
+#include "pico/shared.h"
+#include "pico/nonce.h"
+#include "pico/fsmservice.h"
+#include "../src/processstore.h"
+#include "../src/timesource.h"
+#include "../src/service.h"
+#include "../src/service_private.h"
+#include "../src/servicetcp.h"
+#include "../src/resumption.h"
+#include "testpico.h"
+
+// Defines
+
+/**
+ * @brief The symmetric key shared between the service and the Pico
+ */
+#define TEST_KEY "\x75\xc0\x8f\x89\x33\x0c\xf3\x7b\x06\x3f\x40\x7a\x5b\x7a\xa6\xbc"
+
+/**
+ * @brief The service nonce from the session's handshake
+ */
+#define TEST_NONCE "0123456789abcdef0123456789abcdef"
+
+/**
+ * @brief Whether the grace window can be tested against a real service
+ */
+#if defined(TESTPICO_SUPPORTED) && defined(HAVE_SHARED_GET_SERVICE_NONCE) && defined(HAVE_NONCE_GET_BUFFER) && defined(HAVE_NONCE_GET_LENGTH)
+#define TEST_SERVICE (1)
+#endif
+
+/**
+ * @brief The grace window given to the service, in milliseconds
+ *
+ * This is kept well inside the state machine's own continuous
+ * authentication timeout, so that the virtual clock never reaches it.
+ */
+#define TEST_GRACE (1000)
+
+/**
+ * @brief The longest real time to wait for the service, in microseconds
+ */
+#define TEST_WAIT (20 * 1000000)
+
+// Structure definitions
+
+// Function prototypes
+
+#ifdef TEST_SERVICE
+static void test_pico_wait(TestPico * testpico);
+static void test_service_stopped(Service * service, void * user_data);
+#endif
+
+// Function definitions
+
+#ifdef TEST_SERVICE
+/**
+ * Run the main loop until a simulated Pico has finished authenticating or
+ * resuming.
+ *
+ * @param testpico The simulated Pico to wait for.
+ */
+static void test_pico_wait(TestPico * testpico) {
+	gint64 end;
+
+	end = g_get_monotonic_time() + TEST_WAIT;
+	while ((testpico_get_finished(testpico) == FALSE) && (g_get_monotonic_time() < end)) {
+		g_main_context_iteration(NULL, FALSE);
+		g_usleep(1000);
+	}
+}
+
+/**
+ * Callback for when a Service has stopped.
+ *
+ * @param service The service that stopped.
+ * @param user_data A bool to set to true.
+ */
+static void test_service_stopped(Service * service, void * user_data) {
+	bool * stopped = (bool *)user_data;
+
+	*stopped = TRUE;
+}
+#endif
+
+START_TEST(test_resumption_accept) {
+	Resumption * resumption;
+	Buffer * key;
+	Buffer * nonce;
+	Buffer * message;
+	Buffer * reply;
+	RESUMPTIONRESULT result;
+	bool checked;
+
+	key = buffer_new(0);
+	buffer_append(key, TEST_KEY, 16);
+	nonce = buffer_new(0);
+	buffer_append_string(nonce, TEST_NONCE);
+	message = buffer_new(0);
+	reply = buffer_new(0);
+
+	resumption = resumption_new();
+	resumption_set_keys(resumption, key, nonce);
+
+	// The simulated Pico proves it holds the key
+	resumption_prove(key, nonce, "picononce1", message);
+	result = resumption_read(resumption, buffer_get_buffer(message), buffer_get_pos(message), reply);
+	ck_assert_int_eq(result, RESUMPTIONRESULT_ACCEPTED);
+
+	// The Pico should be able to check the service holds the key too
+	checked = resumption_check_reply(key, nonce, "picononce1", buffer_get_buffer(reply), buffer_get_pos(reply));
+	ck_assert(checked == TRUE);
+	checked = resumption_check_reply(key, nonce, "picononce2", buffer_get_buffer(reply), buffer_get_pos(reply));
+	ck_assert(checked == FALSE);
+
+	// A second resumption in the same session needs a fresh nonce
+	resumption_prove(key, nonce, "picononce2", message);
+	result = resumption_read(resumption, buffer_get_buffer(message), buffer_get_pos(message), reply);
+	ck_assert_int_eq(result, RESUMPTIONRESULT_ACCEPTED);
+
+	resumption_delete(resumption);
+	buffer_delete(key);
+	buffer_delete(nonce);
+	buffer_delete(message);
+	buffer_delete(reply);
+}
+END_TEST
+
+START_TEST(test_resumption_reject) {
+	Resumption * resumption;
+	Buffer * key;
+	Buffer * wrongkey;
+	Buffer * nonce;
+	Buffer * othernonce;
+	Buffer * message;
+	Buffer * reply;
+	RESUMPTIONRESULT result;
+
+	key = buffer_new(0);
+	buffer_append(key, TEST_KEY, 16);
+	wrongkey = buffer_new(0);
+	buffer_append_string(wrongkey, "not the right key");
+	nonce = buffer_new(0);
+	buffer_append_string(nonce, TEST_NONCE);
+	othernonce = buffer_new(0);
+	buffer_append_string(othernonce, "fedcba9876543210fedcba9876543210");
+	message = buffer_new(0);
+	reply = buffer_new(0);
+
+	resumption = resumption_new();
+
+	// Nothing can be resumed until the keys are set
+	resumption_prove(key, nonce, "picononce1", message);
+	result = resumption_read(resumption, buffer_get_buffer(message), buffer_get_pos(message), reply);
+	ck_assert_int_eq(result, RESUMPTIONRESULT_REJECTED);
+
+	resumption_set_keys(resumption, key, nonce);
+
+	// A Pico without the key can't resume
+	resumption_prove(wrongkey, nonce, "picononce1", message);
+	result = resumption_read(resumption, buffer_get_buffer(message), buffer_get_pos(message), reply);
+	ck_assert_int_eq(result, RESUMPTIONRESULT_REJECTED);
+
+	// A resumption from a different session can't be used
+	resumption_prove(key, othernonce, "picononce1", message);
+	result = resumption_read(resumption, buffer_get_buffer(message), buffer_get_pos(message), reply);
+	ck_assert_int_eq(result, RESUMPTIONRESULT_REJECTED);
+
+	// A valid resumption can't be replayed
+	resumption_prove(key, nonce, "picononce1", message);
+	result = resumption_read(resumption, buffer_get_buffer(message), buffer_get_pos(message), reply);
+	ck_assert_int_eq(result, RESUMPTIONRESULT_ACCEPTED);
+	result = resumption_read(resumption, buffer_get_buffer(message), buffer_get_pos(message), reply);
+	ck_assert_int_eq(result, RESUMPTIONRESULT_REJECTED);
+
+	resumption_delete(resumption);
+	buffer_delete(key);
+	buffer_delete(wrongkey);
+	buffer_delete(nonce);
+	buffer_delete(othernonce);
+	buffer_delete(message);
+	buffer_delete(reply);
+}
+END_TEST
+
+START_TEST(test_resumption_other) {
+	Resumption * resumption;
+	Buffer * key;
+	Buffer * nonce;
+	Buffer * reply;
+	RESUMPTIONRESULT result;
+	char const * message;
+
+	key = buffer_new(0);
+	buffer_append(key, TEST_KEY, 16);
+	nonce = buffer_new(0);
+	buffer_append_string(nonce, TEST_NONCE);
+	reply = buffer_new(0);
+
+	resumption = resumption_new();
+	resumption_set_keys(resumption, key, nonce);
+
+	// Ordinary continuous authentication messages are left for the state machine
+	message = "{\"encryptedData\":\"AAAA\",\"iv\":\"BBBB\",\"sessionId\":0}";
+	result = resumption_read(resumption, message, strlen(message), reply);
+	ck_assert_int_eq(result, RESUMPTIONRESULT_OTHER);
+
+	message = "\x01\x02\x03";
+	result = resumption_read(resumption, message, strlen(message), reply);
+	ck_assert_int_eq(result, RESUMPTIONRESULT_OTHER);
+
+	resumption_delete(resumption);
+	buffer_delete(key);
+	buffer_delete(nonce);
+	buffer_delete(reply);
+}
+END_TEST
+
+START_TEST(test_resumption_challenge) {
+	Resumption * resumption;
+	Buffer * key;
+	Buffer * nonce;
+	Buffer * challenge;
+	Buffer * message;
+	Buffer * reply;
+	RESUMPTIONRESULT result;
+	Json * json;
+	bool parsed;
+	char picononce[64];
+
+	key = buffer_new(0);
+	buffer_append(key, TEST_KEY, 16);
+	nonce = buffer_new(0);
+	buffer_append_string(nonce, TEST_NONCE);
+	challenge = buffer_new(0);
+	message = buffer_new(0);
+	reply = buffer_new(0);
+
+	resumption = resumption_new();
+	resumption_set_keys(resumption, key, nonce);
+
+	// The service challenges the simulated Pico
+	resumption_challenge(resumption, challenge);
+	json = json_new();
+	parsed = json_deserialize_string(json, buffer_get_buffer(challenge), buffer_get_pos(challenge));
+	ck_assert(parsed == TRUE);
+	ck_assert(json_get_type(json, "challenge") == JSONTYPE_STRING);
+	g_strlcpy(picononce, json_get_string(json, "challenge"), sizeof(picononce));
+	json_delete(json);
+	ck_assert_int_eq(strlen(picononce), 32);
+
+	// A proof using some other nonce is valid, but doesn't answer the challenge
+	resumption_prove(key, nonce, "picononce1", message);
+	result = resumption_read(resumption, buffer_get_buffer(message), buffer_get_pos(message), reply);
+	ck_assert_int_eq(result, RESUMPTIONRESULT_ACCEPTED);
+
+	// Answering with the challenge completes it
+	resumption_prove(key, nonce, picononce, message);
+	result = resumption_read(resumption, buffer_get_buffer(message), buffer_get_pos(message), reply);
+	ck_assert_int_eq(result, RESUMPTIONRESULT_ANSWERED);
+	ck_assert(resumption_check_reply(key, nonce, picononce, buffer_get_buffer(reply), buffer_get_pos(reply)) == TRUE);
+
+	// The answer can't be used again
+	result = resumption_read(resumption, buffer_get_buffer(message), buffer_get_pos(message), reply);
+	ck_assert_int_eq(result, RESUMPTIONRESULT_REJECTED);
+
+	// Each challenge is different
+	resumption_challenge(resumption, message);
+	ck_assert(buffer_equals(message, challenge) == FALSE);
+
+	resumption_delete(resumption);
+	buffer_delete(key);
+	buffer_delete(nonce);
+	buffer_delete(challenge);
+	buffer_delete(message);
+	buffer_delete(reply);
+}
+END_TEST
+
+START_TEST(test_resumption_no_nonce) {
+	Resumption * resumption;
+	Buffer * key;
+	Buffer * nonce;
+	Buffer * message;
+	Buffer * reply;
+	RESUMPTIONRESULT result;
+
+	key = buffer_new(0);
+	buffer_append(key, TEST_KEY, 16);
+	nonce = buffer_new(0);
+	message = buffer_new(0);
+	reply = buffer_new(0);
+
+	// Without the handshake nonce the proof isn't bound to the session
+	resumption = resumption_new();
+	resumption_set_keys(resumption, key, nonce);
+
+	resumption_prove(key, nonce, "picononce1", message);
+	result = resumption_read(resumption, buffer_get_buffer(message), buffer_get_pos(message), reply);
+	ck_assert_int_eq(result, RESUMPTIONRESULT_REJECTED);
+
+	resumption_delete(resumption);
+	buffer_delete(key);
+	buffer_delete(nonce);
+	buffer_delete(message);
+	buffer_delete(reply);
+}
+END_TEST
+
+START_TEST(test_resumption_limit) {
+	Resumption * resumption;
+	Buffer * key;
+	Buffer * nonce;
+	Buffer * message;
+	Buffer * reply;
+	RESUMPTIONRESULT result;
+	char picononce[64];
+	int count;
+
+	key = buffer_new(0);
+	buffer_append(key, TEST_KEY, 16);
+	nonce = buffer_new(0);
+	buffer_append_string(nonce, TEST_NONCE);
+	message = buffer_new(0);
+	reply = buffer_new(0);
+
+	resumption = resumption_new();
+	resumption_set_keys(resumption, key, nonce);
+
+	// The number of nonces remembered is bounded, after which resumption stops
+	count = 0;
+	do {
+		snprintf(picononce, sizeof(picononce), "picononce%d", count);
+		resumption_prove(key, nonce, picononce, message);
+		result = resumption_read(resumption, buffer_get_buffer(message), buffer_get_pos(message), reply);
+		count++;
+	} while ((result == RESUMPTIONRESULT_ACCEPTED) && (count < 10000));
+
+	ck_assert_int_eq(result, RESUMPTIONRESULT_REJECTED);
+	ck_assert_int_gt(count, 16);
+	ck_assert_int_lt(count, 10000);
+
+	resumption_delete(resumption);
+	buffer_delete(key);
+	buffer_delete(nonce);
+	buffer_delete(message);
+	buffer_delete(reply);
+}
+END_TEST
+
+START_TEST(test_resumption_service) {
+#ifdef TEST_SERVICE
+	ServiceTcp * servicetcp;
+	Service * service;
+	Shared * shared;
+	Buffer * extradata;
+	Buffer * symmetrickey;
+	Buffer * sessionnonce;
+	Nonce * nonce;
+	Json * json;
+	TestPico * pico;
+	TestPico * resumer;
+	char * address;
+	char const * beacon;
+	bool stopped;
+	bool result;
+	gint64 end;
+
+	timesource_set_virtual(TRUE);
+
+	shared = shared_new();
+	shared_load_or_generate_keys(shared, "tests/keydir/" PUB_FILE, "tests/keydir/" PRIV_FILE);
+	extradata = buffer_new(0);
+	stopped = FALSE;
+
+	servicetcp = servicetcp_new();
+	servicetcp_set_host(servicetcp, "127.0.0.1");
+	service = (Service *)servicetcp;
+	service_set_beacons(service, FALSE);
+	service_set_continuous(service, TRUE);
+	service_set_resume_grace(service, TEST_GRACE);
+	service_set_stop_callback(service, test_service_stopped, & stopped);
+	service_start(service, shared, NULL, extradata);
+
+	beacon = service_get_beacon(service);
+	json = json_new();
+	result = json_deserialize_string(json, beacon, strlen(beacon)) && (json_get_type(json, "sa") == JSONTYPE_STRING);
+	ck_assert(result == TRUE);
+	address = g_strdup(json_get_string(json, "sa"));
+	json_delete(json);
+
+	// The Pico authenticates and the session continues
+	pico = testpico_new();
+	testpico_set_hold(pico, TRUE);
+	testpico_start(pico, address);
+	test_pico_wait(pico);
+	ck_assert(testpico_get_result(pico) == TRUE);
+	end = g_get_monotonic_time() + TEST_WAIT;
+	while ((service->resumption == NULL) && (g_get_monotonic_time() < end)) {
+		g_main_context_iteration(NULL, FALSE);
+		g_usleep(1000);
+	}
+	ck_assert(service->continuing == TRUE);
+	ck_assert(service->resumption != NULL);
+
+	// The keys a real Pico would hold for the session
+	symmetrickey = buffer_new(0);
+	buffer_append_buffer(symmetrickey, fsmservice_get_symmetric_key(service->fsmservice));
+	sessionnonce = buffer_new(0);
+	nonce = shared_get_service_nonce(shared);
+	buffer_append(sessionnonce, (char const *)nonce_get_buffer(nonce), nonce_get_length(nonce));
+
+	// The link drops, which starts the grace window rather than ending the session
+	testpico_delete(pico);
+	end = g_get_monotonic_time() + TEST_WAIT;
+	while ((service->resuming == FALSE) && (stopped == FALSE) && (g_get_monotonic_time() < end)) {
+		g_main_context_iteration(NULL, FALSE);
+		g_usleep(1000);
+	}
+	ck_assert(service->resuming == TRUE);
+
+	timesource_advance((TEST_GRACE / 2) * 1000);
+	ck_assert(service->resuming == TRUE);
+	ck_assert(stopped == FALSE);
+
+	// The Pico reconnects and resumes without a new handshake
+	resumer = testpico_new();
+	testpico_set_resume(resumer, symmetrickey, sessionnonce);
+	testpico_set_hold(resumer, TRUE);
+	testpico_start(resumer, address);
+	test_pico_wait(resumer);
+	ck_assert(testpico_get_result(resumer) == TRUE);
+	ck_assert(service->resuming == FALSE);
+	ck_assert(service->continuing == TRUE);
+
+	// So the session outlives the original grace window
+	timesource_advance(TEST_GRACE * 1000);
+	ck_assert(service->continuing == TRUE);
+	ck_assert(stopped == FALSE);
+
+	// The link drops again, and this time the Pico doesn't come back
+	testpico_delete(resumer);
+	end = g_get_monotonic_time() + TEST_WAIT;
+	while ((service->resuming == FALSE) && (stopped == FALSE) && (g_get_monotonic_time() < end)) {
+		g_main_context_iteration(NULL, FALSE);
+		g_usleep(1000);
+	}
+	ck_assert(service->resuming == TRUE);
+
+	timesource_advance((TEST_GRACE - 1) * 1000);
+	ck_assert(stopped == FALSE);
+
+	// Once the grace window runs out the session ends, locking the user out
+	timesource_advance(1 * 1000);
+	end = g_get_monotonic_time() + TEST_WAIT;
+	while ((stopped == FALSE) && (g_get_monotonic_time() < end)) {
+		g_main_context_iteration(NULL, FALSE);
+		g_usleep(1000);
+	}
+	ck_assert(stopped == TRUE);
+	ck_assert(service->continuing == FALSE);
+	ck_assert(service->resuming == FALSE);
+
+	service_delete(service);
+	buffer_delete(sessionnonce);
+	buffer_delete(symmetrickey);
+	buffer_delete(extradata);
+	shared_delete(shared);
+	g_free(address);
+	timesource_set_virtual(FALSE);
+#else
+	printf("Service grace window: not tested, libpico doesn't support custom channels or session nonces\n");
+#endif
+}
+END_TEST
+
+int main (void) {
+	int number_failed;
+	Suite * s;
+	SRunner *sr;
+	TCase * tc;
+
+	s = suite_create("Pico Resumption");
+
+	// Resumption test case
+	tc = tcase_create("Resumption");
+	tcase_set_timeout(tc, 60.0);
+	tcase_add_test(tc, test_resumption_accept);
+	tcase_add_test(tc, test_resumption_reject);
+	tcase_add_test(tc, test_resumption_other);
+	tcase_add_test(tc, test_resumption_challenge);
+	tcase_add_test(tc, test_resumption_no_nonce);
+	tcase_add_test(tc, test_resumption_limit);
+	tcase_add_test(tc, test_resumption_service);
+
+	suite_add_tcase(s, tc);
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+
+	return (number_failed == 0) ? 0 : -1;
+}
+
@@ -0,0 +1,785 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Rendezvous Point endpoint selection tests
+ * @section DESCRIPTION
+ *
+ * Performs unit tests for choosing between several Rendezvous Points,
+ * feeding in the request round trip times and failures that stand-in
+ * endpoints with different latencies would produce.
+ *
+ * The measurements are also checked end-to-end, by authenticating a
+ * simulated Pico to a ServiceRvp through local web servers standing in for
+ * Rendezvous Points, each answering after a different delay. The simulated
+ * Pico needs libpico to allow a channel to be given its own transport, so
+ * this is skipped if it doesn't.
+ *
+ */
+
+#include "config.h"
+
+#include <check.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+#include "pico/buffer.h"
+#include "pico/shared.h"
+#include "pico/channel.h"
+#include "../src/timesource.h"
+#include "../src/rvpendpoints.h"
+#include "../src/processstore.h"
+#include "../src/service.h"
+#include "../src/servicervp.h"
+#include "testpico.h"
+
+// Defines
+
+/**
+ * @brief A stand-in endpoint with a short round trip time
+ */
+#define TEST_NEAR "http://127.0.0.1:8001/channel/"
+
+/**
+ * @brief A stand-in endpoint with a longer round trip time
+ */
+#define TEST_FAR "http://127.0.0.1:8002/channel/"
+
+/**
+ * @brief A stand-in endpoint with a very long round trip time
+ */
+#define TEST_DISTANT "http://127.0.0.1:8003/channel/"
+
+/**
+ * @brief The list of all of the stand-in endpoints
+ */
+#define TEST_LIST TEST_DISTANT "," TEST_FAR "," TEST_NEAR
+
+/**
+ * @brief The longest time to wait for an authentication, in microseconds
+ */
+#define TEST_WAIT (20 * 1000000)
+
+/**
+ * @brief The length of the prefix on each message relayed
+ */
+#define TEST_LENGTH_PREFIX_SIZE (4)
+
+/**
+ * @brief The delays, in milliseconds, of the stand-in Rendezvous Points
+ */
+#define TEST_DELAY_NEAR (20)
+#define TEST_DELAY_FAR (150)
+#define TEST_DELAY_DISTANT (400)
+
+// Structure definitions
+
+/**
+ * @brief A local web server standing in for a Rendezvous Point
+ *
+ * The server relays messages between a single ServiceRvp and a simulated
+ * Pico. The service's messages are passed to the Pico's thread through
+ * topico, while the Pico's messages wait in toservice for the service's
+ * next GET request, or are returned immediately if one is already waiting.
+ * Replies to POST requests are held back by the server's delay. A failing
+ * server refuses every request.
+ */
+typedef struct _TestEndpoint {
+	SoupServer * server;
+	char * urlprefix;
+	guint delay;
+	bool failing;
+	GAsyncQueue * topico;
+	GQueue * toservice;
+	SoupMessage * waiting;
+	int gets;
+	int posts;
+} TestEndpoint;
+
+/**
+ * @brief A reply being held back by a stand-in Rendezvous Point
+ */
+typedef struct _TestDelayed {
+	SoupServer * server;
+	SoupMessage * msg;
+} TestDelayed;
+
+/**
+ * @brief A message from the simulated Pico on its way to the service
+ */
+typedef struct _TestDelivery {
+	TestEndpoint * endpoint;
+	GBytes * message;
+} TestDelivery;
+
+// Function prototypes
+
+static void test_rvpendpoints_samples(RvpEndpoints * rvpendpoints, char const * urlprefix, gint64 rtt, int count);
+#ifdef TESTPICO_SUPPORTED
+static TestEndpoint * test_endpoint_new(guint delay);
+static void test_endpoint_delete(TestEndpoint * endpoint);
+static void test_endpoint_handler(SoupServer * server, SoupMessage * msg, char const * path, GHashTable * query, SoupClientContext * client, gpointer user_data);
+static void test_endpoint_reply(SoupMessage * msg, GBytes * message);
+static gboolean test_endpoint_release(gpointer user_data);
+static gboolean test_endpoint_deliver(gpointer user_data);
+static void test_endpoint_finished(SoupMessage * msg, gpointer user_data);
+static bool test_channel_open(RVPChannel * channel);
+static bool test_channel_close(RVPChannel * channel);
+static bool test_channel_write(RVPChannel * channel, char * data, int length);
+static bool test_channel_read(RVPChannel * channel, Buffer * buffer);
+static RVPChannel * test_endpoint_connect(TestPico * testpico, char const * address, void * user_data);
+static void test_service_stopped(Service * service, void * user_data);
+static bool test_authenticate(RvpEndpoints * rvpendpoints, TestEndpoint * endpoint);
+#endif
+
+// Function definitions
+
+/**
+ * Report a number of successful requests to an endpoint, all with the same
+ * round trip time.
+ *
+ * @param rvpendpoints The object to report to.
+ * @param urlprefix The endpoint to report for.
+ * @param rtt The round trip time of each request, in microseconds.
+ * @param count The number of requests to report.
+ */
+static void test_rvpendpoints_samples(RvpEndpoints * rvpendpoints, char const * urlprefix, gint64 rtt, int count) {
+	int sample;
+
+	for (sample = 0; sample < count; sample++) {
+		rvpendpoints_report(rvpendpoints, urlprefix, rtt, TRUE);
+	}
+}
+
+#ifdef TESTPICO_SUPPORTED
+/**
+ * Create and start a stand-in Rendezvous Point listening on loopback.
+ *
+ * @param delay The time to hold back replies to POST requests, in
+ *        milliseconds.
+ * @return The newly created endpoint.
+ */
+static TestEndpoint * test_endpoint_new(guint delay) {
+	TestEndpoint * endpoint;
+	GSList * uris;
+	char * url;
+	gboolean listening;
+
+	endpoint = CALLOC(sizeof(TestEndpoint), 1);
+	endpoint->delay = delay;
+	endpoint->failing = FALSE;
+	endpoint->topico = g_async_queue_new_full((GDestroyNotify)g_bytes_unref);
+	endpoint->toservice = g_queue_new();
+	endpoint->waiting = NULL;
+	endpoint->gets = 0;
+	endpoint->posts = 0;
+
+	endpoint->server = soup_server_new(NULL, NULL);
+	soup_server_add_handler(endpoint->server, NULL, test_endpoint_handler, endpoint, NULL);
+	listening = soup_server_listen_local(endpoint->server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY, NULL);
+	ck_assert(listening == TRUE);
+
+	uris = soup_server_get_uris(endpoint->server);
+	url = soup_uri_to_string((SoupURI *)uris->data, FALSE);
+	g_slist_free_full(uris, (GDestroyNotify)soup_uri_free);
+	endpoint->urlprefix = g_strconcat(url, "channel/", NULL);
+	g_free(url);
+
+	return endpoint;
+}
+
+/**
+ * Stop a stand-in Rendezvous Point and free the memory allocated to it.
+ *
+ * @param endpoint The endpoint to delete.
+ */
+static void test_endpoint_delete(TestEndpoint * endpoint) {
+	soup_server_disconnect(endpoint->server);
+	g_object_unref(endpoint->server);
+	g_async_queue_unref(endpoint->topico);
+	g_queue_free_full(endpoint->toservice, (GDestroyNotify)g_bytes_unref);
+	g_free(endpoint->urlprefix);
+	FREE(endpoint);
+}
+
+/**
+ * Handler for a stand-in Rendezvous Point. A POST from the service is
+ * passed to the simulated Pico and answered after the endpoint's delay. A
+ * GET is answered with the Pico's next message, or held open until there
+ * is one.
+ *
+ * @param server The server that received the request.
+ * @param msg The request.
+ * @param path The path requested.
+ * @param query The query parameters.
+ * @param client The client that made the request.
+ * @param user_data The TestEndpoint the request was made to.
+ */
+static void test_endpoint_handler(SoupServer * server, SoupMessage * msg, char const * path, GHashTable * query, SoupClientContext * client, gpointer user_data) {
+	TestEndpoint * endpoint = (TestEndpoint *)user_data;
+	TestDelayed * delayed;
+	SoupBuffer * body;
+
+	if (endpoint->failing) {
+		soup_message_set_status(msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+	}
+	else if (msg->method == SOUP_METHOD_POST) {
+		endpoint->posts++;
+		body = soup_message_body_flatten(msg->request_body);
+		if (body->length > TEST_LENGTH_PREFIX_SIZE) {
+			g_async_queue_push(endpoint->topico, g_bytes_new(body->data + TEST_LENGTH_PREFIX_SIZE, body->length - TEST_LENGTH_PREFIX_SIZE));
+		}
+		soup_buffer_free(body);
+
+		soup_message_set_status(msg, SOUP_STATUS_OK);
+		soup_message_set_response(msg, "text/plain", SOUP_MEMORY_STATIC, "", 0);
+
+		delayed = CALLOC(sizeof(TestDelayed), 1);
+		delayed->server = endpoint->server;
+		delayed->msg = g_object_ref(msg);
+		soup_server_pause_message(server, msg);
+		g_timeout_add(endpoint->delay, test_endpoint_release, delayed);
+	}
+	else {
+		endpoint->gets++;
+		if (g_queue_is_empty(endpoint->toservice) == FALSE) {
+			test_endpoint_reply(msg, (GBytes *)g_queue_peek_head(endpoint->toservice));
+			g_bytes_unref((GBytes *)g_queue_pop_head(endpoint->toservice));
+		}
+		else {
+			endpoint->waiting = msg;
+			g_signal_connect(msg, "finished", G_CALLBACK(test_endpoint_finished), endpoint);
+			soup_server_pause_message(server, msg);
+		}
+	}
+}
+
+/**
+ * Set the response to a GET request to be a message from the simulated
+ * Pico, with the same length-prepended framing as the Rendezvous Point.
+ *
+ * @param msg The request to respond to.
+ * @param message The message to return.
+ */
+static void test_endpoint_reply(SoupMessage * msg, GBytes * message) {
+	Buffer * framed;
+	gsize length;
+	char const * data;
+
+	data = g_bytes_get_data(message, & length);
+	framed = buffer_new(0);
+	buffer_append_lengthprepend(framed, data, length);
+
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+	soup_message_set_response(msg, "application/octet-stream", SOUP_MEMORY_COPY, buffer_get_buffer(framed), buffer_get_pos(framed));
+
+	buffer_delete(framed);
+}
+
+/**
+ * Timeout callback to send a reply that's been held back.
+ *
+ * @param user_data The TestDelayed structure for the reply.
+ * @return Always returns FALSE so that the timeout only fires once.
+ */
+static gboolean test_endpoint_release(gpointer user_data) {
+	TestDelayed * delayed = (TestDelayed *)user_data;
+
+	soup_server_unpause_message(delayed->server, delayed->msg);
+	g_object_unref(delayed->msg);
+	FREE(delayed);
+
+	return FALSE;
+}
+
+/**
+ * Idle callback, run on the main loop, to pass a message from the simulated
+ * Pico to the service.
+ *
+ * @param user_data The TestDelivery structure for the message.
+ * @return Always returns FALSE so that the callback only fires once.
+ */
+static gboolean test_endpoint_deliver(gpointer user_data) {
+	TestDelivery * delivery = (TestDelivery *)user_data;
+	TestEndpoint * endpoint;
+
+	endpoint = delivery->endpoint;
+	if (endpoint->waiting != NULL) {
+		test_endpoint_reply(endpoint->waiting, delivery->message);
+		soup_server_unpause_message(endpoint->server, endpoint->waiting);
+		endpoint->waiting = NULL;
+		g_bytes_unref(delivery->message);
+	}
+	else {
+		g_queue_push_tail(endpoint->toservice, delivery->message);
+	}
+	FREE(delivery);
+
+	return FALSE;
+}
+
+/**
+ * Signal handler for when a GET request held open by a stand-in Rendezvous
+ * Point finishes, for example because the service cancelled it.
+ *
+ * @param msg The request that finished.
+ * @param user_data The TestEndpoint the request was made to.
+ */
+static void test_endpoint_finished(SoupMessage * msg, gpointer user_data) {
+	TestEndpoint * endpoint = (TestEndpoint *)user_data;
+
+	if (endpoint->waiting == msg) {
+		endpoint->waiting = NULL;
+	}
+}
+
+/**
+ * Channel function for the simulated Pico's channel through a stand-in
+ * Rendezvous Point. There's nothing to do to open it.
+ *
+ * @param channel The channel to open.
+ * @return Always returns true.
+ */
+static bool test_channel_open(RVPChannel * channel) {
+	return TRUE;
+}
+
+/**
+ * Channel function to close the simulated Pico's channel. There's nothing
+ * to do to close it.
+ *
+ * @param channel The channel to close.
+ * @return Always returns true.
+ */
+static bool test_channel_close(RVPChannel * channel) {
+	return TRUE;
+}
+
+/**
+ * Channel function to send a message from the simulated Pico to the
+ * service, by way of the main loop.
+ *
+ * @param channel The channel to write to.
+ * @param data The message to send.
+ * @param length The length of the message.
+ * @return Always returns true.
+ */
+static bool test_channel_write(RVPChannel * channel, char * data, int length) {
+	TestDelivery * delivery;
+
+	delivery = CALLOC(sizeof(TestDelivery), 1);
+	delivery->endpoint = (TestEndpoint *)channel_get_data(channel);
+	delivery->message = g_bytes_new(data, length);
+	g_idle_add(test_endpoint_deliver, delivery);
+
+	return TRUE;
+}
+
+/**
+ * Channel function to receive a message for the simulated Pico, blocking
+ * until the service has posted one.
+ *
+ * @param channel The channel to read from.
+ * @param buffer A buffer to store the message in, without its prefix.
+ * @return true if a message was received, false o/w.
+ */
+static bool test_channel_read(RVPChannel * channel, Buffer * buffer) {
+	TestEndpoint * endpoint;
+	GBytes * message;
+	gsize length;
+	char const * data;
+	bool result;
+
+	result = FALSE;
+	endpoint = (TestEndpoint *)channel_get_data(channel);
+	message = (GBytes *)g_async_queue_timeout_pop(endpoint->topico, TEST_WAIT);
+	if (message != NULL) {
+		data = g_bytes_get_data(message, & length);
+		buffer_clear(buffer);
+		buffer_append(buffer, data, length);
+		g_bytes_unref(message);
+		result = TRUE;
+	}
+
+	return result;
+}
+
+/**
+ * Connect the simulated Pico to the service through a stand-in Rendezvous
+ * Point. The address isn't needed, since the endpoint only relays for a
+ * single service.
+ *
+ * @param testpico The simulated Pico connecting.
+ * @param address The address from the invitation.
+ * @param user_data The TestEndpoint to relay through.
+ * @return The channel for the simulated Pico to use.
+ */
+static RVPChannel * test_endpoint_connect(TestPico * testpico, char const * address, void * user_data) {
+	RVPChannel * channel;
+
+	channel = channel_new();
+	channel_set_functions(channel, test_channel_open, test_channel_close, test_channel_write, test_channel_read, NULL, NULL, NULL);
+	channel_set_data(channel, user_data);
+
+	return channel;
+}
+
+/**
+ * Callback for when a Service has stopped.
+ *
+ * @param service The service that stopped.
+ * @param user_data A bool to set to true.
+ */
+static void test_service_stopped(Service * service, void * user_data) {
+	bool * stopped = (bool *)user_data;
+
+	*stopped = TRUE;
+}
+
+/**
+ * Authenticate a simulated Pico to a ServiceRvp through a stand-in
+ * Rendezvous Point, with the service reporting its requests to the
+ * RvpEndpoints object given. If the endpoint is failing, the service is
+ * stopped once it's reported the failure.
+ *
+ * @param rvpendpoints The object for the service to report to.
+ * @param endpoint The endpoint for the service to use.
+ * @return true if the authentication succeeded, false o/w.
+ */
+static bool test_authenticate(RvpEndpoints * rvpendpoints, TestEndpoint * endpoint) {
+	ServiceRvp * servicervp;
+	Shared * shared;
+	Buffer * extradata;
+	TestPico * testpico;
+	RvpEndpointStats stats;
+	unsigned long failures;
+	bool stopped;
+	bool result;
+	gint64 end;
+
+	shared = shared_new();
+	shared_load_or_generate_keys(shared, "tests/keydir/" PUB_FILE, "tests/keydir/" PRIV_FILE);
+	extradata = buffer_new(0);
+	stopped = FALSE;
+	result = FALSE;
+	testpico = NULL;
+
+	servicervp = servicervp_new();
+	servicervp_set_urlprefix(servicervp, endpoint->urlprefix);
+	servicervp_set_endpoints(servicervp, rvpendpoints);
+	service_set_beacons((Service *)servicervp, FALSE);
+	service_set_stop_callback((Service *)servicervp, test_service_stopped, & stopped);
+	service_start((Service *)servicervp, shared, NULL, extradata);
+
+	end = g_get_monotonic_time() + TEST_WAIT;
+	if (endpoint->failing) {
+		// Wait for the refused request to be reported
+		failures = 0;
+		if (rvpendpoints_get_stats(rvpendpoints, endpoint->urlprefix, & stats)) {
+			failures = stats.failures;
+		}
+		stats.failures = failures;
+		while ((stats.failures == failures) && (g_get_monotonic_time() < end)) {
+			g_main_context_iteration(NULL, TRUE);
+			rvpendpoints_get_stats(rvpendpoints, endpoint->urlprefix, & stats);
+		}
+		service_stop((Service *)servicervp);
+	}
+	else {
+		testpico = testpico_new();
+		testpico_set_connect(testpico, test_endpoint_connect, endpoint);
+		testpico_start(testpico, endpoint->urlprefix);
+	}
+
+	while (((stopped == FALSE) || ((testpico != NULL) && (testpico_get_done(testpico) == FALSE))) && (g_get_monotonic_time() < end)) {
+		g_main_context_iteration(NULL, TRUE);
+	}
+	ck_assert(stopped == TRUE);
+
+	if (testpico != NULL) {
+		result = testpico_get_result(testpico);
+		testpico_delete(testpico);
+	}
+
+	service_delete((Service *)servicervp);
+	buffer_delete(extradata);
+	shared_delete(shared);
+
+	return result;
+}
+#endif
+
+START_TEST(test_rvpendpoints_fastest) {
+	RvpEndpoints * rvpendpoints;
+	Buffer * urlprefix;
+	RvpEndpointStats stats;
+	bool result;
+
+	timesource_set_virtual(TRUE);
+	rvpendpoints = rvpendpoints_new();
+	urlprefix = buffer_new(0);
+
+	// With nothing known, the first endpoint listed is used
+	rvpendpoints_choose(rvpendpoints, TEST_LIST, urlprefix);
+	ck_assert_str_eq(buffer_get_buffer(urlprefix), TEST_DISTANT);
+
+	// Once it's known to be slow, an untried endpoint is preferred
+	test_rvpendpoints_samples(rvpendpoints, TEST_DISTANT, 900 * 1000, 4);
+	rvpendpoints_choose(rvpendpoints, TEST_LIST, urlprefix);
+	ck_assert_str_eq(buffer_get_buffer(urlprefix), TEST_FAR);
+
+	// The fastest endpoint wins once they've all been tried
+	test_rvpendpoints_samples(rvpendpoints, TEST_FAR, 150 * 1000, 4);
+	test_rvpendpoints_samples(rvpendpoints, TEST_NEAR, 20 * 1000, 4);
+	rvpendpoints_choose(rvpendpoints, TEST_LIST, urlprefix);
+	ck_assert_str_eq(buffer_get_buffer(urlprefix), TEST_NEAR);
+
+	result = rvpendpoints_get_stats(rvpendpoints, TEST_NEAR, & stats);
+	ck_assert(result == TRUE);
+	ck_assert_int_eq(stats.requests, 4);
+	ck_assert_int_eq(stats.rtt, 20 * 1000);
+
+	// A single slow request isn't enough to switch
+	rvpendpoints_report(rvpendpoints, TEST_NEAR, 500 * 1000, TRUE);
+	rvpendpoints_choose(rvpendpoints, TEST_LIST, urlprefix);
+	ck_assert_str_eq(buffer_get_buffer(urlprefix), TEST_NEAR);
+
+	// But an endpoint that stays slow loses out
+	test_rvpendpoints_samples(rvpendpoints, TEST_NEAR, 500 * 1000, 20);
+	rvpendpoints_choose(rvpendpoints, TEST_LIST, urlprefix);
+	ck_assert_str_eq(buffer_get_buffer(urlprefix), TEST_FAR);
+
+	// Requests without a round trip time don't affect it
+	result = rvpendpoints_get_stats(rvpendpoints, TEST_FAR, & stats);
+	ck_assert(result == TRUE);
+	rvpendpoints_report(rvpendpoints, TEST_FAR, -1, TRUE);
+	result = rvpendpoints_get_stats(rvpendpoints, TEST_FAR, & stats);
+	ck_assert_int_eq(stats.rtt, 150 * 1000);
+	ck_assert_int_eq(stats.requests, 5);
+
+	buffer_delete(urlprefix);
+	rvpendpoints_delete(rvpendpoints);
+	timesource_set_virtual(FALSE);
+}
+END_TEST
+
+START_TEST(test_rvpendpoints_failover) {
+	RvpEndpoints * rvpendpoints;
+	Buffer * urlprefix;
+	RvpEndpointStats stats;
+
+	timesource_set_virtual(TRUE);
+	rvpendpoints = rvpendpoints_new();
+	urlprefix = buffer_new(0);
+
+	test_rvpendpoints_samples(rvpendpoints, TEST_NEAR, 20 * 1000, 4);
+	test_rvpendpoints_samples(rvpendpoints, TEST_FAR, 150 * 1000, 4);
+	test_rvpendpoints_samples(rvpendpoints, TEST_DISTANT, 900 * 1000, 4);
+
+	// A failure moves the next session straight to another endpoint
+	rvpendpoints_report(rvpendpoints, TEST_NEAR, -1, FALSE);
+	rvpendpoints_choose(rvpendpoints, TEST_LIST, urlprefix);
+	ck_assert_str_eq(buffer_get_buffer(urlprefix), TEST_FAR);
+
+	// It's tried again once the backoff has passed
+	timesource_advance(RVPENDPOINTS_BACKOFF_MIN);
+	rvpendpoints_choose(rvpendpoints, TEST_LIST, urlprefix);
+	ck_assert_str_eq(buffer_get_buffer(urlprefix), TEST_NEAR);
+
+	// Consecutive failures back off for longer
+	rvpendpoints_report(rvpendpoints, TEST_NEAR, -1, FALSE);
+	rvpendpoints_get_stats(rvpendpoints, TEST_NEAR, & stats);
+	ck_assert_int_eq(stats.consecutive, 2);
+	ck_assert_int_eq(stats.failures, 2);
+	timesource_advance(RVPENDPOINTS_BACKOFF_MIN);
+	rvpendpoints_choose(rvpendpoints, TEST_LIST, urlprefix);
+	ck_assert_str_eq(buffer_get_buffer(urlprefix), TEST_FAR);
+	timesource_advance(RVPENDPOINTS_BACKOFF_MIN);
+	rvpendpoints_choose(rvpendpoints, TEST_LIST, urlprefix);
+	ck_assert_str_eq(buffer_get_buffer(urlprefix), TEST_NEAR);
+
+	// A success ends the backoff
+	rvpendpoints_report(rvpendpoints, TEST_FAR, -1, FALSE);
+	rvpendpoints_report(rvpendpoints, TEST_FAR, 150 * 1000, TRUE);
+	rvpendpoints_get_stats(rvpendpoints, TEST_FAR, & stats);
+	ck_assert_int_eq(stats.consecutive, 0);
+	ck_assert_int_eq(stats.backoff, 0);
+
+	// If they're all failing, the one that will recover soonest is used
+	rvpendpoints_report(rvpendpoints, TEST_NEAR, -1, FALSE);
+	rvpendpoints_report(rvpendpoints, TEST_DISTANT, -1, FALSE);
+	rvpendpoints_report(rvpendpoints, TEST_FAR, -1, FALSE);
+	rvpendpoints_choose(rvpendpoints, TEST_LIST, urlprefix);
+	ck_assert_str_eq(buffer_get_buffer(urlprefix), TEST_DISTANT);
+
+	buffer_delete(urlprefix);
+	rvpendpoints_delete(rvpendpoints);
+	timesource_set_virtual(FALSE);
+}
+END_TEST
+
+START_TEST(test_rvpendpoints_list) {
+	RvpEndpoints * rvpendpoints;
+	Buffer * urlprefix;
+	bool result;
+	RvpEndpointStats stats;
+
+	rvpendpoints = rvpendpoints_new();
+	urlprefix = buffer_new(0);
+
+	// Without any statistics the first endpoint is always used
+	test_rvpendpoints_samples(rvpendpoints, TEST_NEAR, 20 * 1000, 4);
+	rvpendpoints_choose(NULL, TEST_LIST, urlprefix);
+	ck_assert_str_eq(buffer_get_buffer(urlprefix), TEST_DISTANT);
+
+	// Whitespace and empty entries are skipped
+	rvpendpoints_choose(rvpendpoints, " \t" TEST_FAR " ,, " TEST_NEAR "\n", urlprefix);
+	ck_assert_str_eq(buffer_get_buffer(urlprefix), TEST_NEAR);
+
+	// An empty list leaves the URL prefix unchanged
+	rvpendpoints_choose(rvpendpoints, "", urlprefix);
+	ck_assert_str_eq(buffer_get_buffer(urlprefix), TEST_NEAR);
+
+	// Endpoints only appear once requests to them have been reported
+	result = rvpendpoints_get_stats(rvpendpoints, TEST_FAR, & stats);
+	ck_assert(result == FALSE);
+
+	buffer_delete(urlprefix);
+	rvpendpoints_delete(rvpendpoints);
+}
+END_TEST
+
+START_TEST(test_rvpendpoints_service) {
+#ifdef TESTPICO_SUPPORTED
+	RvpEndpoints * rvpendpoints;
+	TestEndpoint * near;
+	TestEndpoint * far;
+	TestEndpoint * distant;
+	RvpEndpointStats stats;
+	RvpEndpointStats farstats;
+	Buffer * urlprefix;
+	char * list;
+	bool result;
+
+	rvpendpoints = rvpendpoints_new();
+	urlprefix = buffer_new(0);
+	near = test_endpoint_new(TEST_DELAY_NEAR);
+	far = test_endpoint_new(TEST_DELAY_FAR);
+	distant = test_endpoint_new(TEST_DELAY_DISTANT);
+	list = g_strjoin(",", distant->urlprefix, far->urlprefix, near->urlprefix, NULL);
+
+	// With nothing known, the first endpoint listed is used
+	rvpendpoints_choose(rvpendpoints, list, urlprefix);
+	ck_assert_str_eq(buffer_get_buffer(urlprefix), distant->urlprefix);
+	result = test_authenticate(rvpendpoints, distant);
+	ck_assert(result == TRUE);
+
+	// Writes were timed and reads counted, with none failing
+	result = rvpendpoints_get_stats(rvpendpoints, distant->urlprefix, & stats);
+	ck_assert(result == TRUE);
+	ck_assert(distant->posts > 0);
+	ck_assert(stats.requests > (unsigned long)distant->posts);
+	ck_assert_int_eq(stats.failures, 0);
+	ck_assert(stats.rtt >= TEST_DELAY_DISTANT * 1000);
+
+	// Once it's known to be slow, an untried endpoint is preferred
+	rvpendpoints_choose(rvpendpoints, list, urlprefix);
+	ck_assert_str_eq(buffer_get_buffer(urlprefix), far->urlprefix);
+	result = test_authenticate(rvpendpoints, far);
+	ck_assert(result == TRUE);
+
+	result = rvpendpoints_get_stats(rvpendpoints, far->urlprefix, & farstats);
+	ck_assert(result == TRUE);
+	ck_assert(farstats.rtt >= TEST_DELAY_FAR * 1000);
+	ck_assert(farstats.rtt < stats.rtt);
+
+	// It's now the one to use
+	rvpendpoints_choose(rvpendpoints, list, urlprefix);
+	ck_assert_str_eq(buffer_get_buffer(urlprefix), far->urlprefix);
+
+	// When it starts failing, the service reports it
+	far->failing = TRUE;
+	test_authenticate(rvpendpoints, far);
+	result = rvpendpoints_get_stats(rvpendpoints, far->urlprefix, & farstats);
+	ck_assert(result == TRUE);
+	ck_assert(farstats.failures > 0);
+	ck_assert(farstats.backoff > 0);
+
+	// So the next session fails over to another endpoint
+	rvpendpoints_choose(rvpendpoints, list, urlprefix);
+	ck_assert_str_eq(buffer_get_buffer(urlprefix), near->urlprefix);
+	result = test_authenticate(rvpendpoints, near);
+	ck_assert(result == TRUE);
+
+	result = rvpendpoints_get_stats(rvpendpoints, near->urlprefix, & stats);
+	ck_assert(result == TRUE);
+	ck_assert(stats.rtt >= TEST_DELAY_NEAR * 1000);
+	ck_assert(stats.rtt < farstats.rtt);
+
+	// Which is fastest, so stays in use
+	rvpendpoints_choose(rvpendpoints, list, urlprefix);
+	ck_assert_str_eq(buffer_get_buffer(urlprefix), near->urlprefix);
+
+	g_free(list);
+	test_endpoint_delete(distant);
+	test_endpoint_delete(far);
+	test_endpoint_delete(near);
+	buffer_delete(urlprefix);
+	rvpendpoints_delete(rvpendpoints);
+#else
+	printf("ServiceRvp endpoints: not tested, libpico doesn't support custom channels\n");
+#endif
+}
+END_TEST
+
+int main (void) {
+	int number_failed;
+	Suite * s;
+	SRunner *sr;
+	TCase * tc;
+
+	s = suite_create("Pico RvpEndpoints");
+
+	// RvpEndpoints test case
+	tc = tcase_create("RvpEndpoints");
+	tcase_set_timeout(tc, 60.0);
+	tcase_add_test(tc, test_rvpendpoints_fastest);
+	tcase_add_test(tc, test_rvpendpoints_failover);
+	tcase_add_test(tc, test_rvpendpoints_list);
+	tcase_add_test(tc, test_rvpendpoints_service);
+
+	suite_add_tcase(s, tc);
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+
+	return (number_failed == 0) ? 0 : -1;
+}
+
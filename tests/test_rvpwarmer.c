@@ -0,0 +1,431 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Rendezvous Point connection warming tests
+ * @section DESCRIPTION
+ *
+ * Performs unit tests for keeping connections to the Rendezvous Points
+ * warm, using a local web server as a stand-in Rendezvous Point. Also checks
+ * that the sessions sharing the RvpWarmer's connections aren't held back
+ * by each other.
+ *
+ */
+
+#include "config.h"
+
+#include <check.h>
+#include <stdbool.h>
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+#include "pico/buffer.h"
+#include "pico/shared.h"
+#include "../src/rvpendpoints.h"
+#include "../src/rvpwarmer.h"
+#include "../src/timesource.h"
+#include "../src/processstore.h"
+#include "../src/service.h"
+#include "../src/servicervp.h"
+
+// Defines
+
+/**
+ * @brief The longest time to wait for requests to complete, in microseconds
+ */
+#define TEST_WAIT (10 * 1000000)
+
+/**
+ * @brief A stand-in endpoint that nothing is listening on
+ */
+#define TEST_UNREACHABLE "http://127.0.0.1:1/channel/"
+
+// Structure definitions
+
+/**
+ * @brief What the stand-in Rendezvous Point has seen
+ *
+ * The ports are the client ports of the first and last requests, which
+ * are the same if the connection was reused.
+ */
+typedef struct _TestServer {
+	int heads;
+	int gets;
+	guint16 firstport;
+	guint16 lastport;
+} TestServer;
+
+// Function prototypes
+
+static void test_server_handler(SoupServer * server, SoupMessage * msg, char const * path, GHashTable * query, SoupClientContext * client, gpointer user_data);
+static void wait_for_warming(RvpWarmer * rvpwarmer, unsigned long finished);
+static void test_request_complete(SoupSession * session, SoupMessage * msg, gpointer user_data);
+static void test_hold_handler(SoupServer * server, SoupMessage * msg, char const * path, GHashTable * query, SoupClientContext * client, gpointer user_data);
+static void test_service_stopped(Service * service, void * user_data);
+
+// Function definitions
+
+/**
+ * Handler for the stand-in Rendezvous Point, which records each request
+ * and replies with an empty body.
+ *
+ * @param server The server that received the request.
+ * @param msg The request.
+ * @param path The path requested.
+ * @param query The query parameters.
+ * @param client The client that made the request.
+ * @param user_data The TestServer structure to record the request in.
+ */
+static void test_server_handler(SoupServer * server, SoupMessage * msg, char const * path, GHashTable * query, SoupClientContext * client, gpointer user_data) {
+	TestServer * testserver = (TestServer *)user_data;
+	GSocketAddress * address;
+	guint16 port;
+
+	address = soup_client_context_get_remote_address(client);
+	port = g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(address));
+	if ((testserver->heads + testserver->gets) == 0) {
+		testserver->firstport = port;
+	}
+	testserver->lastport = port;
+
+	if (msg->method == SOUP_METHOD_HEAD) {
+		testserver->heads++;
+	}
+	else {
+		testserver->gets++;
+	}
+
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+	soup_message_set_response(msg, "text/plain", SOUP_MEMORY_STATIC, "", 0);
+}
+
+/**
+ * Run the main loop until the given number of warming requests have
+ * finished, either successfully or not, or until the wait times out.
+ *
+ * @param rvpwarmer The RvpWarmer making the requests.
+ * @param finished The number of finished requests to wait for.
+ */
+static void wait_for_warming(RvpWarmer * rvpwarmer, unsigned long finished) {
+	RvpWarmerStats stats;
+	gint64 end;
+
+	end = g_get_monotonic_time() + TEST_WAIT;
+	rvpwarmer_get_stats(rvpwarmer, & stats);
+	while (((stats.warmed + stats.failed) < finished) && (g_get_monotonic_time() < end)) {
+		g_main_context_iteration(NULL, TRUE);
+		rvpwarmer_get_stats(rvpwarmer, & stats);
+	}
+}
+
+/**
+ * Callback for a request made through the RvpWarmer's session, which
+ * records the status of the reply.
+ *
+ * @param session The session the request was made through.
+ * @param msg The completed request.
+ * @param user_data A guint to store the status in.
+ */
+static void test_request_complete(SoupSession * session, SoupMessage * msg, gpointer user_data) {
+	guint * status = (guint *)user_data;
+
+	*status = msg->status_code;
+}
+
+/**
+ * Handler for a stand-in Rendezvous Point that never has anything for the
+ * service, so holds every GET request open, as a real Rendezvous Point does
+ * while waiting for a Pico. Each request is counted.
+ *
+ * @param server The server that received the request.
+ * @param msg The request.
+ * @param path The path requested.
+ * @param query The query parameters.
+ * @param client The client that made the request.
+ * @param user_data The TestServer structure to record the request in.
+ */
+static void test_hold_handler(SoupServer * server, SoupMessage * msg, char const * path, GHashTable * query, SoupClientContext * client, gpointer user_data) {
+	TestServer * testserver = (TestServer *)user_data;
+
+	if (msg->method == SOUP_METHOD_GET) {
+		testserver->gets++;
+		soup_server_pause_message(server, msg);
+	}
+	else {
+		testserver->heads++;
+		soup_message_set_status(msg, SOUP_STATUS_OK);
+		soup_message_set_response(msg, "text/plain", SOUP_MEMORY_STATIC, "", 0);
+	}
+}
+
+/**
+ * Callback for when a Service has stopped.
+ *
+ * @param service The service that stopped.
+ * @param user_data An int counting the services stopped.
+ */
+static void test_service_stopped(Service * service, void * user_data) {
+	int * stopped = (int *)user_data;
+
+	(*stopped)++;
+}
+
+START_TEST(test_rvpwarmer_reuse) {
+	RvpWarmer * rvpwarmer;
+	RvpWarmerStats stats;
+	SoupServer * server;
+	SoupMessage * msg;
+	TestServer testserver;
+	GSList * uris;
+	gboolean listening;
+	char * url;
+	char * channel;
+	guint status;
+	gint64 end;
+
+	memset(& testserver, 0, sizeof(TestServer));
+	server = soup_server_new(NULL, NULL);
+	soup_server_add_handler(server, NULL, test_server_handler, & testserver, NULL);
+	listening = soup_server_listen_local(server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY, NULL);
+	ck_assert(listening == TRUE);
+	uris = soup_server_get_uris(server);
+	url = soup_uri_to_string((SoupURI *)uris->data, FALSE);
+	g_slist_free_full(uris, (GDestroyNotify)soup_uri_free);
+
+	rvpwarmer = rvpwarmer_new();
+
+	// The same URL listed twice is only warmed once
+	channel = g_strconcat(url, "channel/", NULL);
+	rvpwarmer_add(rvpwarmer, channel);
+	rvpwarmer_add(rvpwarmer, channel);
+	wait_for_warming(rvpwarmer, 1);
+
+	rvpwarmer_get_stats(rvpwarmer, & stats);
+	ck_assert_int_eq(stats.warmed, 1);
+	ck_assert_int_eq(stats.failed, 0);
+	ck_assert_int_eq(testserver.heads, 1);
+
+	// A request through the session picks up the warm connection
+	g_free(channel);
+	channel = g_strconcat(url, "channel/0123456789abcdef", NULL);
+	msg = soup_message_new("GET", channel);
+	status = SOUP_STATUS_NONE;
+	soup_session_queue_message(rvpwarmer_get_session(rvpwarmer), msg, test_request_complete, & status);
+	end = g_get_monotonic_time() + TEST_WAIT;
+	while ((status == SOUP_STATUS_NONE) && (g_get_monotonic_time() < end)) {
+		g_main_context_iteration(NULL, TRUE);
+	}
+
+	ck_assert_int_eq(status, SOUP_STATUS_OK);
+	ck_assert_int_eq(testserver.gets, 1);
+	ck_assert_int_eq(testserver.firstport, testserver.lastport);
+
+	rvpwarmer_delete(rvpwarmer);
+	g_free(channel);
+	g_free(url);
+	soup_server_disconnect(server);
+	g_object_unref(server);
+}
+END_TEST
+
+START_TEST(test_rvpwarmer_refresh) {
+	RvpWarmer * rvpwarmer;
+	RvpWarmerStats stats;
+	SoupServer * server;
+	TestServer testserver;
+	GSList * uris;
+	gboolean listening;
+	char * url;
+	char * channel;
+
+	memset(& testserver, 0, sizeof(TestServer));
+	server = soup_server_new(NULL, NULL);
+	soup_server_add_handler(server, NULL, test_server_handler, & testserver, NULL);
+	listening = soup_server_listen_local(server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY, NULL);
+	ck_assert(listening == TRUE);
+	uris = soup_server_get_uris(server);
+	url = soup_uri_to_string((SoupURI *)uris->data, FALSE);
+	g_slist_free_full(uris, (GDestroyNotify)soup_uri_free);
+
+	// Run the warming timer against the virtual clock
+	timesource_set_virtual(TRUE);
+	rvpwarmer = rvpwarmer_new();
+
+	channel = g_strconcat(url, "channel/", NULL);
+	rvpwarmer_add(rvpwarmer, channel);
+	wait_for_warming(rvpwarmer, 1);
+
+	// Nothing more is sent until the interval has passed
+	timesource_advance((RVPWARMER_INTERVAL - 1) * G_USEC_PER_SEC);
+	rvpwarmer_get_stats(rvpwarmer, & stats);
+	ck_assert_int_eq(stats.warmed, 1);
+
+	// The connection is refreshed once the interval has passed
+	timesource_advance(1 * G_USEC_PER_SEC);
+	wait_for_warming(rvpwarmer, 2);
+
+	rvpwarmer_get_stats(rvpwarmer, & stats);
+	ck_assert_int_eq(stats.warmed, 2);
+	ck_assert_int_eq(stats.failed, 0);
+	ck_assert_int_eq(testserver.heads, 2);
+	ck_assert_int_eq(testserver.firstport, testserver.lastport);
+
+	rvpwarmer_delete(rvpwarmer);
+	timesource_set_virtual(FALSE);
+	g_free(channel);
+	g_free(url);
+	soup_server_disconnect(server);
+	g_object_unref(server);
+}
+END_TEST
+
+START_TEST(test_rvpwarmer_fail) {
+	RvpWarmer * rvpwarmer;
+	RvpWarmerStats stats;
+	RvpEndpoints * rvpendpoints;
+	RvpEndpointStats endpointstats;
+	bool found;
+
+	rvpendpoints = rvpendpoints_new();
+	rvpwarmer = rvpwarmer_new();
+	rvpwarmer_set_endpoints(rvpwarmer, rvpendpoints);
+
+	rvpwarmer_add(rvpwarmer, TEST_UNREACHABLE);
+	wait_for_warming(rvpwarmer, 1);
+
+	rvpwarmer_get_stats(rvpwarmer, & stats);
+	ck_assert_int_eq(stats.warmed, 0);
+	ck_assert_int_eq(stats.failed, 1);
+
+	// The failure counts against the endpoint before any session uses it
+	found = rvpendpoints_get_stats(rvpendpoints, TEST_UNREACHABLE, & endpointstats);
+	ck_assert(found == TRUE);
+	ck_assert_int_eq(endpointstats.failures, 1);
+	ck_assert(endpointstats.backoff > 0);
+
+	rvpwarmer_delete(rvpwarmer);
+	rvpendpoints_delete(rvpendpoints);
+}
+END_TEST
+
+START_TEST(test_rvpwarmer_concurrent) {
+	RvpWarmer * rvpwarmer;
+	SoupServer * server;
+	TestServer testserver;
+	ServiceRvp * servicervp[MAX_SIMULTANEOUS_AUTHS];
+	Shared * shared;
+	Buffer * extradata;
+	GSList * uris;
+	gboolean listening;
+	char * url;
+	char * channel;
+	int count;
+	int stopped;
+	gint64 end;
+
+	memset(& testserver, 0, sizeof(TestServer));
+	server = soup_server_new(NULL, NULL);
+	soup_server_add_handler(server, NULL, test_hold_handler, & testserver, NULL);
+	listening = soup_server_listen_local(server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY, NULL);
+	ck_assert(listening == TRUE);
+	uris = soup_server_get_uris(server);
+	url = soup_uri_to_string((SoupURI *)uris->data, FALSE);
+	g_slist_free_full(uris, (GDestroyNotify)soup_uri_free);
+	channel = g_strconcat(url, "channel/", NULL);
+
+	rvpwarmer = rvpwarmer_new();
+	shared = shared_new();
+	shared_load_or_generate_keys(shared, "tests/keydir/" PUB_FILE, "tests/keydir/" PRIV_FILE);
+	extradata = buffer_new(0);
+	stopped = 0;
+
+	// As many sessions as the service allows wait on the same Rendezvous Point
+	for (count = 0; count < MAX_SIMULTANEOUS_AUTHS; count++) {
+		servicervp[count] = servicervp_new();
+		servicervp_set_urlprefix(servicervp[count], channel);
+		servicervp_set_session(servicervp[count], rvpwarmer_get_session(rvpwarmer));
+		service_set_beacons((Service *)servicervp[count], FALSE);
+		service_set_stop_callback((Service *)servicervp[count], test_service_stopped, & stopped);
+		service_start((Service *)servicervp[count], shared, NULL, extradata);
+	}
+
+	// Every session's long poll reaches the Rendezvous Point at once, rather
+	// than queueing behind the others
+	end = g_get_monotonic_time() + TEST_WAIT;
+	while ((testserver.gets < MAX_SIMULTANEOUS_AUTHS) && (g_get_monotonic_time() < end)) {
+		g_main_context_iteration(NULL, FALSE);
+		g_usleep(1000);
+	}
+	ck_assert_int_eq(testserver.gets, MAX_SIMULTANEOUS_AUTHS);
+
+	for (count = 0; count < MAX_SIMULTANEOUS_AUTHS; count++) {
+		service_stop((Service *)servicervp[count]);
+	}
+	end = g_get_monotonic_time() + TEST_WAIT;
+	while ((stopped < MAX_SIMULTANEOUS_AUTHS) && (g_get_monotonic_time() < end)) {
+		g_main_context_iteration(NULL, FALSE);
+		g_usleep(1000);
+	}
+	ck_assert_int_eq(stopped, MAX_SIMULTANEOUS_AUTHS);
+
+	for (count = 0; count < MAX_SIMULTANEOUS_AUTHS; count++) {
+		service_delete((Service *)servicervp[count]);
+	}
+	buffer_delete(extradata);
+	shared_delete(shared);
+	rvpwarmer_delete(rvpwarmer);
+	g_free(channel);
+	g_free(url);
+	soup_server_disconnect(server);
+	g_object_unref(server);
+}
+END_TEST
+
+int main (void) {
+	int number_failed;
+	Suite * s;
+	SRunner *sr;
+	TCase * tc;
+
+	s = suite_create("Pico RvpWarmer");
+
+	// RvpWarmer test case
+	tc = tcase_create("RvpWarmer");
+	tcase_set_timeout(tc, 20.0);
+	tcase_add_test(tc, test_rvpwarmer_reuse);
+	tcase_add_test(tc, test_rvpwarmer_refresh);
+	tcase_add_test(tc, test_rvpwarmer_fail);
+	tcase_add_test(tc, test_rvpwarmer_concurrent);
+
+	suite_add_tcase(s, tc);
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+
+	return (number_failed == 0) ? 0 : -1;
+}
@@ -0,0 +1,382 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief ServiceRace tests
+ * @section DESCRIPTION
+ *
+ * Races a ServiceTcp that a simulated Pico connects to over loopback
+ * against a ServiceTcp that nothing connects to, which stands in for a
+ * stalled channel. The channel the Pico connects to should win, whichever
+ * side of the race it's on, the stalled channel should be cancelled, and
+ * queries about the session should be answered by the winner. Each channel
+ * should run with its own Shared object, and the race's statistics should
+ * record the result. This needs the simulated Pico, so is skipped if
+ * libpico doesn't support it.
+ *
+ */
+
+#include "config.h"
+
+#include <check.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include "pico/buffer.h"
+#include "pico/json.h"
+#include "pico/shared.h"
+#include "pico/fsmservice.h"
+#include "../src/service.h"
+#include "../src/service_private.h"
+#include "../src/servicetcp.h"
+#include "../src/servicerace.h"
+#include "testpico.h"
+
+// Defines
+
+/**
+ * @brief The longest real time to wait for the race, in microseconds
+ */
+#define TEST_WAIT (20 * 1000000)
+
+// Structure definitions
+
+/**
+ * @brief A race between a channel a Pico connects to and a stalled one
+ */
+typedef struct _TestRace {
+	Service * service;
+	ServiceTcp * connected;
+	ServiceTcp * stalled;
+	Shared * shared;
+	Buffer * extradata;
+	bool stopped;
+	int updates;
+} TestRace;
+
+// Function prototypes
+
+#ifdef TESTPICO_SUPPORTED
+static TestRace * test_race_new(bool rvpwins);
+static void test_race_delete(TestRace * testrace);
+static void test_race_run(bool rvpwins);
+static void test_race_stop(TestRace * testrace);
+static bool test_race_listening(int port);
+static void test_race_stopped(Service * service, void * user_data);
+static void test_race_update(Service * service, int state, void * user_data);
+#endif
+
+// Function definitions
+
+#ifdef TESTPICO_SUPPORTED
+/**
+ * Create a race between two loopback channels and start it. The simulated
+ * Pico will connect to one of them, and the other will stall.
+ *
+ * @param rvpwins true if the channel the Pico connects to should stand in
+ *        for the Rendezvous Point, false if it should stand in for
+ *        Bluetooth.
+ * @return The newly created object.
+ */
+static TestRace * test_race_new(bool rvpwins) {
+	TestRace * testrace;
+	ServiceRace * servicerace;
+
+	testrace = g_new0(TestRace, 1);
+	testrace->shared = shared_new();
+	shared_load_or_generate_keys(testrace->shared, "tests/keydir/" PUB_FILE, "tests/keydir/" PRIV_FILE);
+	testrace->extradata = buffer_new(0);
+	buffer_append_string(testrace->extradata, "extra");
+
+	testrace->connected = servicetcp_new();
+	servicetcp_set_host(testrace->connected, "127.0.0.1");
+	testrace->stalled = servicetcp_new();
+	servicetcp_set_host(testrace->stalled, "127.0.0.1");
+
+	servicerace = servicerace_new();
+	if (rvpwins) {
+		servicerace_set_channels(servicerace, (Service *)testrace->connected, (Service *)testrace->stalled);
+	}
+	else {
+		servicerace_set_channels(servicerace, (Service *)testrace->stalled, (Service *)testrace->connected);
+	}
+
+	testrace->service = (Service *)servicerace;
+	service_set_beacons(testrace->service, FALSE);
+	service_set_continuous(testrace->service, FALSE);
+	service_set_stop_callback(testrace->service, test_race_stopped, testrace);
+	service_set_update_callback(testrace->service, test_race_update, testrace);
+	service_start(testrace->service, testrace->shared, NULL, testrace->extradata);
+
+	return testrace;
+}
+
+/**
+ * Delete a race, along with the channels it owns.
+ *
+ * @param testrace The object to free.
+ */
+static void test_race_delete(TestRace * testrace) {
+	service_delete(testrace->service);
+	shared_delete(testrace->shared);
+	buffer_delete(testrace->extradata);
+	g_free(testrace);
+}
+
+/**
+ * Stop a race and wait for both of its channels to finish.
+ *
+ * @param testrace The race to stop.
+ */
+static void test_race_stop(TestRace * testrace) {
+	gint64 end;
+
+	service_stop(testrace->service);
+	end = g_get_monotonic_time() + TEST_WAIT;
+	while ((testrace->stopped == FALSE) && (g_get_monotonic_time() < end)) {
+		g_main_context_iteration(NULL, FALSE);
+		g_usleep(1000);
+	}
+	ck_assert(testrace->stopped == TRUE);
+}
+
+/**
+ * Check whether anything is accepting connections on a loopback port.
+ *
+ * @param port The port to check.
+ * @return true if a connection could be made, false o/w.
+ */
+static bool test_race_listening(int port) {
+	GSocketClient * client;
+	GSocketConnection * connection;
+
+	client = g_socket_client_new();
+	connection = g_socket_client_connect_to_host(client, "127.0.0.1", port, NULL, NULL);
+	if (connection != NULL) {
+		g_io_stream_close(G_IO_STREAM(connection), NULL, NULL);
+		g_object_unref(connection);
+	}
+	g_object_unref(client);
+
+	return (connection != NULL);
+}
+
+/**
+ * Callback for when the race has stopped.
+ *
+ * @param service The race that stopped.
+ * @param user_data The TestRace.
+ */
+static void test_race_stopped(Service * service, void * user_data) {
+	TestRace * testrace = (TestRace *)user_data;
+
+	ck_assert(service == testrace->service);
+	testrace->stopped = TRUE;
+}
+
+/**
+ * Callback for the state updates passed on by the race, which should only
+ * ever come from the winner.
+ *
+ * @param service The race.
+ * @param state The state the winner changed to.
+ * @param user_data The TestRace.
+ */
+static void test_race_update(Service * service, int state, void * user_data) {
+	TestRace * testrace = (TestRace *)user_data;
+
+	ck_assert(service == testrace->service);
+	ck_assert(testrace->service->delegate == (Service *)testrace->connected);
+	testrace->updates++;
+}
+
+/**
+ * Run a race that the simulated Pico wins, and check the result.
+ *
+ * @param rvpwins true if the channel the Pico connects to stands in for the
+ *        Rendezvous Point, false if it stands in for Bluetooth.
+ */
+static void test_race_run(bool rvpwins) {
+	TestRace * testrace;
+	ServiceRaceStats before;
+	ServiceRaceStats after;
+	Service * connected;
+	Service * stalled;
+	TestPico * pico;
+	Json * json;
+	char * address;
+	char const * beacon;
+	bool result;
+	int port;
+	gint64 end;
+
+	servicerace_get_stats(& before);
+	testrace = test_race_new(rvpwins);
+	connected = (Service *)testrace->connected;
+	stalled = (Service *)testrace->stalled;
+
+	// Each channel has its own Shared object, holding the identity key
+	ck_assert(connected->shared != NULL);
+	ck_assert(stalled->shared != NULL);
+	ck_assert(connected->shared != testrace->shared);
+	ck_assert(stalled->shared != testrace->shared);
+	ck_assert(connected->shared != stalled->shared);
+	ck_assert(shared_get_service_identity_key(connected->shared) != NULL);
+	ck_assert(shared_get_service_identity_key(stalled->shared) != NULL);
+
+	// The race's QR code comes from the channel standing in for the Rendezvous Point
+	beacon = service_get_beacon(testrace->service);
+	ck_assert_str_eq(beacon, service_get_beacon(rvpwins ? connected : stalled));
+
+	// Nothing has connected, so there's no winner yet. The stalled channel
+	// isn't connected to here, since that would let it win
+	ck_assert(testrace->service->delegate == NULL);
+	port = servicetcp_get_port(testrace->stalled);
+	ck_assert_int_ne(port, 0);
+
+	json = json_new();
+	beacon = service_get_beacon(connected);
+	result = json_deserialize_string(json, beacon, strlen(beacon)) && (json_get_type(json, "sa") == JSONTYPE_STRING);
+	ck_assert(result == TRUE);
+	address = g_strdup(json_get_string(json, "sa"));
+	json_delete(json);
+
+	pico = testpico_new();
+	testpico_start(pico, address);
+	end = g_get_monotonic_time() + TEST_WAIT;
+	while ((testpico_get_finished(pico) == FALSE) && (g_get_monotonic_time() < end)) {
+		g_main_context_iteration(NULL, FALSE);
+		g_usleep(1000);
+	}
+	ck_assert(testpico_get_result(pico) == TRUE);
+
+	// The channel the Pico connected to won, and its updates were passed on
+	ck_assert(testrace->service->delegate == connected);
+	ck_assert_int_gt(testrace->updates, 0);
+
+	// Queries about the session are answered by the winner
+	ck_assert(service_get_symmetric_key(testrace->service) == service_get_symmetric_key(connected));
+	ck_assert_int_gt(buffer_get_pos(service_get_symmetric_key(testrace->service)), 0);
+	ck_assert(service_get_received_extra_data(testrace->service) == service_get_received_extra_data(connected));
+	ck_assert(service_get_last_heard(testrace->service) == service_get_last_heard(connected));
+
+	// The stalled channel was cancelled as soon as the race was won
+	ck_assert(test_race_listening(port) == FALSE);
+
+	servicerace_get_stats(& after);
+	ck_assert_int_eq(after.races, before.races + 1);
+	ck_assert_int_eq(after.unfinished, before.unfinished);
+	if (rvpwins) {
+		ck_assert_int_eq(after.rvp.wins, before.rvp.wins + 1);
+		ck_assert_int_eq(after.btc.wins, before.btc.wins);
+		ck_assert(after.rvp.latencytotal > before.rvp.latencytotal);
+		ck_assert(after.rvp.latencymax > 0);
+	}
+	else {
+		ck_assert_int_eq(after.btc.wins, before.btc.wins + 1);
+		ck_assert_int_eq(after.rvp.wins, before.rvp.wins);
+		ck_assert(after.btc.latencytotal > before.btc.latencytotal);
+		ck_assert(after.btc.latencymax > 0);
+	}
+
+	test_race_stop(testrace);
+
+	testpico_delete(pico);
+	test_race_delete(testrace);
+	g_free(address);
+}
+#endif
+
+START_TEST(test_servicerace_rvp_wins) {
+#ifdef TESTPICO_SUPPORTED
+	test_race_run(TRUE);
+#else
+	printf("Race won by the Rendezvous Point: not tested, libpico doesn't support custom channels\n");
+#endif
+}
+END_TEST
+
+START_TEST(test_servicerace_btc_wins) {
+#ifdef TESTPICO_SUPPORTED
+	test_race_run(FALSE);
+#else
+	printf("Race won by Bluetooth: not tested, libpico doesn't support custom channels\n");
+#endif
+}
+END_TEST
+
+START_TEST(test_servicerace_unfinished) {
+#ifdef TESTPICO_SUPPORTED
+	TestRace * testrace;
+	ServiceRaceStats before;
+	ServiceRaceStats after;
+
+	servicerace_get_stats(& before);
+	testrace = test_race_new(TRUE);
+
+	// Neither channel is connected to before the race is stopped
+	test_race_stop(testrace);
+	ck_assert(testrace->service->delegate == NULL);
+	ck_assert_int_eq(testrace->updates, 0);
+
+	servicerace_get_stats(& after);
+	ck_assert_int_eq(after.races, before.races + 1);
+	ck_assert_int_eq(after.unfinished, before.unfinished + 1);
+	ck_assert_int_eq(after.rvp.wins, before.rvp.wins);
+	ck_assert_int_eq(after.btc.wins, before.btc.wins);
+
+	test_race_delete(testrace);
+#else
+	printf("Race with no winner: not tested, libpico doesn't support custom channels\n");
+#endif
+}
+END_TEST
+
+int main (void) {
+	int number_failed;
+	Suite * s;
+	SRunner *sr;
+	TCase * tc;
+
+	s = suite_create("Pico ServiceRace");
+
+	// ServiceRace test case
+	tc = tcase_create("ServiceRace");
+	tcase_set_timeout(tc, 60.0);
+	tcase_add_test(tc, test_servicerace_rvp_wins);
+	tcase_add_test(tc, test_servicerace_btc_wins);
+	tcase_add_test(tc, test_servicerace_unfinished);
+
+	suite_add_tcase(s, tc);
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+
+	return (number_failed == 0) ? 0 : -1;
+}
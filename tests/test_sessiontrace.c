@@ -0,0 +1,211 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Session trace tests
+ * @section DESCRIPTION
+ *
+ * Performs unit tests for recording and reading back session traces.
+ *
+ */
+
+#include <check.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include "pico/buffer.h"
+#include "../src/timesource.h"
+#include "../src/sessiontrace.h"
+
+// Defines
+
+/**
+ * @brief The file to record the test traces into
+ */
+#define TRACE_FILE "test_sessiontrace.trace"
+
+// Structure definitions
+
+// Function prototypes
+
+// Function definitions
+
+START_TEST(test_sessiontrace_roundtrip) {
+	SessionTrace * trace;
+	SESSIONTRACEEVENT event;
+	gint64 delta;
+	Buffer * data;
+	char large[1000];
+	char continuous;
+	struct stat status;
+	bool result;
+
+	timesource_set_virtual(TRUE);
+	memset(large, 'x', sizeof(large));
+	continuous = 1;
+
+	unlink(TRACE_FILE);
+	trace = sessiontrace_new();
+	result = sessiontrace_open_write(trace, TRACE_FILE);
+	ck_assert(result == TRUE);
+
+	// Only the owner should be able to read the trace
+	ck_assert_int_eq(stat(TRACE_FILE, & status), 0);
+	ck_assert_int_eq(status.st_mode & 0777, 0600);
+
+	sessiontrace_record(trace, SESSIONTRACEEVENT_START, & continuous, 1);
+	timesource_advance(5);
+	sessiontrace_record(trace, SESSIONTRACEEVENT_CONNECTED, NULL, 0);
+	// Check a delay and length that need multi-byte encodings
+	timesource_advance(3600 * (gint64)1000000);
+	sessiontrace_record(trace, SESSIONTRACEEVENT_READ, large, sizeof(large));
+	sessiontrace_record_string(trace, SESSIONTRACEEVENT_DBUS, "StartAuth");
+	sessiontrace_close(trace);
+
+	// Recording after closing should be ignored
+	sessiontrace_record(trace, SESSIONTRACEEVENT_TIMEOUT, NULL, 0);
+
+	data = buffer_new(0);
+	result = sessiontrace_open_read(trace, TRACE_FILE);
+	ck_assert(result == TRUE);
+
+	result = sessiontrace_read(trace, & event, & delta, data);
+	ck_assert(result == TRUE);
+	ck_assert_int_eq(event, SESSIONTRACEEVENT_START);
+	ck_assert_int_eq(delta, 0);
+	ck_assert_int_eq(buffer_get_pos(data), 1);
+	ck_assert_int_eq(buffer_get_buffer(data)[0], 1);
+
+	result = sessiontrace_read(trace, & event, & delta, data);
+	ck_assert(result == TRUE);
+	ck_assert_int_eq(event, SESSIONTRACEEVENT_CONNECTED);
+	ck_assert_int_eq(delta, 5);
+	ck_assert_int_eq(buffer_get_pos(data), 0);
+
+	result = sessiontrace_read(trace, & event, & delta, data);
+	ck_assert(result == TRUE);
+	ck_assert_int_eq(event, SESSIONTRACEEVENT_READ);
+	ck_assert_int_eq(delta, 3600 * (gint64)1000000);
+	ck_assert_int_eq(buffer_get_pos(data), sizeof(large));
+	ck_assert(memcmp(buffer_get_buffer(data), large, sizeof(large)) == 0);
+
+	result = sessiontrace_read(trace, & event, & delta, data);
+	ck_assert(result == TRUE);
+	ck_assert_int_eq(event, SESSIONTRACEEVENT_DBUS);
+	ck_assert_int_eq(delta, 0);
+	ck_assert_int_eq(buffer_get_pos(data), strlen("StartAuth"));
+	ck_assert(memcmp(buffer_get_buffer(data), "StartAuth", strlen("StartAuth")) == 0);
+
+	// That's the end of the trace
+	result = sessiontrace_read(trace, & event, & delta, data);
+	ck_assert(result == FALSE);
+
+	buffer_delete(data);
+	sessiontrace_delete(trace);
+	unlink(TRACE_FILE);
+}
+END_TEST
+
+START_TEST(test_sessiontrace_invalid) {
+	SessionTrace * trace;
+	FILE * file;
+	bool result;
+	SESSIONTRACEEVENT event;
+	gint64 delta;
+	Buffer * data;
+
+	file = fopen(TRACE_FILE, "w");
+	ck_assert(file != NULL);
+	fputs("Not a trace", file);
+	fclose(file);
+
+	trace = sessiontrace_new();
+	result = sessiontrace_open_read(trace, TRACE_FILE);
+	ck_assert(result == FALSE);
+
+	result = sessiontrace_open_read(trace, "does-not-exist.trace");
+	ck_assert(result == FALSE);
+
+	// An existing file mustn't be written over
+	result = sessiontrace_open_write(trace, TRACE_FILE);
+	ck_assert(result == FALSE);
+	unlink(TRACE_FILE);
+
+	// Nor should a symbolic link be followed
+	ck_assert(symlink("does-not-exist.trace", TRACE_FILE) == 0);
+	result = sessiontrace_open_write(trace, TRACE_FILE);
+	ck_assert(result == FALSE);
+	ck_assert(access("does-not-exist.trace", F_OK) != 0);
+	unlink(TRACE_FILE);
+
+	// A record claiming to be longer than the limit should be rejected
+	file = fopen(TRACE_FILE, "w");
+	ck_assert(file != NULL);
+	fputs(SESSIONTRACE_MAGIC, file);
+	// Event type, time and a length of 2^35 bytes
+	fwrite("\x01\x00\x80\x80\x80\x80\x80\x01", 1, 8, file);
+	fclose(file);
+
+	data = buffer_new(0);
+	result = sessiontrace_open_read(trace, TRACE_FILE);
+	ck_assert(result == TRUE);
+	result = sessiontrace_read(trace, & event, & delta, data);
+	ck_assert(result == FALSE);
+	buffer_delete(data);
+
+	ck_assert_str_eq(sessiontrace_event_name(SESSIONTRACEEVENT_WRITE), "write");
+	ck_assert_str_eq(sessiontrace_event_name(SESSIONTRACEEVENT_NUM), "invalid");
+
+	sessiontrace_delete(trace);
+	unlink(TRACE_FILE);
+}
+END_TEST
+
+int main (void) {
+	int number_failed;
+	Suite * s;
+	SRunner *sr;
+	TCase * tc;
+
+	s = suite_create("Pico Session Trace");
+
+	// Session trace test case
+	tc = tcase_create("SessionTrace");
+	tcase_set_timeout(tc, 20.0);
+	tcase_add_test(tc, test_sessiontrace_roundtrip);
+	tcase_add_test(tc, test_sessiontrace_invalid);
+
+	suite_add_tcase(s, tc);
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+
+	return (number_failed == 0) ? 0 : -1;
+}
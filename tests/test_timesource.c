@@ -0,0 +1,216 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Virtual time tests
+ * @section DESCRIPTION
+ *
+ * Performs unit tests for the virtual clock, and uses it to run
+ * timeout-driven scenarios that would take a long time in real time.
+ *
+ */
+
+#include <check.h>
+#include <stdbool.h>
+#include <glib.h>
+#include "mockbt/mockbt.h"
+#include "../src/timesource.h"
+#include "../src/beaconsend.h"
+
+// Defines
+
+/**
+ * @brief One second in the microsecond units used by the virtual clock
+ */
+#define SECOND (1000000)
+
+/**
+ * @brief One hour in the microsecond units used by the virtual clock
+ */
+#define HOUR (60 * 60 * (gint64)SECOND)
+
+// Structure definitions
+
+/**
+ * @brief Records the calls made to a timeout callback
+ */
+typedef struct _Record {
+	int calls;
+	gint64 time[4];
+	int order[4];
+	int * next;
+} Record;
+
+// Function prototypes
+
+// Function definitions
+
+START_TEST(test_timesource_order) {
+	Record record[3];
+	int next;
+	int count;
+
+	gboolean callback(gpointer user_data) {
+		Record * record = (Record *)user_data;
+
+		record->time[record->calls] = timesource_get_monotonic_time();
+		record->order[record->calls] = *record->next;
+		record->calls++;
+		(*record->next)++;
+		return FALSE;
+	}
+
+	timesource_set_virtual(TRUE);
+	next = 0;
+	for (count = 0; count < 3; count++) {
+		record[count].calls = 0;
+		record[count].next = & next;
+	}
+
+	timesource_advance(SECOND);
+
+	// Added out of order to check they're dispatched in order
+	timesource_timeout_add(3000, callback, & record[2]);
+	timesource_timeout_add(1000, callback, & record[0]);
+	timesource_timeout_add(2000, callback, & record[1]);
+
+	timesource_advance(SECOND / 2);
+	ck_assert_int_eq(next, 0);
+
+	timesource_advance(3 * SECOND);
+	ck_assert_int_eq(next, 3);
+	for (count = 0; count < 3; count++) {
+		ck_assert_int_eq(record[count].calls, 1);
+		ck_assert_int_eq(record[count].order[0], count);
+		ck_assert_int_eq(record[count].time[0], (count + 2) * (gint64)SECOND);
+	}
+
+	// Timeouts that return FALSE shouldn't trigger again
+	timesource_advance(HOUR);
+	ck_assert_int_eq(next, 3);
+}
+END_TEST
+
+START_TEST(test_timesource_repeat) {
+	int calls;
+	guint id;
+	gint64 start;
+
+	gboolean callback(gpointer user_data) {
+		(*(int *)user_data)++;
+		return TRUE;
+	}
+
+	timesource_set_virtual(TRUE);
+	start = timesource_get_monotonic_time();
+	calls = 0;
+
+	// An hour of one second retries
+	id = timesource_timeout_add(1000, callback, & calls);
+	timesource_advance(HOUR);
+	ck_assert_int_eq(calls, 60 * 60);
+	ck_assert_int_eq(timesource_get_monotonic_time(), start + HOUR);
+	ck_assert_int_eq(timesource_get_real_time(), start + HOUR);
+
+	// Removing the source should work in the usual way
+	g_source_remove(id);
+	timesource_advance(HOUR);
+	ck_assert_int_eq(calls, 60 * 60);
+}
+END_TEST
+
+START_TEST(test_timesource_beacons) {
+	BeaconSend * beaconsend;
+	int connects;
+	bool finished;
+
+	sdp_session_t * sdp_connect_count(const bdaddr_t *src, const bdaddr_t *dst, uint32_t flags) {
+		connects++;
+		// Fail to connect, so the beacon is never written
+		return NULL;
+	}
+
+	int str2ba_success(const char *str, bdaddr_t *ba) {
+		return 0;
+	}
+
+	void finished_callback(BeaconSend const * beaconsend, void * user_data) {
+		*(bool *)user_data = TRUE;
+	}
+
+	bt_funcs.sdp_connect = sdp_connect_count;
+	bt_funcs.str2ba = str2ba_success;
+	timesource_set_virtual(TRUE);
+	connects = 0;
+	finished = FALSE;
+
+	beaconsend = beaconsend_new();
+	beaconsend_set_device(beaconsend, "00:00:00:00:00:00");
+	beaconsend_set_code(beaconsend, "{}");
+	beaconsend_set_finished_callback(beaconsend, finished_callback, & finished);
+
+	// The first attempt is made immediately
+	beaconsend_start(beaconsend);
+	ck_assert_int_eq(connects, 1);
+
+	// Subsequent attempts are made every two seconds
+	timesource_advance(HOUR);
+	ck_assert_int_eq(connects, 1 + (60 * 60 / 2));
+	ck_assert(finished == FALSE);
+
+	// The beacons stop at the next attempt
+	beaconsend_stop(beaconsend);
+	timesource_advance(2 * SECOND);
+	ck_assert(finished == TRUE);
+	ck_assert_int_eq(connects, 1 + (60 * 60 / 2));
+
+	beaconsend_delete(beaconsend);
+}
+END_TEST
+
+int main (void) {
+	int number_failed;
+	Suite * s;
+	SRunner *sr;
+	TCase * tc;
+
+	s = suite_create("Pico Time Source");
+
+	// Virtual time test case
+	tc = tcase_create("TimeSource");
+	tcase_set_timeout(tc, 20.0);
+	tcase_add_test(tc, test_timesource_order);
+	tcase_add_test(tc, test_timesource_repeat);
+	tcase_add_test(tc, test_timesource_beacons);
+
+	suite_add_tcase(s, tc);
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+
+	return (number_failed == 0) ? 0 : -1;
+}
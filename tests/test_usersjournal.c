@@ -0,0 +1,478 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Paired users journal tests
+ * @section DESCRIPTION
+ *
+ * Performs unit tests for the append-only journal of paired users and
+ * Bluetooth devices, including incremental refreshes and compaction.
+ *
+ */
+
+#include <check.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "pico/buffer.h"
+#include "pico/keypair.h"
+#include "pico/users.h"
+#include "mockbt/mockbt.h"
+#include "../src/usersjournal.h"
+
+// Defines
+
+/**
+ * @brief The Bluetooth address of the simulated Pico
+ */
+#define TEST_ADDRESS "00:11:22:33:44:55"
+
+// Structure definitions
+
+// Function prototypes
+
+static Buffer * test_make_configdir();
+static void test_remove_configdir(Buffer * configdir);
+static void test_append_user(UsersJournal const * usersjournal, char const * name);
+static int test_count_user(Users const * users, char const * name);
+static bt_err_t test_bt_list_load(bt_device_list_t * list, const char * filename);
+
+// Function definitions
+
+/**
+ * Create an empty temporary configuration directory.
+ *
+ * @return The directory path, including a trailing slash.
+ */
+static Buffer * test_make_configdir() {
+	Buffer * configdir;
+	gchar * dirname;
+
+	dirname = g_dir_make_tmp("test_usersjournal_XXXXXX", NULL);
+	ck_assert(dirname != NULL);
+
+	configdir = buffer_new(0);
+	buffer_append_string(configdir, dirname);
+	buffer_append_string(configdir, "/");
+	g_free(dirname);
+
+	return configdir;
+}
+
+/**
+ * Remove a temporary configuration directory and the files in it.
+ *
+ * @param configdir The directory path, including a trailing slash.
+ */
+static void test_remove_configdir(Buffer * configdir) {
+	GDir * dir;
+	gchar const * leaf;
+	gchar * filename;
+
+	dir = g_dir_open(buffer_get_buffer(configdir), 0, NULL);
+	if (dir != NULL) {
+		leaf = g_dir_read_name(dir);
+		while (leaf != NULL) {
+			filename = g_strconcat(buffer_get_buffer(configdir), leaf, NULL);
+			g_unlink(filename);
+			g_free(filename);
+			leaf = g_dir_read_name(dir);
+		}
+		g_dir_close(dir);
+	}
+	g_rmdir(buffer_get_buffer(configdir));
+
+	buffer_delete(configdir);
+}
+
+/**
+ * Append a user with a freshly generated key to the journal.
+ *
+ * @param usersjournal The journal to append to.
+ * @param name The name of the user.
+ */
+static void test_append_user(UsersJournal const * usersjournal, char const * name) {
+	KeyPair * keypair;
+	Buffer * symmetrickey;
+	bool result;
+
+	keypair = keypair_new();
+	keypair_generate(keypair);
+	symmetrickey = buffer_new(0);
+	buffer_append_string(symmetrickey, "0123456789abcdef");
+
+	result = usersjournal_append_user(usersjournal, name, keypair_getpublickey(keypair), symmetrickey);
+	ck_assert(result == TRUE);
+
+	buffer_delete(symmetrickey);
+	keypair_delete(keypair);
+}
+
+/**
+ * Count the entries for a user in a list.
+ *
+ * @param users The list to search.
+ * @param name The name of the user.
+ * @return The number of entries with that name.
+ */
+static int test_count_user(Users const * users, char const * name) {
+	Users * filtered;
+	int count;
+
+	filtered = users_new();
+	count = users_filter_by_name(users, name, filtered);
+	users_delete(filtered);
+
+	return count;
+}
+
+/**
+ * Simulate the Bluetooth device file not yet existing.
+ *
+ * @param list The list to load into.
+ * @param filename The file to load from.
+ * @return Always BT_ERR_FILE_NOT_FOUND.
+ */
+static bt_err_t test_bt_list_load(bt_device_list_t * list, const char * filename) {
+	return BT_ERR_FILE_NOT_FOUND;
+}
+
+START_TEST(test_usersjournal_refresh) {
+	UsersJournal * writer;
+	UsersJournal * reader;
+	Buffer * configdir;
+
+	configdir = test_make_configdir();
+	writer = usersjournal_new();
+	usersjournal_set_configdir(writer, buffer_get_buffer(configdir));
+	reader = usersjournal_new();
+	usersjournal_set_configdir(reader, buffer_get_buffer(configdir));
+
+	// With nothing paired there should be no users
+	usersjournal_refresh(reader);
+	ck_assert_int_eq(test_count_user(usersjournal_get_users(reader), "alice"), 0);
+	ck_assert_int_eq(usersjournal_get_pending(reader), 0);
+
+	test_append_user(writer, "alice");
+	test_append_user(writer, "bob");
+	ck_assert(usersjournal_append_device(writer, TEST_ADDRESS) == TRUE);
+
+	usersjournal_refresh(reader);
+	ck_assert_int_eq(test_count_user(usersjournal_get_users(reader), "alice"), 1);
+	ck_assert_int_eq(test_count_user(usersjournal_get_users(reader), "bob"), 1);
+	ck_assert_int_eq(usersjournal_get_pending(reader), 3);
+	ck_assert_int_eq(usersjournal_get_devices(reader), 1);
+	ck_assert_int_eq(g_slist_length((GSList *)usersjournal_get_device_list(reader)), 1);
+	ck_assert_str_eq(usersjournal_get_device_list(reader)->data, TEST_ADDRESS);
+
+	// Only the new record should be read by the next refresh
+	test_append_user(writer, "alice");
+	usersjournal_refresh(reader);
+	ck_assert_int_eq(test_count_user(usersjournal_get_users(reader), "alice"), 2);
+	ck_assert_int_eq(test_count_user(usersjournal_get_users(reader), "bob"), 1);
+	ck_assert_int_eq(usersjournal_get_pending(reader), 4);
+	ck_assert_int_eq(g_slist_length((GSList *)usersjournal_get_device_list(reader)), 1);
+
+	usersjournal_delete(reader);
+	usersjournal_delete(writer);
+	test_remove_configdir(configdir);
+}
+END_TEST
+
+START_TEST(test_usersjournal_corrupt) {
+	UsersJournal * usersjournal;
+	Buffer * configdir;
+	gchar * filename;
+	FILE * file;
+
+	configdir = test_make_configdir();
+	usersjournal = usersjournal_new();
+	usersjournal_set_configdir(usersjournal, buffer_get_buffer(configdir));
+
+	test_append_user(usersjournal, "alice");
+
+	// A record with the wrong checksum, then one that was only partly written
+	filename = g_strconcat(buffer_get_buffer(configdir), USERS_JOURNAL_FILE, NULL);
+	file = fopen(filename, "a");
+	ck_assert(file != NULL);
+	fputs("0000000000000000 {\"type\":\"device\",\"address\":\"" TEST_ADDRESS "\"}\n", file);
+	fputs("0123", file);
+	fclose(file);
+	g_free(filename);
+
+	usersjournal_refresh(usersjournal);
+	ck_assert_int_eq(test_count_user(usersjournal_get_users(usersjournal), "alice"), 1);
+	ck_assert_int_eq(usersjournal_get_pending(usersjournal), 1);
+	ck_assert_int_eq(usersjournal_get_devices(usersjournal), 0);
+
+	usersjournal_delete(usersjournal);
+	test_remove_configdir(configdir);
+}
+END_TEST
+
+START_TEST(test_usersjournal_commit) {
+	UsersJournal * writer;
+	UsersJournal * reader;
+	Buffer * configdir;
+	KeyPair * keypair;
+	Buffer * symmetrickey;
+	bool result;
+
+	configdir = test_make_configdir();
+	writer = usersjournal_new();
+	usersjournal_set_configdir(writer, buffer_get_buffer(configdir));
+	reader = usersjournal_new();
+	usersjournal_set_configdir(reader, buffer_get_buffer(configdir));
+
+	keypair = keypair_new();
+	keypair_generate(keypair);
+	symmetrickey = buffer_new(0);
+	buffer_append_string(symmetrickey, "0123456789abcdef");
+
+	result = usersjournal_queue_user(writer, "alice", keypair_getpublickey(keypair), symmetrickey);
+	ck_assert(result == TRUE);
+	result = usersjournal_queue_user(writer, "bob", keypair_getpublickey(keypair), symmetrickey);
+	ck_assert(result == TRUE);
+	usersjournal_queue_device(writer, TEST_ADDRESS);
+
+	// Nothing should be visible until the batch is committed
+	usersjournal_refresh(reader);
+	ck_assert_int_eq(usersjournal_get_pending(reader), 0);
+
+	result = usersjournal_commit(writer);
+	ck_assert(result == TRUE);
+	usersjournal_refresh(reader);
+	ck_assert_int_eq(test_count_user(usersjournal_get_users(reader), "alice"), 1);
+	ck_assert_int_eq(test_count_user(usersjournal_get_users(reader), "bob"), 1);
+	ck_assert_int_eq(usersjournal_get_pending(reader), 3);
+
+	// Committing again shouldn't write the records twice
+	result = usersjournal_commit(writer);
+	ck_assert(result == TRUE);
+	usersjournal_refresh(reader);
+	ck_assert_int_eq(usersjournal_get_pending(reader), 3);
+
+	buffer_delete(symmetrickey);
+	keypair_delete(keypair);
+	usersjournal_delete(reader);
+	usersjournal_delete(writer);
+	test_remove_configdir(configdir);
+}
+END_TEST
+
+START_TEST(test_usersjournal_compact) {
+	UsersJournal * usersjournal;
+	Buffer * configdir;
+	Users * users;
+	gchar * filename;
+	bool result;
+
+	bt_funcs.bt_list_load = test_bt_list_load;
+
+	configdir = test_make_configdir();
+	usersjournal = usersjournal_new();
+	usersjournal_set_configdir(usersjournal, buffer_get_buffer(configdir));
+
+	// Compacting an empty journal does nothing
+	result = usersjournal_compact(usersjournal);
+	ck_assert(result == TRUE);
+
+	test_append_user(usersjournal, "alice");
+	ck_assert(usersjournal_append_device(usersjournal, TEST_ADDRESS) == TRUE);
+	usersjournal_refresh(usersjournal);
+	ck_assert_int_eq(usersjournal_get_pending(usersjournal), 2);
+
+	result = usersjournal_compact(usersjournal);
+	ck_assert(result == TRUE);
+
+	// The records should now be in the users and device files
+	filename = g_strconcat(buffer_get_buffer(configdir), "users.txt", NULL);
+	ck_assert(g_file_test(filename, G_FILE_TEST_EXISTS) == TRUE);
+	g_free(filename);
+	filename = g_strconcat(buffer_get_buffer(configdir), "bluetooth.txt", NULL);
+	ck_assert(g_file_test(filename, G_FILE_TEST_EXISTS) == TRUE);
+	g_free(filename);
+
+	// The refresh should notice the replaced files and reload them
+	usersjournal_refresh(usersjournal);
+	ck_assert_int_eq(test_count_user(usersjournal_get_users(usersjournal), "alice"), 1);
+	ck_assert_int_eq(usersjournal_get_pending(usersjournal), 0);
+	ck_assert_int_eq(usersjournal_get_devices(usersjournal), 0);
+	ck_assert(usersjournal_get_device_list(usersjournal) == NULL);
+
+	// Users appended after compaction are read alongside the users file
+	test_append_user(usersjournal, "bob");
+	users = users_new();
+	usersjournal_load(usersjournal, users);
+	ck_assert_int_eq(test_count_user(users, "alice"), 1);
+	ck_assert_int_eq(test_count_user(users, "bob"), 1);
+	users_delete(users);
+
+	usersjournal_delete(usersjournal);
+	test_remove_configdir(configdir);
+}
+END_TEST
+
+START_TEST(test_usersjournal_recover) {
+	UsersJournal * complete;
+	UsersJournal * usersjournal;
+	Buffer * completedir;
+	Buffer * configdir;
+	Users * users;
+	gchar * contents;
+	gsize length;
+	gchar * filename;
+	gchar * journalname;
+	bool result;
+
+	bt_funcs.bt_list_load = test_bt_list_load;
+
+	// Produce the users file a compaction of both users would write
+	completedir = test_make_configdir();
+	complete = usersjournal_new();
+	usersjournal_set_configdir(complete, buffer_get_buffer(completedir));
+	test_append_user(complete, "alice");
+	test_append_user(complete, "bob");
+	ck_assert(usersjournal_compact(complete) == TRUE);
+
+	// Simulate a compaction interrupted just after being committed
+	configdir = test_make_configdir();
+	usersjournal = usersjournal_new();
+	usersjournal_set_configdir(usersjournal, buffer_get_buffer(configdir));
+	test_append_user(usersjournal, "alice");
+	ck_assert(usersjournal_compact(usersjournal) == TRUE);
+	test_append_user(usersjournal, "bob");
+
+	filename = g_strconcat(buffer_get_buffer(completedir), "users.txt", NULL);
+	ck_assert(g_file_get_contents(filename, & contents, & length, NULL) == TRUE);
+	g_free(filename);
+	filename = g_strconcat(buffer_get_buffer(configdir), "users.txt.new", NULL);
+	ck_assert(g_file_set_contents(filename, contents, length, NULL) == TRUE);
+	g_free(filename);
+	g_free(contents);
+
+	filename = g_strconcat(buffer_get_buffer(configdir), USERS_JOURNAL_FILE, NULL);
+	journalname = g_strconcat(buffer_get_buffer(configdir), USERS_JOURNAL_FILE ".folded", NULL);
+	ck_assert(g_rename(filename, journalname) == 0);
+	g_free(filename);
+
+	usersjournal_refresh(usersjournal);
+	ck_assert(usersjournal_get_interrupted(usersjournal) == TRUE);
+
+	// The compaction should be completed without folding bob in again
+	result = usersjournal_compact(usersjournal);
+	ck_assert(result == TRUE);
+	ck_assert(g_file_test(journalname, G_FILE_TEST_EXISTS) == FALSE);
+	g_free(journalname);
+
+	usersjournal_refresh(usersjournal);
+	ck_assert(usersjournal_get_interrupted(usersjournal) == FALSE);
+	users = users_new();
+	usersjournal_load(usersjournal, users);
+	ck_assert_int_eq(test_count_user(users, "alice"), 1);
+	ck_assert_int_eq(test_count_user(users, "bob"), 1);
+	users_delete(users);
+
+	usersjournal_delete(usersjournal);
+	test_remove_configdir(configdir);
+	usersjournal_delete(complete);
+	test_remove_configdir(completedir);
+}
+END_TEST
+
+START_TEST(test_usersjournal_symlink) {
+	UsersJournal * usersjournal;
+	Buffer * configdir;
+	gchar * victim;
+	gchar * filename;
+	gchar * contents;
+	struct stat status;
+	bool result;
+
+	bt_funcs.bt_list_load = test_bt_list_load;
+
+	configdir = test_make_configdir();
+	usersjournal = usersjournal_new();
+	usersjournal_set_configdir(usersjournal, buffer_get_buffer(configdir));
+
+	// A symlink left where the new users file is written mustn't be followed
+	victim = g_strconcat(buffer_get_buffer(configdir), "victim", NULL);
+	ck_assert(g_file_set_contents(victim, "unchanged", -1, NULL) == TRUE);
+	filename = g_strconcat(buffer_get_buffer(configdir), "users.txt.new", NULL);
+	ck_assert(symlink(victim, filename) == 0);
+	g_free(filename);
+
+	test_append_user(usersjournal, "alice");
+	result = usersjournal_compact(usersjournal);
+	ck_assert(result == TRUE);
+
+	ck_assert(g_file_get_contents(victim, & contents, NULL, NULL) == TRUE);
+	ck_assert_str_eq(contents, "unchanged");
+	g_free(contents);
+	g_free(victim);
+
+	// The users file holds secrets, so only the owner can read it
+	filename = g_strconcat(buffer_get_buffer(configdir), "users.txt", NULL);
+	ck_assert(lstat(filename, & status) == 0);
+	ck_assert(S_ISREG(status.st_mode));
+	ck_assert_int_eq(status.st_mode & 0777, S_IRUSR | S_IWUSR);
+	g_free(filename);
+
+	usersjournal_delete(usersjournal);
+	test_remove_configdir(configdir);
+}
+END_TEST
+
+int main (void) {
+	int number_failed;
+	Suite * s;
+	SRunner *sr;
+	TCase * tc;
+
+	s = suite_create("Pico Users Journal");
+
+	// Users journal test case
+	tc = tcase_create("UsersJournal");
+	tcase_set_timeout(tc, 20.0);
+	tcase_add_test(tc, test_usersjournal_refresh);
+	tcase_add_test(tc, test_usersjournal_corrupt);
+	tcase_add_test(tc, test_usersjournal_commit);
+	tcase_add_test(tc, test_usersjournal_compact);
+	tcase_add_test(tc, test_usersjournal_recover);
+	tcase_add_test(tc, test_usersjournal_symlink);
+
+	suite_add_tcase(s, tc);
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+
+	return (number_failed == 0) ? 0 : -1;
+}
+
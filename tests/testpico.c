@@ -0,0 +1,855 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Simulated Pico for tests and benchmarks
+ * @section DESCRIPTION
+ *
+ * Runs the Pico side of an authentication against a real Service. See
+ * testpico.h for details.
+ *
+ * The simulated Pico and the main loop talk over a pair of pipes. The
+ * Pico writes a byte to the events pipe each time it reaches a new stage,
+ * which a watch on the main loop reads to update the state the tests
+ * check. The main loop writes a byte to the commands pipe to let the Pico
+ * carry on from midway or drop its connection. Each side only touches its
+ * own fields of the structure, so nothing else needs to be shared. This
+ * also allows the Pico to run in a child process rather than a thread.
+ *
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include <gio/gio.h>
+#include "pico/pico.h"
+#include "pico/buffer.h"
+#include "pico/shared.h"
+#include "pico/channel.h"
+#include "pico/sigmaprover.h"
+#include "pico/cryptosupport.h"
+#include "../src/processstore.h"
+#include "../src/resumption.h"
+#include "testpico.h"
+
+#ifdef TESTPICO_SUPPORTED
+
+// Defines
+
+/**
+ * @brief The length of the prefix on each message sent over TCP
+ */
+#define TESTPICO_LENGTH_PREFIX_SIZE (4)
+
+/**
+ * @brief The nonce the simulated Pico resumes with
+ */
+#define TESTPICO_RESUME_NONCE "picononce1"
+
+/**
+ * @brief Event sent once the Pico has stopped midway
+ */
+#define TESTPICO_EVENT_PAUSED 'p'
+
+/**
+ * @brief Event sent once the Pico has authenticated or resumed
+ */
+#define TESTPICO_EVENT_AUTHENTICATED 'a'
+
+/**
+ * @brief Event sent if the Pico failed to authenticate or resume
+ */
+#define TESTPICO_EVENT_FAILED 'f'
+
+/**
+ * @brief Event sent once the Pico has closed its connection
+ */
+#define TESTPICO_EVENT_DONE 'd'
+
+/**
+ * @brief Command to carry on from midway
+ */
+#define TESTPICO_COMMAND_PROCEED 'c'
+
+/**
+ * @brief Command to drop the connection
+ */
+#define TESTPICO_COMMAND_RELEASE 'r'
+
+// Structure definitions
+
+/**
+ * @brief The state of a simulated Pico
+ *
+ * The paused, finished, result and done values are only set by the main
+ * loop, from the events the Pico sends. The pausedonce and released values
+ * are only used by the Pico.
+ */
+struct _TestPico {
+	TestPicoConnect connect;
+	void * connect_data;
+	char * publicb64;
+	char * privateb64;
+	Buffer * extradata;
+	bool midway;
+	bool resume;
+	Buffer * symmetrickey;
+	Buffer * sessionnonce;
+	bool hold;
+	bool process;
+	char * address;
+	bool running;
+	GThread * thread;
+	pid_t pid;
+	int events[2];
+	int commands[2];
+	guint watchid;
+	bool pausedonce;
+	bool released;
+	bool paused;
+	bool finished;
+	bool result;
+	bool done;
+};
+
+/**
+ * @brief The data for the simulated Pico's TCP channel
+ */
+typedef struct _TestPicoTcp {
+	TestPico * testpico;
+	GSocketConnection * connection;
+} TestPicoTcp;
+
+// Function prototypes
+
+static gpointer testpico_main(gpointer user_data);
+static bool testpico_resume(TestPico * testpico, RVPChannel * channel);
+static void testpico_send(TestPico * testpico, char event);
+static char testpico_receive(TestPico * testpico);
+static gboolean testpico_event(gint fd, GIOCondition condition, gpointer user_data);
+static void testpico_command(TestPico * testpico, char command);
+static bool testpico_tcp_open(RVPChannel * channel);
+static bool testpico_tcp_close(RVPChannel * channel);
+static bool testpico_tcp_write(RVPChannel * channel, char * data, int length);
+static bool testpico_tcp_read(RVPChannel * channel, Buffer * buffer);
+
+// Function definitions
+
+/**
+ * Create a new simulated Pico. By default it connects to a ServiceTcp,
+ * authenticates with the Pico keys from tests/keydir, sends no extra data
+ * and closes its connection as soon as it's authenticated.
+ *
+ * @return The newly created object.
+ */
+TestPico * testpico_new() {
+	TestPico * testpico;
+
+	testpico = CALLOC(sizeof(TestPico), 1);
+	testpico->connect = testpico_connect_tcp;
+	testpico->connect_data = NULL;
+	testpico->publicb64 = NULL;
+	testpico->privateb64 = NULL;
+	testpico->extradata = buffer_new(0);
+	testpico->midway = FALSE;
+	testpico->resume = FALSE;
+	testpico->symmetrickey = buffer_new(0);
+	testpico->sessionnonce = buffer_new(0);
+	testpico->hold = FALSE;
+	testpico->process = FALSE;
+	testpico->address = NULL;
+	testpico->running = FALSE;
+	testpico->thread = NULL;
+	testpico->pid = -1;
+	testpico->events[0] = -1;
+	testpico->events[1] = -1;
+	testpico->commands[0] = -1;
+	testpico->commands[1] = -1;
+	testpico->watchid = 0;
+	testpico->pausedonce = FALSE;
+	testpico->released = FALSE;
+	testpico->paused = FALSE;
+	testpico->finished = FALSE;
+	testpico->result = FALSE;
+	testpico->done = FALSE;
+
+	return testpico;
+}
+
+/**
+ * Delete a simulated Pico, first waiting for it to finish if it was
+ * started.
+ *
+ * @param testpico The object to free.
+ */
+void testpico_delete(TestPico * testpico) {
+	if (testpico) {
+		testpico_finish(testpico);
+
+		g_free(testpico->publicb64);
+		g_free(testpico->privateb64);
+		g_free(testpico->address);
+		buffer_delete(testpico->extradata);
+		buffer_delete(testpico->symmetrickey);
+		buffer_delete(testpico->sessionnonce);
+
+		FREE(testpico);
+	}
+}
+
+/**
+ * Set the function used to connect the simulated Pico to the service.
+ *
+ * @param testpico The object to set the value for.
+ * @param connect The function to connect with, such as
+ *        testpico_connect_tcp() or testpico_connect_rvp().
+ * @param user_data Data to pass to the function.
+ */
+void testpico_set_connect(TestPico * testpico, TestPicoConnect connect, void * user_data) {
+	testpico->connect = connect;
+	testpico->connect_data = user_data;
+}
+
+/**
+ * Set the Pico's identity key pair, rather than using the keys from
+ * tests/keydir. This is needed to authenticate as a user paired with
+ * different keys.
+ *
+ * @param testpico The object to set the value for.
+ * @param publicb64 The public key, as base64-encoded DER.
+ * @param privateb64 The private key, as base64-encoded DER.
+ */
+void testpico_set_keys(TestPico * testpico, char const * publicb64, char const * privateb64) {
+	g_free(testpico->publicb64);
+	g_free(testpico->privateb64);
+	testpico->publicb64 = g_strdup(publicb64);
+	testpico->privateb64 = g_strdup(privateb64);
+}
+
+/**
+ * Set the extra data the Pico sends to the service as part of the
+ * handshake, such as the user's encrypted password.
+ *
+ * @param testpico The object to set the value for.
+ * @param extradata The extra data to send.
+ */
+void testpico_set_extradata(TestPico * testpico, Buffer const * extradata) {
+	buffer_clear(testpico->extradata);
+	buffer_append_buffer(testpico->extradata, extradata);
+}
+
+/**
+ * Set whether the Pico should stop part way through the handshake. If set,
+ * it stops once the first message from the service starts to arrive, by
+ * which point the service is waiting part way through the handshake. It
+ * carries on once testpico_proceed() is called.
+ *
+ * Stopping relies on the Pico's channel calling testpico_midway(), which
+ * the TCP channel does.
+ *
+ * @param testpico The object to set the value for.
+ * @param midway true to stop midway, false o/w.
+ */
+void testpico_set_midway(TestPico * testpico, bool midway) {
+	testpico->midway = midway;
+}
+
+/**
+ * Set the Pico to resume a continuous session, rather than authenticating
+ * with a full handshake. The keys are those the Pico would hold from the
+ * session's handshake.
+ *
+ * @param testpico The object to set the value for.
+ * @param symmetrickey The session's symmetric key.
+ * @param sessionnonce The service nonce from the session's handshake.
+ */
+void testpico_set_resume(TestPico * testpico, Buffer const * symmetrickey, Buffer const * sessionnonce) {
+	testpico->resume = TRUE;
+	buffer_clear(testpico->symmetrickey);
+	buffer_append_buffer(testpico->symmetrickey, symmetrickey);
+	buffer_clear(testpico->sessionnonce);
+	buffer_append_buffer(testpico->sessionnonce, sessionnonce);
+}
+
+/**
+ * Set whether the Pico should hold its connection open once it's
+ * authenticated, so that a continuous session stays continuing. The
+ * connection is closed once testpico_release() is called.
+ *
+ * @param testpico The object to set the value for.
+ * @param hold true to hold the connection open, false o/w.
+ */
+void testpico_set_hold(TestPico * testpico, bool hold) {
+	testpico->hold = hold;
+}
+
+/**
+ * Set whether the Pico should run in a child process rather than a thread.
+ * This keeps the Pico's allocations out of the service's heap, so that
+ * they don't count towards the memory the service is measured as using.
+ *
+ * The child process uses the Pico's own copy of the service's memory, so
+ * the connect function must only use data that was set before the Pico
+ * started.
+ *
+ * @param testpico The object to set the value for.
+ * @param process true to run in a child process, false to run in a thread.
+ */
+void testpico_set_process(TestPico * testpico, bool process) {
+	testpico->process = process;
+}
+
+/**
+ * Start the simulated Pico authenticating to the service with the given
+ * address. This returns straight away; the Pico's progress can be checked
+ * as the main loop runs.
+ *
+ * @param testpico The simulated Pico to start.
+ * @param address The address from the service's invitation.
+ */
+void testpico_start(TestPico * testpico, char const * address) {
+	int result;
+
+	g_free(testpico->address);
+	testpico->address = g_strdup(address);
+	testpico->pausedonce = FALSE;
+	testpico->released = FALSE;
+	testpico->paused = FALSE;
+	testpico->finished = FALSE;
+	testpico->result = FALSE;
+	testpico->done = FALSE;
+
+	result = pipe(testpico->events);
+	if (result == 0) {
+		result = pipe(testpico->commands);
+	}
+
+	if ((result == 0) && testpico->process) {
+		testpico->pid = fork();
+		if (testpico->pid == 0) {
+			// Child process
+			close(testpico->events[0]);
+			close(testpico->commands[1]);
+			testpico_main(testpico);
+			_exit(0);
+		}
+
+		// Closing our copy means the events pipe ends if the child does
+		close(testpico->events[1]);
+		close(testpico->commands[0]);
+		testpico->events[1] = -1;
+		testpico->commands[0] = -1;
+		result = (testpico->pid > 0) ? 0 : -1;
+	}
+	else if (result == 0) {
+		testpico->thread = g_thread_new("pico", testpico_main, testpico);
+	}
+
+	if (result == 0) {
+		testpico->running = TRUE;
+		testpico->watchid = g_unix_fd_add(testpico->events[0], G_IO_IN | G_IO_HUP, testpico_event, testpico);
+	}
+	else {
+		printf("Failed to start the simulated Pico\n");
+		testpico->finished = TRUE;
+		testpico->done = TRUE;
+	}
+}
+
+/**
+ * Let a simulated Pico that stopped midway carry on with the handshake.
+ *
+ * @param testpico The simulated Pico to continue.
+ */
+void testpico_proceed(TestPico * testpico) {
+	testpico->paused = FALSE;
+	testpico_command(testpico, TESTPICO_COMMAND_PROCEED);
+}
+
+/**
+ * Tell a simulated Pico to close its connection, once it's finished
+ * authenticating. A Pico stopped midway carries on first.
+ *
+ * @param testpico The simulated Pico to release.
+ */
+void testpico_release(TestPico * testpico) {
+	testpico_command(testpico, TESTPICO_COMMAND_RELEASE);
+}
+
+/**
+ * Release a simulated Pico and wait for it to finish, running the main
+ * loop in the meantime so that the service can carry on. Nothing happens
+ * if the Pico isn't running.
+ *
+ * @param testpico The simulated Pico to finish.
+ */
+void testpico_finish(TestPico * testpico) {
+	int fd;
+
+	if (testpico->running) {
+		testpico_release(testpico);
+		while (testpico->done == FALSE) {
+			g_main_context_iteration(NULL, TRUE);
+		}
+
+		if (testpico->thread != NULL) {
+			g_thread_join(testpico->thread);
+			testpico->thread = NULL;
+		}
+		if (testpico->pid > 0) {
+			waitpid(testpico->pid, NULL, 0);
+			testpico->pid = -1;
+		}
+		testpico->running = FALSE;
+
+		if (testpico->watchid != 0) {
+			g_source_remove(testpico->watchid);
+			testpico->watchid = 0;
+		}
+		for (fd = 0; fd < 2; fd++) {
+			if (testpico->events[fd] >= 0) {
+				close(testpico->events[fd]);
+				testpico->events[fd] = -1;
+			}
+			if (testpico->commands[fd] >= 0) {
+				close(testpico->commands[fd]);
+				testpico->commands[fd] = -1;
+			}
+		}
+	}
+}
+
+/**
+ * Check whether the Pico has stopped midway.
+ *
+ * @param testpico The object to get the value from.
+ * @return true if the Pico is waiting midway, false o/w.
+ */
+bool testpico_get_paused(TestPico const * testpico) {
+	return testpico->paused;
+}
+
+/**
+ * Check whether the Pico has finished authenticating or resuming, whether
+ * or not it succeeded.
+ *
+ * @param testpico The object to get the value from.
+ * @return true if the Pico has finished authenticating, false o/w.
+ */
+bool testpico_get_finished(TestPico const * testpico) {
+	return testpico->finished;
+}
+
+/**
+ * Get the result of the Pico authenticating or resuming. This is only
+ * valid once testpico_get_finished() returns true.
+ *
+ * @param testpico The object to get the value from.
+ * @return true if the Pico authenticated or resumed successfully, false
+ *         o/w.
+ */
+bool testpico_get_result(TestPico const * testpico) {
+	return testpico->result;
+}
+
+/**
+ * Check whether the Pico has closed its connection.
+ *
+ * @param testpico The object to get the value from.
+ * @return true if the Pico has closed its connection, false o/w.
+ */
+bool testpico_get_done(TestPico const * testpico) {
+	return testpico->done;
+}
+
+/**
+ * Called by the Pico's channel once the first message from the service
+ * starts to arrive. If the Pico is set to stop midway, this tells the main
+ * loop and waits for testpico_proceed() to be called. Otherwise it does
+ * nothing.
+ *
+ * This must only be called from the simulated Pico's thread or process.
+ *
+ * @param testpico The simulated Pico the channel belongs to.
+ */
+void testpico_midway(TestPico * testpico) {
+	if (testpico->midway && (testpico->pausedonce == FALSE)) {
+		testpico->pausedonce = TRUE;
+		testpico_send(testpico, TESTPICO_EVENT_PAUSED);
+		if (testpico->released == FALSE) {
+			testpico_receive(testpico);
+		}
+	}
+}
+
+/**
+ * Runs the simulated Pico, in its own thread or process. It connects, authenticates or
+ * resumes, optionally holds the connection open until it's released, then
+ * closes it.
+ *
+ * @param user_data The TestPico, cast to (gpointer).
+ * @return Always returns NULL.
+ */
+static gpointer testpico_main(gpointer user_data) {
+	TestPico * testpico = (TestPico *)user_data;
+	Shared * shared;
+	RVPChannel * channel;
+	Buffer * returnedextradata;
+	bool result;
+
+	channel = testpico->connect(testpico, testpico->address, testpico->connect_data);
+
+	if (testpico->resume) {
+		result = testpico_resume(testpico, channel);
+	}
+	else {
+		shared = shared_new();
+		if ((testpico->publicb64 != NULL) && (testpico->privateb64 != NULL)) {
+			shared_set_pico_identity_public_key(shared, cryptosupport_read_base64_string_public_key(testpico->publicb64));
+			shared_set_pico_identity_private_key(shared, cryptosupport_read_base64_string_private_key(testpico->privateb64));
+		}
+		else {
+			shared_load_or_generate_pico_keys(shared, "tests/keydir/" PUB_FILE, "tests/keydir/" PRIV_FILE);
+		}
+		returnedextradata = buffer_new(0);
+
+		result = sigmaprover(shared, channel, testpico->extradata, returnedextradata);
+
+		buffer_delete(returnedextradata);
+		shared_delete(shared);
+	}
+
+	testpico_send(testpico, result ? TESTPICO_EVENT_AUTHENTICATED : TESTPICO_EVENT_FAILED);
+
+	if (testpico->hold) {
+		while (testpico->released == FALSE) {
+			testpico_receive(testpico);
+		}
+	}
+
+	// Closing the channel drops the link
+	channel_delete(channel);
+
+	testpico_send(testpico, TESTPICO_EVENT_DONE);
+
+	return NULL;
+}
+
+/**
+ * Resume the session over a fresh connection, as a Pico would after its
+ * link dropped, and check the service's reply.
+ *
+ * @param testpico The simulated Pico, holding the session's keys.
+ * @param channel The channel to resume over.
+ * @return true if the service accepted the resumption and proved it holds
+ *         the key, false o/w.
+ */
+static bool testpico_resume(TestPico * testpico, RVPChannel * channel) {
+	Buffer * message;
+	bool result;
+
+	message = buffer_new(0);
+	resumption_prove(testpico->symmetrickey, testpico->sessionnonce, TESTPICO_RESUME_NONCE, message);
+	result = channel_write(channel, buffer_get_buffer(message), buffer_get_pos(message));
+	if (result) {
+		result = channel_read(channel, message);
+	}
+	if (result) {
+		result = resumption_check_reply(testpico->symmetrickey, testpico->sessionnonce, TESTPICO_RESUME_NONCE, buffer_get_buffer(message), buffer_get_pos(message));
+	}
+	buffer_delete(message);
+
+	return result;
+}
+
+/**
+ * Send an event from the simulated Pico to the main loop.
+ *
+ * @param testpico The simulated Pico sending the event.
+ * @param event The event to send.
+ */
+static void testpico_send(TestPico * testpico, char event) {
+	if (write(testpico->events[1], & event, 1) != 1) {
+		printf("Failed to send event from the simulated Pico\n");
+	}
+}
+
+/**
+ * Wait for the next command from the main loop. If the commands pipe is
+ * closed, the Pico is treated as having been released.
+ *
+ * @param testpico The simulated Pico receiving the command.
+ * @return The command received.
+ */
+static char testpico_receive(TestPico * testpico) {
+	char command;
+
+	if (read(testpico->commands[0], & command, 1) != 1) {
+		command = TESTPICO_COMMAND_RELEASE;
+	}
+	if (command == TESTPICO_COMMAND_RELEASE) {
+		testpico->released = TRUE;
+	}
+
+	return command;
+}
+
+/**
+ * Internal callback on the main loop for events from the simulated Pico.
+ *
+ * @param fd The read end of the events pipe.
+ * @param condition The condition that triggered the callback.
+ * @param user_data The TestPico, cast to (gpointer).
+ * @return G_SOURCE_CONTINUE until the Pico is done, G_SOURCE_REMOVE then.
+ */
+static gboolean testpico_event(gint fd, GIOCondition condition, gpointer user_data) {
+	TestPico * testpico = (TestPico *)user_data;
+	char event;
+	gboolean keep;
+
+	keep = G_SOURCE_CONTINUE;
+	if (read(fd, & event, 1) != 1) {
+		event = TESTPICO_EVENT_DONE;
+	}
+
+	switch (event) {
+	case TESTPICO_EVENT_PAUSED:
+		testpico->paused = TRUE;
+		break;
+	case TESTPICO_EVENT_AUTHENTICATED:
+		testpico->paused = FALSE;
+		testpico->finished = TRUE;
+		testpico->result = TRUE;
+		break;
+	case TESTPICO_EVENT_FAILED:
+		testpico->paused = FALSE;
+		testpico->finished = TRUE;
+		testpico->result = FALSE;
+		break;
+	default:
+		testpico->finished = TRUE;
+		testpico->done = TRUE;
+		testpico->watchid = 0;
+		keep = G_SOURCE_REMOVE;
+		break;
+	}
+
+	return keep;
+}
+
+/**
+ * Send a command from the main loop to the simulated Pico. Nothing is sent
+ * if the Pico isn't running.
+ *
+ * @param testpico The simulated Pico to send the command to.
+ * @param command The command to send.
+ */
+static void testpico_command(TestPico * testpico, char command) {
+	if (testpico->running && (testpico->done == FALSE)) {
+		if (write(testpico->commands[1], & command, 1) != 1) {
+			printf("Failed to send command to the simulated Pico\n");
+		}
+	}
+}
+
+/**
+ * Connect the simulated Pico to a ServiceTcp, given a tcp://host:port/token
+ * address, and present the token. This is the default connect function.
+ *
+ * @param testpico The simulated Pico connecting.
+ * @param address The address from the invitation.
+ * @param user_data Not used.
+ * @return The channel for the simulated Pico to use.
+ */
+RVPChannel * testpico_connect_tcp(TestPico * testpico, char const * address, void * user_data) {
+	RVPChannel * channel;
+	TestPicoTcp * tcp;
+	GSocketClient * client;
+	gchar ** parts;
+
+	tcp = CALLOC(sizeof(TestPicoTcp), 1);
+	tcp->testpico = testpico;
+	tcp->connection = NULL;
+
+	channel = channel_new();
+	channel_set_functions(channel, testpico_tcp_open, testpico_tcp_close, testpico_tcp_write, testpico_tcp_read, NULL, NULL, NULL);
+	channel_set_data(channel, tcp);
+
+	// Split "tcp://host:port/token" into "host:port" and "token"
+	parts = g_strsplit(address + strlen("tcp://"), "/", 2);
+	client = g_socket_client_new();
+	tcp->connection = g_socket_client_connect_to_host(client, parts[0], 0, NULL, NULL);
+	g_object_unref(client);
+
+	if (tcp->connection != NULL) {
+		g_socket_set_option(g_socket_connection_get_socket(tcp->connection), IPPROTO_TCP, TCP_NODELAY, 1, NULL);
+		if ((parts[1] == NULL) || (testpico_tcp_write(channel, parts[1], strlen(parts[1])) == FALSE)) {
+			printf("Failed to send token to %s\n", address);
+		}
+	}
+	else {
+		printf("Failed to connect to %s\n", address);
+	}
+
+	g_strfreev(parts);
+
+	return channel;
+}
+
+/**
+ * Connect the simulated Pico to a ServiceRvp, given the channel URL from the
+ * invitation. This needs a Rendezvous Point to relay through.
+ *
+ * @param testpico The simulated Pico connecting.
+ * @param address The address from the invitation.
+ * @param user_data Not used.
+ * @return The channel for the simulated Pico to use.
+ */
+RVPChannel * testpico_connect_rvp(TestPico * testpico, char const * address, void * user_data) {
+	char const * name;
+
+	name = strrchr(address, '/') + 1;
+
+	return channel_connect(name);
+}
+
+/**
+ * Channel function for the simulated Pico's TCP channel. The connection is
+ * made by testpico_connect_tcp(), so there's nothing to do here.
+ *
+ * @param channel The channel to open.
+ * @return Always returns true.
+ */
+static bool testpico_tcp_open(RVPChannel * channel) {
+	return TRUE;
+}
+
+/**
+ * Channel function to close the simulated Pico's TCP channel.
+ *
+ * @param channel The channel to close.
+ * @return true if the connection closed cleanly, false o/w.
+ */
+static bool testpico_tcp_close(RVPChannel * channel) {
+	TestPicoTcp * tcp;
+	bool result;
+
+	result = FALSE;
+	tcp = (TestPicoTcp *)channel_get_data(channel);
+	if (tcp != NULL) {
+		if (tcp->connection != NULL) {
+			result = g_io_stream_close(G_IO_STREAM(tcp->connection), NULL, NULL);
+			g_object_unref(tcp->connection);
+		}
+		FREE(tcp);
+		channel_set_data(channel, NULL);
+	}
+
+	return result;
+}
+
+/**
+ * Channel function to send a message from the simulated Pico, using the
+ * same length-prepended framing as the service.
+ *
+ * @param channel The channel to write to.
+ * @param data The message to send.
+ * @param length The length of the message.
+ * @return true if the message was sent, false o/w.
+ */
+static bool testpico_tcp_write(RVPChannel * channel, char * data, int length) {
+	TestPicoTcp * tcp;
+	GOutputStream * output;
+	Buffer * message;
+	bool result;
+
+	result = FALSE;
+	tcp = (TestPicoTcp *)channel_get_data(channel);
+	if ((tcp != NULL) && (tcp->connection != NULL)) {
+		output = g_io_stream_get_output_stream(G_IO_STREAM(tcp->connection));
+
+		message = buffer_new(0);
+		buffer_append_lengthprepend(message, data, length);
+		result = g_output_stream_write_all(output, buffer_get_buffer(message), buffer_get_pos(message), NULL, NULL, NULL);
+		buffer_delete(message);
+	}
+
+	return result;
+}
+
+/**
+ * Channel function to receive a message for the simulated Pico, blocking
+ * until a complete message has arrived.
+ *
+ * The first time a message starts to arrive the Pico may stop midway, by
+ * which point the service is part way through the handshake.
+ *
+ * @param channel The channel to read from.
+ * @param buffer A buffer to store the message in, without its prefix.
+ * @return true if a message was received, false o/w.
+ */
+static bool testpico_tcp_read(RVPChannel * channel, Buffer * buffer) {
+	TestPicoTcp * tcp;
+	GInputStream * input;
+	unsigned char prefix[TESTPICO_LENGTH_PREFIX_SIZE];
+	char * data;
+	size_t length;
+	gsize received;
+	bool result;
+
+	result = FALSE;
+	tcp = (TestPicoTcp *)channel_get_data(channel);
+	if ((tcp != NULL) && (tcp->connection != NULL)) {
+		input = g_io_stream_get_input_stream(G_IO_STREAM(tcp->connection));
+
+		result = g_input_stream_read_all(input, prefix, TESTPICO_LENGTH_PREFIX_SIZE, & received, NULL, NULL);
+		result = result && (received == TESTPICO_LENGTH_PREFIX_SIZE);
+		if (result) {
+			testpico_midway(tcp->testpico);
+
+			length = ((size_t)prefix[0] << 24) | ((size_t)prefix[1] << 16) | ((size_t)prefix[2] << 8) | (size_t)prefix[3];
+			data = g_malloc(length);
+			result = g_input_stream_read_all(input, data, length, & received, NULL, NULL);
+			result = result && (received == length);
+			buffer_clear(buffer);
+			buffer_append(buffer, data, length);
+			g_free(data);
+		}
+	}
+
+	return result;
+}
+
+#endif
+
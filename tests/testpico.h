@@ -0,0 +1,115 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <David.Llewellyn-Jones@cl.cam.ac.uk>
+ * @version $(VERSION)
+ *
+ * @section LICENSE
+ *
+ * (C) Copyright Cambridge Authentication Ltd, 2017
+ *
+ * This file is part of pam_pico.
+ *
+ * pam_pico is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * pam_pico is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with pam_pico. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ *
+ * @brief Simulated Pico for tests and benchmarks
+ * @section DESCRIPTION
+ *
+ * Runs the Pico side of an authentication against a real Service, so that
+ * sessions can be driven end-to-end without a phone. The simulated Pico
+ * runs in its own thread, connects to the address from the service's
+ * invitation and performs the sigma handshake. Alternatively it can resume
+ * a continuous session using keys taken from an earlier handshake.
+ *
+ * By default it connects directly to a ServiceTcp over loopback. Other
+ * channels can be used by setting a connect function, which is given the
+ * address from the invitation and returns the channel for the Pico to use.
+ *
+ * The simulated Pico can be told to stop part way through the handshake
+ * (midway), and to hold its connection open once it's authenticated until
+ * it's released, so that sessions can be examined at those points. It
+ * reports its progress through the main loop, so that its state can be
+ * checked from the main loop's thread while the service runs. It can also
+ * run in a child process, to keep its memory apart from the service's.
+ *
+ * The helper needs libpico to allow channels to be given their own
+ * transport, so is only built if it does.
+ *
+ */
+
+#ifndef __TESTPICO_H
+#define __TESTPICO_H (1)
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <glib.h>
+#include "pico/buffer.h"
+#include "pico/channel.h"
+
+// Defines
+
+/**
+ * @brief Whether libpico allows the simulated Pico's channels
+ */
+#if defined(HAVE_CHANNEL_SET_FUNCTIONS) && defined(HAVE_CHANNEL_SET_DATA) && defined(HAVE_CHANNEL_GET_DATA)
+#define TESTPICO_SUPPORTED (1)
+#endif
+
+// Structure definitions
+
+/**
+ * The internal structure can be found in testpico.c
+ */
+typedef struct _TestPico TestPico;
+
+/**
+ * @brief Function to connect the simulated Pico to a service
+ *
+ * Called from the simulated Pico's thread with the address from the
+ * service's invitation. The channel returned is deleted by the simulated
+ * Pico once it's finished.
+ */
+typedef RVPChannel * (*TestPicoConnect)(TestPico * testpico, char const * address, void * user_data);
+
+// Function prototypes
+
+#ifdef TESTPICO_SUPPORTED
+TestPico * testpico_new();
+void testpico_delete(TestPico * testpico);
+void testpico_set_connect(TestPico * testpico, TestPicoConnect connect, void * user_data);
+void testpico_set_keys(TestPico * testpico, char const * publicb64, char const * privateb64);
+void testpico_set_extradata(TestPico * testpico, Buffer const * extradata);
+void testpico_set_midway(TestPico * testpico, bool midway);
+void testpico_set_resume(TestPico * testpico, Buffer const * symmetrickey, Buffer const * sessionnonce);
+void testpico_set_hold(TestPico * testpico, bool hold);
+void testpico_set_process(TestPico * testpico, bool process);
+void testpico_start(TestPico * testpico, char const * address);
+void testpico_proceed(TestPico * testpico);
+void testpico_release(TestPico * testpico);
+void testpico_finish(TestPico * testpico);
+bool testpico_get_paused(TestPico const * testpico);
+bool testpico_get_finished(TestPico const * testpico);
+bool testpico_get_result(TestPico const * testpico);
+bool testpico_get_done(TestPico const * testpico);
+void testpico_midway(TestPico * testpico);
+RVPChannel * testpico_connect_tcp(TestPico * testpico, char const * address, void * user_data);
+RVPChannel * testpico_connect_rvp(TestPico * testpico, char const * address, void * user_data);
+#endif
+
+// Function definitions
+
+#endif
+